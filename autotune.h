@@ -0,0 +1,241 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Warm-up tuning of the throughput settings of the training binaries, like
+ * the loader workers, the prefetch depth and the thread split. A setting is a
+ * knob with a list of candidate values. The knobs are tuned one by one in
+ * their order, with the other knobs fixed to their best values so far, so the
+ * number of trials is the sum and not the product of the candidates. Trials
+ * over the memory limit or which throw are rejected. The best settings are
+ * kept in a text file of the host, under a signature of what they depend on,
+ * like the GPU count and the image size, so the next run skips the trials.
+ */
+namespace utils {
+
+using TuneSettings = std::map<std::string, uint32_t>;
+
+struct TuneKnob {
+  std::string name;
+  std::vector<uint32_t> candidates;
+};
+
+// Throughput of a trial, higher is better, and its peak memory in bytes.
+// When the memory is a high watermark of the process, which never goes down,
+// memory_before is the watermark before the trial, and the trial is only over
+// the limit when it raised the watermark over it.
+struct TuneTrial {
+  double rate{0};
+  int64_t memory{0};
+  int64_t memory_before{0};
+};
+
+// "name=value name=value"
+inline std::string TuneSettingsString(const TuneSettings& settings) {
+  std::string text;
+  for (const auto& setting : settings) {
+    if (!text.empty())
+      text += ' ';
+    text += setting.first + '=' + std::to_string(setting.second);
+  }
+  return text;
+}
+
+inline TuneSettings ParseTuneSettings(const std::string& text) {
+  TuneSettings settings;
+  std::istringstream items(text);
+  std::string item;
+  while (items >> item) {
+    auto pos = item.find('=');
+    if (pos == std::string::npos || pos == 0)
+      throw std::invalid_argument("Wrong tuning setting " + item);
+    settings[item.substr(0, pos)] =
+        static_cast<uint32_t>(std::stoul(item.substr(pos + 1)));
+  }
+  return settings;
+}
+
+// The values from 1 to max, sorted and without duplicates
+inline std::vector<uint32_t> TuneCandidates(std::vector<uint32_t> values,
+                                            uint32_t max) {
+  values.erase(std::remove_if(values.begin(), values.end(),
+                              [max](uint32_t v) { return v == 0 || v > max; }),
+               values.end());
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+  return values;
+}
+
+class AutoTuner {
+ public:
+  using Measure = std::function<TuneTrial(const TuneSettings&)>;
+
+  // memory_limit 0 is no limit
+  explicit AutoTuner(std::vector<TuneKnob> knobs, int64_t memory_limit = 0)
+      : knobs_(std::move(knobs)), memory_limit_(memory_limit) {}
+
+  // Best settings found from start, start is measured first and is returned
+  // when all trials are rejected
+  TuneSettings Tune(TuneSettings start, const Measure& measure) {
+    trials_num_ = 0;
+    best_rate_ = Try(start, measure);
+    for (const auto& knob : knobs_) {
+      auto best = start;
+      for (auto value : knob.candidates) {
+        auto current = start.find(knob.name);
+        if (current != start.end() && current->second == value)
+          continue;
+        auto settings = start;
+        settings[knob.name] = value;
+        auto rate = Try(settings, measure);
+        if (rate > best_rate_) {
+          best_rate_ = rate;
+          best = std::move(settings);
+        }
+      }
+      start = std::move(best);
+    }
+    return start;
+  }
+
+  size_t TrialsNum() const { return trials_num_; }
+  double BestRate() const { return best_rate_; }
+
+ private:
+  // Rate of the trial, 0 if it's rejected
+  double Try(const TuneSettings& settings, const Measure& measure) {
+    ++trials_num_;
+    TuneTrial trial;
+    try {
+      trial = measure(settings);
+    } catch (const std::exception& err) {
+      std::cout << "Tuning trial " << TuneSettingsString(settings)
+                << " failed : " << err.what() << std::endl;
+      return 0;
+    }
+    const bool over_limit = memory_limit_ > 0 &&
+                            trial.memory > memory_limit_ &&
+                            trial.memory > trial.memory_before;
+    std::cout << "Tuning trial " << TuneSettingsString(settings) << " : "
+              << trial.rate << (over_limit ? " over the memory limit" : "")
+              << std::endl;
+    return over_limit ? 0 : trial.rate;
+  }
+
+  std::vector<TuneKnob> knobs_;
+  int64_t memory_limit_{0};
+  size_t trials_num_{0};
+  double best_rate_{0};
+};
+
+// dir/autotune-<host name>.txt, the MLCPP_CACHE_DIR environment variable
+// overrides dir, so the settings are shared by the samples
+inline std::string TuneFile(const std::string& dir) {
+  const char* env = std::getenv("MLCPP_CACHE_DIR");
+  std::string base = env != nullptr && *env != '\0' ? env : dir;
+  char host[256] = {};
+  if (gethostname(host, sizeof(host) - 1) != 0 || host[0] == '\0')
+    std::snprintf(host, sizeof(host), "localhost");
+  return (base.empty() ? std::string(".") : base) + "/autotune-" + host +
+         ".txt";
+}
+
+// Lines of the file are "signature<tab>settings"
+inline std::vector<std::pair<std::string, std::string>> ReadTuneLines(
+    const std::string& file_name) {
+  std::vector<std::pair<std::string, std::string>> lines;
+  std::ifstream file(file_name);
+  std::string line;
+  while (std::getline(file, line)) {
+    auto pos = line.find('\t');
+    if (pos != std::string::npos)
+      lines.emplace_back(line.substr(0, pos), line.substr(pos + 1));
+  }
+  return lines;
+}
+
+// Settings saved for the signature, false if there are none
+inline bool LoadTuneSettings(const std::string& file_name,
+                             const std::string& signature,
+                             TuneSettings& settings) {
+  for (const auto& line : ReadTuneLines(file_name)) {
+    if (line.first == signature) {
+      settings = ParseTuneSettings(line.second);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Replaces the settings of the signature and keeps the other ones, the file
+// is renamed over the old one, so a reader never sees a partial file
+inline void SaveTuneSettings(const std::string& file_name,
+                             const std::string& signature,
+                             const TuneSettings& settings) {
+  if (signature.find_first_of("\t\n") != std::string::npos)
+    throw std::invalid_argument("Wrong tuning signature " + signature);
+  auto lines = ReadTuneLines(file_name);
+  bool replaced = false;
+  for (auto& line : lines) {
+    if (line.first == signature) {
+      line.second = TuneSettingsString(settings);
+      replaced = true;
+    }
+  }
+  if (!replaced)
+    lines.emplace_back(signature, TuneSettingsString(settings));
+
+  const auto part_name = file_name + ".part";
+  {
+    std::ofstream file(part_name);
+    for (const auto& line : lines)
+      file << line.first << '\t' << line.second << '\n';
+    if (!file)
+      throw std::runtime_error(part_name + " file can't be written");
+  }
+  if (std::rename(part_name.c_str(), file_name.c_str()) != 0)
+    throw std::runtime_error(file_name + " file can't be written");
+}
+
+// Settings of the signature saved in file_name or, when there are none or
+// retune is set, the ones tuned from start, which are saved for the next runs
+inline TuneSettings LoadOrTune(const std::string& file_name,
+                               const std::string& signature,
+                               bool retune,
+                               AutoTuner& tuner,
+                               const TuneSettings& start,
+                               const AutoTuner::Measure& measure) {
+  TuneSettings settings;
+  if (!retune && LoadTuneSettings(file_name, signature, settings)) {
+    std::cout << "Tuned settings from " << file_name << " : "
+              << TuneSettingsString(settings) << std::endl;
+    return settings;
+  }
+  settings = tuner.Tune(start, measure);
+  std::cout << "Tuned settings after " << tuner.TrialsNum()
+            << " trials : " << TuneSettingsString(settings) << " rate "
+            << tuner.BestRate() << std::endl;
+  SaveTuneSettings(file_name, signature, settings);
+  return settings;
+}
+
+}  // namespace utils
+
+#endif  // AUTOTUNE_H
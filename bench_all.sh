@@ -0,0 +1,112 @@
+#!/bin/sh
+# End to end performance suite of the samples on fixed seeded inputs: the
+# polynomial fits, the classifiers, the Mask R-CNN detection and training and
+# the Faster R-CNN training and demo. All results are JSON lines of one file
+# (see perfstats.h), with BASELINE they are checked against the stored
+# baseline by bench_compare.sh. The samples are expected to be built in their
+# build folders, the ones which aren't built are skipped.
+#
+# usage: bench_all.sh [output.jsonl]
+# environment: BUILD_DIR, BASELINE, TOLERANCE,
+#   REGRESSION_SIZES, CLASSIFICATION_SIZES, CLASSIFICATION_FEATURES,
+#   GBENCH_ARGS (options of the Google Benchmark binaries),
+#   COCO_PATH and RCNN_PARAMS (Faster R-CNN training on the COCO dataset and
+#   the pretrained resnet parameters), RCNN_MODEL and BENCH_IMAGE (Faster
+#   R-CNN demo with the trained parameters)
+
+OUTPUT=${1:-bench_all.jsonl}
+BUILD_DIR=${BUILD_DIR:-build}
+GBENCH_ARGS=${GBENCH_ARGS:-"--benchmark_repetitions=3 \
+--benchmark_report_aggregates_only=true"}
+ROOT=$(cd "$(dirname "$0")" && pwd)
+export BUILD_DIR
+
+: > "$OUTPUT" || exit 1
+
+# Google Benchmark CSV to the JSON lines of the suite: the case is the
+# benchmark name, ms is the real time and the counters keep their names. Of
+# the aggregates of the repetitions only the medians are kept. Every case runs
+# in its own process, so the peak memory counters are the ones of the case
+# and not of the cases before it.
+gbench() {
+  suite=$1
+  shift
+  if [ ! -x "$1" ]; then
+    return 0
+  fi
+  cases=$("$@" --benchmark_list_tests=true) || return 1
+  : > "$OUTPUT.csv"
+  for case in $cases; do
+    "$@" $GBENCH_ARGS --benchmark_filter="^$case\$" \
+      --benchmark_format=csv >> "$OUTPUT.csv" || return 1
+  done
+  awk -F, -v suite="$suite" '
+    BEGIN {
+      split("name iterations real_time cpu_time time_unit bytes_per_second " \
+            "items_per_second label error_occurred error_message", names, " ")
+      for (i in names)
+        fixed[names[i]] = 1
+    }
+    /^name,/ {
+      for (i = 1; i <= NF; ++i) {
+        column = $i
+        gsub(/"/, "", column)
+        header[i] = column
+      }
+      columns = NF
+      next
+    }
+    columns == 0 { next }
+    {
+      split("", value)
+      for (i = 1; i <= columns; ++i) {
+        field = $i
+        gsub(/"/, "", field)
+        value[header[i]] = field
+      }
+      name = value["name"]
+      if (value["error_occurred"] == "true" || name ~ /_(mean|stddev|cv)$/)
+        next
+      sub(/_median$/, "", name)
+      unit = value["time_unit"]
+      scale = unit == "ns" ? 1e-6 : unit == "us" ? 1e-3 : unit == "s" ? 1e3 : 1
+      line = "{\"suite\":\"" suite "\",\"case\":\"" name "\",\"ms\":" \
+             value["real_time"] * scale
+      if (value["items_per_second"] != "")
+        line = line ",\"items_per_s\":" value["items_per_second"]
+      for (i = 1; i <= columns; ++i) {
+        if (!(header[i] in fixed) && value[header[i]] != "")
+          line = line ",\"" header[i] "\":" value[header[i]]
+      }
+      print line "}"
+    }' "$OUTPUT.csv" >> "$OUTPUT"
+  status=$?
+  rm -f "$OUTPUT.csv"
+  return $status
+}
+
+# Small sizes of the synthetic data, so the suite takes minutes
+SIZES=${REGRESSION_SIZES:-"100000 1000000"} \
+  "$ROOT/bench_regression.sh" "$OUTPUT" || exit 1
+SIZES=${CLASSIFICATION_SIZES:-"100000"} \
+  FEATURES=${CLASSIFICATION_FEATURES:-"64"} \
+  "$ROOT/bench_classification.sh" "$OUTPUT" || exit 1
+
+gbench mask-rcnn "$ROOT/mask_rcnn_pytorch/$BUILD_DIR/mask-rcnn_bench" || exit 1
+gbench rcnn-mxnet "$ROOT/rcnn-mxnet/$BUILD_DIR/rcnn_bench" || exit 1
+
+RCNN=$ROOT/rcnn-mxnet/$BUILD_DIR
+if [ -x "$RCNN/rcnn_train" ] && [ -n "$COCO_PATH" ] && [ -n "$RCNN_PARAMS" ]
+then
+  "$RCNN/rcnn_train" "$COCO_PATH" --params="$RCNN_PARAMS" --start-train \
+    --bench="$OUTPUT" || exit 1
+fi
+if [ -x "$RCNN/rcnn_demo" ] && [ -n "$RCNN_MODEL" ] && [ -n "$BENCH_IMAGE" ]
+then
+  "$RCNN/rcnn_demo" "$RCNN_MODEL" "$BENCH_IMAGE" --bench="$OUTPUT" || exit 1
+fi
+echo "Results are in $OUTPUT"
+
+if [ -n "$BASELINE" ]; then
+  "$ROOT/bench_compare.sh" "$BASELINE" "$OUTPUT" "${TOLERANCE:-0.1}"
+fi
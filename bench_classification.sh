@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs the benchmarks of the classification backends on the same synthetic
+# data sizes and appends their JSON lines to one file, see classbench.h. The
+# samples are expected to be built in their build folders.
+#
+# usage: bench_classification.sh [output.jsonl]
+# environment: SIZES (rows), FEATURES, BUILD_DIR
+
+OUTPUT=${1:-classification_bench.jsonl}
+SIZES=${SIZES:-"1000 100000 1000000 10000000"}
+FEATURES=${FEATURES:-"4 64 512"}
+BUILD_DIR=${BUILD_DIR:-build}
+ROOT=$(cd "$(dirname "$0")" && pwd)
+
+for rows in $SIZES; do
+  for features in $FEATURES; do
+    for backend in dlib shark shogun; do
+      SAMPLE=$ROOT/classification_$backend/$BUILD_DIR/classify
+      if [ -x "$SAMPLE" ]; then
+        "$SAMPLE" --bench "$rows" "$features" --bench-json "$OUTPUT" || exit 1
+      fi
+    done
+  done
+done
+echo "Results are in $OUTPUT"
@@ -0,0 +1,114 @@
+#!/bin/sh
+# Checks the JSON lines of a bench_all.sh run against the stored baseline and
+# exits with 1 when a metric got worse by more than the tolerance, a share of
+# the baseline value. Lines are matched by their names and sizes, the other
+# fields are the metrics: times (ms, *_ms), memory (*_mb) and allocations are
+# worse when they grow, throughputs (*_per_s) and accuracies (value) when
+# they fall. Cases missing from one of the files are listed, but don't fail
+# the check, the samples which aren't built are skipped by the suite.
+#
+# usage: bench_compare.sh baseline.jsonl current.jsonl [tolerance]
+#        bench_compare.sh --update baseline.jsonl current.jsonl
+
+if [ "$1" = "--update" ]; then
+  if [ ! -f "$3" ]; then
+    echo "No results in $3" >&2
+    exit 2
+  fi
+  cp "$3" "$2" || exit 2
+  echo "Baseline $2 is updated from $3"
+  exit 0
+fi
+
+BASELINE=$1
+CURRENT=$2
+TOLERANCE=${3:-0.1}
+if [ ! -f "$BASELINE" ] || [ ! -f "$CURRENT" ]; then
+  echo "usage: bench_compare.sh baseline.jsonl current.jsonl [tolerance]" >&2
+  echo "       bench_compare.sh --update baseline.jsonl current.jsonl" >&2
+  exit 2
+fi
+
+awk -v tolerance="$TOLERANCE" -v baseline="$BASELINE" '
+  # 1 if a larger value is better, -1 if a smaller one, 0 for the fields
+  # which name the case
+  function direction(name) {
+    if (name == "ms" || name ~ /_ms$/ || name ~ /_mb$/ || name == "allocations")
+      return -1
+    if (name ~ /_per_s$/ || name == "value")
+      return 1
+    return 0
+  }
+
+  # Splits the flat JSON object to the key of the case and its metrics
+  function parse(line,    fields, n, i, pos, name, field) {
+    gsub(/^[ \t]*\{|\}[ \t\r]*$/, "", line)
+    n = split(line, fields, ",")
+    key = ""
+    metrics_num = 0
+    for (i = 1; i <= n; ++i) {
+      pos = index(fields[i], ":")
+      name = substr(fields[i], 1, pos - 1)
+      field = substr(fields[i], pos + 1)
+      gsub(/"/, "", name)
+      gsub(/"/, "", field)
+      if (direction(name) != 0) {
+        metric_names[++metrics_num] = name
+        metric_values[name] = field + 0
+      } else {
+        key = key (key == "" ? "" : " ") name "=" field
+      }
+    }
+  }
+
+  NF == 0 { next }
+
+  FILENAME == baseline {
+    parse($0)
+    base_keys[key] = 1
+    for (i = 1; i <= metrics_num; ++i)
+      base[key, metric_names[i]] = metric_values[metric_names[i]]
+    next
+  }
+
+  {
+    parse($0)
+    if (!(key in base_keys)) {
+      print "new      " key
+      next
+    }
+    current_keys[key] = 1
+    for (i = 1; i <= metrics_num; ++i) {
+      metric = metric_names[i]
+      if (!((key, metric) in base))
+        continue
+      old = base[key, metric]
+      now = metric_values[metric]
+      if (old != 0)
+        change = (now - old) / (old < 0 ? -old : old)
+      else
+        change = now > 0 ? 1 : now < 0 ? -1 : 0
+      ++compared
+      gain = direction(metric) * change
+      if (gain < -tolerance) {
+        ++regressions
+        status = "WORSE   "
+      } else if (gain > tolerance) {
+        status = "better  "
+      } else {
+        continue
+      }
+      printf "%s%s %s %g -> %g (%+.1f%%)\n", status, key, metric, old, now,
+             change * 100
+    }
+  }
+
+  END {
+    for (key in base_keys) {
+      if (!(key in current_keys))
+        print "missing  " key
+    }
+    printf "%d metrics compared, %d worse than the tolerance of %g%%\n",
+           compared, regressions, tolerance * 100
+    exit regressions > 0 ? 1 : 0
+  }' "$BASELINE" "$CURRENT"
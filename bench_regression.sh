@@ -0,0 +1,39 @@
+#!/bin/sh
+# Runs the benchmarks of the polynomial regression backends on the same
+# synthetic data sizes and appends their JSON lines to one file, see
+# regbench.h. The samples are expected to be built in their build folders.
+#
+# usage: bench_regression.sh [output.jsonl]
+# environment: SIZES (rows), DEGREE, BUILD_DIR
+
+OUTPUT=${1:-regression_bench.jsonl}
+SIZES=${SIZES:-"10000 100000 1000000 10000000"}
+DEGREE=${DEGREE:-16}
+BUILD_DIR=${BUILD_DIR:-build}
+ROOT=$(cd "$(dirname "$0")" && pwd)
+
+XTENSOR_DIR=$ROOT/polynomial_regression/$BUILD_DIR
+XTENSOR=$XTENSOR_DIR/polynomial-regression
+XTENSOR_F32=$XTENSOR_DIR/polynomial-regression-float32
+XTENSOR_NATIVE=$XTENSOR_DIR/polynomial-regression-native
+EIGEN=$ROOT/polynomial_regression_eigen/$BUILD_DIR/polynomial-regression-eigen
+MSHADOW=$ROOT/polynomial_regression_gpu/$BUILD_DIR/polynomial-regression-gpu
+
+for rows in $SIZES; do
+  if [ -x "$XTENSOR" ]; then
+    "$XTENSOR" --bench "$rows" "$DEGREE" "$OUTPUT" || exit 1
+  fi
+  if [ -x "$XTENSOR_F32" ]; then
+    "$XTENSOR_F32" --bench "$rows" "$DEGREE" "$OUTPUT" || exit 1
+  fi
+  if [ -x "$XTENSOR_NATIVE" ]; then
+    "$XTENSOR_NATIVE" --bench "$rows" "$DEGREE" "$OUTPUT" || exit 1
+  fi
+  if [ -x "$EIGEN" ]; then
+    "$EIGEN" --bench "$rows" "$DEGREE" "$OUTPUT" || exit 1
+  fi
+  if [ -x "$MSHADOW" ]; then
+    "$MSHADOW" --bench "$rows" "$DEGREE" "$OUTPUT" || exit 1
+  fi
+done
+echo "Results are in $OUTPUT"
@@ -0,0 +1,136 @@
+#ifndef CLASSBENCH_H
+#define CLASSBENCH_H
+
+#include "csvloader.h"
+#include "regbench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Benchmark harness shared by the classification samples, the counterpart of
+ * regbench.h. The backends train and predict on the same synthetic blobs, a
+ * Gaussian cloud around a random center per class, and every stage is one
+ * JSON line with the time, the throughput, the heap allocations and the peak
+ * resident memory, the accuracy is a line of its own. The lines of all the
+ * backends can be appended to one file, see bench_classification.sh.
+ * The backends train the same models: the SVMs have the Gaussian kernel
+ * exp(-|x-y|^2 / features) and C = 10, they fit the standardization of the
+ * features in their train stage and apply it in the predict stage.
+ */
+namespace utils {
+
+// Train and test rows of the classes blobs, the test part is the last fifth
+template <typename T>
+std::pair<LabeledRows<T>, LabeledRows<T>> SyntheticClassificationData(
+    size_t rows,
+    size_t features,
+    size_t classes = 3,
+    unsigned seed = 25345) {
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<double> center(-3, 3);
+  std::normal_distribution<double> noise(0, 1);
+  std::uniform_int_distribution<size_t> label(0, classes - 1);
+  std::vector<double> centers(classes * features);
+  for (auto& c : centers)
+    c = center(generator);
+
+  std::pair<LabeledRows<T>, LabeledRows<T>> data;
+  const auto test_rows = rows / 5;
+  for (auto* part : {&data.first, &data.second}) {
+    auto part_rows = part == &data.second ? test_rows : rows - test_rows;
+    part->columns = features;
+    part->features.resize(part_rows * features);
+    part->labels.resize(part_rows);
+    for (size_t c = 0; c < classes; ++c)
+      part->label_names.push_back(std::to_string(c));
+    for (size_t r = 0; r < part_rows; ++r) {
+      auto l = label(generator);
+      part->labels[r] = l;
+      for (size_t f = 0; f < features; ++f)
+        part->features[r * features + f] =
+            static_cast<T>(centers[l * features + f] + noise(generator));
+    }
+  }
+  return data;
+}
+
+// Share of the predictions equal to the labels
+template <typename Labels>
+double Accuracy(const Labels& predicted, const std::vector<size_t>& labels) {
+  size_t matches = 0;
+  for (size_t i = 0; i < labels.size(); ++i) {
+    if (static_cast<size_t>(predicted[i]) == labels[i])
+      ++matches;
+  }
+  return labels.empty() ? 0 : static_cast<double>(matches) / labels.size();
+}
+
+class ClassBenchReport {
+ public:
+  // An empty file name writes the lines to stdout
+  ClassBenchReport(std::string backend,
+                   size_t rows,
+                   size_t features,
+                   const std::string& file_name)
+      : backend_(std::move(backend)), rows_(rows), features_(features) {
+    if (!file_name.empty()) {
+      file_.open(file_name, std::ios::app);
+      if (!file_)
+        throw std::runtime_error(file_name + " file can't be opened");
+    }
+  }
+
+  // Times f over the rows of the stage, f must finish its work before it
+  // returns, the asynchronous devices have to be synchronized inside
+  template <typename F>
+  double Measure(const std::string& model,
+                 const std::string& stage,
+                 size_t rows,
+                 F f) {
+    auto allocations = AllocationCount();
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    allocations = AllocationCount() - allocations;
+    Begin(model, stage) << ",\"ms\":" << elapsed.count() << ",\"rows_per_s\":"
+                        << (elapsed.count() > 0 ? static_cast<double>(rows) /
+                                                      elapsed.count() * 1000
+                                                : 0)
+                        << ",\"allocations\":" << allocations
+                        << ",\"peak_rss_mb\":" << PeakMemoryMb() << "}"
+                        << std::endl;
+    return elapsed.count();
+  }
+
+  void Accuracy(const std::string& model, double accuracy) {
+    Begin(model, "accuracy") << ",\"value\":" << accuracy << "}" << std::endl;
+  }
+
+ private:
+  std::ostream& Begin(const std::string& model, const std::string& stage) {
+    std::ostream& out = file_.is_open() ? file_ : std::cout;
+    out << "{\"backend\":\"" << backend_ << "\",\"model\":\"" << model
+        << "\",\"rows\":" << rows_ << ",\"features\":" << features_
+        << ",\"stage\":\"" << stage << "\"";
+    return out;
+  }
+
+  std::string backend_;
+  size_t rows_{0};
+  size_t features_{0};
+  std::ofstream file_;
+};
+
+}  // namespace utils
+
+#endif  // CLASSBENCH_H
@@ -2,21 +2,29 @@
 #include <dlib/dnn.h>
 #include <dlib/global_optimization.h>
 #include <dlib/matrix.h>
+#include <dlib/pipe.h>
 #include <dlib/svm.h>
 #include <dlib/svm_threaded.h>
 #include <plot.h>
 
 // stl includes
+#include <algorithm>
+#include <chrono>
 #include <experimental/filesystem>
-#include <fstream>
 #include <iostream>
 #include <memory>
-#include <regex>
-#include <streambuf>
+#include <numeric>
+#include <random>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 // application includes
+#include "../classbench.h"
+#include "../csvloader.h"
 #include "../ioutils.h"
 #include "../utils.h"
+#include "svm_scorer.h"
 
 // Namespace and type aliases
 namespace fs = std::experimental::filesystem;
@@ -32,6 +40,20 @@ using svm_dec_funct_type = dlib::one_vs_all_decision_function<svm_ova_trainer>;
 using svm_normalizer_type = dlib::vector_normalizer<Matrix>;
 using svm_funct_type =
     dlib::normalized_function<svm_dec_funct_type, svm_normalizer_type>;
+// dlib serializes the one-vs-all functions only with the concrete binary
+// decision function types
+using svm_saved_dec_funct_type = dlib::one_vs_all_decision_function<
+    svm_ova_trainer,
+    dlib::decision_function<svm_kernel_type>>;
+using svm_saved_funct_type =
+    dlib::normalized_function<svm_saved_dec_funct_type, svm_normalizer_type>;
+//  NN types
+using nn_net_type = dlib::loss_multiclass_log<dlib::fc<
+    3,
+    dlib::relu<dlib::fc<
+        10,
+        dlib::relu<dlib::fc<5, dlib::input<dlib::matrix<DType>>>>>>>>;
+using nn_classifier_type = std::pair<nn_net_type, svm_normalizer_type>;
 
 static const std::string train_data_url =
     "https://raw.githubusercontent.com/pandas-dev/pandas/master/pandas/tests/"
@@ -47,43 +69,48 @@ DataSet LoadData() {
       return {};
     }
   }
-  // ----------- Load data to string
-  std::ifstream data_file(data_path);
-  std::string train_data_str((std::istreambuf_iterator<char>(data_file)),
-                             std::istreambuf_iterator<char>());
-
-  // ----------- Remove first line - columns labels
-  train_data_str.erase(0, train_data_str.find_first_of("\n") + 1);
-
-  // ----------- Replace string labels with ints
-  train_data_str =
-      std::regex_replace(train_data_str, std::regex("Iris-setosa"), "0");
-  train_data_str =
-      std::regex_replace(train_data_str, std::regex("Iris-versicolor"), "1");
-  train_data_str =
-      std::regex_replace(train_data_str, std::regex("Iris-virginica"), "2");
-
-  // ----------- Load data to matrix
-  Matrix train_data(150, 5);
-  std::stringstream ss(train_data_str);
-  ss >> train_data;
-  // ----------- Extract labels
-  Matrix labels = dlib::colm(train_data, 4);
-  // std::cout << dlib::csv << labels << std::endl;
-  // ----------- Extract and transpose samples
-  Matrix samples = dlib::subm_clipped(train_data, 0, 0, train_data.nr(),
-                                      train_data.nc() - 1);
-  // std::cout << dlib::csv << samples << std::endl;
-  // convert to matrices to vectors, because algorithms require such data types
+  // ----------- Parse the features and the class names in one pass, the ids
+  // follow the order of the classes in the file
+  const size_t columns = 4;
+  auto data = utils::LoadLabeledCsv<DType>(data_path, columns);
+  if (data.invalid_rows != 0)
+    std::cerr << "Skipped " << data.invalid_rows << " invalid rows"
+              << std::endl;
+  // ----------- Copy the rows to the column vectors the algorithms require
   DataSet ds;
-  for (long row = 0; row < samples.nr(); ++row) {
-    ds.first.push_back(dlib::reshape_to_column_vector(
-        dlib::subm_clipped(samples, row, 0, 1, samples.nc())));
+  ds.first.resize(data.rows(), Matrix(static_cast<long>(columns), 1));
+  ds.second.resize(data.rows());
+  for (size_t row = 0; row < data.rows(); ++row) {
+    std::copy_n(data.row(row), columns, ds.first[row].begin());
+    ds.second[row] = static_cast<DType>(data.labels[row]);
   }
-  ds.second.assign(labels.begin(), labels.end());
   return ds;
 }
 
+// SVM with the given parameters on the normalized samples
+svm_funct_type TrainSVM(const svm_normalizer_type& normalizer,
+                        const std::vector<Matrix>& samples,
+                        const std::vector<DType>& labels,
+                        double gamma,
+                        double c1,
+                        double c2,
+                        unsigned long threads) {
+  dlib::svm_c_trainer<svm_kernel_type> svm_trainer;
+  svm_trainer.set_kernel(svm_kernel_type(gamma));
+  svm_trainer.set_c_class1(c1);
+  svm_trainer.set_c_class2(c2);
+  svm_ova_trainer trainer;
+  trainer.set_num_threads(threads);
+  trainer.set_trainer(svm_trainer);
+
+  svm_funct_type learned_function;
+  learned_function.normalizer = normalizer;  // save normalization information
+  learned_function.function = trainer.train(
+      samples,
+      labels);  // perform the actual SVM training and save the results
+  return learned_function;
+}
+
 svm_funct_type TrainSVMClassifier(DataSet dataset) {
   // based on http://dlib.net/model_selection_ex.cpp.html
 
@@ -105,6 +132,13 @@ svm_funct_type TrainSVMClassifier(DataSet dataset) {
 
   // ----------- Select best parameters for svm model
 
+  // The candidates are evaluated concurrently on the pool, so every
+  // cross-validation trains its one-vs-all classifiers in one thread and the
+  // output of the evaluations is serialized.
+  const auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+  dlib::thread_pool pool(threads);
+  std::mutex output_guard;
+
   //  Here we define a function, that will do the cross-validation and return
   //  a number indicating how good a particular setting of gamma, c1, and c2
   //  is.
@@ -118,7 +152,7 @@ svm_funct_type TrainSVMClassifier(DataSet dataset) {
     svm_trainer.set_c_class2(c2);
 
     svm_ova_trainer trainer;
-    trainer.set_num_threads(4);
+    trainer.set_num_threads(1);
     trainer.set_trainer(svm_trainer);
 
     // Perform 10-fold cross validation and then print and return the
@@ -126,10 +160,15 @@ svm_funct_type TrainSVMClassifier(DataSet dataset) {
     Matrix result =
         dlib::cross_validate_multiclass_trainer(trainer, samples, labels, 10);
     auto accuracy = sum(diag(result)) / sum(result);
-    std::cout << "gamma: " << gamma << "  c1: " << c1 << "  c2: " << c2
-              << "\ncross validation accuracy: " << accuracy
-              << "\nconfusion matrix:\n"
-              << dlib::csv << result << std::endl;
+    std::ostringstream report;
+    report << "gamma: " << gamma << "  c1: " << c1 << "  c2: " << c2
+           << "\ncross validation accuracy: " << accuracy
+           << "\nconfusion matrix:\n"
+           << dlib::csv << result << "\n";
+    {
+      std::lock_guard<std::mutex> lock(output_guard);
+      std::cout << report.str() << std::flush;
+    }
 
     // Now return a number indicating how good the parameters are.  Bigger is
     // better in this example.
@@ -138,9 +177,10 @@ svm_funct_type TrainSVMClassifier(DataSet dataset) {
 
   // Call this global optimizer that will search for the best
   // parameters. It will call cross_validation_score() 50 times with different
-  // settings and return the best parameter setting it finds.
+  // settings, as many at once as the pool has threads, and return the best
+  // parameter setting it finds.
   auto result = dlib::find_max_global(
-      cross_validation_score,
+      pool, cross_validation_score,
       {1e-5, 1e-5,
        1e-5},  // lower bound constraints on gamma, c1, and c2, respectively
       {100, 1e6,
@@ -157,97 +197,300 @@ svm_funct_type TrainSVMClassifier(DataSet dataset) {
 
   // ---------- Create final SVM model
 
-  dlib::svm_c_trainer<svm_kernel_type> svm_trainer;
-  svm_trainer.set_kernel(svm_kernel_type(best_gamma));
-  svm_trainer.set_c_class1(best_c1);
-  svm_trainer.set_c_class2(best_c2);
-  svm_ova_trainer trainer;
-  trainer.set_num_threads(4);
-  trainer.set_trainer(svm_trainer);
-
-  svm_funct_type learned_function;
-  learned_function.normalizer = normalizer;  // save normalization information
-  learned_function.function = trainer.train(
-      samples,
-      labels);  // perform the actual SVM training and save the results
-  return learned_function;
+  return TrainSVM(normalizer, samples, labels, best_gamma, best_c1, best_c2,
+                  threads);
 }
 
-auto TrainNNClassifier(DataSet dataset) {
-  // based on http://dlib.net/dnn_introduction_ex.cpp.html
+// Configuration of the DNN, the widths are the ones of the hidden layers
+struct NNConfig {
+  size_t batch_size{128};
+  long first_width{5};
+  long second_width{10};
+  double learning_rate{0.01};
+  double min_learning_rate{0.00001};
+  size_t max_epochs{10000};
+  size_t prefetch_batches{4};  // batches the loader thread prepares ahead
+};
+
+// Mini-batch of the DNN training
+struct NNBatch {
+  std::vector<Matrix> samples;
+  std::vector<unsigned long> labels;
+};
+
+nn_classifier_type TrainNNClassifier(DataSet dataset,
+                                     const NNConfig& config = {}) {
+  // based on http://dlib.net/dnn_introduction_ex.cpp.html and
+  // http://dlib.net/dnn_imagenet_train_ex.cpp.html
   using namespace dlib;
 
   auto& [samples, real_labels] = dataset;
-  std::vector<unsigned long> labels;
-  labels.assign(real_labels.begin(), real_labels.end());
   // ----------- Pre-process data
   // Here we normalize all the samples by subtracting their mean and
   // dividing by their standard deviation.
   vector_normalizer<Matrix> normalizer;
   // let the normalizer learn the mean and standard deviation of the samples
   normalizer.train(samples);
-  // now normalize each sample
-  for (size_t i = 0; i < samples.size(); ++i) {
-    samples[i] = normalizer(samples[i]);
-  }
-
-  using net_type = loss_multiclass_log<
-      fc<3, relu<fc<10, relu<fc<5, input<matrix<DType>>>>>>>>;
-  net_type net;
-  dnn_trainer<net_type> trainer(net);
-  trainer.set_learning_rate(0.01);
-  trainer.set_min_learning_rate(0.00001);
-  trainer.set_mini_batch_size(8);
+  // the normalized samples are kept in one contiguous samples x features
+  // matrix, the per sample matrices aren't needed anymore
+  auto data = StackSamples(samples);
+  const Matrix means = trans(normalizer.means());
+  const Matrix scales = trans(normalizer.std_devs());
+  for (long r = 0; r < data.nr(); ++r)
+    set_rowm(data, r) = pointwise_multiply(rowm(data, r) - means, scales);
+  std::vector<unsigned long> labels(real_labels.begin(), real_labels.end());
+  samples.clear();
+  samples.shrink_to_fit();
+
+  nn_net_type net;
+  // the widths are given in the run time, layer<0> is the loss layer
+  layer<1>(net).layer_details().set_num_outputs(
+      static_cast<long>(*std::max_element(labels.begin(), labels.end()) + 1));
+  layer<3>(net).layer_details().set_num_outputs(config.second_width);
+  layer<5>(net).layer_details().set_num_outputs(config.first_width);
+  dnn_trainer<nn_net_type> trainer(net);
+  trainer.set_learning_rate(config.learning_rate);
+  trainer.set_min_learning_rate(config.min_learning_rate);
+  trainer.set_mini_batch_size(config.batch_size);
   trainer.be_verbose();
-  trainer.train(samples, labels);
+
+  // The loader thread copies the shuffled rows to the batches while the
+  // trainer is busy with the previous ones on the device
+  const auto batch_size =
+      std::min<size_t>(config.batch_size, static_cast<size_t>(data.nr()));
+  dlib::pipe<NNBatch> batches(config.prefetch_batches);
+  std::thread loader([&]() {
+    std::vector<long> order(static_cast<size_t>(data.nr()));
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937 generator(data.nr());
+    size_t position = order.size();
+    while (batches.is_enabled()) {
+      NNBatch batch;
+      batch.samples.resize(batch_size);
+      batch.labels.resize(batch_size);
+      for (size_t i = 0; i < batch_size; ++i, ++position) {
+        if (position == order.size()) {
+          std::shuffle(order.begin(), order.end(), generator);
+          position = 0;
+        }
+        batch.samples[i] = trans(rowm(data, order[position]));
+        batch.labels[i] = labels[static_cast<size_t>(order[position])];
+      }
+      batches.enqueue(batch);
+    }
+  });
+
+  const auto steps_per_epoch = (data.nr() + batch_size - 1) / batch_size;
+  NNBatch batch;
+  while (trainer.get_learning_rate() >= config.min_learning_rate &&
+         trainer.get_train_one_step_calls() / steps_per_epoch <
+             config.max_epochs &&
+         batches.dequeue(batch)) {
+    trainer.train_one_step(batch.samples, batch.labels);
+  }
+  batches.disable();
+  loader.join();
+  trainer.get_net();  // waits for the training to finish
   net.clean();
   return std::make_pair(net, normalizer);
 }
 
 // ---------- Evaluate model on samples
-template <typename Classfier>
-void TestSVMClassfier(const std::string& name,
-                      const Classfier& classifier,
-                      DataSet dataset) {
-  auto& [test_data, test_labels] = dataset;
+double SamplesPerSecond(size_t samples,
+                        std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() > 0 ? static_cast<double>(samples) / elapsed.count()
+                             : 0;
+}
+
+template <typename Labels>
+DType Accuracy(const Labels& predicted_labels,
+               const std::vector<DType>& test_labels) {
   DType matches_num = 0;
-  for (size_t i = 0; i < test_data.size(); ++i) {
-    auto predicted_class = classifier(test_data[i]);
-    auto true_class = test_labels[i];
-    if (predicted_class == true_class) {
+  for (size_t i = 0; i < test_labels.size(); ++i) {
+    if (predicted_labels[i] == test_labels[i]) {
       ++matches_num;
     }
   }
-  std::cout << name << " test accuracy = " << matches_num / test_data.size()
-            << std::endl;
+  return matches_num / test_labels.size();
+}
+
+void TestSVMClassfier(const std::string& name,
+                      const svm_funct_type& classifier,
+                      DataSet dataset) {
+  auto& [test_data, test_labels] = dataset;
+  // the scorer is built once per model, scoring is done on the whole matrix
+  SVMBatchScorer<Matrix> scorer(classifier);
+  auto samples = StackSamples(test_data);
+  auto start = std::chrono::steady_clock::now();
+  auto predicted_labels = scorer.Predict(samples);
+  auto speed = SamplesPerSecond(test_data.size(), start);
+  std::cout << name << " test accuracy = "
+            << Accuracy(predicted_labels, test_labels) << " (" << speed
+            << " samples/s)" << std::endl;
+}
+
+std::vector<unsigned long> PredictNN(nn_classifier_type& classifier,
+                                     std::vector<Matrix> samples) {
+  // normalize, vector_normalizer keeps the reciprocals of the deviations and
+  // isn't thread safe itself
+  const Matrix& means = classifier.second.means();
+  const Matrix& scales = classifier.second.std_devs();
+  const auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+  dlib::parallel_for(threads, 0, samples.size(), [&](long i) {
+    samples[i] = dlib::pointwise_multiply(samples[i] - means, scales);
+  });
+
+  // the net is evaluated on the device in large mini-batches
+  const size_t batch_size = 4096;
+  return classifier.first(samples.begin(), samples.end(), batch_size);
 }
 
-template <typename Classfier>
 void TestNNClassfier(const std::string& name,
-                     Classfier& classifier,
+                     nn_classifier_type& classifier,
                      DataSet dataset) {
   auto& [test_data, test_labels] = dataset;
-  for (auto& ts : test_data)
-    ts = classifier.second(ts);  // normalize
+  auto start = std::chrono::steady_clock::now();
+  auto predicted_labels = PredictNN(classifier, std::move(test_data));
+  auto speed = SamplesPerSecond(test_labels.size(), start);
+  std::cout << name << " test accuracy = "
+            << Accuracy(predicted_labels, test_labels) << " (" << speed
+            << " samples/s)" << std::endl;
+}
 
-  auto predicted_labels = classifier.first(test_data);
-  DType matches_num = 0;
-  for (size_t i = 0; i < test_data.size(); ++i) {
-    auto predicted_class = predicted_labels[i];
-    auto true_class = test_labels[i];
-    if (predicted_class == true_class) {
-      ++matches_num;
-    }
+// ---------- Benchmark on the synthetic data shared with the other libraries,
+// see classbench.h
+DataSet ToDataSet(const utils::LabeledRows<DType>& rows) {
+  DataSet ds;
+  ds.first.resize(rows.rows(), Matrix(static_cast<long>(rows.columns), 1));
+  ds.second.resize(rows.rows());
+  for (size_t row = 0; row < rows.rows(); ++row) {
+    std::copy_n(rows.row(row), rows.columns, ds.first[row].begin());
+    ds.second[row] = static_cast<DType>(rows.labels[row]);
   }
-  std::cout << name << " test accuracy = " << matches_num / test_data.size()
-            << std::endl;
+  return ds;
+}
+
+int BenchMain(size_t rows, size_t features, const std::string& json_file) {
+  auto data = utils::SyntheticClassificationData<DType>(rows, features);
+  const auto& train = data.first;
+  const auto& test = data.second;
+  utils::ClassBenchReport report("dlib", rows, features, json_file);
+  const auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  svm_funct_type svm_classifier;
+  report.Measure("svm", "train", train.rows(), [&]() {
+    auto [samples, labels] = ToDataSet(train);
+    svm_normalizer_type normalizer;
+    normalizer.train(samples);
+    for (auto& sample : samples)
+      sample = normalizer(sample);
+    svm_classifier =
+        TrainSVM(normalizer, samples, labels, 1. / features, 10, 10, threads);
+  });
+  Matrix test_samples = dlib::mat(test.features.data(),
+                                  static_cast<long>(test.rows()),
+                                  static_cast<long>(test.columns));
+  std::vector<DType> svm_labels;
+  report.Measure("svm", "predict", test.rows(), [&]() {
+    SVMBatchScorer<Matrix> scorer(svm_classifier);
+    svm_labels = scorer.Predict(test_samples);
+  });
+  report.Accuracy("svm", utils::Accuracy(svm_labels, test.labels));
+
+  NNConfig nn_config;
+  nn_config.batch_size = 1024;
+  nn_config.max_epochs = 10;
+  nn_classifier_type nn_classifier;
+  report.Measure("nn", "train", train.rows(), [&]() {
+    nn_classifier = TrainNNClassifier(ToDataSet(train), nn_config);
+  });
+  auto test_set = ToDataSet(test);
+  std::vector<unsigned long> nn_labels;
+  report.Measure("nn", "predict", test.rows(), [&]() {
+    nn_labels = PredictNN(nn_classifier, test_set.first);
+  });
+  report.Accuracy("nn", utils::Accuracy(nn_labels, test.labels));
+  return 0;
+}
+
+// ---------- Persist the trained models, so scoring doesn't retrain them
+void SaveModels(const std::string& dir,
+                const svm_funct_type& svm_classifier,
+                const nn_classifier_type& nn_classifier) {
+  fs::create_directories(dir);
+  svm_saved_funct_type svm_saved;
+  svm_saved.normalizer = svm_classifier.normalizer;
+  svm_saved.function = svm_classifier.function;
+  dlib::serialize((fs::path(dir) / "svm.dat").string()) << svm_saved;
+  dlib::serialize((fs::path(dir) / "nn.dat").string())
+      << nn_classifier.first << nn_classifier.second;
+}
+
+std::pair<svm_funct_type, nn_classifier_type> LoadModels(
+    const std::string& dir) {
+  svm_saved_funct_type svm_saved;
+  dlib::deserialize((fs::path(dir) / "svm.dat").string()) >> svm_saved;
+  svm_funct_type svm_classifier;
+  svm_classifier.normalizer = svm_saved.normalizer;
+  svm_classifier.function = svm_saved.function;
+  nn_classifier_type nn_classifier;
+  dlib::deserialize((fs::path(dir) / "nn.dat").string()) >>
+      nn_classifier.first >> nn_classifier.second;
+  return {svm_classifier, nn_classifier};
 }
 
-int main(int, char* []) {
+int main(int argc, char* argv[]) {
   using namespace std::string_literals;
   try {
+    NNConfig nn_config;
+    std::string save_dir;
+    std::string load_dir;
+    size_t bench_rows = 0;
+    size_t bench_features = 4;
+    std::string bench_json;
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--batch-size" && i + 1 < argc) {
+        nn_config.batch_size = std::stoul(argv[++i]);
+      } else if (arg == "--widths" && i + 2 < argc) {
+        nn_config.first_width = std::stol(argv[++i]);
+        nn_config.second_width = std::stol(argv[++i]);
+      } else if (arg == "--save-models" && i + 1 < argc) {
+        save_dir = argv[++i];
+      } else if (arg == "--load-models" && i + 1 < argc) {
+        load_dir = argv[++i];
+      } else if (arg == "--bench" && i + 2 < argc) {
+        bench_rows = std::stoul(argv[++i]);
+        bench_features = std::stoul(argv[++i]);
+      } else if (arg == "--bench-json" && i + 1 < argc) {
+        bench_json = argv[++i];
+      } else {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--batch-size n] [--widths first second]"
+                     " [--save-models dir | --load-models dir]"
+                     " [--bench rows features [--bench-json file]]\n";
+        return 1;
+      }
+    }
+    if (bench_rows > 0)
+      return BenchMain(bench_rows, bench_features, bench_json);
     auto [samples, labels] = LoadData();
 
+    // ----------- Scoring only, the saved models are evaluated on all the data
+    if (!load_dir.empty()) {
+      auto start = std::chrono::steady_clock::now();
+      auto [svm_classifier, nn_classifier] = LoadModels(load_dir);
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      std::cout << "Models loaded in " << elapsed.count() << " ms"
+                << std::endl;
+      TestSVMClassfier("SVM"s, svm_classifier, {samples, labels});
+      TestNNClassfier("NN"s, nn_classifier, {samples, labels});
+      return 0;
+    }
+
     // ----------- Pre-process data
     // It have sense to compile DLib in debug mode with DLIB_ENABLE_ASSERTS
     // CMake option enabled, to see inconvinience in data types
@@ -270,9 +513,12 @@ int main(int, char* []) {
     // Decision trees and Random Forest algorithms are missed in DLib
 
     // ----------- Neural Net
-    auto nn_classifier = TrainNNClassifier({samples, labels});
+    auto nn_classifier = TrainNNClassifier({samples, labels}, nn_config);
     TestNNClassfier("NN"s, nn_classifier, {test_data, test_labels});
 
+    if (!save_dir.empty())
+      SaveModels(save_dir, svm_classifier, nn_classifier);
+
   } catch (const std::exception& err) {
     std::cout << "Program crashed : " << err.what() << std::endl;
   }
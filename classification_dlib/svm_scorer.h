@@ -0,0 +1,144 @@
+#ifndef SVM_SCORER_H
+#define SVM_SCORER_H
+
+#include <dlib/matrix.h>
+#include <dlib/statistics.h>
+#include <dlib/svm.h>
+#include <dlib/svm_threaded.h>
+#include <dlib/threads.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/*
+ * Batch scoring of the normalized one-vs-all RBF SVM. The decision function of
+ * dlib evaluates the kernel expansion of every class for one sample at a time,
+ * here the support vectors of all the classes are stacked to one matrix and a
+ * block of samples is scored with one matrix product: the squared distances
+ * are |x|^2 + |s|^2 - 2 * X * S^T, so the kernel values of the block against
+ * all the support vectors come from the BLAS. The blocks are spread over
+ * threads, the scorer state is read only and can be shared.
+ */
+// Contiguous samples x features matrix of the column vector samples
+template <typename Sample>
+dlib::matrix<typename Sample::type> StackSamples(
+    const std::vector<Sample>& samples) {
+  dlib::matrix<typename Sample::type> result(
+      static_cast<long>(samples.size()),
+      samples.empty() ? 0 : samples.front().size());
+  for (size_t i = 0; i < samples.size(); ++i)
+    dlib::set_rowm(result, static_cast<long>(i)) = dlib::trans(samples[i]);
+  return result;
+}
+
+template <typename Sample>
+class SVMBatchScorer {
+ public:
+  using DType = typename Sample::type;
+  using Matrix = dlib::matrix<DType>;
+  using Kernel = dlib::radial_basis_kernel<Sample>;
+  using Function = dlib::normalized_function<
+      dlib::one_vs_all_decision_function<
+          dlib::one_vs_all_trainer<dlib::any_trainer<Sample>>>,
+      dlib::vector_normalizer<Sample>>;
+
+  explicit SVMBatchScorer(const Function& function,
+                          long threads = std::max(
+                              std::thread::hardware_concurrency(), 1u))
+      : threads_(std::max(threads, 1L)) {
+    // vector_normalizer keeps the reciprocals of the deviations
+    means_ = dlib::trans(function.normalizer.means());
+    scales_ = dlib::trans(function.normalizer.std_devs());
+
+    const auto& table = function.function.get_binary_decision_functions();
+    long vectors_num = 0;
+    for (const auto& binary : table) {
+      const auto& df =
+          binary.second.template cast_to<dlib::decision_function<Kernel>>();
+      vectors_num += df.basis_vectors.size();
+    }
+    support_vectors_.set_size(vectors_num, means_.nc());
+    alpha_.set_size(vectors_num);
+    offsets_.push_back(0);
+    for (const auto& binary : table) {
+      const auto& df =
+          binary.second.template cast_to<dlib::decision_function<Kernel>>();
+      auto offset = offsets_.back();
+      for (long i = 0; i < df.basis_vectors.size(); ++i) {
+        dlib::set_rowm(support_vectors_, offset + i) =
+            dlib::trans(df.basis_vectors(i));
+        alpha_(offset + i) = df.alpha(i);
+      }
+      offsets_.push_back(offset + df.basis_vectors.size());
+      labels_.push_back(binary.first);
+      gamma_.push_back(df.kernel_function.gamma);
+      bias_.push_back(df.b);
+    }
+    vector_norms_ =
+        dlib::sum_cols(dlib::squared(support_vectors_));  // |s|^2 per row
+  }
+
+  long classes() const { return static_cast<long>(labels_.size()); }
+
+  // Decision values of the classes, a row per sample of the samples x features
+  // matrix
+  Matrix Score(const Matrix& samples) const {
+    if (samples.nc() != means_.nc())
+      throw std::invalid_argument("wrong number of the sample features");
+    Matrix scores(samples.nr(), classes());
+    const long blocks = (samples.nr() + kBlockRows - 1) / kBlockRows;
+    dlib::parallel_for(threads_, 0, blocks, [&](long block) {
+      const long begin = block * kBlockRows;
+      const long rows = std::min(kBlockRows, samples.nr() - begin);
+      Matrix x = dlib::subm(samples, begin, 0, rows, samples.nc());
+      for (long r = 0; r < rows; ++r)
+        dlib::set_rowm(x, r) =
+            dlib::pointwise_multiply(dlib::rowm(x, r) - means_, scales_);
+      Matrix x_norms = dlib::sum_cols(dlib::squared(x));
+      Matrix products = x * dlib::trans(support_vectors_);
+      for (long r = 0; r < rows; ++r) {
+        for (long c = 0; c < classes(); ++c) {
+          DType value = 0;
+          for (long v = offsets_[c]; v < offsets_[c + 1]; ++v) {
+            auto distance = std::max<DType>(
+                x_norms(r) + vector_norms_(v) - 2 * products(r, v), 0);
+            value += alpha_(v) * std::exp(-gamma_[c] * distance);
+          }
+          scores(begin + r, c) = value - bias_[c];
+        }
+      }
+    });
+    return scores;
+  }
+
+  // Labels of the classes with the largest decision values
+  std::vector<DType> Predict(const Matrix& samples) const {
+    auto scores = Score(samples);
+    std::vector<DType> labels(samples.nr());
+    for (long r = 0; r < scores.nr(); ++r)
+      labels[r] = labels_[dlib::index_of_max(dlib::rowm(scores, r))];
+    return labels;
+  }
+
+ private:
+  // Samples of one matrix product, the block and its kernel values stay in
+  // the cache for the Iris sized models
+  static constexpr long kBlockRows = 256;
+
+  long threads_{1};
+  Matrix means_;   // 1 x features
+  Matrix scales_;  // 1 x features
+  Matrix support_vectors_;
+  Matrix vector_norms_;
+  dlib::matrix<DType, 0, 1> alpha_;
+  std::vector<long> offsets_;  // support vectors of the class c are in
+                               // [offsets_[c], offsets_[c + 1])
+  std::vector<DType> labels_;
+  std::vector<DType> gamma_;
+  std::vector<DType> bias_;
+};
+
+#endif  // SVM_SCORER_H
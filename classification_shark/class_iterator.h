@@ -2,66 +2,89 @@
 #define CLASS_ITERATOR_H
 
 #include <shark/Data/Dataset.h>
-#include <limits>
 
-struct ClassIterator {
-  // iterator traits
-  using difference_type = size_t;
-  using value_type = double;
-  using pointer = const double*;
-  using reference = const double&;
-  using iterator_category = std::forward_iterator_tag;
-  ClassIterator()
-      : label(0),
-        data_index(0),
-        index(std::numeric_limits<unsigned int>::max()),
-        data(nullptr),
-        labels(nullptr) {}
-  ClassIterator(const shark::Data<shark::RealVector>* data,
-                const shark::Data<unsigned int>* labels,
-                unsigned int label,
-                unsigned int data_index)
-      : label(label),
-        data_index(data_index),
-        index(0),
-        data(data),
-        labels(labels) {
-    bool found = false;
-    while (index < labels->numberOfElements()) {
-      if (labels->element(index) == label) {
-        found = true;
-        break;
-      }
-      ++index;
+#include <algorithm>
+#include <vector>
+
+// Samples grouped by the class, built with one pass over the data. The ids of
+// the samples of every class are stored one after another (CSR like) and the
+// features are copied to contiguous columns of every class, so the plotting
+// iterates over plain arrays instead of the batched shark::Data elements.
+class ClassIndex {
+ public:
+  using iterator = std::vector<double>::const_iterator;
+
+  struct Range {
+    iterator begin() const { return first; }
+    iterator end() const { return last; }
+    size_t size() const { return static_cast<size_t>(last - first); }
+    iterator first;
+    iterator last;
+  };
+
+  ClassIndex(const shark::Data<shark::RealVector>& data,
+             const shark::Data<unsigned int>& labels) {
+    std::vector<unsigned int> sample_labels;
+    sample_labels.reserve(labels.numberOfElements());
+    for (auto label : labels.elements())
+      sample_labels.push_back(label);
+    auto classes =
+        sample_labels.empty()
+            ? 0
+            : *std::max_element(sample_labels.begin(), sample_labels.end()) +
+                  1;
+    offsets_.assign(classes + 1, 0);
+    for (auto label : sample_labels)
+      ++offsets_[label + 1];
+    for (size_t c = 0; c < classes; ++c)
+      offsets_[c + 1] += offsets_[c];
+
+    features_ = data.numberOfElements() > 0 ? data.element(0).size() : 0;
+    ids_.resize(sample_labels.size());
+    values_.resize(sample_labels.size() * features_);
+    std::vector<size_t> positions(offsets_.begin(), offsets_.end() - 1);
+    size_t id = 0;
+    for (const auto& sample : data.elements()) {
+      auto label = sample_labels[id];
+      auto position = positions[label]++;
+      ids_[position] = id++;
+      // the columns of a class follow each other
+      auto count = offsets_[label + 1] - offsets_[label];
+      auto column = values_.begin() + offsets_[label] * features_ +
+                    (position - offsets_[label]);
+      for (size_t f = 0; f < features_; ++f)
+        column[f * count] = sample(f);
     }
-    if (!found)
-      index = std::numeric_limits<unsigned int>::max();
   }
-  ClassIterator& operator++() {
-    while (index < labels->numberOfElements()) {
-      ++index;
-      if (index < labels->numberOfElements() &&
-          labels->element(index) == label) {
-        return *this;
-      }
-    }
-    index = std::numeric_limits<unsigned int>::max();
-    return *this;
+
+  size_t classes() const { return offsets_.size() - 1; }
+  size_t size(unsigned int label) const {
+    return label < classes() ? offsets_[label + 1] - offsets_[label] : 0;
   }
-  double operator*() { return data->element(index)[data_index]; }
-  unsigned int label;
-  unsigned int data_index;
-  unsigned int index;
-  const shark::Data<shark::RealVector>* data;
-  const shark::Data<unsigned int>* labels;
-};
 
-bool operator==(const ClassIterator& a, const ClassIterator& b) {
-  return a.index == b.index;
-}
+  // Ids of the samples of the class in the data order
+  std::vector<size_t> samples(unsigned int label) const {
+    if (label >= classes())
+      return {};
+    return std::vector<size_t>(ids_.begin() + offsets_[label],
+                               ids_.begin() + offsets_[label + 1]);
+  }
 
-bool operator!=(const ClassIterator& a, const ClassIterator& b) {
-  return a.index != b.index;
-}
+  // The feature values of the samples of the class
+  Range column(unsigned int label, size_t feature) const {
+    if (label >= classes())
+      return {values_.end(), values_.end()};
+    auto count = size(label);
+    auto first =
+        values_.begin() + offsets_[label] * features_ + feature * count;
+    return {first, first + count};
+  }
+
+ private:
+  size_t features_{0};
+  std::vector<size_t> offsets_{0};
+  std::vector<size_t> ids_;
+  std::vector<double> values_;
+};
 
-#endif // CLASS_ITERATOR_H
+#endif  // CLASS_ITERATOR_H
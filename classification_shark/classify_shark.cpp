@@ -1,30 +1,42 @@
 // third party includes
+#include <boost/archive/polymorphic_text_iarchive.hpp>
+#include <boost/archive/polymorphic_text_oarchive.hpp>
 #include <plot.h>
-#include <shark/Algorithms/DirectSearch/GridSearch.h>
 #include <shark/Algorithms/JaakkolaHeuristic.h>
 #include <shark/Algorithms/Trainers/CSvmTrainer.h>
 #include <shark/Algorithms/Trainers/NormalizeComponentsUnitVariance.h>
 #include <shark/Algorithms/Trainers/PCA.h>
 #include <shark/Algorithms/Trainers/RFTrainer.h>
+#include <shark/Data/CVDatasetTools.h>
 #include <shark/Data/Csv.h>
 #include <shark/Models/ConcatenatedModel.h>
 #include <shark/Models/Kernels/GaussianRbfKernel.h>
 #include <shark/Models/Normalizer.h>
-#include <shark/ObjectiveFunctions/CrossValidationError.h>
 #include <shark/ObjectiveFunctions/Loss/ZeroOneLoss.h>
 
+#include <omp.h>
+
 // stl includes
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <experimental/filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <regex>
+#include <stdexcept>
 #include <streambuf>
+#include <vector>
 
 // application includes
+#include "../classbench.h"
 #include "../ioutils.h"
 #include "../utils.h"
 #include "class_iterator.h"
+#include "flat_forest.h"
 
 // Namespace and type aliases
 namespace fs = std::experimental::filesystem;
@@ -76,42 +88,26 @@ void ShowModel(const shark::ClassificationDataset& true_data,
   shark::LinearModel<> enc;
   pca.encoder(enc, 2);
   shark::Data<shark::RealVector> encoded_data = enc(true_data.inputs());
-  auto& lables = true_data.labels();
-
-  ClassIterator di_0_x(&encoded_data, &lables, 0, 0);
-  ClassIterator di_0_y(&encoded_data, &lables, 0, 1);
-
-  ClassIterator di_1_x(&encoded_data, &lables, 1, 0);
-  ClassIterator di_1_y(&encoded_data, &lables, 1, 1);
-
-  ClassIterator di_2_x(&encoded_data, &lables, 2, 0);
-  ClassIterator di_2_y(&encoded_data, &lables, 2, 1);
-
-  ClassIterator pdi_0_x(&encoded_data, &predictions, 0, 0);
-  ClassIterator pdi_0_y(&encoded_data, &predictions, 0, 1);
-
-  ClassIterator pdi_1_x(&encoded_data, &predictions, 1, 0);
-  ClassIterator pdi_1_y(&encoded_data, &predictions, 1, 1);
-
-  ClassIterator pdi_2_x(&encoded_data, &predictions, 2, 0);
-  ClassIterator pdi_2_y(&encoded_data, &predictions, 2, 1);
+  // every pass over the data builds the index once
+  ClassIndex true_classes(encoded_data, true_data.labels());
+  ClassIndex predicted_classes(encoded_data, predictions);
+  auto points = [](const ClassIndex& index, unsigned int label,
+                   const std::string& title, const std::string& style) {
+    auto x = index.column(label, 0);
+    auto y = index.column(label, 1);
+    return plotcpp::Points(x.begin(), x.end(), y.begin(), title, style);
+  };
 
   plotcpp::Plot plt(true);
   plt.SetTerminal("qt");
   plt.SetAutoscale();
   plt.GnuplotCommand("set grid");
-  plt.Draw2D(plotcpp::Points(di_0_x, ClassIterator(), di_0_y, "class 0",
-                             "lc rgb 'red' pt 4"),
-             plotcpp::Points(di_1_x, ClassIterator(), di_1_y, "class 1",
-                             "lc rgb 'green' pt 4"),
-             plotcpp::Points(di_2_x, ClassIterator(), di_2_y, "class 2",
-                             "lc rgb 'blue' pt 4"),
-             plotcpp::Points(pdi_0_x, ClassIterator(), pdi_0_y, "predict 0",
-                             "lc rgb 'red' pt 1"),
-             plotcpp::Points(pdi_1_x, ClassIterator(), pdi_1_y, "predict 1",
-                             "lc rgb 'green' pt 1"),
-             plotcpp::Points(pdi_2_x, ClassIterator(), pdi_2_y, "predict 2",
-                             "lc rgb 'blue' pt 1"));
+  plt.Draw2D(points(true_classes, 0, "class 0", "lc rgb 'red' pt 4"),
+             points(true_classes, 1, "class 1", "lc rgb 'green' pt 4"),
+             points(true_classes, 2, "class 2", "lc rgb 'blue' pt 4"),
+             points(predicted_classes, 0, "predict 0", "lc rgb 'red' pt 1"),
+             points(predicted_classes, 1, "predict 1", "lc rgb 'green' pt 1"),
+             points(predicted_classes, 2, "predict 2", "lc rgb 'blue' pt 1"));
   plt.Flush();
 }
 
@@ -136,6 +132,29 @@ void EvaluateModel(const std::string& name,
   std::cout << name << " test error = " << test_error << std::endl;
 }
 
+// The forest is evaluated flattened, which scores many samples per tree
+void EvaluateForest(const std::string& name,
+                    const FlatForest& forest,
+                    const shark::Normalizer<shark::RealVector>& normalizer,
+                    const shark::ClassificationDataset& train_data,
+                    const shark::ClassificationDataset& test_data) {
+  shark::ZeroOneLoss<unsigned int> loss;
+  auto start = std::chrono::steady_clock::now();
+  auto output = forest.Predict(train_data.inputs());
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto train_error = loss.eval(train_data.labels(), output);
+  std::cout << name << " train error = " << train_error << " ("
+            << train_data.numberOfElements() / elapsed.count()
+            << " samples/s)" << std::endl;
+
+  ShowModel(train_data, output);
+
+  output = forest.Predict(normalizer(test_data.inputs()));
+  auto test_error = loss.eval(test_data.labels(), output);
+  std::cout << name << " test error = " << test_error << std::endl;
+}
+
 // ----------- SVM classificatoin
 // https://github.com/Shark-ML/Shark/blob/master/examples/Supervised/McSvm.tpp
 // http://www.shark-ml.org/sphinx_pages/build/html/rest_sources/tutorials/algorithms/svm.html
@@ -147,65 +166,269 @@ struct SVMModel {
   // template parameter is input type
   shark::KernelClassifier<shark::RealVector> model;
 };
+// The grid of the unconstrained parameters, the log of the kernel gamma and
+// the log of the regularization parameter C
+struct SVMGridConfig {
+  double log_gamma_radius{4};  // around the Jaakkola heuristic estimate
+  size_t gamma_sections{9};
+  double min_log_c{0};
+  double max_log_c{10};
+  size_t c_sections{11};
+  // a point isn't validated on the rest of the folds, when the errors of the
+  // folds done so far already exceed the best mean error by the margin
+  double prune_margin{0.05};
+};
+
+double GridSection(double min, double max, size_t sections, size_t index) {
+  return sections > 1 ? min + (max - min) * static_cast<double>(index) /
+                                  static_cast<double>(sections - 1)
+                      : min;
+}
+
 auto TrySVM(const shark::ClassificationDataset& train_data,
-            const shark::CVFolds<shark::ClassificationDataset>& folds) {
+            const shark::CVFolds<shark::ClassificationDataset>& folds,
+            const SVMGridConfig& config = {}) {
   double c{1.0};
   double gamma{0.5};
   bool offset = true;
   bool unconstrained = true;
 
-  auto svm = std::make_shared<SVMModel>(gamma, unconstrained);
-
-  shark::CSvmTrainer<shark::RealVector> trainer(&svm->kernel, c, offset,
-                                                unconstrained);
-  trainer.setMcSvmType(shark::McSvm::OVA);  // one-versus-all
-
-  shark::ZeroOneLoss<unsigned int> loss;
-
-  // configure CV
-  shark::CrossValidationError<shark::KernelClassifier<shark::RealVector>,
-                              unsigned int>
-      cv_error(folds, &trainer, &svm->model, &trainer, &loss);
-
   // estimate initial parameters values
   shark::JaakkolaHeuristic ja(train_data);
   double ljg = log(ja.gamma());
 
   // we have two hyperparameters so define the grid accordingly
-  shark::GridSearch grid;
-  std::vector<double> min(2);
-  std::vector<double> max(2);
-  std::vector<size_t> sections(2);
-  // kernel parameter gamma
-  min[0] = ljg - 4.;
-  max[0] = ljg + 4;
-  sections[0] = 9;
-  // regularization parameter C
-  min[1] = 0.0;
-  max[1] = 10.0;
-  sections[1] = 11;
-  grid.configure(min, max, sections);
-  grid.step(cv_error);
-
-  trainer.setParameterVector(grid.solution().point);
+  std::vector<shark::RealVector> grid;
+  for (size_t g = 0; g < config.gamma_sections; ++g) {
+    for (size_t s = 0; s < config.c_sections; ++s) {
+      shark::RealVector point(2);
+      point(0) = GridSection(ljg - config.log_gamma_radius,
+                             ljg + config.log_gamma_radius,
+                             config.gamma_sections, g);
+      point(1) = GridSection(config.min_log_c, config.max_log_c,
+                             config.c_sections, s);
+      grid.push_back(point);
+    }
+  }
+
+  // The points are cross validated in parallel, every thread trains its own
+  // copies of the kernel, the model and the trainer
+  const auto folds_num = folds.size();
+  std::vector<double> errors(grid.size(),
+                             std::numeric_limits<double>::infinity());
+  double best_error = std::numeric_limits<double>::infinity();
+#pragma omp parallel
+  {
+    SVMModel svm(gamma, unconstrained);
+    shark::CSvmTrainer<shark::RealVector> trainer(&svm.kernel, c, offset,
+                                                  unconstrained);
+    trainer.setMcSvmType(shark::McSvm::OVA);  // one-versus-all
+    shark::ZeroOneLoss<unsigned int> loss;
+#pragma omp for schedule(dynamic)
+    for (int64_t i = 0; i < static_cast<int64_t>(grid.size()); ++i) {
+      trainer.setParameterVector(grid[static_cast<size_t>(i)]);
+      double error_sum = 0;
+      size_t fold = 0;
+      for (; fold < folds_num; ++fold) {
+        trainer.train(svm.model, folds.training(fold));
+        auto validation = folds.validation(fold);
+        error_sum +=
+            loss.eval(validation.labels(), svm.model(validation.inputs()));
+        double best = 0;
+#pragma omp critical(best_error)
+        best = best_error;
+        if (error_sum / folds_num > best + config.prune_margin)
+          break;  // the mean error can't become better
+      }
+      if (fold == folds_num) {
+        errors[static_cast<size_t>(i)] = error_sum / folds_num;
+#pragma omp critical(best_error)
+        best_error = std::min(best_error, errors[static_cast<size_t>(i)]);
+      }
+    }
+  }
+  auto best_point = std::distance(
+      errors.begin(), std::min_element(errors.begin(), errors.end()));
+  std::cout << "svm best cross validation error = " << errors[best_point]
+            << std::endl;
+
+  auto svm = std::make_shared<SVMModel>(gamma, unconstrained);
+  shark::CSvmTrainer<shark::RealVector> trainer(&svm->kernel, c, offset,
+                                                unconstrained);
+  trainer.setMcSvmType(shark::McSvm::OVA);  // one-versus-all
+  trainer.setParameterVector(grid[static_cast<size_t>(best_point)]);
   trainer.train(svm->model, train_data);
   return svm;
 }
 
 // ----------- Random Forest classification
 // http://www.shark-ml.org/sphinx_pages/build/html/rest_sources/tutorials/algorithms/rf.html
+struct RFConfig {
+  size_t trees{100};
+  int threads{omp_get_max_threads()};
+};
+
 auto TryRF(const shark::ClassificationDataset& train_data,
-           const shark::CVFolds<shark::ClassificationDataset>& folds) {
+           const RFConfig& config = {}) {
   // template parameter is label type
   shark::RFTrainer<unsigned int> trainer;
+  trainer.setNTrees(config.trees);
+  // the trainer builds the trees in parallel with the OpenMP threads
+  omp_set_num_threads(config.threads);
   auto rf = std::make_shared<shark::RFClassifier<unsigned int>>();
   trainer.train(*rf, train_data);
   return rf;
 }
 
-int main(int, char* []) {
+// ----------- Persist the trained models, so scoring doesn't retrain them
+template <typename Object>
+void SaveObject(const Object& object, const fs::path& path) {
+  std::ofstream file(path.string());
+  if (!file)
+    throw std::runtime_error(path.string() + " file can't be opened");
+  boost::archive::polymorphic_text_oarchive archive(file);
+  object.write(archive);
+}
+
+template <typename Object>
+void LoadObject(Object& object, const fs::path& path) {
+  std::ifstream file(path.string());
+  if (!file)
+    throw std::runtime_error(path.string() + " file can't be opened");
+  boost::archive::polymorphic_text_iarchive archive(file);
+  object.read(archive);
+}
+
+void SaveModels(const fs::path& dir,
+                const shark::Normalizer<shark::RealVector>& normalizer,
+                const SVMModel& svm,
+                const shark::RFClassifier<unsigned int>& rf) {
+  fs::create_directories(dir);
+  SaveObject(normalizer, dir / "normalizer.txt");
+  SaveObject(svm.model, dir / "svm.txt");  // includes the kernel parameters
+  SaveObject(rf, dir / "rf.txt");
+}
+
+void ScoreModels(const fs::path& dir,
+                 const shark::ClassificationDataset& data) {
+  auto start = std::chrono::steady_clock::now();
+  shark::Normalizer<shark::RealVector> normalizer;
+  LoadObject(normalizer, dir / "normalizer.txt");
+  SVMModel svm(0.5, true);
+  // the expansion reads the parameters to the kernel it points to
+  svm.model.decisionFunction().setKernel(&svm.kernel);
+  LoadObject(svm.model, dir / "svm.txt");
+  shark::RFClassifier<unsigned int> rf;
+  LoadObject(rf, dir / "rf.txt");
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "Models loaded in " << elapsed.count() << " ms" << std::endl;
+
+  auto inputs = normalizer(data.inputs());
+  shark::ZeroOneLoss<unsigned int> loss;
+  std::cout << "svm error = " << loss.eval(data.labels(), svm.model(inputs))
+            << std::endl;
+  std::cout << "random forest error = "
+            << loss.eval(data.labels(), FlatForest(rf).Predict(inputs))
+            << std::endl;
+}
+
+// ----------- Benchmark on the synthetic data shared with the other libraries,
+// see classbench.h
+shark::ClassificationDataset ToDataset(const utils::LabeledRows<double>& rows) {
+  std::vector<shark::RealVector> inputs(rows.rows(),
+                                        shark::RealVector(rows.columns));
+  std::vector<unsigned int> labels(rows.rows());
+  for (size_t r = 0; r < rows.rows(); ++r) {
+    std::copy_n(rows.row(r), rows.columns, inputs[r].begin());
+    labels[r] = static_cast<unsigned int>(rows.labels[r]);
+  }
+  return shark::createLabeledDataFromRange(inputs, labels);
+}
+
+std::vector<unsigned int> ToVector(const shark::Data<unsigned int>& data) {
+  std::vector<unsigned int> result;
+  result.reserve(data.numberOfElements());
+  for (auto label : data.elements())
+    result.push_back(label);
+  return result;
+}
+
+int BenchMain(size_t rows,
+              size_t features,
+              const std::string& json_file,
+              const RFConfig& rf_config) {
+  auto data = utils::SyntheticClassificationData<double>(rows, features);
+  utils::ClassBenchReport report("shark", rows, features, json_file);
+  auto train_data = ToDataset(data.first);
+  auto test_data = ToDataset(data.second);
+
+  // the standardization is a part of the SVM stages, like in the other
+  // backends, the forest takes the raw features
+  shark::Normalizer<shark::RealVector> normalizer;
+  SVMModel svm(1. / features, false);
+  report.Measure("svm", "train", data.first.rows(), [&]() {
+    shark::NormalizeComponentsUnitVariance<shark::RealVector>
+        normalizing_trainer(true);
+    normalizing_trainer.train(normalizer, train_data.inputs());
+    shark::CSvmTrainer<shark::RealVector> trainer(&svm.kernel, 10, true);
+    trainer.setMcSvmType(shark::McSvm::OVA);  // one-versus-all
+    trainer.train(svm.model, shark::transformInputs(train_data, normalizer));
+  });
+  shark::Data<unsigned int> output;
+  report.Measure("svm", "predict", data.second.rows(), [&]() {
+    output = svm.model(normalizer(test_data.inputs()));
+  });
+  report.Accuracy("svm", utils::Accuracy(ToVector(output), data.second.labels));
+
+  std::shared_ptr<shark::RFClassifier<unsigned int>> rf;
+  report.Measure("rf", "train", data.first.rows(),
+                 [&]() { rf = TryRF(train_data, rf_config); });
+  FlatForest forest(*rf);
+  report.Measure("rf", "predict", data.second.rows(),
+                 [&]() { output = forest.Predict(test_data.inputs()); });
+  report.Accuracy("rf", utils::Accuracy(ToVector(output), data.second.labels));
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
   try {
+    fs::path save_dir;
+    fs::path load_dir;
+    RFConfig rf_config;
+    size_t bench_rows = 0;
+    size_t bench_features = 4;
+    std::string bench_json;
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--save-models" && i + 1 < argc) {
+        save_dir = argv[++i];
+      } else if (arg == "--load-models" && i + 1 < argc) {
+        load_dir = argv[++i];
+      } else if (arg == "--trees" && i + 1 < argc) {
+        rf_config.trees = std::stoul(argv[++i]);
+      } else if (arg == "--threads" && i + 1 < argc) {
+        rf_config.threads = std::stoi(argv[++i]);
+      } else if (arg == "--bench" && i + 2 < argc) {
+        bench_rows = std::stoul(argv[++i]);
+        bench_features = std::stoul(argv[++i]);
+      } else if (arg == "--bench-json" && i + 1 < argc) {
+        bench_json = argv[++i];
+      } else {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--trees n] [--threads n]"
+                     " [--save-models dir | --load-models dir]"
+                     " [--bench rows features [--bench-json file]]\n";
+        return 1;
+      }
+    }
+    if (bench_rows > 0)
+      return BenchMain(bench_rows, bench_features, bench_json, rf_config);
     shark::ClassificationDataset train_data = LoadData();
+    if (!load_dir.empty()) {
+      ScoreModels(load_dir, train_data);
+      return 0;
+    }
     // ----------- Preprocess data
     // www.shark-ml.org/sphinx_pages/build/html/rest_sources/tutorials/concepts/data/normalization.html
     train_data.shuffle();
@@ -228,9 +451,12 @@ int main(int, char* []) {
     EvaluateModel("svm", svm_model->model, normalizer, train_data, test_data);
 
     // ----------- Random Forest classificatoin
-    auto rf_model = TryRF(train_data, folds);
-    EvaluateModel("random forest", *rf_model, normalizer, train_data,
-                  test_data);
+    auto rf_model = TryRF(train_data, rf_config);
+    EvaluateForest("random forest", FlatForest(*rf_model), normalizer,
+                   train_data, test_data);
+
+    if (!save_dir.empty())
+      SaveModels(save_dir, normalizer, *svm_model, *rf_model);
 
   } catch (const std::exception& err) {
     std::cout << "Program crashed : " << err.what() << std::endl;
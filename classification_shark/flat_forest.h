@@ -0,0 +1,146 @@
+#ifndef FLAT_FOREST_H
+#define FLAT_FOREST_H
+
+#include <shark/Data/Dataset.h>
+#include <shark/Models/Trees/RFClassifier.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Random forest flattened for the inference. The nodes of all the trees are
+// stored in the breadth first order in plain arrays, the children of a node
+// are neighbours, so a node is a feature index, a threshold and one child
+// offset. A leaf points to its class histogram. A block of samples is passed
+// down a tree before the next one is taken, so the tree stays in the cache
+// for the whole block, and the blocks are spread over the OpenMP threads.
+class FlatForest {
+ public:
+  explicit FlatForest(const shark::RFClassifier<unsigned int>& forest) {
+    std::vector<std::vector<double>> histograms;
+    for (size_t t = 0; t < forest.numberOfModels(); ++t)
+      AddTree(forest.model(t), histograms);
+    // the histograms are packed when the number of classes is known
+    histograms_.reserve(histograms.size() * classes_);
+    for (const auto& histogram : histograms) {
+      histograms_.insert(histograms_.end(), histogram.begin(),
+                         histogram.end());
+      histograms_.resize(histograms_.size() + classes_ - histogram.size(), 0);
+    }
+  }
+
+  size_t trees() const { return roots_.size(); }
+
+  // The class with the largest mean of the leaf histograms, the same as
+  // RFClassifier, its trees have equal weights
+  std::vector<unsigned int> Predict(const double* samples,
+                                    size_t rows,
+                                    size_t columns) const {
+    std::vector<unsigned int> labels(rows);
+    const auto blocks = static_cast<int64_t>((rows + kBlock - 1) / kBlock);
+#pragma omp parallel for schedule(static)
+    for (int64_t block = 0; block < blocks; ++block) {
+      auto begin = static_cast<size_t>(block) * kBlock;
+      auto end = std::min(begin + kBlock, rows);
+      std::vector<double> sums((end - begin) * classes_, 0);
+      for (auto root : roots_) {
+        for (size_t r = begin; r < end; ++r) {
+          const double* sample = samples + r * columns;
+          auto node = root;
+          while (feature_[node] >= 0) {
+            node = child_[node] +
+                   (sample[feature_[node]] <= threshold_[node] ? 0 : 1);
+          }
+          const double* histogram = &histograms_[child_[node] * classes_];
+          double* sum = &sums[(r - begin) * classes_];
+          for (size_t c = 0; c < classes_; ++c)
+            sum[c] += histogram[c];
+        }
+      }
+      // the sums are divided like the mean of shark, so the ties are the same
+      const auto trees_num = static_cast<double>(roots_.size());
+      for (size_t r = begin; r < end; ++r) {
+        double* first = &sums[(r - begin) * classes_];
+        for (auto i = first; i != first + classes_; ++i)
+          *i /= trees_num;
+        labels[r] = static_cast<unsigned int>(
+            std::max_element(first, first + classes_) - first);
+      }
+    }
+    return labels;
+  }
+
+  shark::Data<unsigned int> Predict(
+      const shark::Data<shark::RealVector>& data) const {
+    auto columns = data.numberOfElements() > 0 ? data.element(0).size() : 0;
+    std::vector<double> samples;
+    samples.reserve(data.numberOfElements() * columns);
+    for (const auto& sample : data.elements())
+      samples.insert(samples.end(), sample.begin(), sample.end());
+    return shark::createDataFromRange(
+        Predict(samples.data(), data.numberOfElements(), columns));
+  }
+
+ private:
+  // Samples passed down a tree together
+  static const size_t kBlock = 64;
+
+  // A leaf with a single label is a one hot histogram
+  static std::vector<double> LeafHistogram(unsigned int label) {
+    std::vector<double> histogram(label + 1, 0);
+    histogram[label] = 1;
+    return histogram;
+  }
+  static std::vector<double> LeafHistogram(const shark::RealVector& label) {
+    return std::vector<double>(label.begin(), label.end());
+  }
+
+  template <typename Tree>
+  void AddTree(const Tree& tree, std::vector<std::vector<double>>& histograms) {
+    // the shark nodes are indexed by the ids, a leaf has no left child
+    roots_.push_back(static_cast<uint32_t>(feature_.size()));
+    std::deque<size_t> queue{0};
+    Append(tree.getNode(0), histograms);
+    while (!queue.empty()) {
+      auto local = queue.front();  // index in the current tree
+      queue.pop_front();
+      const auto& node = tree.getNode(ids_[local]);
+      if (node.leftNodeId == 0)
+        continue;
+      child_[roots_.back() + local] = static_cast<uint32_t>(feature_.size());
+      for (auto id : {node.leftNodeId, node.rightNodeId}) {
+        queue.push_back(feature_.size() - roots_.back());
+        Append(tree.getNode(id), histograms);
+      }
+    }
+    ids_.clear();
+  }
+
+  template <typename Node>
+  void Append(const Node& node, std::vector<std::vector<double>>& histograms) {
+    ids_.push_back(node.nodeId);
+    if (node.leftNodeId == 0) {
+      histograms.push_back(LeafHistogram(node.label));
+      classes_ = std::max(classes_, histograms.back().size());
+      feature_.push_back(-1);
+      threshold_.push_back(0);
+      // the histogram of a leaf
+      child_.push_back(static_cast<uint32_t>(histograms.size() - 1));
+    } else {
+      feature_.push_back(static_cast<int32_t>(node.attributeIndex));
+      threshold_.push_back(node.attributeValue);
+      child_.push_back(0);
+    }
+  }
+
+  std::vector<int32_t> feature_;  // -1 for the leaves
+  std::vector<double> threshold_;
+  std::vector<uint32_t> child_;  // the left child, the right one is next
+  std::vector<uint32_t> roots_;
+  std::vector<double> histograms_;  // classes_ values per leaf
+  size_t classes_{0};
+  std::vector<size_t> ids_;  // shark ids of the nodes of the current tree
+};
+
+#endif  // FLAT_FOREST_H
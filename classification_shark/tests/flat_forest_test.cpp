@@ -0,0 +1,43 @@
+#include "catch.hpp"
+
+#include "../flat_forest.h"
+
+#include <shark/Algorithms/Trainers/RFTrainer.h>
+#include <shark/Data/Dataset.h>
+
+#include <random>
+#include <vector>
+
+namespace {
+// Overlapping blobs of three classes, so the trees disagree on many samples
+shark::ClassificationDataset Blobs(size_t rows, unsigned int seed) {
+  std::mt19937 mt(seed);
+  std::normal_distribution<double> noise(0, 1.5);
+  std::vector<shark::RealVector> inputs(rows, shark::RealVector(2));
+  std::vector<unsigned int> labels(rows);
+  for (size_t i = 0; i < rows; ++i) {
+    labels[i] = static_cast<unsigned int>(i % 3);
+    inputs[i][0] = labels[i] + noise(mt);
+    inputs[i][1] = (labels[i] == 1 ? 1.0 : 0.0) + noise(mt);
+  }
+  return shark::createLabeledDataFromRange(inputs, labels);
+}
+}  // namespace
+
+TEST_CASE("Flat forest predicts as the random forest", "[flat_forest]") {
+  shark::RFTrainer<unsigned int> trainer;
+  trainer.setNTrees(25);
+  shark::RFClassifier<unsigned int> rf;
+  trainer.train(rf, Blobs(600, 1));
+
+  FlatForest forest(rf);
+  REQUIRE(forest.trees() == 25);
+  auto test_data = Blobs(400, 2);
+  auto expected = rf(test_data.inputs());
+  auto predicted = forest.Predict(test_data.inputs());
+  REQUIRE(predicted.numberOfElements() == expected.numberOfElements());
+  size_t mismatches = 0;
+  for (size_t i = 0; i < expected.numberOfElements(); ++i)
+    mismatches += predicted.element(i) != expected.element(i) ? 1 : 0;
+  REQUIRE(mismatches == 0);
+}
@@ -11,6 +11,8 @@
 #include <shogun/features/CombinedFeatures.h>
 #include <shogun/features/DenseFeatures.h>
 #include <shogun/io/File.h>
+#include <shogun/io/SerializableAsciiFile.h>
+#include <shogun/kernel/CustomKernel.h>
 #include <shogun/kernel/GaussianKernel.h>
 #include <shogun/kernel/LinearKernel.h>
 #include <shogun/labels/MulticlassLabels.h>
@@ -22,17 +24,25 @@
 #include <shogun/mathematics/Math.h>
 #include <shogun/multiclass/MulticlassLibSVM.h>
 #include <shogun/preprocessor/PCA.h>
+#include <shogun/preprocessor/PruneVarSubMean.h>
 #include <shogun/preprocessor/RescaleFeatures.h>
 #include <shogun/util/factory.h>
 
 #include <omp.h>
 
 // stl includes
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <vector>
 
+// application includes
+#include "../classbench.h"
+#include "../csvloader.h"
+
 const std::string train_data_file_name =
     "/home/kirill/development/dataset/iris/iris.csv";
 
@@ -43,36 +53,17 @@ using Matrix = shogun::SGMatrix<DType>;
 using Data = std::tuple<shogun::Some<shogun::CDenseFeatures<DType>>,
                         shogun::Some<shogun::CMulticlassLabels>>;
 
-Data load_data(const std::string& file_name) {
+// The rows of the loader are the samples, so its row major features are
+// already in the shogun column major layout with the samples in colums
+Data to_data(const utils::LabeledRows<DType>& data) {
   // We can't define objects of types nherited from CSGObject on stack, because
   // algorithms use reference counting for such types of objects, and take it as
   // input parameter by pointer.
-
-  auto data_file = shogun::some<shogun::CCSVFile>(file_name.c_str());
-
-  // skip lables row
-  data_file->set_lines_to_skip(1);
-
-  // Shogun csv reader transpose data from file - restore right order
-  // commented because some time leads to crash ???
-  // data_file->set_transpose(true);
-
-  // Load data from CSV to matrix
-  // Matrix object can be created on stack
-  Matrix data;
-  data.load(data_file);
-
-  Matrix::transpose_matrix(data.matrix, data.num_rows, data.num_cols);
-
-  // Exclude classification info from data
-  Matrix data_no_class = data.submatrix(0, data.num_cols - 1);  // make a view
-  data_no_class = data_no_class.clone();  // copy exact data
-
-  // Transpose because shogun algorithms expect that samples are in colums
-  Matrix::transpose_matrix(data_no_class.matrix, data_no_class.num_rows,
-                           data_no_class.num_cols);
-
-  auto features = shogun::some<shogun::CDenseFeatures<DType>>(data_no_class);
+  Matrix features_matrix(static_cast<index_t>(data.columns),
+                         static_cast<index_t>(data.rows()));
+  std::copy(data.features.begin(), data.features.end(),
+            features_matrix.matrix);
+  auto features = shogun::some<shogun::CDenseFeatures<DType>>(features_matrix);
 
   // features->get_feature_matrix().display_matrix();
 
@@ -84,11 +75,9 @@ Data load_data(const std::string& file_name) {
 
   std::cout << "labels = " << labels->get_num_labels() << std::endl;
 
-  for (int i = 0; i < labels->get_num_labels() / 3; ++i) {
-    labels->set_int_label(i, 0);
-    labels->set_int_label(i + 50, 1);
-    labels->set_int_label(i + 100, 2);
-  }
+  // the ids of the classes follow their order in the file
+  for (index_t i = 0; i < labels->get_num_labels(); ++i)
+    labels->set_int_label(i, static_cast<int32_t>(data.labels[i]));
 
   // shuffle data
   //  shogun::SGVector<index_t> indices(labels->get_num_labels());
@@ -102,6 +91,14 @@ Data load_data(const std::string& file_name) {
   return std::make_tuple(features, labels);
 }
 
+Data load_data(const std::string& file_name) {
+  // Parse the features and the class names in one pass
+  auto data = utils::LoadLabeledCsv<DType>(file_name, 0);
+  if (data.invalid_rows != 0)
+    std::cout << "skipped invalid rows = " << data.invalid_rows << std::endl;
+  return to_data(data);
+}
+
 void show_accuracy(shogun::Some<shogun::CMulticlassLabels> prediction,
                    shogun::Some<shogun::CMulticlassLabels> truth) {
   auto mult_accuracy_eval = shogun::wrap(new shogun::CMulticlassAccuracy());
@@ -115,10 +112,20 @@ void show_accuracy(shogun::Some<shogun::CMulticlassLabels> prediction,
   }
 }
 
-void random_forest(Data train_data) {
+struct TrainConfig {
+  int threads{omp_get_max_threads()};
+  int32_t trees{10};
+  int folds{2};
+  // the folds share one precomputed kernel matrix and run concurrently
+  bool cached_kernel{false};
+};
+
+shogun::Some<shogun::CMachine> random_forest(Data train_data,
+                                             const TrainConfig& config) {
   std::cout << "Train Random Forest ..." << std::endl;
   auto vote = shogun::some<shogun::CMajorityVote>();
-  auto rand_forest = shogun::some<shogun::CRandomForest>(0, 10);
+  // the bagging machine trains the trees on the shogun threads
+  auto rand_forest = shogun::some<shogun::CRandomForest>(0, config.trees);
   rand_forest->set_combination_rule(vote);
   auto featureTypes =
       shogun::SGVector<bool>(std::get<0>(train_data)->get_num_features());
@@ -140,9 +147,86 @@ void random_forest(Data train_data) {
 
   // estimate accuracy
   show_accuracy(forest_predict, std::get<1>(train_data));
+  return shogun::wrap<shogun::CMachine>(rand_forest.get());
 }
 
-void svm(Data train_data) {
+// Cross validation with the Gaussian kernel computed once for all the
+// samples. Every fold gets its own custom kernel, which shares the matrix and
+// selects the rows of the training samples and the columns of the training or
+// the validation ones, so the folds are independent and run in parallel.
+void cached_kernel_cv(Data train_data, const TrainConfig& config) {
+  auto features = std::get<0>(train_data);
+  auto labels = std::get<1>(train_data);
+  auto kernel = shogun::wrap(new shogun::CGaussianKernel(5));
+  kernel->init(features, features);
+  auto full_matrix = kernel->get_kernel_matrix();
+  // the custom kernel keeps float32 values, the matrix of this type is
+  // shared by the fold kernels without a copy
+  shogun::SGMatrix<float32_t> kernel_matrix(full_matrix.num_rows,
+                                            full_matrix.num_cols);
+  std::copy(full_matrix.matrix,
+            full_matrix.matrix + full_matrix.num_rows * full_matrix.num_cols,
+            kernel_matrix.matrix);
+  full_matrix = shogun::SGMatrix<DType>();
+
+  auto splitting = shogun::some<shogun::CCrossValidationSplitting>(
+      labels, config.folds);
+  splitting->build_subsets();
+  auto label_values = labels->get_labels();
+
+  std::vector<double> accuracy(static_cast<size_t>(config.folds));
+  std::vector<double> train_ms(accuracy.size());
+  std::vector<double> apply_ms(accuracy.size());
+#pragma omp parallel for schedule(dynamic) num_threads(config.threads)
+  for (int fold = 0; fold < config.folds; ++fold) {
+    auto train_indices = splitting->generate_subset_inverse(fold);
+    auto validation_indices = splitting->generate_subset_indices(fold);
+    auto subset_labels = [&](const shogun::SGVector<index_t>& indices) {
+      shogun::SGVector<DType> values(indices.vlen);
+      for (index_t i = 0; i < indices.vlen; ++i)
+        values[i] = label_values[indices[i]];
+      return shogun::wrap(new shogun::CMulticlassLabels(values));
+    };
+
+    auto fold_kernel = shogun::some<shogun::CCustomKernel>(kernel_matrix);
+    fold_kernel->add_row_subset(train_indices);
+    fold_kernel->add_col_subset(train_indices);
+    auto fold_svm = shogun::some<shogun::CMulticlassLibSVM>();
+    fold_svm->set_kernel(fold_kernel);
+    fold_svm->set_C(1);
+    fold_svm->set_epsilon(0.00001);
+    fold_svm->set_labels(subset_labels(train_indices));
+
+    auto start = std::chrono::steady_clock::now();
+    fold_svm->train();
+    auto trained = std::chrono::steady_clock::now();
+    // the support vectors are the rows, the validation samples the columns
+    fold_kernel->remove_col_subset();
+    fold_kernel->add_col_subset(validation_indices);
+    auto predict = shogun::wrap(fold_svm->apply_multiclass());
+    auto applied = std::chrono::steady_clock::now();
+
+    auto evaluation = shogun::some<shogun::CMulticlassAccuracy>();
+    accuracy[fold] =
+        evaluation->evaluate(predict, subset_labels(validation_indices));
+    train_ms[fold] =
+        std::chrono::duration<double, std::milli>(trained - start).count();
+    apply_ms[fold] =
+        std::chrono::duration<double, std::milli>(applied - trained).count();
+  }
+
+  double mean_accuracy = 0;
+  for (size_t fold = 0; fold < accuracy.size(); ++fold) {
+    std::cout << "fold " << fold << " train = " << train_ms[fold]
+              << " ms apply = " << apply_ms[fold]
+              << " ms accuracy = " << accuracy[fold] << std::endl;
+    mean_accuracy += accuracy[fold] / accuracy.size();
+  }
+  std::cout << "Validation accuracy = " << mean_accuracy << std::endl;
+}
+
+shogun::Some<shogun::CMachine> svm(Data train_data,
+                                   const TrainConfig& config) {
   std::cout << "Train SVM ..." << std::endl;
 
   auto kernel = shogun::wrap(new shogun::CGaussianKernel(5));
@@ -151,8 +235,23 @@ void svm(Data train_data) {
   svm->set_kernel(kernel);
   svm->set_C(1);
   svm->set_epsilon(0.00001);
+  // keep the support vectors in the model, so it can be saved and applied
+  // without the training features
+  svm->set_store_model_features(true);
+
+  if (config.cached_kernel) {
+    cached_kernel_cv(train_data, config);
+    svm->set_labels(std::get<1>(train_data));
+    svm->train(std::get<0>(train_data));
+
+    std::cout << "Evaluate ..." << std::endl;
+    auto svm_predict =
+        shogun::wrap(svm->apply_multiclass(std::get<0>(train_data)));
+    show_accuracy(svm_predict, std::get<1>(train_data));
+    return shogun::wrap<shogun::CMachine>(svm.get());
+  }
 
-  const int num_subsets = 2;
+  const int num_subsets = config.folds;
   auto splitting_strategy = shogun::some<shogun::CCrossValidationSplitting>(
       std::get<1>(train_data), num_subsets);
 
@@ -183,13 +282,170 @@ void svm(Data train_data) {
 
   // estimate accuracy
   show_accuracy(svm_predict, std::get<1>(train_data));
+  return shogun::wrap(machine);
 }
 
-int main(int, char* []) {
+// Persist the trained objects, so scoring doesn't retrain them
+void save_object(shogun::CSGObject* object, const std::string& file_name) {
+  auto file = shogun::some<shogun::CSerializableAsciiFile>(file_name.c_str(),
+                                                          'w');
+  if (!object->save_serializable(file))
+    throw std::runtime_error("Failed to save " + file_name);
+  file->close();
+}
+
+template <typename T>
+shogun::Some<T> load_object(const std::string& file_name) {
+  auto file = shogun::some<shogun::CSerializableAsciiFile>(file_name.c_str(),
+                                                          'r');
+  auto object = shogun::some<T>();
+  if (!object->load_serializable(file))
+    throw std::runtime_error("Failed to load " + file_name);
+  file->close();
+  return object;
+}
+
+// Scoring with the saved preprocessors and models, the files are
+// <prefix>scaler.txt, pca.txt, svm.txt and random_forest.txt
+void score(const std::string& prefix) {
+  std::cout << "Loading models ..." << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  auto scaler = load_object<shogun::CRescaleFeatures>(prefix + "scaler.txt");
+  auto pca = load_object<shogun::CPCA>(prefix + "pca.txt");
+  auto svm = load_object<shogun::CMulticlassLibSVM>(prefix + "svm.txt");
+  auto forest =
+      load_object<shogun::CRandomForest>(prefix + "random_forest.txt");
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "Models loaded in " << elapsed.count() << " ms" << std::endl;
+
+  auto data = load_data(train_data_file_name);
+  scaler->apply_to_feature_matrix(std::get<0>(data));
+  pca->apply_to_feature_matrix(std::get<0>(data));
+  std::cout << "SVM ..." << std::endl;
+  show_accuracy(shogun::wrap(svm->apply_multiclass(std::get<0>(data))),
+                std::get<1>(data));
+  std::cout << "Random Forest ..." << std::endl;
+  show_accuracy(shogun::wrap(forest->apply_multiclass(std::get<0>(data))),
+                std::get<1>(data));
+}
+
+// Benchmark on the synthetic data shared with the other libraries, see
+// classbench.h
+std::vector<size_t> to_vector(shogun::CMulticlassLabels* labels) {
+  std::vector<size_t> result(static_cast<size_t>(labels->get_num_labels()));
+  for (index_t i = 0; i < labels->get_num_labels(); ++i)
+    result[static_cast<size_t>(i)] =
+        static_cast<size_t>(labels->get_int_label(i));
+  return result;
+}
+
+int bench(size_t rows,
+          size_t features,
+          const std::string& json_file,
+          const TrainConfig& config) {
+  auto data = utils::SyntheticClassificationData<DType>(rows, features);
+  utils::ClassBenchReport report("shogun", rows, features, json_file);
+  // the features are standardized in place, so the SVM has own copies
+  auto svm_train_data = to_data(data.first);
+  auto svm_test_data = to_data(data.second);
+  auto train_data = to_data(data.first);
+  auto test_data = to_data(data.second);
+
+  // the standardization is a part of the SVM stages, like in the other
+  // backends, the forest takes the raw features
+  auto standardizer = shogun::some<shogun::CPruneVarSubMean>(true);
+  auto svm = shogun::some<shogun::CMulticlassLibSVM>();
+  // the shogun Gaussian kernel is exp(-|x-y|^2 / width), the gamma of the
+  // other backends is 1 / features
+  svm->set_kernel(
+      shogun::wrap(new shogun::CGaussianKernel(static_cast<double>(features))));
+  svm->set_C(10);
+  svm->set_labels(std::get<1>(svm_train_data));
+  report.Measure("svm", "train", data.first.rows(), [&]() {
+    standardizer->init(std::get<0>(svm_train_data));
+    standardizer->apply_to_feature_matrix(std::get<0>(svm_train_data));
+    svm->train(std::get<0>(svm_train_data));
+  });
+  shogun::Some<shogun::CMulticlassLabels> predict;
+  report.Measure("svm", "predict", data.second.rows(), [&]() {
+    standardizer->apply_to_feature_matrix(std::get<0>(svm_test_data));
+    predict = shogun::wrap(svm->apply_multiclass(std::get<0>(svm_test_data)));
+  });
+  report.Accuracy("svm", utils::Accuracy(to_vector(predict),
+                                         data.second.labels));
+
+  auto rand_forest = shogun::some<shogun::CRandomForest>(0, config.trees);
+  rand_forest->set_combination_rule(shogun::some<shogun::CMajorityVote>());
+  shogun::SGVector<bool> feature_types(static_cast<index_t>(features));
+  shogun::SGVector<bool>::fill_vector(feature_types.vector,
+                                      feature_types.size(), false);
+  rand_forest->set_feature_types(feature_types);
+  rand_forest->set_labels(std::get<1>(train_data));
+  rand_forest->set_machine_problem_type(shogun::EProblemType::PT_MULTICLASS);
+  report.Measure("rf", "train", data.first.rows(),
+                 [&]() { rand_forest->train(std::get<0>(train_data)); });
+  report.Measure("rf", "predict", data.second.rows(), [&]() {
+    predict =
+        shogun::wrap(rand_forest->apply_multiclass(std::get<0>(test_data)));
+  });
+  report.Accuracy("rf", utils::Accuracy(to_vector(predict),
+                                        data.second.labels));
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  std::string save_prefix;
+  std::string load_prefix;
+  TrainConfig config;
+  size_t bench_rows = 0;
+  size_t bench_features = 4;
+  std::string bench_json;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--save-models" && i + 1 < argc) {
+      save_prefix = argv[++i];
+    } else if (arg == "--load-models" && i + 1 < argc) {
+      load_prefix = argv[++i];
+    } else if (arg == "--threads" && i + 1 < argc) {
+      config.threads = std::stoi(argv[++i]);
+    } else if (arg == "--trees" && i + 1 < argc) {
+      config.trees = std::stoi(argv[++i]);
+    } else if (arg == "--folds" && i + 1 < argc) {
+      config.folds = std::stoi(argv[++i]);
+    } else if (arg == "--cached-kernel") {
+      config.cached_kernel = true;
+    } else if (arg == "--bench" && i + 2 < argc) {
+      bench_rows = std::stoul(argv[++i]);
+      bench_features = std::stoul(argv[++i]);
+    } else if (arg == "--bench-json" && i + 1 < argc) {
+      bench_json = argv[++i];
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--threads n] [--trees n] [--folds n] [--cached-kernel]"
+                   " [--save-models prefix | --load-models prefix]"
+                   " [--bench rows features [--bench-json file]]\n";
+      return 1;
+    }
+  }
+
   shogun::init_shogun_with_defaults();
+  shogun::get_global_parallel()->set_num_threads(config.threads);
   // shogun::sg_io->set_loglevel(shogun::MSG_INFO);
   shogun::sg_rand->set_seed(10);
 
+  if (!load_prefix.empty()) {
+    score(load_prefix);
+    shogun::exit_shogun();
+    return 0;
+  }
+
+  if (bench_rows > 0) {
+    auto result = bench(bench_rows, bench_features, bench_json, config);
+    shogun::exit_shogun();
+    return result;
+  }
+
   // load data
   std::cout << "Loading train data ..." << std::endl;
   auto train_data = load_data(train_data_file_name);
@@ -208,8 +464,15 @@ int main(int, char* []) {
   pca->apply_to_feature_matrix(std::get<0>(train_data));
 
   // Try models
-  svm(train_data);
-  random_forest(train_data);
+  auto svm_machine = svm(train_data, config);
+  auto forest_machine = random_forest(train_data, config);
+
+  if (!save_prefix.empty()) {
+    save_object(scaler, save_prefix + "scaler.txt");
+    save_object(pca, save_prefix + "pca.txt");
+    save_object(svm_machine, save_prefix + "svm.txt");
+    save_object(forest_machine, save_prefix + "random_forest.txt");
+  }
 
   shogun::exit_shogun();
   return 0;
@@ -0,0 +1,129 @@
+#ifndef CROSSVAL_H
+#define CROSSVAL_H
+
+#include "streamfit.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+/*
+ * K-fold cross validation of the polynomial degree. The design matrices of
+ * the lower degrees are column prefixes of the one of the highest degree, so
+ * the sums of the powers P^T*P and P^T*y of every fold are accumulated once
+ * for the highest degree. The normal equation of a degree d is the leading
+ * d x d block of the sums, the training sums of a fold are the total minus
+ * the fold ones, and the validation error comes from the fold sums without
+ * the rows. The search costs one pass over the data and the solution of
+ * degrees * folds small systems, which are solved in parallel.
+ */
+namespace utils {
+
+struct DegreeScore {
+  size_t degree{0};  // number of the coefficients, the powers 0..degree-1
+  double validation_mse{std::numeric_limits<double>::infinity()};
+};
+
+namespace detail {
+// Leading degree x degree block of the sums
+inline void PrefixSums(const PowerSums& sums,
+                       size_t degree,
+                       std::vector<double>& ptp,
+                       std::vector<double>& pty) {
+  ptp.resize(degree * degree);
+  pty.assign(sums.pty.begin(), sums.pty.begin() + degree);
+  for (size_t i = 0; i < degree; ++i)
+    for (size_t j = 0; j < degree; ++j)
+      ptp[i * degree + j] = sums.ptp[i * sums.degree + j];
+}
+
+// Sum of the squared errors over the fold
+inline DegreeScore ScoreDegree(const PowerSums& total,
+                               const std::vector<PowerSums>& folds,
+                               size_t degree) {
+  DegreeScore score;
+  score.degree = degree;
+  double sse = 0;
+  std::vector<double> ptp, pty, b;
+  for (const auto& fold : folds) {
+    PrefixSums(total, degree, ptp, b);
+    std::vector<double> fold_ptp, fold_pty;
+    PrefixSums(fold, degree, fold_ptp, fold_pty);
+    for (size_t i = 0; i < ptp.size(); ++i)
+      ptp[i] -= fold_ptp[i];
+    for (size_t i = 0; i < degree; ++i)
+      b[i] -= fold_pty[i];
+    if (!SolveCholesky(ptp, b))
+      return score;  // ill-conditioned degree isn't selected
+    sse += NormalEquationCost(fold_ptp, fold_pty, fold.yty, 1, b);
+  }
+  score.validation_mse = sse / static_cast<double>(total.count);
+  return score;
+}
+}  // namespace detail
+
+// Scores of the degrees 2..max_degree by the folds validation, the rows are
+// assigned to the folds by their index, so the data should be shuffled.
+// x and y are standardized and scaled like in StreamPolynomialStats, the
+// errors are in the units of the standardized y.
+template <typename T>
+std::vector<DegreeScore> CrossValidateDegrees(const std::vector<T>& x,
+                                              const std::vector<T>& y,
+                                              size_t max_degree,
+                                              size_t folds_num,
+                                              size_t threads,
+                                              double scale = 1) {
+  folds_num = std::max<size_t>(folds_num, 2);
+  threads = std::max<size_t>(threads, 1);
+  RunningMoments x_moments, y_moments;
+  for (size_t r = 0; r < x.size(); ++r) {
+    x_moments.Add(x[r]);
+    y_moments.Add(y[r]);
+  }
+  const double x_scale = scale / x_moments.Sd();
+  const double y_scale = scale / y_moments.Sd();
+
+  // every task sums the rows of its folds
+  std::vector<PowerSums> folds(folds_num, PowerSums(max_degree));
+  const auto tasks_num = std::min(threads, folds_num);
+  utils::ParallelFor(0, tasks_num, [&](size_t t) {
+    for (size_t f = t; f < folds_num; f += tasks_num) {
+      for (size_t r = f; r < x.size(); r += folds_num)
+        folds[f].Add((x[r] - x_moments.mean) * x_scale,
+                     (y[r] - y_moments.mean) * y_scale);
+    }
+  });
+  PowerSums total(max_degree);
+  for (auto& fold : folds) {
+    fold.Finish();
+    total.Merge(fold);
+  }
+
+  std::vector<DegreeScore> scores(max_degree > 1 ? max_degree - 1 : 0);
+  utils::ParallelFor(0, scores.size(), [&](size_t i) {
+    scores[i] = detail::ScoreDegree(total, folds, i + 2);
+  });
+  return scores;
+}
+
+inline DegreeScore BestDegree(const std::vector<DegreeScore>& scores) {
+  DegreeScore best;
+  for (const auto& score : scores) {
+    if (score.validation_mse < best.validation_mse)
+      best = score;
+  }
+  return best;
+}
+
+// Prints the validation cost of every degree and the best degree
+inline void PrintDegreeScores(const std::vector<DegreeScore>& scores) {
+  for (const auto& score : scores)
+    std::cout << "Degree " << score.degree
+              << " validation cost = " << score.validation_mse << std::endl;
+  std::cout << "Best degree : " << BestDegree(scores).degree << std::endl;
+}
+
+}  // namespace utils
+
+#endif  // CROSSVAL_H
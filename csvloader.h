@@ -0,0 +1,164 @@
+#ifndef CSVLOADER_H
+#define CSVLOADER_H
+
+#include "tsvloader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Loader of classification CSV files: numeric feature columns and the class
+ * name in the last column. The file is mapped and parsed in parallel ranges
+ * like in tsvloader.h, every range has its own label dictionary and the
+ * dictionaries are merged in the file order, so the label ids are given in
+ * the order of the first appearance of the names. The features of all the
+ * rows are stored in one row major array.
+ */
+namespace utils {
+
+template <typename DType>
+struct LabeledRows {
+  size_t rows() const { return labels.size(); }
+  const DType* row(size_t index) const {
+    return features.data() + index * columns;
+  }
+
+  size_t columns{0};            // features in a row
+  std::vector<DType> features;  // rows x columns
+  std::vector<size_t> labels;
+  std::vector<std::string> label_names;
+  size_t invalid_rows{0};
+};
+
+namespace detail {
+inline void TrimField(const char*& begin, const char*& end) {
+  while (begin != end && (*begin == ' ' || *begin == '"'))
+    ++begin;
+  while (end != begin &&
+         (end[-1] == ' ' || end[-1] == '\r' || end[-1] == '"'))
+    --end;
+}
+
+template <typename DType>
+LabeledRows<DType> ParseLabeledRange(const char* begin,
+                                     const char* end,
+                                     size_t columns,
+                                     char delimiter) {
+  LabeledRows<DType> result;
+  result.columns = columns;
+  std::unordered_map<std::string, size_t> dictionary;
+  std::vector<double> row(columns);
+  std::string name;
+  while (begin < end) {
+    auto line_end = static_cast<const char*>(
+        std::memchr(begin, '\n', static_cast<size_t>(end - begin)));
+    if (line_end == nullptr)
+      line_end = end;
+    if (line_end != begin && !(line_end - begin == 1 && *begin == '\r')) {
+      bool valid = true;
+      auto field = begin;
+      for (size_t c = 0; valid && c < columns; ++c) {
+        auto field_end = std::find(field, line_end, delimiter);
+        valid = field_end != line_end && ParseField(field, field_end, row[c]);
+        field = field_end + 1;
+      }
+      auto name_begin = field;
+      auto name_end = line_end;
+      if (valid) {
+        valid = std::find(name_begin, name_end, delimiter) == name_end;
+        TrimField(name_begin, name_end);
+        valid = valid && name_begin != name_end;
+      }
+      if (valid) {
+        name.assign(name_begin, name_end);
+        auto label = dictionary.emplace(name, result.label_names.size());
+        if (label.second)
+          result.label_names.push_back(name);
+        result.labels.push_back(label.first->second);
+        for (auto v : row)
+          result.features.push_back(static_cast<DType>(v));
+      } else {
+        ++result.invalid_rows;
+      }
+    }
+    begin = line_end + 1;
+  }
+  return result;
+}
+}  // namespace detail
+
+// Loads the rows of columns features and a class name, the first line is
+// skipped when it is a header. Zero columns takes their number from the first
+// line.
+template <typename DType>
+LabeledRows<DType> LoadLabeledCsv(
+    const std::string& path,
+    size_t columns,
+    bool header = true,
+    char delimiter = ',',
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u)) {
+  detail::MappedFile file(path);
+  const char* data = file.data();
+  const char* data_end = data + file.size();
+  if (data != nullptr && (header || columns == 0)) {
+    auto line_end = static_cast<const char*>(
+        std::memchr(data, '\n', file.size()));
+    if (line_end == nullptr)
+      line_end = data_end;
+    if (columns == 0)
+      columns = static_cast<size_t>(std::count(data, line_end, delimiter));
+    if (header)
+      data = line_end != data_end ? line_end + 1 : data_end;
+  }
+
+  std::vector<std::future<LabeledRows<DType>>> parts;
+  if (data != nullptr) {
+    auto bounds = detail::SplitLines(data, data_end, threads);
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+      auto begin = bounds[i];
+      auto end = bounds[i + 1];
+      parts.push_back(utils::Async([begin, end, columns, delimiter]() {
+        return detail::ParseLabeledRange<DType>(begin, end, columns,
+                                                delimiter);
+      }));
+    }
+  }
+
+  std::vector<LabeledRows<DType>> results;
+  size_t rows = 0;
+  for (auto& part : parts) {
+    results.push_back(utils::DefaultPool().Wait(part));
+    rows += results.back().rows();
+  }
+  LabeledRows<DType> result;
+  result.columns = columns;
+  result.features.reserve(rows * columns);
+  result.labels.reserve(rows);
+  std::unordered_map<std::string, size_t> dictionary;
+  std::vector<size_t> ids;
+  for (auto& part : results) {
+    // ids of the range dictionary in the merged one
+    ids.clear();
+    for (auto& name : part.label_names) {
+      auto label = dictionary.emplace(name, result.label_names.size());
+      if (label.second)
+        result.label_names.push_back(name);
+      ids.push_back(label.first->second);
+    }
+    for (auto label : part.labels)
+      result.labels.push_back(ids[label]);
+    result.features.insert(result.features.end(), part.features.begin(),
+                           part.features.end());
+    result.invalid_rows += part.invalid_rows;
+  }
+  return result;
+}
+
+}  // namespace utils
+
+#endif  // CSVLOADER_H
@@ -1,7 +1,11 @@
 #include "anchors.h"
 #include "debug.h"
 
+#include <cmath>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
 
 namespace {
 
@@ -29,9 +33,11 @@ torch::Tensor GenerateAnchors(torch::Tensor scales,
   auto widths = scales * torch::sqrt(ratios);
 
   // Enumerate shifts in feature space
-  auto shifts_y = torch::arange(0, shape.first, anchor_stride) * feature_stride;
+  auto options = scales.options();
+  auto shifts_y =
+      torch::arange(0, shape.first, anchor_stride, options) * feature_stride;
   auto shifts_x =
-      torch::arange(0, shape.second, anchor_stride) * feature_stride;
+      torch::arange(0, shape.second, anchor_stride, options) * feature_stride;
 
   mesh = torch::meshgrid({shifts_x, shifts_y});
   shifts_x = mesh[0].permute({1, 0}).flatten();
@@ -65,14 +71,69 @@ torch::Tensor GeneratePyramidAnchors(
     std::vector<float> ratios_vec,
     const std::vector<std::pair<float, float> >& feature_shapes,
     const std::vector<float>& feature_strides,
-    float anchor_stride) {
+    float anchor_stride,
+    at::Device device) {
   std::vector<at::Tensor> anchors;
-  auto ratios = torch::tensor(ratios_vec);
+  auto ratios = torch::tensor(ratios_vec).to(device);
 
   for (size_t i = 0; i < scales_vec.size(); ++i) {
-    auto scale = torch::tensor(scales_vec[i]);
+    auto scale = torch::tensor(scales_vec[i]).to(device);
     anchors.push_back(GenerateAnchors(scale, ratios, feature_shapes[i],
                                       feature_strides[i], anchor_stride));
   }
   return at::cat(anchors, /*dim*/ 0);
 }
+
+namespace {
+using AnchorsKey = std::tuple<std::vector<std::pair<float, float>>,
+                              std::vector<float>,
+                              std::vector<float>,
+                              std::vector<float>,
+                              float,
+                              int,
+                              int>;
+}  // namespace
+
+torch::Tensor CachedPyramidAnchors(const Config& config, at::Device device) {
+  return CachedPyramidAnchors(config, config.image_shape[0],
+                              config.image_shape[1], device);
+}
+
+torch::Tensor CachedPyramidAnchors(const Config& config,
+                                   int32_t height,
+                                   int32_t width,
+                                   at::Device device) {
+  static std::mutex cache_mutex;
+  static std::map<AnchorsKey, torch::Tensor> cache;
+
+  auto feature_shapes = config.BackboneShapes(height, width);
+  AnchorsKey key(feature_shapes, config.backbone_strides,
+                 config.rpn_anchor_scales, config.rpn_anchor_ratios,
+                 static_cast<float>(config.rpn_anchor_stride),
+                 static_cast<int>(device.type()),
+                 static_cast<int>(device.index()));
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  auto& anchors = cache[key];
+  if (!anchors.defined()) {
+    anchors = GeneratePyramidAnchors(
+        config.rpn_anchor_scales, config.rpn_anchor_ratios, feature_shapes,
+        config.backbone_strides, static_cast<float>(config.rpn_anchor_stride),
+        device);
+  }
+  return anchors;
+}
+
+std::vector<int64_t> PyramidAnchorCounts(const Config& config,
+                                         int32_t height,
+                                         int32_t width) {
+  // Same number of elements as torch::arange in GenerateAnchors
+  auto anchor_stride = static_cast<float>(config.rpn_anchor_stride);
+  auto num_ratios = static_cast<int64_t>(config.rpn_anchor_ratios.size());
+  std::vector<int64_t> counts;
+  for (const auto& shape : config.BackboneShapes(height, width)) {
+    auto rows = static_cast<int64_t>(std::ceil(shape.first / anchor_stride));
+    auto cols = static_cast<int64_t>(std::ceil(shape.second / anchor_stride));
+    counts.push_back(rows * cols * num_ratios);
+  }
+  return counts;
+}
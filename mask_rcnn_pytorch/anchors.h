@@ -1,6 +1,8 @@
 #ifndef ANCHORS_H
 #define ANCHORS_H
 
+#include "config.h"
+
 #include <torch/torch.h>
 
 #include <stdint.h>
@@ -14,12 +16,34 @@
  * anchors: [N, (y1, x1, y2, x2)]. All generated anchors in one array. Sorted
  *     with the same order of the given scales. So, anchors of scale[0] come
  *     first, then anchors of scale[1], and so on.
+ *     Anchors are generated directly on the device.
  */
 torch::Tensor GeneratePyramidAnchors(
     std::vector<float> scales_vec,
     std::vector<float> ratios_vec,
     const std::vector<std::pair<float, float>>& feature_shapes,
     const std::vector<float>& feature_strides,
-    float anchor_stride);
+    float anchor_stride,
+    at::Device device = at::kCPU);
+
+/*
+ * Pyramid anchors of the config, cached by the feature shapes, strides,
+ * scales, ratios and the device. The dataset and the model get the same
+ * tensor, so anchors of each input geometry are generated once per device.
+ * The returned tensor is shared and must not be modified in place.
+ */
+torch::Tensor CachedPyramidAnchors(const Config& config, at::Device device);
+
+// Same for the input image of height x width size, when padding is off
+torch::Tensor CachedPyramidAnchors(const Config& config,
+                                   int32_t height,
+                                   int32_t width,
+                                   at::Device device);
+
+// Number of anchors of each pyramid level for the input image of
+// height x width size, in the order of CachedPyramidAnchors rows
+std::vector<int64_t> PyramidAnchorCounts(const Config& config,
+                                         int32_t height,
+                                         int32_t width);
 
 #endif  // ANCHORS_H
@@ -0,0 +1,201 @@
+#include "augmentation.h"
+
+#include <tuple>
+
+namespace {
+const int64_t kBilinearMode = 0;
+const int64_t kZerosPadding = 0;
+
+struct Transform {
+  bool flip{false};
+  float scale{1.f};  // > 1 zooms in
+  float center_y{0};
+  float center_x{0};
+};
+
+at::Tensor ToTensor(const std::vector<float>& values,
+                    const at::TensorOptions& options) {
+  return torch::tensor(values, at::dtype(at::kFloat)).to(options);
+}
+
+// Grid coordinate of the x pixel edge coordinate on the axis of size
+// pixels, centers of the corner pixels are at -1 and 1
+float GridCoord(float x, int64_t size) {
+  return (x - 0.5f) * 2.f / static_cast<float>(size - 1) - 1.f;
+}
+
+// Affine theta of the image, it maps grid coordinates of output points to
+// the input points: flip and scale around the window center
+std::vector<float> ImageTheta(const Transform& t,
+                              int64_t height,
+                              int64_t width) {
+  const float fx = t.flip ? -1.f : 1.f;
+  const float cy = GridCoord(t.center_y, height);
+  const float cx = GridCoord(t.center_x, width);
+  return {fx / t.scale, 0, cx * (1 - fx / t.scale),  // x
+          0, 1 / t.scale, cy * (1 - 1 / t.scale)};       // y
+}
+
+/* Scales and offsets of the mini mask theta along the axis of size pixels.
+ * The output mask covers the clipped box [clipped1, clipped2], the input
+ * mask covers the moved box [moved1, moved2], mirrored if flipped.
+ */
+std::tuple<at::Tensor, at::Tensor> MaskAxisTheta(at::Tensor moved1,
+                                                 at::Tensor moved2,
+                                                 at::Tensor clipped1,
+                                                 at::Tensor clipped2,
+                                                 int64_t size,
+                                                 bool mirror) {
+  // Grid coordinate of the box relative coordinate t is a * t + b
+  const float a = 2.f * size / static_cast<float>(size - 1);
+  const float b = -1.f - 1.f / static_cast<float>(size - 1);
+  const float sign = mirror ? -1.f : 1.f;
+  auto length = (moved2 - moved1).clamp_min(1e-3);
+  auto scale = (clipped2 - clipped1) / length * sign;
+  auto shift = (clipped1 - moved1) / length * sign + (mirror ? 1.f : 0.f);
+  auto offset = shift * a + b - scale * b;
+  return {scale, offset};
+}
+
+/* Moves the boxes and masks of the sample, returns false if no instance
+ * stays in the window, then the sample isn't changed.
+ */
+bool TransformInstances(const Transform& t,
+                        const Window& window,
+                        const std::vector<float>& image_theta,
+                        const Config& config,
+                        at::Tensor& class_ids,
+                        at::Tensor& boxes,
+                        at::Tensor& masks) {
+  const auto count = boxes.size(1);
+  if (count == 0)
+    return true;
+  auto b = boxes[0];
+  const float fx = t.flip ? -t.scale : t.scale;
+  auto y1 = (b.select(1, 0) - t.center_y) * t.scale + t.center_y;
+  auto y2 = (b.select(1, 2) - t.center_y) * t.scale + t.center_y;
+  auto xa = (b.select(1, 1) - t.center_x) * fx + t.center_x;
+  auto xb = (b.select(1, 3) - t.center_x) * fx + t.center_x;
+  auto x1 = t.flip ? xb : xa;
+  auto x2 = t.flip ? xa : xb;
+  auto clipped_y1 = y1.clamp(window.y1, window.y2);
+  auto clipped_y2 = y2.clamp(window.y1, window.y2);
+  auto clipped_x1 = x1.clamp(window.x1, window.x2);
+  auto clipped_x2 = x2.clamp(window.x1, window.x2);
+
+  // Instances with less than a pixel in the window are removed
+  auto keep =
+      ((clipped_y2 - clipped_y1) >= 1) & ((clipped_x2 - clipped_x1) >= 1);
+  auto ids = keep.nonzero().flatten();
+  if (ids.size(0) == 0)
+    return false;
+
+  auto m = masks[0];
+  at::Tensor theta;
+  if (config.use_mini_mask) {
+    auto [scale_y, offset_y] =
+        MaskAxisTheta(y1, y2, clipped_y1, clipped_y2, m.size(1), false);
+    auto [scale_x, offset_x] =
+        MaskAxisTheta(x1, x2, clipped_x1, clipped_x2, m.size(2), t.flip);
+    auto zeros = torch::zeros_like(scale_x);
+    theta = torch::stack({scale_x, zeros, offset_x, zeros, scale_y, offset_y},
+                         /*dim*/ 1)
+                .view({count, 2, 3});
+  } else {
+    theta = ToTensor(image_theta, m.options())
+                .view({1, 2, 3})
+                .expand({count, 2, 3});
+  }
+  auto grid =
+      at::affine_grid_generator(theta, {count, 1, m.size(1), m.size(2)});
+  m = at::grid_sampler(m.unsqueeze(1).to(grid.scalar_type()), grid,
+                       kBilinearMode, kZerosPadding)
+          .squeeze(1);
+  m = (m >= 0.5f).to(masks.scalar_type());
+
+  class_ids = class_ids.index_select(1, ids);
+  boxes = torch::stack({clipped_y1, clipped_x1, clipped_y2, clipped_x2},
+                       /*dim*/ 1)
+              .index_select(0, ids)
+              .unsqueeze(0);
+  masks = m.index_select(0, ids).unsqueeze(0);
+  return true;
+}
+}  // namespace
+
+bool HasGeometricAugmentation(const Config& config) {
+  return config.augment_flip_prob > 0 || config.augment_scale_jitter > 0;
+}
+
+void AugmentBatch(at::Tensor& images,
+                  const std::vector<Window>& windows,
+                  std::vector<at::Tensor>& gt_class_ids,
+                  std::vector<at::Tensor>& gt_boxes,
+                  std::vector<at::Tensor>& gt_masks,
+                  const Config& config) {
+  const bool geometric = HasGeometricAugmentation(config);
+  const float color_jitter = config.augment_color_jitter;
+  if (!geometric && color_jitter <= 0)
+    return;
+
+  const auto batch = images.size(0);
+  const auto height = images.size(2);
+  const auto width = images.size(3);
+  // Parameters are drawn on the host, only instance filtering waits for the
+  // device
+  auto random = torch::rand({batch, 6});
+  auto r = random.accessor<float, 2>();
+  std::vector<float> thetas;
+  std::vector<float> factors;
+  std::vector<float> bounds;
+  for (int64_t i = 0; i < batch; ++i) {
+    const auto& window = windows[static_cast<size_t>(i)];
+    Transform t;
+    t.center_y = (window.y1 + window.y2) / 2.f;
+    t.center_x = (window.x1 + window.x2) / 2.f;
+    if (geometric) {
+      t.flip = r[i][0] < config.augment_flip_prob;
+      t.scale = 1.f + config.augment_scale_jitter * (2 * r[i][1] - 1);
+      auto i_size = static_cast<size_t>(i);
+      if (!TransformInstances(t, window, ImageTheta(t, height, width), config,
+                              gt_class_ids[i_size], gt_boxes[i_size],
+                              gt_masks[i_size])) {
+        t.flip = false;
+        t.scale = 1.f;
+      }
+    }
+    auto theta = ImageTheta(t, height, width);
+    thetas.insert(thetas.end(), theta.begin(), theta.end());
+    // Brightness and the color balance
+    const float brightness = 1.f + color_jitter * (2 * r[i][2] - 1);
+    for (int64_t c = 0; c < 3; ++c)
+      factors.push_back(brightness *
+                        (1.f + 0.5f * color_jitter * (2 * r[i][3 + c] - 1)));
+    bounds.insert(bounds.end(),
+                  {static_cast<float>(window.y1), static_cast<float>(window.x1),
+                   static_cast<float>(window.y2),
+                   static_cast<float>(window.x2)});
+  }
+
+  auto options = images.options();
+  std::vector<float> mean(config.mean_pixel.begin(), config.mean_pixel.end());
+  auto mean_pixel = ToTensor(mean, options).view({1, 3, 1, 1});
+  auto result = images + mean_pixel;
+  if (geometric) {
+    auto theta = ToTensor(thetas, options).view({batch, 2, 3});
+    auto grid = at::affine_grid_generator(theta, result.sizes());
+    result = at::grid_sampler(result, grid, kBilinearMode, kZerosPadding);
+    // Content moved over the padding is cut off, centers of the pixels are
+    // compared with the window
+    auto window = ToTensor(bounds, options).view({batch, 4, 1, 1});
+    auto rows = torch::arange(height, options).view({1, 1, height, 1}) + 0.5;
+    auto cols = torch::arange(width, options).view({1, 1, 1, width}) + 0.5;
+    auto inside = (rows > window.narrow(1, 0, 1)) &
+                  (cols > window.narrow(1, 1, 1)) &
+                  (rows < window.narrow(1, 2, 1)) &
+                  (cols < window.narrow(1, 3, 1));
+    result.mul_(inside.to(images.scalar_type()));
+  }
+  auto factor = ToTensor(factors, options).view({batch, 3, 1, 1});
+  images = result.mul_(factor).sub_(mean_pixel);
+}
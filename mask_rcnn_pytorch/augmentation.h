@@ -0,0 +1,37 @@
+#ifndef AUGMENTATION_H
+#define AUGMENTATION_H
+
+#include "config.h"
+#include "imageutils.h"
+
+#include <torch/torch.h>
+
+#include <vector>
+
+// True if the config has random flips or scale jitter, they change the
+// boxes, so RPN targets have to be built after the augmentation
+bool HasGeometricAugmentation(const Config& config);
+
+/* Random augmentation of a training batch, on the device of the batch.
+ * Images are flipped horizontally and zoomed around the window center with
+ * one batched resampling, the boxes and masks of the instances get the same
+ * transform and are clipped to the window, instances which are out of the
+ * window are removed. If no instance of an image stays in the window the
+ * image isn't transformed. Color jitter scales the brightness and every
+ * channel of the image, it is applied with the mean subtraction in one
+ * pass, so the padding stays zero.
+ * images: [batch, 3, height, width] molded images of the same shape
+ * windows: window of the image in every sample
+ * gt_class_ids [1, instances], gt_boxes [1, instances, (y1, x1, y2, x2)],
+ * gt_masks [1, instances, height, width]: targets of every sample, mini
+ * masks if Config::use_mini_mask is set
+ * Random values are taken from the torch generator.
+ */
+void AugmentBatch(at::Tensor& images,
+                  const std::vector<Window>& windows,
+                  std::vector<at::Tensor>& gt_class_ids,
+                  std::vector<at::Tensor>& gt_boxes,
+                  std::vector<at::Tensor>& gt_masks,
+                  const Config& config);
+
+#endif  // AUGMENTATION_H
@@ -0,0 +1,181 @@
+#include "../../perfstats.h"
+#include "../cocorle.h"
+#include "../config.h"
+#include "../maskrcnn.h"
+#include "../shardfile.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <THC/THCCachingAllocator.h>
+#include <benchmark/benchmark.h>
+#include <cuda_runtime_api.h>
+#include <torch/torch.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <experimental/filesystem>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+class BenchConfig : public Config {
+ public:
+  explicit BenchConfig(uint32_t batch_size) {
+    gpu_count = 1;
+    images_per_gpu = batch_size;
+    num_classes = 81;
+    UpdateSettings();
+  }
+};
+
+// High watermark of the process, it can't be reset, so it's the peak of the
+// case only when the case runs alone, like in bench_all.sh
+double PeakDeviceMemoryMb() {
+  return static_cast<double>(THCCachingAllocator_maxMemoryAllocated(0)) /
+         (1 << 20);
+}
+
+// Shard of images of the config size with one box and its mask each, seeded,
+// so every run trains on the same data. Images are smooth noise, the JPEG
+// decoding of pixel noise would take longer than of real photos.
+std::vector<std::string> SyntheticShards(const Config& config,
+                                         uint32_t images) {
+  auto dir = fs::temp_directory_path() / "mask_rcnn_bench";
+  fs::create_directories(dir);
+  auto file_name = (dir / "00000.shard").string();
+  auto height = config.image_shape[0];
+  auto width = config.image_shape[1];
+  cv::RNG rng(25345);
+  ShardWriter writer(file_name);
+  for (uint32_t id = 0; id < images; ++id) {
+    cv::Mat noise(16, 16, CV_8UC3);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat image;
+    cv::resize(noise, image, cv::Size(width, height));
+    ShardRecord record;
+    record.image_id = id + 1;
+    record.width = static_cast<uint32_t>(width);
+    record.height = static_cast<uint32_t>(height);
+    cv::imencode(".jpg", image, record.image);
+
+    CocoBBox bbox;
+    bbox.width = rng.uniform(width / 8, width / 2);
+    bbox.height = rng.uniform(height / 8, height / 2);
+    bbox.x = rng.uniform(0, width - bbox.width);
+    bbox.y = rng.uniform(0, height - bbox.height);
+    cv::Mat mask = cv::Mat::zeros(height, width, CV_8UC1);
+    mask(cv::Rect(bbox.x, bbox.y, bbox.width, bbox.height)).setTo(1);
+    record.boxes.push_back(bbox);
+    record.classes.push_back(
+        static_cast<int32_t>(1 + id % (config.num_classes - 1)));
+    record.masks.push_back(EncodeRle(mask));
+    writer.Write(record);
+  }
+  writer.Close();
+  return {file_name};
+}
+
+// End to end detection with random weights, the pipeline has fixed shapes,
+// so the time doesn't depend on the weights. The device time is the span of
+// the detection on the stream, with the gaps where the GPU waits for the host.
+void BM_Detect(benchmark::State& state) {
+  if (!torch::cuda::is_available()) {
+    state.SkipWithError("Cuda is not available");
+    return;
+  }
+  torch::manual_seed(0);
+  auto batch_size = static_cast<uint32_t>(state.range(0));
+  auto config = std::make_shared<BenchConfig>(batch_size);
+  MaskRCNN model("", config);
+  model->to(torch::DeviceType::CUDA);
+  model->WarmUp();
+
+  auto height = config->image_shape[0];
+  auto width = config->image_shape[1];
+  std::vector<ImageMeta> image_metas(batch_size);
+  for (auto& meta : image_metas) {
+    meta.image_width = width;
+    meta.image_height = height;
+    meta.window = Window{0, 0, height, width};
+  }
+  auto images =
+      torch::randn({state.range(0), 3, height, width}).to(torch::kCUDA);
+  cudaEvent_t gpu_start;
+  cudaEvent_t gpu_stop;
+  cudaEventCreate(&gpu_start);
+  cudaEventCreate(&gpu_stop);
+  double gpu_ms = 0;
+  auto allocations = utils::AllocationCount();
+  for (auto _ : state) {
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    cudaEventRecord(gpu_start, stream);
+    auto [detections, masks] = model->Detect(images, image_metas);
+    cudaEventRecord(gpu_stop, stream);
+    cudaDeviceSynchronize();
+    float ms = 0;
+    cudaEventElapsedTime(&ms, gpu_start, gpu_stop);
+    gpu_ms += ms;
+    benchmark::DoNotOptimize(detections);
+    benchmark::DoNotOptimize(masks);
+  }
+  cudaEventDestroy(gpu_start);
+  cudaEventDestroy(gpu_stop);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["gpu_ms"] =
+      benchmark::Counter(gpu_ms, benchmark::Counter::kAvgIterations);
+  state.counters["allocations"] = benchmark::Counter(
+      static_cast<double>(utils::AllocationCount() - allocations),
+      benchmark::Counter::kAvgIterations);
+  state.counters["peak_device_mb"] = PeakDeviceMemoryMb();
+  state.counters["peak_rss_mb"] = utils::PeakMemoryMb();
+}
+BENCHMARK(BM_Detect)
+    ->Arg(1)
+    ->Arg(4)
+    ->ArgName("images")
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Training steps of all layers on the synthetic shard with the loaders of the
+// config, see MaskRCNNImpl::MeasureTraining. An iteration is the timed steps
+// of autotune_images images after a warm-up step.
+void BM_Train(benchmark::State& state) {
+  if (!torch::cuda::is_available()) {
+    state.SkipWithError("Cuda is not available");
+    return;
+  }
+  torch::manual_seed(0);
+  auto config =
+      std::make_shared<BenchConfig>(static_cast<uint32_t>(state.range(0)));
+  MaskRCNN model("", config);
+  model->to(torch::DeviceType::CUDA);
+  auto images = config->autotune_images;
+  auto shards = SyntheticShards(*config, images + config->batch_size);
+
+  double images_per_s = 0;
+  auto allocations = utils::AllocationCount();
+  for (auto _ : state) {
+    std::tie(images_per_s, std::ignore) =
+        model->MeasureTraining(shards, images, "all");
+    state.SetIterationTime(images / images_per_s);
+  }
+  fs::remove_all(fs::path(shards.front()).parent_path());
+  state.SetItemsProcessed(state.iterations() * images);
+  state.counters["steps_per_s"] = images_per_s / config->batch_size;
+  state.counters["allocations"] = benchmark::Counter(
+      static_cast<double>(utils::AllocationCount() - allocations),
+      benchmark::Counter::kAvgIterations);
+  state.counters["peak_device_mb"] = PeakDeviceMemoryMb();
+  state.counters["peak_rss_mb"] = utils::PeakMemoryMb();
+}
+BENCHMARK(BM_Train)
+    ->Arg(1)
+    ->Arg(2)
+    ->ArgName("images")
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime();
+}  // namespace
@@ -0,0 +1,186 @@
+#include "../anchors.h"
+#include "../boxutils.h"
+#include "../config.h"
+#include "../imageutils.h"
+#include "../nms.h"
+#include "../roialign/crop_and_resize.h"
+#include "../roialign/crop_and_resize_gpu.h"
+#include "../rpntargets.h"
+
+#include <benchmark/benchmark.h>
+#include <cuda_runtime_api.h>
+#include <torch/torch.h>
+
+#include <opencv2/opencv.hpp>
+
+namespace {
+class BenchConfig : public Config {
+ public:
+  BenchConfig() {
+    num_classes = 81;
+    UpdateSettings();
+  }
+};
+
+// [n, (y1, x1, y2, x2)] boxes with corners in [0, size)
+at::Tensor RandomBoxes(int64_t n, float size) {
+  auto corners = torch::rand({n, 2}) * size * 0.8f;
+  auto sides = torch::rand({n, 2}) * size * 0.2f + 1;
+  return torch::cat({corners, corners + sides}, 1);
+}
+
+// Waits for the GPU, so the time of the iteration includes the kernels
+void Sync(const at::Tensor& tensor) {
+  if (tensor.is_cuda())
+    cudaDeviceSynchronize();
+}
+
+bool SkipWithoutCuda(benchmark::State& state, bool on_gpu) {
+  if (on_gpu && !torch::cuda::is_available()) {
+    state.SkipWithError("Cuda is not available");
+    return true;
+  }
+  return false;
+}
+
+void BM_Nms(benchmark::State& state) {
+  bool on_gpu = state.range(1) != 0;
+  if (SkipWithoutCuda(state, on_gpu))
+    return;
+  torch::manual_seed(0);
+  auto n = state.range(0);
+  auto dets = torch::cat({RandomBoxes(n, 1024), torch::rand({n, 1})}, 1);
+  if (on_gpu)
+    dets = dets.cuda();
+  for (auto _ : state) {
+    auto keep = Nms(dets, 0.7f);
+    Sync(keep);
+    benchmark::DoNotOptimize(keep);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_Nms)
+    ->ArgsProduct({{1000, 2000, 6000, 12000}, {0, 1}})
+    ->ArgNames({"boxes", "gpu"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_CropAndResize(benchmark::State& state) {
+  bool on_gpu = state.range(1) != 0;
+  if (SkipWithoutCuda(state, on_gpu))
+    return;
+  torch::manual_seed(0);
+  auto n = state.range(0);
+  auto image = torch::rand({2, 256, 64, 64});
+  auto boxes = RandomBoxes(n, 1);
+  auto box_index = torch::randint(0, 2, {n}, at::dtype(at::kInt));
+  auto crops = torch::empty({0});
+  if (on_gpu) {
+    image = image.cuda();
+    boxes = boxes.cuda();
+    box_index = box_index.cuda();
+    crops = crops.cuda();
+  }
+  for (auto _ : state) {
+    if (on_gpu)
+      crop_and_resize_gpu_forward(image, boxes, box_index, 0, 7, 7, crops);
+    else
+      crop_and_resize_forward(image, boxes, box_index, 0, 7, 7, crops);
+    Sync(crops);
+    benchmark::DoNotOptimize(crops);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_CropAndResize)
+    ->ArgsProduct({{200, 1000}, {0, 1}})
+    ->ArgNames({"boxes", "gpu"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_BBoxOverlaps(benchmark::State& state) {
+  torch::manual_seed(0);
+  auto boxes1 = RandomBoxes(state.range(0), 1024);
+  auto boxes2 = RandomBoxes(state.range(1), 1024);
+  for (auto _ : state) {
+    auto overlaps = BBoxOverlaps(boxes1, boxes2);
+    benchmark::DoNotOptimize(overlaps);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) *
+                          state.range(1));
+}
+BENCHMARK(BM_BBoxOverlaps)
+    ->ArgsProduct({{2000, 32000}, {10, 100}})
+    ->ArgNames({"boxes", "gt_boxes"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_BBoxOverlapsLoops(benchmark::State& state) {
+  torch::manual_seed(0);
+  auto boxes1 = RandomBoxes(state.range(0), 1024);
+  auto boxes2 = RandomBoxes(state.range(1), 1024);
+  for (auto _ : state) {
+    auto overlaps = BBoxOverlapsLoops(boxes1, boxes2);
+    benchmark::DoNotOptimize(overlaps);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) *
+                          state.range(1));
+}
+BENCHMARK(BM_BBoxOverlapsLoops)
+    ->ArgsProduct({{2000, 32000}, {10, 100}})
+    ->ArgNames({"boxes", "gt_boxes"})
+    ->Unit(benchmark::kMillisecond);
+
+void BM_GeneratePyramidAnchors(benchmark::State& state) {
+  BenchConfig config;
+  for (auto _ : state) {
+    auto anchors = GeneratePyramidAnchors(
+        config.rpn_anchor_scales, config.rpn_anchor_ratios,
+        config.backbone_shapes, config.backbone_strides,
+        config.rpn_anchor_stride);
+    benchmark::DoNotOptimize(anchors);
+  }
+}
+BENCHMARK(BM_GeneratePyramidAnchors)->Unit(benchmark::kMillisecond);
+
+void BM_BuildRpnTargets(benchmark::State& state) {
+  torch::manual_seed(0);
+  BenchConfig config;
+  auto anchors = GeneratePyramidAnchors(
+      config.rpn_anchor_scales, config.rpn_anchor_ratios,
+      config.backbone_shapes, config.backbone_strides,
+      config.rpn_anchor_stride);
+  auto gt_boxes = RandomBoxes(state.range(0), config.image_shape[0]);
+  for (auto _ : state) {
+    auto targets = BuildRpnTargets(anchors, gt_boxes, config);
+    benchmark::DoNotOptimize(targets);
+  }
+}
+BENCHMARK(BM_BuildRpnTargets)
+    ->Arg(10)
+    ->Arg(100)
+    ->ArgName("gt_boxes")
+    ->Unit(benchmark::kMillisecond);
+
+void BM_ResizeMasks(benchmark::State& state) {
+  cv::RNG rng(0);
+  std::vector<RleMask> masks;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    cv::Mat mask = cv::Mat::zeros(480, 640, CV_8UC1);
+    auto x = rng.uniform(0, 400);
+    auto y = rng.uniform(0, 300);
+    cv::ellipse(mask, cv::Point(x + 100, y + 80), cv::Size(100, 80), 0, 0,
+                360, cv::Scalar(1), -1);
+    masks.push_back({EncodeRle(mask), mask.rows, mask.cols});
+  }
+  Padding padding;
+  padding.top_pad = 96;
+  padding.bottom_pad = 96;
+  for (auto _ : state) {
+    auto resized = ResizeMasks(masks, 1.6f, padding);
+    benchmark::DoNotOptimize(resized);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ResizeMasks)
+    ->Arg(10)
+    ->Arg(50)
+    ->ArgName("masks")
+    ->Unit(benchmark::kMillisecond);
+}  // namespace
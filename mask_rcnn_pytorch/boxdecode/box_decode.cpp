@@ -0,0 +1,22 @@
+#include "box_decode.h"
+
+void box_decode_forward(at::Tensor boxes,
+                        at::Tensor deltas,
+                        const BoxDecodeParams& params,
+                        at::Tensor output) {
+  boxes = boxes.contiguous();
+  deltas = deltas.contiguous();
+
+  const int64_t num = boxes.size(0);
+  output.resize_({num, 4});
+  const float* boxes_ptr = boxes.data<float>();
+  const float* deltas_ptr = deltas.data<float>();
+  float* output_ptr = output.data<float>();
+
+  // There are at most a few thousands of boxes, threads don't pay off
+#pragma omp simd
+  for (int64_t i = 0; i < num; ++i) {
+    DecodeBox(boxes_ptr + i * 4, deltas_ptr + i * 4, params,
+              output_ptr + i * 4);
+  }
+}
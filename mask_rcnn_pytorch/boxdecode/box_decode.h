@@ -0,0 +1,10 @@
+#include <torch/torch.h>
+
+#include "box_decode_common.h"
+
+// Applies deltas to boxes, scales and clips the results in one pass
+void box_decode_forward(at::Tensor boxes,   // [N, (y1, x1, y2, x2)] float
+                        at::Tensor deltas,  // [N, 4] float
+                        const BoxDecodeParams& params,
+                        at::Tensor output  // [N, 4] float
+);
@@ -0,0 +1,52 @@
+#ifndef BOX_DECODE_COMMON_H
+#define BOX_DECODE_COMMON_H
+
+#include <math.h>
+
+#ifdef __CUDACC__
+#define DECODE_HOST_DEVICE __host__ __device__
+#else
+#define DECODE_HOST_DEVICE
+#endif
+
+// Deltas are multiplied by std_dev, decoded boxes are multiplied by
+// (scale_y, scale_x) and clipped to the window in the output coordinates
+struct BoxDecodeParams {
+  float std_dev[4];
+  float scale_y;
+  float scale_x;
+  float window[4];
+};
+
+DECODE_HOST_DEVICE inline float ClampCoord(float value, float lo, float hi) {
+  return fminf(fmaxf(value, lo), hi);
+}
+
+// Decodes one box, the sequence of operations is the same as in
+// ApplyBoxDeltas followed by the scaling and ClipBoxes
+DECODE_HOST_DEVICE inline void DecodeBox(const float* box,
+                                         const float* delta,
+                                         const BoxDecodeParams& params,
+                                         float* out) {
+  float height = box[2] - box[0];
+  float width = box[3] - box[1];
+  float center_y = box[0] + 0.5f * height;
+  float center_x = box[1] + 0.5f * width;
+  center_y += delta[0] * params.std_dev[0] * height;
+  center_x += delta[1] * params.std_dev[1] * width;
+  height *= expf(delta[2] * params.std_dev[2]);
+  width *= expf(delta[3] * params.std_dev[3]);
+
+  const float y1 = center_y - 0.5f * height;
+  const float x1 = center_x - 0.5f * width;
+  const float y2 = y1 + height;
+  const float x2 = x1 + width;
+
+  const float* window = params.window;
+  out[0] = ClampCoord(y1 * params.scale_y, window[0], window[2]);
+  out[1] = ClampCoord(x1 * params.scale_x, window[1], window[3]);
+  out[2] = ClampCoord(y2 * params.scale_y, window[0], window[2]);
+  out[3] = ClampCoord(x2 * params.scale_x, window[1], window[3]);
+}
+
+#endif  // BOX_DECODE_COMMON_H
@@ -0,0 +1,18 @@
+#include "box_decode_gpu.h"
+#include "cuda/box_decode_kernel.h"
+
+void box_decode_gpu_forward(at::Tensor boxes,
+                            at::Tensor deltas,
+                            const BoxDecodeParams& params,
+                            at::Tensor output) {
+  assert(boxes.is_cuda());
+  assert(deltas.is_cuda());
+  assert(output.is_cuda());
+
+  boxes = boxes.contiguous();
+  deltas = deltas.contiguous();
+  output.resize_({boxes.size(0), 4});
+
+  BoxDecodeLaucher(boxes.data<float>(), deltas.data<float>(), boxes.size(0),
+                   params, output.data<float>());
+}
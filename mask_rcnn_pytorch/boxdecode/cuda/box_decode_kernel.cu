@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <algorithm>
+#include "box_decode_kernel.h"
+
+__global__ void BoxDecodeKernel(const float* boxes_ptr,
+                                const float* deltas_ptr,
+                                int64_t num_boxes,
+                                BoxDecodeParams params,
+                                float* output_ptr) {
+  for (int64_t idx = blockIdx.x * static_cast<int64_t>(blockDim.x) +
+                     threadIdx.x;
+       idx < num_boxes; idx += static_cast<int64_t>(blockDim.x) * gridDim.x) {
+    DecodeBox(boxes_ptr + idx * 4, deltas_ptr + idx * 4, params,
+              output_ptr + idx * 4);
+  }
+}
+
+void BoxDecodeLaucher(const float* boxes_ptr,
+                      const float* deltas_ptr,
+                      int64_t num_boxes,
+                      BoxDecodeParams params,
+                      float* output_ptr) {
+  const int thread_per_block = 256;
+  const int64_t max_blocks = 65535;
+  const int block_count = static_cast<int>(
+      std::min((num_boxes + thread_per_block - 1) / thread_per_block,
+               max_blocks));
+  cudaError_t err;
+
+  if (num_boxes > 0) {
+    BoxDecodeKernel<<<block_count, thread_per_block, 0>>>(
+        boxes_ptr, deltas_ptr, num_boxes, params, output_ptr);
+
+    err = cudaGetLastError();
+    if (cudaSuccess != err) {
+      fprintf(stderr, "cudaCheckError() failed : %s\n",
+              cudaGetErrorString(err));
+      exit(-1);
+    }
+  }
+}
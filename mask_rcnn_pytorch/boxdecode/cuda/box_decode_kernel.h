@@ -0,0 +1,23 @@
+#ifndef _BoxDecode_Kernel
+#define _BoxDecode_Kernel
+
+#include <stdint.h>
+
+#include "../box_decode_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One thread decodes one box
+void BoxDecodeLaucher(const float* boxes_ptr,
+                      const float* deltas_ptr,
+                      int64_t num_boxes,
+                      BoxDecodeParams params,
+                      float* output_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,8 @@
 #include "boxutils.h"
+#include "boxdecode/box_decode.h"
+#include "boxdecode/box_decode_gpu.h"
+#include "iou/box_iou.h"
+#include "iou/box_iou_gpu.h"
 
 /* Calculates IoU of the given box with the array of the given boxes.
  * box: 1D vector [y1, x1, y2, x2]
@@ -46,6 +50,38 @@ torch::Tensor BBoxOverlapsLoops(torch::Tensor boxes1, torch::Tensor boxes2) {
   return overlaps;
 }
 
+torch::Tensor BBoxOverlaps(torch::Tensor boxes1, torch::Tensor boxes2) {
+  auto overlaps = torch::empty({boxes1.size(0), boxes2.size(0)},
+                               boxes1.options().dtype(at::kFloat));
+  if (boxes1.is_cuda()) {
+    box_iou_gpu_forward(boxes1, boxes2, overlaps, at::Tensor(), at::Tensor(),
+                        at::Tensor(), at::Tensor());
+  } else {
+    box_iou_forward(boxes1, boxes2, overlaps, at::Tensor(), at::Tensor(),
+                    at::Tensor(), at::Tensor());
+  }
+  return overlaps;
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> BBoxMaxOverlaps(
+    torch::Tensor boxes1,
+    torch::Tensor boxes2) {
+  auto float_options = boxes1.options().dtype(at::kFloat);
+  auto long_options = boxes1.options().dtype(at::kLong);
+  auto max1 = torch::empty({boxes1.size(0)}, float_options);
+  auto argmax1 = torch::empty({boxes1.size(0)}, long_options);
+  auto max2 = torch::empty({boxes2.size(0)}, float_options);
+  auto argmax2 = torch::empty({boxes2.size(0)}, long_options);
+  if (boxes1.is_cuda()) {
+    box_iou_gpu_forward(boxes1, boxes2, at::Tensor(), max1, argmax1, max2,
+                        argmax2);
+  } else {
+    box_iou_forward(boxes1, boxes2, at::Tensor(), max1, argmax1, max2,
+                    argmax2);
+  }
+  return {max1, argmax1, max2, argmax2};
+}
+
 torch::Tensor BoxRefinement(torch::Tensor box, torch::Tensor gt_box) {
   auto height = box.narrow(1, 2, 1) - box.narrow(1, 0, 1);
   auto width = box.narrow(1, 3, 1) - box.narrow(1, 1, 1);
@@ -112,6 +148,33 @@ at::Tensor ClipBoxes(at::Tensor boxes, Window window) {
   return boxes;
 }
 
+at::Tensor DecodeBoxes(at::Tensor boxes,
+                       at::Tensor deltas,
+                       const std::vector<float>& std_dev,
+                       float scale_y,
+                       float scale_x,
+                       const Window& window) {
+  assert(std_dev.size() == 4);
+  BoxDecodeParams params;
+  for (size_t i = 0; i < 4; ++i)
+    params.std_dev[i] = std_dev[i];
+  params.scale_y = scale_y;
+  params.scale_x = scale_x;
+  params.window[0] = static_cast<float>(window.y1);
+  params.window[1] = static_cast<float>(window.x1);
+  params.window[2] = static_cast<float>(window.y2);
+  params.window[3] = static_cast<float>(window.x2);
+
+  boxes = boxes.to(at::kFloat);
+  deltas = deltas.to(at::kFloat);
+  auto output = torch::empty({boxes.size(0), 4}, boxes.options());
+  if (boxes.is_cuda())
+    box_decode_gpu_forward(boxes, deltas, params, output);
+  else
+    box_decode_forward(boxes, deltas, params, output);
+  return output;
+}
+
 at::Tensor ClipToWindow(const Window& window, at::Tensor boxes) {
   boxes.narrow(1, 0, 1) = boxes.narrow(1, 0, 1).clamp(
       static_cast<float>(window.y1), static_cast<float>(window.y2));
@@ -5,13 +5,28 @@
 
 #include <torch/torch.h>
 
-/* Computes IoU overlaps between two sets of boxes.
+/* Computes IoU overlaps between two sets of boxes in a single pass of the
+ * tiled IoU kernel.
  * boxes1, boxes2: [N, (y1, x1, y2, x2)].
- * !!! Requires a lot of memory - but without loops
+ * Returns: [boxes1 count, boxes2 count]
  */
 torch::Tensor BBoxOverlaps(torch::Tensor boxes1, torch::Tensor boxes2);
 
-/* Computes IoU overlaps between two sets of boxes.
+/* Computes the best matches between two sets of boxes without building the
+ * overlaps matrix.
+ * boxes1, boxes2: [N, (y1, x1, y2, x2)].
+ * Returns:
+ * max: [boxes1 count] max IoU of each box of boxes1 with boxes2
+ * argmax: [boxes1 count] (long) index of the matched box in boxes2
+ * max2: [boxes2 count] max IoU of each box of boxes2 with boxes1
+ * argmax2: [boxes2 count] (long) index of the matched box in boxes1
+ * The first index is taken among equal IoU values.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> BBoxMaxOverlaps(
+    torch::Tensor boxes1,
+    torch::Tensor boxes2);
+
+/* Computes IoU overlaps between two sets of boxes with torch operations.
  * boxes1, boxes2: [N, (y1, x1, y2, x2)].
  * For better performance, pass the largest set first and the smaller second.
  */
@@ -35,6 +50,23 @@ at::Tensor ApplyBoxDeltas(at::Tensor boxes, at::Tensor deltas);
  */
 at::Tensor ClipBoxes(at::Tensor boxes, Window window);
 
+/*
+ * ApplyBoxDeltas, scaling and ClipBoxes fused in a single kernel, runs on
+ * the device of boxes without temporary tensors.
+ * boxes: [N, (y1, x1, y2, x2)]
+ * deltas: [N, (dy, dx, log(dh), log(dw))] before multiplying by std_dev
+ * scale_y, scale_x: multipliers of the decoded coordinates, e.g. the image
+ *                   size to get pixels from normalized boxes
+ * window: (y1, x1, y2, x2) to clip to, in the scaled coordinates
+ * Returns: [N, (y1, x1, y2, x2)]
+ */
+at::Tensor DecodeBoxes(at::Tensor boxes,
+                       at::Tensor deltas,
+                       const std::vector<float>& std_dev,
+                       float scale_y,
+                       float scale_x,
+                       const Window& window);
+
 /*
  *    window: (y1, x1, y2, x2). The window in the image we want to clip to.
  *    boxes: [N, (y1, x1, y2, x2)]
@@ -0,0 +1,120 @@
+#include "checkpointwriter.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <cuda_runtime_api.h>
+
+#include <experimental/filesystem>
+#include <iostream>
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+void CheckCuda(cudaError_t status) {
+  if (status != cudaSuccess)
+    throw std::runtime_error(std::string("Checkpoint CUDA error : ") +
+                             cudaGetErrorString(status));
+}
+}  // namespace
+
+CheckpointWriter::CheckpointWriter()
+    : thread_(&CheckpointWriter::WriteLoop, this) {}
+
+CheckpointWriter::~CheckpointWriter() {
+  try {
+    Wait();
+  } catch (const std::exception& err) {
+    std::cerr << "Checkpoint failed : " << err.what() << std::endl;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  if (copy_event_)
+    cudaEventDestroy(static_cast<cudaEvent_t>(copy_event_));
+}
+
+void CheckpointWriter::Save(const StateTensors& state,
+                            const std::string& file_name,
+                            const std::string& replaced_file) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WaitLocked(lock);
+
+  torch::NoGradGuard no_grad;
+  auto& host_tensors = host_state_.tensors;
+  host_tensors.resize(state.tensors.size());
+  wait_copy_ = false;
+  for (size_t i = 0; i < state.tensors.size(); ++i) {
+    const auto& tensor = state.tensors[i];
+    auto& host = host_tensors[i];
+    if (!host.defined() || host.sizes() != tensor.sizes() ||
+        host.scalar_type() != tensor.scalar_type()) {
+      host = torch::empty(tensor.sizes(), at::dtype(tensor.scalar_type()));
+      if (tensor.is_cuda())
+        host = host.pin_memory();
+    }
+    host.copy_(tensor, /*non_blocking*/ true);
+    wait_copy_ = wait_copy_ || tensor.is_cuda();
+  }
+  if (wait_copy_) {
+    if (!copy_event_) {
+      cudaEvent_t event;
+      CheckCuda(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+      copy_event_ = event;
+    }
+    CheckCuda(cudaEventRecord(static_cast<cudaEvent_t>(copy_event_),
+                              at::cuda::getCurrentCUDAStream().stream()));
+  }
+  host_state_.names = state.names;
+  host_state_.is_buffer = state.is_buffer;
+  host_state_.partial = state.partial;
+  file_name_ = file_name;
+  replaced_file_ = replaced_file;
+  pending_ = true;
+  cv_.notify_all();
+}
+
+void CheckpointWriter::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WaitLocked(lock);
+}
+
+void CheckpointWriter::WaitLocked(std::unique_lock<std::mutex>& lock) {
+  cv_.wait(lock, [this] { return !pending_; });
+  if (error_) {
+    auto error = error_;
+    error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void CheckpointWriter::WriteLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || pending_; });
+    if (!pending_)
+      break;
+    // Save can't touch the state while the checkpoint is pending, so it is
+    // written without the lock
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      if (wait_copy_)
+        CheckCuda(cudaEventSynchronize(static_cast<cudaEvent_t>(copy_event_)));
+      auto tmp_file_name = file_name_ + ".tmp";
+      SaveStateTensors(host_state_, tmp_file_name);
+      fs::rename(tmp_file_name, file_name_);
+      if (!replaced_file_.empty() && replaced_file_ != file_name_ &&
+          fs::exists(replaced_file_))
+        fs::remove(replaced_file_);
+      std::cerr << "Checkpoint saved to : " << file_name_ << "\n";
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    error_ = error;
+    pending_ = false;
+    cv_.notify_all();
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef CHECKPOINTWRITER_H
+#define CHECKPOINTWRITER_H
+
+#include "stateloader.h"
+
+#include <torch/torch.h>
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Writes checkpoints on the background thread, so training continues while
+ * the state is saved. Save copies the state to the pinned host buffers,
+ * which are reused by the next checkpoints, with asynchronous copies queued
+ * on the current CUDA stream. The writer thread waits for the copies, writes
+ * the file next to the target and renames it, so the checkpoint file is
+ * either complete or absent. Only one checkpoint is written at a time.
+ */
+class CheckpointWriter {
+ public:
+  CheckpointWriter();
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+  // Waits for the last checkpoint
+  ~CheckpointWriter();
+
+  // Waits for the previous checkpoint before the copy. replaced_file is
+  // removed after the new checkpoint is in place.
+  void Save(const StateTensors& state,
+            const std::string& file_name,
+            const std::string& replaced_file = "");
+
+  // Waits for the written checkpoint, rethrows the error of writing it
+  void Wait();
+
+ private:
+  void WriteLoop();
+  void WaitLocked(std::unique_lock<std::mutex>& lock);
+
+ private:
+  StateTensors host_state_;
+  std::string file_name_;
+  std::string replaced_file_;
+  void* copy_event_{nullptr};
+  bool wait_copy_{false};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool pending_{false};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+
+#endif  // CHECKPOINTWRITER_H
@@ -6,7 +6,6 @@ ClassifierImpl::ClassifierImpl() {}
 
 ClassifierImpl::ClassifierImpl(uint32_t depth,
                                uint32_t pool_size,
-                               const std::vector<int32_t>& image_shape,
                                uint32_t num_classes)
     : conv1_(torch::nn::Conv2dOptions(depth, 1024, pool_size).stride(1)),
       bn1_(torch::nn::BatchNormOptions(1024).eps(0.001).momentum(0.01)),
@@ -15,8 +14,7 @@ ClassifierImpl::ClassifierImpl(uint32_t depth,
       relu_(torch::relu),
       linear_class_(1024, num_classes),
       linear_bbox_(1024, num_classes * 4),
-      pool_size_(pool_size),
-      image_shape_(image_shape) {
+      pool_size_(pool_size) {
   register_module("conv1", conv1_);
   register_module("bn1", bn1_);
   register_module("conv2", conv2_);
@@ -28,9 +26,15 @@ ClassifierImpl::ClassifierImpl(uint32_t depth,
 
 std::tuple<at::Tensor, at::Tensor, at::Tensor> ClassifierImpl::forward(
     std::vector<at::Tensor> feature_maps,
-    at::Tensor rois) {
+    at::Tensor rois,
+    const std::vector<int32_t>& image_shape,
+    StageProfiler* profiler) {
   feature_maps.insert(feature_maps.begin(), rois);
-  auto x = PyramidRoiAlign(feature_maps, pool_size_, image_shape_);
+  at::Tensor x;
+  {
+    StageProfiler::Scope scope(profiler, "classifier_roi_align");
+    x = PyramidRoiAlign(feature_maps, pool_size_, image_shape);
+  }
   x = conv1_->forward(x);
   x = bn1_->forward(x);
   x = relu_->forward(x);
@@ -3,6 +3,8 @@
 
 #include <inttypes.h>
 
+#include "stageprofiler.h"
+
 #include <torch/torch.h>
 
 class ClassifierImpl : public torch::nn::Module {
@@ -10,12 +12,14 @@ class ClassifierImpl : public torch::nn::Module {
   ClassifierImpl();
   ClassifierImpl(uint32_t depth,
                  uint32_t pool_size,
-                 const std::vector<int32_t>& image_shape,
                  uint32_t num_classes);
 
+  // image_shape: [height, width] of the input images, including padding
   std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> forward(
       std::vector<torch::Tensor> feature_maps,
-      torch::Tensor rois);
+      torch::Tensor rois,
+      const std::vector<int32_t>& image_shape,
+      StageProfiler* profiler = nullptr);
 
  private:
   torch::nn::Conv2d conv1_{nullptr};
@@ -27,7 +31,6 @@ class ClassifierImpl : public torch::nn::Module {
   torch::nn::Linear linear_bbox_{nullptr};
 
   uint32_t pool_size_{0};
-  std::vector<int32_t> image_shape_;
 };
 
 TORCH_MODULE(Classifier);
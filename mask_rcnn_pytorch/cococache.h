@@ -0,0 +1,61 @@
+#ifndef COCOCACHE_H
+#define COCOCACHE_H
+
+#include "mappedfile.h"
+
+#include <cstdint>
+
+/* Binary cache of the parsed COCO annotations file, instance masks are stored
+ * as RLE counts (see cocorle.h) so they are not rasterized for each sample.
+ * File layout:
+ * [header][images][categories][annotations][names][RLE counts]
+ * Names are stored without terminating zeros, offsets are from the file start.
+ * The cache is valid only for the annotations file of the same size and
+ * modification time.
+ */
+const char kCocoCacheMagic[8] = {'C', 'O', 'C', 'O', 'C', 'A', 'C', 'H'};
+const uint32_t kCocoCacheVersion = 1;
+
+struct CocoCacheHeader {
+  char magic[8];
+  uint32_t version{0};
+  uint32_t images_num{0};
+  uint32_t categories_num{0};
+  uint32_t annotations_num{0};
+  uint64_t source_size{0};
+  int64_t source_time{0};
+  uint64_t images_offset{0};
+  uint64_t categories_offset{0};
+  uint64_t annotations_offset{0};
+  uint64_t names_offset{0};
+  uint64_t counts_offset{0};
+};
+
+struct CocoCacheImage {
+  uint32_t id{0};
+  uint32_t width{0};
+  uint32_t height{0};
+  uint32_t name_size{0};
+  uint64_t name_offset{0};
+};
+
+struct CocoCacheCategory {
+  uint32_t id{0};
+  uint32_t name_size{0};
+  uint64_t name_offset{0};
+};
+
+struct CocoCacheAnnotation {
+  uint32_t id{0};
+  uint32_t image_id{0};
+  uint32_t category_id{0};
+  uint32_t iscrowd{0};
+  int32_t x{0};
+  int32_t y{0};
+  int32_t width{0};
+  int32_t height{0};
+  uint64_t counts_offset{0};
+  uint64_t counts_num{0};
+};
+
+#endif  // COCOCACHE_H
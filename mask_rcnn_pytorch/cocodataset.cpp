@@ -1,114 +1,14 @@
 #include "cocodataset.h"
+#include "../trace.h"
 #include "anchors.h"
 #include "boxutils.h"
 #include "datasetclasses.h"
 #include "imageutils.h"
 #include "nnutils.h"
+#include "rpntargets.h"
 
-namespace {
-/* Given the anchors and GT boxes, compute overlaps and identify positive
- * anchors and deltas to refine them to match their corresponding GT boxes.
- * anchors: [num_anchors, (y1, x1, y2, x2)]
- * gt_boxes: [num_gt_boxes, (y1, x1, y2, x2)]
- * Returns:
- * rpn_match: [N] (int32) matches between anchors and GT boxes.
- *            1 = positive anchor, -1 = negative anchor, 0 = neutral
- * rpn_bbox: [N, (dy, dx, log(dh), log(dw))] Anchor bbox deltas.
- */
-std::tuple<at::Tensor, at::Tensor> BuildRpnTargets(at::Tensor anchors,
-                                                   at::Tensor gt_boxes,
-                                                   const Config& config) {
-  // RPN Match: 1 = positive anchor, -1 = negative anchor, 0 = neutral
-  auto rpn_match = torch::zeros({anchors.size(0)}, at::dtype(at::kInt));
-  // RPN bounding boxes: [max anchors per image, (dy, dx, log(dh), log(dw))]
-  auto rpn_bbox = torch::zeros({config.rpn_train_anchors_per_image, 4});
-
-  auto minus_one = torch::tensor(-1);
-  auto one = torch::tensor(1);
-
-  // Handle COCO crowds
-  // A crowd box in COCO is a bounding box around several instances.
-  // They are excluded on loading stage
-
-  // Compute overlaps [num_anchors, num_gt_boxes]
-  // use loops because anchors are too big
-  auto overlaps = BBoxOverlapsLoops(anchors, gt_boxes);
-
-  //  // Debug block
-  //  {
-  //    std::cerr << std::get<0>(overlaps.sort(0, true)).narrow(0, 0,
-  //    10).squeeze(); auto max_overlaps =
-  //        std::get<1>(overlaps.sort(0, true)).narrow(0, 0, 10).squeeze();
-  //    auto max_anchors = anchors.index_select(0, max_overlaps);
-  //    VisualizeRPNTrargets(config.image_shape[0], config.image_shape[1],
-  //                         max_anchors, gt_boxes);
-  //    exit(0);
-  //  }
-
-  // Match anchors to GT Boxes
-  // If an anchor overlaps a GT box with IoU >= 0.7 then it's positive.
-  // If an anchor overlaps a GT box with IoU < 0.3 then it's negative.
-  // Neutral anchors are those that don't match the conditions above,
-  // and they don't influence the loss function.
-  // However, don't keep any GT box unmatched (rare, but happens). Instead,
-  // match it to the closest anchor (even if its max IoU is < 0.3).
-
-  // 1. Set negative anchors first. They get overwritten below if a GT box is
-  // matched to them. Skip boxes in crowd areas.
-  auto anchor_iou_argmax = torch::argmax(overlaps, /*dim*/ 1);
-  auto anchor_iou_max =
-      overlaps.index({torch::arange(overlaps.size(0), at::dtype(at::kLong)),
-                      anchor_iou_argmax});
-  rpn_match = torch::where(anchor_iou_max < 0.5, minus_one, rpn_match);  // 0.3
-
-  // 2. Set an anchor for each GT box (regardless of IoU value).
-  // TODO: (Legacy)If multiple anchors have the same IoU match all of them
-  auto gt_iou_argmax = torch::argmax(overlaps, /*dim*/ 0);
-  rpn_match.index_fill_(0, gt_iou_argmax, 1);
-  // 3. Set anchors with high overlap as positive.
-  rpn_match = torch::where(anchor_iou_max >= config.anchor_iou_max_threshold,
-                           one, rpn_match);
-
-  // Subsample to balance positive and negative anchors
-  // Don't let positives be more than half the anchors
-  auto ids = (rpn_match == 1).nonzero().narrow(1, 0, 1);  // take first column
-  auto extra = ids.size(0) - (config.rpn_train_anchors_per_image / 2);
-  if (extra > 0) {
-    // Reset the extra ones to neutral
-    auto idx = torch::randperm(ids.size(0), at::dtype(at::kLong));
-    idx = idx.narrow(0, 0, extra);
-    ids = ids.take(idx);  // random::choice(ids, extra, replace=False)
-    rpn_match.index_fill_(0, ids, 0);
-  }
-  // Same for negative proposals
-  auto positives_num = torch::sum(rpn_match == 1).item<int32_t>();
-  // or: auto positives_num = ids.size(0);
-  ids = (rpn_match == -1).nonzero().narrow(1, 0, 1);
-  extra = ids.size(0) - (config.rpn_train_anchors_per_image - positives_num);
-  if (extra > 0) {
-    // Rest the extra ones to neutral
-    auto idx = torch::randperm(ids.size(0), at::dtype(at::kLong));
-    idx = idx.narrow(0, 0, extra);
-    ids = ids.take(idx);  // random::choice(ids, extra, replace=False)
-    rpn_match.index_fill_(0, ids, 0);
-  }
-
-  // For positive anchors, compute shift and scale needed to transform them
-  // to match the corresponding GT boxes.
-  ids = (rpn_match == 1).nonzero().narrow(1, 0, 1).squeeze();
-  auto gt = gt_boxes.index_select(0, anchor_iou_argmax.take(ids));
-  auto a = anchors.index_select(0, ids);
-  rpn_bbox.index_put_({torch::arange(0, ids.numel(), at::kLong)},
-                      BoxRefinement(a, gt));
+#include <map>
 
-  // Normalize
-  auto std_dev = torch::tensor(config.rpn_bbox_std_dev,
-                               at::dtype(at::kFloat).requires_grad(false));
-  rpn_bbox /= std_dev;
-
-  return {rpn_match, rpn_bbox};
-}
-}  // namespace
 
 CocoDataset::CocoDataset(std::shared_ptr<CocoLoader> loader,
                          std::shared_ptr<const Config> config)
@@ -116,22 +16,60 @@ CocoDataset::CocoDataset(std::shared_ptr<CocoLoader> loader,
   loader_->LoadData(GetDatasetClasses());
   // train only on vehicles
   // loader_->LoadData(GetDatasetClasses(), {2, 3, 4, 6, 7});
-
-  anchors_ = GeneratePyramidAnchors(
-      config_->rpn_anchor_scales, config_->rpn_anchor_ratios,
-      config_->backbone_shapes, config_->backbone_strides,
-      config_->rpn_anchor_stride);
 }
 
-Sample CocoDataset::get(size_t index) {
-  auto img_desc = loader_->GetImage(index);
-  auto img_width = img_desc.image.cols;
-  auto img_height = img_desc.image.rows;
-  auto [image, window, scale, padding] =
-      ResizeImage(img_desc.image, config_->image_min_dim,
-                  config_->image_max_dim, config_->image_padding);
+Sample MakeSample(ImageDesc img_desc,
+                  const Config& config,
+                  JpegDecoder* decoder) {
+  // JPEG files are decoded, resized and molded on the GPU with the decoder,
+  // other encoded images are decoded here
+  cv::Size img_size;
+  const bool gpu_image = decoder != nullptr && !img_desc.image_data.empty() &&
+                         decoder->GetImageSize(img_desc.image_data, img_size);
+  if (!gpu_image && img_desc.image.empty()) {
+    MLCPP_TRACE_ZONE("decode");
+    img_desc.image = cv::imdecode(img_desc.image_data, cv::IMREAD_COLOR);
+    if (img_desc.image.empty())
+      throw std::runtime_error("Failed to decode image " +
+                               std::to_string(img_desc.id));
+  }
+  if (!gpu_image)
+    img_size = img_desc.image.size();
+  auto img_width = img_size.width;
+  auto img_height = img_size.height;
+  auto scale = ResizeScale(img_height, img_width, config.image_min_dim,
+                           config.image_max_dim);
+  auto resized_size = ResizedImageSize(img_height, img_width,
+                                       config.image_min_dim,
+                                       config.image_max_dim);
+  auto [window, padding] =
+      InputPadding(resized_size.height, resized_size.width, config);
+  const auto input_height =
+      resized_size.height + padding.top_pad + padding.bottom_pad;
+  const auto input_width =
+      resized_size.width + padding.left_pad + padding.right_pad;
+  cv::Mat image;
+  if (!gpu_image) {
+    image = std::get<0>(ResizeImage(img_desc.image, config.image_min_dim,
+                                    config.image_max_dim, false));
+    cv::copyMakeBorder(image, image, padding.top_pad, padding.bottom_pad,
+                       padding.left_pad, padding.right_pad,
+                       cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
+  }
 
-  auto masks = ResizeMasks(img_desc.masks, scale, padding);
+  // Mini masks are made in one resize, from the box areas of the masks
+  std::vector<cv::Mat> masks;
+  if (config.use_mini_mask) {
+    std::vector<cv::Rect> mask_boxes;
+    mask_boxes.reserve(img_desc.boxes.size());
+    for (auto bbox : img_desc.boxes)
+      mask_boxes.emplace_back(bbox.x, bbox.y, bbox.width, bbox.height);
+    masks = MiniMasksFromRle(img_desc.masks, mask_boxes,
+                             config.mini_mask_shape[0],
+                             config.mini_mask_shape[1]);
+  } else {
+    masks = ResizeMasks(img_desc.masks, scale, padding);
+  }
 
   // Resize and format boxes -> [y1,x1,y2,x2]
   std::vector<float> boxes;
@@ -167,25 +105,26 @@ Sample CocoDataset::get(size_t index) {
   //    exit(0);
   //  }
 
-  // Resize masks to smaller size to reduce memory usage
-  if (config_->use_mini_mask) {
-    masks = MinimizeMasks(boxes, masks, config_->mini_mask_shape[0],
-                          config_->mini_mask_shape[1]);
-  }
-
   // Make training sample
   Sample result;
-  img_desc.image = MoldImage(image, *config_);
-  result.data.image = CvImageToTensor(img_desc.image);
+  if (gpu_image) {
+    result.data.image =
+        MoldImageTensor(decoder->Decode(img_desc.image_data), resized_size,
+                        padding, config);
+  } else {
+    img_desc.image = MoldImage(image, config);
+    result.data.image = CvImageToTensor(img_desc.image);
+  }
   result.data.image_meta.image_id = static_cast<int32_t>(img_desc.id);
   result.data.image_meta.window = window;
   result.data.image_meta.image_width = img_width;
   result.data.image_meta.image_height = img_height;
 
+  // Masks stay bytes on the way to the device, only the masks of the
+  // sampled ROIs become floats in DetectionTargetLayer
   std::vector<at::Tensor> tmasks;
   for (auto& m : masks) {
-    auto mask = CvImageToTensor(m) != 0;
-    tmasks.push_back(mask.to(at::kFloat));
+    tmasks.push_back(CvImageToTensor(m) != 0);
   }
   result.target.gt_masks = torch::stack(tmasks);
 
@@ -196,14 +135,20 @@ Sample CocoDataset::get(size_t index) {
   result.target.gt_class_ids =
       torch::tensor(img_desc.classes, at::dtype(at::kInt)).clone();
 
-  // RPN Targets
-  auto [rpn_match, rpn_bbox] =
-      BuildRpnTargets(anchors_, result.target.gt_boxes, *config_);
+  // RPN Targets, they are built by the training loop on the GPU if enabled
+  at::Tensor rpn_match = torch::empty({0}, at::dtype(at::kInt));
+  at::Tensor rpn_bbox = torch::empty({0, 4});
+  if (!config.rpn_targets_on_gpu) {
+    auto anchors =
+        CachedPyramidAnchors(config, input_height, input_width, at::kCPU);
+    std::tie(rpn_match, rpn_bbox) =
+        BuildRpnTargets(anchors, result.target.gt_boxes, config);
+  }
 
   // If more instances than fits in the array, sub-sample from them.
-  if (result.target.gt_boxes.size(0) > config_->max_gt_instances) {
+  if (result.target.gt_boxes.size(0) > config.max_gt_instances) {
     auto ids = torch::randperm(result.target.gt_boxes.size(0), at::kLong);
-    ids = ids.narrow(0, 0, config_->max_gt_instances);
+    ids = ids.narrow(0, 0, config.max_gt_instances);
     result.target.gt_class_ids =
         result.target.gt_class_ids.index_select(0, ids);
     result.target.gt_boxes = result.target.gt_boxes.index_select(0, ids);
@@ -223,6 +168,32 @@ Sample CocoDataset::get(size_t index) {
   return result;
 }
 
+Sample CocoDataset::get(size_t index) {
+  MLCPP_TRACE_ZONE("load");
+  return MakeSample(loader_->GetImage(index), *config_);
+}
+
 torch::optional<size_t> CocoDataset::size() const {
   return loader_->GetImagesCount();
 }
+
+std::vector<uint32_t> CocoDataset::ShapeGroups() const {
+  auto sizes = loader_->GetImageSizes();
+  std::vector<uint32_t> groups;
+  groups.reserve(sizes.size());
+  std::map<std::pair<int32_t, int32_t>, uint32_t> shape_groups;
+  for (const auto& size : sizes) {
+    auto resized = ResizedImageSize(size.height, size.width,
+                                    config_->image_min_dim,
+                                    config_->image_max_dim);
+    auto [window, padding] =
+        InputPadding(resized.height, resized.width, *config_);
+    std::pair<int32_t, int32_t> shape(
+        resized.height + padding.top_pad + padding.bottom_pad,
+        resized.width + padding.left_pad + padding.right_pad);
+    auto group = shape_groups.emplace(
+        shape, static_cast<uint32_t>(shape_groups.size()));
+    groups.push_back(group.first->second);
+  }
+  return groups;
+}
@@ -4,6 +4,7 @@
 #include "cocoloader.h"
 #include "config.h"
 #include "imageutils.h"
+#include "jpegdecoder.h"
 
 #include <torch/torch.h>
 
@@ -22,6 +23,13 @@ struct Target {
 
 using Sample = torch::data::Example<Input, Target>;
 
+// Resized and padded image with the targets for the training. Encoded JPEG
+// images are decoded on the GPU if the decoder is given, then the image of
+// the sample is on the GPU.
+Sample MakeSample(ImageDesc img_desc,
+                  const Config& config,
+                  JpegDecoder* decoder = nullptr);
+
 class CocoDataset : public torch::data::Dataset<CocoDataset, Sample> {
  public:
   CocoDataset(std::shared_ptr<CocoLoader> loader,
@@ -30,10 +38,17 @@ class CocoDataset : public torch::data::Dataset<CocoDataset, Sample> {
   Sample get(size_t index) override;
   torch::optional<size_t> size() const override;
 
+  // Group of the input shape for every image, images of one group have the
+  // same shape after resizing and padding
+  std::vector<uint32_t> ShapeGroups() const;
+
+  // Annotations for the evaluation of the detections
+  const CocoLoader& Loader() const { return *loader_; }
+  std::shared_ptr<const Config> GetConfig() const { return config_; }
+
  private:
   std::shared_ptr<CocoLoader> loader_;
   std::shared_ptr<const Config> config_;
-  torch::Tensor anchors_;
 };
 
 #endif  // COCODATASET_H
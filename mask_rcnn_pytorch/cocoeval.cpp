@@ -0,0 +1,353 @@
+#include "cocoeval.h"
+#include "../threadpool.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <set>
+#include <utility>
+
+namespace {
+const int kIouThresholdsNum = 10;
+const int kRecallThresholdsNum = 101;
+const int kMaxDetsNum = 3;
+const uint32_t kMaxDets[kMaxDetsNum] = {1, 10, 100};
+// all, small, medium, large
+const int kAreasNum = 4;
+const double kAreaRanges[kAreasNum][2] = {{0, 1e10},
+                                          {0, 32 * 32},
+                                          {32 * 32, 96 * 96},
+                                          {96 * 96, 1e10}};
+
+// The same values as np.linspace in pycocotools
+double IouThreshold(int t) {
+  return 0.5 + t * (0.45 / (kIouThresholdsNum - 1));
+}
+
+double RecallThreshold(int r) {
+  return r * (1.0 / (kRecallThresholdsNum - 1));
+}
+
+bool IsInRange(double area, int range) {
+  return area >= kAreaRanges[range][0] && area <= kAreaRanges[range][1];
+}
+
+double BoxArea(const CocoInstance& instance) {
+  return static_cast<double>(instance.box[2]) * instance.box[3];
+}
+
+double BoxIntersection(const CocoInstance& a, const CocoInstance& b) {
+  auto w = std::min(a.box[0] + a.box[2], b.box[0] + b.box[2]) -
+           std::max(a.box[0], b.box[0]);
+  auto h = std::min(a.box[1] + a.box[3], b.box[1] + b.box[3]) -
+           std::max(a.box[1], b.box[1]);
+  if (w <= 0 || h <= 0)
+    return 0;
+  return static_cast<double>(w) * h;
+}
+
+// Matching results of the detections of one image and class for one area
+// range, detections are sorted by score
+struct ImageEval {
+  std::vector<float> scores;
+  // [threshold][detection]
+  std::vector<std::vector<uint8_t>> matched;
+  std::vector<std::vector<uint8_t>> ignored;
+  uint32_t gt_num{0};  // not ignored
+  bool valid{false};
+};
+
+std::vector<std::vector<double>> ComputeIous(
+    const std::vector<const CocoInstance*>& dts,
+    const std::vector<const CocoInstance*>& gts,
+    const std::vector<double>& dt_areas,  // box or mask areas for the type
+    CocoIouType type) {
+  std::vector<std::vector<double>> ious(dts.size(),
+                                        std::vector<double>(gts.size(), 0));
+  std::vector<double> gt_areas(gts.size());
+  for (size_t g = 0; g < gts.size(); ++g)
+    gt_areas[g] = type == CocoIouType::BBox
+                      ? BoxArea(*gts[g])
+                      : static_cast<double>(RleArea(gts[g]->mask));
+  for (size_t d = 0; d < dts.size(); ++d) {
+    for (size_t g = 0; g < gts.size(); ++g) {
+      // Instances with separate boxes can't overlap, masks are compared only
+      // when the boxes with a pixel of margin intersect
+      auto intersection = BoxIntersection(*dts[d], *gts[g]);
+      if (type == CocoIouType::Segm) {
+        CocoInstance expanded = *gts[g];
+        expanded.box[0] -= 1;
+        expanded.box[1] -= 1;
+        expanded.box[2] += 2;
+        expanded.box[3] += 2;
+        if (BoxIntersection(*dts[d], expanded) <= 0)
+          continue;
+        intersection =
+            static_cast<double>(RleIntersection(dts[d]->mask, gts[g]->mask));
+      }
+      auto union_area = gts[g]->iscrowd
+                            ? dt_areas[d]
+                            : dt_areas[d] + gt_areas[g] - intersection;
+      if (union_area > 0)
+        ious[d][g] = intersection / union_area;
+    }
+  }
+  return ious;
+}
+
+ImageEval EvaluateImage(const std::vector<const CocoInstance*>& dts,
+                        const std::vector<const CocoInstance*>& gts,
+                        const std::vector<double>& dt_areas,
+                        const std::vector<double>& gt_areas,
+                        const std::vector<std::vector<double>>& ious,
+                        int area_range) {
+  ImageEval eval;
+  if (dts.empty() && gts.empty())
+    return eval;
+  eval.valid = true;
+
+  // Not ignored ground truth goes first
+  std::vector<uint8_t> gt_ignored(gts.size());
+  for (size_t g = 0; g < gts.size(); ++g) {
+    gt_ignored[g] = gts[g]->iscrowd || !IsInRange(gt_areas[g], area_range);
+    eval.gt_num += gt_ignored[g] ? 0 : 1;
+  }
+  std::vector<size_t> gt_order(gts.size());
+  std::iota(gt_order.begin(), gt_order.end(), 0);
+  std::stable_sort(gt_order.begin(), gt_order.end(), [&](size_t a, size_t b) {
+    return gt_ignored[a] < gt_ignored[b];
+  });
+
+  auto dts_num = dts.size();
+  eval.scores.resize(dts_num);
+  for (size_t d = 0; d < dts_num; ++d)
+    eval.scores[d] = dts[d]->score;
+  eval.matched.assign(kIouThresholdsNum, std::vector<uint8_t>(dts_num, 0));
+  eval.ignored.assign(kIouThresholdsNum, std::vector<uint8_t>(dts_num, 0));
+  for (int t = 0; t < kIouThresholdsNum; ++t) {
+    std::vector<uint8_t> gt_matched(gts.size(), 0);
+    for (size_t d = 0; d < dts_num; ++d) {
+      double best_iou = std::min(IouThreshold(t), 1 - 1e-10);
+      int64_t match = -1;
+      for (auto g : gt_order) {
+        // Crowd regions can be matched many times
+        if (gt_matched[g] && !gts[g]->iscrowd)
+          continue;
+        // Ignored ground truth is matched only if nothing else was
+        if (match > -1 && !gt_ignored[static_cast<size_t>(match)] &&
+            gt_ignored[g])
+          break;
+        if (ious[d][g] < best_iou)
+          continue;
+        best_iou = ious[d][g];
+        match = static_cast<int64_t>(g);
+      }
+      if (match > -1) {
+        auto g = static_cast<size_t>(match);
+        gt_matched[g] = 1;
+        eval.matched[t][d] = 1;
+        eval.ignored[t][d] = gt_ignored[g];
+      } else {
+        // Unmatched detections outside of the area range don't count
+        eval.ignored[t][d] = !IsInRange(dt_areas[d], area_range);
+      }
+    }
+  }
+  return eval;
+}
+}  // namespace
+
+void CocoEvaluator::AddGroundTruth(CocoInstance instance) {
+  ground_truth_.push_back(std::move(instance));
+}
+
+void CocoEvaluator::AddDetection(CocoInstance instance) {
+  detections_.push_back(std::move(instance));
+}
+
+void CocoEvaluator::Clear() {
+  ground_truth_.clear();
+  detections_.clear();
+}
+
+CocoEvalStats CocoEvaluator::Evaluate(CocoIouType type) const {
+  // Instances grouped by image and class
+  using Key = std::pair<uint32_t, int32_t>;
+  std::map<Key, std::vector<const CocoInstance*>> gt_groups;
+  std::map<Key, std::vector<const CocoInstance*>> dt_groups;
+  std::set<uint32_t> image_set;
+  std::set<int32_t> class_set;
+  for (const auto& gt : ground_truth_) {
+    gt_groups[{gt.image_id, gt.class_id}].push_back(&gt);
+    image_set.insert(gt.image_id);
+    class_set.insert(gt.class_id);
+  }
+  for (const auto& dt : detections_) {
+    dt_groups[{dt.image_id, dt.class_id}].push_back(&dt);
+    image_set.insert(dt.image_id);
+  }
+  std::vector<uint32_t> images(image_set.begin(), image_set.end());
+  std::vector<int32_t> classes(class_set.begin(), class_set.end());
+  const auto images_num = images.size();
+  const auto classes_num = classes.size();
+
+  // [class][area][image]
+  std::vector<std::vector<std::vector<ImageEval>>> evals(
+      classes_num, std::vector<std::vector<ImageEval>>(
+                       kAreasNum, std::vector<ImageEval>(images_num)));
+  const std::vector<const CocoInstance*> no_instances;
+  utils::ParallelFor(0, classes_num * images_num, [&](size_t pair) {
+    auto k = pair / images_num;
+    auto i = pair % images_num;
+    Key key{images[i], classes[k]};
+    auto gt_group = gt_groups.find(key);
+    auto dt_group = dt_groups.find(key);
+    const auto& gts =
+        gt_group != gt_groups.end() ? gt_group->second : no_instances;
+    auto dts = dt_group != dt_groups.end() ? dt_group->second : no_instances;
+    std::stable_sort(dts.begin(), dts.end(),
+                     [](const CocoInstance* a, const CocoInstance* b) {
+                       return a->score > b->score;
+                     });
+    if (dts.size() > kMaxDets[kMaxDetsNum - 1])
+      dts.resize(kMaxDets[kMaxDetsNum - 1]);
+
+    std::vector<double> dt_areas(dts.size());
+    for (size_t d = 0; d < dts.size(); ++d)
+      dt_areas[d] = type == CocoIouType::BBox
+                        ? BoxArea(*dts[d])
+                        : static_cast<double>(RleArea(dts[d]->mask));
+    // Areas of the ground truth are the mask areas, as in COCO annotations
+    std::vector<double> gt_areas(gts.size());
+    for (size_t g = 0; g < gts.size(); ++g)
+      gt_areas[g] = gts[g]->mask.counts.empty()
+                        ? BoxArea(*gts[g])
+                        : static_cast<double>(RleArea(gts[g]->mask));
+    auto ious = ComputeIous(dts, gts, dt_areas, type);
+    for (int a = 0; a < kAreasNum; ++a)
+      evals[k][static_cast<size_t>(a)][i] =
+          EvaluateImage(dts, gts, dt_areas, gt_areas, ious, a);
+  });
+
+  // [threshold][recall][class][area][max dets], -1 for classes without
+  // ground truth
+  auto index = [classes_num](int t, size_t k, int a, int m) {
+    return ((static_cast<size_t>(t) * classes_num + k) * kAreasNum +
+            static_cast<size_t>(a)) *
+               kMaxDetsNum +
+           static_cast<size_t>(m);
+  };
+  std::vector<double> precision(
+      kRecallThresholdsNum * kIouThresholdsNum * classes_num * kAreasNum *
+          kMaxDetsNum,
+      -1);
+  std::vector<double> recall(
+      kIouThresholdsNum * classes_num * kAreasNum * kMaxDetsNum, -1);
+  const auto precision_stride = kIouThresholdsNum * classes_num * kAreasNum *
+                                kMaxDetsNum;
+  utils::ParallelFor(0, classes_num, [&](size_t k) {
+    for (int a = 0; a < kAreasNum; ++a) {
+      for (int m = 0; m < kMaxDetsNum; ++m) {
+        const auto max_dets = kMaxDets[m];
+        std::vector<float> scores;
+        std::vector<std::pair<size_t, size_t>> refs;  // image, detection
+        uint32_t gt_num = 0;
+        for (size_t i = 0; i < images_num; ++i) {
+          const auto& eval = evals[k][static_cast<size_t>(a)][i];
+          if (!eval.valid)
+            continue;
+          gt_num += eval.gt_num;
+          auto num = std::min<size_t>(eval.scores.size(), max_dets);
+          for (size_t d = 0; d < num; ++d) {
+            scores.push_back(eval.scores[d]);
+            refs.emplace_back(i, d);
+          }
+        }
+        if (gt_num == 0)
+          continue;
+        std::vector<size_t> order(scores.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+          return scores[x] > scores[y];
+        });
+
+        for (int t = 0; t < kIouThresholdsNum; ++t) {
+          std::vector<double> rc(order.size());
+          std::vector<double> pr(order.size());
+          double tp = 0;
+          double fp = 0;
+          for (size_t n = 0; n < order.size(); ++n) {
+            auto ref = refs[order[n]];
+            const auto& eval = evals[k][static_cast<size_t>(a)][ref.first];
+            if (!eval.ignored[t][ref.second]) {
+              tp += eval.matched[t][ref.second] ? 1 : 0;
+              fp += eval.matched[t][ref.second] ? 0 : 1;
+            }
+            rc[n] = tp / gt_num;
+            pr[n] = tp / (fp + tp + std::numeric_limits<double>::epsilon());
+          }
+          recall[index(t, k, a, m)] = rc.empty() ? 0 : rc.back();
+
+          // Precision envelope, interpolated at the recall thresholds
+          for (size_t n = pr.size(); n > 1; --n)
+            pr[n - 2] = std::max(pr[n - 2], pr[n - 1]);
+          for (int r = 0; r < kRecallThresholdsNum; ++r) {
+            auto pos = std::lower_bound(rc.begin(), rc.end(),
+                                        RecallThreshold(r)) -
+                       rc.begin();
+            auto value = static_cast<size_t>(pos) < pr.size()
+                             ? pr[static_cast<size_t>(pos)]
+                             : 0;
+            precision[static_cast<size_t>(r) * precision_stride +
+                      index(t, k, a, m)] = value;
+          }
+        }
+      }
+    }
+  });
+
+  // Mean over the thresholds and classes with ground truth, threshold -1
+  // takes all of them
+  auto summarize = [&](bool ap, int threshold, int a, int m) {
+    double sum = 0;
+    size_t count = 0;
+    for (int t = 0; t < kIouThresholdsNum; ++t) {
+      if (threshold >= 0 && t != threshold)
+        continue;
+      for (size_t k = 0; k < classes_num; ++k) {
+        for (int r = 0; r < (ap ? kRecallThresholdsNum : 1); ++r) {
+          auto value = ap ? precision[static_cast<size_t>(r) *
+                                          precision_stride +
+                                      index(t, k, a, m)]
+                          : recall[index(t, k, a, m)];
+          if (value > -1) {
+            sum += value;
+            ++count;
+          }
+        }
+      }
+    }
+    return count > 0 ? sum / static_cast<double>(count) : -1;
+  };
+
+  const int all = 0;
+  const int small = 1;
+  const int medium = 2;
+  const int large = 3;
+  const int max100 = kMaxDetsNum - 1;
+  CocoEvalStats stats;
+  stats.ap = summarize(true, -1, all, max100);
+  stats.ap50 = summarize(true, 0, all, max100);
+  stats.ap75 = summarize(true, 5, all, max100);
+  stats.ap_small = summarize(true, -1, small, max100);
+  stats.ap_medium = summarize(true, -1, medium, max100);
+  stats.ap_large = summarize(true, -1, large, max100);
+  stats.ar1 = summarize(false, -1, all, 0);
+  stats.ar10 = summarize(false, -1, all, 1);
+  stats.ar100 = summarize(false, -1, all, max100);
+  stats.ar_small = summarize(false, -1, small, max100);
+  stats.ar_medium = summarize(false, -1, medium, max100);
+  stats.ar_large = summarize(false, -1, large, max100);
+  return stats;
+}
@@ -0,0 +1,64 @@
+#ifndef COCOEVAL_H
+#define COCOEVAL_H
+
+#include "cocorle.h"
+
+#include <cstdint>
+#include <vector>
+
+enum class CocoIouType { BBox, Segm };
+
+// Ground truth annotation or detection of one image
+struct CocoInstance {
+  uint32_t image_id{0};
+  int32_t class_id{0};
+  // x, y, width, height in pixels
+  float box[4] = {0, 0, 0, 0};
+  // Mask of the image size, can be empty for the box evaluation
+  RleMask mask;
+  // Ground truth only, crowd regions match any number of detections and
+  // don't count as misses
+  bool iscrowd{false};
+  // Detections only
+  float score{0};
+};
+
+/* The standard COCO summary, -1 if there are no ground truth instances for
+ * the area range
+ */
+struct CocoEvalStats {
+  double ap{-1};  // IoU=0.50:0.95
+  double ap50{-1};
+  double ap75{-1};
+  double ap_small{-1};
+  double ap_medium{-1};
+  double ap_large{-1};
+  double ar1{-1};  // Max 1 detection per image
+  double ar10{-1};
+  double ar100{-1};
+  double ar_small{-1};
+  double ar_medium{-1};
+  double ar_large{-1};
+};
+
+/* Computes the COCO detection metrics the same way as COCOeval of
+ * pycocotools: detections are greedily matched to the ground truth by score
+ * for each image and class at IoU thresholds 0.50:0.05:0.95, precision is
+ * interpolated at 101 recall points and averaged over the classes with the
+ * ground truth. Masks are compared in RLE without decoding them. Images and
+ * classes are matched in parallel on the shared pool of threadpool.h.
+ */
+class CocoEvaluator {
+ public:
+  void AddGroundTruth(CocoInstance instance);
+  void AddDetection(CocoInstance instance);
+  void Clear();
+
+  CocoEvalStats Evaluate(CocoIouType type) const;
+
+ private:
+  std::vector<CocoInstance> ground_truth_;
+  std::vector<CocoInstance> detections_;
+};
+
+#endif  // COCOEVAL_H
@@ -1,5 +1,7 @@
 #include "cocoloader.h"
 
+#include "../threadpool.h"
+#include "cocorle.h"
 #include "imageutils.h"
 
 #include <rapidjson/error/en.h>
@@ -7,14 +9,19 @@
 #include <rapidjson/reader.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <experimental/filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 
 namespace fs = std::experimental::filesystem;
 
 CocoLoader::CocoLoader(const std::string& images_folder,
-                       const std::string& ann_file) {
+                       const std::string& ann_file,
+                       const std::string& cache_file)
+    : cache_file_(cache_file) {
   images_folder_ = fs::path(images_folder);
   if (!fs::exists(images_folder_))
     throw std::runtime_error(images_folder_ + " folder missed");
@@ -38,6 +45,11 @@ struct CocoHandler
   }
 
   bool Uint(unsigned u) {
+    if (rle_object_) {
+      if (key_ == "counts")
+        annotation_.push_rle_count(u);
+      return true;
+    }
     if (image_object_) {
       if (key_ == "id") {
         image_.id = u;
@@ -59,16 +71,17 @@ struct CocoHandler
         annotation_.category_id = u;
       } else if (key_ == "iscrowd") {
         annotation_.iscrowd = u == 1;
-        if (annotation_.iscrowd) {
-          std::cerr << "RLE segmentations are not supported\n";
-          exit(0);
-        }
       }
     }
     return true;
   }
 
   bool String(const char* str, rapidjson::SizeType length, bool /*copy*/) {
+    if (rle_object_) {
+      if (key_ == "counts")
+        annotation_.rle = DecodeRleString(str, length);
+      return true;
+    }
     if (image_object_) {
       if (key_ == "file_name") {
         image_.name.assign(str, length);
@@ -81,15 +94,15 @@ struct CocoHandler
     return true;
   }
   bool StartObject() {
-    if (image_array_) {
+    if (annotation_object_ && key_ == "segmentation") {
+      // {"counts": [...] or "...", "size": [height, width]}
+      rle_object_ = true;
+    } else if (image_array_) {
       image_object_ = true;
     } else if (category_array_) {
       category_object_ = true;
     } else if (annotation_array_) {
       annotation_object_ = true;
-    } else if (segmentation_array_) {
-      std::cerr << "RLE segmentations are not supported\n";
-      exit(0);
     }
     return true;
   }
@@ -98,7 +111,9 @@ struct CocoHandler
     return true;
   }
   bool EndObject(rapidjson::SizeType /*memberCount*/) {
-    if (image_array_ && image_object_) {
+    if (rle_object_) {
+      rle_object_ = false;
+    } else if (image_array_ && image_object_) {
       coco_->AddImage(image_);
       image_object_ = false;
     } else if (category_array_ && category_object_) {
@@ -107,13 +122,17 @@ struct CocoHandler
     } else if (annotation_array_ && annotation_object_) {
       coco_->AddAnnotation(annotation_);
       annotation_.segmentation.clear();
+      annotation_.rle.clear();
+      annotation_.iscrowd = false;
       annotation_object_ = false;
     }
     key_.clear();
     return true;
   }
   bool StartArray() {
-    if (key_ == "images") {
+    if (rle_object_) {
+      array_close_ = nullptr;
+    } else if (key_ == "images") {
       image_array_ = true;
       array_close_ = &image_array_;
     } else if (key_ == "categories") {
@@ -156,6 +175,7 @@ struct CocoHandler
 
   CocoAnnotation annotation_;
   bool segmentation_array_ = false;
+  bool rle_object_ = false;
   bool annotation_array_ = false;
   bool annotation_object_ = false;
 
@@ -181,97 +201,346 @@ void CocoLoader::LoadData(const std::vector<std::string>& coco_classes,
     std::cerr << "Dataset " << images_folder_ << " already loaded\n";
     return;
   }
-  auto* file = std::fopen(annotations_file_.c_str(), "r");
-  if (file) {
-    const uint32_t n_reserve = 100000;
-    images_.reserve(n_reserve);
-    annotations_.reserve(n_reserve);
-    categories_.reserve(n_reserve);
-    {  // force memory cleaning
-      char readBuffer[65536];
-      rapidjson::FileReadStream is(file, readBuffer, sizeof(readBuffer));
-      rapidjson::Reader reader;
-      CocoHandler handler(this);
-      auto res = reader.Parse(is, handler);
-      std::fclose(file);
-      if (!res) {
-        throw std::runtime_error(rapidjson::GetParseError_En(res.Code()));
+  const uint32_t n_reserve = 100000;
+  images_.reserve(n_reserve);
+  annotations_.reserve(n_reserve);
+  categories_.reserve(n_reserve);
+  if (!LoadCache()) {
+    ParseAnnotations();
+    SaveCache();
+  }
+
+  // remove images without annotations, crowd ones are not used for training
+  std::vector<uint32_t> images_to_remove;
+  for (auto& img : images_) {
+    auto image_id = img.first;
+    if (!HasTrainAnnotations(image_id)) {
+      images_to_remove.push_back(image_id);
+    }
+  }
+  for (auto image_id : images_to_remove) {
+    images_.erase(image_id);
+  }
+
+  // map categories to classes
+  for (auto& cat : categories_) {
+    auto i =
+        std::find(coco_classes.begin(), coco_classes.end(), cat.second.name);
+    auto pos = std::distance(coco_classes.begin(), i);
+    cat_ind_to_class_ind_.insert({cat.second.id, static_cast<uint32_t>(pos)});
+  }
+  // filter - leave images with required aspect ration only
+  if (keep_aspect > 0) {
+    images_to_remove.clear();
+    for (auto& img : images_) {
+      auto aspect = static_cast<float>(img.second.width) /
+                    static_cast<float>(img.second.height);
+      if (std::abs(aspect - keep_aspect) > 0.001f) {
+        images_to_remove.push_back(img.first);
       }
     }
+    for (auto image_id : images_to_remove) {
+      images_.erase(image_id);
+    }
+  }
 
-    // remove images without annotations
-    std::vector<uint32_t> images_to_remove;
+  // filter - leave only required classes
+  if (!keep_classes.empty()) {
+    std::unordered_set<uint32_t> keep_classes_set;
+    keep_classes_set.insert(keep_classes.begin(), keep_classes.end());
+    images_to_remove.clear();
     for (auto& img : images_) {
       auto image_id = img.first;
-      auto i = image_to_ant_index_.find(image_id);
-      if (i == image_to_ant_index_.end()) {
+      bool skip = true;
+      std::vector<uint32_t> ant_to_remove;
+      auto& ants = image_to_ant_index_[image_id];
+      for (auto ant_id : ants) {
+        auto class_ind =
+            cat_ind_to_class_ind_[annotations_[ant_id].category_id];
+        bool is_keep_class =
+            keep_classes_set.find(class_ind) != keep_classes_set.end();
+        if (is_keep_class) {
+          skip = skip && annotations_[ant_id].iscrowd;
+        } else {
+          ant_to_remove.push_back(ant_id);
+        }
+      }
+
+      if (skip) {
         images_to_remove.push_back(image_id);
+      } else {
+        for (auto ant_id : ant_to_remove) {
+          // leave only keep classes annotations
+          ants.erase(ant_id);
+        }
       }
     }
     for (auto image_id : images_to_remove) {
       images_.erase(image_id);
     }
+  }
+}
 
-    // map categories to classes
-    for (auto& cat : categories_) {
-      auto i =
-          std::find(coco_classes.begin(), coco_classes.end(), cat.second.name);
-      auto pos = std::distance(coco_classes.begin(), i);
-      cat_ind_to_class_ind_.insert({cat.second.id, static_cast<uint32_t>(pos)});
+void CocoLoader::ParseAnnotations() {
+  auto* file = std::fopen(annotations_file_.c_str(), "r");
+  if (file) {
+    char readBuffer[65536];
+    rapidjson::FileReadStream is(file, readBuffer, sizeof(readBuffer));
+    rapidjson::Reader reader;
+    CocoHandler handler(this);
+    auto res = reader.Parse(is, handler);
+    std::fclose(file);
+    if (!res) {
+      throw std::runtime_error(rapidjson::GetParseError_En(res.Code()));
     }
-    // filter - leave images with required aspect ration only
-    if (keep_aspect > 0) {
-      images_to_remove.clear();
-      for (auto& img : images_) {
-        auto aspect = static_cast<float>(img.second.width) /
-                      static_cast<float>(img.second.height);
-        if (std::abs(aspect - keep_aspect) > 0.001f) {
-          images_to_remove.push_back(img.first);
-        }
-      }
-      for (auto image_id : images_to_remove) {
-        images_.erase(image_id);
-      }
+  } else {
+    throw std::runtime_error(annotations_file_ + " file can't be opened");
+  }
+}
+
+static cv::Mat ConvertPolygonsToMask(
+    const std::vector<std::vector<int32_t>>& polygons,
+    const cv::Size& size) {
+  cv::Mat mask = cv::Mat::zeros(size, CV_8UC1);
+
+  std::vector<std::vector<cv::Point>> contours(polygons.size());
+
+  size_t c_idx = 0;
+  for (const auto& poly : polygons) {
+    auto len = poly.size() / 2;
+    for (size_t i = 0; i < len; ++i) {
+      auto p_idx = i * 2;
+      contours[c_idx].push_back(cv::Point(poly[p_idx], poly[p_idx + 1]));
     }
+    ++c_idx;
+  }
 
-    // filter - leave only required classes
-    if (!keep_classes.empty()) {
-      std::unordered_set<uint32_t> keep_classes_set;
-      keep_classes_set.insert(keep_classes.begin(), keep_classes.end());
-      images_to_remove.clear();
-      for (auto& img : images_) {
-        auto image_id = img.first;
-        bool skip = true;
-        std::vector<uint32_t> ant_to_remove;
-        auto& ants = image_to_ant_index_[image_id];
-        for (auto ant_id : ants) {
-          auto class_ind =
-              cat_ind_to_class_ind_[annotations_[ant_id].category_id];
-          bool is_keep_class =
-              keep_classes_set.find(class_ind) != keep_classes_set.end();
-          if (is_keep_class) {
-            skip = false;
-          } else {
-            ant_to_remove.push_back(ant_id);
-          }
-        }
+  cv::drawContours(mask, contours, -1, cv::Scalar(255), cv::FILLED);
 
-        if (skip) {
-          images_to_remove.push_back(image_id);
-        } else {
-          for (auto ant_id : ant_to_remove) {
-            // leave only keep classes annotations
-            ants.erase(ant_id);
-          }
+  return mask;
+}
+
+namespace {
+int64_t GetFileTime(const std::string& file_name) {
+  return static_cast<int64_t>(
+      fs::last_write_time(file_name).time_since_epoch().count());
+}
+
+template <typename T>
+void WriteRecords(std::ofstream& file, const std::vector<T>& records) {
+  file.write(reinterpret_cast<const char*>(records.data()),
+             static_cast<std::streamsize>(records.size() * sizeof(T)));
+}
+}  // namespace
+
+bool CocoLoader::LoadCache() {
+  if (cache_file_.empty() || !fs::exists(cache_file_))
+    return false;
+
+  auto cache = std::make_shared<MappedFile>(cache_file_);
+  const auto* header = cache->at<CocoCacheHeader>(0);
+  if (!header ||
+      std::memcmp(header->magic, kCocoCacheMagic, sizeof(kCocoCacheMagic)) !=
+          0 ||
+      header->version != kCocoCacheVersion ||
+      header->source_size != fs::file_size(annotations_file_) ||
+      header->source_time != GetFileTime(annotations_file_)) {
+    std::cerr << "Cache " << cache_file_ << " is outdated, rebuilding\n";
+    return false;
+  }
+  const auto* images =
+      cache->at<CocoCacheImage>(header->images_offset, header->images_num);
+  const auto* categories = cache->at<CocoCacheCategory>(
+      header->categories_offset, header->categories_num);
+  const auto* annotations = cache->at<CocoCacheAnnotation>(
+      header->annotations_offset, header->annotations_num);
+  if (!images || !categories || !annotations)
+    throw std::runtime_error(cache_file_ + " file is corrupted");
+
+  auto get_name = [&](uint64_t offset, uint32_t size) {
+    const auto* name = cache->at<char>(offset, size);
+    if (!name)
+      throw std::runtime_error(cache_file_ + " file is corrupted");
+    return std::string(name, size);
+  };
+
+  for (uint32_t i = 0; i < header->images_num; ++i) {
+    CocoImage image;
+    image.id = images[i].id;
+    image.width = images[i].width;
+    image.height = images[i].height;
+    image.name = get_name(images[i].name_offset, images[i].name_size);
+    AddImage(std::move(image));
+  }
+  for (uint32_t i = 0; i < header->categories_num; ++i) {
+    CocoCategory category;
+    category.id = categories[i].id;
+    category.name =
+        get_name(categories[i].name_offset, categories[i].name_size);
+    AddCategory(std::move(category));
+  }
+  for (uint32_t i = 0; i < header->annotations_num; ++i) {
+    const auto& cached = annotations[i];
+    CocoAnnotation annotation;
+    annotation.id = cached.id;
+    annotation.image_id = cached.image_id;
+    annotation.category_id = cached.category_id;
+    annotation.iscrowd = cached.iscrowd != 0;
+    annotation.bbox.x = cached.x;
+    annotation.bbox.y = cached.y;
+    annotation.bbox.width = cached.width;
+    annotation.bbox.height = cached.height;
+    annotation.rle_counts =
+        cache->at<uint32_t>(cached.counts_offset, cached.counts_num);
+    annotation.rle_counts_num = cached.counts_num;
+    if (!annotation.rle_counts)
+      throw std::runtime_error(cache_file_ + " file is corrupted");
+    AddAnnotation(std::move(annotation));
+  }
+  cache_ = cache;
+  return true;
+}
+
+void CocoLoader::SaveCache() const {
+  if (cache_file_.empty())
+    return;
+
+  std::vector<CocoCacheImage> images;
+  std::vector<CocoCacheCategory> categories;
+  std::vector<CocoCacheAnnotation> annotations;
+  std::string names;
+  images.reserve(images_.size());
+  for (const auto& img : images_) {
+    CocoCacheImage image;
+    image.id = img.second.id;
+    image.width = img.second.width;
+    image.height = img.second.height;
+    image.name_offset = names.size();
+    image.name_size = static_cast<uint32_t>(img.second.name.size());
+    names += img.second.name;
+    images.push_back(image);
+  }
+  categories.reserve(categories_.size());
+  for (const auto& cat : categories_) {
+    CocoCacheCategory category;
+    category.id = cat.second.id;
+    category.name_offset = names.size();
+    category.name_size = static_cast<uint32_t>(cat.second.name.size());
+    names += cat.second.name;
+    categories.push_back(category);
+  }
+
+  // Rasterize masks once, it is the most expensive part of the build
+  std::vector<const CocoAnnotation*> source;
+  source.reserve(annotations_.size());
+  for (const auto& ant : annotations_)
+    source.push_back(&ant.second);
+  std::vector<std::vector<uint32_t>> counts(source.size());
+  utils::ParallelFor(
+      0, source.size(),
+      [&](size_t i) {
+        auto img = images_.find(source[i]->image_id);
+        if (img != images_.end()) {
+          cv::Size size(static_cast<int>(img->second.width),
+                        static_cast<int>(img->second.height));
+          counts[i] = GetMask(*source[i], size).counts;
         }
-      }
-      for (auto image_id : images_to_remove) {
-        images_.erase(image_id);
-      }
+      },
+      64);
+
+  CocoCacheHeader header;
+  std::memcpy(header.magic, kCocoCacheMagic, sizeof(kCocoCacheMagic));
+  header.version = kCocoCacheVersion;
+  header.images_num = static_cast<uint32_t>(images.size());
+  header.categories_num = static_cast<uint32_t>(categories.size());
+  header.annotations_num = static_cast<uint32_t>(source.size());
+  header.source_size = fs::file_size(annotations_file_);
+  header.source_time = GetFileTime(annotations_file_);
+  header.images_offset = sizeof(CocoCacheHeader);
+  header.categories_offset =
+      header.images_offset + images.size() * sizeof(CocoCacheImage);
+  header.annotations_offset = header.categories_offset +
+                              categories.size() * sizeof(CocoCacheCategory);
+  header.names_offset = header.annotations_offset +
+                        source.size() * sizeof(CocoCacheAnnotation);
+  // Align counts for the direct access from the mapped memory
+  header.counts_offset =
+      (header.names_offset + names.size() + sizeof(uint64_t) - 1) /
+      sizeof(uint64_t) * sizeof(uint64_t);
+
+  for (auto& image : images)
+    image.name_offset += header.names_offset;
+  for (auto& category : categories)
+    category.name_offset += header.names_offset;
+  annotations.reserve(source.size());
+  uint64_t counts_offset = header.counts_offset;
+  for (size_t i = 0; i < source.size(); ++i) {
+    const auto& ant = *source[i];
+    CocoCacheAnnotation annotation;
+    annotation.id = ant.id;
+    annotation.image_id = ant.image_id;
+    annotation.category_id = ant.category_id;
+    annotation.iscrowd = ant.iscrowd ? 1 : 0;
+    annotation.x = ant.bbox.x;
+    annotation.y = ant.bbox.y;
+    annotation.width = ant.bbox.width;
+    annotation.height = ant.bbox.height;
+    annotation.counts_offset = counts_offset;
+    annotation.counts_num = counts[i].size();
+    counts_offset += counts[i].size() * sizeof(uint32_t);
+    annotations.push_back(annotation);
+  }
+
+  // Write to the temporary file first, to not leave broken cache on failures
+  auto tmp_file_name = cache_file_ + ".tmp";
+  {
+    std::ofstream file(tmp_file_name, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      std::cerr << "Can't create cache file " << cache_file_ << "\n";
+      return;
     }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    WriteRecords(file, images);
+    WriteRecords(file, categories);
+    WriteRecords(file, annotations);
+    file.write(names.data(), static_cast<std::streamsize>(names.size()));
+    std::vector<char> padding(
+        header.counts_offset - header.names_offset - names.size(), 0);
+    WriteRecords(file, padding);
+    for (const auto& c : counts)
+      WriteRecords(file, c);
+    if (!file) {
+      std::cerr << "Can't write cache file " << cache_file_ << "\n";
+      return;
+    }
+  }
+  fs::rename(tmp_file_name, cache_file_);
+}
+
+RleMask CocoLoader::GetMask(const CocoAnnotation& ant,
+                            const cv::Size& size) const {
+  RleMask mask;
+  mask.height = size.height;
+  mask.width = size.width;
+  if (ant.rle_counts) {
+    mask.counts.assign(ant.rle_counts, ant.rle_counts + ant.rle_counts_num);
+  } else if (!ant.rle.empty()) {
+    mask.counts = ant.rle;
   } else {
-    throw std::runtime_error(annotations_file_ + " file can't be opened");
+    mask.counts = EncodeRle(ConvertPolygonsToMask(ant.segmentation, size));
   }
+  return mask;
+}
+
+bool CocoLoader::HasTrainAnnotations(uint32_t image_id) const {
+  auto i = image_to_ant_index_.find(image_id);
+  if (i == image_to_ant_index_.end())
+    return false;
+  for (auto ant_id : i->second) {
+    if (!annotations_.at(ant_id).iscrowd)
+      return true;
+  }
+  return false;
 }
 
 void CocoLoader::AddImage(CocoImage image) {
@@ -294,60 +563,100 @@ uint32_t CocoLoader::GetImagesCount() const {
   return static_cast<uint32_t>(images_.size());
 }
 
-static cv::Mat ConvertPolygonsToMask(
-    const std::vector<std::vector<int32_t>>& polygons,
-    const cv::Size& size) {
-  cv::Mat mask = cv::Mat::zeros(size, CV_8UC1);
+std::vector<cv::Size> CocoLoader::GetImageSizes() const {
+  std::vector<cv::Size> sizes;
+  sizes.reserve(images_.size());
+  for (const auto& image : images_)
+    sizes.emplace_back(static_cast<int>(image.second.width),
+                       static_cast<int>(image.second.height));
+  return sizes;
+}
 
-  std::vector<std::vector<cv::Point>> contours(polygons.size());
+const CocoImage& CocoLoader::ImageAt(uint64_t index) const {
+  if (index >= images_.size())
+    throw std::out_of_range("Image index is out of bounds");
+  auto i = images_.begin();
+  std::advance(i, index);
+  return i->second;
+}
 
-  size_t c_idx = 0;
-  for (const auto& poly : polygons) {
-    auto len = poly.size() / 2;
-    for (size_t i = 0; i < len; ++i) {
-      auto p_idx = i * 2;
-      contours[c_idx].push_back(cv::Point(poly[p_idx], poly[p_idx + 1]));
-    }
-    ++c_idx;
-  }
+cv::Mat CocoLoader::ReadImage(const CocoImage& image) const {
+  fs::path file_path(images_folder_);
+  file_path /= image.name;
+  cv::Mat img = LoadImage(file_path.string());
+  if (img.empty())
+    throw std::runtime_error(file_path.string() + " file can't be opened");
+  return img;
+}
 
-  cv::drawContours(mask, contours, -1, cv::Scalar(255), cv::FILLED);
+const CocoImage& CocoLoader::GetImageInfo(uint64_t index) const {
+  return ImageAt(index);
+}
 
-  return mask;
+std::string CocoLoader::GetImagePath(uint64_t index) const {
+  fs::path file_path(images_folder_);
+  file_path /= ImageAt(index).name;
+  return file_path.string();
 }
 
-ImageDesc CocoLoader::GetImage(uint64_t index) const {
-  if (index < images_.size()) {
-    auto i = images_.begin();
-    std::advance(i, index);
-    fs::path file_path(images_folder_);
-    file_path /= i->second.name;
-    // std::cout << file_path << std::endl;
-    cv::Mat img = LoadImage(file_path.string());
-    if (!img.empty()) {
-      ImageDesc result;
-      result.id = i->second.id;
-      result.image = img;
-      auto& ants = image_to_ant_index_.at(i->second.id);
-      result.boxes.reserve(ants.size());
-      result.classes.reserve(ants.size());
-      for (const auto ant_id : ants) {
-        const auto& ant = annotations_.at(ant_id);
-        result.boxes.push_back(ant.bbox);
-        const auto& cat = categories_.at(ant.category_id);
-        uint32_t class_ind = cat_ind_to_class_ind_.at(cat.id);
-        result.classes.push_back(static_cast<int32_t>(class_ind));
-
-        result.masks.push_back(
-            ConvertPolygonsToMask(ant.segmentation, img.size()));
-      }
-      return result;
-    } else {
-      throw std::runtime_error(file_path.string() + " file can't be opened");
-    }
+ImageDesc CocoLoader::GetImage(uint64_t index, bool decode_image) const {
+  const auto& image = ImageAt(index);
+  ImageDesc result;
+  result.id = image.id;
+  cv::Size size(static_cast<int>(image.width), static_cast<int>(image.height));
+  if (decode_image) {
+    result.image = ReadImage(image);
+    size = result.image.size();
   } else {
-    throw std::out_of_range("Image index is out of bounds");
+    auto file_path = GetImagePath(index);
+    std::ifstream file(file_path, std::ios::binary);
+    result.image_data.assign(std::istreambuf_iterator<char>(file),
+                             std::istreambuf_iterator<char>());
+    if (result.image_data.empty())
+      throw std::runtime_error(file_path + " file can't be opened");
+  }
+  auto& ants = image_to_ant_index_.at(image.id);
+  result.boxes.reserve(ants.size());
+  result.classes.reserve(ants.size());
+  for (const auto ant_id : ants) {
+    const auto& ant = annotations_.at(ant_id);
+    // A crowd box in COCO is a bounding box around several instances,
+    // they are excluded from training
+    if (ant.iscrowd)
+      continue;
+    result.boxes.push_back(ant.bbox);
+    const auto& cat = categories_.at(ant.category_id);
+    uint32_t class_ind = cat_ind_to_class_ind_.at(cat.id);
+    result.classes.push_back(static_cast<int32_t>(class_ind));
+
+    result.masks.push_back(GetMask(ant, size));
+  }
+  return result;
+}
+
+cv::Mat CocoLoader::GetImageData(uint64_t index) const {
+  return ReadImage(ImageAt(index));
+}
+
+std::vector<CocoInstance> CocoLoader::GetGroundTruth(uint64_t index) const {
+  const auto& image = ImageAt(index);
+  cv::Size size(static_cast<int>(image.width), static_cast<int>(image.height));
+  std::vector<CocoInstance> instances;
+  for (const auto ant_id : image_to_ant_index_.at(image.id)) {
+    const auto& ant = annotations_.at(ant_id);
+    CocoInstance instance;
+    instance.image_id = image.id;
+    const auto& cat = categories_.at(ant.category_id);
+    instance.class_id = static_cast<int32_t>(cat_ind_to_class_ind_.at(cat.id));
+    instance.box[0] = static_cast<float>(ant.bbox.x);
+    instance.box[1] = static_cast<float>(ant.bbox.y);
+    instance.box[2] = static_cast<float>(ant.bbox.width);
+    instance.box[3] = static_cast<float>(ant.bbox.height);
+    instance.mask = GetMask(ant, size);
+    instance.iscrowd = ant.iscrowd;
+    instances.push_back(std::move(instance));
   }
+  return instances;
 }
 
 cv::Mat CocoLoader::DrawAnnotedImage(uint32_t id) const {
@@ -365,7 +674,7 @@ cv::Mat CocoLoader::DrawAnnotedImage(uint32_t id) const {
       cv::rectangle(img, tl, br, cv::Scalar(255, 0, 0));
 
       cv::Mat mask_ch[3];
-      mask_ch[2] = ConvertPolygonsToMask(ant.segmentation, img.size());
+      mask_ch[2] = DecodeRle(GetMask(ant, img.size()));
       mask_ch[0] = cv::Mat::zeros(img.size(), CV_8UC1);
       mask_ch[1] = cv::Mat::zeros(img.size(), CV_8UC1);
       cv::Mat mask;
@@ -1,10 +1,15 @@
 #ifndef COCO_H
 #define COCO_H
 
+#include "cococache.h"
+#include "cocoeval.h"
+#include "cocorle.h"
+
 #include <torch/torch.h>
 
 #include <opencv2/opencv.hpp>
 
+#include <memory>
 #include <string>
 #include <tuple>
 #include <unordered_map>
@@ -30,6 +35,12 @@ struct CocoAnnotation {
   uint32_t category_id{0};
   uint32_t bbox_index{0};
   bool iscrowd{false};
+  // RLE counts of crowd annotations
+  std::vector<uint32_t> rle;
+  // RLE counts of the mask from the cache, used instead of segmentation and
+  // rle if not null
+  const uint32_t* rle_counts{nullptr};
+  uint64_t rle_counts_num{0};
 
   void push_bbox(double v) {
     switch (bbox_index) {
@@ -51,6 +62,7 @@ struct CocoAnnotation {
       bbox_index = 0;
     }
   }
+  void push_rle_count(unsigned v) { rle.push_back(v); }
   void push_segm_coord(double v) {
     segmentation.back().push_back(static_cast<int32_t>(v));
   }
@@ -66,15 +78,20 @@ struct CocoImage {
 struct ImageDesc {
   uint32_t id{0};
   cv::Mat image;
-  std::vector<cv::Mat> masks;
+  // Encoded image file if the image isn't decoded
+  std::vector<uint8_t> image_data;
+  std::vector<RleMask> masks;
   std::vector<CocoBBox> boxes;
   std::vector<int32_t> classes;
 };
 
 class CocoLoader {
  public:
+  // If cache_file is not empty, annotations are loaded from it, the cache
+  // is built on the first load of ann_file
   explicit CocoLoader(const std::string& images_folder,
-                      const std::string& ann_file);
+                      const std::string& ann_file,
+                      const std::string& cache_file = "");
   void LoadData(const std::vector<std::string>& coco_classes,
                 const std::vector<uint32_t>& keep_classes = {},
                 float keep_aspect = -1);
@@ -85,11 +102,34 @@ class CocoLoader {
 
   // ImageDb interface
   uint32_t GetImagesCount() const;
-  ImageDesc GetImage(uint64_t index) const;
+  // Without decode_image the image file is returned in image_data
+  ImageDesc GetImage(uint64_t index, bool decode_image = true) const;
+  // Sizes of all images from the annotations, in the order of indices
+  std::vector<cv::Size> GetImageSizes() const;
+
+  // Image without annotations
+  cv::Mat GetImageData(uint64_t index) const;
+  // Id, size and file name of the image
+  const CocoImage& GetImageInfo(uint64_t index) const;
+  // Path of the image file, to read the encoded image as is
+  std::string GetImagePath(uint64_t index) const;
+  // All annotations of the image for CocoEvaluator, with crowd regions
+  std::vector<CocoInstance> GetGroundTruth(uint64_t index) const;
+
+ private:
+  void ParseAnnotations();
+  const CocoImage& ImageAt(uint64_t index) const;
+  cv::Mat ReadImage(const CocoImage& image) const;
+  bool LoadCache();
+  void SaveCache() const;
+  RleMask GetMask(const CocoAnnotation& ant, const cv::Size& size) const;
+  bool HasTrainAnnotations(uint32_t image_id) const;
 
  private:
   std::string images_folder_;
   std::string annotations_file_;
+  std::string cache_file_;
+  std::shared_ptr<MappedFile> cache_;
 
   std::unordered_map<uint32_t, CocoImage> images_;
   std::unordered_map<uint32_t, CocoAnnotation> annotations_;
@@ -0,0 +1,117 @@
+#include "cocorle.h"
+
+#include <algorithm>
+#include <cassert>
+
+std::vector<uint32_t> EncodeRle(const cv::Mat& mask) {
+  assert(mask.type() == CV_8UC1);
+  // Rows of the transposed mask are columns of the original one
+  cv::Mat columns;
+  cv::transpose(mask, columns);
+  if (!columns.isContinuous())
+    columns = columns.clone();
+
+  std::vector<uint32_t> counts;
+  const uint8_t* data = columns.ptr<uint8_t>();
+  const size_t total = columns.total();
+  uint8_t value = 0;
+  uint32_t run = 0;
+  for (size_t i = 0; i < total; ++i) {
+    const uint8_t pixel = data[i] != 0 ? 1 : 0;
+    if (pixel != value) {
+      counts.push_back(run);
+      run = 0;
+      value = pixel;
+    }
+    ++run;
+  }
+  counts.push_back(run);
+  return counts;
+}
+
+cv::Mat DecodeRle(const uint32_t* counts,
+                  size_t counts_num,
+                  int32_t height,
+                  int32_t width) {
+  cv::Mat columns = cv::Mat::zeros(width, height, CV_8UC1);
+  uint8_t* data = columns.ptr<uint8_t>();
+  const size_t total = columns.total();
+  size_t pos = 0;
+  for (size_t i = 0; i < counts_num && pos < total; ++i) {
+    const size_t run = std::min<size_t>(counts[i], total - pos);
+    // Odd runs are ones
+    if (i % 2 == 1)
+      std::fill(data + pos, data + pos + run, 255);
+    pos += run;
+  }
+  cv::Mat mask;
+  cv::transpose(columns, mask);
+  return mask;
+}
+
+cv::Mat DecodeRle(const RleMask& mask) {
+  return DecodeRle(mask.counts.data(), mask.counts.size(), mask.height,
+                   mask.width);
+}
+
+uint64_t RleArea(const RleMask& mask) {
+  uint64_t area = 0;
+  for (size_t i = 1; i < mask.counts.size(); i += 2)
+    area += mask.counts[i];
+  return area;
+}
+
+uint64_t RleIntersection(const RleMask& a, const RleMask& b) {
+  assert(a.height == b.height && a.width == b.width);
+  if (a.counts.empty() || b.counts.empty())
+    return 0;
+  uint64_t intersection = 0;
+  size_t i = 0;
+  size_t j = 0;
+  uint64_t run_a = a.counts[0];
+  uint64_t run_b = b.counts[0];
+  while (true) {
+    // Takes the shorter run, the values are ones on odd runs
+    auto run = std::min(run_a, run_b);
+    if (i % 2 == 1 && j % 2 == 1)
+      intersection += run;
+    run_a -= run;
+    run_b -= run;
+    if (run_a == 0) {
+      if (++i == a.counts.size())
+        break;
+      run_a = a.counts[i];
+    }
+    if (run_b == 0) {
+      if (++j == b.counts.size())
+        break;
+      run_b = b.counts[j];
+    }
+  }
+  return intersection;
+}
+
+std::vector<uint32_t> DecodeRleString(const char* str, size_t length) {
+  std::vector<uint32_t> counts;
+  size_t p = 0;
+  while (p < length) {
+    // Each count is a sequence of 5 bit chunks with continuation bit,
+    // starting from the third one counts are stored as deltas
+    int64_t x = 0;
+    int k = 0;
+    bool more = true;
+    while (more && p < length) {
+      const int64_t c = static_cast<int64_t>(str[p]) - 48;
+      x |= (c & 0x1f) << (5 * k);
+      more = (c & 0x20) != 0;
+      ++p;
+      ++k;
+      if (!more && (c & 0x10))
+        x |= -1ll << (5 * k);
+    }
+    if (counts.size() > 2)
+      x += counts[counts.size() - 2];
+    counts.push_back(static_cast<uint32_t>(x));
+  }
+  return counts;
+}
@@ -0,0 +1,48 @@
+#ifndef COCORLE_H
+#define COCORLE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Run length encoding of binary masks in the COCO format: runs go over the
+ * mask in column-major order, alternating between 0 and 1 values and always
+ * start with the (possibly empty) run of zeros.
+ */
+
+struct RleMask {
+  std::vector<uint32_t> counts;
+  int32_t height{0};
+  int32_t width{0};
+};
+
+/* Encodes CV_8UC1 mask, all non zero values are treated as 1
+ */
+std::vector<uint32_t> EncodeRle(const cv::Mat& mask);
+
+/* Decodes runs to the CV_8UC1 mask [height, width] of 0 and 255 values, the
+ * same as rasterized polygons
+ */
+cv::Mat DecodeRle(const uint32_t* counts,
+                  size_t counts_num,
+                  int32_t height,
+                  int32_t width);
+
+cv::Mat DecodeRle(const RleMask& mask);
+
+// Number of pixels of the mask
+uint64_t RleArea(const RleMask& mask);
+
+/* Number of pixels in both masks, runs are merged without decoding. Masks
+ * have to be of the same size.
+ */
+uint64_t RleIntersection(const RleMask& a, const RleMask& b);
+
+/* Decodes counts from the compressed string representation used by COCO
+ * tools, see rleFrString in pycocotools
+ */
+std::vector<uint32_t> DecodeRleString(const char* str, size_t length);
+
+#endif  // COCORLE_H
@@ -19,6 +19,7 @@ void Config::UpdateSettings() {
   } else {
     batch_size = images_per_gpu;
   }
+  batch_size *= gradient_accumulation_steps;
 
   // adjust step size based on batch size
   steps_per_epoch = batch_size * steps_per_epoch;
@@ -27,9 +28,14 @@ void Config::UpdateSettings() {
   image_shape = {image_max_dim, image_max_dim, 3};
 
   // compute backbone size from input image size
-  backbone_shapes.clear();
-  for (auto stride : backbone_strides) {
-    backbone_shapes.push_back(
-        {image_shape[0] / stride, image_shape[1] / stride});
-  }
+  backbone_shapes = BackboneShapes(image_shape[0], image_shape[1]);
+}
+
+std::vector<std::pair<float, float>> Config::BackboneShapes(
+    int32_t height,
+    int32_t width) const {
+  std::vector<std::pair<float, float>> shapes;
+  for (auto stride : backbone_strides)
+    shapes.push_back({height / stride, width / stride});
+  return shapes;
 }
@@ -13,12 +13,18 @@ class Config {
   Config();
   void UpdateSettings();
 
+  // Sizes of the feature pyramid levels for the input image of the size
+  std::vector<std::pair<float, float>> BackboneShapes(int32_t height,
+                                                      int32_t width) const;
+
   std::string name;  // Override in sub-classes
 
   // Path to pretrained imagenet model
   std::string imagenet_model_path;
 
   // NUMBER OF GPUs to use. For CPU use 0
+  // With several GPUs training is data parallel, the model has to be on the
+  // first GPU and replicas are created on the others.
   uint32_t gpu_count = 1;
 
   // Number of images to train with on each GPU. A 12GB GPU can typically
@@ -27,6 +33,35 @@ class Config {
   // number that your GPU can handle for best performance.
   uint32_t images_per_gpu = 1;
 
+  // Number of forward and backward passes of images_per_gpu images on each
+  // GPU whose gradients are accumulated for one optimizer step, it makes
+  // the effective batch larger without more memory
+  uint32_t gradient_accumulation_steps = 1;
+
+  // Number of threads which load training and validation samples
+  uint32_t data_workers_num = 4;
+
+  // Number of samples loaded ahead of the training loop
+  uint32_t data_prefetch_size = 8;
+
+  // Warm-up tuning of the loader workers, the prefetch depth and the torch
+  // threads by mask_rcnn_pytorch_train --autotune, see autotune.h. Every
+  // trial times autotune_images training images, trials with more GPU
+  // memory than autotune_memory_fraction of the total are rejected.
+  uint32_t autotune_images = 40;
+  float autotune_memory_fraction = 0.9f;
+
+  // Decode JPEG images of the samples loaded to the GPU with nvJPEG, and
+  // resize and mold them on the GPU, see JpegDecoder
+  bool gpu_image_decode = false;
+
+  // Training from shard files, see ShardStream: records are taken at random
+  // from a buffer of shard_shuffle_size records, shard_readahead more records
+  // are read ahead. Memory of a GPU stream is about the buffer of encoded
+  // images and RLE masks.
+  uint32_t shard_shuffle_size = 1024;
+  uint32_t shard_readahead = 64;
+
   // Number of training steps per epoch
   // This doesn't need to match the size of the training set. Tensorboard
   // updates are saved at the end of each epoch, so setting this to a
@@ -41,6 +76,25 @@ class Config {
   // down the training.
   uint32_t validation_steps = 50;
 
+  // Number of validation images to compute the COCO box and mask mAP on at
+  // the end of every epoch, 0 turns the evaluation off. Detections are
+  // filtered with detection_min_confidence, so the mAP is lower than with the
+  // usual 0.05 threshold of COCO evaluations.
+  uint32_t eval_images = 500;
+
+  // Losses stay on the GPU and are copied to the host for the progress and
+  // metrics after this number of optimizer steps, so steps between don't
+  // wait for the GPU
+  uint32_t stats_interval = 20;
+
+  // Write training metrics to the model directory, see MetricsExporter
+  bool export_metrics = true;
+
+  // Checkpoints have only the trainable parameters and the buffers, so they
+  // are much smaller with the frozen backbone. Such checkpoint is partial, it
+  // has to be loaded over the parameters the training started from.
+  bool checkpoint_trainable_only = false;
+
   // The strides of each layer of the FPN Pyramid. These values
   // are based on a Resnet101 backbone.
   std::vector<float> backbone_strides = {4, 8, 16, 32, 64};
@@ -71,10 +125,38 @@ class Config {
   // How many anchors per image to use for RPN training
   int32_t rpn_train_anchors_per_image = 256;
 
+  // Build RPN training targets on the GPU in the training loop instead of
+  // in the data loader
+  bool rpn_targets_on_gpu = false;
+
+  // Random augmentation of the training batches on their device, see
+  // AugmentBatch. Flips and scale jitter change the boxes, so they need
+  // rpn_targets_on_gpu.
+  // Probability of the horizontal flip of an image
+  float augment_flip_prob = 0;
+  // Images are zoomed by a factor from [1 - jitter, 1 + jitter]
+  float augment_scale_jitter = 0;
+  // Brightness is scaled by a factor from [1 - jitter, 1 + jitter], every
+  // channel by a factor from [1 - jitter / 2, 1 + jitter / 2]
+  float augment_color_jitter = 0;
+
+  // Anchors with the highest scores selected before the RPN non-maximum
+  // supression. At most pre_nms_limit_per_level anchors are kept by partial
+  // selection in each FPN level, then at most pre_nms_limit of them in total.
+  // Lower per level limits make the proposal layer faster, but recall of
+  // small objects in the crowded finer levels can drop.
+  int64_t pre_nms_limit_per_level = 6000;
+  int64_t pre_nms_limit = 6000;
+
   // ROIs kept after non-maximum supression (training and inference)
   int64_t post_nms_rois_training = 2000;
   int64_t post_nms_rois_inference = 1000;
 
+  // Anchors with lower foreground scores are dropped before the RPN
+  // non-maximum supression, 0 keeps all of them. Nearly empty images then
+  // spend little time in the proposal layer.
+  float rpn_min_score = 0;
+
   // If enabled, resizes instance masks to a smaller size to reduce
   // memory load. Recommended when using high-resolution images.
   bool use_mini_mask = true;
@@ -87,8 +169,13 @@ class Config {
   // be satisfied together the IMAGE_MAX_DIM is enforced.
   int32_t image_min_dim = 800;
   int32_t image_max_dim = 1024;
-  // If True, pad images with zeros such that they're (max_dim by max_dim)
-  bool image_padding = true;  // currently, the False option is not supported
+  // If True, pad images with zeros such that they're (max_dim by max_dim).
+  // If False, only the bottom and right sides are padded to multiples of
+  // image_size_multiple, input shapes are different for images of different
+  // aspect ratios and training samples are grouped by their shapes.
+  bool image_padding = true;
+  // Images are downscaled 6 times by the backbone
+  int32_t image_size_multiple = 64;
 
   // Image mean (RGB)
   std::vector<double> mean_pixel = {123.7, 116.8, 103.9};
@@ -125,6 +212,22 @@ class Config {
   // Non-maximum suppression threshold for detection
   float detection_nms_threshold = 0.3f;
 
+  // Serving limits applied before the mask head, the mask head runs only on
+  // the detections left. Detections with lower scores are dropped, 0 keeps
+  // all detections above detection_min_confidence
+  float inference_min_score = 0;
+  // At most this number of the top detections of an image are kept and get
+  // masks, 0 - detection_max_instances
+  int64_t inference_mask_top_k = 0;
+  // Only boxes are detected, the mask head doesn't run and masks are empty
+  bool inference_boxes_only = false;
+  // Latency objective of the served requests in milliseconds, 0 - none.
+  // The server lowers the number of proposals of the inference, down to
+  // min_post_nms_rois_inference, when requests get slower, see
+  // ProposalBudget.
+  double inference_latency_slo_ms = 0;
+  int64_t min_post_nms_rois_inference = 250;
+
   // Learning rate and momentum
   // The Mask RCNN paper uses lr=0.02, but it can cause
   // weights to explode. Likely due to differences in optimzer
@@ -135,6 +238,35 @@ class Config {
   // Weight decay regularization
   double weight_decay = 0.0001;
 
+  // Run the network in half precision on the GPU, proposals, detections and
+  // losses are computed in float. Training keeps float master copies of the
+  // weights and uses dynamic loss scaling.
+  bool mixed_precision = false;
+
+  // Keep the pyramid feature maps channels-last (NHWC) for the RoIAlign of
+  // the heads on the GPU, each sampling point reads the channels of a
+  // location from one cache line. The libtorch 1.0 convolutions need NCHW,
+  // so the maps are converted once after the FPN, see ToChannelsLast.
+  bool channels_last_features = false;
+
+  // Activations of the trainable backbone stages and of the pyramid levels
+  // are recomputed in the backward pass instead of being kept, see
+  // CheckpointForward. It costs another forward pass of the backbone per
+  // step and saves most of its activation memory for larger batches.
+  bool gradient_checkpointing = false;
+
+  // Fold batch norms of the backbone into convolutions when the model is
+  // warmed up for inference, the model can't be trained after that
+  bool fold_batch_norm = true;
+
+  // Time the stages of the inference pipeline, see StageProfiler
+  bool profile_inference = false;
+
+  // Initial loss scale for mixed precision training, it is halved on
+  // gradient overflow and doubled after loss_scale_window good steps
+  float loss_scale = 65536.f;
+  uint32_t loss_scale_window = 2000;
+
   // Use RPN ROIs or externally generated ROIs for training
   // Keep this True for most situations. Set to False if you want to train
   // the head branches on ROI generated by code rather than the ROIs from
@@ -142,10 +274,10 @@ class Config {
   // train the RPN.
   // bool use_rpn_rois = true;
 
-  // Effective batch size
+  // Effective batch size, images of one optimizer step on all GPUs
   uint32_t batch_size = 0;
 
-  // input image size
+  // input image size, the largest one if padding is off
   std::vector<int32_t> image_shape;
 };
 
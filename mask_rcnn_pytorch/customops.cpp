@@ -0,0 +1,37 @@
+#include "customops.h"
+#include "nms.h"
+#include "roialign.h"
+
+#include <torch/csrc/jit/custom_operator.h>
+
+namespace {
+// TorchScript passes floats as double and ints as int64_t
+at::Tensor NmsOp(at::Tensor dets, double thresh) {
+  return Nms(dets, static_cast<float>(thresh));
+}
+
+at::Tensor GroupNmsOp(at::Tensor dets, double thresh) {
+  return GroupNms(dets, static_cast<float>(thresh));
+}
+
+at::Tensor PyramidRoiAlignOp(at::Tensor boxes,
+                             std::vector<at::Tensor> feature_maps,
+                             int64_t pool_size,
+                             std::vector<int64_t> image_shape) {
+  feature_maps.insert(feature_maps.begin(), boxes);
+  std::vector<int32_t> shape(image_shape.begin(), image_shape.end());
+  return PyramidRoiAlign(feature_maps, static_cast<uint32_t>(pool_size),
+                         shape);
+}
+}  // namespace
+
+void RegisterCustomOps() {
+  // Registration lives in the function, so the linker keeps it when the
+  // library is linked statically
+  static auto registry =
+      torch::jit::RegisterOperators()
+          .op("maskrcnn::nms", &NmsOp)
+          .op("maskrcnn::group_nms", &GroupNmsOp)
+          .op("maskrcnn::pyramid_roi_align", &PyramidRoiAlignOp);
+  (void)registry;
+}
@@ -0,0 +1,15 @@
+#ifndef CUSTOMOPS_H
+#define CUSTOMOPS_H
+
+/* Registers the custom kernels as TorchScript operators, so exported graphs
+ * of the model can call them:
+ *   maskrcnn::nms(Tensor dets, float thresh) -> Tensor, see Nms
+ *   maskrcnn::group_nms(Tensor dets, float thresh) -> Tensor, see GroupNms
+ *   maskrcnn::pyramid_roi_align(Tensor boxes, Tensor[] feature_maps,
+ *       int pool_size, int[] image_shape) -> Tensor, see PyramidRoiAlign
+ * Operators are registered on the first call, it has to be called before
+ * a module using them is loaded.
+ */
+void RegisterCustomOps();
+
+#endif  // CUSTOMOPS_H
@@ -0,0 +1,79 @@
+#include "dataparallel.h"
+
+namespace {
+// Calls func(begin, end) for ranges of consecutive tensors of the same type
+// with about bucket_bytes bytes in total
+template <typename Func>
+void ForEachBucket(const std::vector<at::Tensor>& tensors,
+                   int64_t bucket_bytes,
+                   Func func) {
+  size_t begin = 0;
+  int64_t bytes = 0;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    bytes += tensors[i].numel() * tensors[i].element_size();
+    bool last = i + 1 == tensors.size();
+    if (last || bytes >= bucket_bytes ||
+        tensors[i + 1].scalar_type() != tensors[begin].scalar_type()) {
+      func(begin, i + 1);
+      begin = i + 1;
+      bytes = 0;
+    }
+  }
+}
+}  // namespace
+
+std::vector<at::Tensor> FlattenGrads(const std::vector<at::Tensor>& params,
+                                     at::Device device,
+                                     int64_t bucket_bytes) {
+  std::vector<at::Tensor> buckets;
+  ForEachBucket(params, bucket_bytes, [&](size_t begin, size_t end) {
+    std::vector<at::Tensor> grads;
+    for (size_t i = begin; i < end; ++i) {
+      auto& grad = params[i].grad();
+      if (grad.defined())
+        grads.push_back(grad.detach().contiguous().view({-1}));
+      else
+        grads.push_back(torch::zeros({params[i].numel()}, params[i].options()));
+    }
+    buckets.push_back(torch::cat(grads).to(device));
+  });
+  return buckets;
+}
+
+void AddFlatGrads(const std::vector<at::Tensor>& params,
+                  const std::vector<at::Tensor>& buckets,
+                  int64_t bucket_bytes) {
+  size_t bucket_index = 0;
+  ForEachBucket(params, bucket_bytes, [&](size_t begin, size_t end) {
+    const auto& bucket = buckets.at(bucket_index++);
+    int64_t offset = 0;
+    for (size_t i = begin; i < end; ++i) {
+      auto numel = params[i].numel();
+      auto grad_part = bucket.narrow(0, offset, numel).view_as(params[i]);
+      offset += numel;
+      auto& grad = params[i].grad();
+      if (grad.defined())
+        grad.add_(grad_part);
+      else
+        grad = grad_part.clone();
+    }
+  });
+}
+
+void BroadcastTensors(const std::vector<at::Tensor>& src,
+                      const std::vector<at::Tensor>& dst,
+                      int64_t bucket_bytes) {
+  torch::NoGradGuard no_grad;
+  ForEachBucket(src, bucket_bytes, [&](size_t begin, size_t end) {
+    std::vector<at::Tensor> values;
+    for (size_t i = begin; i < end; ++i)
+      values.push_back(src[i].detach().contiguous().view({-1}));
+    auto flat = torch::cat(values).to(dst[begin].device());
+    int64_t offset = 0;
+    for (size_t i = begin; i < end; ++i) {
+      auto numel = dst[i].numel();
+      dst[i].copy_(flat.narrow(0, offset, numel).view_as(dst[i]));
+      offset += numel;
+    }
+  });
+}
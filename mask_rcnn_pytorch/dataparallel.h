@@ -0,0 +1,31 @@
+#ifndef DATAPARALLEL_H
+#define DATAPARALLEL_H
+
+#include <torch/torch.h>
+
+#include <vector>
+
+/* Helpers for data parallel training with model replicas on the GPUs of one
+ * node. Tensors are transferred between devices in flat buckets of about
+ * bucket_bytes bytes, so a few large copies are made instead of one copy per
+ * parameter. All lists of parameters have to be in the same order, as given
+ * by named_parameters of the replicas.
+ */
+
+// Copies gradients of the replica parameters to the device in flat buckets.
+// Missing gradients are treated as zeros.
+std::vector<at::Tensor> FlattenGrads(const std::vector<at::Tensor>& params,
+                                     at::Device device,
+                                     int64_t bucket_bytes);
+
+// Adds flat buckets made by FlattenGrads to the gradients of params
+void AddFlatGrads(const std::vector<at::Tensor>& params,
+                  const std::vector<at::Tensor>& buckets,
+                  int64_t bucket_bytes);
+
+// Copies values of src tensors to dst tensors on another device
+void BroadcastTensors(const std::vector<at::Tensor>& src,
+                      const std::vector<at::Tensor>& dst,
+                      int64_t bucket_bytes);
+
+#endif  // DATAPARALLEL_H
@@ -1,8 +1,74 @@
-#ifndef NDEBUG
-
 #include "debug.h"
+#include "../npydump.h"
+
+#include <ATen/DeviceGuard.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <cuda_runtime_api.h>
+
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+
+namespace {
+std::string NpyDescr(at::ScalarType type) {
+  switch (type) {
+    case at::kFloat:
+      return "<f4";
+    case at::kDouble:
+      return "<f8";
+    case at::kHalf:
+      return "<f2";
+    case at::kByte:
+      return "|u1";
+    case at::kChar:
+      return "|i1";
+    case at::kShort:
+      return "<i2";
+    case at::kInt:
+      return "<i4";
+    case at::kLong:
+      return "<i8";
+    default:
+      throw std::invalid_argument("Tensor type can't be dumped");
+  }
+}
+
+void CheckCuda(cudaError_t status) {
+  if (status != cudaSuccess)
+    throw std::runtime_error(std::string("Dump CUDA error : ") +
+                             cudaGetErrorString(status));
+}
+}  // namespace
+
+void DumpTensor(const at::Tensor& tensor, const std::string& file_name) {
+  utils::NpyWriter::Dump dump;
+  dump.file_name = file_name;
+  dump.descr = NpyDescr(tensor.scalar_type());
+  dump.shape.assign(tensor.sizes().begin(), tensor.sizes().end());
+  auto value = tensor.detach().contiguous();
+  if (value.is_cuda()) {
+    at::DeviceGuard device_guard(value.device());
+    auto host = torch::empty(value.sizes(), at::dtype(value.scalar_type()))
+                    .pin_memory();
+    host.copy_(value, /*non_blocking*/ true);
+    cudaEvent_t event;
+    CheckCuda(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    std::shared_ptr<CUevent_st> copied(event, cudaEventDestroy);
+    CheckCuda(
+        cudaEventRecord(event, at::cuda::getCurrentCUDAStream().stream()));
+    dump.wait = [copied]() { CheckCuda(cudaEventSynchronize(copied.get())); };
+    value = host;
+  } else if (value.data_ptr() == tensor.data_ptr()) {
+    value = value.clone();  // the caller may change the tensor
+  }
+  dump.data = value.data_ptr();
+  dump.bytes = static_cast<size_t>(value.numel() * value.element_size());
+  dump.owner = std::shared_ptr<const void>(dump.data, [value](const void*) {});
+  utils::DefaultNpyWriter().Push(std::move(dump));
+}
+
+#ifndef NDEBUG
 
 TensorInfo __attribute__((used, noinline)) PrintTensor(at::Tensor val) {
   return TensorInfo(val);
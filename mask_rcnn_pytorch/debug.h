@@ -55,4 +55,13 @@ TensorInfo __attribute__((used, noinline)) PrintTensor(at::Tensor val);
 
 #endif
 
+#include <torch/torch.h>
+#include <string>
+
+// Writes the values of the tensor to the .npy file in the background, see
+// ../npydump.h. A GPU tensor is copied to the pinned host memory on the
+// current stream without waiting, the caller may change the tensor after the
+// call. utils::FlushDumps waits for the written files.
+void DumpTensor(const at::Tensor& tensor, const std::string& file_name);
+
 #endif  // DEBUG_H
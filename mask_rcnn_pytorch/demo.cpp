@@ -2,9 +2,11 @@
 #include "config.h"
 #include "datasetclasses.h"
 #include "debug.h"
+#include "detectionbackend.h"
 #include "imageutils.h"
 #include "maskrcnn.h"
 #include "stateloader.h"
+#include "tileddetection.h"
 #include "visualize.h"
 
 #include <torch/torch.h>
@@ -32,7 +34,10 @@ class InferenceConfig : public Config {
 const cv::String keys =
     "{help h usage ? |      | print this message   }"
     "{@params        |<none>| path to trained parameters }"
-    "{@image         |<none>| path to image }";
+    "{@image         |<none>| path to image }"
+    "{int8           |      | save int8 weights to this file and use them }"
+    "{tile_overlap   |-1    | detect full resolution image in tiles of the "
+    "input size overlapping by this number of pixels }";
 
 int main(int argc, char** argv) {
 #ifndef NDEBUG
@@ -51,6 +56,8 @@ int main(int argc, char** argv) {
 
     std::string params_path = parser.get<cv::String>(0);
     std::string image_path = parser.get<cv::String>(1);
+    std::string int8_path = parser.get<cv::String>("int8");
+    auto tile_overlap = parser.get<int>("tile_overlap");
 
     // Chech parsing errors
     if (!parser.check()) {
@@ -92,9 +99,46 @@ int main(int argc, char** argv) {
       LoadStateDict(*model, params_path, "");
     }
 
+    // Detections are made with the restored weights, to compare them with
+    // the float model
+    if (!int8_path.empty()) {
+      SaveStateDict(*model, int8_path, /*quantize_weights*/ true);
+      LoadStateDict(*model, int8_path);
+      std::cout << "Quantized weights saved to " << int8_path << " ("
+                << fs::file_size(int8_path) / (1 << 20) << " MB)\n";
+    }
+
     if (config->gpu_count > 0)
       model->to(torch::DeviceType::CUDA);
 
+    // Don't count cuDNN benchmarking and first allocations
+    model->WarmUp();
+
+    // Small objects of large images stay in the tiles
+    if (tile_overlap >= 0) {
+      EagerBackend backend(model);
+      auto start = std::chrono::steady_clock::now();
+      auto [boxes, class_ids, scores, packed_masks] =
+          DetectTiled(backend, image, *config, tile_overlap,
+                      /*mask_threshold*/ 0.5);
+      auto stop = std::chrono::steady_clock::now();
+      std::cout << "Tiled inference time "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       stop - start)
+                       .count()
+                << "\n";
+      if (packed_masks.empty()) {
+        std::cerr << "Failed to detect anything!\n";
+        return 0;
+      }
+      std::vector<cv::Mat> masks;
+      for (const auto& mask : packed_masks)
+        masks.push_back(UnpackMask(mask, image.size()));
+      visualize(image, boxes, class_ids, scores, masks, 0.7f,
+                GetDatasetClasses());
+      return 0;
+    }
+
     auto start = std::chrono::steady_clock::now();
     auto [detections, mrcnn_mask] = model->Detect(molded_images, image_metas);
     if (!is_empty(detections)) {
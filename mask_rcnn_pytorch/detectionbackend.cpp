@@ -0,0 +1,68 @@
+#include "detectionbackend.h"
+#include "customops.h"
+
+#include <stdexcept>
+
+EagerBackend::EagerBackend(MaskRCNN model) : model_(model) {}
+
+std::tuple<at::Tensor, at::Tensor> EagerBackend::Detect(
+    at::Tensor images,
+    const std::vector<ImageMeta>& image_metas) {
+  return model_->Detect(images, image_metas);
+}
+
+std::vector<std::tuple<at::Tensor, at::Tensor>> EagerBackend::DetectHeads(
+    at::Tensor images,
+    const std::vector<ImageMeta>& image_metas) {
+  return model_->DetectHeads(images, image_metas);
+}
+
+size_t EagerBackend::HeadsNum() const {
+  return model_->HeadsNum();
+}
+
+bool EagerBackend::SetProposalCount(int64_t count) {
+  model_->SetProposalCount(count);
+  return true;
+}
+
+void EagerBackend::WarmUp() {
+  model_->WarmUp();
+}
+
+StageProfiler* EagerBackend::Profiler() {
+  return model_->Profiler();
+}
+
+ScriptBackend::ScriptBackend(const std::string& file_name, at::Device device)
+    : device_(device) {
+  RegisterCustomOps();
+  module_ = torch::jit::load(file_name);
+  if (!module_)
+    throw std::runtime_error("Failed to load TorchScript module " +
+                             file_name);
+  module_->to(device_);
+}
+
+std::tuple<at::Tensor, at::Tensor> ScriptBackend::Detect(
+    at::Tensor images,
+    const std::vector<ImageMeta>& image_metas) {
+  torch::NoGradGuard no_grad;
+  std::vector<int32_t> metas;
+  for (const auto& meta : image_metas) {
+    metas.insert(metas.end(),
+                 {meta.image_id, meta.image_width, meta.image_height,
+                  meta.window.y1, meta.window.x1, meta.window.y2,
+                  meta.window.x2});
+  }
+  auto metas_tensor =
+      torch::tensor(metas, at::dtype(at::kInt))
+          .view({static_cast<int64_t>(image_metas.size()), 7})
+          .to(device_);
+
+  auto output = module_->forward({images.to(device_), metas_tensor});
+  auto elements = output.toTuple()->elements();
+  if (elements.size() != 2)
+    throw std::runtime_error("TorchScript module returned wrong outputs");
+  return {elements[0].toTensor(), elements[1].toTensor()};
+}
@@ -0,0 +1,84 @@
+#ifndef DETECTIONBACKEND_H
+#define DETECTIONBACKEND_H
+
+#include "imageutils.h"
+#include "maskrcnn.h"
+#include "stageprofiler.h"
+
+#include <torch/script.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Runs the detection pipeline for the serving code, the same way as
+ * MaskRCNNImpl::Detect: same inputs and the same outputs on the device.
+ */
+class DetectionBackend {
+ public:
+  virtual ~DetectionBackend() = default;
+
+  virtual std::tuple<at::Tensor, at::Tensor> Detect(
+      at::Tensor images,
+      const std::vector<ImageMeta>& image_metas) = 0;
+
+  // Detections and masks of every class set, the first one is the set of
+  // Detect, see MaskRCNNImpl::DetectHeads
+  virtual std::vector<std::tuple<at::Tensor, at::Tensor>> DetectHeads(
+      at::Tensor images,
+      const std::vector<ImageMeta>& image_metas) {
+    return {Detect(images, image_metas)};
+  }
+  virtual size_t HeadsNum() const { return 1; }
+
+  // See MaskRCNNImpl::SetProposalCount, returns false if the backend can't
+  // change it
+  virtual bool SetProposalCount(int64_t /*count*/) { return false; }
+
+  virtual void WarmUp() {}
+
+  // Stage timings, nullptr if they aren't collected
+  virtual StageProfiler* Profiler() { return nullptr; }
+};
+
+// The libtorch model, it is the reference implementation
+class EagerBackend : public DetectionBackend {
+ public:
+  explicit EagerBackend(MaskRCNN model);
+
+  std::tuple<at::Tensor, at::Tensor> Detect(
+      at::Tensor images,
+      const std::vector<ImageMeta>& image_metas) override;
+  std::vector<std::tuple<at::Tensor, at::Tensor>> DetectHeads(
+      at::Tensor images,
+      const std::vector<ImageMeta>& image_metas) override;
+  size_t HeadsNum() const override;
+  bool SetProposalCount(int64_t count) override;
+  void WarmUp() override;
+  StageProfiler* Profiler() override;
+
+ private:
+  MaskRCNN model_;
+};
+
+/* TorchScript module exported from the model. The module forward takes
+ * the molded images and [batch, (image_id, image_width, image_height, y1, x1,
+ * y2, x2)] int32 image metas, and returns the detections and masks tuple as
+ * Detect does. NMS and ROI align are called as custom operators, see
+ * RegisterCustomOps.
+ */
+class ScriptBackend : public DetectionBackend {
+ public:
+  ScriptBackend(const std::string& file_name, at::Device device);
+
+  std::tuple<at::Tensor, at::Tensor> Detect(
+      at::Tensor images,
+      const std::vector<ImageMeta>& image_metas) override;
+
+ private:
+  std::shared_ptr<torch::jit::script::Module> module_;
+  at::Device device_;
+};
+
+#endif  // DETECTIONBACKEND_H
@@ -8,144 +8,155 @@
 namespace {
 
 /*
- * Refine classified proposals and filter overlaps and return final detections.
+ * Refine classified proposals of the whole batch and return detections
+ * before NMS.
  * Inputs:
- *     rois: [N, (y1, x1, y2, x2)] in normalized coordinates
- *     probs: [N, num_classes]. Class probabilities.
- *     deltas: [N, num_classes, (dy, dx, log(dh), log(dw))]. Class-specific
- *             bounding box deltas.
- *     window: (y1, x1, y2, x2) in image coordinates. The part
- *             of the image that contains the image excluding the padding.
+ *     rois: [batch * N, (y1, x1, y2, x2)] in normalized coordinates, zero
+ *           rows are padding
+ *     probs: [batch * N, num_classes]. Class probabilities.
+ *     deltas: [batch * N, num_classes, (dy, dx, log(dh), log(dw))].
+ *             Class-specific bounding box deltas.
+ *     image_meta: window of every image in image coordinates, the part of
+ *                 the image that contains the image excluding the padding.
  * Returns
- *       detections shaped: [N, (y1, x1, y2, x2, class_id, score)]
+ *       detections shaped: [batch * N, (y1, x1, y2, x2, class_id, score)]
+ *       valid mask: [batch * N] detections which are not background,
+ *                   padding or low confidence boxes
  */
-at::Tensor RefineDetections(at::Tensor rois,
-                            at::Tensor probs,
-                            at::Tensor deltas,
-                            const Window& window,
-                            const Config& config) {
+std::tuple<at::Tensor, at::Tensor> RefineDetections(
+    at::Tensor rois,
+    at::Tensor probs,
+    at::Tensor deltas,
+    const std::vector<ImageMeta>& image_meta,
+    const LayerConstants& constants,
+    const Config& config) {
   // Class IDs per ROI
   at::Tensor class_ids;
   std::tie(std::ignore, class_ids) = torch::max(probs, /*dim*/ 1);
 
   // Class probability of the top class of each ROI
   // Class-specific bounding box deltas
-  auto idx = torch::arange(class_ids.size(0), at::dtype(at::kLong));
-  if (config.gpu_count > 0)
-    idx = idx.cuda();
-
-  auto class_scores = probs.index({idx, class_ids});
-  auto deltas_specific = deltas.index({idx, class_ids});
-
-  // Apply bounding box deltas
-  // Shape: [boxes, (y1, x1, y2, x2)] in normalized coordinates
-  auto std_dev = torch::tensor(config.rpn_bbox_std_dev,
-                               at::dtype(at::kFloat).requires_grad(false));
-  if (config.gpu_count > 0)
-    std_dev = std_dev.cuda();
-  auto refined_rois = ApplyBoxDeltas(rois, deltas_specific * std_dev);
-
-  // Convert coordiates to image domain
-  auto height = static_cast<float>(config.image_shape[0]);
-  auto width = static_cast<float>(config.image_shape[1]);
-
-  auto scale = torch::tensor({height, width, height, width},
-                             at::dtype(at::kFloat).requires_grad(false));
-  if (config.gpu_count > 0)
-    scale = scale.cuda();
-  refined_rois *= scale;
+  auto class_scores = probs.gather(1, class_ids.unsqueeze(1)).squeeze(1);
+  auto deltas_specific =
+      deltas.gather(1, class_ids.view({-1, 1, 1}).expand({-1, 1, 4}))
+          .squeeze(1);
+
+  // Boxes are clipped to the union of the windows by the decoding, then to
+  // the window of their image if windows differ
+  Window bounds = image_meta.front().window;
+  bool same_windows = true;
+  for (const auto& meta : image_meta) {
+    const auto& window = meta.window;
+    same_windows = same_windows && window.y1 == bounds.y1 &&
+                   window.x1 == bounds.x1 && window.y2 == bounds.y2 &&
+                   window.x2 == bounds.x2;
+    bounds.y1 = std::min(bounds.y1, window.y1);
+    bounds.x1 = std::min(bounds.x1, window.x1);
+    bounds.y2 = std::max(bounds.y2, window.y2);
+    bounds.x2 = std::max(bounds.x2, window.x2);
+  }
 
-  // Clip boxes to image window
-  refined_rois = ClipToWindow(window, refined_rois);
+  // Apply bounding box deltas, convert coordiates to image domain and clip
+  // boxes to image window in one pass
+  // Shape: [boxes, (y1, x1, y2, x2)] in image coordinates
+  auto refined_rois = DecodeBoxes(
+      rois, deltas_specific, config.rpn_bbox_std_dev,
+      static_cast<float>(constants.image_height),
+      static_cast<float>(constants.image_width), bounds);
+  if (!same_windows) {
+    std::vector<float> lower;
+    std::vector<float> upper;
+    for (const auto& meta : image_meta) {
+      const auto& w = meta.window;
+      auto y1 = static_cast<float>(w.y1);
+      auto x1 = static_cast<float>(w.x1);
+      auto y2 = static_cast<float>(w.y2);
+      auto x2 = static_cast<float>(w.x2);
+      lower.insert(lower.end(), {y1, x1, y1, x1});
+      upper.insert(upper.end(), {y2, x2, y2, x2});
+    }
+    auto batch_size = static_cast<int64_t>(image_meta.size());
+    auto lower_bounds =
+        torch::tensor(lower).to(rois.device()).view({batch_size, 1, 4});
+    auto upper_bounds =
+        torch::tensor(upper).to(rois.device()).view({batch_size, 1, 4});
+    refined_rois =
+        torch::min(torch::max(refined_rois.view({batch_size, -1, 4}),
+                              lower_bounds),
+                   upper_bounds)
+            .view({-1, 4});
+  }
 
   // Round and cast to  int since we're deadling with pixels now
   refined_rois = torch::round(refined_rois);
 
   // TODO: (Legacy)Filter out  boxes with zero area
 
-  // Filter out background boxes
-  auto keep_bool = class_ids > 0;
+  // Filter out background boxes and padding
+  auto valid = (class_ids > 0) * (rois.abs().sum(1) > 0);
 
   // Filter out low  confidence boxes
   if (config.detection_min_confidence > 0) {
-    keep_bool = keep_bool * (class_scores >= config.detection_min_confidence);
+    valid = valid * (class_scores >= config.detection_min_confidence);
   }
 
-  auto keep = torch::nonzero(keep_bool)
-                  .narrow(1, 0, 1)
-                  .to(at::dtype(at::kLong))
-                  .squeeze();
-
-  // Unsqueeze in case keep is a 0-dimensional tensor
-  // otherwise calls like nms_class_ids.size(0) will fail
-  if (keep.ndimension() == 0)
-      keep = keep.unsqueeze(0);
-
-  // Apply per-class NMS
-  auto pre_nms_class_ids = class_ids.take(keep);
-  auto pre_nms_scores = class_scores.take(keep);
-  auto pre_nms_rois = refined_rois.index_select(0, keep);
-
-  auto nms_class_ids = unique1d(pre_nms_class_ids);
-  at::Tensor nms_keep =
-      torch::empty({0}, at::dtype(at::kLong).requires_grad(false));
-  if (config.gpu_count > 0)
-    nms_keep = nms_keep.cuda();
-  for (int64_t i = 0; i < nms_class_ids.size(0); ++i) {
-    auto class_id = nms_class_ids[i];
-    //    // Pick detections of this class
-    auto ixs =
-        torch::nonzero(pre_nms_class_ids == class_id).narrow(1, 0, 1).squeeze();
-
-    // Sort
-    auto ix_rois = pre_nms_rois.index_select(0, ixs);
-
-    auto ix_scores = pre_nms_scores.index_select(0, ixs);
-    at::Tensor order;
-    std::tie(ix_scores, order) =
-        ix_scores.unsqueeze(1).sort(0, /*descending*/ true);
-    order = order.squeeze();
-    ix_rois = ix_rois.index_select(0, order);
-
-    auto class_keep = Nms(torch::cat({ix_rois, ix_scores}, /*dim*/ 1),
-                          config.detection_nms_threshold);
-
-    // Map indicies
-    class_keep = keep.take(ixs.take(order.take(class_keep)));
-
-    if (i == 0)
-      nms_keep = class_keep;
-    else
-      nms_keep = unique1d(torch::cat({nms_keep, class_keep}));
-  }
-  keep = intersect1d(keep, nms_keep);
-
-  // Keep top detections
-  auto scores = class_scores.take(keep).unsqueeze(1);
-  at::Tensor top_ids;
-  std::tie(scores, top_ids) = scores.sort(0, /*descending*/ true);
-  auto roi_count = config.detection_max_instances;
-  top_ids = top_ids.narrow(0, 0, std::min(roi_count, top_ids.size(0)));
-  keep = keep.take(top_ids.squeeze());
-
   // Arrange output as [N, (y1, x1, y2, x2, class_id, score)]
   // Coordinates are in image domain.
-  auto result = torch::cat(
-      {refined_rois.index_select(0, keep),
-       class_ids.index_select(0, keep).unsqueeze(1).to(at::dtype(at::kFloat)),
-       class_scores.index_select(0, keep).unsqueeze(1)},
+  auto detections = torch::cat(
+      {refined_rois, class_ids.unsqueeze(1).to(at::dtype(at::kFloat)),
+       class_scores.unsqueeze(1)},
       /*dim*/ 1);
-  return result;
+  return {detections, valid};
 }
 }  // namespace
+
 at::Tensor DetectionLayer(const Config& config,
+                          const LayerConstants& constants,
                           at::Tensor rois,
                           at::Tensor mrcnn_class,
                           at::Tensor mrcnn_bbox,
                           const std::vector<ImageMeta>& image_meta) {
-  // Currently only supports batchsize 1
-  rois = rois.squeeze(0);
-  auto detections = RefineDetections(rois, mrcnn_class, mrcnn_bbox,
-                                     image_meta[0].window, config);
-  return detections;
+  if (rois.ndimension() == 2)
+    rois = rois.unsqueeze(0);
+  auto batch_size = rois.size(0);
+  auto num_rois = rois.size(1);
+  assert(static_cast<int64_t>(image_meta.size()) == batch_size);
+
+  // All images are refined at once, filtering is done with masks to keep
+  // fixed shapes and avoid synchronization with the host, so the number of
+  // launches doesn't depend on the batch, the classes or the detections
+  auto [detections, valid] =
+      RefineDetections(rois.reshape({-1, 4}), mrcnn_class, mrcnn_bbox,
+                       image_meta, constants, config);
+
+  // Apply per-class NMS for the whole batch at once, every (image, class)
+  // pair is a separate group. Invalid boxes are not removed before NMS, but
+  // they either are in the background group or have lower scores than all
+  // valid boxes of their class, so they can't suppress valid ones.
+  auto image_ids =
+      torch::arange(batch_size, detections.options().dtype(at::kFloat))
+          .unsqueeze(1)
+          .expand({batch_size, num_rois})
+          .contiguous()
+          .view({-1, 1});
+  auto groups = detections.narrow(1, 4, 1) +
+                image_ids * static_cast<float>(config.num_classes);
+  auto nms_dets = torch::cat(
+      {detections.narrow(1, 0, 4), groups, detections.narrow(1, 5, 1)}, 1);
+  auto keep = GroupNms(nms_dets, config.detection_nms_threshold) * valid;
+
+  // Keep top detections
+  auto roi_count = std::min(config.detection_max_instances, num_rois);
+  auto scores = detections.narrow(1, 5, 1).squeeze(1) * keep.toType(at::kFloat);
+  at::Tensor top_ids;
+  std::tie(std::ignore, top_ids) =
+      scores.view({batch_size, num_rois}).topk(roi_count, /*dim*/ 1);
+  auto offsets =
+      torch::arange(batch_size, top_ids.options()).unsqueeze(1) * num_rois;
+  top_ids = (top_ids + offsets).view({-1});
+
+  // Zero rows mark padding, they are placed after all kept detections
+  auto top_keep = keep.index_select(0, top_ids).toType(at::kFloat).unsqueeze(1);
+  auto result = detections.index_select(0, top_ids) * top_keep;
+  return result.view({batch_size, roi_count, 6});
 }
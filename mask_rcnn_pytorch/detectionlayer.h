@@ -3,16 +3,25 @@
 
 #include "config.h"
 #include "imageutils.h"
+#include "layerconstants.h"
 
 #include <torch/torch.h>
 /*
  * Takes classified proposal boxes and their bounding box deltas and
  * returns the final detection boxes.
+ * Inputs:
+ * constants: constant tensors on the device of the inputs
+ * rois: [batch, num_rois, (y1, x1, y2, x2)] zero padded proposals
+ * probs: [batch * num_rois, num_classes]
+ * deltas: [batch * num_rois, num_classes, 4]
  * Returns:
- * [batch, num_detections, (y1, x1, y2, x2, class_score)] in pixels
+ * [batch, num_detections, (y1, x1, y2, x2, class_id, score)] in pixels,
+ * num_detections is detection_max_instances (or num_rois if it is smaller),
+ * rows after the detected objects are zero padded
  */
 
 at::Tensor DetectionLayer(const Config& config,
+                          const LayerConstants& constants,
                           at::Tensor rois,
                           at::Tensor probs,
                           at::Tensor deltas,
@@ -4,216 +4,224 @@
 #include "roialign/crop_and_resize.h"
 #include "roialign/crop_and_resize_gpu.h"
 
-std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> DetectionTargetLayer(
-    const Config& config,
-    at::Tensor proposals,
-    at::Tensor gt_class_ids,
-    at::Tensor gt_boxes,
-    at::Tensor gt_masks) {
-  // Currently only supports batchsize 1
-  proposals = proposals.squeeze(0);
-  gt_class_ids = gt_class_ids.squeeze(0);
-  gt_boxes = gt_boxes.squeeze(0);
-  gt_masks = gt_masks.squeeze(0);
+namespace {
+/*
+ * Randomly selects up to count rows where mask is set, without nonzero or
+ * randperm: rows get random keys and the top keys are taken, unselected rows
+ * get the -1 key. Returns: [count] keys, negative for unused slots, and
+ * [count] row indices.
+ */
+std::tuple<at::Tensor, at::Tensor> SampleRows(at::Tensor keys,
+                                              at::Tensor mask,
+                                              int64_t count) {
+  return keys.masked_fill(mask == 0, -1)
+      .topk(count, /*dim*/ 0, /*largest*/ true, /*sorted*/ true);
+}
 
+/*
+ * Writes targets of a single image to the [TRAIN_ROIS_PER_IMAGE, ...] rows of
+ * the outputs, the inputs are in the format of DetectionTargetLayer without
+ * the batch dimension.
+ */
+void ImageTargets(const Config& config,
+                  at::Tensor proposals,
+                  at::Tensor gt_class_ids,
+                  at::Tensor gt_boxes,
+                  at::Tensor gt_masks,
+                  at::Tensor rois,
+                  at::Tensor class_ids,
+                  at::Tensor target_deltas,
+                  at::Tensor target_masks) {
   //  Handle COCO crowds
   //  A crowd box in COCO is a bounding box around several instances. Exclude
   //  them from training. A crowd box is given a negative class ID.
   //  Now they are excluded in coco loader
 
-  // Compute overlaps matrix [proposals, gt_boxes]
-  auto overlaps = BBoxOverlapsLoops(proposals, gt_boxes);
+  // All sizes below are known on the host, the sampled counts stay on the
+  // device, so the layer doesn't synchronize with the GPU
+  auto rois_count = static_cast<int64_t>(config.train_rois_per_image);
+  auto proposals_count = proposals.size(0);
+  auto positive_slots = std::min(
+      static_cast<int64_t>(config.train_rois_per_image *
+                           config.roi_positive_ratio),
+      proposals_count);
+  auto negative_slots =
+      std::min(rois_count - positive_slots, proposals_count);
+
+  // Compute best matches from overlaps matrix [proposals, gt_boxes]
+  at::Tensor roi_iou_max, roi_iou_argmax;
+  std::tie(roi_iou_max, roi_iou_argmax, std::ignore, std::ignore) =
+      BBoxMaxOverlaps(proposals, gt_boxes);
+
+  // Zero padded proposals are neither positive nor negative
+  auto non_empty = (proposals.narrow(1, 2, 1) > proposals.narrow(1, 0, 1)) &
+                   (proposals.narrow(1, 3, 1) > proposals.narrow(1, 1, 1));
+  non_empty = non_empty.squeeze(1);
 
   // Determine postive and negative ROIs
-  auto roi_iou_max = std::get<0>(torch::max(overlaps, /*dim*/ 1));
-
   // 1. Positive ROIs are those with >= 0.5 IoU with a GT box
-  auto positive_roi_bool = roi_iou_max >= 0.5f;
-
-  at::Tensor roi_gt_class_ids;
-  at::Tensor deltas;
-  at::Tensor masks;
-
-  // Subsample ROIs. Aim for 33% positive
-  // Positive ROIs
-  int64_t positive_count = 0;
-  torch::Tensor positive_rois;
-  auto positive_indices = torch::nonzero(positive_roi_bool);
-  if (!is_empty(positive_indices)) {
-    positive_indices = positive_indices.narrow(1, 0, 1);
-
-    positive_count =
-        int(config.train_rois_per_image * config.roi_positive_ratio);
-
-    auto rand_idx =
-        torch::randperm(positive_indices.size(0), at::dtype(at::kLong));
-    rand_idx = rand_idx.narrow(
-        0, 0, std::min(positive_indices.size(0), positive_count));
-    if (config.gpu_count > 0) {
-      rand_idx = rand_idx.cuda();
-    }
-    positive_indices = positive_indices.take(rand_idx);
-    positive_count = positive_indices.size(0);
-    positive_rois = proposals.index_select(0, positive_indices);
-
-    // Debug block
-    //    std::cerr << "positive rois \n" << positive_rois << "\n";
-    //    auto d = torch::tensor({512, 512, 512, 512}, at::dtype(at::kFloat));
-    //    VisualizeBoxes("proposals", 512, 512, positive_rois.squeeze().cpu() *
-    //    d,
-    //                   gt_boxes.squeeze().cpu() * d);
-    //    exit(0);
-
-    //   Assign positive ROIs to GT boxes.
-    auto positive_overlaps = overlaps.index_select(0, positive_indices);
-    auto roi_gt_box_assignment =
-        std::get<1>(torch::max(positive_overlaps, /*dim*/ 1));
-    auto roi_gt_boxes = gt_boxes.index_select(0, roi_gt_box_assignment);
-    roi_gt_class_ids = gt_class_ids.take(roi_gt_box_assignment);
-
-    //   Compute bbox refinement for positive ROIs
-    {
-      auto deltas_data = BoxRefinement(positive_rois, roi_gt_boxes);
-      deltas =
-          torch::from_blob(deltas_data.cpu().data<float>(), deltas_data.sizes(),
-                           at::dtype(at::kFloat).requires_grad(false))
-              .clone();
-    }
-    if (config.gpu_count > 0)
-      deltas = deltas.cuda();
-
-    auto std_dev = torch::tensor(config.rpn_bbox_std_dev,
-                                 at::dtype(at::kFloat).requires_grad(false));
-    if (config.gpu_count > 0)
-      std_dev = std_dev.cuda();
-    deltas /= std_dev;
-
-    //   Assign positive ROIs to GT masks
-    auto roi_masks = gt_masks.index_select(0, roi_gt_box_assignment);
-
-    //   Compute mask targets
-    auto boxes = positive_rois;
-    if (config.use_mini_mask) {
-      // Transform ROI corrdinates from normalized image space
-      // to normalized mini-mask space.
-      auto yxyx = positive_rois.chunk(4, /*dim*/ 1);
-      auto y1 = yxyx[0];
-      auto x1 = yxyx[1];
-      auto y2 = yxyx[2];
-      auto x2 = yxyx[3];
-      auto gyxyx = roi_gt_boxes.chunk(4, /*dim*/ 1);
-      auto gt_y1 = gyxyx[0];
-      auto gt_x1 = gyxyx[1];
-      auto gt_y2 = gyxyx[2];
-      auto gt_x2 = gyxyx[3];
-      auto gt_h = gt_y2 - gt_y1;
-      auto gt_w = gt_x2 - gt_x1;
-      y1 = (y1 - gt_y1) / gt_h;
-      x1 = (x1 - gt_x1) / gt_w;
-      y2 = (y2 - gt_y1) / gt_h;
-      x2 = (x2 - gt_x1) / gt_w;
-      boxes = torch::cat({y1, x1, y2, x2}, /*dim*/ 1);
-    }
-    auto box_ids = torch::arange(roi_masks.size(0),
-                                 at::requires_grad(false).dtype(at::kInt));
-    if (config.gpu_count > 0)
-      box_ids = box_ids.cuda();
-    masks = torch::zeros({}, at::dtype(at::kFloat).requires_grad(false));
-    if (config.gpu_count > 0)
-      masks = masks.cuda();
-
-    if (config.gpu_count > 0) {
-      crop_and_resize_gpu_forward(roi_masks.unsqueeze(1), boxes, box_ids, 0,
-                                  config.mask_shape[0], config.mask_shape[1],
-                                  masks);
-    } else {
-      crop_and_resize_forward(roi_masks.unsqueeze(1), boxes, box_ids, 0,
-                              config.mask_shape[0], config.mask_shape[1],
-                              masks);
-    }
-    masks = masks.squeeze(1);
-
-    //  Threshold mask pixels at 0.5 to have GT masks be 0 or 1 to use with
-    //   binary cross entropy loss.
-    masks = torch::round(masks);
-  } else {
-    positive_count = 0;
-  }
+  auto positive_roi_bool = (roi_iou_max >= 0.5f) & non_empty;
+  //  2. Negative ROIs are those with < 0.5 with every GT box.
+  auto negative_roi_bool = (roi_iou_max < 0.5f) & non_empty;
+
+  // Subsample ROIs. Aim for 33% positive, random keys are generated on the
+  // device
+  auto keys = torch::rand({proposals_count},
+                          proposals.options().requires_grad(false));
+  at::Tensor positive_keys, positive_indices;
+  std::tie(positive_keys, positive_indices) =
+      SampleRows(keys, positive_roi_bool, positive_slots);
+  auto positive_valid = positive_keys >= 0;
+  auto positive_invalid = positive_valid == 0;
+  auto positive_count = positive_valid.to(at::kFloat).sum();
 
-  //  2. Negative ROIs are those with < 0.5 with every GT box. Skip crowds.
-  auto negative_roi_bool = roi_iou_max < 0.5f;
-  // negative_roi_bool = negative_roi_bool & no_crowd_bool
   // Negative ROIs. Add enough to maintain positive:negative ratio.
-  int64_t negative_count = 0;
-  torch::Tensor negative_rois;
-  if (!is_empty(torch::nonzero(negative_roi_bool)) && positive_count > 0) {
-    auto negative_indices = torch::nonzero(negative_roi_bool).narrow(1, 0, 1);
-    auto r = 1.0f / config.roi_positive_ratio;
-    negative_count = static_cast<int64_t>(r * positive_count - positive_count);
-    auto rand_idx =
-        torch::randperm(negative_indices.size(0), at::dtype(at::kLong));
-    rand_idx = rand_idx.narrow(
-        0, 0, std::min(negative_indices.size(0), negative_count));
-    if (config.gpu_count > 0)
-      rand_idx = rand_idx.cuda();
-    negative_indices = negative_indices.take(rand_idx);
-    negative_count = negative_indices.size(0);
-    negative_rois = proposals.index_select(0, negative_indices);
+  auto r = 1.0f / config.roi_positive_ratio;
+  auto negative_count = (positive_count * r - positive_count).floor();
+  at::Tensor negative_keys, negative_indices;
+  std::tie(negative_keys, negative_indices) =
+      SampleRows(keys, negative_roi_bool, negative_slots);
+  auto negative_rank = torch::arange(negative_slots, negative_keys.options());
+  auto negative_invalid =
+      (negative_keys < 0) | (negative_rank >= negative_count);
+
+  auto positive_rois = proposals.index_select(0, positive_indices)
+                           .masked_fill(positive_invalid.unsqueeze(1), 0);
+
+  //   Assign positive ROIs to GT boxes.
+  auto roi_gt_box_assignment =
+      roi_iou_argmax.index_select(0, positive_indices);
+  auto roi_gt_boxes = gt_boxes.index_select(0, roi_gt_box_assignment);
+  auto roi_gt_class_ids = gt_class_ids.take(roi_gt_box_assignment)
+                              .masked_fill(positive_invalid, -1);
+
+  //   Compute bbox refinement for positive ROIs, unused slots can be matched
+  //   to zero padded GT boxes, so they are overwritten instead of multiplied
+  auto deltas = BoxRefinement(positive_rois, roi_gt_boxes);
+  const auto& std_dev = config.rpn_bbox_std_dev;
+  deltas = torch::stack(
+      {deltas.select(1, 0) / std_dev[0], deltas.select(1, 1) / std_dev[1],
+       deltas.select(1, 2) / std_dev[2], deltas.select(1, 3) / std_dev[3]},
+      /*dim*/ 1);
+  deltas = deltas.masked_fill(positive_invalid.unsqueeze(1), 0);
+
+  //   Assign positive ROIs to GT masks, GT masks can be bytes, only the
+  //   selected ones are converted for the crops
+  auto roi_masks =
+      gt_masks.index_select(0, roi_gt_box_assignment).to(at::kFloat);
+
+  //   Compute mask targets
+  auto boxes = positive_rois;
+  if (config.use_mini_mask) {
+    // Transform ROI corrdinates from normalized image space
+    // to normalized mini-mask space.
+    auto yxyx = positive_rois.chunk(4, /*dim*/ 1);
+    auto y1 = yxyx[0];
+    auto x1 = yxyx[1];
+    auto y2 = yxyx[2];
+    auto x2 = yxyx[3];
+    auto gyxyx = roi_gt_boxes.chunk(4, /*dim*/ 1);
+    auto gt_y1 = gyxyx[0];
+    auto gt_x1 = gyxyx[1];
+    auto gt_y2 = gyxyx[2];
+    auto gt_x2 = gyxyx[3];
+    auto gt_h = gt_y2 - gt_y1;
+    auto gt_w = gt_x2 - gt_x1;
+    y1 = (y1 - gt_y1) / gt_h;
+    x1 = (x1 - gt_x1) / gt_w;
+    y2 = (y2 - gt_y1) / gt_h;
+    x2 = (x2 - gt_x1) / gt_w;
+    boxes = torch::cat({y1, x1, y2, x2}, /*dim*/ 1)
+                .masked_fill(positive_invalid.unsqueeze(1), 0);
+  }
+  auto box_ids = torch::arange(
+      positive_slots, boxes.options().dtype(at::kInt).requires_grad(false));
+
+  // Outputs are filled by parts: positive ROIs, negative ROIs and padding
+  // when there are not enough proposals. Mask target crops are written
+  // directly to the output.
+  auto sampled_count = positive_slots + negative_slots;
+  auto padding_count = rois_count - sampled_count;
+  auto masks = target_masks.narrow(0, 0, positive_slots);
+  if (config.gpu_count > 0) {
+    crop_and_resize_gpu_forward(roi_masks.unsqueeze(1), boxes, box_ids, 0,
+                                config.mask_shape[0], config.mask_shape[1],
+                                masks);
   } else {
-    negative_count = 0;
+    crop_and_resize_forward(roi_masks.unsqueeze(1), boxes, box_ids, 0,
+                            config.mask_shape[0], config.mask_shape[1], masks);
   }
 
+  //  Threshold mask pixels at 0.5 to have GT masks be 0 or 1 to use with
+  //   binary cross entropy loss.
+  masks.round_().masked_fill_(positive_invalid.view({-1, 1, 1, 1}), 0);
+  target_masks.narrow(0, positive_slots, rois_count - positive_slots).zero_();
+
   // Append negative ROIs and pad bbox deltas and masks that
   // are not used for negative ROIs with zeros.
-  at::Tensor rois;
-  if (positive_count > 0 && negative_count > 0) {
-    rois = torch::cat({positive_rois, negative_rois}, /*dim*/ 0);
-    auto zeros = torch::zeros({negative_count},
-                              at::requires_grad(false).dtype(at::kInt));
-    if (config.gpu_count > 0)
-      zeros = zeros.cuda();
-    roi_gt_class_ids = torch::cat({roi_gt_class_ids, zeros}, /*dim*/ 0);
-    zeros = torch::zeros({negative_count, 4}, at::requires_grad(false));
-    if (config.gpu_count > 0)
-      zeros = zeros.cuda();
-    deltas = torch::cat({deltas, zeros}, /*dim*/ 0);
-    zeros = torch::zeros(
-        {negative_count, config.mask_shape[0], config.mask_shape[1]},
-        at::requires_grad(false));
-    if (config.gpu_count > 0)
-      zeros = zeros.cuda();
-    masks = torch::cat({masks, zeros}, /*dim*/ 0);
-  } else if (positive_count > 0) {
-    rois = positive_rois;
-  } else if (negative_count > 0) {
-    rois = negative_rois;
-    auto zeros = torch::zeros({negative_count}, at::requires_grad(false));
-    if (config.gpu_count > 0)
-      zeros = zeros.cuda();
-    roi_gt_class_ids = zeros;
-    zeros = torch::zeros({negative_count, 4},
-                         at::requires_grad(false).dtype(at::kInt));
-    if (config.gpu_count > 0)
-      zeros = zeros.cuda();
-    deltas = zeros;
-    zeros = torch::zeros(
-        {negative_count, config.mask_shape[0], config.mask_shape[1]},
-        at::requires_grad(false));
-    if (config.gpu_count > 0)
-      zeros = zeros.cuda();
-    masks = zeros;
-  } else {
-    rois = torch::empty({}, at::dtype(at::kFloat).requires_grad(false));
-    roi_gt_class_ids =
-        torch::empty({}, at::dtype(at::kFloat).requires_grad(false));
-    deltas = torch::empty({}, at::dtype(at::kFloat).requires_grad(false));
-    masks = torch::empty({}, at::dtype(at::kFloat).requires_grad(false));
-    if (config.gpu_count) {
-      rois = rois.cuda();
-      roi_gt_class_ids = roi_gt_class_ids.cuda();
-      deltas = deltas.cuda();
-      masks = masks.cuda();
-    }
+  auto negative_rois = proposals.index_select(0, negative_indices)
+                           .masked_fill(negative_invalid.unsqueeze(1), 0);
+  rois.narrow(0, 0, positive_slots).copy_(positive_rois);
+  rois.narrow(0, positive_slots, negative_slots).copy_(negative_rois);
+  rois.narrow(0, sampled_count, padding_count).zero_();
+
+  class_ids.narrow(0, 0, positive_slots).copy_(roi_gt_class_ids);
+  auto negative_class_ids = class_ids.narrow(0, positive_slots, negative_slots);
+  negative_class_ids.zero_().masked_fill_(negative_invalid, -1);
+  class_ids.narrow(0, sampled_count, padding_count).fill_(-1);
+
+  target_deltas.narrow(0, 0, positive_slots).copy_(deltas);
+  target_deltas.narrow(0, positive_slots, rois_count - positive_slots).zero_();
+}
+
+// Output tensor taken from the arena if there is one
+at::Tensor Output(StepArena* arena,
+                  const std::string& name,
+                  at::IntList sizes,
+                  const at::TensorOptions& options,
+                  at::ScalarType type) {
+  if (arena)
+    return arena->Get(name, sizes, type);
+  return torch::empty(sizes, options.dtype(type).requires_grad(false));
+}
+}  // namespace
+
+void ReserveDetectionTargets(const Config& config, StepArena& arena) {
+  auto batch_size = static_cast<int64_t>(config.images_per_gpu);
+  auto rois_count = static_cast<int64_t>(config.train_rois_per_image);
+  arena.Reserve("target_rois", {batch_size, rois_count, 4}, at::kFloat);
+  arena.Reserve("target_class_ids", {batch_size, rois_count}, at::kInt);
+  arena.Reserve("target_deltas", {batch_size, rois_count, 4}, at::kFloat);
+  arena.Reserve(
+      "target_masks",
+      {batch_size, rois_count, config.mask_shape[0], config.mask_shape[1]},
+      at::kFloat);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> DetectionTargetLayer(
+    const Config& config,
+    at::Tensor proposals,
+    at::Tensor gt_class_ids,
+    at::Tensor gt_boxes,
+    at::Tensor gt_masks,
+    StepArena* arena) {
+  // Images are sampled independently into their rows of the outputs
+  auto batch_size = proposals.size(0);
+  auto rois_count = static_cast<int64_t>(config.train_rois_per_image);
+  auto options = proposals.options();
+  auto rois = Output(arena, "target_rois", {batch_size, rois_count, 4},
+                     options, at::kFloat);
+  auto class_ids = Output(arena, "target_class_ids", {batch_size, rois_count},
+                          options, gt_class_ids.scalar_type());
+  auto deltas = Output(arena, "target_deltas", {batch_size, rois_count, 4},
+                       options, at::kFloat);
+  auto masks = Output(arena, "target_masks",
+                      {batch_size, rois_count, config.mask_shape[0],
+                       config.mask_shape[1]},
+                      options, at::kFloat);
+  for (int64_t b = 0; b < batch_size; ++b) {
+    ImageTargets(config, proposals[b], gt_class_ids[b], gt_boxes[b],
+                 gt_masks[b], rois[b], class_ids[b], deltas[b], masks[b]);
   }
-  return {rois, roi_gt_class_ids, deltas, masks};
+  return {rois, class_ids, deltas, masks};
 }
@@ -3,36 +3,50 @@
 
 #include "config.h"
 #include "imageutils.h"
+#include "steparena.h"
 
 #include <torch/torch.h>
 
 /* Subsamples proposals and generates target box refinment, class_ids,
- * and masks for each.
+ * and masks for each. Sampling is done on the device of the inputs with
+ * random keys instead of nonzero and randperm, the outputs always have
+ * TRAIN_ROIS_PER_IMAGE rows, so the layer doesn't synchronize with the GPU.
  * Inputs:
  * proposals: [batch, N, (y1, x1, y2, x2)] in normalized coordinates. Might
  *             be zero padded if there are not enough proposals.
  *  gt_class_ids: [batch, MAX_GT_INSTANCES] Integer class IDs.
  *  gt_boxes: [batch, MAX_GT_INSTANCES, (y1, x1, y2, x2)] in normalized
  *            coordinates.
- *  gt_masks: [batch, height, width, MAX_GT_INSTANCES] of boolean type
+ *  gt_masks: [batch, MAX_GT_INSTANCES, height, width] of boolean type,
+ *            uint8 or float
+ *  Images of the batch are sampled independently, their GT instances can be
+ *  zero padded to the same count.
  *
  *  Returns: Target ROIs and corresponding class IDs, bounding box shifts,
  *  and masks.
  *  rois: [batch, TRAIN_ROIS_PER_IMAGE, (y1, x1, y2, x2)] in normalized
  *        coordinates
- *  target_class_ids: [batch, TRAIN_ROIS_PER_IMAGE]. Integer class IDs.
- *  target_deltas: [batch, TRAIN_ROIS_PER_IMAGE, NUM_CLASSES,
- *                  (dy, dx, log(dh), log(dw), class_id)]
- *                 Class-specific bbox refinments.
+ *  target_class_ids: [batch, TRAIN_ROIS_PER_IMAGE]. Integer class IDs,
+ *                    0 for negative ROIs and -1 for padding rows which are
+ *                    excluded from the losses. Padding rows of other
+ *                    outputs are zeros.
+ *  target_deltas: [batch, TRAIN_ROIS_PER_IMAGE, (dy, dx, log(dh), log(dw))]
+ *                 Bbox refinments for the target class.
  *  target_mask: [batch, TRAIN_ROIS_PER_IMAGE, height, width)
  *               Masks cropped to bbox boundaries and resized to neural
  *               network output size.
+ * If arena is given, outputs share memory with its buffers reserved by
+ * ReserveDetectionTargets and are valid until the next call.
  */
 std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> DetectionTargetLayer(
     const Config& config,
     at::Tensor proposals,
     at::Tensor gt_class_ids,
     at::Tensor gt_boxes,
-    at::Tensor gt_masks);
+    at::Tensor gt_masks,
+    StepArena* arena = nullptr);
+
+// Reserves the arena buffers for the largest outputs of DetectionTargetLayer
+void ReserveDetectionTargets(const Config& config, StepArena& arena);
 
 #endif  // DETECTIONTARGETLAYER_H
@@ -1,6 +1,7 @@
 #include "fpn.h"
 #include "debug.h"
 #include "nnutils.h"
+#include "resnet.h"
 
 FPNImpl::FPNImpl() {}
 
@@ -55,6 +56,55 @@ FPNImpl::FPNImpl(torch::nn::Sequential c1,
   register_module("P3_conv2", p3_conv2_);
   register_module("P2_conv1", p2_conv1_);
   register_module("P2_conv2", p2_conv2_);
+  c1_run_ = c1_;
+}
+
+void FPNImpl::FoldBatchNorm() {
+  if (c1_run_.ptr() != c1_.ptr())
+    return;
+  c1_run_ = ResNetImpl::FoldStage1(c1_);
+  for (auto& stage : {c2_, c3_, c4_, c5_})
+    ResNetImpl::FoldStage(stage);
+}
+
+void FPNImpl::UpdateFrozenStages() {
+  frozen_stages_ = 0;
+  for (const auto& stage : {c1_, c2_, c3_, c4_, c5_}) {
+    for (const auto& param : stage->parameters()) {
+      if (param.requires_grad())
+        return;
+    }
+    ++frozen_stages_;
+  }
+}
+
+void FPNImpl::SetGradientCheckpointing(bool enabled) {
+  gradient_checkpointing_ = enabled;
+}
+
+at::Tensor FPNImpl::RunStage(torch::nn::Sequential stage,
+                             at::Tensor x,
+                             size_t index) {
+  // Activations of the frozen stages aren't kept for the backward pass,
+  // they are released as soon as the next stage has run
+  if (index < frozen_stages_) {
+    torch::NoGradGuard no_grad;
+    return stage->forward(x);
+  }
+  if (gradient_checkpointing_) {
+    return CheckpointForward(
+        [stage](at::Tensor input) { return stage->forward(input); }, x);
+  }
+  return stage->forward(x);
+}
+
+// The padded copy of the level is the activation kept by the convolution
+at::Tensor FPNImpl::RunLevel(torch::nn::Sequential conv, at::Tensor x) {
+  if (gradient_checkpointing_) {
+    return CheckpointForward(
+        [conv](at::Tensor input) { return conv->forward(input); }, x);
+  }
+  return conv->forward(x);
 }
 
 std::tuple<torch::Tensor,
@@ -63,14 +113,11 @@ std::tuple<torch::Tensor,
            torch::Tensor,
            torch::Tensor>
 FPNImpl::forward(at::Tensor x) {
-  x = c1_->forward(x);
-  x = c2_->forward(x);
-  auto c2_out = x;
-  x = c3_->forward(x);
-  auto c3_out = x;
-  x = c4_->forward(x);
-  auto c4_out = x;
-  x = c5_->forward(x);
+  x = RunStage(c1_run_, x, 0);
+  auto c2_out = x = RunStage(c2_, x, 1);
+  auto c3_out = x = RunStage(c3_, x, 2);
+  auto c4_out = x = RunStage(c4_, x, 3);
+  x = RunStage(c5_, x, 4);
   auto p5_out = p5_conv1_->forward(x);
   auto p4_out =
       p4_conv1_->forward(c4_out) + upsample(p5_out, /*scale_factor*/ 2);
@@ -79,10 +126,10 @@ FPNImpl::forward(at::Tensor x) {
   auto p2_out =
       p2_conv1_->forward(c2_out) + upsample(p3_out, /*scale_factor*/ 2);
 
-  p5_out = p5_conv2_->forward(p5_out);
-  p4_out = p4_conv2_->forward(p4_out);
-  p3_out = p3_conv2_->forward(p3_out);
-  p2_out = p2_conv2_->forward(p2_out);
+  p5_out = RunLevel(p5_conv2_, p5_out);
+  p4_out = RunLevel(p4_conv2_, p4_out);
+  p3_out = RunLevel(p3_conv2_, p3_out);
+  p2_out = RunLevel(p2_conv2_, p2_out);
 
   // P6 is used for the 5th anchor scale in RPN. Generated by subsampling from
   // P5 with stride of 2.
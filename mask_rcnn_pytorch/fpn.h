@@ -20,12 +20,33 @@ class FPNImpl : public torch::nn::Module {
              torch::Tensor>
   forward(torch::Tensor x);
 
+  // Folds batch norms of the backbone into convolutions for inference.
+  // Training needs the batch norms, the folded model is for Detect only.
+  void FoldBatchNorm();
+
+  // Counts the leading backbone stages whose parameters don't require
+  // gradients, forward runs them without the autograd graph. Call it after
+  // the trainable parameters change.
+  void UpdateFrozenStages();
+
+  // Trainable backbone stages and the 3x3 convolutions of the pyramid levels
+  // are run with CheckpointForward, their activations are recomputed in the
+  // backward pass
+  void SetGradientCheckpointing(bool enabled);
+
  private:
+  at::Tensor RunStage(torch::nn::Sequential stage, at::Tensor x, size_t index);
+  at::Tensor RunLevel(torch::nn::Sequential conv, at::Tensor x);
+
   torch::nn::Sequential c1_{nullptr};
   torch::nn::Sequential c2_{nullptr};
   torch::nn::Sequential c3_{nullptr};
   torch::nn::Sequential c4_{nullptr};
   torch::nn::Sequential c5_{nullptr};
+  // C1 stage run by forward, it differs from c1_ when batch norm is folded
+  torch::nn::Sequential c1_run_{nullptr};
+  size_t frozen_stages_{0};
+  bool gradient_checkpointing_{false};
 
   torch::nn::Functional p6_{nullptr};
   torch::nn::Conv2d p5_conv1_{nullptr};
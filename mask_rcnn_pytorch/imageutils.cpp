@@ -1,51 +1,51 @@
 #include "imageutils.h"
+#include "../tensorview.h"
+#include "../threadpool.h"
 #include "debug.h"
 #include "nnutils.h"
 
+#include <mutex>
+
 cv::Mat LoadImage(const std::string path) {
   cv::Mat image = cv::imread(path, cv::IMREAD_COLOR);
   return image;
 }
 
 at::Tensor CvImageToTensor(const cv::Mat& image) {
-  // Idea taken from https://github.com/pytorch/pytorch/issues/12506
-  // we have to split the interleaved channels
-  cv::Mat channelsConcatenatedFloat;
-  if (image.channels() == 3) {
-    cv::Mat bgr[3];
-    cv::split(image, bgr);
-    cv::Mat channelsConcatenated;
-    cv::vconcat(bgr[2], bgr[1], channelsConcatenated);
-    cv::vconcat(channelsConcatenated, bgr[0], channelsConcatenated);
-
-    channelsConcatenated.convertTo(channelsConcatenatedFloat, CV_32FC3);
-    assert(channelsConcatenatedFloat.isContinuous());
-  } else if (image.channels() == 1) {
-    image.convertTo(channelsConcatenatedFloat, CV_32FC3);
-  } else {
+  if (image.channels() != 3 && image.channels() != 1)
     throw std::invalid_argument("CvImageToTensor: Unsupported image format");
+  // the tensor of a float mask shares the memory, it keeps the cv::Mat alive
+  if (image.channels() == 1 && image.depth() == CV_32F &&
+      image.isContinuous()) {
+    cv::Mat owner = image;
+    return torch::from_blob(image.data, {image.rows, image.cols},
+                            [owner](void*) {},
+                            at::TensorOptions(at::kFloat));
+  }
+  // interleaved BGR to the RGB planes with one pass
+  auto tensor = torch::empty({image.channels(), image.rows, image.cols},
+                             at::TensorOptions(at::kFloat));
+  auto planes = utils::TorchView<float>(tensor);
+  auto copy = [&planes](auto pixels) {
+    utils::CopyView(pixels.Reverse(2).Permute({2, 0, 1}), planes);
+  };
+  switch (image.depth()) {
+    case CV_8U:
+      copy(utils::CvMatView<const uint8_t>(image));
+      break;
+    case CV_32F:
+      copy(utils::CvMatView<const float>(image));
+      break;
+    default: {
+      cv::Mat float_image;
+      image.convertTo(float_image, CV_32F);
+      copy(utils::CvMatView<const float>(float_image));
+    }
   }
-  std::vector<int64_t> dims{static_cast<int64_t>(image.channels()),
-                            static_cast<int64_t>(image.rows),
-                            static_cast<int64_t>(image.cols)};
-
-  at::TensorOptions options(at::kFloat);
-  at::Tensor tensor_image =
-      torch::from_blob(channelsConcatenatedFloat.data, at::IntList(dims),
-                       options.requires_grad(false))
-          .clone();  // clone is required to copy data from temporary object
-  return tensor_image.squeeze();
+  return tensor.squeeze();
 }
 
-std::tuple<cv::Mat, Window, float, Padding> ResizeImage(cv::Mat image,
-                                                        int32_t min_dim,
-                                                        int32_t max_dim,
-                                                        bool do_padding) {
-  // Default window (y1, x1, y2, x2) and default scale == 1.
-  auto h = image.rows;
-  auto w = image.cols;
-  Window window{0, 0, h, w};
-  Padding padding;
+float ResizeScale(int32_t h, int32_t w, int32_t min_dim, int32_t max_dim) {
   float scale = 1.f;
 
   // Scale?
@@ -60,30 +60,72 @@ std::tuple<cv::Mat, Window, float, Padding> ResizeImage(cv::Mat image,
     if (std::round(image_max * scale) > max_dim)
       scale = static_cast<float>(max_dim) / image_max;
   }
+  return scale;
+}
+
+cv::Size ResizedImageSize(int32_t height,
+                          int32_t width,
+                          int32_t min_dim,
+                          int32_t max_dim) {
+  auto scale = ResizeScale(height, width, min_dim, max_dim);
+  if (scale == 1.f)
+    return cv::Size(width, height);
+  return cv::Size(static_cast<int>(std::round(width * scale)),
+                  static_cast<int>(std::round(height * scale)));
+}
+
+std::tuple<cv::Mat, Window, float, Padding> ResizeImage(cv::Mat image,
+                                                        int32_t min_dim,
+                                                        int32_t max_dim,
+                                                        bool do_padding) {
+  // Default window (y1, x1, y2, x2) and default scale == 1.
+  auto h = image.rows;
+  auto w = image.cols;
+  Window window{0, 0, h, w};
+  Padding padding;
+  float scale = ResizeScale(h, w, min_dim, max_dim);
+
   // Resize image and mask
   if (scale != 1.f) {
-    cv::resize(image, image,
-               cv::Size(static_cast<int>(std::round(w * scale)),
-                        static_cast<int>(std::round(h * scale))),
+    cv::resize(image, image, ResizedImageSize(h, w, min_dim, max_dim),
                cv::INTER_LINEAR);
   }
   // Need padding?
   if (do_padding) {
-    // Get new height and width
-    h = image.rows;
-    w = image.cols;
-    auto top_pad = (max_dim - h) / 2;
-    auto bottom_pad = max_dim - h - top_pad;
-    auto left_pad = (max_dim - w) / 2;
-    auto right_pad = max_dim - w - left_pad;
-    cv::copyMakeBorder(image, image, top_pad, bottom_pad, left_pad, right_pad,
+    std::tie(window, padding) = PaddingWindow(image.rows, image.cols, max_dim);
+    cv::copyMakeBorder(image, image, padding.top_pad, padding.bottom_pad,
+                       padding.left_pad, padding.right_pad,
                        cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
-    padding = {top_pad, bottom_pad, left_pad, right_pad, 0, 0};
-    window = {top_pad, left_pad, h + top_pad, w + left_pad};
   }
   return {image, window, scale, padding};
 }
 
+std::tuple<Window, Padding> PaddingWindow(int32_t height,
+                                          int32_t width,
+                                          int32_t max_dim) {
+  auto top_pad = (max_dim - height) / 2;
+  auto bottom_pad = max_dim - height - top_pad;
+  auto left_pad = (max_dim - width) / 2;
+  auto right_pad = max_dim - width - left_pad;
+  Padding padding{top_pad, bottom_pad, left_pad, right_pad, 0, 0};
+  Window window{top_pad, left_pad, height + top_pad, width + left_pad};
+  return {window, padding};
+}
+
+std::tuple<Window, Padding> InputPadding(int32_t height,
+                                          int32_t width,
+                                          const Config& config) {
+  if (config.image_padding)
+    return PaddingWindow(height, width, config.image_max_dim);
+
+  auto multiple = config.image_size_multiple;
+  auto bottom_pad = (height + multiple - 1) / multiple * multiple - height;
+  auto right_pad = (width + multiple - 1) / multiple * multiple - width;
+  Padding padding{0, bottom_pad, 0, right_pad, 0, 0};
+  Window window{0, 0, height, width};
+  return {window, padding};
+}
+
 cv::Mat MoldImage(cv::Mat image, const Config& config) {
   assert(image.channels() == 3);
   cv::Scalar mean(config.mean_pixel[2], config.mean_pixel[1],
@@ -92,36 +134,154 @@ cv::Mat MoldImage(cv::Mat image, const Config& config) {
   return image;
 }
 
+at::Tensor MoldImageTensor(at::Tensor image,
+                           cv::Size size,
+                           const Padding& padding,
+                           const Config& config) {
+  auto result = image.to(at::kFloat).unsqueeze(0);
+  if (size.height != image.size(1) || size.width != image.size(2))
+    result = at::upsample_bilinear2d(result, {size.height, size.width},
+                                     /*align_corners*/ false);
+  // Padding is zero before the mean subtraction, same as on the CPU
+  result = at::constant_pad_nd(result,
+                               {padding.left_pad, padding.right_pad,
+                                padding.top_pad, padding.bottom_pad},
+                               0);
+  for (int64_t c = 0; c < 3; ++c)
+    result.select(1, c).sub_(config.mean_pixel[static_cast<size_t>(c)]);
+  return result.squeeze(0);
+}
+
+namespace {
+/*
+ * Writes the BGR 8 bit image to the [3, height, width] RGB float tensor at
+ * the window and subtracts the mean pixel in the same pass. Pixels out of
+ * the window get the value of a zero pixel after the mean subtraction, as if
+ * the image was padded before molding.
+ */
+void MoldImageToTensor(const cv::Mat& image,
+                       const Window& window,
+                       const std::vector<double>& mean_pixel,
+                       at::Tensor output) {
+  const auto height = output.size(1);
+  const auto width = output.size(2);
+  const auto plane = height * width;
+  float* out = output.data<float>();
+  const float mean[3] = {static_cast<float>(mean_pixel[0]),
+                         static_cast<float>(mean_pixel[1]),
+                         static_cast<float>(mean_pixel[2])};
+
+#pragma omp parallel for
+  for (int64_t y = 0; y < height; ++y) {
+    float* r = out + y * width;
+    float* g = r + plane;
+    float* b = g + plane;
+    const bool inside_rows = y >= window.y1 && y < window.y2;
+    const int64_t x1 = inside_rows ? window.x1 : width;
+    const int64_t x2 = inside_rows ? window.x2 : width;
+    for (int64_t x = 0; x < x1; ++x) {
+      r[x] = -mean[0];
+      g[x] = -mean[1];
+      b[x] = -mean[2];
+    }
+    if (inside_rows) {
+      const uint8_t* src = image.ptr<uint8_t>(static_cast<int>(y - window.y1));
+#pragma omp simd
+      for (int64_t x = x1; x < x2; ++x) {
+        const uint8_t* px = src + (x - x1) * 3;
+        r[x] = px[2] - mean[0];
+        g[x] = px[1] - mean[1];
+        b[x] = px[0] - mean[2];
+      }
+    }
+    for (int64_t x = x2; x < width; ++x) {
+      r[x] = -mean[0];
+      g[x] = -mean[1];
+      b[x] = -mean[2];
+    }
+  }
+}
+}  // namespace
+
 std::tuple<at::Tensor, std::vector<ImageMeta>, std::vector<Window>> MoldInputs(
     const std::vector<cv::Mat>& images,
     const Config& config) {
-  std::vector<at::Tensor> molded_images;
+  std::vector<cv::Mat> resized_images;
   std::vector<ImageMeta> image_metas;
   std::vector<Window> windows;
+  int32_t height = 0;
+  int32_t width = 0;
   for (const auto& image : images) {
-    // Resize image to fit the model expected size
-    auto [molded_image, window, scale, padding] =
-        ResizeImage(image, config.image_min_dim, config.image_max_dim,
-                    config.image_padding);
-    molded_image.convertTo(molded_image, CV_32FC3);
-    molded_image = MoldImage(molded_image, config);
+    assert(image.type() == CV_8UC3);
+    // Resize image to fit the model expected size, padding is added later
+    // when the image is copied to the input tensor
+    cv::Mat resized_image;
+    std::tie(resized_image, std::ignore, std::ignore, std::ignore) =
+        ResizeImage(image, config.image_min_dim, config.image_max_dim, false);
+    if (!resized_image.isContinuous())
+      resized_image = resized_image.clone();
+    auto [window, padding] =
+        InputPadding(resized_image.rows, resized_image.cols, config);
+
+    // Without the square padding images of other aspect ratios are padded
+    // on the bottom and right sides to the largest size in the batch
+    auto padded_height =
+        resized_image.rows + padding.top_pad + padding.bottom_pad;
+    auto padded_width =
+        resized_image.cols + padding.left_pad + padding.right_pad;
+    height = std::max(height, padded_height);
+    width = std::max(width, padded_width);
 
     // Build image_meta
     ImageMeta image_meta{0, image.rows, image.cols, window};
 
-    // To tensor
-    auto img_t = CvImageToTensor(molded_image);
-
     // Append
-    molded_images.push_back(img_t);
+    resized_images.push_back(resized_image);
     windows.push_back(window);
     image_metas.push_back(image_meta);
   }
-  // Pack into arrays
-  auto tensor_images = torch::stack(molded_images);
-  // To GPU
-  if (config.gpu_count > 0)
-    tensor_images = tensor_images.cuda();
+
+  auto batch_size = static_cast<int64_t>(images.size());
+  at::Tensor tensor_images;
+  if (config.gpu_count > 0) {
+    // Only 8 bit images are copied to the GPU from the pinned memory, they
+    // are padded, normalized and transposed to CHW directly in the input
+    // tensor. Padding gets the value of a zero pixel after normalization.
+    auto mean = torch::tensor({static_cast<float>(config.mean_pixel[0]),
+                               static_cast<float>(config.mean_pixel[1]),
+                               static_cast<float>(config.mean_pixel[2])})
+                    .view({1, 3, 1, 1})
+                    .cuda();
+    tensor_images = torch::zeros({batch_size, 3, height, width},
+                                 at::dtype(at::kFloat).device(at::kCUDA)) -
+                    mean;
+    auto bgr_to_rgb = torch::tensor({2, 1, 0}, at::dtype(at::kLong)).cuda();
+    for (int64_t i = 0; i < batch_size; ++i) {
+      const auto& image = resized_images[static_cast<size_t>(i)];
+      const auto& window = windows[static_cast<size_t>(i)];
+      auto image_data =
+          torch::from_blob(image.data, {image.rows, image.cols, 3},
+                           at::dtype(at::kByte))
+              .pin_memory()
+              .to(torch::Device(torch::kCUDA), at::kByte,
+                  /*non_blocking*/ true)
+              .permute({2, 0, 1})
+              .index_select(0, bgr_to_rgb)
+              .to(at::kFloat);
+      tensor_images[i]
+          .narrow(1, window.y1, window.y2 - window.y1)
+          .narrow(2, window.x1, window.x2 - window.x1)
+          .copy_(image_data - mean[0]);
+    }
+  } else {
+    tensor_images =
+        torch::empty({batch_size, 3, height, width}, at::dtype(at::kFloat));
+    for (int64_t i = 0; i < batch_size; ++i) {
+      MoldImageToTensor(resized_images[static_cast<size_t>(i)],
+                        windows[static_cast<size_t>(i)], config.mean_pixel,
+                        tensor_images[i]);
+    }
+  }
 
   return {tensor_images, image_metas, windows};
 }
@@ -133,55 +293,52 @@ std::tuple<at::Tensor, std::vector<ImageMeta>, std::vector<Window>> MoldInputs(
  * bbox: [y1, x1, y2, x2]. The box to fit the mask in.
  * Returns a binary mask with the same size as the original image.
  */
-cv::Mat UnmoldMask(at::Tensor mask,
-                   at::Tensor bbox,
-                   const cv::Size& image_shape,
-                   double threshold) {
-  auto y1 = *bbox[0].data<int32_t>();
-  auto x1 = *bbox[1].data<int32_t>();
-  auto y2 = *bbox[2].data<int32_t>();
-  auto x2 = *bbox[3].data<int32_t>();
-
-  if ((mask > 0).nonzero().numel() == 0) {
-    std::cerr << "Empty mask detected!";
+cv::Mat UnpackMask(const PackedMask& mask, const cv::Size& image_shape) {
+  cv::Mat full_mask = cv::Mat::zeros(image_shape, CV_8UC1);
+  for (int32_t y = 0; y < mask.height; ++y) {
+    auto* row = full_mask.ptr<uint8_t>(mask.y1 + y) + mask.x1;
+    const auto* words = mask.words.data() + y * mask.words_per_row;
+    for (int32_t x = 0; x < mask.width; ++x) {
+      if ((words[x / 32] >> (x % 32)) & 1u)
+        row[x] = 255;
+    }
   }
-
-  cv::Mat cv_mask(static_cast<int>(mask.size(0)),
-                  static_cast<int>(mask.size(1)), CV_32FC1, mask.data<float>());
-  cv::resize(cv_mask, cv_mask, cv::Size(x2 - x1, y2 - y1));
-  cv::threshold(cv_mask, cv_mask, threshold, 1, cv::THRESH_BINARY);
-  cv_mask *= 255;
-
-  cv::Mat full_mask = cv::Mat::zeros(image_shape, CV_32FC1);
-  cv_mask.copyTo(full_mask(cv::Rect(x1, y1, x2 - x1, y2 - y1)));
-
-  full_mask.convertTo(full_mask, CV_8UC1);
   return full_mask;
 }
 
-std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<cv::Mat>>
-UnmoldDetections(at::Tensor detections,
-                 at::Tensor mrcnn_mask,
-                 const cv::Size& image_shape,
-                 const Window& window,
-                 double mask_threshold) {
+std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<PackedMask>>
+UnmoldDetectionsPacked(at::Tensor detections,
+                       at::Tensor mrcnn_mask,
+                       const cv::Size& image_shape,
+                       const Window& window,
+                       double mask_threshold) {
+  // Detections are small and processed on the host, masks stay on their
+  // device until they are packed
+  detections = detections.cpu();
+  auto mask_device = mrcnn_mask.device();
+
   // How many detections do we have?
   // Detections array is padded with zeros. Find the first class_id == 0.
   auto zero_ix = (detections.narrow(1, 4, 1) == 0).nonzero();
   if (zero_ix.size(0) > 0)
     zero_ix = zero_ix[0];
   auto N =
-      zero_ix.size(0) > 0 ? *zero_ix[0].data<uint8_t>() : detections.size(0);
+      zero_ix.size(0) > 0 ? *zero_ix[0].data<int64_t>() : detections.size(0);
 
   //  Extract boxes, class_ids, scores, and class-specific masks
   auto boxes = detections.narrow(0, 0, N).narrow(1, 0, 4);
   auto class_ids = detections.narrow(0, 0, N)
                        .narrow(1, 4, 1)
                        .to(at::dtype(at::kLong))
-                       .squeeze();
+                       .view({-1});
   auto scores = detections.narrow(0, 0, N).narrow(1, 5, 1);
-  auto masks = mrcnn_mask.permute({0, 3, 1, 2})
-                   .index({torch::arange(N, at::kLong), class_ids});
+  // Masks aren't computed for box only detections
+  const bool with_masks = mrcnn_mask.size(0) > 0;
+  at::Tensor masks;
+  if (with_masks)
+    masks = mrcnn_mask.permute({0, 3, 1, 2})
+                .index({torch::arange(N, at::kLong).to(mask_device),
+                        class_ids.to(mask_device)});
 
   // Compute scale and shift to translate coordinates to image domain.
   auto h_scale =
@@ -202,37 +359,56 @@ UnmoldDetections(at::Tensor detections,
   auto include_ix = (((boxes.narrow(1, 2, 1) - boxes.narrow(1, 0, 1)) *
                       (boxes.narrow(1, 3, 1) - boxes.narrow(1, 1, 1))) > 0)
                         .nonzero();
-  include_ix = include_ix.narrow(1, 0, 1).squeeze();
+  include_ix = include_ix.narrow(1, 0, 1).view({-1});
   if (include_ix.numel() > 0) {
     N = include_ix.numel();
     boxes = boxes.index_select(0, include_ix).reshape({N, -1});
     class_ids = class_ids.index_select(0, include_ix).reshape({N, -1});
     scores = scores.index_select(0, include_ix).reshape({N, -1});
-    masks = masks.index_select(0, include_ix);
+    if (with_masks)
+      masks = masks.index_select(0, include_ix.to(mask_device));
   } else {
     boxes = torch::empty({}, boxes.options());
     class_ids = torch::empty({}, class_ids.options());
     scores = torch::empty({}, scores.options());
-    masks = torch::empty({}, masks.options());
-    N = 0;
+    return {boxes, class_ids, scores, {}};
   }
-  // Resize masks to original image size and set boundary threshold.
+
+  if (!with_masks)
+    return {boxes, class_ids, scores, {}};
+
+  // Resize masks to their boxes and set boundary threshold
+  auto packed_masks =
+      PasteMasks(masks, boxes, image_shape.height, image_shape.width,
+                 static_cast<float>(mask_threshold));
+
+  return {boxes, class_ids, scores, packed_masks};
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<cv::Mat>>
+UnmoldDetections(at::Tensor detections,
+                 at::Tensor mrcnn_mask,
+                 const cv::Size& image_shape,
+                 const Window& window,
+                 double mask_threshold) {
+  auto [boxes, class_ids, scores, packed_masks] = UnmoldDetectionsPacked(
+      detections, mrcnn_mask, image_shape, window, mask_threshold);
+
+  // Convert packed masks to full size masks
   std::vector<cv::Mat> full_masks_vec;
-  for (int64_t i = 0; i < N; ++i) {
-    // Convert neural network mask to full size mask
-    auto full_mask =
-        UnmoldMask(masks[i], boxes[i], image_shape, mask_threshold);
-    full_masks_vec.push_back(full_mask);
-  }
+  for (const auto& mask : packed_masks)
+    full_masks_vec.push_back(UnpackMask(mask, image_shape));
 
   return {boxes, class_ids, scores, full_masks_vec};
 }
 
-std::vector<cv::Mat> ResizeMasks(const std::vector<cv::Mat>& masks,
+std::vector<cv::Mat> ResizeMasks(const std::vector<RleMask>& masks,
                                  float scale,
                                  const Padding& padding) {
   std::vector<cv::Mat> res_masks;
-  for (const auto& mask : masks) {
+  res_masks.reserve(masks.size());
+  for (const auto& rle : masks) {
+    cv::Mat mask = DecodeRle(rle);
     cv::Mat m;
     cv::resize(mask, m,
                cv::Size(static_cast<int>(std::round(mask.cols * scale)),
@@ -277,6 +453,66 @@ std::vector<cv::Mat> MinimizeMasks(const std::vector<float>& boxes,
   return mini_masks;
 }
 
+namespace {
+// Decodes the rect area of the RLE mask to CV_8UC1 of 0 and 255 values.
+// Runs before the first column of the rect are only counted.
+cv::Mat DecodeRleRect(const RleMask& mask, const cv::Rect& rect) {
+  cv::Mat crop = cv::Mat::zeros(rect.height, rect.width, CV_8UC1);
+  const int64_t rows = mask.height;
+  const int64_t end = static_cast<int64_t>(rect.x + rect.width) * rows;
+  int64_t pos = 0;
+  for (size_t i = 0; i < mask.counts.size() && pos < end; ++i) {
+    const int64_t run_end = pos + mask.counts[i];
+    // Odd runs are ones
+    if (i % 2 == 1) {
+      auto first_col = std::max<int64_t>(pos / rows, rect.x);
+      auto last_col = std::min<int64_t>((run_end - 1) / rows,
+                                        rect.x + rect.width - 1);
+      for (auto col = first_col; col <= last_col; ++col) {
+        auto y1 = std::max<int64_t>(pos - col * rows, rect.y);
+        auto y2 = std::min<int64_t>(run_end - col * rows, rect.y + rect.height);
+        auto x = static_cast<int>(col - rect.x);
+        for (auto y = y1; y < y2; ++y)
+          crop.at<uint8_t>(static_cast<int>(y - rect.y), x) = 255;
+      }
+    }
+    pos = run_end;
+  }
+  return crop;
+}
+}  // namespace
+
+std::vector<cv::Mat> MiniMasksFromRle(const std::vector<RleMask>& masks,
+                                      const std::vector<cv::Rect>& boxes,
+                                      int32_t width,
+                                      int32_t height) {
+  cv::Size mini_shape(width, height);
+  std::vector<cv::Mat> mini_masks(masks.size());
+  std::mutex log_mutex;
+  // Masks are taken by eights, small images aren't worth waking up the
+  // threads
+  utils::ParallelFor(
+      0, masks.size(),
+      [&](size_t i) {
+        const auto& rle = masks[i];
+        auto m_rect = cv::Rect(0, 0, rle.width, rle.height);
+        auto crop_rect = m_rect & boxes[i];
+        if (crop_rect.empty()) {
+          std::lock_guard<std::mutex> lock(log_mutex);
+          std::cerr << "Dataset: Invalid bounding box with area of zero "
+                    << boxes[i] << " \n";
+          crop_rect = m_rect;
+        }
+        cv::Mat m_crop;
+        DecodeRleRect(rle, crop_rect).convertTo(m_crop, CV_32FC1);
+        cv::resize(m_crop, m_crop, mini_shape, cv::INTER_LINEAR);
+        cv::threshold(m_crop, m_crop, 127, 1, cv::THRESH_BINARY);
+        mini_masks[i] = m_crop;
+      },
+      8);
+  return mini_masks;
+}
+
 void VisualizeBoxes(const std::string& name,
                     int width,
                     int height,
@@ -1,7 +1,9 @@
 #ifndef IMAGEUTILS_H
 #define IMAGEUTILS_H
 
+#include "cocorle.h"
 #include "config.h"
+#include "pastemasks.h"
 
 #include <torch/torch.h>
 #include <opencv2/opencv.hpp>
@@ -58,13 +60,46 @@ std::tuple<cv::Mat, Window, float, Padding> ResizeImage(
     int32_t max_dim,
     bool do_padding = false);
 
+// Scale of the height x width image in ResizeImage
+float ResizeScale(int32_t height,
+                  int32_t width,
+                  int32_t min_dim,
+                  int32_t max_dim);
+
+// Size of the height x width image after ResizeImage, without padding
+cv::Size ResizedImageSize(int32_t height,
+                          int32_t width,
+                          int32_t min_dim,
+                          int32_t max_dim);
+
+/*
+ * Padding of the resized height x width image for the model input. With
+ * config.image_padding the image is placed in the middle of the max_dim x
+ * max_dim square, otherwise the bottom and right sides are padded to
+ * multiples of config.image_size_multiple.
+ * Returns the window of the image and the padding.
+ */
+std::tuple<Window, Padding> InputPadding(int32_t height,
+                                         int32_t width,
+                                         const Config& config);
+
+/*
+ * Padding which places the image of height x width size in the middle of
+ * the max_dim x max_dim square, same as ResizeImage does.
+ * Returns the window of the image and the padding.
+ */
+std::tuple<Window, Padding> PaddingWindow(int32_t height,
+                                          int32_t width,
+                                          int32_t max_dim);
+
 /* Resizes a mask using the given scale and padding.
  * Typically, you get the scale and padding from resize_image() to
  * ensure both, the image and the mask, are resized consistently.
+ * Masks are decoded one by one, so only resized masks are kept dense.
  * scale: mask scaling factor
  * padding: Padding to add to the mask
  */
-std::vector<cv::Mat> ResizeMasks(const std::vector<cv::Mat>& masks,
+std::vector<cv::Mat> ResizeMasks(const std::vector<RleMask>& masks,
                                  float scale,
                                  const Padding& padding);
 
@@ -75,6 +110,17 @@ std::vector<cv::Mat> MinimizeMasks(const std::vector<float>& boxes,
                                    int32_t width,
                                    int32_t height);
 
+/* Same as ResizeMasks followed by MinimizeMasks, but each mini mask is made
+ * directly from the RLE: only the box area of the mask is decoded, in the
+ * original image resolution, and resized once to width x height. Returns
+ * CV_32FC1 masks of 0 and 1 values, masks are processed in parallel.
+ * boxes: boxes of the masks in the original image pixels
+ */
+std::vector<cv::Mat> MiniMasksFromRle(const std::vector<RleMask>& masks,
+                                      const std::vector<cv::Rect>& boxes,
+                                      int32_t width,
+                                      int32_t height);
+
 /*
  * Takes RGB images with 0-255 values and subtraces
  * the mean pixel and converts it to float. Expects image
@@ -82,6 +128,17 @@ std::vector<cv::Mat> MinimizeMasks(const std::vector<float>& boxes,
  */
 cv::Mat MoldImage(cv::Mat image, const Config& config);
 
+/*
+ * Same as ResizeImage to the size, padding and MoldImage for the [3, height,
+ * width] RGB uint8 image tensor on the GPU, returns [3, height, width] float
+ * tensor. Resizing is bilinear on the float values, so pixels differ from
+ * the CPU path by the rounding of the resized 8 bit image.
+ */
+at::Tensor MoldImageTensor(at::Tensor image,
+                           cv::Size size,
+                           const Padding& padding,
+                           const Config& config);
+
 /*
  * Takes a list of images and modifies them to the format expected
  * as an input to the neural network.
@@ -101,7 +158,8 @@ std::tuple<at::Tensor, std::vector<ImageMeta>, std::vector<Window>> MoldInputs(
  * network output to a format suitable for use in the rest of the
  * application.
  * detections: [N, (y1, x1, y2, x2, class_id, score)]
- * mrcnn_mask: [N, height, width, num_classes]
+ * mrcnn_mask: [N, height, width, num_classes], without rows only boxes are
+ *             unmolded and masks are empty
  * image_shape: [height, width, depth] Original size of the image before
  resizing
  * window: [y1, x1, y2, x2] Box in the image where the real image is
@@ -119,6 +177,21 @@ UnmoldDetections(at::Tensor detections,
                  const Window& window,
                  double mask_threshold);
 
+/*
+ * Same as UnmoldDetections, but masks are pasted on the device of mrcnn_mask
+ * and returned packed to bits, only box areas of the masks are copied to the
+ * host. boxes, class_ids and scores are on the host.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<PackedMask>>
+UnmoldDetectionsPacked(at::Tensor detections,
+                       at::Tensor mrcnn_mask,
+                       const cv::Size& image_shape,
+                       const Window& window,
+                       double mask_threshold);
+
+// Full size CV_8UC1 mask with 255 for the pixels of the instance
+cv::Mat UnpackMask(const PackedMask& mask, const cv::Size& image_shape);
+
 void VisualizeBoxes(const std::string& name,
                     int width,
                     int height,
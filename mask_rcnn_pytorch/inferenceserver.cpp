@@ -0,0 +1,403 @@
+#include "inferenceserver.h"
+#include "../trace.h"
+#include "imageutils.h"
+#include "nnutils.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+
+namespace {
+// Protects the server from allocating memory for garbage lengths
+const uint32_t kMaxRequestBytes = 64 * 1024 * 1024;
+
+// Profile files are rewritten after this number of batches
+const uint32_t kProfileBatches = 100;
+
+bool ReadAll(int fd, void* data, size_t size) {
+  auto* ptr = static_cast<uint8_t*>(data);
+  while (size > 0) {
+    auto n = recv(fd, ptr, size, 0);
+    if (n <= 0)
+      return false;
+    ptr += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const auto* ptr = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    auto n = send(fd, ptr, size, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    ptr += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+std::string ErrorJson(const char* message) {
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  writer.StartObject();
+  writer.Key("error");
+  writer.String(message);
+  writer.EndObject();
+  return buffer.GetString();
+}
+}  // namespace
+
+InferenceServer::InferenceServer(std::shared_ptr<DetectionBackend> backend,
+                                 std::shared_ptr<Config const> config,
+                                 uint16_t port,
+                                 std::chrono::milliseconds max_delay,
+                                 double mask_threshold,
+                                 const std::string& profile_dir)
+    : backend_(backend),
+      config_(config),
+      max_delay_(max_delay),
+      mask_threshold_(mask_threshold),
+      profile_dir_(profile_dir) {
+  if (config_->inference_latency_slo_ms > 0 &&
+      backend_->SetProposalCount(config_->post_nms_rois_inference))
+    budget_ = std::make_unique<ProposalBudget>(*config_);
+
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0)
+    throw std::runtime_error("Failed to create server socket");
+  int reuse = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) < 0 ||
+      listen(listen_fd_, SOMAXCONN) < 0) {
+    close(listen_fd_);
+    throw std::runtime_error("Failed to listen on port " +
+                             std::to_string(port));
+  }
+
+  batch_thread_ = std::thread(&InferenceServer::BatchLoop, this);
+}
+
+InferenceServer::~InferenceServer() {
+  Stop();
+  batch_thread_.join();
+  std::unique_lock<std::mutex> lock(connections_mutex_);
+  connections_cv_.wait(lock, [this] { return connection_fds_.empty(); });
+  close(listen_fd_);
+}
+
+void InferenceServer::Run() {
+  while (true) {
+    int socket_fd = accept(listen_fd_, nullptr, nullptr);
+    if (socket_fd < 0) {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      if (stop_)
+        break;
+      continue;
+    }
+    int no_delay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay,
+               sizeof(no_delay));
+    {
+      std::unique_lock<std::mutex> lock(connections_mutex_);
+      connection_fds_.push_back(socket_fd);
+    }
+    std::thread(&InferenceServer::ServeConnection, this, socket_fd).detach();
+  }
+}
+
+void InferenceServer::Stop() {
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    stop_ = true;
+  }
+  queue_cv_.notify_all();
+  // Wakes up the accept and recv calls
+  shutdown(listen_fd_, SHUT_RDWR);
+  std::unique_lock<std::mutex> lock(connections_mutex_);
+  for (auto fd : connection_fds_)
+    shutdown(fd, SHUT_RDWR);
+}
+
+void InferenceServer::ServeConnection(int socket_fd) {
+  std::vector<uint8_t> data;
+  while (true) {
+    uint32_t length = 0;
+    if (!ReadAll(socket_fd, &length, sizeof(length)))
+      break;
+    length = ntohl(length);
+    if (length == 0)
+      break;
+
+    std::string response;
+    if (length > kMaxRequestBytes) {
+      response = ErrorJson("Request is too large");
+    } else {
+      data.resize(length);
+      if (!ReadAll(socket_fd, data.data(), data.size()))
+        break;
+      response = Process(data);
+    }
+
+    uint32_t response_length = htonl(static_cast<uint32_t>(response.size()));
+    if (!WriteAll(socket_fd, &response_length, sizeof(response_length)) ||
+        !WriteAll(socket_fd, response.data(), response.size()) ||
+        length > kMaxRequestBytes)
+      break;
+  }
+
+  // Closed under the lock, so Stop doesn't shut down a reused descriptor
+  std::unique_lock<std::mutex> lock(connections_mutex_);
+  close(socket_fd);
+  connection_fds_.erase(
+      std::find(connection_fds_.begin(), connection_fds_.end(), socket_fd));
+  connections_cv_.notify_all();
+}
+
+std::string InferenceServer::Process(const std::vector<uint8_t>& data) {
+  auto request = std::make_unique<Request>();
+  request->image = cv::imdecode(data, cv::IMREAD_COLOR);
+  if (request->image.empty())
+    return ErrorJson("Failed to decode the image");
+  request->arrival = std::chrono::steady_clock::now();
+
+  auto result_future = request->result.get_future();
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    if (stop_)
+      return ErrorJson("Server is stopped");
+    queue_.push_back(std::move(request));
+  }
+  queue_cv_.notify_one();
+
+  std::vector<Detections> results;
+  try {
+    results = result_future.get();
+  } catch (const std::exception& err) {
+    return ErrorJson(err.what());
+  }
+
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  auto write_detections = [&writer](const Detections& result) {
+    writer.StartObject();
+    writer.Key("detections");
+    writer.StartArray();
+    // Box only detections have no masks
+    const auto count = is_empty(result.boxes) ? 0 : result.boxes.size(0);
+    for (int64_t n = 0; n < count; ++n) {
+      auto i = static_cast<size_t>(n);
+      auto box = result.boxes[n].contiguous();
+      const auto* box_data = box.data<int32_t>();
+      writer.StartObject();
+      writer.Key("box");
+      writer.StartArray();
+      for (int64_t j = 0; j < 4; ++j)
+        writer.Int(box_data[j]);
+      writer.EndArray();
+      writer.Key("class_id");
+      writer.Int64(result.class_ids[n].item<int64_t>());
+      writer.Key("score");
+      writer.Double(static_cast<double>(result.scores[n].item<float>()));
+      if (i >= result.masks.size()) {
+        writer.EndObject();
+        continue;
+      }
+
+      auto rle = PackedMaskToRle(result.masks[i], result.image_size.height,
+                                 result.image_size.width);
+      writer.Key("segmentation");
+      writer.StartObject();
+      writer.Key("size");
+      writer.StartArray();
+      writer.Int(rle.height);
+      writer.Int(rle.width);
+      writer.EndArray();
+      writer.Key("counts");
+      writer.StartArray();
+      for (auto count : rle.counts)
+        writer.Uint(count);
+      writer.EndArray();
+      writer.EndObject();
+      writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+  };
+
+  if (results.size() == 1) {
+    write_detections(results[0]);
+  } else {
+    writer.StartObject();
+    writer.Key("heads");
+    writer.StartArray();
+    for (const auto& result : results)
+      write_detections(result);
+    writer.EndArray();
+    writer.EndObject();
+  }
+  return buffer.GetString();
+}
+
+std::vector<std::unique_ptr<InferenceServer::Request>>
+InferenceServer::TakeBatch() {
+  std::vector<std::unique_ptr<Request>> batch;
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  queue_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+  if (stop_)
+    return batch;
+
+  // Wait for more requests while the oldest one is within the latency budget
+  auto batch_size = static_cast<size_t>(config_->images_per_gpu);
+  auto deadline = queue_.front()->arrival + max_delay_;
+  queue_cv_.wait_until(lock, deadline, [this, batch_size] {
+    return stop_ || queue_.size() >= batch_size;
+  });
+
+  auto num = std::min(batch_size, queue_.size());
+  for (size_t i = 0; i < num; ++i) {
+    batch.push_back(std::move(queue_.front()));
+    queue_.pop_front();
+  }
+  return batch;
+}
+
+void InferenceServer::BatchLoop() {
+  uint32_t batches_num = 0;
+  while (true) {
+    auto batch = TakeBatch();
+    if (batch.empty())
+      break;
+    ProcessBatch(batch);
+    if (++batches_num % kProfileBatches == 0)
+      WriteProfile();
+  }
+  WriteProfile();
+
+  // Fail requests which were not started
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  for (auto& request : queue_)
+    request->result.set_exception(std::make_exception_ptr(
+        std::runtime_error("Server is stopped")));
+  queue_.clear();
+}
+
+void InferenceServer::ProcessBatch(
+    std::vector<std::unique_ptr<Request>>& batch) {
+  // [request][class set]
+  std::vector<std::vector<Detections>> results(batch.size());
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    std::vector<cv::Mat> images;
+    for (auto& request : batch)
+      images.push_back(request->image);
+    // Partial batches are filled with copies of the last image, so the model
+    // always runs with the warmed up shapes
+    while (images.size() < config_->images_per_gpu)
+      images.push_back(images.back());
+
+    auto* profiler = backend_->Profiler();
+    std::optional<StageProfiler::Scope> scope;
+    scope.emplace(profiler, "mold_inputs", /*on_gpu*/ false);
+    auto [molded_images, image_metas, windows] = MoldInputs(images, *config_);
+    scope.reset();
+    if (budget_) {
+      backend_->SetProposalCount(budget_->Count());
+      MLCPP_TRACE_COUNTER("proposal_budget", budget_->Count());
+    }
+    std::vector<std::tuple<at::Tensor, at::Tensor>> outputs;
+    if (backend_->HeadsNum() > 1)
+      outputs = backend_->DetectHeads(molded_images, image_metas);
+    else
+      outputs.push_back(backend_->Detect(molded_images, image_metas));
+    scope.emplace(profiler, "unmold_detections");
+    for (const auto& [detections, mrcnn_mask] : outputs) {
+      for (size_t i = 0; i < batch.size(); ++i) {
+        results[i].emplace_back();
+        auto& result = results[i].back();
+        result.image_size = images[i].size();
+        if (is_empty(detections))
+          continue;
+        auto n = static_cast<int64_t>(i);
+        std::tie(result.boxes, result.class_ids, result.scores,
+                 result.masks) =
+            UnmoldDetectionsPacked(detections[n], mrcnn_mask[n],
+                                   result.image_size, windows[i],
+                                   mask_threshold_);
+      }
+    }
+  } catch (const std::exception& err) {
+    std::cerr << "Batch failed : " << err.what() << std::endl;
+    for (auto& request : batch)
+      request->result.set_exception(std::current_exception());
+    return;
+  }
+
+  for (size_t i = 0; i < batch.size(); ++i)
+    batch[i]->result.set_value(std::move(results[i]));
+
+  if (budget_) {
+    // The oldest request is the first one
+    const auto end = std::chrono::steady_clock::now();
+    size_t queued = 0;
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      queued = queue_.size();
+    }
+    using Ms = std::chrono::duration<double, std::milli>;
+    budget_->Update(Ms(end - batch.front()->arrival).count(),
+                    Ms(end - start).count(), queued,
+                    static_cast<size_t>(config_->images_per_gpu));
+  }
+}
+
+void InferenceServer::WriteProfile() {
+  if (budget_ && !profile_dir_.empty()) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("count");
+    writer.Int64(budget_->Count());
+    writer.Key("batches");
+    writer.StartObject();
+    for (size_t i = 0; i < budget_->Counts().size(); ++i) {
+      writer.Key(std::to_string(budget_->Counts()[i]).c_str());
+      writer.Uint64(budget_->Batches()[i]);
+    }
+    writer.EndObject();
+    writer.EndObject();
+    std::ofstream file(profile_dir_ + "/proposal_budget.json");
+    file << buffer.GetString() << std::endl;
+    if (!file)
+      std::cerr << "Failed to write the proposal budget" << std::endl;
+  }
+
+  auto* profiler = backend_->Profiler();
+  if (profile_dir_.empty() || !profiler)
+    return;
+  try {
+    profiler->WriteJson(profile_dir_ + "/inference_profile.json");
+    profiler->WriteChromeTrace(profile_dir_ + "/inference_trace.json");
+  } catch (const std::exception& err) {
+    std::cerr << "Failed to write the profile : " << err.what() << std::endl;
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef INFERENCESERVER_H
+#define INFERENCESERVER_H
+
+#include "config.h"
+#include "detectionbackend.h"
+#include "pastemasks.h"
+#include "proposalbudget.h"
+
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Serves detection requests with the model backend loaded once.
+ * Protocol over TCP: a request is the 4 byte big-endian length followed by
+ * the encoded image (any format cv::imdecode reads), the response is the 4
+ * byte big-endian length followed by the JSON document:
+ * {"detections": [{"box": [y1, x1, y2, x2], "class_id": id, "score": s,
+ *   "segmentation": {"size": [height, width], "counts": [...]}}]}
+ * with masks in the uncompressed COCO RLE, or {"error": "message"}.
+ * Backends with several class sets, see DetectionBackend::DetectHeads,
+ * respond with {"heads": [{"detections": [...]}, ...]}, one object per set.
+ * A connection can send any number of requests, the zero length closes it.
+ *
+ * Requests of all connections are collected into batches of up to
+ * images_per_gpu images. The batch is started when it is full or when the
+ * oldest request waited max_delay. Only the detection and mask pasting run
+ * on the batching thread, RLE and JSON encoding are done by the connection
+ * threads, so host work of one batch overlaps with the GPU work of the next.
+ *
+ * With profile_dir and the backend profiler (Config::profile_inference) stage
+ * latencies are written to profile_dir/inference_profile.json and the trace
+ * to profile_dir/inference_trace.json every kProfileBatches batches.
+ *
+ * With Config::inference_latency_slo_ms the proposal count of every batch is
+ * picked by ProposalBudget, if the backend supports it. The count is a trace
+ * counter, and with profile_dir the batches run with each count are written
+ * to profile_dir/proposal_budget.json.
+ */
+class InferenceServer {
+ public:
+  InferenceServer(std::shared_ptr<DetectionBackend> backend,
+                  std::shared_ptr<Config const> config,
+                  uint16_t port,
+                  std::chrono::milliseconds max_delay,
+                  double mask_threshold,
+                  const std::string& profile_dir = "");
+  InferenceServer(const InferenceServer&) = delete;
+  InferenceServer& operator=(const InferenceServer&) = delete;
+  ~InferenceServer();
+
+  // Accepts connections until Stop is called
+  void Run();
+
+  void Stop();
+
+ private:
+  struct Detections {
+    at::Tensor boxes;
+    at::Tensor class_ids;
+    at::Tensor scores;
+    std::vector<PackedMask> masks;
+    cv::Size image_size;
+  };
+
+  struct Request {
+    cv::Mat image;
+    std::chrono::steady_clock::time_point arrival;
+    // one per class set of the backend
+    std::promise<std::vector<Detections>> result;
+  };
+
+  void BatchLoop();
+  std::vector<std::unique_ptr<Request>> TakeBatch();
+  void ProcessBatch(std::vector<std::unique_ptr<Request>>& batch);
+  void WriteProfile();
+  void ServeConnection(int socket_fd);
+  std::string Process(const std::vector<uint8_t>& data);
+
+ private:
+  std::shared_ptr<DetectionBackend> backend_;
+  std::shared_ptr<Config const> config_;
+  std::chrono::milliseconds max_delay_;
+  double mask_threshold_{0.5};
+  std::string profile_dir_;
+  std::unique_ptr<ProposalBudget> budget_;
+  int listen_fd_{-1};
+
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::deque<std::unique_ptr<Request>> queue_;
+  bool stop_{false};
+  std::thread batch_thread_;
+
+  // Connection threads are detached, the destructor waits until all of them
+  // finished, guarded with connections_mutex_
+  std::mutex connections_mutex_;
+  std::condition_variable connections_cv_;
+  std::vector<int> connection_fds_;
+};
+
+#endif  // INFERENCESERVER_H
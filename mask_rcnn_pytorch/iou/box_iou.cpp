@@ -0,0 +1,196 @@
+#include "box_iou.h"
+#include <math.h>
+#include <omp.h>
+#include <torch/torch.h>
+
+#include <vector>
+
+namespace {
+// Rows of boxes1 processed together, the IoU values of a tile and its row
+// reductions stay in the L1 cache while all boxes2 are visited
+const int64_t kTileRows = 512;
+
+// boxes1 stored by columns to allow vector loads
+struct BoxColumns {
+  std::vector<float> y1;
+  std::vector<float> x1;
+  std::vector<float> y2;
+  std::vector<float> x2;
+  std::vector<float> areas;
+};
+
+BoxColumns ToColumns(const float* boxes, int64_t num) {
+  BoxColumns columns;
+  columns.y1.resize(static_cast<size_t>(num));
+  columns.x1.resize(static_cast<size_t>(num));
+  columns.y2.resize(static_cast<size_t>(num));
+  columns.x2.resize(static_cast<size_t>(num));
+  columns.areas.resize(static_cast<size_t>(num));
+  for (int64_t i = 0; i < num; ++i) {
+    const float* box = boxes + i * 4;
+    columns.y1[i] = box[0];
+    columns.x1[i] = box[1];
+    columns.y2[i] = box[2];
+    columns.x2[i] = box[3];
+    columns.areas[i] = (box[2] - box[0]) * (box[3] - box[1]);
+  }
+  return columns;
+}
+
+// IoU of `box` with boxes [offset, offset + rows) of boxes1, the sequence of
+// operations is the same as in BBoxOverlapsLoops
+__attribute__((target_clones("arch=haswell", "default"))) void IouTileColumn(
+    const BoxColumns& columns,
+    int64_t offset,
+    int64_t rows,
+    const float* box,
+    float box_area,
+    float* iou) {
+  const float* y1 = columns.y1.data() + offset;
+  const float* x1 = columns.x1.data() + offset;
+  const float* y2 = columns.y2.data() + offset;
+  const float* x2 = columns.x2.data() + offset;
+  const float* areas = columns.areas.data() + offset;
+#pragma omp simd
+  for (int64_t i = 0; i < rows; ++i) {
+    const float yy1 = fmaxf(box[0], y1[i]);
+    const float yy2 = fminf(box[2], y2[i]);
+    const float xx1 = fmaxf(box[1], x1[i]);
+    const float xx2 = fminf(box[3], x2[i]);
+    const float intersection = fmaxf(xx2 - xx1, 0.f) * fmaxf(yy2 - yy1, 0.f);
+    iou[i] = intersection / (box_area + areas[i] - intersection);
+  }
+}
+
+__attribute__((target_clones("arch=haswell", "default"))) void UpdateRowMax(
+    const float* iou,
+    int64_t rows,
+    int64_t col,
+    float* row_max,
+    int64_t* row_argmax) {
+#pragma omp simd
+  for (int64_t i = 0; i < rows; ++i) {
+    if (iou[i] > row_max[i]) {
+      row_max[i] = iou[i];
+      row_argmax[i] = col;
+    }
+  }
+}
+
+// Returns the maximum of the tile column and its first position, or zero
+// and position 0 if there are no positive values
+std::pair<float, int64_t> ColumnMax(const float* iou, int64_t rows) {
+  float best = 0;
+#pragma omp simd reduction(max : best)
+  for (int64_t i = 0; i < rows; ++i) {
+    best = fmaxf(best, iou[i]);
+  }
+  if (best > 0) {
+    for (int64_t i = 0; i < rows; ++i) {
+      if (iou[i] == best)
+        return {best, i};
+    }
+  }
+  return {0.f, 0};
+}
+}  // namespace
+
+void box_iou_forward(at::Tensor boxes1,
+                     at::Tensor boxes2,
+                     at::Tensor overlaps,
+                     at::Tensor row_max,
+                     at::Tensor row_argmax,
+                     at::Tensor col_max,
+                     at::Tensor col_argmax) {
+  assert(row_max.defined() == row_argmax.defined());
+  assert(col_max.defined() == col_argmax.defined());
+
+  const int64_t n = boxes1.size(0);
+  const int64_t m = boxes2.size(0);
+
+  boxes1 = boxes1.contiguous();
+  boxes2 = boxes2.contiguous();
+  const float* boxes2_data = boxes2.data<float>();
+  const BoxColumns columns = ToColumns(boxes1.data<float>(), n);
+
+  std::vector<float> areas2(static_cast<size_t>(m));
+  for (int64_t j = 0; j < m; ++j) {
+    const float* box = boxes2_data + j * 4;
+    areas2[j] = (box[2] - box[0]) * (box[3] - box[1]);
+  }
+
+  // init output space
+  float* overlaps_data = nullptr;
+  if (overlaps.defined()) {
+    overlaps.resize_({n, m});
+    overlaps_data = overlaps.data<float>();
+  }
+  float* row_max_data = nullptr;
+  int64_t* row_argmax_data = nullptr;
+  if (row_max.defined()) {
+    row_max.resize_({n});
+    row_max.zero_();
+    row_argmax.resize_({n});
+    row_argmax.zero_();
+    row_max_data = row_max.data<float>();
+    row_argmax_data = row_argmax.data<int64_t>();
+  }
+  float* col_max_data = nullptr;
+  int64_t* col_argmax_data = nullptr;
+  if (col_max.defined()) {
+    col_max.resize_({m});
+    col_max.zero_();
+    col_argmax.resize_({m});
+    col_argmax.zero_();
+    col_max_data = col_max.data<float>();
+    col_argmax_data = col_argmax.data<int64_t>();
+  }
+
+  const int64_t tiles = (n + kTileRows - 1) / kTileRows;
+#pragma omp parallel
+  {
+    std::vector<float> iou(static_cast<size_t>(kTileRows));
+    // Column reductions over the tiles of this thread
+    std::vector<float> thread_col_max(col_max_data ? m : 0, 0.f);
+    std::vector<int64_t> thread_col_argmax(col_max_data ? m : 0, 0);
+
+    // Static schedule visits tiles of a thread in increasing order, so the
+    // first maximum wins
+#pragma omp for schedule(static)
+    for (int64_t t = 0; t < tiles; ++t) {
+      const int64_t offset = t * kTileRows;
+      const int64_t rows = std::min(kTileRows, n - offset);
+      for (int64_t j = 0; j < m; ++j) {
+        IouTileColumn(columns, offset, rows, boxes2_data + j * 4, areas2[j],
+                      iou.data());
+        if (overlaps_data) {
+          for (int64_t i = 0; i < rows; ++i)
+            overlaps_data[(offset + i) * m + j] = iou[i];
+        }
+        if (row_max_data) {
+          UpdateRowMax(iou.data(), rows, j, row_max_data + offset,
+                       row_argmax_data + offset);
+        }
+        if (col_max_data) {
+          auto best = ColumnMax(iou.data(), rows);
+          if (best.first > thread_col_max[j]) {
+            thread_col_max[j] = best.first;
+            thread_col_argmax[j] = offset + best.second;
+          }
+        }
+      }
+    }
+
+    if (col_max_data) {
+#pragma omp critical
+      for (int64_t j = 0; j < m; ++j) {
+        if (thread_col_max[j] > col_max_data[j] ||
+            (thread_col_max[j] == col_max_data[j] &&
+             thread_col_argmax[j] < col_argmax_data[j])) {
+          col_max_data[j] = thread_col_max[j];
+          col_argmax_data[j] = thread_col_argmax[j];
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,17 @@
+#include <torch/torch.h>
+
+// Computes IoU of all pairs of boxes1 [N, (y1, x1, y2, x2)] and
+// boxes2 [M, (y1, x1, y2, x2)] in a single tiled pass. Every output is
+// optional, pass an undefined tensor to skip it, so the [N, M] matrix is
+// never allocated when only the best matches are required. Argmax picks the
+// first index among equal maximums, all IoU values which are not greater
+// than zero (including NaN for empty boxes) are treated as zero by the
+// reductions.
+void box_iou_forward(at::Tensor boxes1,
+                     at::Tensor boxes2,
+                     at::Tensor overlaps,    // [N, M]
+                     at::Tensor row_max,     // [N] float
+                     at::Tensor row_argmax,  // [N] long, index in boxes2
+                     at::Tensor col_max,     // [M] float
+                     at::Tensor col_argmax   // [M] long, index in boxes1
+);
@@ -0,0 +1,58 @@
+#include "box_iou_gpu.h"
+#include <torch/torch.h>
+#include "cuda/box_iou_kernel.h"
+
+void box_iou_gpu_forward(at::Tensor boxes1,
+                         at::Tensor boxes2,
+                         at::Tensor overlaps,
+                         at::Tensor row_max,
+                         at::Tensor row_argmax,
+                         at::Tensor col_max,
+                         at::Tensor col_argmax) {
+  assert(boxes1.is_cuda());
+  assert(boxes2.is_cuda());
+  assert(row_max.defined() == row_argmax.defined());
+  assert(col_max.defined() == col_argmax.defined());
+
+  const int num_boxes1 = boxes1.size(0);
+  const int num_boxes2 = boxes2.size(0);
+
+  boxes1 = boxes1.contiguous();
+  boxes2 = boxes2.contiguous();
+
+  // init output space
+  float* overlaps_ptr = nullptr;
+  if (overlaps.defined()) {
+    overlaps.resize_({num_boxes1, num_boxes2});
+    overlaps_ptr = overlaps.data<float>();
+  }
+  float* row_max_ptr = nullptr;
+  int64_t* row_argmax_ptr = nullptr;
+  if (row_max.defined()) {
+    row_max.resize_({num_boxes1});
+    row_max.zero_();
+    row_argmax.resize_({num_boxes1});
+    row_argmax.zero_();
+    row_max_ptr = row_max.data<float>();
+    row_argmax_ptr = row_argmax.data<int64_t>();
+  }
+  at::Tensor col_packed;
+  unsigned long long* col_packed_ptr = nullptr;
+  float* col_max_ptr = nullptr;
+  int64_t* col_argmax_ptr = nullptr;
+  if (col_max.defined()) {
+    col_packed = at::zeros({num_boxes2}, at::CUDA(at::kLong));
+    col_packed_ptr =
+        reinterpret_cast<unsigned long long*>(col_packed.data<int64_t>());
+    col_max.resize_({num_boxes2});
+    col_max.zero_();
+    col_argmax.resize_({num_boxes2});
+    col_argmax.zero_();
+    col_max_ptr = col_max.data<float>();
+    col_argmax_ptr = col_argmax.data<int64_t>();
+  }
+
+  BoxIouLaucher(boxes1.data<float>(), boxes2.data<float>(), num_boxes1,
+                num_boxes2, overlaps_ptr, row_max_ptr, row_argmax_ptr,
+                col_packed_ptr, col_max_ptr, col_argmax_ptr);
+}
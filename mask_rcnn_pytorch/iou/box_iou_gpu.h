@@ -0,0 +1,11 @@
+#include <torch/torch.h>
+
+// CUDA version of box_iou_forward, doesn't synchronize with the host
+void box_iou_gpu_forward(at::Tensor boxes1,
+                         at::Tensor boxes2,
+                         at::Tensor overlaps,    // [N, M]
+                         at::Tensor row_max,     // [N] float
+                         at::Tensor row_argmax,  // [N] long, index in boxes2
+                         at::Tensor col_max,     // [M] float
+                         at::Tensor col_argmax   // [M] long, index in boxes1
+);
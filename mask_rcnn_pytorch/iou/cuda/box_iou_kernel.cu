@@ -0,0 +1,149 @@
+#include <math.h>
+#include <stdio.h>
+#include "box_iou_kernel.h"
+
+// Number of boxes2 loaded to the shared memory at once, equals to the block
+// size, so each thread loads one box
+#define BOX_IOU_TILE 256
+
+// IoU values are not negative, so the bits of the float value keep the order
+// and the inverted row index makes the first row win ties in atomicMax
+__device__ inline unsigned long long PackColumnMax(float iou, int row) {
+  const float value = iou > 0 ? iou : 0;
+  return (static_cast<unsigned long long>(__float_as_uint(value)) << 32) |
+         (0xFFFFFFFFull - static_cast<unsigned int>(row));
+}
+
+__global__ void BoxIouKernel(const float* boxes1_ptr,
+                             const float* boxes2_ptr,
+                             int num_boxes1,
+                             int num_boxes2,
+                             float* overlaps_ptr,
+                             float* row_max_ptr,
+                             int64_t* row_argmax_ptr,
+                             unsigned long long* col_packed_ptr) {
+  __shared__ float tile[BOX_IOU_TILE * 5];
+
+  const int i = blockIdx.x * blockDim.x + threadIdx.x;
+  const bool valid_row = i < num_boxes1;
+
+  float y1 = 0, x1 = 0, y2 = 0, x2 = 0, area = 0;
+  if (valid_row) {
+    y1 = boxes1_ptr[i * 4 + 0];
+    x1 = boxes1_ptr[i * 4 + 1];
+    y2 = boxes1_ptr[i * 4 + 2];
+    x2 = boxes1_ptr[i * 4 + 3];
+    area = (y2 - y1) * (x2 - x1);
+  }
+
+  float best = 0;
+  int64_t best_idx = 0;
+  for (int start = 0; start < num_boxes2; start += BOX_IOU_TILE) {
+    const int tile_size = min(BOX_IOU_TILE, num_boxes2 - start);
+    __syncthreads();
+    if (threadIdx.x < tile_size) {
+      const float* box = boxes2_ptr + (start + threadIdx.x) * 4;
+      tile[threadIdx.x * 5 + 0] = box[0];
+      tile[threadIdx.x * 5 + 1] = box[1];
+      tile[threadIdx.x * 5 + 2] = box[2];
+      tile[threadIdx.x * 5 + 3] = box[3];
+      tile[threadIdx.x * 5 + 4] = (box[2] - box[0]) * (box[3] - box[1]);
+    }
+    __syncthreads();
+
+    for (int k = 0; k < tile_size; ++k) {
+      const float* box = tile + k * 5;
+      const int j = start + k;
+      const float yy1 = fmaxf(box[0], y1);
+      const float yy2 = fminf(box[2], y2);
+      const float xx1 = fmaxf(box[1], x1);
+      const float xx2 = fminf(box[3], x2);
+      const float intersection =
+          fmaxf(xx2 - xx1, 0.f) * fmaxf(yy2 - yy1, 0.f);
+      const float iou = intersection / (box[4] + area - intersection);
+
+      if (valid_row) {
+        if (overlaps_ptr)
+          overlaps_ptr[static_cast<int64_t>(i) * num_boxes2 + j] = iou;
+        if (iou > best) {
+          best = iou;
+          best_idx = j;
+        }
+      }
+
+      if (col_packed_ptr) {
+        // Warp reduction first, then one atomic per warp
+        unsigned long long packed = valid_row ? PackColumnMax(iou, i) : 0;
+        for (int offset = warpSize / 2; offset > 0; offset /= 2) {
+          const unsigned long long other =
+              __shfl_down_sync(0xFFFFFFFF, packed, offset);
+          packed = other > packed ? other : packed;
+        }
+        if ((threadIdx.x & (warpSize - 1)) == 0 && packed != 0)
+          atomicMax(col_packed_ptr + j, packed);
+      }
+    }
+  }
+
+  if (valid_row && row_max_ptr) {
+    row_max_ptr[i] = best;
+    row_argmax_ptr[i] = best_idx;
+  }
+}
+
+__global__ void BoxIouUnpackKernel(const unsigned long long* col_packed_ptr,
+                                   int num_boxes2,
+                                   float* col_max_ptr,
+                                   int64_t* col_argmax_ptr) {
+  const int j = blockIdx.x * blockDim.x + threadIdx.x;
+  if (j < num_boxes2) {
+    const unsigned long long packed = col_packed_ptr[j];
+    col_max_ptr[j] = __uint_as_float(static_cast<unsigned int>(packed >> 32));
+    col_argmax_ptr[j] =
+        packed != 0 ? 0xFFFFFFFFll - static_cast<int64_t>(packed & 0xFFFFFFFF)
+                    : 0;
+  }
+}
+
+void BoxIouLaucher(const float* boxes1_ptr,
+                   const float* boxes2_ptr,
+                   int num_boxes1,
+                   int num_boxes2,
+                   float* overlaps_ptr,
+                   float* row_max_ptr,
+                   int64_t* row_argmax_ptr,
+                   unsigned long long* col_packed_ptr,
+                   float* col_max_ptr,
+                   int64_t* col_argmax_ptr) {
+  const int thread_per_block = BOX_IOU_TILE;
+  cudaError_t err;
+
+  if (num_boxes1 > 0) {
+    const int block_count =
+        (num_boxes1 + thread_per_block - 1) / thread_per_block;
+    BoxIouKernel<<<block_count, thread_per_block, 0>>>(
+        boxes1_ptr, boxes2_ptr, num_boxes1, num_boxes2, overlaps_ptr,
+        row_max_ptr, row_argmax_ptr, col_packed_ptr);
+
+    err = cudaGetLastError();
+    if (cudaSuccess != err) {
+      fprintf(stderr, "cudaCheckError() failed : %s\n",
+              cudaGetErrorString(err));
+      exit(-1);
+    }
+  }
+
+  if (col_packed_ptr && num_boxes2 > 0) {
+    const int block_count =
+        (num_boxes2 + thread_per_block - 1) / thread_per_block;
+    BoxIouUnpackKernel<<<block_count, thread_per_block, 0>>>(
+        col_packed_ptr, num_boxes2, col_max_ptr, col_argmax_ptr);
+
+    err = cudaGetLastError();
+    if (cudaSuccess != err) {
+      fprintf(stderr, "cudaCheckError() failed : %s\n",
+              cudaGetErrorString(err));
+      exit(-1);
+    }
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef _BoxIou_Kernel
+#define _BoxIou_Kernel
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// All output pointers except boxes are optional and can be NULL.
+// col_packed has to be zero initialized, it holds [M] (value, index) pairs
+// reduced with atomicMax, col_max and col_argmax are unpacked from it.
+void BoxIouLaucher(const float* boxes1_ptr,
+                   const float* boxes2_ptr,
+                   int num_boxes1,
+                   int num_boxes2,
+                   float* overlaps_ptr,
+                   float* row_max_ptr,
+                   int64_t* row_argmax_ptr,
+                   unsigned long long* col_packed_ptr,
+                   float* col_max_ptr,
+                   int64_t* col_argmax_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#include "jpegdecoder.h"
+#include "../trace.h"
+
+#include <ATen/DeviceGuard.h>
+#include <ATen/cuda/CUDAContext.h>
+
+#ifdef WITH_NVJPEG
+#include <nvjpeg.h>
+#endif
+
+#include <stdexcept>
+#include <string>
+
+#ifdef WITH_NVJPEG
+namespace {
+void CheckNvjpeg(nvjpegStatus_t status) {
+  if (status != NVJPEG_STATUS_SUCCESS)
+    throw std::runtime_error("nvJPEG error : " +
+                             std::to_string(static_cast<int>(status)));
+}
+}  // namespace
+
+bool JpegDecoder::IsAvailable() {
+  return true;
+}
+
+JpegDecoder::JpegDecoder(int16_t device_index) : device_index_(device_index) {
+  at::DeviceGuard device_guard(at::Device(at::kCUDA, device_index_));
+  nvjpegHandle_t handle{nullptr};
+  CheckNvjpeg(nvjpegCreate(NVJPEG_BACKEND_DEFAULT, nullptr, &handle));
+  nvjpegJpegState_t state{nullptr};
+  auto status = nvjpegJpegStateCreate(handle, &state);
+  if (status != NVJPEG_STATUS_SUCCESS)
+    nvjpegDestroy(handle);
+  CheckNvjpeg(status);
+  handle_ = handle;
+  state_ = state;
+}
+
+JpegDecoder::~JpegDecoder() {
+  at::DeviceGuard device_guard(at::Device(at::kCUDA, device_index_));
+  nvjpegJpegStateDestroy(static_cast<nvjpegJpegState_t>(state_));
+  nvjpegDestroy(static_cast<nvjpegHandle_t>(handle_));
+}
+
+bool JpegDecoder::GetImageSize(const std::vector<uint8_t>& data,
+                               cv::Size& size) {
+  int components = 0;
+  nvjpegChromaSubsampling_t subsampling;
+  int widths[NVJPEG_MAX_COMPONENT];
+  int heights[NVJPEG_MAX_COMPONENT];
+  auto status = nvjpegGetImageInfo(static_cast<nvjpegHandle_t>(handle_),
+                                   data.data(), data.size(), &components,
+                                   &subsampling, widths, heights);
+  if (status != NVJPEG_STATUS_SUCCESS || components < 1 ||
+      subsampling == NVJPEG_CSS_UNKNOWN)
+    return false;
+  size = cv::Size(widths[0], heights[0]);
+  return true;
+}
+
+at::Tensor JpegDecoder::Decode(const std::vector<uint8_t>& data) {
+  cv::Size size;
+  if (!GetImageSize(data, size))
+    throw std::invalid_argument("Unsupported JPEG image");
+  at::Device device(at::kCUDA, device_index_);
+  at::DeviceGuard device_guard(device);
+  auto stream = at::cuda::getCurrentCUDAStream(device_index_).stream();
+  MLCPP_TRACE_GPU_ZONE("decode", true, stream);
+  auto image = torch::empty({3, size.height, size.width},
+                            at::dtype(at::kByte).device(device));
+  // Planes of the tensor are the RGB channels of the output
+  nvjpegImage_t output;
+  for (int64_t c = 0; c < NVJPEG_MAX_COMPONENT; ++c) {
+    output.channel[c] = c < 3 ? image[c].data<uint8_t>() : nullptr;
+    output.pitch[c] = c < 3 ? static_cast<unsigned int>(size.width) : 0;
+  }
+  CheckNvjpeg(nvjpegDecode(static_cast<nvjpegHandle_t>(handle_),
+                           static_cast<nvjpegJpegState_t>(state_),
+                           data.data(), data.size(), NVJPEG_OUTPUT_RGB,
+                           &output, stream));
+  return image;
+}
+#else
+bool JpegDecoder::IsAvailable() {
+  return false;
+}
+
+JpegDecoder::JpegDecoder(int16_t device_index) : device_index_(device_index) {
+  throw std::runtime_error("Built without nvJPEG, can't decode on the GPU");
+}
+
+JpegDecoder::~JpegDecoder() {}
+
+bool JpegDecoder::GetImageSize(const std::vector<uint8_t>& /*data*/,
+                               cv::Size& /*size*/) {
+  return false;
+}
+
+at::Tensor JpegDecoder::Decode(const std::vector<uint8_t>& /*data*/) {
+  throw std::runtime_error("Built without nvJPEG, can't decode on the GPU");
+}
+#endif
@@ -0,0 +1,40 @@
+#ifndef JPEGDECODER_H
+#define JPEGDECODER_H
+
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include <cstdint>
+#include <vector>
+
+/* Decodes JPEG files with nvJPEG straight to the GPU memory, so CPU workers
+ * only read files and process annotations. Work is queued on the current
+ * CUDA stream of the device, same as the sample copies of SamplePrefetcher.
+ * A decoder keeps the decoding state, it is used by one thread at a time.
+ * Available if the library is built with nvJPEG (WITH_NVJPEG), otherwise
+ * the constructor throws.
+ */
+class JpegDecoder {
+ public:
+  static bool IsAvailable();
+
+  explicit JpegDecoder(int16_t device_index);
+  JpegDecoder(const JpegDecoder&) = delete;
+  JpegDecoder& operator=(const JpegDecoder&) = delete;
+  ~JpegDecoder();
+
+  // Width and height from the file header, false if the data isn't a JPEG
+  // which the decoder supports
+  bool GetImageSize(const std::vector<uint8_t>& data, cv::Size& size);
+
+  // Returns [3, height, width] RGB uint8 tensor on the device
+  at::Tensor Decode(const std::vector<uint8_t>& data);
+
+ private:
+  int16_t device_index_{0};
+  // nvjpegHandle_t and nvjpegJpegState_t
+  void* handle_{nullptr};
+  void* state_{nullptr};
+};
+
+#endif  // JPEGDECODER_H
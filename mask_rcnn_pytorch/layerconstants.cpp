@@ -0,0 +1,32 @@
+#include "layerconstants.h"
+#include "anchors.h"
+
+#include <ATen/cuda/CUDAContext.h>
+
+LayerConstants BuildLayerConstants(const Config& config,
+                                   int32_t image_height,
+                                   int32_t image_width) {
+  LayerConstants constants;
+  constants.image_height = image_height;
+  constants.image_width = image_width;
+  at::Device device(at::kCPU);
+  if (config.gpu_count > 0) {
+    auto index = static_cast<at::DeviceIndex>(at::cuda::current_device());
+    device = at::Device(at::kCUDA, index);
+  }
+  constants.anchors =
+      CachedPyramidAnchors(config, image_height, image_width, device);
+  constants.level_anchor_counts =
+      PyramidAnchorCounts(config, image_height, image_width);
+
+  auto height = static_cast<float>(image_height);
+  auto width = static_cast<float>(image_width);
+  constants.image_scale =
+      torch::tensor({height, width, height, width},
+                    at::dtype(at::kFloat).requires_grad(false));
+
+  if (config.gpu_count > 0) {
+    constants.image_scale = constants.image_scale.cuda();
+  }
+  return constants;
+}
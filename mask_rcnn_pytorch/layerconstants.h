@@ -0,0 +1,34 @@
+#ifndef LAYERCONSTANTS_H
+#define LAYERCONSTANTS_H
+
+#include "config.h"
+
+#include <torch/torch.h>
+
+#include <vector>
+
+/* Constant tensors of the proposal and detection layers. They only depend
+ * on the config and the input shape, so the model builds them once for each
+ * input shape on its device instead of creating them on the host and
+ * copying to the GPU on every call.
+ */
+struct LayerConstants {
+  // Input image size in pixels, including padding
+  int32_t image_height{0};
+  int32_t image_width{0};
+  // [anchors, (y1, x1, y2, x2)] in pixels
+  at::Tensor anchors;
+  // Number of anchors of each FPN level, rows of anchors are ordered by level
+  std::vector<int64_t> level_anchor_counts;
+  // [4] (height, width, height, width) of the image, boxes are divided by it
+  // to get normalized coordinates
+  at::Tensor image_scale;
+};
+
+// Tensors are placed on the current GPU if config.gpu_count > 0, anchors are
+// shared with other users of CachedPyramidAnchors
+LayerConstants BuildLayerConstants(const Config& config,
+                                   int32_t image_height,
+                                   int32_t image_width);
+
+#endif  // LAYERCONSTANTS_H
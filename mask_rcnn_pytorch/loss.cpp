@@ -11,20 +11,16 @@ at::Tensor ComputeRpnClassLoss(at::Tensor rpn_match,
   auto anchor_class = (rpn_match == 1).to(at::dtype(at::kLong));
 
   // Positive and Negative anchors contribute to the loss,
-  // but neutral anchors (match value = 0) don't.
-  auto indices = torch::nonzero(rpn_match != 0);
-
-  // Pick rows that contribute to the loss and filter out the rest.
-  auto y_ind = indices.narrow(1, 0, 1).squeeze();
-  auto x_ind = indices.narrow(1, 1, 1).squeeze();
-
-  rpn_class_logits = rpn_class_logits.index({y_ind, x_ind});
-
-  anchor_class = anchor_class.index({y_ind, x_ind});
-
-  // Crossentropy loss
-  auto loss = torch::nll_loss(rpn_class_logits.log_softmax(1), anchor_class);
-  return loss;
+  // but neutral anchors (match value = 0) don't. They are masked out instead
+  // of picking the contributing rows.
+  auto valid = (rpn_match != 0).to(at::kFloat);
+
+  // Crossentropy loss, averaged over the valid anchors
+  auto loss = torch::nll_loss(rpn_class_logits.log_softmax(2).view({-1, 2}),
+                              anchor_class.view({-1}), /*weight*/ {},
+                              at::Reduction::None);
+  loss = (loss * valid.view({-1})).sum();
+  return loss / valid.sum().clamp_min(1);
 }
 
 at::Tensor ComputeRpnBBoxLoss(at::Tensor target_bbox,
@@ -34,96 +30,97 @@ at::Tensor ComputeRpnBBoxLoss(at::Tensor target_bbox,
   rpn_match = rpn_match.squeeze(2);
 
   // Positive anchors contribute to the loss, but negative and
-  // neutral anchors (match value of 0 or -1) don't.
-  auto indices = torch::nonzero(rpn_match == 1);
-
-  // Pick bbox deltas that contribute to the loss
-  auto y_ind = indices.narrow(1, 0, 1).squeeze();
-  auto x_ind = indices.narrow(1, 1, 1).squeeze();
-
-  rpn_bbox = rpn_bbox.index({y_ind, x_ind});
-
-  // Trim target bounding box deltas to the same length as rpn_bbox.
-  target_bbox = target_bbox[0].narrow(0, 0, rpn_bbox.size(0));
-
-  // Smooth L1 loss
-  auto box_target = torch::broadcast_tensors({rpn_bbox, target_bbox});
-  auto loss = torch::smooth_l1_loss(box_target[0], box_target[1]);
-
-  return loss;
+  // neutral anchors (match value of 0 or -1) don't. Targets of each image
+  // are in the order of its positive anchors, so the target row of an anchor
+  // is the number of positive anchors before it.
+  auto positive = (rpn_match == 1).to(at::kFloat);
+  auto rows = target_bbox.size(1);
+  auto rank = positive.cumsum(1) - 1;
+  positive = positive * (rank < rows).to(at::kFloat);
+  auto index = rank.clamp(0, rows - 1).to(at::dtype(at::kLong));
+  target_bbox = target_bbox.gather(
+      1, index.unsqueeze(2).expand({index.size(0), index.size(1), 4}));
+
+  // Smooth L1 loss, averaged over coordinates of positive anchors
+  auto loss =
+      torch::smooth_l1_loss(rpn_bbox, target_bbox, at::Reduction::None);
+  loss = (loss * positive.unsqueeze(2)).sum();
+  return loss / (positive.sum() * 4).clamp_min(1);
 }
 
 at::Tensor ComputeMrcnnClassLoss(at::Tensor target_class_ids,
                                  at::Tensor pred_class_logits) {
-  at::Tensor loss;
-  if (!is_empty(target_class_ids)) {
-    loss = torch::nll_loss(pred_class_logits.log_softmax(1),
-                           target_class_ids.to(at::dtype(at::kLong)));
-  } else {
-    loss = torch::tensor(0.f, at::dtype(at::kFloat).requires_grad(false));
-    if (target_class_ids.is_cuda())
-      loss = loss.cuda();
-  }
-
-  return loss;
+  // Padding rows have -1 class id, they are ignored and not counted
+  auto valid_count = (target_class_ids >= 0).to(at::kFloat).sum();
+  auto loss = torch::nll_loss(pred_class_logits.log_softmax(1),
+                              target_class_ids.to(at::dtype(at::kLong)),
+                              /*weight*/ {}, at::Reduction::None,
+                              /*ignore_index*/ -1);
+  return loss.sum() / valid_count.clamp_min(1);
 }
 
 at::Tensor ComputeMrcnnBBoxLoss(at::Tensor target_bbox,
                                 at::Tensor target_class_ids,
                                 at::Tensor pred_bbox) {
-  at::Tensor loss;
-  if (!is_empty(target_class_ids)) {
-    // Only positive ROIs contribute to the loss. And only
-    // the right class_id of each ROI. Get their indicies.
-    auto positive_ix = torch::nonzero(target_class_ids > 0).narrow(1, 0, 1);
-    auto positive_class_ids =
-        target_class_ids.take(positive_ix).to(at::dtype(at::kLong));
-    auto indices = torch::stack({positive_ix, positive_class_ids}, /*dim*/ 1);
-
-    // Gather the masks (predicted and true) that contribute to loss
-    auto y_ind = indices.narrow(1, 0, 1).squeeze();
-    auto x_ind = indices.narrow(1, 1, 1).squeeze();
-
-    // Gather the deltas (predicted and true) that contribute to loss
-    target_bbox = target_bbox.index(y_ind);
-    pred_bbox = pred_bbox.index({y_ind, x_ind});
-
-    // Smooth L1 loss
-    auto box_target = torch::broadcast_tensors({pred_bbox, target_bbox});
-    loss = torch::smooth_l1_loss(box_target[0], box_target[1]);
-  } else {
-    loss = torch::tensor(0.f, at::dtype(at::kFloat).requires_grad(false));
-    if (target_class_ids.is_cuda())
-      loss = loss.cuda();
-  }
-  return loss;
+  // Only positive ROIs contribute to the loss. And only
+  // the right class_id of each ROI. Other rows are masked out instead of
+  // gathering positive indices, which would synchronize with the GPU.
+  auto positive = (target_class_ids > 0).to(at::kFloat);
+  auto class_ids = target_class_ids.clamp_min(0).to(at::dtype(at::kLong));
+  pred_bbox =
+      pred_bbox.gather(1, class_ids.view({-1, 1, 1}).expand({-1, 1, 4}))
+          .squeeze(1);
+
+  // Smooth L1 loss, averaged over coordinates of positive ROIs
+  auto loss = torch::smooth_l1_loss(pred_bbox, target_bbox,
+                                    at::Reduction::None);
+  loss = (loss * positive.unsqueeze(1)).sum();
+  return loss / (positive.sum() * 4).clamp_min(1);
 }
 
 at::Tensor ComputeMrcnnMaskLoss(at::Tensor target_masks,
                                 at::Tensor target_class_ids,
                                 at::Tensor pred_masks) {
-  at::Tensor loss;
-  if (!is_empty(target_class_ids)) {
-    // Only positive ROIs contribute to the loss. And only
-    // the class specific mask of each ROI.
-    auto positive_ix = torch::nonzero(target_class_ids > 0).narrow(1, 0, 1);
-    auto positive_class_ids =
-        target_class_ids.take(positive_ix).to(at::dtype(at::kLong));
-    auto indices = torch::stack({positive_ix, positive_class_ids}, /*dim*/ 1);
-
-    // Gather the masks (predicted and true) that contribute to loss
-    auto y_ind = indices.narrow(1, 0, 1).squeeze();
-    auto x_ind = indices.narrow(1, 1, 1).squeeze();
-
-    auto y_true = target_masks.index(y_ind);
-    auto y_pred = pred_masks.index({y_ind, x_ind});
+  // Only positive ROIs contribute to the loss. And only
+  // the class specific mask of each ROI.
+  auto positive = (target_class_ids > 0).to(at::kFloat);
+  auto class_ids = target_class_ids.clamp_min(0).to(at::dtype(at::kLong));
+  auto height = pred_masks.size(2);
+  auto width = pred_masks.size(3);
+  auto index = class_ids.view({-1, 1, 1, 1}).expand({-1, 1, height, width});
+  auto y_pred = pred_masks.gather(1, index).squeeze(1);
+
+  // Binary cross entropy, averaged over pixels of positive ROIs
+  auto loss = torch::binary_cross_entropy(y_pred, target_masks, /*weight*/ {},
+                                          at::Reduction::None);
+  loss = (loss * positive.view({-1, 1, 1})).sum();
+  return loss / (positive.sum() * height * width).clamp_min(1);
+}
 
-    // Binary cross entropy
-    loss = torch::binary_cross_entropy(y_pred, y_true);
-  } else {
-    loss = torch::tensor(0.f, at::dtype(at::kFloat).requires_grad(false));
-    if (target_class_ids.is_cuda())
-      loss = loss.cuda();
-  }
-  return loss;
+std::tuple<at::Tensor, at::Tensor> ComputeLosses(at::Tensor rpn_match,
+                                                 at::Tensor rpn_bbox,
+                                                 at::Tensor rpn_class_logits,
+                                                 at::Tensor rpn_pred_bbox,
+                                                 at::Tensor target_class_ids,
+                                                 at::Tensor mrcnn_class_logits,
+                                                 at::Tensor target_deltas,
+                                                 at::Tensor mrcnn_bbox,
+                                                 at::Tensor target_mask,
+                                                 at::Tensor mrcnn_mask) {
+  auto rpn_class_loss = ComputeRpnClassLoss(rpn_match, rpn_class_logits);
+  auto rpn_bbox_loss = ComputeRpnBBoxLoss(rpn_bbox, rpn_match, rpn_pred_bbox);
+  auto mrcnn_class_loss =
+      ComputeMrcnnClassLoss(target_class_ids, mrcnn_class_logits);
+  auto mrcnn_bbox_loss =
+      ComputeMrcnnBBoxLoss(target_deltas, target_class_ids, mrcnn_bbox);
+  auto mrcnn_mask_loss =
+      ComputeMrcnnMaskLoss(target_mask, target_class_ids, mrcnn_mask);
+  auto loss = rpn_class_loss + rpn_bbox_loss + mrcnn_class_loss +
+              mrcnn_bbox_loss + mrcnn_mask_loss;
+
+  auto values = torch::stack({loss, rpn_class_loss, rpn_bbox_loss,
+                              mrcnn_class_loss, mrcnn_bbox_loss,
+                              mrcnn_mask_loss})
+                    .detach();
+  return {loss, values};
 }
@@ -3,6 +3,11 @@
 
 #include <torch/torch.h>
 
+/* Losses are computed with masked reductions over the padded targets,
+ * without selecting the contributing rows, so they don't synchronize with
+ * the GPU.
+ */
+
 /* RPN anchor classifier loss.
  * rpn_match: [batch, anchors, 1]. Anchor match type. 1=positive,
  *           -1=negative, 0=neutral anchor.
@@ -23,31 +28,49 @@ torch::Tensor ComputeRpnBBoxLoss(torch::Tensor target_bbox,
                                  torch::Tensor rpn_bbox);
 
 /* Loss for the classifier head of Mask RCNN.
- * target_class_ids: [batch, num_rois]. Integer class IDs. Uses zero
- *   padding to fill in the array.
+ * target_class_ids: [num_rois]. Integer class IDs. Padding rows have
+ *   -1 class id and don't contribute to the loss.
  * pred_class_logits: [batch, num_rois, num_classes]
  */
 torch::Tensor ComputeMrcnnClassLoss(torch::Tensor target_class_ids,
                                     torch::Tensor pred_class_logits);
 
 /* Loss for Mask R-CNN bounding box refinement.
- * target_bbox: [batch, num_rois, (dy, dx, log(dh), log(dw))]
- * target_class_ids: [batch, num_rois]. Integer class IDs.
- * pred_bbox: [batch, num_rois, num_classes, (dy, dx, log(dh), log(dw))]
+ * target_bbox: [num_rois, (dy, dx, log(dh), log(dw))]
+ * target_class_ids: [num_rois]. Integer class IDs.
+ * pred_bbox: [num_rois, num_classes, (dy, dx, log(dh), log(dw))]
  */
 torch::Tensor ComputeMrcnnBBoxLoss(torch::Tensor target_bbox,
                                    torch::Tensor target_class_ids,
                                    torch::Tensor pred_bbox);
 
 /* Mask binary cross-entropy loss for the masks head.
- * target_masks: [batch, num_rois, height, width].
+ * target_masks: [num_rois, height, width].
  *   A float32 tensor of values 0 or 1. Uses zero padding to fill array.
- * target_class_ids: [batch, num_rois]. Integer class IDs. Zero padded.
- * pred_masks: [batch, proposals, height, width, num_classes] float32 tensor
+ * target_class_ids: [num_rois]. Integer class IDs.
+ * pred_masks: [num_rois, num_classes, height, width] float32 tensor
  *             with values from 0 to 1.
+ * Mask R-CNN losses are 0 without positive ROIs.
  */
 torch::Tensor ComputeMrcnnMaskLoss(torch::Tensor target_masks,
                                    torch::Tensor target_class_ids,
                                    torch::Tensor pred_masks);
 
+/* All losses of the training step.
+ * Returns: sum of the losses to backpropagate and [6] detached values (sum,
+ * rpn_class, rpn_bbox, mrcnn_class, mrcnn_bbox, mrcnn_mask), so statistics
+ * are copied to the host at once.
+ */
+std::tuple<torch::Tensor, torch::Tensor> ComputeLosses(
+    torch::Tensor rpn_match,
+    torch::Tensor rpn_bbox,
+    torch::Tensor rpn_class_logits,
+    torch::Tensor rpn_pred_bbox,
+    torch::Tensor target_class_ids,
+    torch::Tensor mrcnn_class_logits,
+    torch::Tensor target_deltas,
+    torch::Tensor mrcnn_bbox,
+    torch::Tensor target_mask,
+    torch::Tensor mrcnn_mask);
+
 #endif  // LOSS_H
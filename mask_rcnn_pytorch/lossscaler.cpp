@@ -0,0 +1,60 @@
+#include "lossscaler.h"
+
+#include <cmath>
+
+LossScaler::LossScaler(float init_scale, uint32_t window)
+    : scale_(init_scale), window_(window) {}
+
+std::vector<at::Tensor> LossScaler::AddParams(
+    const std::vector<at::Tensor>& model_params) {
+  std::vector<at::Tensor> master_params;
+  for (auto& p : model_params) {
+    auto master = p.detach().to(at::kFloat).clone();
+    master.set_requires_grad(true);
+    model_.push_back(p);
+    master_.push_back(master);
+    master_params.push_back(master);
+  }
+  return master_params;
+}
+
+bool LossScaler::UnscaleGrads() {
+  // Accumulate the sum of all gradients on the device, it is inf or nan if
+  // any of them overflowed, so only one synchronization is required
+  at::Tensor grads_sum;
+  for (size_t i = 0; i < model_.size(); ++i) {
+    auto& grad = model_[i].grad();
+    if (!grad.defined())
+      continue;
+    auto master_grad = grad.detach().to(at::kFloat) / scale_;
+    master_[i].grad() = master_grad;
+    auto sum = master_grad.sum();
+    grads_sum = grads_sum.defined() ? grads_sum + sum : sum;
+  }
+  bool finite = !grads_sum.defined() || std::isfinite(grads_sum.item<float>());
+
+  if (!finite) {
+    scale_ /= 2.f;
+    good_steps_ = 0;
+  } else if (++good_steps_ == window_) {
+    scale_ *= 2.f;
+    good_steps_ = 0;
+  }
+  return finite;
+}
+
+void LossScaler::CopyMasterToModel() {
+  torch::NoGradGuard no_grad;
+  for (size_t i = 0; i < model_.size(); ++i)
+    model_[i].copy_(master_[i]);
+}
+
+void LossScaler::ZeroModelGrads() {
+  for (auto& p : model_) {
+    auto& grad = p.grad();
+    if (grad.defined()) {
+      grad.detach_();
+      grad.zero_();
+    }
+  }
+}
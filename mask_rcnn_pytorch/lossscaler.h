@@ -0,0 +1,46 @@
+#ifndef LOSSSCALER_H
+#define LOSSSCALER_H
+
+#include <torch/torch.h>
+
+#include <vector>
+
+/* Dynamic loss scaling for mixed precision training.
+ * The model runs in half precision, the optimizers update float master
+ * copies of its parameters. The loss is multiplied by the scale before the
+ * backward pass, so small gradients don't flush to zero in half precision.
+ * Gradients are unscaled into the master copies, steps with inf or nan
+ * gradients are skipped and the scale is halved. The scale is doubled after
+ * window steps without overflow.
+ */
+class LossScaler {
+ public:
+  LossScaler(float init_scale, uint32_t window);
+
+  // Creates float master copies of the model parameters, the optimizer
+  // should be built on the returned tensors
+  std::vector<at::Tensor> AddParams(
+      const std::vector<at::Tensor>& model_params);
+
+  float Scale() const { return scale_; }
+
+  // Writes unscaled model gradients to the master copies, updates the scale.
+  // Returns false if gradients overflowed and the step should be skipped.
+  bool UnscaleGrads();
+
+  // Copies updated master weights back to the model
+  void CopyMasterToModel();
+
+  void ZeroModelGrads();
+
+  const std::vector<at::Tensor>& MasterParams() const { return master_; }
+
+ private:
+  std::vector<at::Tensor> model_;
+  std::vector<at::Tensor> master_;
+  float scale_{1.f};
+  uint32_t window_{0};
+  uint32_t good_steps_{0};
+};
+
+#endif  // LOSSSCALER_H
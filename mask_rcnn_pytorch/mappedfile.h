@@ -0,0 +1,32 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+#include <string>
+
+/* Read only memory mapping of the whole file
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& file_name);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  const uint8_t* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+  // Returns nullptr if [offset, offset + count * sizeof(T)) is out of file
+  template <typename T>
+  const T* at(uint64_t offset, uint64_t count = 1) const {
+    if (offset > size_ || count > (size_ - offset) / sizeof(T))
+      return nullptr;
+    return reinterpret_cast<const T*>(data_ + offset);
+  }
+
+ private:
+  const uint8_t* data_{nullptr};
+  uint64_t size_{0};
+};
+
+#endif  // MAPPEDFILE_H
@@ -6,7 +6,6 @@ MaskImpl::MaskImpl() {}
 
 MaskImpl::MaskImpl(uint32_t depth,
                    uint32_t pool_size,
-                   const std::vector<int32_t>& image_shape,
                    uint32_t num_classes)
     : padding_(/*kernel_size*/ 3, /*stride*/ 1),
       conv1_(torch::nn::Conv2dOptions(depth, 256, 3).stride(1)),
@@ -19,8 +18,7 @@ MaskImpl::MaskImpl(uint32_t depth,
       bn4_(torch::nn::BatchNormOptions(256).eps(0.001)),
       conv5_(torch::nn::Conv2dOptions(256, num_classes, 1).stride(1)),
       deconv_(Deconv()),
-      pool_size_(pool_size),
-      image_shape_(image_shape) {
+      pool_size_(pool_size) {
   register_module("padding", padding_);
   register_module("conv1", conv1_);
   register_module("bn1", bn1_);
@@ -35,9 +33,15 @@ MaskImpl::MaskImpl(uint32_t depth,
 }
 
 torch::Tensor MaskImpl::forward(std::vector<torch::Tensor> feature_maps,
-                                at::Tensor rois) {
+                                at::Tensor rois,
+                                const std::vector<int32_t>& image_shape,
+                                StageProfiler* profiler) {
   feature_maps.insert(feature_maps.begin(), rois);
-  auto x = PyramidRoiAlign(feature_maps, pool_size_, image_shape_);
+  at::Tensor x;
+  {
+    StageProfiler::Scope scope(profiler, "mask_roi_align");
+    x = PyramidRoiAlign(feature_maps, pool_size_, image_shape);
+  }
   x = conv1_->forward(padding_->forward(x));
   x = bn1_->forward(x);
   x = torch::relu(x);
@@ -2,6 +2,7 @@
 #define MASK_H
 
 #include "nnutils.h"
+#include "stageprofiler.h"
 
 #include <inttypes.h>
 
@@ -25,11 +26,13 @@ class MaskImpl : public torch::nn::Module {
   MaskImpl();
   MaskImpl(uint32_t depth,
            uint32_t pool_size,
-           const std::vector<int32_t>& image_shape,
            uint32_t num_classes);
 
+  // image_shape: [height, width] of the input images, including padding
   torch::Tensor forward(std::vector<torch::Tensor> feature_maps,
-                        torch::Tensor rois);
+                        torch::Tensor rois,
+                        const std::vector<int32_t>& image_shape,
+                        StageProfiler* profiler = nullptr);
 
  private:
   SamePad2d padding_{nullptr};
@@ -45,7 +48,6 @@ class MaskImpl : public torch::nn::Module {
   Deconv deconv_{nullptr};
 
   uint32_t pool_size_{0};
-  std::vector<int32_t> image_shape_;
 };
 
 TORCH_MODULE(Mask);
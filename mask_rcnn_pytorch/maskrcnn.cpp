@@ -1,55 +1,401 @@
 #include "maskrcnn.h"
-#include "anchors.h"
+#include "../threadpool.h"
+#include "../trace.h"
+#include "augmentation.h"
+#include "checkpointwriter.h"
+#include "dataparallel.h"
 #include "debug.h"
 #include "detectionlayer.h"
 #include "detectiontargetlayer.h"
 #include "loss.h"
+#include "lossscaler.h"
+#include "nnutils.h"
 #include "proposallayer.h"
+#include "proposalbudget.h"
 #include "resnet.h"
+#include "roialign.h"
+#include "rpntargets.h"
 #include "stateloader.h"
 
+#include <ATen/DeviceGuard.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <THC/THCCachingAllocator.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <exception>
 #include <experimental/filesystem>
+#include <optional>
 #include <random>
 #include <regex>
+#include <thread>
 
 namespace fs = std::experimental::filesystem;
 
+namespace {
+// Gradients and weights are exchanged between GPUs in buckets of this size
+const int64_t kGradBucketBytes = 25 * 1024 * 1024;
+
+// Concatenates [1, instances, ...] tensors of the samples along the batch
+// dimension, zero padding them to the largest number of instances
+at::Tensor CatPaddedInstances(const std::vector<at::Tensor>& tensors) {
+  int64_t max_count = 0;
+  for (const auto& tensor : tensors)
+    max_count = std::max(max_count, tensor.size(1));
+  std::vector<at::Tensor> padded;
+  for (const auto& tensor : tensors) {
+    auto sizes = tensor.sizes().vec();
+    sizes[1] = max_count - tensor.size(1);
+    if (sizes[1] > 0) {
+      auto padding = torch::zeros(sizes, tensor.options());
+      padded.push_back(torch::cat({tensor, padding}, /*dim*/ 1));
+    } else {
+      padded.push_back(tensor);
+    }
+  }
+  return padded.size() == 1 ? padded[0] : torch::cat(padded, /*dim*/ 0);
+}
+
+// Copies values returned by ComputeLosses for several steps to the host
+// with one transfer
+std::vector<LossStat> ReadLossStats(const std::vector<at::Tensor>& values) {
+  auto host_values = torch::stack(values).cpu();
+  const auto* data = host_values.data<float>();
+  std::vector<LossStat> stats(values.size());
+  for (auto& stat : stats) {
+    stat.loss = data[0];
+    stat.loss_rpn_class = data[1];
+    stat.loss_rpn_bbox = data[2];
+    stat.loss_mrcnn_class = data[3];
+    stat.loss_mrcnn_bbox = data[4];
+    stat.loss_mrcnn_mask = data[5];
+    data += 6;
+  }
+  return stats;
+}
+
+void AddLossStat(LossStat& sum, const LossStat& stat, float weight) {
+  sum.loss += stat.loss * weight;
+  sum.loss_rpn_class += stat.loss_rpn_class * weight;
+  sum.loss_rpn_bbox += stat.loss_rpn_bbox * weight;
+  sum.loss_mrcnn_class += stat.loss_mrcnn_class * weight;
+  sum.loss_mrcnn_bbox += stat.loss_mrcnn_bbox * weight;
+  sum.loss_mrcnn_mask += stat.loss_mrcnn_mask * weight;
+}
+
+void CheckCuda(cudaError_t status) {
+  if (status != cudaSuccess)
+    throw std::runtime_error(cudaGetErrorString(status));
+}
+
+// Work queued on stream after the call waits for the work queued on source
+void WaitStream(cudaStream_t stream, cudaStream_t source) {
+  cudaEvent_t event;
+  CheckCuda(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+  auto status = cudaEventRecord(event, source);
+  if (status == cudaSuccess)
+    status = cudaStreamWaitEvent(stream, event, 0);
+  cudaEventDestroy(event);
+  CheckCuda(status);
+}
+
+bool HasInferenceLimits(const Config& config, bool boxes_only) {
+  return config.inference_min_score > 0 || config.inference_mask_top_k > 0 ||
+         boxes_only;
+}
+
+/* Drops detections below Config::inference_min_score and after the
+ * inference_mask_top_k top ones of every image, detections are sorted by
+ * score, so the dropped rows become zero padding. Returns the detections
+ * narrowed to the rows the mask head has to run on: the largest number of
+ * detections in the batch rounded up to a power of two, so cuDNN sees few
+ * shapes. Only the count is copied to the host. Box only detections keep
+ * their rows.
+ */
+at::Tensor LimitDetections(at::Tensor detections,
+                           const Config& config,
+                           bool boxes_only) {
+  const auto rows = detections.size(1);
+  auto keep = detections.narrow(2, 5, 1) >= config.inference_min_score;
+  const auto top_k = config.inference_mask_top_k;
+  if (top_k > 0 && top_k < rows)
+    keep.narrow(1, top_k, rows - top_k).fill_(0);
+  detections = detections * keep.to(detections.scalar_type());
+  if (boxes_only)
+    return detections;
+
+  // Padding rows have zero class ids
+  auto count = (detections.narrow(2, 4, 1) != 0)
+                   .sum(/*dim*/ 1)
+                   .max()
+                   .item<int64_t>();
+  int64_t mask_rows = count > 0 ? 1 : 0;
+  while (mask_rows < count)
+    mask_rows *= 2;
+  return detections.narrow(1, 0, std::min(mask_rows, rows));
+}
+}  // namespace
+
 MaskRCNNImpl::MaskRCNNImpl(std::string model_dir,
                            std::shared_ptr<Config const> config)
-    : model_dir_(model_dir), config_(config) {
+    : model_dir_(model_dir),
+      config_(config),
+      proposal_count_(config->post_nms_rois_inference) {
   Build();
   InitializeWeights();
+
+  // Weights are converted after initialization, checkpoints are loaded with
+  // the type conversion
+  if (config_->mixed_precision) {
+    if (config_->gpu_count == 0)
+      throw std::invalid_argument("Mixed precision mode requires a GPU");
+    to(torch::kHalf);
+  }
+
+  if (config_->profile_inference)
+    profiler_ = std::make_unique<StageProfiler>(config_->gpu_count > 0);
 }
 
 /* Runs the detection pipeline.
- * images: List of images, potentially of different sizes.
- * Returns a list of dicts, one dict per image. The dict contains:
- * rois: [N, (y1, x1, y2, x2)] detection bounding boxes
- * class_ids: [N] int class IDs
- * scores: [N] float probability scores for the class IDs
- * masks: [H, W, N] instance binary masks
+ * images: [batch, channels, height, width] molded images, see MoldInputs.
+ * image_metas: one meta per image in the batch.
+ * Returns a tuple:
+ * detections: [batch, N, (y1, x1, y2, x2, class_id, score)] zero padded
+ *             to the largest number of detections in batch
+ * masks: [batch, N, height, width, num_classes] masks, with no rows if
+ *        boxes_only or Config::inference_boxes_only is set
+ * Tensors stay on the device of the model, UnmoldDetections pastes masks
+ * there and copies only compact results to the host.
  */
 std::tuple<at::Tensor, at::Tensor> MaskRCNNImpl::Detect(
     at::Tensor images,
-    const std::vector<ImageMeta>& image_metas) {
+    const std::vector<ImageMeta>& image_metas,
+    bool boxes_only) {
+  // Inference doesn't need the autograd graph
+  torch::NoGradGuard no_grad;
+
   // Run object detection
-  auto [detections, mrcnn_mask] = PredictInference(images, image_metas);
-  detections = detections.cpu();
-  if (!is_empty(mrcnn_mask))
-    mrcnn_mask = mrcnn_mask.permute({0, 1, 3, 4, 2}).cpu();
+  at::Tensor detections, mrcnn_mask;
+  {
+    StageProfiler::Scope scope(profiler_.get(), "detect");
+    MLCPP_TRACE_GPU_ZONE("forward", images.is_cuda(),
+                         at::cuda::getCurrentCUDAStream().stream());
+    std::tie(detections, mrcnn_mask) = PredictInference(
+        images, image_metas, boxes_only || config_->inference_boxes_only);
+  }
+  if (mrcnn_mask.dim() == 5)
+    mrcnn_mask = mrcnn_mask.permute({0, 1, 3, 4, 2});
+
+  // Stages the GPU already finished, without waiting
+  if (profiler_)
+    profiler_->Collect(/*wait*/ false);
 
   return {detections, mrcnn_mask};
 }
 
+HeadSetImpl::HeadSetImpl(std::shared_ptr<Config const> config)
+    : config(config) {
+  classifier = Classifier(256, config->pool_size, config->num_classes);
+  register_module("classifier", classifier);
+  mask = Mask(256, config->mask_pool_size, config->num_classes);
+  register_module("mask", mask);
+  // Loaded with the type conversion, like the heads of the model
+  if (config->mixed_precision)
+    to(torch::kHalf);
+}
+
+size_t MaskRCNNImpl::AddHeads(HeadSet heads) {
+  if (heads->config->pool_size != config_->pool_size ||
+      heads->config->mask_pool_size != config_->mask_pool_size ||
+      heads->config->mixed_precision != config_->mixed_precision)
+    throw std::invalid_argument("Heads don't match the model settings");
+  head_sets_.push_back(heads);
+  register_module("heads_" + std::to_string(head_sets_.size()), heads);
+  return head_sets_.size();
+}
+
+void MaskRCNNImpl::SetProposalCount(int64_t count) {
+  if (count <= 0)
+    throw std::invalid_argument("Proposal count should be positive");
+  proposal_count_ = count;
+}
+
+std::vector<std::tuple<at::Tensor, at::Tensor>> MaskRCNNImpl::DetectHeads(
+    at::Tensor images,
+    const std::vector<ImageMeta>& image_metas,
+    bool boxes_only) {
+  torch::NoGradGuard no_grad;
+  eval();
+
+  std::vector<std::tuple<at::Tensor, at::Tensor>> results(HeadsNum());
+  {
+    StageProfiler::Scope scope(profiler_.get(), "detect");
+    MLCPP_TRACE_GPU_ZONE("forward", images.is_cuda(),
+                         at::cuda::getCurrentCUDAStream().stream());
+    std::vector<at::Tensor> feature_maps;
+    at::Tensor rpn_rois;
+    std::tie(feature_maps, rpn_rois) = PredictProposals(images);
+    const auto& constants = Constants(images);
+
+    // The profiler isn't shared between threads, all sets are one stage
+    StageProfiler::Scope heads_scope(profiler_.get(), "heads");
+    auto predict = [&](size_t i) {
+      const auto& config = i == 0 ? *config_ : *head_sets_[i - 1]->config;
+      auto& classifier = i == 0 ? classifier_ : head_sets_[i - 1]->classifier;
+      auto& mask = i == 0 ? mask_ : head_sets_[i - 1]->mask;
+      results[i] = PredictHeads(config, classifier, mask, feature_maps,
+                                rpn_rois, image_metas, constants,
+                                boxes_only || config.inference_boxes_only,
+                                /*profiler*/ nullptr);
+    };
+    if (images.is_cuda()) {
+      // Every set runs on its own stream after the backbone and the current
+      // stream waits for all of them, so the caching allocator reuses the
+      // memory of the sets only after the work queued before
+      const auto device = images.get_device();
+      auto current = at::cuda::getCurrentCUDAStream();
+      std::vector<at::cuda::CUDAStream> streams;
+      for (size_t i = 0; i < results.size(); ++i) {
+        streams.push_back(at::cuda::getStreamFromPool(false, device));
+        WaitStream(streams.back().stream(), current.stream());
+      }
+      utils::ParallelFor(0, results.size(), [&](size_t i) {
+        torch::NoGradGuard no_grad;
+        at::DeviceGuard device_guard(images.device());
+        StreamGuard stream_guard(streams[i]);
+        predict(i);
+      });
+      for (auto& stream : streams)
+        WaitStream(current.stream(), stream.stream());
+    } else {
+      for (size_t i = 0; i < results.size(); ++i)
+        predict(i);
+    }
+  }
+  for (auto& result : results) {
+    auto& mrcnn_mask = std::get<1>(result);
+    if (mrcnn_mask.dim() == 5)
+      mrcnn_mask = mrcnn_mask.permute({0, 1, 3, 4, 2});
+  }
+
+  // Stages the GPU already finished, without waiting
+  if (profiler_)
+    profiler_->Collect(/*wait*/ false);
+
+  return results;
+}
+
+void MaskRCNNImpl::WarmUp(uint32_t steps) {
+  // Images are padded to image_max_dim x image_max_dim and the numbers of
+  // proposals and detections are fixed, so benchmarking happens only once.
+  // Without padding only the largest input shape is warmed up.
+  if (config_->gpu_count > 0)
+    at::globalContext().setBenchmarkCuDNN(true);
+
+  // Weights are frozen for serving, batch norms are folded before
+  // convolutions are benchmarked
+  if (config_->fold_batch_norm)
+    fpn_->FoldBatchNorm();
+
+  auto batch_size = static_cast<int64_t>(config_->images_per_gpu);
+  auto height = config_->image_shape[0];
+  auto width = config_->image_shape[1];
+  std::vector<ImageMeta> image_metas(static_cast<size_t>(batch_size));
+  for (auto& meta : image_metas) {
+    meta.image_width = width;
+    meta.image_height = height;
+    meta.window = Window{0, 0, height, width};
+  }
+  // Every proposal count of the latency objective is a shape of its own
+  std::vector<int64_t> proposal_counts{proposal_count_};
+  if (config_->inference_latency_slo_ms > 0)
+    proposal_counts = ProposalCounts(*config_);
+  const auto proposal_count = proposal_count_;
+  for (auto count : proposal_counts) {
+    proposal_count_ = count;
+    for (uint32_t i = 0; i < steps; ++i) {
+      auto images = torch::randn({batch_size, 3, height, width});
+      if (config_->gpu_count > 0)
+        images = images.cuda();
+      if (head_sets_.empty())
+        Detect(images, image_metas);
+      else
+        DetectHeads(images, image_metas);
+    }
+  }
+  proposal_count_ = proposal_count;
+
+  // Benchmarking doesn't count in the stage timings
+  if (profiler_)
+    profiler_->Reset();
+}
+
+MaskRCNNImpl::TrainLoaderFactory MaskRCNNImpl::LoaderFactory(
+    CocoDataset train_dataset) const {
+  auto config = config_;
+  return [train_dataset, config](uint32_t shard, uint32_t shards_num,
+                                 uint32_t group_size) {
+    return std::make_unique<SamplePrefetcher>(
+        train_dataset, config->data_workers_num, config->data_prefetch_size,
+        config->gpu_count > 0, shard, shard, shards_num, group_size);
+  };
+}
+
+MaskRCNNImpl::TrainLoaderFactory MaskRCNNImpl::LoaderFactory(
+    std::vector<std::string> train_shards) const {
+  auto config = config_;
+  return [train_shards, config](uint32_t shard, uint32_t shards_num,
+                                uint32_t group_size) {
+    if (group_size > 1)
+      throw std::invalid_argument(
+          "Training from shards needs the image padding");
+    auto stream = std::make_shared<ShardStream>(
+        train_shards, config->shard_shuffle_size, config->shard_readahead,
+        shard, shards_num);
+    return std::make_unique<SamplePrefetcher>(
+        stream, config, config->data_workers_num, config->data_prefetch_size,
+        config->gpu_count > 0, shard);
+  };
+}
+
 void MaskRCNNImpl::Train(CocoDataset train_dataset,
                          CocoDataset val_dataset,
                          double learning_rate,
                          uint32_t epochs,
                          std::string layers_regex) {
+  TrainLoop(LoaderFactory(std::move(train_dataset)), std::move(val_dataset),
+            learning_rate, epochs, std::move(layers_regex));
+}
+
+void MaskRCNNImpl::Train(std::vector<std::string> train_shards,
+                         CocoDataset val_dataset,
+                         double learning_rate,
+                         uint32_t epochs,
+                         std::string layers_regex) {
+  TrainLoop(LoaderFactory(std::move(train_shards)), std::move(val_dataset),
+            learning_rate, epochs, std::move(layers_regex));
+}
+
+std::tuple<double, MemoryStat> MaskRCNNImpl::MeasureTraining(
+    CocoDataset train_dataset,
+    uint32_t images,
+    const std::string& layers) {
+  return MeasureLoop(LoaderFactory(std::move(train_dataset)), images,
+                     layers);
+}
+
+std::tuple<double, MemoryStat> MaskRCNNImpl::MeasureTraining(
+    std::vector<std::string> train_shards,
+    uint32_t images,
+    const std::string& layers) {
+  return MeasureLoop(LoaderFactory(std::move(train_shards)), images, layers);
+}
+
+std::string MaskRCNNImpl::LayersRegex(const std::string& layers) {
   // Pre-defined layer regular expressions
   // clang-format off
-  std::map<std::string, std::string> layers_regex_map = {
+  static const std::map<std::string, std::string> layers_regex_map = {
            // all layers but the backbone
            {"heads", "(fpn.P5\\_.*)|(fpn.P4\\_.*)|(fpn.P3\\_.*)|(fpn.P2\\_.*)|(rpn.*)|(classifier.*)|(mask.*)"},
            // From a specific Resnet stage and up
@@ -59,10 +405,95 @@ void MaskRCNNImpl::Train(CocoDataset train_dataset,
            // All layers
            {"all", ".*"}};
   // clang-format on
+  auto layer_regex_i = layers_regex_map.find(layers);
+  return layer_regex_i != layers_regex_map.end() ? layer_regex_i->second
+                                                 : layers;
+}
+
+std::vector<std::shared_ptr<MaskRCNNImpl>> MaskRCNNImpl::MakeReplicas(
+    const std::string& layers_regex) {
+  // Data parallel training, the model itself is on the first GPU and every
+  // other GPU gets a replica. Replicas are created with the current device
+  // set, so all tensors of the pipeline are allocated on their own GPU.
+  std::vector<std::shared_ptr<MaskRCNNImpl>> replicas;
+  for (uint32_t d = 1; d < config_->gpu_count; ++d) {
+    at::Device device(at::kCUDA, static_cast<int16_t>(d));
+    at::DeviceGuard device_guard(device);
+    auto replica = std::make_shared<MaskRCNNImpl>(model_dir_, config_);
+    replica->to(device);
+    replica->SetTrainableLayers(layers_regex);
+    BroadcastTensors(parameters(), replica->parameters(), kGradBucketBytes);
+    BroadcastTensors(buffers(), replica->buffers(), kGradBucketBytes);
+    replicas.push_back(replica);
+  }
+  return replicas;
+}
+
+std::vector<std::unique_ptr<SamplePrefetcher>> MaskRCNNImpl::MakeTrainLoaders(
+    const TrainLoaderFactory& make_train_loader,
+    uint32_t shards_num) const {
+  // Every GPU loads its own shard of the train set. Without padding samples
+  // of one step on a GPU are taken with the same shape.
+  const auto group_size =
+      config_->image_padding ? 1u
+                             : std::max(config_->batch_size / shards_num, 1u);
+  std::vector<std::unique_ptr<SamplePrefetcher>> train_loaders;
+  for (uint32_t shard = 0; shard < shards_num; ++shard)
+    train_loaders.push_back(make_train_loader(shard, shards_num, group_size));
+  return train_loaders;
+}
+
+std::tuple<double, MemoryStat> MaskRCNNImpl::MeasureLoop(
+    const TrainLoaderFactory& make_train_loader,
+    uint32_t images,
+    const std::string& layers) {
+  auto layers_regex = LayersRegex(layers);
+  SetTrainableLayers(layers_regex);
+  // Optimizers without the learning rate and the momentum, the steps don't
+  // change the weights and leave no state
+  auto params = TrainableParameters();
+  std::unique_ptr<LossScaler> loss_scaler;
+  if (config_->mixed_precision) {
+    loss_scaler = std::make_unique<LossScaler>(config_->loss_scale,
+                                               config_->loss_scale_window);
+    params = loss_scaler->AddParams(params);
+  }
+  torch::optim::SGD optim(params, torch::optim::SGDOptions(0));
+  torch::optim::SGD optim_bn(std::vector<torch::Tensor>(),
+                             torch::optim::SGDOptions(0));
+
+  auto replicas = MakeReplicas(layers_regex);
+  auto train_loaders = MakeTrainLoaders(
+      make_train_loader, static_cast<uint32_t>(replicas.size() + 1));
+  // The first steps allocate the memory and fill the loader queues, they
+  // aren't timed. The losses are read back at the end of TrainEpoch, so the
+  // device work is done when it returns.
+  const auto step_images = std::max(config_->batch_size, 1u) *
+                           std::max(config_->gradient_accumulation_steps, 1u);
+  StatReporter reporter(1, images + step_images, 0);
+  reporter.StartEpoch(0, 0);
+  TrainEpoch(reporter, train_loaders, replicas, optim, optim_bn,
+             loss_scaler.get(), step_images);
+  auto start = std::chrono::steady_clock::now();
+  TrainEpoch(reporter, train_loaders, replicas, optim, optim_bn,
+             loss_scaler.get(), std::max(images, step_images));
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  reporter.Stop();
+  return {std::max(images, step_images) / elapsed.count(),
+          MemoryStats(replicas)};
+}
+
+void MaskRCNNImpl::TrainLoop(const TrainLoaderFactory& make_train_loader,
+                             CocoDataset val_dataset,
+                             double learning_rate,
+                             uint32_t epochs,
+                             std::string layers_regex) {
+  if (HasGeometricAugmentation(*config_) && !config_->rpn_targets_on_gpu)
+    throw std::invalid_argument(
+        "Flips and scale jitter need RPN targets built on the GPU");
 
-  auto layer_regex_i = layers_regex_map.find(layers_regex);
-  if (layer_regex_i != layers_regex_map.end())
-    layers_regex = layer_regex_i->second;
+  layers_regex = LayersRegex(layers_regex);
   SetTrainableLayers(layers_regex);
 
   // Optimizer object
@@ -81,6 +512,15 @@ void MaskRCNNImpl::Train(CocoDataset train_dataset,
       trainable_params_bn.push_back(param.value());
     }
   }
+  // In mixed precision mode optimizers update float master copies of the
+  // half precision weights
+  std::unique_ptr<LossScaler> loss_scaler;
+  if (config_->mixed_precision) {
+    loss_scaler = std::make_unique<LossScaler>(config_->loss_scale,
+                                               config_->loss_scale_window);
+    trainable_params_no_bn = loss_scaler->AddParams(trainable_params_no_bn);
+    trainable_params_bn = loss_scaler->AddParams(trainable_params_bn);
+  }
   torch::optim::SGD optim_no_bn(trainable_params_no_bn,
                                 torch::optim::SGDOptions(learning_rate)
                                     .momentum(config_->learning_momentum)
@@ -90,37 +530,41 @@ void MaskRCNNImpl::Train(CocoDataset train_dataset,
                              torch::optim::SGDOptions(learning_rate)
                                  .momentum(config_->learning_momentum));
 
+  auto replicas = MakeReplicas(layers_regex);
+
   StatReporter reporter(epochs, config_->steps_per_epoch,
-                        config_->validation_steps);
-  const uint32_t workers_num = 1;
+                        config_->validation_steps,
+                        config_->export_metrics ? model_dir_ : "");
+  // Data loaders are shared by all epochs, samples are copied to the GPU by
+  // loader threads
+  const bool load_to_gpu = config_->gpu_count > 0;
+  auto train_loaders = MakeTrainLoaders(
+      make_train_loader, static_cast<uint32_t>(replicas.size() + 1));
+  SamplePrefetcher val_loader(val_dataset, config_->data_workers_num,
+                              config_->data_prefetch_size, load_to_gpu);
+
+  // Checkpoints are written while the next epoch runs
+  CheckpointWriter checkpoint_writer;
   std::string check_file_name;
   std::random_device rnd_dev;
   for (uint32_t epoch = 0; epoch < epochs; ++epoch) {
     reporter.StartEpoch(epoch, optim_no_bn.options.learning_rate_);
-    // Reset data loaders
 #ifdef NDEBUG
     torch::manual_seed(rnd_dev());
 #endif
-    auto train_loader = torch::data::make_data_loader(
-        train_dataset,
-        torch::data::DataLoaderOptions().batch_size(1).workers(
-            workers_num));  // random sampler is default
-
-    auto val_loader = torch::data::make_data_loader(
-        val_dataset,
-        torch::data::DataLoaderOptions().batch_size(1).workers(
-            workers_num));  // random sampler is default
 
     // Training
     auto [loss, loss_rpn_class, loss_rpn_bbox, loss_mrcnn_class,
           loss_mrcnn_bbox, loss_mrcnn_mask] =
-        TrainEpoch(reporter, *train_loader, optim_no_bn, optim_bn,
-                   config_->steps_per_epoch);
+        TrainEpoch(reporter, train_loaders, replicas, optim_no_bn, optim_bn,
+                   loss_scaler.get(), config_->steps_per_epoch);
+
+    reporter.ReportMemory(MemoryStats(replicas));
 
     //  Validation
     auto [val_loss, val_loss_rpn_class, val_loss_rpn_bbox, val_loss_mrcnn_class,
           val_loss_mrcnn_bbox, val_loss_mrcnn_mask] =
-        ValidEpoch(reporter, *val_loader, config_->validation_steps);
+        ValidEpoch(reporter, val_loader, config_->validation_steps);
 
     // Show statistics
     reporter.ReportEpoch(
@@ -131,10 +575,16 @@ void MaskRCNNImpl::Train(CocoDataset train_dataset,
 
     auto prev_check_file_name = check_file_name;
     check_file_name = GetCheckpointPath(epoch);
-    SaveStateDict(*this, check_file_name);
-    std::cerr << "Checkpoint saved to : " << check_file_name << "\n";
-    if (fs::exists(prev_check_file_name))
-      fs::remove(prev_check_file_name);
+    checkpoint_writer.Save(
+        GetStateTensors(*this, config_->checkpoint_trainable_only),
+        check_file_name, prev_check_file_name);
+
+    // COCO metrics of the detections, while the checkpoint is written
+    if (config_->eval_images > 0) {
+      auto [bbox_stats, segm_stats] =
+          EvaluateEpoch(val_dataset.Loader(), config_->eval_images);
+      reporter.ReportEvaluation(bbox_stats, segm_stats);
+    }
 
     // Debug block
     //    if (loss_rpn_bbox < 0.01f) {
@@ -145,29 +595,25 @@ void MaskRCNNImpl::Train(CocoDataset train_dataset,
 
 std::tuple<float, float, float, float, float, float> MaskRCNNImpl::ValidEpoch(
     StatReporter& reporter,
-    torch::data::DataLoader<CocoDataset, torch::data::samplers::RandomSampler>&
-        datagenerator,
+    SamplePrefetcher& datagenerator,
     uint32_t steps) {
-  float loss_sum = 0;
-  float loss_rpn_class_sum = 0;
-  float loss_rpn_bbox_sum = 0;
-  float loss_mrcnn_class_sum = 0;
-  float loss_mrcnn_bbox_sum = 0;
-  float loss_mrcnn_mask_sum = 0;
+  LossStat sum;
   uint32_t step = 0;
+  const auto stats_interval = std::max(config_->stats_interval, 1u);
+  std::vector<at::Tensor> pending_values;
 
-  for (auto input : datagenerator) {
-    assert(input.size() == 1);
+  while (true) {
+    auto input = datagenerator.Next();
 
     // Wrap input in variables
-    auto images = input[0].data.image;
-    auto rpn_match = input[0].target.rpn_match;
-    auto rpn_bbox = input[0].target.rpn_bbox;
-    auto gt_class_ids = input[0].target.gt_class_ids;
-    auto gt_boxes = input[0].target.gt_boxes;
-    auto gt_masks = input[0].target.gt_masks;
-
-    // To GPU
+    auto images = input.data.image;
+    auto rpn_match = input.target.rpn_match;
+    auto rpn_bbox = input.target.rpn_bbox;
+    auto gt_class_ids = input.target.gt_class_ids;
+    auto gt_boxes = input.target.gt_boxes;
+    auto gt_masks = input.target.gt_masks;
+
+    // To GPU, does nothing for tensors already copied by the loader
     if (config_->gpu_count > 0) {
       images = images.cuda();
       rpn_match = rpn_match.cuda();
@@ -177,85 +623,123 @@ std::tuple<float, float, float, float, float, float> MaskRCNNImpl::ValidEpoch(
       gt_masks = gt_masks.cuda();
     }
 
+    if (config_->rpn_targets_on_gpu) {
+      std::tie(rpn_match, rpn_bbox) =
+          BuildBatchRpnTargets(Constants(images).anchors, gt_boxes, *config_);
+    }
+
     // Run object detection
     auto [rpn_class_logits, rpn_pred_bbox, target_class_ids, mrcnn_class_logits,
           target_deltas, mrcnn_bbox, target_mask, mrcnn_mask] =
         PredictTraining(images, gt_class_ids, gt_boxes, gt_masks);
 
     // Compute losses
-    auto [rpn_class_loss, rpn_bbox_loss, mrcnn_class_loss, mrcnn_bbox_loss,
-          mrcnn_mask_loss] =
+    at::Tensor loss_values;
+    std::tie(std::ignore, loss_values) =
         ComputeLosses(rpn_match, rpn_bbox, rpn_class_logits, rpn_pred_bbox,
                       target_class_ids, mrcnn_class_logits, target_deltas,
                       mrcnn_bbox, target_mask, mrcnn_mask);
-    auto loss = rpn_class_loss + rpn_bbox_loss + mrcnn_class_loss +
-                mrcnn_bbox_loss + mrcnn_mask_loss;
-
-    // Progress
-    auto loss_ = loss.cpu().data<float>()[0];
-    auto loss_rpn_class = rpn_class_loss.cpu().data<float>()[0];
-    auto loss_rpn_bbox = rpn_bbox_loss.cpu().data<float>()[0];
-    auto loss_mrcnn_class = mrcnn_class_loss.cpu().data<float>()[0];
-    auto loss_mrcnn_bbox = mrcnn_bbox_loss.cpu().data<float>()[0];
-    auto loss_mrcnn_mask = mrcnn_mask_loss.cpu().data<float>()[0];
-    reporter.ReportValidationStep(
-        step, {loss_, loss_rpn_class, loss_rpn_bbox, loss_mrcnn_class,
-               loss_mrcnn_bbox, loss_mrcnn_mask});
-
-    // Statistics
-    loss_sum += loss_ / steps;
-    loss_rpn_class_sum += loss_rpn_class / steps;
-    loss_rpn_bbox_sum += loss_rpn_bbox / steps;
-    loss_mrcnn_class_sum += loss_mrcnn_class / steps;
-    loss_mrcnn_bbox_sum += loss_mrcnn_bbox / steps;
-    loss_mrcnn_mask_sum += loss_mrcnn_mask / steps;
+
+    // Progress and statistics, read back every stats_interval steps
+    pending_values.push_back(loss_values);
+    bool last = step == steps - 1;
+    if (last || pending_values.size() >= stats_interval) {
+      auto first_step = step + 1 - static_cast<uint32_t>(pending_values.size());
+      auto stats = ReadLossStats(pending_values);
+      pending_values.clear();
+      for (size_t i = 0; i < stats.size(); ++i) {
+        reporter.ReportValidationStep(first_step + static_cast<uint32_t>(i),
+                                      stats[i]);
+        AddLossStat(sum, stats[i], 1.f / steps);
+      }
+    }
 
     // Break after 'steps' steps
-    if (step == steps - 1)
+    if (last)
       break;
     ++step;
   }
 
-  return {loss_sum,
-          loss_rpn_class_sum,
-          loss_rpn_bbox_sum,
-          loss_mrcnn_class_sum,
-          loss_mrcnn_bbox_sum,
-          loss_mrcnn_mask_sum};
+  return {sum.loss,
+          sum.loss_rpn_class,
+          sum.loss_rpn_bbox,
+          sum.loss_mrcnn_class,
+          sum.loss_mrcnn_bbox,
+          sum.loss_mrcnn_mask};
 }
 
-std::tuple<float, float, float, float, float, float> MaskRCNNImpl::TrainEpoch(
-    StatReporter& reporter,
-    torch::data::DataLoader<CocoDataset, torch::data::samplers::RandomSampler>&
-        datagenerator,
-    torch::optim::SGD& optimizer,
-    torch::optim::SGD& optimizer_bn,
-    uint32_t steps) {
-  uint32_t batch_count = 0;
-  float loss_sum = 0;
-  float loss_rpn_class_sum = 0;
-  float loss_rpn_bbox_sum = 0;
-  float loss_mrcnn_class_sum = 0;
-  float loss_mrcnn_bbox_sum = 0;
-  float loss_mrcnn_mask_sum = 0;
-  uint32_t step = 0;
-
-  optimizer.zero_grad();
-  optimizer_bn.zero_grad();
+std::tuple<CocoEvalStats, CocoEvalStats> MaskRCNNImpl::EvaluateEpoch(
+    const CocoLoader& loader,
+    uint32_t images_num) {
+  CocoEvaluator evaluator;
+  const double mask_threshold = 0.5;
+  images_num = std::min(images_num, loader.GetImagesCount());
+  for (uint32_t i = 0; i < images_num; ++i) {
+    // Loaded images always have annotations
+    auto ground_truth = loader.GetGroundTruth(i);
+    if (ground_truth.empty())
+      continue;
+    auto image_id = ground_truth.front().image_id;
+    for (auto& instance : ground_truth)
+      evaluator.AddGroundTruth(std::move(instance));
+
+    // Images are detected one by one, they have different shapes without
+    // padding
+    std::vector<cv::Mat> images{loader.GetImageData(i)};
+    auto [molded_images, image_metas, windows] = MoldInputs(images, *config_);
+    if (config_->gpu_count > 0)
+      molded_images = molded_images.cuda();
+    auto [detections, mrcnn_mask] = Detect(molded_images, image_metas);
+    if (is_empty(detections))
+      continue;
+    auto [boxes, class_ids, scores, masks] = UnmoldDetectionsPacked(
+        detections[0], mrcnn_mask[0], images[0].size(), windows[0],
+        mask_threshold);
+    auto boxes_data = boxes.contiguous();
+    const auto* box = boxes_data.data<int32_t>();
+    for (size_t n = 0; n < masks.size(); ++n, box += 4) {
+      CocoInstance instance;
+      instance.image_id = image_id;
+      auto index = static_cast<int64_t>(n);
+      instance.class_id =
+          static_cast<int32_t>(class_ids[index].item<int64_t>());
+      instance.score = scores[index].item<float>();
+      instance.box[0] = static_cast<float>(box[1]);
+      instance.box[1] = static_cast<float>(box[0]);
+      instance.box[2] = static_cast<float>(box[3] - box[1]);
+      instance.box[3] = static_cast<float>(box[2] - box[0]);
+      instance.mask =
+          PackedMaskToRle(masks[n], images[0].rows, images[0].cols);
+      evaluator.AddDetection(std::move(instance));
+    }
+  }
+  return {evaluator.Evaluate(CocoIouType::BBox),
+          evaluator.Evaluate(CocoIouType::Segm)};
+}
 
-  for (auto input : datagenerator) {
-    ++batch_count;
-    assert(input.size() == 1);
+std::tuple<at::Tensor, double> MaskRCNNImpl::TrainBatch(
+    SamplePrefetcher& datagenerator,
+    LossScaler* loss_scaler,
+    uint32_t images_num,
+    float loss_weight) {
+  std::vector<at::Tensor> images_list, rpn_match_list, rpn_bbox_list;
+  std::vector<at::Tensor> gt_class_ids_list, gt_boxes_list, gt_masks_list;
+  std::vector<Window> windows;
+  std::chrono::duration<double> data_wait(0);
+  for (uint32_t i = 0; i < images_num; ++i) {
+    auto wait_start = std::chrono::steady_clock::now();
+    auto input = datagenerator.Next();
+    data_wait += std::chrono::steady_clock::now() - wait_start;
 
     // Wrap input in variables
-    auto images = input[0].data.image;
-    auto rpn_match = input[0].target.rpn_match;
-    auto rpn_bbox = input[0].target.rpn_bbox;
-    auto gt_class_ids = input[0].target.gt_class_ids;
-    auto gt_boxes = input[0].target.gt_boxes;
-    auto gt_masks = input[0].target.gt_masks;
-
-    // To GPU
+    auto images = input.data.image;
+    auto rpn_match = input.target.rpn_match;
+    auto rpn_bbox = input.target.rpn_bbox;
+    auto gt_class_ids = input.target.gt_class_ids;
+    auto gt_boxes = input.target.gt_boxes;
+    auto gt_masks = input.target.gt_masks;
+
+    // To GPU, does nothing for tensors already copied by the loader
     if (config_->gpu_count > 0) {
       images = images.cuda();
       rpn_match = rpn_match.cuda();
@@ -265,97 +749,233 @@ std::tuple<float, float, float, float, float, float> MaskRCNNImpl::TrainEpoch(
       gt_masks = gt_masks.cuda();
     }
 
-    // Run object detection
-    auto [rpn_class_logits, rpn_pred_bbox, target_class_ids, mrcnn_class_logits,
-          target_deltas, mrcnn_bbox, target_mask, mrcnn_mask] =
-        PredictTraining(images, gt_class_ids, gt_boxes, gt_masks);
+    images_list.push_back(images);
+    rpn_match_list.push_back(rpn_match);
+    rpn_bbox_list.push_back(rpn_bbox);
+    gt_class_ids_list.push_back(gt_class_ids);
+    gt_boxes_list.push_back(gt_boxes);
+    gt_masks_list.push_back(gt_masks);
+    windows.push_back(input.data.image_meta.window);
+  }
 
-    // Compute losses
-    auto [rpn_class_loss, rpn_bbox_loss, mrcnn_class_loss, mrcnn_bbox_loss,
-          mrcnn_mask_loss] =
-        ComputeLosses(rpn_match, rpn_bbox, rpn_class_logits, rpn_pred_bbox,
-                      target_class_ids, mrcnn_class_logits, target_deltas,
-                      mrcnn_bbox, target_mask, mrcnn_mask);
-    auto loss = rpn_class_loss + rpn_bbox_loss + mrcnn_class_loss +
-                mrcnn_bbox_loss + mrcnn_mask_loss;
+  // Samples of the batch have the same shape, only the number of GT
+  // instances differs
+  auto images = torch::cat(images_list, /*dim*/ 0);
+  AugmentBatch(images, windows, gt_class_ids_list, gt_boxes_list,
+               gt_masks_list, *config_);
+
+  // Built after the augmentation and before GT instances are padded for the
+  // batch
+  if (config_->rpn_targets_on_gpu) {
+    for (size_t i = 0; i < gt_boxes_list.size(); ++i) {
+      std::tie(rpn_match_list[i], rpn_bbox_list[i]) = BuildBatchRpnTargets(
+          Constants(images).anchors, gt_boxes_list[i], *config_);
+    }
+  }
+
+  auto rpn_match = torch::cat(rpn_match_list, /*dim*/ 0);
+  auto rpn_bbox = torch::cat(rpn_bbox_list, /*dim*/ 0);
+  auto gt_class_ids = CatPaddedInstances(gt_class_ids_list);
+  auto gt_boxes = CatPaddedInstances(gt_boxes_list);
+  auto gt_masks = CatPaddedInstances(gt_masks_list);
+
+  // Run object detection
+  auto [rpn_class_logits, rpn_pred_bbox, target_class_ids, mrcnn_class_logits,
+        target_deltas, mrcnn_bbox, target_mask, mrcnn_mask] =
+      PredictTraining(images, gt_class_ids, gt_boxes, gt_masks);
+
+  // Compute losses
+  auto [loss, loss_values] =
+      ComputeLosses(rpn_match, rpn_bbox, rpn_class_logits, rpn_pred_bbox,
+                    target_class_ids, mrcnn_class_logits, target_deltas,
+                    mrcnn_bbox, target_mask, mrcnn_mask);
+
+  // Backpropagation, gradients are accumulated until the optimizer step and
+  // clipped there
+  if (loss_scaler) {
+    (loss * (loss_weight * loss_scaler->Scale())).backward();
+  } else {
+    (loss * loss_weight).backward();
+  }
+
+  return {loss_values, data_wait.count()};
+}
+
+std::vector<at::Tensor> MaskRCNNImpl::TrainableParameters() {
+  std::vector<at::Tensor> trainable_params;
+  for (auto& param : parameters()) {
+    if (param.requires_grad())
+      trainable_params.push_back(param);
+  }
+  return trainable_params;
+}
 
-    // Backpropagation
-    loss.backward();
-    ClipGradNorm(parameters(), 5.0f);
-    if ((batch_count % config_->batch_size) == 0) {
+std::tuple<float, float, float, float, float, float> MaskRCNNImpl::TrainEpoch(
+    StatReporter& reporter,
+    std::vector<std::unique_ptr<SamplePrefetcher>>& datagenerators,
+    const std::vector<std::shared_ptr<MaskRCNNImpl>>& replicas,
+    torch::optim::SGD& optimizer,
+    torch::optim::SGD& optimizer_bn,
+    LossScaler* loss_scaler,
+    uint32_t steps) {
+  LossStat sum;
+  uint32_t step = 0;
+
+  // Each optimizer step processes the batch, every GPU takes its part in
+  // gradient_accumulation_steps forward passes of images_per_gpu images.
+  // Gradients are averaged over the images of the step.
+  const auto models_num = replicas.size() + 1;
+  const auto images_per_pass = std::max(config_->images_per_gpu, 1u);
+  const auto passes_num = std::max(config_->gradient_accumulation_steps, 1u);
+  const auto loss_weight = 1.f / static_cast<float>(passes_num * models_num);
+  const auto images_per_step =
+      images_per_pass * passes_num * static_cast<uint32_t>(models_num);
+  const auto stats_interval = std::max(config_->stats_interval, 1u);
+  auto params = TrainableParameters();
+  std::vector<std::vector<at::Tensor>> replica_params;
+  for (auto& replica : replicas)
+    replica_params.push_back(replica->TrainableParameters());
+
+  optimizer.zero_grad();
+  optimizer_bn.zero_grad();
+
+  // Device side losses and host timings of the steps not reported yet
+  std::vector<at::Tensor> pending_values;
+  std::vector<StepTiming> pending_timings;
+
+  while (step < steps) {
+    auto step_start = std::chrono::steady_clock::now();
+    std::vector<std::vector<at::Tensor>> values(models_num);
+    std::vector<double> data_waits(models_num, 0);
+    auto train_passes = [&](MaskRCNNImpl& model, size_t m) {
+      for (uint32_t i = 0; i < passes_num; ++i) {
+        auto [pass_values, data_wait] = model.TrainBatch(
+            *datagenerators[m], loss_scaler, images_per_pass, loss_weight);
+        values[m].push_back(pass_values);
+        data_waits[m] += data_wait;
+      }
+    };
+    if (replicas.empty()) {
+      train_passes(*this, 0);
+    } else {
+      // Replicas train in their own threads with their own current device.
+      // As soon as a replica finishes backward, its gradients are copied to
+      // the first GPU while other replicas are still computing.
+      std::vector<std::vector<at::Tensor>> replica_grads(replicas.size());
+      std::vector<std::exception_ptr> errors(models_num);
+      std::vector<std::thread> threads;
+      for (size_t m = 0; m < models_num; ++m) {
+        threads.emplace_back([&, m]() {
+          try {
+            at::DeviceGuard device_guard(
+                at::Device(at::kCUDA, static_cast<int16_t>(m)));
+            MaskRCNNImpl& model = m == 0 ? *this : *replicas[m - 1];
+            train_passes(model, m);
+            if (m > 0) {
+              replica_grads[m - 1] =
+                  FlattenGrads(replica_params[m - 1],
+                               at::Device(at::kCUDA, 0), kGradBucketBytes);
+            }
+          } catch (...) {
+            errors[m] = std::current_exception();
+          }
+        });
+      }
+      for (auto& thread : threads)
+        thread.join();
+      for (auto& error : errors) {
+        if (error)
+          std::rethrow_exception(error);
+      }
+
+      // All-reduce: sum gradients on the first GPU
+      for (auto& grads : replica_grads)
+        AddFlatGrads(params, grads, kGradBucketBytes);
+    }
+
+    if (loss_scaler) {
+      // Skip the step if gradients overflowed, the scale is reduced
+      if (loss_scaler->UnscaleGrads()) {
+        ClipGradNorm(loss_scaler->MasterParams(), 5.0f);
+        optimizer.step();
+        optimizer_bn.step();
+        loss_scaler->CopyMasterToModel();
+      }
+      loss_scaler->ZeroModelGrads();
+    } else {
+      ClipGradNorm(params, 5.0f);
       optimizer.step();
       optimizer.zero_grad();
 
       optimizer_bn.step();
       optimizer_bn.zero_grad();
-
-      batch_count = 0;
     }
 
-    // Progress
-    auto loss_ = loss.cpu().data<float>()[0];
-    auto loss_rpn_class = rpn_class_loss.cpu().data<float>()[0];
-    auto loss_rpn_bbox = rpn_bbox_loss.cpu().data<float>()[0];
-    auto loss_mrcnn_class = mrcnn_class_loss.cpu().data<float>()[0];
-    auto loss_mrcnn_bbox = mrcnn_bbox_loss.cpu().data<float>()[0];
-    auto loss_mrcnn_mask = mrcnn_mask_loss.cpu().data<float>()[0];
-    reporter.ReportTrainStep(
-        step, {loss_, loss_rpn_class, loss_rpn_bbox, loss_mrcnn_class,
-               loss_mrcnn_bbox, loss_mrcnn_mask});
-
-    // Statistics
-    loss_sum += loss_ / steps;
-    loss_rpn_class_sum += loss_rpn_class / steps;
-    loss_rpn_bbox_sum += loss_rpn_bbox / steps;
-    loss_mrcnn_class_sum += loss_mrcnn_class / steps;
-    loss_mrcnn_bbox_sum += loss_mrcnn_bbox / steps;
-    loss_mrcnn_mask_sum += loss_mrcnn_mask / steps;
+    // Updated weights are sent back to replicas
+    for (size_t r = 0; r < replicas.size(); ++r) {
+      BroadcastTensors(params, replica_params[r], kGradBucketBytes);
+      replicas[r]->zero_grad();
+    }
 
-    // Break after 'steps' steps
-    if (step == steps - 1)
-      break;
-    ++step;
+    // Losses of the step averaged over the passes, without waiting for the
+    // GPU. The step time is measured on the host, it matches the GPU time
+    // on average as the host can't run far ahead of the GPU.
+    std::vector<at::Tensor> step_values;
+    for (auto& model_values : values) {
+      for (auto& pass_values : model_values)
+        step_values.push_back(pass_values.to(values[0][0].device()));
+    }
+    pending_values.push_back(torch::stack(step_values).mean(0));
+    StepTiming timing;
+    timing.step_seconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - step_start)
+                              .count();
+    timing.data_wait_seconds =
+        *std::max_element(data_waits.begin(), data_waits.end());
+    timing.images = images_per_step;
+    pending_timings.push_back(timing);
+    step += images_per_step;
+
+    // Progress and statistics, read back every stats_interval steps. Steps
+    // are counted in images.
+    if (step >= steps || pending_values.size() >= stats_interval) {
+      auto stats = ReadLossStats(pending_values);
+      reporter.ReportMemory(MemoryStats(replicas));
+      auto first_step =
+          step - images_per_step * static_cast<uint32_t>(stats.size());
+      for (size_t i = 0; i < stats.size(); ++i) {
+        reporter.ReportTrainStep(
+            first_step + images_per_step * static_cast<uint32_t>(i), stats[i],
+            pending_timings[i]);
+        AddLossStat(sum, stats[i], static_cast<float>(images_per_step));
+      }
+      pending_values.clear();
+      pending_timings.clear();
+    }
   }
 
-  return {loss_sum,
-          loss_rpn_class_sum,
-          loss_rpn_bbox_sum,
-          loss_mrcnn_class_sum,
-          loss_mrcnn_bbox_sum,
-          loss_mrcnn_mask_sum};
-}
-
-std::tuple<torch::Tensor,
-           torch::Tensor,
-           torch::Tensor,
-           torch::Tensor,
-           torch::Tensor>
-MaskRCNNImpl::ComputeLosses(torch::Tensor rpn_match,
-                            torch::Tensor rpn_bbox,
-                            torch::Tensor rpn_class_logits,
-                            torch::Tensor rpn_pred_bbox,
-                            torch::Tensor target_class_ids,
-                            torch::Tensor mrcnn_class_logits,
-                            torch::Tensor target_deltas,
-                            torch::Tensor mrcnn_bbox,
-                            torch::Tensor target_mask,
-                            torch::Tensor mrcnn_mask) {
-  auto rpn_class_loss = ComputeRpnClassLoss(rpn_match, rpn_class_logits);
-  auto rpn_bbox_loss = ComputeRpnBBoxLoss(rpn_bbox, rpn_match, rpn_pred_bbox);
-  auto mrcnn_class_loss =
-      ComputeMrcnnClassLoss(target_class_ids, mrcnn_class_logits);
-  auto mrcnn_bbox_loss =
-      ComputeMrcnnBBoxLoss(target_deltas, target_class_ids, mrcnn_bbox);
-  auto mrcnn_mask_loss =
-      ComputeMrcnnMaskLoss(target_mask, target_class_ids, mrcnn_mask);
-
-  return {rpn_class_loss, rpn_bbox_loss, mrcnn_class_loss, mrcnn_bbox_loss,
-          mrcnn_mask_loss};
+  // Averaged over the trained images
+  LossStat mean;
+  AddLossStat(mean, sum, 1.f / static_cast<float>(step));
+  return {mean.loss,
+          mean.loss_rpn_class,
+          mean.loss_rpn_bbox,
+          mean.loss_mrcnn_class,
+          mean.loss_mrcnn_bbox,
+          mean.loss_mrcnn_mask};
 }
 
 std::tuple<std::vector<at::Tensor>, at::Tensor, at::Tensor, at::Tensor>
 MaskRCNNImpl::PredictRPN(at::Tensor images, int64_t proposal_count) {
+  if (config_->mixed_precision)
+    images = images.to(at::kHalf);
+
+  // Only the inference pipeline is profiled
+  auto* profiler = is_training() ? nullptr : profiler_.get();
+
   // Feature extraction
+  std::optional<StageProfiler::Scope> scope;
+  scope.emplace(profiler, "fpn");
   auto [p2_out, p3_out, p4_out, p5_out, p6_out] = fpn_->forward(images);
 
   // Note that P6 is used in RPN, but not in the classifier heads.
@@ -367,6 +987,7 @@ MaskRCNNImpl::PredictRPN(at::Tensor images, int64_t proposal_count) {
   std::vector<at::Tensor> rpn_class_logits;
   std::vector<at::Tensor> rpn_class;
   std::vector<at::Tensor> rpn_bbox;
+  scope.emplace(profiler, "rpn");
   for (auto p : rpn_feature_maps) {
     auto [class_logits, probs, bbox] = rpn_->forward(p);
     rpn_class_logits.push_back(class_logits);
@@ -376,13 +997,17 @@ MaskRCNNImpl::PredictRPN(at::Tensor images, int64_t proposal_count) {
 
   // Generate proposals
   // Proposals are [batch, N, (y1, x1, y2, x2)] in normalized coordinates
-  // and zero padded.
-  auto scores = torch::cat(rpn_class, 1);
-  auto deltas = torch::cat(rpn_bbox, 1);
+  // and zero padded. RPN outputs are converted to float in mixed precision
+  // mode, the proposals and losses are computed in float.
+  auto scores = torch::cat(rpn_class, 1).to(at::kFloat);
+  auto deltas = torch::cat(rpn_bbox, 1).to(at::kFloat);
+  scope.emplace(profiler, "proposal_layer");
   auto rpn_rois = ProposalLayer({scores, deltas}, proposal_count,
-                                config_->rpn_nms_threshold, anchors_, *config_);
+                                config_->rpn_nms_threshold, Constants(images),
+                                *config_);
+  scope.reset();
 
-  auto class_logits = torch::cat(rpn_class_logits, 1);
+  auto class_logits = torch::cat(rpn_class_logits, 1).to(at::kFloat);
   return {mrcnn_feature_maps, rpn_rois, class_logits, deltas};
 }
 
@@ -410,6 +1035,16 @@ MaskRCNNImpl::PredictTraining(at::Tensor images,
   auto [mrcnn_feature_maps, rpn_rois, rpn_class_logits, rpn_bbox] =
       PredictRPN(images, config_->post_nms_rois_training);
 
+  // Pad proposals to the fixed count, like in inference, so the detection
+  // targets are computed for the same shapes every step
+  auto& arena = Arena(images);
+  auto count = std::max(config_->post_nms_rois_training, rpn_rois.size(1));
+  auto padded_rois =
+      arena.Get("proposals", {rpn_rois.size(0), count, 4}, at::kFloat);
+  padded_rois.narrow(1, 0, rpn_rois.size(1)).copy_(rpn_rois);
+  padded_rois.narrow(1, rpn_rois.size(1), count - rpn_rois.size(1)).zero_();
+  rpn_rois = padded_rois;
+
   // Debug block
   //  auto d = torch::tensor({512, 512, 512, 512}, at::dtype(at::kFloat));
   //  VisualizeBoxes("rpn_targets", 512, 512,
@@ -418,13 +1053,10 @@ MaskRCNNImpl::PredictTraining(at::Tensor images,
   // exit(0);
 
   // Normalize coordinates
-  auto h = static_cast<float>(config_->image_shape[0]);
-  auto w = static_cast<float>(config_->image_shape[1]);
-  auto scale =
-      torch::tensor({h, w, h, w}, at::dtype(at::kFloat).requires_grad(false));
-  if (config_->gpu_count > 0)
-    scale = scale.cuda();
-  gt_boxes = gt_boxes / scale;
+  const auto& constants = Constants(images);
+  std::vector<int32_t> image_shape = {constants.image_height,
+                                      constants.image_width};
+  gt_boxes = gt_boxes / constants.image_scale;
 
   // Generate detection targets
   // Subsamples proposals and generates target outputs for training
@@ -432,36 +1064,30 @@ MaskRCNNImpl::PredictTraining(at::Tensor images,
   // padded. Equally, returned rois and targets are zero padded.
   auto [rois, target_class_ids, target_deltas, target_mask] =
       DetectionTargetLayer(*config_, rpn_rois, gt_class_ids, gt_boxes,
-                           gt_masks);
+                           gt_masks, &arena);
 
   // Debug block
   //  VisualizeBoxes("proposals", 512, 512, rois.squeeze().cpu() * d,
   //                 gt_boxes.squeeze().cpu() * d);
   //  exit(0);
 
-  auto mrcnn_class_logits = torch::empty({}, at::dtype(at::kFloat));
-  auto mrcnn_class = torch::empty({}, at::dtype(at::kInt));
-  auto mrcnn_bbox = torch::empty({}, at::dtype(at::kFloat));
-  auto mrcnn_mask = torch::empty({}, at::dtype(at::kFloat));
-  if (config_->gpu_count > 0) {
-    mrcnn_class_logits = mrcnn_class_logits.cuda();
-    mrcnn_class = mrcnn_class.cuda();
-    mrcnn_bbox = mrcnn_bbox.cuda();
-    mrcnn_mask = mrcnn_mask.cuda();
-  }
+  // Network Heads, rois always have train_rois_per_image rows per image
+  // Proposal classifier and BBox regressor heads, outputs are
+  // [batch * rois, ...]
+  auto [mrcnn_class_logits, mrcnn_class, mrcnn_bbox] =
+      classifier_->forward(mrcnn_feature_maps, rois, image_shape);
+  mrcnn_class_logits = mrcnn_class_logits.to(at::kFloat);
+  mrcnn_bbox = mrcnn_bbox.to(at::kFloat);
 
-  if (!is_empty(rois)) {
-    // Network Heads
-    // Proposal classifier and BBox regressor heads
-    std::tie(mrcnn_class_logits, mrcnn_class, mrcnn_bbox) =
-        classifier_->forward(mrcnn_feature_maps, rois);
+  // Create masks for detections
+  auto mrcnn_mask =
+      mask_->forward(mrcnn_feature_maps, rois, image_shape).to(at::kFloat);
 
-    // Add back batch dimension
-    rois = rois.unsqueeze(0);
-
-    // Create masks for detections
-    mrcnn_mask = mask_->forward(mrcnn_feature_maps, rois);
-  }
+  // Targets are flattened in the same way for the losses
+  target_class_ids = target_class_ids.view({-1});
+  target_deltas = target_deltas.view({-1, 4});
+  target_mask =
+      target_mask.view({-1, target_mask.size(2), target_mask.size(3)});
 
   return {rpn_class_logits, rpn_bbox,   target_class_ids, mrcnn_class_logits,
           target_deltas,    mrcnn_bbox, target_mask,      mrcnn_mask};
@@ -469,45 +1095,89 @@ MaskRCNNImpl::PredictTraining(at::Tensor images,
 
 std::tuple<at::Tensor, at::Tensor> MaskRCNNImpl::PredictInference(
     at::Tensor images,
-    const std::vector<ImageMeta>& image_metas) {
+    const std::vector<ImageMeta>& image_metas,
+    bool boxes_only) {
   eval();
 
+  auto [mrcnn_feature_maps, rpn_rois] = PredictProposals(images);
+  return PredictHeads(*config_, classifier_, mask_, mrcnn_feature_maps,
+                      rpn_rois, image_metas, Constants(images), boxes_only,
+                      profiler_.get());
+}
+
+std::tuple<std::vector<at::Tensor>, at::Tensor>
+MaskRCNNImpl::PredictProposals(at::Tensor images) {
   auto [mrcnn_feature_maps, rpn_rois, rpn_class_logits, rpn_bbox] =
-      PredictRPN(images, config_->post_nms_rois_inference);
+      PredictRPN(images, proposal_count_);
+  if (config_->channels_last_features && images.is_cuda()) {
+    for (auto& feature_map : mrcnn_feature_maps)
+      feature_map = ToChannelsLast(feature_map);
+  }
 
+  // Pad proposals to the fixed count, so shapes of the heads don't depend on
+  // the NMS results, padding rows are filtered out by the detection layer
+  auto padding_count = proposal_count_ - rpn_rois.size(1);
+  if (padding_count > 0) {
+    auto padding = torch::zeros({rpn_rois.size(0), padding_count, 4},
+                                rpn_rois.options());
+    rpn_rois = torch::cat({rpn_rois, padding}, 1);
+  }
+  return {mrcnn_feature_maps, rpn_rois};
+}
+
+std::tuple<at::Tensor, at::Tensor> MaskRCNNImpl::PredictHeads(
+    const Config& config,
+    Classifier& classifier,
+    Mask& mask,
+    const std::vector<at::Tensor>& mrcnn_feature_maps,
+    at::Tensor rpn_rois,
+    const std::vector<ImageMeta>& image_metas,
+    const LayerConstants& constants,
+    bool boxes_only,
+    StageProfiler* profiler) {
   // Network Heads
   // Proposal classifier and BBox regressor heads
-  auto [mrcnn_class_logits, mrcnn_class, mrcnn_bbox] =
-      classifier_->forward(mrcnn_feature_maps, rpn_rois);
+  std::vector<int32_t> image_shape = {constants.image_height,
+                                      constants.image_width};
+  std::optional<StageProfiler::Scope> scope;
+  scope.emplace(profiler, "classifier");
+  auto [mrcnn_class_logits, mrcnn_class, mrcnn_bbox] = classifier->forward(
+      mrcnn_feature_maps, rpn_rois, image_shape, profiler);
+  mrcnn_class = mrcnn_class.to(at::kFloat);
+  mrcnn_bbox = mrcnn_bbox.to(at::kFloat);
 
   // Detections
   // output is [batch, num_detections, (y1, x1, y2, x2, class_id, score)] in
   // image coordinates
-  at::Tensor detections = DetectionLayer(*config_.get(), rpn_rois, mrcnn_class,
-                                         mrcnn_bbox, image_metas);
+  scope.emplace(profiler, "detection_layer");
+  at::Tensor detections = DetectionLayer(config, constants, rpn_rois,
+                                         mrcnn_class, mrcnn_bbox, image_metas);
+  if (HasInferenceLimits(config, boxes_only) && !is_empty(detections))
+    detections = LimitDetections(detections, config, boxes_only);
+  scope.reset();
 
   auto mrcnn_mask = torch::empty({0}, at::dtype(at::kFloat));
-  if (!is_empty(detections)) {
+  if (boxes_only && !is_empty(detections)) {
+    // Masks have no rows, they are indexed per image as usual
+    mrcnn_mask = torch::zeros(
+        {detections.size(0), 0, static_cast<int64_t>(config.num_classes),
+         config.mask_shape[0], config.mask_shape[1]},
+        detections.options());
+  } else if (!is_empty(detections)) {
     // Convert boxes to normalized coordinates
-    auto h = static_cast<float>(config_->image_shape[0]);
-    auto w = static_cast<float>(config_->image_shape[1]);
-
-    auto scale =
-        torch::tensor({h, w, h, w}, at::dtype(at::kFloat).requires_grad(false));
-
-    if (config_->gpu_count > 0)
-      scale = scale.cuda();
-    auto detection_boxes = detections.narrow(1, 0, 4) / scale;
-
-    // Add back batch dimension
-    detection_boxes = detection_boxes.unsqueeze(0);
+    // [batch, num_detections, (y1, x1, y2, x2)]
+    auto detection_boxes = detections.narrow(2, 0, 4) / constants.image_scale;
 
     // Create masks for detections
-    mrcnn_mask = mask_->forward(mrcnn_feature_maps, detection_boxes);
-
-    // Add back batch dimension
-    detections = detections.unsqueeze(0);
-    mrcnn_mask = mrcnn_mask.unsqueeze(0);
+    StageProfiler::Scope mask_scope(profiler, "mask");
+    mrcnn_mask = mask->forward(mrcnn_feature_maps, detection_boxes,
+                               image_shape, profiler)
+                     .to(at::kFloat);
+
+    // Restore batch dimension
+    mrcnn_mask = mrcnn_mask.view({detections.size(0), detections.size(1),
+                                  mrcnn_mask.size(1), mrcnn_mask.size(2),
+                                  mrcnn_mask.size(3)});
   }
   return {detections, mrcnn_mask};
 }
@@ -540,29 +1210,20 @@ void MaskRCNNImpl::Build() {
   // Top-down Layers
   // TODO: (Legacy)add assert to varify feature map sizes match what's in config
   fpn_ = FPN(C1, C2, C3, C4, C5, /*out_channels*/ 256);
+  fpn_->SetGradientCheckpointing(config_->gradient_checkpointing);
   register_module("fpn", fpn_);
 
-  anchors_ = GeneratePyramidAnchors(
-      config_->rpn_anchor_scales, config_->rpn_anchor_ratios,
-      config_->backbone_shapes, config_->backbone_strides,
-      config_->rpn_anchor_stride);
-
-  if (config_->gpu_count > 0)
-    anchors_ = anchors_.toBackend(torch::Backend::CUDA);
-
   // RPN
   rpn_ =
       RPN(config_->rpn_anchor_ratios.size(), config_->rpn_anchor_stride, 256);
   register_module("rpn", rpn_);
 
   // FPN Classifier
-  classifier_ = Classifier(256, config_->pool_size, config_->image_shape,
-                           config_->num_classes);
+  classifier_ = Classifier(256, config_->pool_size, config_->num_classes);
   register_module("classifier", classifier_);
 
   // FPN Mask
-  mask_ = Mask(256, config_->mask_pool_size, config_->image_shape,
-               config_->num_classes);
+  mask_ = Mask(256, config_->mask_pool_size, config_->num_classes);
   register_module("mask", mask_);
 
   // Fix batch norm layers
@@ -619,9 +1280,58 @@ void MaskRCNNImpl::SetTrainableLayers(const std::string& layers_regex) {
       param.value().set_requires_grad(false);
     }
   }
+  fpn_->UpdateFrozenStages();
 }
 
 std::string MaskRCNNImpl::GetCheckpointPath(uint32_t epoch) const {
   return fs::path(model_dir_) /
          ("checkpoint_epoch_" + std::to_string(epoch) + ".pt");
 }
+
+const LayerConstants& MaskRCNNImpl::Constants(const at::Tensor& images) {
+  auto height = images.size(2);
+  auto width = images.size(3);
+  auto& constants = constants_[{height, width}];
+  if (!constants.anchors.defined()) {
+    constants = BuildLayerConstants(*config_, static_cast<int32_t>(height),
+                                    static_cast<int32_t>(width));
+  }
+  return constants;
+}
+
+StepArena& MaskRCNNImpl::Arena(const at::Tensor& images) {
+  if (!arena_) {
+    arena_ = std::make_unique<StepArena>(images.device());
+    arena_->Reserve("proposals",
+                    {images.size(0), config_->post_nms_rois_training, 4},
+                    at::kFloat);
+    ReserveDetectionTargets(*config_, *arena_);
+  }
+  return *arena_;
+}
+
+MemoryStat MaskRCNNImpl::MemoryStats(
+    const std::vector<std::shared_ptr<MaskRCNNImpl>>& replicas) const {
+  MemoryStat stat;
+  for (uint32_t d = 0; d < config_->gpu_count; ++d) {
+    auto device = static_cast<int>(d);
+    stat.allocated += static_cast<int64_t>(
+        THCCachingAllocator_currentMemoryAllocated(device));
+    stat.peak_allocated += static_cast<int64_t>(
+        THCCachingAllocator_maxMemoryAllocated(device));
+    stat.cached +=
+        static_cast<int64_t>(THCCachingAllocator_currentMemoryCached(device));
+    stat.peak_cached +=
+        static_cast<int64_t>(THCCachingAllocator_maxMemoryCached(device));
+  }
+  auto add_arena = [&stat](const std::unique_ptr<StepArena>& arena) {
+    if (arena) {
+      stat.arena_reserved += arena->ReservedBytes();
+      stat.arena_grows += arena->GrowCount();
+    }
+  };
+  add_arena(arena_);
+  for (auto& replica : replicas)
+    add_arena(replica->arena_);
+  return stat;
+}
@@ -6,29 +6,94 @@
 #include "config.h"
 #include "fpn.h"
 #include "imageutils.h"
+#include "layerconstants.h"
+#include "lossscaler.h"
 #include "mask.h"
 #include "rpn.h"
+#include "sampleprefetcher.h"
+#include "stageprofiler.h"
 #include "statreporter.h"
+#include "steparena.h"
 
 #include <torch/torch.h>
+#include <functional>
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
+
+/* Classifier and mask heads of one class set. Parameters are named as the
+ * heads of MaskRCNNImpl, so LoadStateDict reads them from the checkpoint of
+ * the whole fine-tuned model. config sets num_classes and the inference
+ * limits of the set, the other settings are the ones of the model.
+ */
+class HeadSetImpl : public torch::nn::Module {
+ public:
+  explicit HeadSetImpl(std::shared_ptr<Config const> config);
+
+  std::shared_ptr<Config const> config;
+  Classifier classifier{nullptr};
+  Mask mask{nullptr};
+};
+
+TORCH_MODULE(HeadSet);
 
 class MaskRCNNImpl : public torch::nn::Module {
  public:
   MaskRCNNImpl(std::string model_dir, std::shared_ptr<Config const> config);
 
   /* Runs the detection pipeline.
-   * images: List of images, potentially of different sizes.
-   * Returns a list of dicts, one dict per image. The dict contains:
-   *      rois: [N, (y1, x1, y2, x2)] detection bounding boxes
-   *      class_ids: [N] int class IDs
-   *      scores: [N] float probability scores for the class IDs
-   *      masks: [H, W, N] instance binary masks
+   * images: [batch, channels, height, width] molded images, see MoldInputs.
+   * image_metas: one meta per image in the batch.
+   * Returns a tuple:
+   *      detections: [batch, N, (y1, x1, y2, x2, class_id, score)] zero
+   *                  padded to the largest number of detections in batch
+   *      masks: [batch, N, height, width, num_classes] masks, with no
+   *             rows if boxes_only or Config::inference_boxes_only is set
+   * Tensors stay on the device of the model, UnmoldDetections pastes masks
+   * there and copies only compact results to the host.
    */
 
   std::tuple<at::Tensor, at::Tensor> Detect(
       at::Tensor images,
-      const std::vector<ImageMeta>& image_metas);
+      const std::vector<ImageMeta>& image_metas,
+      bool boxes_only = false);
+
+  /* Prepares the model for serving. Runs detection on steps random images,
+   * all shapes of the inference pipeline are fixed, so cuDNN benchmarks
+   * convolution algorithms and the caching allocator reserves memory of the
+   * whole pipeline once, before the first real request.
+   * With Config::fold_batch_norm backbone batch norms are folded into the
+   * convolutions, after that the model is for inference only.
+   */
+  void WarmUp(uint32_t steps = 2);
+
+  /* Attaches the heads of another class set to the backbone and RPN of the
+   * model, for serving several variants fine-tuned from the same frozen
+   * backbone. Attach the heads before the model is moved to the GPU, or
+   * move them to the device of the model first. Returns the index of the set
+   * in the DetectHeads results, the own heads of the model are the set 0.
+   */
+  size_t AddHeads(HeadSet heads);
+
+  // Proposals of the inference, Config::post_nms_rois_inference by default.
+  // Every count is a new shape for the heads, WarmUp warms up the counts of
+  // ProposalCounts when Config::inference_latency_slo_ms is set.
+  void SetProposalCount(int64_t count);
+  size_t HeadsNum() const { return head_sets_.size() + 1; }
+
+  /* Detect for all head sets. The backbone and RPN run once, then the heads
+   * of every set run on their own thread and CUDA stream. Returns detections
+   * and masks of each set, as Detect returns them.
+   */
+  std::vector<std::tuple<at::Tensor, at::Tensor>> DetectHeads(
+      at::Tensor images,
+      const std::vector<ImageMeta>& image_metas,
+      bool boxes_only = false);
+
+  // Stage timings of Detect, nullptr if Config::profile_inference is off.
+  // Callers can time their own stages, from the thread running Detect.
+  StageProfiler* Profiler() { return profiler_.get(); }
 
   /*
    * Train the model.
@@ -52,33 +117,120 @@ class MaskRCNNImpl : public torch::nn::Module {
              double learning_rate,
              uint32_t epochs,
              std::string layers_regex);
+  // Trains on the samples streamed from the shard files, see ShardStream,
+  // every GPU reads its own part of the shards. Shape grouping isn't
+  // supported, so the image padding has to be on for several images per GPU.
+  void Train(std::vector<std::string> train_shards,
+             CocoDataset val_dataset,
+             double learning_rate,
+             uint32_t epochs,
+             std::string layers_regex);
+  // Images per second of the training with the loader and batch settings of
+  // the config, and the memory taken, for the tuning of the settings. One
+  // warm-up step is followed by the timed steps of images images. The
+  // optimizer has no learning rate, so the weights don't change.
+  std::tuple<double, MemoryStat> MeasureTraining(CocoDataset train_dataset,
+                                                 uint32_t images,
+                                                 const std::string& layers);
+  std::tuple<double, MemoryStat> MeasureTraining(
+      std::vector<std::string> train_shards,
+      uint32_t images,
+      const std::string& layers);
 
  private:
+  // Makes the train loader of the GPU shard, samples of one step on a GPU
+  // are group_size samples of the same shape
+  using TrainLoaderFactory =
+      std::function<std::unique_ptr<SamplePrefetcher>(uint32_t shard,
+                                                      uint32_t shards_num,
+                                                      uint32_t group_size)>;
+  // Loaders read the worker and prefetch settings of the config when
+  // they are made
+  TrainLoaderFactory LoaderFactory(CocoDataset train_dataset) const;
+  TrainLoaderFactory LoaderFactory(std::vector<std::string> train_shards) const;
+  std::vector<std::unique_ptr<SamplePrefetcher>> MakeTrainLoaders(
+      const TrainLoaderFactory& make_train_loader,
+      uint32_t shards_num) const;
+  void TrainLoop(const TrainLoaderFactory& make_train_loader,
+                 CocoDataset val_dataset,
+                 double learning_rate,
+                 uint32_t epochs,
+                 std::string layers_regex);
+  std::tuple<double, MemoryStat> MeasureLoop(
+      const TrainLoaderFactory& make_train_loader,
+      uint32_t images,
+      const std::string& layers);
+  // Regular expression of the predefined layer sets like "heads" or "4+",
+  // other values are taken as regular expressions
+  static std::string LayersRegex(const std::string& layers);
+  // Replicas of the model on the GPUs 1, 2, ... with the same trainable
+  // layers
+  std::vector<std::shared_ptr<MaskRCNNImpl>> MakeReplicas(
+      const std::string& layers_regex);
   void Build();
   void InitializeWeights();
   void SetTrainableLayers(const std::string& layers_regex);
   std::string GetCheckpointPath(uint32_t epoch) const;
+  // Constants of the proposal and detection layers for the shape of images,
+  // built on the first use of the shape
+  const LayerConstants& Constants(const at::Tensor& images);
+  // Buffers for the training step temporaries on the device of images,
+  // reserved on the first use
+  StepArena& Arena(const at::Tensor& images);
+  // Memory of the caching allocator on all GPUs of the model and arenas
+  MemoryStat MemoryStats(
+      const std::vector<std::shared_ptr<MaskRCNNImpl>>& replicas) const;
+  std::vector<at::Tensor> TrainableParameters();
+  // Forward and backward pass for a batch of images_num samples of the same
+  // shape, gradients of the loss multiplied by loss_weight are accumulated.
+  // Returns the losses as returned by ComputeLosses, still on the device,
+  // and seconds waited for the samples.
+  std::tuple<at::Tensor, double> TrainBatch(SamplePrefetcher& datagenerator,
+                                            LossScaler* loss_scaler,
+                                            uint32_t images_num,
+                                            float loss_weight);
+  // replicas: model replicas on the GPUs 1, 2, ..., datagenerators has one
+  // loader for each GPU
   std::tuple<float, float, float, float, float, float> TrainEpoch(
       StatReporter& reporter,
-      torch::data::DataLoader<CocoDataset,
-                              torch::data::samplers::RandomSampler>&
-          datagenerator,
+      std::vector<std::unique_ptr<SamplePrefetcher>>& datagenerators,
+      const std::vector<std::shared_ptr<MaskRCNNImpl>>& replicas,
       torch::optim::SGD& optimizer,
       torch::optim::SGD& optimizer_bn,
+      LossScaler* loss_scaler,
       uint32_t steps);
   std::tuple<float, float, float, float, float, float> ValidEpoch(
       StatReporter& reporter,
-      torch::data::DataLoader<CocoDataset,
-                              torch::data::samplers::RandomSampler>&
-          datagenerator,
+      SamplePrefetcher& datagenerator,
       uint32_t steps);
+  // COCO box and mask metrics of the detections on the first images_num
+  // images of the loader
+  std::tuple<CocoEvalStats, CocoEvalStats> EvaluateEpoch(
+      const CocoLoader& loader,
+      uint32_t images_num);
 
   std::tuple<std::vector<at::Tensor>, at::Tensor, at::Tensor, at::Tensor>
   PredictRPN(at::Tensor images, int64_t proposal_count);
 
   std::tuple<at::Tensor, at::Tensor> PredictInference(
       at::Tensor images,
-      const std::vector<ImageMeta>& image_metas);
+      const std::vector<ImageMeta>& image_metas,
+      bool boxes_only);
+  // Backbone and RPN part of the inference, returns the feature maps of the
+  // heads and the proposals padded to the proposal count
+  std::tuple<std::vector<at::Tensor>, at::Tensor> PredictProposals(
+      at::Tensor images);
+  // Heads part of the inference for the class set of config
+  std::tuple<at::Tensor, at::Tensor> PredictHeads(
+      const Config& config,
+      Classifier& classifier,
+      Mask& mask,
+      const std::vector<at::Tensor>& mrcnn_feature_maps,
+      at::Tensor rpn_rois,
+      const std::vector<ImageMeta>& image_metas,
+      const LayerConstants& constants,
+      bool boxes_only,
+      StageProfiler* profiler);
 
   std::tuple<at::Tensor,
              at::Tensor,
@@ -93,31 +245,21 @@ class MaskRCNNImpl : public torch::nn::Module {
                   at::Tensor gt_boxes,
                   at::Tensor gt_masks);
 
-  std::tuple<torch::Tensor,
-             torch::Tensor,
-             torch::Tensor,
-             torch::Tensor,
-             torch::Tensor>
-  ComputeLosses(torch::Tensor rpn_match,
-                torch::Tensor rpn_bbox,
-                torch::Tensor rpn_class_logits,
-                torch::Tensor rpn_pred_bbox,
-                torch::Tensor target_class_ids,
-                torch::Tensor mrcnn_class_logits,
-                torch::Tensor target_deltas,
-                torch::Tensor mrcnn_bbox,
-                torch::Tensor target_mask,
-                torch::Tensor mrcnn_mask);
-
  private:
   std::string model_dir_;
   std::shared_ptr<Config const> config_;
 
   FPN fpn_{nullptr};
-  torch::Tensor anchors_;
+  // Keyed by (height, width) of the input
+  std::map<std::pair<int64_t, int64_t>, LayerConstants> constants_;
+  std::unique_ptr<StepArena> arena_;
+  std::unique_ptr<StageProfiler> profiler_;
   RPN rpn_{nullptr};
   Classifier classifier_{nullptr};
   Mask mask_{nullptr};
+  // Class sets attached with AddHeads
+  std::vector<HeadSet> head_sets_;
+  int64_t proposal_count_{0};
 };
 
 TORCH_MODULE(MaskRCNN);
@@ -0,0 +1,157 @@
+#include "metricsexporter.h"
+
+#include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/writer.h>
+
+#include <cstdio>
+#include <stdexcept>
+
+namespace {
+double SamplesPerSecond(const StepTiming& timing) {
+  return timing.step_seconds > 0 ? timing.images / timing.step_seconds : 0;
+}
+}  // namespace
+
+MetricsExporter::MetricsExporter(const std::string& dir)
+    : prom_path_(dir + "/metrics.prom"),
+      json_lines_(dir + "/metrics.jsonl", std::ios::app) {
+  if (!json_lines_)
+    throw std::runtime_error("Failed to open metrics file in " + dir);
+}
+
+void MetricsExporter::WriteStep(uint32_t epoch,
+                                uint32_t step,
+                                const LossStat& stat,
+                                const StepTiming& timing,
+                                const MemoryStat& memory) {
+  rapidjson::OStreamWrapper stream(json_lines_);
+  rapidjson::Writer<rapidjson::OStreamWrapper> writer(stream);
+  writer.StartObject();
+  writer.Key("epoch");
+  writer.Uint(epoch);
+  writer.Key("step");
+  writer.Uint(step);
+  writer.Key("loss");
+  writer.Double(static_cast<double>(stat.loss));
+  writer.Key("loss_rpn_class");
+  writer.Double(static_cast<double>(stat.loss_rpn_class));
+  writer.Key("loss_rpn_bbox");
+  writer.Double(static_cast<double>(stat.loss_rpn_bbox));
+  writer.Key("loss_mrcnn_class");
+  writer.Double(static_cast<double>(stat.loss_mrcnn_class));
+  writer.Key("loss_mrcnn_bbox");
+  writer.Double(static_cast<double>(stat.loss_mrcnn_bbox));
+  writer.Key("loss_mrcnn_mask");
+  writer.Double(static_cast<double>(stat.loss_mrcnn_mask));
+  writer.Key("step_seconds");
+  writer.Double(timing.step_seconds);
+  writer.Key("data_wait_seconds");
+  writer.Double(timing.data_wait_seconds);
+  writer.Key("samples_per_second");
+  writer.Double(SamplesPerSecond(timing));
+  writer.Key("gpu_allocated_bytes");
+  writer.Int64(memory.allocated);
+  writer.Key("gpu_peak_allocated_bytes");
+  writer.Int64(memory.peak_allocated);
+  writer.Key("gpu_cached_bytes");
+  writer.Int64(memory.cached);
+  writer.EndObject();
+  json_lines_ << "\n";
+
+  has_step_ = true;
+  flushed_ = false;
+  epoch_ = epoch;
+  step_ = step;
+  stat_ = stat;
+  timing_ = timing;
+  memory_ = memory;
+}
+
+void MetricsExporter::WriteEvaluation(uint32_t epoch,
+                                      const CocoEvalStats& bbox_stat,
+                                      const CocoEvalStats& segm_stat) {
+  rapidjson::OStreamWrapper stream(json_lines_);
+  rapidjson::Writer<rapidjson::OStreamWrapper> writer(stream);
+  auto write_stats = [&writer](const char* name, const CocoEvalStats& stat) {
+    writer.Key(name);
+    writer.StartObject();
+    writer.Key("ap");
+    writer.Double(stat.ap);
+    writer.Key("ap50");
+    writer.Double(stat.ap50);
+    writer.Key("ap75");
+    writer.Double(stat.ap75);
+    writer.Key("ap_small");
+    writer.Double(stat.ap_small);
+    writer.Key("ap_medium");
+    writer.Double(stat.ap_medium);
+    writer.Key("ap_large");
+    writer.Double(stat.ap_large);
+    writer.Key("ar1");
+    writer.Double(stat.ar1);
+    writer.Key("ar10");
+    writer.Double(stat.ar10);
+    writer.Key("ar100");
+    writer.Double(stat.ar100);
+    writer.EndObject();
+  };
+  writer.StartObject();
+  writer.Key("epoch");
+  writer.Uint(epoch);
+  writer.Key("eval");
+  writer.StartObject();
+  write_stats("bbox", bbox_stat);
+  write_stats("segm", segm_stat);
+  writer.EndObject();
+  writer.EndObject();
+  json_lines_ << "\n";
+  flushed_ = false;
+}
+
+void MetricsExporter::Flush() {
+  if (flushed_)
+    return;
+  json_lines_.flush();
+  flushed_ = true;
+  if (!has_step_)
+    return;
+
+  auto tmp_path = prom_path_ + ".tmp";
+  {
+    std::ofstream out(tmp_path);
+    auto gauge = [&out](const char* name, const char* help, double value) {
+      out << "# HELP " << name << " " << help << "\n";
+      out << "# TYPE " << name << " gauge\n";
+      out << name << " " << value << "\n";
+    };
+    gauge("maskrcnn_train_epoch", "Current training epoch", epoch_);
+    gauge("maskrcnn_train_step", "Current training step in the epoch", step_);
+    out << "# HELP maskrcnn_train_loss Losses of the latest step\n";
+    out << "# TYPE maskrcnn_train_loss gauge\n";
+    out << "maskrcnn_train_loss{head=\"sum\"} " << stat_.loss << "\n";
+    out << "maskrcnn_train_loss{head=\"rpn_class\"} " << stat_.loss_rpn_class
+        << "\n";
+    out << "maskrcnn_train_loss{head=\"rpn_bbox\"} " << stat_.loss_rpn_bbox
+        << "\n";
+    out << "maskrcnn_train_loss{head=\"mrcnn_class\"} "
+        << stat_.loss_mrcnn_class << "\n";
+    out << "maskrcnn_train_loss{head=\"mrcnn_bbox\"} " << stat_.loss_mrcnn_bbox
+        << "\n";
+    out << "maskrcnn_train_loss{head=\"mrcnn_mask\"} " << stat_.loss_mrcnn_mask
+        << "\n";
+    gauge("maskrcnn_train_step_seconds", "Duration of the latest step",
+          timing_.step_seconds);
+    gauge("maskrcnn_train_data_wait_seconds",
+          "Time the latest step waited for data", timing_.data_wait_seconds);
+    gauge("maskrcnn_train_samples_per_second", "Training throughput",
+          SamplesPerSecond(timing_));
+    gauge("maskrcnn_gpu_allocated_bytes", "Memory allocated on the GPUs",
+          static_cast<double>(memory_.allocated));
+    gauge("maskrcnn_gpu_peak_allocated_bytes",
+          "Peak memory allocated on the GPUs",
+          static_cast<double>(memory_.peak_allocated));
+    gauge("maskrcnn_gpu_cached_bytes", "Memory cached by the allocator",
+          static_cast<double>(memory_.cached));
+  }
+  std::rename(tmp_path.c_str(), prom_path_.c_str());
+}
@@ -0,0 +1,49 @@
+#ifndef METRICSEXPORTER_H
+#define METRICSEXPORTER_H
+
+#include "statreporter.h"
+
+#include <fstream>
+#include <string>
+
+/* Exports training metrics for monitoring. Every train step is appended as
+ * a JSON line to dir/metrics.jsonl. The latest step is kept in
+ * dir/metrics.prom in the Prometheus text format, to be collected with the
+ * node exporter textfile collector. The file is replaced on Flush, so the
+ * collector never reads it partially written. COCO metrics of the epochs are
+ * appended to the JSON lines too.
+ */
+class MetricsExporter {
+ public:
+  explicit MetricsExporter(const std::string& dir);
+  MetricsExporter(const MetricsExporter&) = delete;
+  MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+  void WriteStep(uint32_t epoch,
+                 uint32_t step,
+                 const LossStat& stat,
+                 const StepTiming& timing,
+                 const MemoryStat& memory);
+
+  // Appended as the JSON line with the "eval" key
+  void WriteEvaluation(uint32_t epoch,
+                       const CocoEvalStats& bbox_stat,
+                       const CocoEvalStats& segm_stat);
+
+  // Writes the JSON lines to the disk and updates the Prometheus file
+  void Flush();
+
+ private:
+  std::string prom_path_;
+  std::ofstream json_lines_;
+
+  bool has_step_{false};
+  bool flushed_{true};
+  uint32_t epoch_{0};
+  uint32_t step_{0};
+  LossStat stat_;
+  StepTiming timing_;
+  MemoryStat memory_;
+};
+
+#endif  // METRICSEXPORTER_H
@@ -1,17 +1,22 @@
 #include "nms.h"
+#include "../trace.h"
 #include "debug.h"
 
 #include "nms/nms.h"
 #include "nms/nms_cuda.h"
 
+#include <ATen/cuda/CUDAContext.h>
+
 at::Tensor Nms(at::Tensor dets, float thresh) {
+  MLCPP_TRACE_GPU_ZONE("nms", dets.is_cuda(),
+                       at::cuda::getCurrentCUDAStream().stream());
   auto scores = dets.narrow(1, 4, 1);
   at::Tensor order;
   std::tie(std::ignore, order) = scores.sort(0, /*descending*/ true);
-  auto keep = torch::full({dets.size(0)}, 0, at::dtype(at::kLong));
-  auto num_out = torch::full({1}, 0, at::dtype(at::kLong));
 
   if (!dets.is_cuda()) {
+    auto keep = torch::full({dets.size(0)}, 0, at::dtype(at::kLong));
+    auto num_out = torch::full({1}, 0, at::dtype(at::kLong));
     auto x1 = dets.narrow(1, 1, 1);
     auto y1 = dets.narrow(1, 0, 1);
     auto x2 = dets.narrow(1, 3, 1);
@@ -20,15 +25,43 @@ at::Tensor Nms(at::Tensor dets, float thresh) {
     cpu_nms(keep, num_out, dets, order, areas, thresh);
     return keep.narrow(0, 0, num_out.item<int64_t>());
   } else {
-    auto dets_temp = torch::full(dets.sizes(), 0, at::dtype(at::kFloat)).cuda();
-    dets_temp.narrow(1, 0, 1) = dets.narrow(1, 1, 1);
-    dets_temp.narrow(1, 1, 1) = dets.narrow(1, 0, 1);
-    dets_temp.narrow(1, 2, 1) = dets.narrow(1, 3, 1);
-    dets_temp.narrow(1, 3, 1) = dets.narrow(1, 2, 1);
-    dets_temp.narrow(1, 4, 1) = dets.narrow(1, 4, 1);
-    dets = dets.index(order).contiguous();
-    gpu_nms(keep, num_out, dets_temp, thresh);
-    auto ind = keep.narrow(0, 0, num_out.item<int64_t>()).cuda();
-    return order.take(ind).contiguous();
+    // Kernel computes IoU symmetrically for both axes, so there is no need to
+    // swap coordinates
+    order = order.flatten();
+    auto sorted_dets = dets.index_select(0, order).contiguous();
+    auto keep_mask =
+        torch::zeros({dets.size(0)}, dets.options().dtype(at::kByte));
+    gpu_nms_mask(keep_mask, sorted_dets, thresh);
+    return order.masked_select(keep_mask);
+  }
+}
+
+at::Tensor GroupNms(at::Tensor dets, float thresh) {
+  auto keep_mask = torch::zeros(
+      {dets.size(0)}, dets.options().dtype(at::kByte).requires_grad(false));
+  if (dets.size(0) == 0)
+    return keep_mask;
+
+  auto boxes = dets.narrow(1, 0, 4);
+  auto groups = dets.narrow(1, 4, 1);
+  auto scores = dets.narrow(1, 5, 1);
+
+  // Shift boxes of each group to a separate region, so boxes from different
+  // groups never intersect. Offsets are computed on the device.
+  auto offset = boxes.max() - boxes.min() + 2;
+  auto shifted_dets = torch::cat({boxes + groups * offset, scores}, /*dim*/ 1);
+
+  if (!dets.is_cuda()) {
+    auto keep = Nms(shifted_dets, thresh);
+    keep_mask.index_fill_(0, keep, 1);
+  } else {
+    at::Tensor order;
+    std::tie(std::ignore, order) = scores.sort(0, /*descending*/ true);
+    order = order.flatten();
+    auto sorted_dets = shifted_dets.index_select(0, order).contiguous();
+    auto sorted_keep_mask = torch::zeros_like(keep_mask);
+    gpu_nms_mask(sorted_keep_mask, sorted_dets, thresh);
+    keep_mask.index_copy_(0, order, sorted_keep_mask);
   }
+  return keep_mask;
 }
@@ -3,6 +3,20 @@
 
 #include <torch/torch.h>
 
+/*
+ * dets: [N, (y1, x1, y2, x2, score)]
+ * Returns: indices of kept boxes sorted by score
+ */
 at::Tensor Nms(at::Tensor dets, float thresh);
 
+/*
+ * Non-max suppression of several groups of boxes at once, boxes of different
+ * groups never suppress each other. Group can be a class id or any other
+ * non negative number, e.g. combined image index and class id.
+ * dets: [N, (y1, x1, y2, x2, group, score)]
+ * Returns: [N] kByte mask of kept boxes on the same device as dets. For CUDA
+ * tensors it doesn't synchronize with the host.
+ */
+at::Tensor GroupNms(at::Tensor dets, float thresh);
+
 #endif  // NMS_H
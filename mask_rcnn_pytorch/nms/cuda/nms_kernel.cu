@@ -82,6 +82,43 @@ void _nms(int boxes_num, float * boxes_dev,
                                   mask_dev);
 }
 
+// Reduces the overlap mask to keep flags of the sorted boxes. It is a
+// sequential scan, so it runs in a single block, but the result stays on the
+// device and no copy of the mask to the host is required.
+__global__ void nms_keep_kernel(const int n_boxes, const int64_t *dev_mask,
+                                unsigned char *dev_keep) {
+  extern __shared__ int64_t remv[];
+  const int col_blocks = DIVUP(n_boxes, threadsPerBlock);
+  for (int j = threadIdx.x; j < col_blocks; j += blockDim.x) {
+    remv[j] = 0;
+  }
+  __syncthreads();
+
+  for (int i = 0; i < n_boxes; i++) {
+    const int nblock = i / threadsPerBlock;
+    const int inblock = i % threadsPerBlock;
+    const bool keep = !(remv[nblock] & (1ULL << inblock));
+    __syncthreads();
+    if (keep) {
+      const int64_t *p = dev_mask + i * col_blocks;
+      for (int j = nblock + threadIdx.x; j < col_blocks; j += blockDim.x) {
+        remv[j] |= p[j];
+      }
+    }
+    if (threadIdx.x == 0) {
+      dev_keep[i] = keep ? 1 : 0;
+    }
+    __syncthreads();
+  }
+}
+
+void _nms_keep(int boxes_num, const int64_t * mask_dev,
+               unsigned char * keep_dev) {
+  const int col_blocks = DIVUP(boxes_num, threadsPerBlock);
+  nms_keep_kernel<<<1, threadsPerBlock, col_blocks * sizeof(int64_t)>>>(
+      boxes_num, mask_dev, keep_dev);
+}
+
 #ifdef __cplusplus
 }
 #endif
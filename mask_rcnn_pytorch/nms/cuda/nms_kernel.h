@@ -11,6 +11,9 @@ int const threadsPerBlock = sizeof(int64_t) * 8;
 void _nms(int boxes_num, float * boxes_dev,
           int64_t * mask_dev, float nms_overlap_thresh);
 
+void _nms_keep(int boxes_num, const int64_t * mask_dev,
+               unsigned char * keep_dev);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,6 +2,164 @@
 #include <math.h>
 #include <torch/torch.h>
 
+#include <cstdint>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NMS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Boxes in sorted order, stored by columns to allow vector loads
+struct SortedBoxes {
+  std::vector<float> x1;
+  std::vector<float> y1;
+  std::vector<float> x2;
+  std::vector<float> y2;
+  std::vector<float> areas;
+  int64_t num{0};
+};
+
+// The same sequence of operations is used by all kernels, so results are
+// bit exact with the original scalar implementation
+inline bool IsOverlapped(const SortedBoxes& boxes,
+                         int64_t i,
+                         int64_t j,
+                         float nms_overlap_thresh) {
+  float xx1 = fmaxf(boxes.x1[i], boxes.x1[j]);
+  float yy1 = fmaxf(boxes.y1[i], boxes.y1[j]);
+  float xx2 = fminf(boxes.x2[i], boxes.x2[j]);
+  float yy2 = fminf(boxes.y2[i], boxes.y2[j]);
+  float w = fmaxf(0.0f, xx2 - xx1 + 1);
+  float h = fmaxf(0.0f, yy2 - yy1 + 1);
+  float inter = w * h;
+  float ovr = inter / (boxes.areas[i] + boxes.areas[j] - inter);
+  return ovr >= nms_overlap_thresh;
+}
+
+// Sets bits of `mask` starting at bit position `pos`
+inline void SetBits(uint64_t* bits, int64_t pos, uint64_t mask) {
+  auto word = pos >> 6;
+  auto shift = pos & 63;
+  bits[word] |= mask << shift;
+  if (shift != 0)
+    bits[word + 1] |= mask >> (64 - shift);
+}
+
+inline bool TestBit(const uint64_t* bits, int64_t pos) {
+  return (bits[pos >> 6] >> (pos & 63)) & 1;
+}
+
+// Marks all boxes after i which overlap box i as suppressed
+using SuppressFunc = void (*)(const SortedBoxes& boxes,
+                              int64_t i,
+                              float nms_overlap_thresh,
+                              uint64_t* suppressed);
+
+void SuppressScalar(const SortedBoxes& boxes,
+                    int64_t i,
+                    float nms_overlap_thresh,
+                    uint64_t* suppressed) {
+  for (int64_t j = i + 1; j < boxes.num; ++j) {
+    if (IsOverlapped(boxes, i, j, nms_overlap_thresh))
+      SetBits(suppressed, j, 1);
+  }
+}
+
+#ifdef NMS_X86_SIMD
+__attribute__((target("avx2"))) void SuppressAvx2(const SortedBoxes& boxes,
+                                                  int64_t i,
+                                                  float nms_overlap_thresh,
+                                                  uint64_t* suppressed) {
+  const __m256 ix1 = _mm256_set1_ps(boxes.x1[i]);
+  const __m256 iy1 = _mm256_set1_ps(boxes.y1[i]);
+  const __m256 ix2 = _mm256_set1_ps(boxes.x2[i]);
+  const __m256 iy2 = _mm256_set1_ps(boxes.y2[i]);
+  const __m256 iarea = _mm256_set1_ps(boxes.areas[i]);
+  const __m256 thresh = _mm256_set1_ps(nms_overlap_thresh);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 zero = _mm256_setzero_ps();
+
+  int64_t j = i + 1;
+  for (; j + 8 <= boxes.num; j += 8) {
+    __m256 xx1 = _mm256_max_ps(ix1, _mm256_loadu_ps(&boxes.x1[j]));
+    __m256 yy1 = _mm256_max_ps(iy1, _mm256_loadu_ps(&boxes.y1[j]));
+    __m256 xx2 = _mm256_min_ps(ix2, _mm256_loadu_ps(&boxes.x2[j]));
+    __m256 yy2 = _mm256_min_ps(iy2, _mm256_loadu_ps(&boxes.y2[j]));
+    __m256 w =
+        _mm256_max_ps(zero, _mm256_add_ps(_mm256_sub_ps(xx2, xx1), one));
+    __m256 h =
+        _mm256_max_ps(zero, _mm256_add_ps(_mm256_sub_ps(yy2, yy1), one));
+    __m256 inter = _mm256_mul_ps(w, h);
+    __m256 uni = _mm256_sub_ps(
+        _mm256_add_ps(iarea, _mm256_loadu_ps(&boxes.areas[j])), inter);
+    __m256 ovr = _mm256_div_ps(inter, uni);
+    auto mask = static_cast<uint64_t>(
+        _mm256_movemask_ps(_mm256_cmp_ps(ovr, thresh, _CMP_GE_OQ)));
+    if (mask != 0)
+      SetBits(suppressed, j, mask);
+  }
+  for (; j < boxes.num; ++j) {
+    if (IsOverlapped(boxes, i, j, nms_overlap_thresh))
+      SetBits(suppressed, j, 1);
+  }
+}
+
+__attribute__((target("avx512f"))) void SuppressAvx512(
+    const SortedBoxes& boxes,
+    int64_t i,
+    float nms_overlap_thresh,
+    uint64_t* suppressed) {
+  const __m512 ix1 = _mm512_set1_ps(boxes.x1[i]);
+  const __m512 iy1 = _mm512_set1_ps(boxes.y1[i]);
+  const __m512 ix2 = _mm512_set1_ps(boxes.x2[i]);
+  const __m512 iy2 = _mm512_set1_ps(boxes.y2[i]);
+  const __m512 iarea = _mm512_set1_ps(boxes.areas[i]);
+  const __m512 thresh = _mm512_set1_ps(nms_overlap_thresh);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 zero = _mm512_setzero_ps();
+
+  int64_t j = i + 1;
+  for (; j + 16 <= boxes.num; j += 16) {
+    __m512 xx1 = _mm512_max_ps(ix1, _mm512_loadu_ps(&boxes.x1[j]));
+    __m512 yy1 = _mm512_max_ps(iy1, _mm512_loadu_ps(&boxes.y1[j]));
+    __m512 xx2 = _mm512_min_ps(ix2, _mm512_loadu_ps(&boxes.x2[j]));
+    __m512 yy2 = _mm512_min_ps(iy2, _mm512_loadu_ps(&boxes.y2[j]));
+    __m512 w =
+        _mm512_max_ps(zero, _mm512_add_ps(_mm512_sub_ps(xx2, xx1), one));
+    __m512 h =
+        _mm512_max_ps(zero, _mm512_add_ps(_mm512_sub_ps(yy2, yy1), one));
+    __m512 inter = _mm512_mul_ps(w, h);
+    __m512 uni = _mm512_sub_ps(
+        _mm512_add_ps(iarea, _mm512_loadu_ps(&boxes.areas[j])), inter);
+    __m512 ovr = _mm512_div_ps(inter, uni);
+    auto mask = static_cast<uint64_t>(
+        _mm512_cmp_ps_mask(ovr, thresh, _CMP_GE_OQ));
+    if (mask != 0)
+      SetBits(suppressed, j, mask);
+  }
+  for (; j < boxes.num; ++j) {
+    if (IsOverlapped(boxes, i, j, nms_overlap_thresh))
+      SetBits(suppressed, j, 1);
+  }
+}
+#endif
+
+SuppressFunc SelectSuppressFunc() {
+#ifdef NMS_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return SuppressAvx512;
+  if (__builtin_cpu_supports("avx2"))
+    return SuppressAvx2;
+#endif
+  return SuppressScalar;
+}
+
+}  // namespace
+
 int cpu_nms(at::Tensor keep_out,
             at::Tensor num_out,
             at::Tensor boxes,
@@ -9,62 +167,51 @@ int cpu_nms(at::Tensor keep_out,
             at::Tensor areas,
             float nms_overlap_thresh) {
   // boxes has to be sorted
+  static const SuppressFunc suppress_func = SelectSuppressFunc();
 
   // Number of ROIs
   int64_t boxes_num = boxes.size(0);
   int64_t boxes_dim = boxes.size(1);
 
-  int64_t* keep_out_flat = keep_out.contiguous().data<int64_t>();
-  float* boxes_flat = boxes.contiguous().data<float>();
-  int64_t* order_flat = order.contiguous().data<int64_t>();
-  float* areas_flat = areas.contiguous().data<float>();
-
-  at::Tensor suppressed = at::zeros({boxes_num}, at::CPU(at::kByte));
-  unsigned char* suppressed_flat = suppressed.data<unsigned char>();
-
-  // nominal indices
-  int i, j;
-  // sorted indices
-  int _i, _j;
-  // temp variables for box i's (the box currently under consideration)
-  float ix1, iy1, ix2, iy2, iarea;
-  // variables for computing overlap with box j (lower scoring box)
-  float xx1, yy1, xx2, yy2;
-  float w, h;
-  float inter, ovr;
+  boxes = boxes.contiguous();
+  order = order.contiguous();
+  areas = areas.contiguous();
+  int64_t* keep_out_flat = keep_out.data<int64_t>();
+  const float* boxes_flat = boxes.data<float>();
+  const int64_t* order_flat = order.data<int64_t>();
+  const float* areas_flat = areas.data<float>();
+
+  // Transpose boxes to columns in the sorted order
+  SortedBoxes sorted;
+  sorted.num = boxes_num;
+  sorted.x1.resize(static_cast<size_t>(boxes_num));
+  sorted.y1.resize(static_cast<size_t>(boxes_num));
+  sorted.x2.resize(static_cast<size_t>(boxes_num));
+  sorted.y2.resize(static_cast<size_t>(boxes_num));
+  sorted.areas.resize(static_cast<size_t>(boxes_num));
+  for (int64_t k = 0; k < boxes_num; ++k) {
+    auto i = order_flat[k];
+    const float* box = boxes_flat + i * boxes_dim;
+    sorted.x1[k] = box[0];
+    sorted.y1[k] = box[1];
+    sorted.x2[k] = box[2];
+    sorted.y2[k] = box[3];
+    sorted.areas[k] = areas_flat[i];
+  }
+
+  // One bit per sorted box, one extra word for unaligned bit masks
+  std::vector<uint64_t> suppressed(static_cast<size_t>(boxes_num / 64 + 2), 0);
 
   int64_t num_to_keep = 0;
-  for (_i = 0; _i < boxes_num; ++_i) {
-    i = order_flat[_i];
-    if (suppressed_flat[i] == 1) {
+  for (int64_t k = 0; k < boxes_num; ++k) {
+    if (TestBit(suppressed.data(), k)) {
       continue;
     }
-    keep_out_flat[num_to_keep++] = i;
-    ix1 = boxes_flat[i * boxes_dim];
-    iy1 = boxes_flat[i * boxes_dim + 1];
-    ix2 = boxes_flat[i * boxes_dim + 2];
-    iy2 = boxes_flat[i * boxes_dim + 3];
-    iarea = areas_flat[i];
-    for (_j = _i + 1; _j < boxes_num; ++_j) {
-      j = order_flat[_j];
-      if (suppressed_flat[j] == 1) {
-        continue;
-      }
-      xx1 = fmaxf(ix1, boxes_flat[j * boxes_dim]);
-      yy1 = fmaxf(iy1, boxes_flat[j * boxes_dim + 1]);
-      xx2 = fminf(ix2, boxes_flat[j * boxes_dim + 2]);
-      yy2 = fminf(iy2, boxes_flat[j * boxes_dim + 3]);
-      w = fmaxf(0.0, xx2 - xx1 + 1);
-      h = fmaxf(0.0, yy2 - yy1 + 1);
-      inter = w * h;
-      ovr = inter / (iarea + areas_flat[j] - inter);
-      if (ovr >= nms_overlap_thresh) {
-        suppressed_flat[j] = 1;
-      }
-    }
+    keep_out_flat[num_to_keep++] = order_flat[k];
+    suppress_func(sorted, k, nms_overlap_thresh, suppressed.data());
   }
 
-  int64_t* num_out_flat = num_out.contiguous().data<int64_t>();
+  int64_t* num_out_flat = num_out.data<int64_t>();
   *num_out_flat = num_to_keep;
   return 1;
 }
@@ -60,3 +60,26 @@ int gpu_nms(at::Tensor keep,
 
   return 1;
 }
+
+int gpu_nms_mask(at::Tensor keep_mask,
+                 at::Tensor boxes,
+                 float nms_overlap_thresh) {
+  // boxes has to be sorted
+
+  // Number of ROIs
+  int boxes_num = boxes.size(0);
+  if (boxes_num == 0)
+    return 1;
+
+  boxes = boxes.contiguous();
+  float* boxes_flat = boxes.data<float>();
+
+  const int col_blocks = DIVUP(boxes_num, threadsPerBlock);
+  at::Tensor mask = at::empty({boxes_num, col_blocks}, at::CUDA(at::kLong));
+  int64_t* mask_flat = mask.data<int64_t>();
+
+  _nms(boxes_num, boxes_flat, mask_flat, nms_overlap_thresh);
+  _nms_keep(boxes_num, mask_flat, keep_mask.data<uint8_t>());
+
+  return 1;
+}
@@ -1,3 +1,7 @@
 #include <torch/torch.h>
 
 int gpu_nms(at::Tensor keep_out, at::Tensor num_out, at::Tensor boxes, float nms_overlap_thresh);
+
+// Writes 1 to keep_mask for kept boxes, boxes have to be sorted by score.
+// Does not synchronize with the host.
+int gpu_nms_mask(at::Tensor keep_mask, at::Tensor boxes, float nms_overlap_thresh);
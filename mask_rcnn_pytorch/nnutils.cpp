@@ -1,7 +1,38 @@
 #include "nnutils.h"
 #include "debug.h"
 
+#include <torch/csrc/autograd/function.h>
+#include <torch/csrc/autograd/functions/utils.h>
+
 #include <cmath>
+#include <stdexcept>
+
+namespace {
+// Backward of CheckpointForward, it recomputes the forward pass
+class CheckpointBackward : public torch::autograd::Function {
+ public:
+  CheckpointBackward(std::function<at::Tensor(at::Tensor)> fn,
+                     at::Tensor input)
+      : fn_(std::move(fn)), input_(std::move(input)) {}
+
+  torch::autograd::variable_list apply(
+      torch::autograd::variable_list&& grads) override {
+    auto input = input_.detach();
+    input.set_requires_grad(true);
+    {
+      torch::AutoGradMode enable_grad(true);
+      auto output = fn_(input);
+      if (output.requires_grad())
+        output.backward(grads[0]);
+    }
+    return {input.grad()};
+  }
+
+ private:
+  std::function<at::Tensor(at::Tensor)> fn_;
+  at::Tensor input_;
+};
+}  // namespace
 
 SamePad2dImpl::SamePad2dImpl() {}
 
@@ -49,6 +80,42 @@ at::Tensor SamePad2dImpl::forward(at::Tensor input) {
   return input;
 }
 
+void FoldBatchNorm(torch::nn::Conv2dImpl& conv, torch::nn::BatchNormImpl& bn) {
+  if (!conv.bias.defined())
+    throw std::invalid_argument("Batch norm folding needs convolution bias");
+  torch::NoGradGuard no_grad;
+  // Computed in float, weights can be in half precision
+  auto eps = bn.options.eps();
+  auto scale = bn.weight.to(at::kFloat) /
+               (bn.running_variance.to(at::kFloat) + eps).sqrt();
+  auto weight = conv.weight.to(at::kFloat) * scale.view({-1, 1, 1, 1});
+  auto bias = (conv.bias.to(at::kFloat) - bn.running_mean.to(at::kFloat)) *
+                  scale +
+              bn.bias.to(at::kFloat);
+  conv.weight.copy_(weight);
+  conv.bias.copy_(bias);
+
+  bn.weight.fill_(1);
+  bn.bias.fill_(0);
+  bn.running_mean.fill_(0);
+  bn.running_variance.fill_(1 - eps);
+}
+
+at::Tensor CheckpointForward(std::function<at::Tensor(at::Tensor)> fn,
+                             at::Tensor input) {
+  if (!torch::GradMode::is_enabled())
+    return fn(input);
+  at::Tensor output;
+  {
+    torch::NoGradGuard no_grad;
+    output = fn(input);
+  }
+  auto grad_fn = std::make_shared<CheckpointBackward>(std::move(fn), input);
+  grad_fn->set_next_edges(torch::autograd::collect_next_edges(input));
+  torch::autograd::set_history(output, grad_fn);
+  return output;
+}
+
 at::Tensor upsample(at::Tensor x, float scale_factor) {
   auto output_size = [scale_factor, &x](uint32_t dim) {
     std::vector<int64_t> sizes(dim);
@@ -1,11 +1,30 @@
 #ifndef NNUTILS_H
 #define NNUTILS_H
 
+#include <ATen/cuda/CUDAContext.h>
 #include <torch/torch.h>
+
+#include <functional>
 #include <vector>
 
 bool is_empty(at::Tensor x);
 
+// Makes the stream current for the device until destruction
+class StreamGuard {
+ public:
+  explicit StreamGuard(at::cuda::CUDAStream stream)
+      : previous_(at::cuda::getCurrentCUDAStream()) {
+    at::cuda::setCurrentCUDAStream(stream);
+  }
+  ~StreamGuard() { at::cuda::setCurrentCUDAStream(previous_); }
+
+  StreamGuard(const StreamGuard&) = delete;
+  StreamGuard& operator=(const StreamGuard&) = delete;
+
+ private:
+  at::cuda::CUDAStream previous_;
+};
+
 /* Clips gradient norm of an iterable of parameters.
  * The norm is computed over all gradients together, as if they were
  * concatenated into a single vector. Gradients are modified in-place.
@@ -18,6 +37,23 @@ bool is_empty(at::Tensor x);
  */
 void ClipGradNorm(std::vector<at::Tensor> parameters, float max_norm);
 
+/* Folds the batch norm following the convolution into the convolution
+ * weights and bias, using the running statistics of inference. The batch
+ * norm is turned into the identity, so the state stays consistent and the
+ * folded model can still be saved, but the caller should skip it.
+ */
+void FoldBatchNorm(torch::nn::Conv2dImpl& conv, torch::nn::BatchNormImpl& bn);
+
+/* Activation checkpointing: runs fn(input) without keeping the activations
+ * inside fn, the backward pass runs fn again with the autograd graph and
+ * backpropagates through it. Parameters used by fn get their gradients
+ * accumulated by this inner backward pass. fn must compute the same result
+ * again, e.g. batch norms have to be in eval mode, and must not change its
+ * input in place. Without the grad mode fn just runs.
+ */
+at::Tensor CheckpointForward(std::function<at::Tensor(at::Tensor)> fn,
+                             at::Tensor input);
+
 at::Tensor upsample(at::Tensor x, float scale_factor);
 at::Tensor unique1d(at::Tensor tensor);
 at::Tensor intersect1d(at::Tensor tensor1, at::Tensor tensor2);
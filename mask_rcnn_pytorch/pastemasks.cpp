@@ -0,0 +1,102 @@
+#include "pastemasks.h"
+
+#include "pastemasks/paste_masks.h"
+#include "pastemasks/paste_masks_gpu.h"
+
+#include <algorithm>
+
+std::vector<PackedMask> PasteMasks(at::Tensor masks,
+                                   at::Tensor boxes,
+                                   int32_t image_height,
+                                   int32_t image_width,
+                                   float threshold) {
+  // Boxes are small, the layout of the packed buffer is computed on the host
+  boxes = boxes.to(at::dtype(at::kInt)).cpu().contiguous().view({-1, 4});
+  auto num = boxes.size(0);
+  std::vector<PackedMask> result(static_cast<size_t>(num));
+  if (num == 0)
+    return result;
+
+  auto offsets = torch::empty({num + 1}, at::dtype(at::kLong));
+  auto boxes_data = boxes.accessor<int32_t, 2>();
+  auto offsets_data = offsets.accessor<int64_t, 1>();
+  int64_t total_words = 0;
+  for (int64_t n = 0; n < num; ++n) {
+    auto& mask = result[static_cast<size_t>(n)];
+    auto y1 = std::min(std::max(boxes_data[n][0], 0), image_height);
+    auto x1 = std::min(std::max(boxes_data[n][1], 0), image_width);
+    auto y2 = std::min(std::max(boxes_data[n][2], y1), image_height);
+    auto x2 = std::min(std::max(boxes_data[n][3], x1), image_width);
+    boxes_data[n][0] = y1;
+    boxes_data[n][1] = x1;
+    boxes_data[n][2] = y2;
+    boxes_data[n][3] = x2;
+
+    mask.y1 = y1;
+    mask.x1 = x1;
+    mask.height = y2 - y1;
+    mask.width = x2 - x1;
+    mask.words_per_row = (mask.width + 31) / 32;
+    offsets_data[n] = total_words;
+    total_words += static_cast<int64_t>(mask.height) * mask.words_per_row;
+  }
+  offsets_data[num] = total_words;
+
+  auto packed = torch::empty({total_words}, masks.options().dtype(at::kInt));
+  if (masks.is_cuda()) {
+    paste_masks_gpu_forward(masks.to(at::kFloat), boxes.to(masks.device()),
+                            offsets.to(masks.device()), threshold, packed);
+    packed = packed.cpu();
+  } else {
+    paste_masks_forward(masks.to(at::kFloat), boxes, offsets, threshold,
+                        packed);
+  }
+
+  const auto* packed_ptr =
+      reinterpret_cast<const uint32_t*>(packed.data<int32_t>());
+  for (int64_t n = 0; n < num; ++n) {
+    auto& mask = result[static_cast<size_t>(n)];
+    mask.words.assign(packed_ptr + offsets_data[n],
+                      packed_ptr + offsets_data[n + 1]);
+  }
+  return result;
+}
+
+RleMask PackedMaskToRle(const PackedMask& mask,
+                        int32_t image_height,
+                        int32_t image_width) {
+  RleMask rle;
+  rle.height = image_height;
+  rle.width = image_width;
+  uint8_t value = 0;
+  uint32_t run = 0;
+  auto add_run = [&](uint8_t pixel, uint32_t length) {
+    if (length == 0)
+      return;
+    if (pixel != value) {
+      rle.counts.push_back(run);
+      run = 0;
+      value = pixel;
+    }
+    run += length;
+  };
+
+  auto bottom = static_cast<uint32_t>(image_height - mask.y1 - mask.height);
+  for (int32_t x = 0; x < image_width; ++x) {
+    int32_t col = x - mask.x1;
+    if (col < 0 || col >= mask.width) {
+      add_run(0, static_cast<uint32_t>(image_height));
+      continue;
+    }
+    add_run(0, static_cast<uint32_t>(mask.y1));
+    const uint32_t* word = mask.words.data() + col / 32;
+    const uint32_t bit = static_cast<uint32_t>(col % 32);
+    for (int32_t row = 0; row < mask.height; ++row) {
+      auto pixel = (word[row * mask.words_per_row] >> bit) & 1u;
+      add_run(static_cast<uint8_t>(pixel), 1);
+    }
+    add_run(0, bottom);
+  }
+  rle.counts.push_back(run);
+  return rle;
+}
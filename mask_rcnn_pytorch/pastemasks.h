@@ -0,0 +1,54 @@
+#ifndef PASTEMASKS_H
+#define PASTEMASKS_H
+
+#include "cocorle.h"
+
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+/* Instance mask in the image domain packed to bits. Only the area of the box
+ * is stored, pixels outside of it are zero. Bit b of word w in row r is the
+ * pixel (y1 + r, x1 + 32 * w + b).
+ */
+struct PackedMask {
+  int32_t y1{0};
+  int32_t x1{0};
+  int32_t height{0};
+  int32_t width{0};
+  int32_t words_per_row{0};
+  std::vector<uint32_t> words;
+
+  bool Test(int32_t y, int32_t x) const {
+    y -= y1;
+    x -= x1;
+    if (y < 0 || x < 0 || y >= height || x >= width)
+      return false;
+    return (words[y * words_per_row + x / 32] >> (x % 32)) & 1u;
+  }
+};
+
+/*
+ * Resizes masks to their boxes, thresholds and packs them to bits. Runs on
+ * the device of masks, for CUDA tensors only the packed masks are copied to
+ * the host.
+ * masks: [N, height, width] float mask probabilities
+ * boxes: [N, (y1, x1, y2, x2)] boxes in image pixels, clipped to the image
+ */
+std::vector<PackedMask> PasteMasks(at::Tensor masks,
+                                   at::Tensor boxes,
+                                   int32_t image_height,
+                                   int32_t image_width,
+                                   float threshold);
+
+/*
+ * Encodes the packed mask of the image_height x image_width image to the COCO
+ * RLE, the result is the same as EncodeRle of the unpacked mask. Columns
+ * outside of the box are encoded without visiting their pixels.
+ */
+RleMask PackedMaskToRle(const PackedMask& mask,
+                        int32_t image_height,
+                        int32_t image_width);
+
+#endif  // PASTEMASKS_H
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <algorithm>
+#include "../paste_masks_common.h"
+#include "paste_masks_kernel.h"
+
+__global__ void PasteMasksKernel(const float* masks_ptr,
+                                 int num_masks,
+                                 int mask_height,
+                                 int mask_width,
+                                 const int32_t* boxes_ptr,
+                                 const int64_t* offsets_ptr,
+                                 int64_t total_words,
+                                 float threshold,
+                                 unsigned int* packed_ptr) {
+  for (int64_t idx = blockIdx.x * static_cast<int64_t>(blockDim.x) +
+                     threadIdx.x;
+       idx < total_words; idx += static_cast<int64_t>(blockDim.x) * gridDim.x) {
+    // Find the mask of the word, there are at most a few hundreds of them
+    int lo = 0;
+    int hi = num_masks - 1;
+    while (lo < hi) {
+      const int mid = (lo + hi + 1) / 2;
+      if (offsets_ptr[mid] <= idx)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    const int n = lo;
+
+    const int32_t* box = boxes_ptr + n * 4;
+    const int box_height = box[2] - box[0];
+    const int box_width = box[3] - box[1];
+    const int words_per_row = (box_width + 31) / 32;
+    const int64_t local = idx - offsets_ptr[n];
+    const int y = static_cast<int>(local / words_per_row);
+    const int word = static_cast<int>(local % words_per_row);
+
+    packed_ptr[idx] = PackedMaskWord(
+        masks_ptr + static_cast<int64_t>(n) * mask_height * mask_width,
+        mask_height, mask_width, box_height, box_width, y, word, threshold);
+  }
+}
+
+void PasteMasksLaucher(const float* masks_ptr,
+                       int num_masks,
+                       int mask_height,
+                       int mask_width,
+                       const int32_t* boxes_ptr,
+                       const int64_t* offsets_ptr,
+                       int64_t total_words,
+                       float threshold,
+                       unsigned int* packed_ptr) {
+  const int thread_per_block = 256;
+  const int64_t max_blocks = 65535;
+  const int block_count = static_cast<int>(
+      std::min((total_words + thread_per_block - 1) / thread_per_block,
+               max_blocks));
+  cudaError_t err;
+
+  if (total_words > 0 && num_masks > 0) {
+    PasteMasksKernel<<<block_count, thread_per_block, 0>>>(
+        masks_ptr, num_masks, mask_height, mask_width, boxes_ptr, offsets_ptr,
+        total_words, threshold, packed_ptr);
+
+    err = cudaGetLastError();
+    if (cudaSuccess != err) {
+      fprintf(stderr, "cudaCheckError() failed : %s\n",
+              cudaGetErrorString(err));
+      exit(-1);
+    }
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef _PasteMasks_Kernel
+#define _PasteMasks_Kernel
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One thread computes one 32 bit word of a packed mask
+void PasteMasksLaucher(const float* masks_ptr,
+                       int num_masks,
+                       int mask_height,
+                       int mask_width,
+                       const int32_t* boxes_ptr,
+                       const int64_t* offsets_ptr,
+                       int64_t total_words,
+                       float threshold,
+                       unsigned int* packed_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#include "paste_masks.h"
+#include "paste_masks_common.h"
+
+void paste_masks_forward(at::Tensor masks,
+                         at::Tensor boxes,
+                         at::Tensor offsets,
+                         float threshold,
+                         at::Tensor packed) {
+  masks = masks.contiguous();
+  boxes = boxes.contiguous();
+  offsets = offsets.contiguous();
+
+  const int64_t num = masks.size(0);
+  const int mask_height = static_cast<int>(masks.size(1));
+  const int mask_width = static_cast<int>(masks.size(2));
+  const float* masks_ptr = masks.data<float>();
+  const int32_t* boxes_ptr = boxes.data<int32_t>();
+  const int64_t* offsets_ptr = offsets.data<int64_t>();
+  auto* packed_ptr = reinterpret_cast<unsigned int*>(packed.data<int32_t>());
+
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t n = 0; n < num; ++n) {
+    const int32_t* box = boxes_ptr + n * 4;
+    const int box_height = box[2] - box[0];
+    const int box_width = box[3] - box[1];
+    const int words_per_row = (box_width + 31) / 32;
+    const float* mask = masks_ptr + n * mask_height * mask_width;
+    unsigned int* out = packed_ptr + offsets_ptr[n];
+    for (int y = 0; y < box_height; ++y) {
+      for (int w = 0; w < words_per_row; ++w) {
+        out[y * words_per_row + w] =
+            PackedMaskWord(mask, mask_height, mask_width, box_height,
+                           box_width, y, w, threshold);
+      }
+    }
+  }
+}
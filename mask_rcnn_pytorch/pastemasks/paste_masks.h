@@ -0,0 +1,11 @@
+#include <torch/torch.h>
+
+// Resizes masks to their boxes, thresholds and packs them to bits.
+// Mask n is stored in packed[offsets[n] .. offsets[n + 1]) row by row, each
+// row has (box_width + 31) / 32 words.
+void paste_masks_forward(at::Tensor masks,    // [N, height, width] float
+                         at::Tensor boxes,    // [N, (y1, x1, y2, x2)] int
+                         at::Tensor offsets,  // [N + 1] long
+                         float threshold,
+                         at::Tensor packed  // [offsets[N]] int
+);
@@ -0,0 +1,70 @@
+#ifndef PASTE_MASKS_COMMON_H
+#define PASTE_MASKS_COMMON_H
+
+#include <math.h>
+
+#ifdef __CUDACC__
+#define PASTE_HOST_DEVICE __host__ __device__
+#else
+#define PASTE_HOST_DEVICE
+#endif
+
+// Source coordinate and interpolation weight of the destination pixel for
+// the linear resize, the same mapping as cv::resize with INTER_LINEAR
+PASTE_HOST_DEVICE inline void ResizeCoord(int dst,
+                                          int src_size,
+                                          int dst_size,
+                                          int* src,
+                                          float* lerp) {
+  float f = (dst + 0.5f) * (static_cast<float>(src_size) / dst_size) - 0.5f;
+  int s = static_cast<int>(floorf(f));
+  f -= s;
+  if (s < 0) {
+    s = 0;
+    f = 0;
+  }
+  if (s >= src_size - 1) {
+    s = src_size - 1;
+    f = 0;
+  }
+  *src = s;
+  *lerp = f;
+}
+
+// Resizes the mask [mask_height, mask_width] to the box, thresholds it and
+// returns the word with 32 pixels of row y starting at x = 32 * word, bit b
+// is the pixel x + b
+PASTE_HOST_DEVICE inline unsigned int PackedMaskWord(const float* mask,
+                                                     int mask_height,
+                                                     int mask_width,
+                                                     int box_height,
+                                                     int box_width,
+                                                     int y,
+                                                     int word,
+                                                     float threshold) {
+  int sy;
+  float ly;
+  ResizeCoord(y, mask_height, box_height, &sy, &ly);
+  const int sy1 = sy + (ly > 0 ? 1 : 0);
+  const float* top = mask + sy * mask_width;
+  const float* bottom = mask + sy1 * mask_width;
+
+  unsigned int bits = 0;
+  for (int b = 0; b < 32; ++b) {
+    const int x = word * 32 + b;
+    if (x >= box_width)
+      break;
+    int sx;
+    float lx;
+    ResizeCoord(x, mask_width, box_width, &sx, &lx);
+    const int sx1 = sx + (lx > 0 ? 1 : 0);
+    const float t = top[sx] * (1 - lx) + top[sx1] * lx;
+    const float d = bottom[sx] * (1 - lx) + bottom[sx1] * lx;
+    const float value = t * (1 - ly) + d * ly;
+    if (value > threshold)
+      bits |= 1u << b;
+  }
+  return bits;
+}
+
+#endif  // PASTE_MASKS_COMMON_H
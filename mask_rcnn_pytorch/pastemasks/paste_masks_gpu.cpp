@@ -0,0 +1,23 @@
+#include "paste_masks_gpu.h"
+#include "cuda/paste_masks_kernel.h"
+
+void paste_masks_gpu_forward(at::Tensor masks,
+                             at::Tensor boxes,
+                             at::Tensor offsets,
+                             float threshold,
+                             at::Tensor packed) {
+  assert(masks.is_cuda());
+  assert(boxes.is_cuda());
+  assert(offsets.is_cuda());
+  assert(packed.is_cuda());
+
+  masks = masks.contiguous();
+  boxes = boxes.contiguous();
+  offsets = offsets.contiguous();
+
+  PasteMasksLaucher(
+      masks.data<float>(), static_cast<int>(masks.size(0)),
+      static_cast<int>(masks.size(1)), static_cast<int>(masks.size(2)),
+      boxes.data<int32_t>(), offsets.data<int64_t>(), packed.numel(),
+      threshold, reinterpret_cast<unsigned int*>(packed.data<int32_t>()));
+}
@@ -0,0 +1,9 @@
+#include <torch/torch.h>
+
+// CUDA version of paste_masks_forward, all tensors are on the GPU
+void paste_masks_gpu_forward(at::Tensor masks,    // [N, height, width] float
+                             at::Tensor boxes,    // [N, (y1, x1, y2, x2)] int
+                             at::Tensor offsets,  // [N + 1] long
+                             float threshold,
+                             at::Tensor packed  // [offsets[N]] int
+);
@@ -0,0 +1,72 @@
+#include "proposalbudget.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+// Latencies of the batches the percentile is taken from
+const size_t kWindowBatches = 32;
+// Batches run with the new count before it is lowered further, so the
+// requests queued before the change don't lower it at once
+const size_t kSettleBatches = 4;
+// The count is raised after this number of batches with the expected
+// latency below kRaiseMargin of the objective
+const size_t kRaiseBatches = 32;
+const double kRaiseMargin = 0.7;
+
+double Percentile(std::deque<double> values, double q) {
+  auto n = static_cast<size_t>(q * static_cast<double>(values.size() - 1));
+  std::nth_element(values.begin(), values.begin() + n, values.end());
+  return values[n];
+}
+}  // namespace
+
+std::vector<int64_t> ProposalCounts(const Config& config) {
+  const auto max_count = config.post_nms_rois_inference;
+  const auto min_count = std::max<int64_t>(
+      1, std::min(config.min_post_nms_rois_inference, max_count));
+  std::vector<int64_t> counts;
+  for (auto count = max_count; count > min_count; count /= 2)
+    counts.push_back(count);
+  counts.push_back(min_count);
+  return counts;
+}
+
+ProposalBudget::ProposalBudget(const Config& config)
+    : slo_ms_(config.inference_latency_slo_ms),
+      counts_(ProposalCounts(config)),
+      batches_(counts_.size(), 0) {
+  if (slo_ms_ <= 0)
+    throw std::invalid_argument("Latency objective should be positive");
+}
+
+int64_t ProposalBudget::Update(double latency_ms,
+                               double batch_ms,
+                               size_t queued,
+                               size_t batch_size) {
+  ++batches_[level_];
+  latencies_.push_back(latency_ms);
+  if (latencies_.size() > kWindowBatches)
+    latencies_.pop_front();
+
+  // Requests waiting now are served after the batches ahead of them
+  const auto batches_ahead = queued / std::max<size_t>(batch_size, 1);
+  const auto expected = Percentile(latencies_, 0.9) +
+                        batch_ms * static_cast<double>(batches_ahead);
+  if (expected > slo_ms_) {
+    calm_batches_ = 0;
+    if (level_ + 1 < counts_.size() && latencies_.size() >= kSettleBatches) {
+      ++level_;
+      latencies_.clear();
+    }
+  } else if (expected < kRaiseMargin * slo_ms_) {
+    if (++calm_batches_ >= kRaiseBatches && level_ > 0) {
+      --level_;
+      latencies_.clear();
+      calm_batches_ = 0;
+    }
+  } else {
+    calm_batches_ = 0;
+  }
+  return Count();
+}
@@ -0,0 +1,58 @@
+#ifndef PROPOSALBUDGET_H
+#define PROPOSALBUDGET_H
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Proposal counts the inference can run with under the latency objective:
+// post_nms_rois_inference and its halves down to min_post_nms_rois_inference.
+// Every count is a shape of its own for the heads, so there are few of them.
+std::vector<int64_t> ProposalCounts(const Config& config);
+
+/* Picks the proposal count of the next batch from the latency objective
+ * Config::inference_latency_slo_ms and the recent load. The expected latency
+ * of the next requests is the 90th percentile of the recent batch latencies
+ * plus the time of the batches queued ahead of them. The count goes one step
+ * down when the expected latency exceeds the objective, and one step up
+ * after kRaiseBatches batches well within it. Fewer proposals trade a little
+ * recall of the crowded images for the bounded tail latency.
+ * The budget isn't thread safe, it is updated by the batching thread.
+ */
+class ProposalBudget {
+ public:
+  explicit ProposalBudget(const Config& config);
+
+  // Proposal count for the next batch
+  int64_t Count() const { return counts_[level_]; }
+
+  /* latency_ms: time from the arrival of the oldest request of the batch
+   *             till its results
+   * batch_ms: time the batch took to process
+   * queued, batch_size: requests waiting for the next batches and the max
+   *                     number of requests in a batch
+   * Returns the new count.
+   */
+  int64_t Update(double latency_ms,
+                 double batch_ms,
+                 size_t queued,
+                 size_t batch_size);
+
+  const std::vector<int64_t>& Counts() const { return counts_; }
+  // Number of batches run with each of Counts
+  const std::vector<size_t>& Batches() const { return batches_; }
+
+ private:
+  double slo_ms_{0};
+  std::vector<int64_t> counts_;
+  std::vector<size_t> batches_;
+  size_t level_{0};
+  // Latencies of the batches since the last change of the count
+  std::deque<double> latencies_;
+  size_t calm_batches_{0};
+};
+
+#endif  // PROPOSALBUDGET_H
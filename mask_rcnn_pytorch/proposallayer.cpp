@@ -5,51 +5,87 @@
 #include "nms.h"
 #include "nnutils.h"
 
-at::Tensor ProposalLayer(std::vector<at::Tensor> inputs,
-                         int64_t proposal_count,
-                         float nms_threshold,
-                         at::Tensor anchors,
-                         const Config& config) {
-  // Currently only supports batchsize 1
-  inputs[0] = inputs[0].squeeze(0);
-  inputs[1] = inputs[1].squeeze(0);
-
-  // Box Scores. Use the foreground class confidence. [Batch, num_rois, 1]
-  auto scores = inputs[0].narrow(1, 1, 1);
+namespace {
+/*
+ * Indices of the top scored anchors, at most level_limit in each pyramid
+ * level and total_limit in total, in no particular order. Uses partial
+ * selection with topk (radix select on the GPU, quickselect on the CPU)
+ * instead of sorting all anchors of the image.
+ * Inputs:
+ *     scores: [anchors] foreground probabilities, ordered by level
+ *     level_counts: number of anchors of each level
+ */
+at::Tensor SelectTopAnchors(at::Tensor scores,
+                            const std::vector<int64_t>& level_counts,
+                            int64_t level_limit,
+                            int64_t total_limit) {
+  std::vector<at::Tensor> candidates;
+  int64_t offset = 0;
+  for (auto count : level_counts) {
+    if (count > level_limit) {
+      at::Tensor order;
+      std::tie(std::ignore, order) =
+          scores.narrow(0, offset, count)
+              .topk(level_limit, /*dim*/ 0, /*largest*/ true,
+                    /*sorted*/ false);
+      candidates.push_back(order + offset);
+    } else {
+      candidates.push_back(torch::arange(offset, offset + count,
+                                         scores.options().dtype(at::kLong)));
+    }
+    offset += count;
+  }
+  if (offset != scores.size(0))
+    throw std::logic_error("Anchor counts don't match the number of scores");
 
-  // Box deltas [batch, num_rois, 4]
-  auto deltas = inputs[1];
-
-  auto std_dev =
-      torch::tensor(config.rpn_bbox_std_dev,
-                    at::TensorOptions().requires_grad(false).dtype(at::kFloat));
-  if (config.gpu_count > 0)
-    std_dev = std_dev.cuda();
-  deltas = deltas * std_dev;
+  auto order = torch::cat(candidates);
+  if (order.size(0) > total_limit) {
+    at::Tensor top;
+    std::tie(std::ignore, top) =
+        scores.index_select(0, order)
+            .topk(total_limit, /*dim*/ 0, /*largest*/ true, /*sorted*/ false);
+    order = order.index_select(0, top);
+  }
+  return order;
+}
 
+/*
+ * Selects proposals for a single image of the batch.
+ * Inputs:
+ *     scores: [anchors] foreground probabilities
+ *     deltas: [anchors, (dy, dx, log(dh), log(dw))] before scaling by
+ *             std_dev
+ * Returns:
+ *     Proposals in pixel coordinates [rois, (y1, x1, y2, x2)]
+ */
+at::Tensor ImageProposals(at::Tensor scores,
+                          at::Tensor deltas,
+                          const LayerConstants& constants,
+                          int64_t proposal_count,
+                          float nms_threshold,
+                          const Config& config,
+                          const Window& window) {
   // Improve performance by trimming to top anchors by score
-  // and doing the rest on the smaller subset.
-  auto pre_nms_limit = std::min(int64_t{6000}, anchors.size(0));
-  at::Tensor order;
-  std::tie(scores, order) = scores.sort(/*dim*/ 0, /*descending*/ true);
-
-  order = order.narrow(0, 0, std::min(order.numel(), pre_nms_limit)).flatten();
-  scores =
-      scores.narrow(0, 0, std::min(scores.numel(), pre_nms_limit)).flatten();
-
-  // TODO : (Legacy)Support batch size > 1 ff.
+  // and doing the rest on the smaller subset. Nms sorts them by score.
+  auto order =
+      SelectTopAnchors(scores, constants.level_anchor_counts,
+                       config.pre_nms_limit_per_level, config.pre_nms_limit);
+  scores = scores.index_select(0, order);
+  // Early cutoff of the background anchors, NMS runs only on the rest
+  if (config.rpn_min_score > 0) {
+    auto keep = (scores >= config.rpn_min_score).nonzero().view({-1});
+    if (keep.size(0) == 0)
+      return torch::zeros({0, 4}, scores.options().requires_grad(false));
+    order = order.index_select(0, keep);
+    scores = scores.index_select(0, keep);
+  }
   deltas = deltas.index_select(0, order);
-  anchors = anchors.index_select(0, order);
-
-  // Apply deltas to anchors to get refined anchors.
-  // [batch, N, (y1, x1, y2, x2)]
-  auto boxes = ApplyBoxDeltas(anchors, deltas);
+  auto anchors = constants.anchors.index_select(0, order);
 
-  // Clip to image boundaries. [batch, N, (y1, x1, y2, x2)]
-  auto height = config.image_shape[0];
-  auto width = config.image_shape[1];
-  Window window{0, 0, height, width};
-  boxes = ClipBoxes(boxes, window);
+  // Apply deltas to anchors to get refined anchors and clip them to image
+  // boundaries in one pass. [N, (y1, x1, y2, x2)]
+  auto boxes = DecodeBoxes(anchors, deltas, config.rpn_bbox_std_dev, 1.f, 1.f,
+                           window);
 
   // Filter out small boxes
   // According to Xinlei Chen's paper, this reduces detection accuracy
@@ -58,20 +94,48 @@ at::Tensor ProposalLayer(std::vector<at::Tensor> inputs,
   // Non-max suppression
   auto keep = Nms(torch::cat({boxes, scores.unsqueeze(1)}, 1), nms_threshold);
   keep = keep.narrow(0, 0, std::min(keep.size(0), proposal_count));
-  boxes = boxes.index_select(0, keep);
+  return boxes.index_select(0, keep);
+}
+}  // namespace
 
-  // Normalize dimensions to range of 0 to 1.
-  auto norm =
-      torch::tensor({static_cast<float>(height), static_cast<float>(width),
-                     static_cast<float>(height), static_cast<float>(width)},
-                    at::requires_grad(false).dtype(at::kFloat));
+at::Tensor ProposalLayer(std::vector<at::Tensor> inputs,
+                         int64_t proposal_count,
+                         float nms_threshold,
+                         const LayerConstants& constants,
+                         const Config& config) {
+  // Box Scores. Use the foreground class confidence. [Batch, num_rois]
+  auto scores = inputs[0].narrow(2, 1, 1).squeeze(2);
 
-  if (config.gpu_count > 0)
-    norm = norm.cuda();
-  auto normalized_boxes = boxes / norm;
+  // Box deltas [batch, num_rois, 4], they are scaled by std_dev only for
+  // the selected top anchors
+  auto deltas = inputs[1];
+
+  Window window{0, 0, constants.image_height, constants.image_width};
+
+  // Images have different number of proposals left after NMS, so they are
+  // selected independently
+  auto batch_size = scores.size(0);
+  std::vector<at::Tensor> proposals;
+  int64_t max_count = 0;
+  for (int64_t b = 0; b < batch_size; ++b) {
+    auto boxes = ImageProposals(scores[b], deltas[b], constants,
+                                proposal_count, nms_threshold, config, window);
+    max_count = std::max(max_count, boxes.size(0));
+    proposals.push_back(boxes);
+  }
 
-  // Add back batch dimension
-  normalized_boxes = normalized_boxes.unsqueeze(0);
+  // Pad with zeros to the largest number of proposals in the batch
+  for (auto& boxes : proposals) {
+    if (boxes.size(0) < max_count) {
+      auto padding = torch::zeros({max_count - boxes.size(0), 4},
+                                  boxes.options().requires_grad(false));
+      boxes = torch::cat({boxes, padding}, 0);
+    }
+  }
+  auto boxes = torch::stack(proposals, /*dim*/ 0);
+
+  // Normalize dimensions to range of 0 to 1.
+  auto normalized_boxes = boxes / constants.image_scale;
 
   return normalized_boxes;
 }
@@ -2,6 +2,7 @@
 #define PROPOSALLAYER_H
 
 #include "config.h"
+#include "layerconstants.h"
 
 #include <torch/torch.h>
 
@@ -13,13 +14,15 @@
  *  Inputs:
  *      rpn_probs: [batch, anchors, (bg prob, fg prob)]
  *      rpn_bbox: [batch, anchors, (dy, dx, log(dh), log(dw))]
+ *      constants: anchors and constant tensors on the device of the inputs
  *  Returns:
  *      Proposals in normalized coordinates [batch, rois, (y1, x1, y2, x2)]
+ *      Images with fewer proposals than others are zero padded at the end.
  */
 at::Tensor ProposalLayer(std::vector<at::Tensor> inputs,
                          int64_t proposal_count,
                          float nms_threshold,
-                         at::Tensor anchors,
+                         const LayerConstants& constants,
                          const Config& config);
 
 #endif  // PROPOSALLAYER_H
@@ -0,0 +1,39 @@
+#include "quantization.h"
+
+namespace {
+const double kInt8Max = 127;
+}  // namespace
+
+bool IsQuantizableWeight(const std::string& name, const at::Tensor& weight) {
+  const std::string suffix = ".weight";
+  return weight.dim() >= 2 && weight.scalar_type() == at::kFloat &&
+         name.size() > suffix.size() &&
+         name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+QuantizedWeight QuantizeWeight(const at::Tensor& weight) {
+  auto flat = weight.detach().contiguous().view({weight.size(0), -1});
+  auto scales = std::get<0>(flat.abs().max(1)) / kInt8Max;
+  // All zero channels are kept with the unit scale
+  scales.masked_fill_(scales == 0, 1);
+  auto values =
+      (flat / scales.unsqueeze(1)).round().clamp_(-kInt8Max, kInt8Max);
+  return {values.to(at::kChar).view(weight.sizes()), scales};
+}
+
+at::Tensor DequantizeWeight(const at::Tensor& values,
+                            const at::Tensor& scales) {
+  auto flat = values.contiguous().view({values.size(0), -1}).to(at::kFloat);
+  return (flat * scales.to(at::kFloat).unsqueeze(1)).view(values.sizes());
+}
+
+void FakeQuantizeWeights(torch::nn::Module& module) {
+  torch::NoGradGuard no_grad;
+  for (auto& param : module.named_parameters(true /*recurse*/)) {
+    auto& weight = param.value();
+    if (!IsQuantizableWeight(param.key(), weight))
+      continue;
+    auto quantized = QuantizeWeight(weight.cpu());
+    weight.copy_(DequantizeWeight(quantized.values, quantized.scales));
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include <torch/torch.h>
+
+#include <string>
+
+/* Symmetric per output channel int8 quantization of convolution and linear
+ * weights. Each output channel c is stored as values[c] = round(w[c] / s[c])
+ * clamped to [-127, 127] with s[c] = max|w[c]| / 127, so the weight is
+ * restored as values * scales with the error of at most s[c] / 2.
+ */
+struct QuantizedWeight {
+  at::Tensor values;  // int8, the weight shape
+  at::Tensor scales;  // float, [output channels]
+};
+
+// Only weights of convolutions and linear layers are quantized, batch norms,
+// biases and buffers stay in float
+bool IsQuantizableWeight(const std::string& name, const at::Tensor& weight);
+
+QuantizedWeight QuantizeWeight(const at::Tensor& weight);
+
+at::Tensor DequantizeWeight(const at::Tensor& values, const at::Tensor& scales);
+
+// Replaces the quantizable weights of the module with their int8 round trip,
+// to check the accuracy of the quantized model without saving it
+void FakeQuantizeWeights(torch::nn::Module& module);
+
+#endif  // QUANTIZATION_H
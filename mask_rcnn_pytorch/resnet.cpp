@@ -68,6 +68,22 @@ torch::nn::Sequential ResNetImpl::MakeLayer(uint32_t planes,
   return layers;
 }
 
+torch::nn::Sequential ResNetImpl::FoldStage1(torch::nn::Sequential c1) {
+  auto conv = c1->ptr<torch::nn::Conv2dImpl>(0);
+  ::FoldBatchNorm(*conv, *c1->ptr<torch::nn::BatchNormImpl>(1));
+  torch::nn::Sequential folded;
+  folded->push_back(conv);
+  folded->push_back(c1->ptr<torch::nn::FunctionalImpl>(2));
+  folded->push_back(c1->ptr<SamePad2dImpl>(3));
+  folded->push_back(c1->ptr<torch::nn::FunctionalImpl>(4));
+  return folded;
+}
+
+void ResNetImpl::FoldStage(torch::nn::Sequential stage) {
+  for (size_t i = 0; i < stage->size(); ++i)
+    stage->ptr<BottleneckImpl>(i)->FoldBatchNorm();
+}
+
 at::Tensor ResNetImpl::forward(at::Tensor input) {
   input = c1_->forward(input);
   input = c2_->forward(input);
@@ -105,23 +121,43 @@ BottleneckImpl::BottleneckImpl(uint32_t inplanes,
     register_module("downsample", downsample_);
 }
 
+void BottleneckImpl::FoldBatchNorm() {
+  if (bn_folded_)
+    return;
+  ::FoldBatchNorm(*conv1_, *bn1_);
+  ::FoldBatchNorm(*conv2_, *bn2_);
+  ::FoldBatchNorm(*conv3_, *bn3_);
+  if (downsample_) {
+    ::FoldBatchNorm(*downsample_->ptr<torch::nn::Conv2dImpl>(0),
+                    *downsample_->ptr<torch::nn::BatchNormImpl>(1));
+  }
+  bn_folded_ = true;
+}
+
 at::Tensor BottleneckImpl::forward(at::Tensor x) {
   auto residual = x;
 
   at::Tensor out = conv1_->forward(x);
-  out = bn1_->forward(out);
+  if (!bn_folded_)
+    out = bn1_->forward(out);
   out = relu_->forward(out);
 
   out = padding2_->forward(out);
   out = conv2_->forward(out);
-  out = bn2_->forward(out);
+  if (!bn_folded_)
+    out = bn2_->forward(out);
   out = relu_->forward(out);
 
   out = conv3_->forward(out);
-  out = bn3_->forward(out);
-
-  if (downsample_)
-    residual = downsample_->forward(x);
+  if (!bn_folded_)
+    out = bn3_->forward(out);
+
+  if (downsample_) {
+    // Batch norm of the downsampling is folded into its convolution
+    residual = bn_folded_
+                   ? downsample_->ptr<torch::nn::Conv2dImpl>(0)->forward(x)
+                   : downsample_->forward(x);
+  }
 
   out += residual;
   out = relu_->forward(out);
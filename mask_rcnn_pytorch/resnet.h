@@ -18,6 +18,9 @@ class BottleneckImpl : public torch::nn::Module {
 
   torch::Tensor forward(torch::Tensor x);
 
+  // Folds batch norms into the convolutions, see FoldBatchNorm
+  void FoldBatchNorm();
+
  private:
   torch::nn::Conv2d conv1_{nullptr};
   torch::nn::BatchNorm bn1_{nullptr};
@@ -28,6 +31,7 @@ class BottleneckImpl : public torch::nn::Module {
   torch::nn::BatchNorm bn3_{nullptr};
   torch::nn::Functional relu_{nullptr};
   torch::nn::Sequential downsample_{nullptr};
+  bool bn_folded_{false};
 };
 
 TORCH_MODULE(Bottleneck);
@@ -43,6 +47,14 @@ class ResNetImpl : public torch::nn::Module {
 
   auto GetStages() { return std::make_tuple(c1_, c2_, c3_, c4_, c5_); }
 
+  /* Stage C1 with the batch norm folded into the first convolution, see
+   * FoldBatchNorm. Shares modules with c1, which keeps the identity batch
+   * norm for the state dict.
+   */
+  static torch::nn::Sequential FoldStage1(torch::nn::Sequential c1);
+  // Folds batch norms of the bottlenecks in place
+  static void FoldStage(torch::nn::Sequential stage);
+
  private:
   torch::nn::Sequential MakeLayer(uint32_t planes,
                                   uint32_t blocks,
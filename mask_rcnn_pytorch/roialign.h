@@ -10,11 +10,12 @@
  *  - image_shape: [height, width, channels]. Shape of input image in pixels
  *  Inputs:
  *  - boxes: [batch, num_boxes, (y1, x1, y2, x2)] in normalized
- *           coordinates.
+ *           coordinates. [num_boxes, 4] is treated as a batch of one image.
  *  - Feature maps: List of feature maps from different levels of the pyramid.
  *                  Each is [batch, channels, height, width]
  *  Output:
- *  Pooled regions in the shape: [num_boxes, height, width, channels].
+ *  Pooled regions in the shape: [batch * num_boxes, channels, height, width],
+ *  boxes of the image b occupy rows [b * num_boxes, (b + 1) * num_boxes).
  *  The width and height are those specific in the pool_shape in the layer
  *  constructor.
  */
@@ -22,4 +23,11 @@ torch::Tensor PyramidRoiAlign(std::vector<torch::Tensor> input,
                               uint32_t pool_size,
                               const std::vector<int32_t>& image_shape);
 
+// Feature map [batch, channels, height, width] with the channels of a
+// location next to each other. PyTorch 1.0 has no memory formats, so it's a
+// permuted view of a dense [batch, height, width, channels] tensor, both
+// RoIAlign kernels read it in place.
+torch::Tensor ToChannelsLast(torch::Tensor feature_map);
+bool IsChannelsLast(const torch::Tensor& feature_map);
+
 #endif  // ROIALIGN_H
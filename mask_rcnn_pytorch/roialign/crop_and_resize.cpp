@@ -1,8 +1,259 @@
 #include "crop_and_resize.h"
+#include "../../threadpool.h"
+#include "pyramid_levels.h"
 #include <math.h>
-#include <omp.h>
 #include <stdio.h>
 #include <torch/torch.h>
+#include <vector>
+
+namespace {
+// Crops one box from the image and resizes it to [depth, crop_height,
+// crop_width], image is [depth, image_height, image_width]
+inline void CropAndResizeBox(const float* image_data,
+                             const int depth,
+                             const int image_height,
+                             const int image_width,
+                             const float* box,
+                             float* crop_data,
+                             const int crop_height,
+                             const int crop_width,
+                             const float extrapolation_value) {
+  const int image_channel_elements = image_height * image_width;
+  const int channel_elements = crop_height * crop_width;
+
+  const float y1 = box[0];
+  const float x1 = box[1];
+  const float y2 = box[2];
+  const float x2 = box[3];
+
+  const float height_scale =
+      (crop_height > 1) ? (y2 - y1) * (image_height - 1) / (crop_height - 1)
+                        : 0;
+  const float width_scale =
+      (crop_width > 1) ? (x2 - x1) * (image_width - 1) / (crop_width - 1) : 0;
+
+  for (int y = 0; y < crop_height; ++y) {
+    const float in_y = (crop_height > 1)
+                           ? y1 * (image_height - 1) + y * height_scale
+                           : 0.5 * (y1 + y2) * (image_height - 1);
+
+    if (in_y < 0 || in_y > image_height - 1) {
+      for (int x = 0; x < crop_width; ++x) {
+        for (int d = 0; d < depth; ++d) {
+          // crops(b, y, x, d) = extrapolation_value;
+          crop_data[channel_elements * d + y * crop_width + x] =
+              extrapolation_value;
+        }
+      }
+      continue;
+    }
+
+    const int top_y_index = floorf(in_y);
+    const int bottom_y_index = ceilf(in_y);
+    const float y_lerp = in_y - top_y_index;
+
+    for (int x = 0; x < crop_width; ++x) {
+      const float in_x = (crop_width > 1)
+                             ? x1 * (image_width - 1) + x * width_scale
+                             : 0.5 * (x1 + x2) * (image_width - 1);
+      if (in_x < 0 || in_x > image_width - 1) {
+        for (int d = 0; d < depth; ++d) {
+          crop_data[channel_elements * d + y * crop_width + x] =
+              extrapolation_value;
+        }
+        continue;
+      }
+
+      const int left_x_index = floorf(in_x);
+      const int right_x_index = ceilf(in_x);
+      const float x_lerp = in_x - left_x_index;
+
+      for (int d = 0; d < depth; ++d) {
+        const float* pimage = image_data + d * image_channel_elements;
+
+        const float top_left = pimage[top_y_index * image_width + left_x_index];
+        const float top_right =
+            pimage[top_y_index * image_width + right_x_index];
+        const float bottom_left =
+            pimage[bottom_y_index * image_width + left_x_index];
+        const float bottom_right =
+            pimage[bottom_y_index * image_width + right_x_index];
+
+        const float top = top_left + (top_right - top_left) * x_lerp;
+        const float bottom =
+            bottom_left + (bottom_right - bottom_left) * x_lerp;
+
+        crop_data[channel_elements * d + y * crop_width + x] =
+            top + (bottom - top) * y_lerp;
+      }
+    }  // end for x
+  }    // end for y
+}
+
+// Depth starting from which images are transposed to channels-last layout,
+// for small depth (e.g. masks in DetectionTargetLayer) it doesn't pay off
+const int kChannelsLastMinDepth = 16;
+
+// Bilinear sampling point of one crop row or column
+struct CropTap {
+  int low;
+  int high;
+  float lerp;
+  bool inside;
+};
+
+// Sampling points of the crop_size rows (columns) of the box side [v1, v2]
+// normalized to the image side of image_size
+void ComputeCropTaps(const float v1,
+                     const float v2,
+                     const int image_size,
+                     const int crop_size,
+                     CropTap* taps) {
+  const float scale =
+      (crop_size > 1) ? (v2 - v1) * (image_size - 1) / (crop_size - 1) : 0;
+  for (int i = 0; i < crop_size; ++i) {
+    const float in = (crop_size > 1) ? v1 * (image_size - 1) + i * scale
+                                     : 0.5 * (v1 + v2) * (image_size - 1);
+    auto& tap = taps[i];
+    tap.inside = in >= 0 && in <= image_size - 1;
+    tap.low = tap.inside ? static_cast<int>(floorf(in)) : 0;
+    tap.high = tap.inside ? static_cast<int>(ceilf(in)) : 0;
+    tap.lerp = in - tap.low;
+  }
+}
+
+// Computes one row of the crop from the channels-last image
+// [image_height, image_width, depth], crop_row is [crop_width, depth].
+// Four bilinear taps are contiguous channel vectors, so the inner loop is
+// vectorized. Non zero kCropWidth and kDepth replace the runtime sizes, the
+// column loop is unrolled for them.
+template <int kCropWidth, int kDepth>
+__attribute__((always_inline)) inline void CropRowNHWC(
+    const float* image_data,
+    int depth,
+    const int image_width,
+    const CropTap& y_tap,
+    const CropTap* x_taps,
+    float* crop_row,
+    int crop_width,
+    const float extrapolation_value) {
+  if (kCropWidth > 0)
+    crop_width = kCropWidth;
+  if (kDepth > 0)
+    depth = kDepth;
+  if (!y_tap.inside) {
+    for (int i = 0; i < crop_width * depth; ++i)
+      crop_row[i] = extrapolation_value;
+    return;
+  }
+
+  const int row_elements = image_width * depth;
+  const float* top_row = image_data + y_tap.low * row_elements;
+  const float* bottom_row = image_data + y_tap.high * row_elements;
+  const float y_lerp = y_tap.lerp;
+
+#pragma GCC unroll 16
+  for (int x = 0; x < crop_width; ++x) {
+    float* out = crop_row + x * depth;
+    const auto& x_tap = x_taps[x];
+    if (!x_tap.inside) {
+      for (int d = 0; d < depth; ++d)
+        out[d] = extrapolation_value;
+      continue;
+    }
+
+    const float x_lerp = x_tap.lerp;
+    const float* top_left = top_row + x_tap.low * depth;
+    const float* top_right = top_row + x_tap.high * depth;
+    const float* bottom_left = bottom_row + x_tap.low * depth;
+    const float* bottom_right = bottom_row + x_tap.high * depth;
+
+#pragma omp simd
+    for (int d = 0; d < depth; ++d) {
+      const float top = top_left[d] + (top_right[d] - top_left[d]) * x_lerp;
+      const float bottom =
+          bottom_left[d] + (bottom_right[d] - bottom_left[d]) * x_lerp;
+      out[d] = top + (bottom - top) * y_lerp;
+    }
+  }  // end for x
+}
+
+// Picks the instantiation for the pool sizes of Config and the depth of the
+// pyramid, the AVX2/FMA clone is selected at runtime
+__attribute__((target_clones("arch=haswell", "default"))) void
+CropAndResizeRowNHWC(const float* image_data,
+                     const int depth,
+                     const int image_width,
+                     const CropTap& y_tap,
+                     const CropTap* x_taps,
+                     float* crop_row,
+                     const int crop_width,
+                     const float extrapolation_value) {
+  if (crop_width == 7 && depth == 256)
+    CropRowNHWC<7, 256>(image_data, depth, image_width, y_tap, x_taps,
+                        crop_row, crop_width, extrapolation_value);
+  else if (crop_width == 14 && depth == 256)
+    CropRowNHWC<14, 256>(image_data, depth, image_width, y_tap, x_taps,
+                         crop_row, crop_width, extrapolation_value);
+  else
+    CropRowNHWC<0, 0>(image_data, depth, image_width, y_tap, x_taps,
+                      crop_row, crop_width, extrapolation_value);
+}
+
+// Crops boxes from channels-last levels, each level is
+// [batch, height, width, depth], crops are
+// [num_boxes, crop_height, crop_width, depth]. The sampling points of the
+// boxes are computed first, then the work is split by (box, row) pairs, so
+// all cores are busy even for a few boxes.
+void CropAndResizeNHWC(const PyramidLevels& levels,
+                       const int batch_size,
+                       const int depth,
+                       const float image_area,
+                       const float* boxes_data,
+                       const int* box_index_data,
+                       const int num_boxes,
+                       float* crops_data,
+                       const int crop_height,
+                       const int crop_width,
+                       const float extrapolation_value) {
+  const int row_elements = crop_width * depth;
+  const int crop_elements = crop_height * row_elements;
+
+  std::vector<int> box_levels(static_cast<size_t>(num_boxes));
+  std::vector<CropTap> y_taps(static_cast<size_t>(num_boxes) * crop_height);
+  std::vector<CropTap> x_taps(static_cast<size_t>(num_boxes) * crop_width);
+  for (int b = 0; b < num_boxes; ++b) {
+    const int b_in = box_index_data[b];
+    if (b_in < 0 || b_in >= batch_size) {
+      printf("Error: batch_index %d out of range [0, %d)\n", b_in, batch_size);
+      exit(-1);
+    }
+    const float* box = boxes_data + b * 4;
+    const int l = levels.num_levels > 1
+                      ? PyramidLevelIndex(box, image_area, levels.num_levels)
+                      : 0;
+    box_levels[b] = l;
+    ComputeCropTaps(box[0], box[2], levels.height[l], crop_height,
+                    y_taps.data() + b * crop_height);
+    ComputeCropTaps(box[1], box[3], levels.width[l], crop_width,
+                    x_taps.data() + b * crop_width);
+  }
+
+  auto crop_row = [&](size_t i) {
+    const int b = static_cast<int>(i / crop_height);
+    const int y = static_cast<int>(i % crop_height);
+    const int l = box_levels[b];
+    const int image_elements = levels.height[l] * levels.width[l] * depth;
+    CropAndResizeRowNHWC(levels.data[l] + box_index_data[b] * image_elements,
+                         depth, levels.width[l], y_taps[b * crop_height + y],
+                         x_taps.data() + b * crop_width,
+                         crops_data + b * crop_elements + y * row_elements,
+                         crop_width, extrapolation_value);
+  };
+  utils::ParallelFor(0, static_cast<size_t>(num_boxes) * crop_height,
+                     crop_row);
+}
+}  // namespace
 
 void CropAndResizePerBox(const float* image_data,
                          const int batch_size,
@@ -19,93 +270,23 @@ void CropAndResizePerBox(const float* image_data,
                          const int crop_height,
                          const int crop_width,
                          const float extrapolation_value) {
-  const int image_channel_elements = image_height * image_width;
-  const int image_elements = depth * image_channel_elements;
-
-  const int channel_elements = crop_height * crop_width;
-  const int crop_elements = depth * channel_elements;
-
-  int b{0};
-
-#pragma omp parallel for
-  for (b = start_box; b < limit_box; ++b) {
-    const float* box = boxes_data + b * 4;
-    const float y1 = box[0];
-    const float x1 = box[1];
-    const float y2 = box[2];
-    const float x2 = box[3];
+  const int image_elements = depth * image_height * image_width;
+  const int crop_elements = depth * crop_height * crop_width;
 
+  if (start_box >= limit_box)
+    return;
+  utils::ParallelFor(start_box, limit_box, [&](size_t i) {
+    const int b = static_cast<int>(i);
     const int b_in = box_index_data[b];
     if (b_in < 0 || b_in >= batch_size) {
       printf("Error: batch_index %d out of range [0, %d)\n", b_in, batch_size);
       exit(-1);
     }
-
-    const float height_scale =
-        (crop_height > 1) ? (y2 - y1) * (image_height - 1) / (crop_height - 1)
-                          : 0;
-    const float width_scale =
-        (crop_width > 1) ? (x2 - x1) * (image_width - 1) / (crop_width - 1) : 0;
-
-    for (int y = 0; y < crop_height; ++y) {
-      const float in_y = (crop_height > 1)
-                             ? y1 * (image_height - 1) + y * height_scale
-                             : 0.5 * (y1 + y2) * (image_height - 1);
-
-      if (in_y < 0 || in_y > image_height - 1) {
-        for (int x = 0; x < crop_width; ++x) {
-          for (int d = 0; d < depth; ++d) {
-            // crops(b, y, x, d) = extrapolation_value;
-            crops_data[crop_elements * b + channel_elements * d +
-                       y * crop_width + x] = extrapolation_value;
-          }
-        }
-        continue;
-      }
-
-      const int top_y_index = floorf(in_y);
-      const int bottom_y_index = ceilf(in_y);
-      const float y_lerp = in_y - top_y_index;
-
-      for (int x = 0; x < crop_width; ++x) {
-        const float in_x = (crop_width > 1)
-                               ? x1 * (image_width - 1) + x * width_scale
-                               : 0.5 * (x1 + x2) * (image_width - 1);
-        if (in_x < 0 || in_x > image_width - 1) {
-          for (int d = 0; d < depth; ++d) {
-            crops_data[crop_elements * b + channel_elements * d +
-                       y * crop_width + x] = extrapolation_value;
-          }
-          continue;
-        }
-
-        const int left_x_index = floorf(in_x);
-        const int right_x_index = ceilf(in_x);
-        const float x_lerp = in_x - left_x_index;
-
-        for (int d = 0; d < depth; ++d) {
-          const float* pimage =
-              image_data + b_in * image_elements + d * image_channel_elements;
-
-          const float top_left =
-              pimage[top_y_index * image_width + left_x_index];
-          const float top_right =
-              pimage[top_y_index * image_width + right_x_index];
-          const float bottom_left =
-              pimage[bottom_y_index * image_width + left_x_index];
-          const float bottom_right =
-              pimage[bottom_y_index * image_width + right_x_index];
-
-          const float top = top_left + (top_right - top_left) * x_lerp;
-          const float bottom =
-              bottom_left + (bottom_right - bottom_left) * x_lerp;
-
-          crops_data[crop_elements * b + channel_elements * d + y * crop_width +
-                     x] = top + (bottom - top) * y_lerp;
-        }
-      }  // end for x
-    }    // end for y
-  }      // end for b
+    CropAndResizeBox(image_data + b_in * image_elements, depth, image_height,
+                     image_width, boxes_data + b * 4,
+                     crops_data + b * crop_elements, crop_height, crop_width,
+                     extrapolation_value);
+  });
 }
 
 void crop_and_resize_forward(at::Tensor image,
@@ -122,6 +303,27 @@ void crop_and_resize_forward(at::Tensor image,
 
   const int num_boxes = boxes.size(0);
 
+  if (depth >= kChannelsLastMinDepth) {
+    image = image.permute({0, 2, 3, 1}).contiguous();
+    boxes = boxes.contiguous();
+    box_index = box_index.contiguous();
+    auto crops_nhwc =
+        torch::empty({num_boxes, crop_height, crop_width, depth},
+                     image.options().requires_grad(false));
+    PyramidLevels levels;
+    levels.num_levels = 1;
+    levels.data[0] = image.data<float>();
+    levels.height[0] = image_height;
+    levels.width[0] = image_width;
+    CropAndResizeNHWC(levels, batch_size, depth, 0, boxes.data<float>(),
+                      box_index.data<int>(), num_boxes,
+                      crops_nhwc.data<float>(), crop_height, crop_width,
+                      extrapolation_value);
+    crops.resize_({num_boxes, depth, crop_height, crop_width});
+    crops.copy_(crops_nhwc.permute({0, 3, 1, 2}));
+    return;
+  }
+
   // init output space
   crops.resize_({num_boxes, depth, crop_height, crop_width});
   crops.zero_();
@@ -135,6 +337,73 @@ void crop_and_resize_forward(at::Tensor image,
       crops.data<float>(), crop_height, crop_width, extrapolation_value);
 }
 
+void pyramid_crop_and_resize_forward(
+    std::vector<at::Tensor> feature_maps,  // [P2, P3, ...]
+    at::Tensor boxes,                      // [y1, x1, y2, x2] normalized
+    at::Tensor box_index,                  // range in [0, batch_size)
+    const float image_area,
+    const float extrapolation_value,
+    const int crop_height,
+    const int crop_width,
+    at::Tensor crops) {
+  const int num_levels = static_cast<int>(feature_maps.size());
+  assert(num_levels > 0 && num_levels <= PYRAMID_MAX_LEVELS);
+
+  const int batch_size = feature_maps[0].size(0);
+  const int depth = feature_maps[0].size(1);
+  const bool channels_last = depth >= kChannelsLastMinDepth;
+
+  PyramidLevels levels;
+  levels.num_levels = num_levels;
+  for (int l = 0; l < num_levels; ++l) {
+    levels.height[l] = feature_maps[l].size(2);
+    levels.width[l] = feature_maps[l].size(3);
+    if (channels_last)
+      feature_maps[l] = feature_maps[l].permute({0, 2, 3, 1});
+    feature_maps[l] = feature_maps[l].contiguous();
+    levels.data[l] = feature_maps[l].data<float>();
+  }
+
+  boxes = boxes.contiguous();
+  box_index = box_index.contiguous();
+  const int num_boxes = boxes.size(0);
+  const float* boxes_data = boxes.data<float>();
+  const int* box_index_data = box_index.data<int>();
+
+  if (channels_last) {
+    auto crops_nhwc =
+        torch::empty({num_boxes, crop_height, crop_width, depth},
+                     feature_maps[0].options().requires_grad(false));
+    CropAndResizeNHWC(levels, batch_size, depth, image_area, boxes_data,
+                      box_index_data, num_boxes, crops_nhwc.data<float>(),
+                      crop_height, crop_width, extrapolation_value);
+    crops.resize_({num_boxes, depth, crop_height, crop_width});
+    crops.copy_(crops_nhwc.permute({0, 3, 1, 2}));
+    return;
+  }
+
+  // init output space
+  crops.resize_({num_boxes, depth, crop_height, crop_width});
+  float* crops_data = crops.data<float>();
+  const int crop_elements = depth * crop_height * crop_width;
+
+  utils::ParallelFor(0, num_boxes, [&](size_t i) {
+    const int b = static_cast<int>(i);
+    const int b_in = box_index_data[b];
+    if (b_in < 0 || b_in >= batch_size) {
+      printf("Error: batch_index %d out of range [0, %d)\n", b_in, batch_size);
+      exit(-1);
+    }
+    const float* box = boxes_data + b * 4;
+    const int l = PyramidLevelIndex(box, image_area, num_levels);
+    const int image_elements = depth * levels.height[l] * levels.width[l];
+    CropAndResizeBox(levels.data[l] + b_in * image_elements, depth,
+                     levels.height[l], levels.width[l], box,
+                     crops_data + b * crop_elements, crop_height, crop_width,
+                     extrapolation_value);
+  });
+}
+
 void crop_and_resize_backward(
     at::Tensor grads,
     at::Tensor boxes,       // [y1, x1, y2, x2]
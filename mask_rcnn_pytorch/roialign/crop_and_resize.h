@@ -1,4 +1,5 @@
 #include <torch/torch.h>
+#include <vector>
 
 void crop_and_resize_forward(at::Tensor image,
                              at::Tensor boxes,      // [y1, x1, y2, x2]
@@ -8,6 +9,19 @@ void crop_and_resize_forward(at::Tensor image,
                              const int crop_width,
                              at::Tensor crops);
 
+// Fused crop_and_resize for all levels of the feature pyramid, each box picks
+// its level by area, see PyramidLevelIndex, and is written to its own row of
+// crops, so boxes keep the input order.
+void pyramid_crop_and_resize_forward(
+    std::vector<at::Tensor> feature_maps,  // [P2, P3, ...]
+    at::Tensor boxes,                      // [y1, x1, y2, x2] normalized
+    at::Tensor box_index,                  // range in [0, batch_size)
+    const float image_area,
+    const float extrapolation_value,
+    const int crop_height,
+    const int crop_width,
+    at::Tensor crops);
+
 void crop_and_resize_backward(
     at::Tensor grads,
     at::Tensor boxes,       // [y1, x1, y2, x2]
@@ -1,5 +1,6 @@
 #include "crop_and_resize_gpu.h"
 #include <torch/torch.h>
+#include "../roialign.h"
 #include "cuda/crop_and_resize_kernel.h"
 
 void crop_and_resize_gpu_forward(
@@ -33,6 +34,75 @@ void crop_and_resize_gpu_forward(
       crops.data<float>());
 }
 
+void pyramid_crop_and_resize_gpu_forward(
+    std::vector<at::Tensor> feature_maps,  // [P2, P3, ...]
+    at::Tensor boxes,                      // [y1, x1, y2, x2] normalized
+    at::Tensor box_index,                  // range in [0, batch_size)
+    const float image_area,
+    const float extrapolation_value,
+    const int crop_height,
+    const int crop_width,
+    at::Tensor crops) {
+  assert(boxes.is_cuda());
+  assert(box_index.is_cuda());
+  assert(crops.is_cuda());
+
+  const int num_levels = static_cast<int>(feature_maps.size());
+  assert(num_levels > 0 && num_levels <= PYRAMID_MAX_LEVELS);
+
+  const int batch_size = feature_maps[0].size(0);
+  const int depth = feature_maps[0].size(1);
+  // channels-last maps are read in place, other layouts are made NCHW
+  bool channels_last = true;
+  for (int l = 0; l < num_levels; ++l)
+    channels_last = channels_last && IsChannelsLast(feature_maps[l]);
+  for (int l = 0; l < num_levels; ++l) {
+    assert(feature_maps[l].is_cuda());
+    if (!channels_last)
+      feature_maps[l] = feature_maps[l].contiguous();
+  }
+
+  boxes = boxes.contiguous();
+  box_index = box_index.contiguous();
+  const int num_boxes = boxes.size(0);
+
+  // init output space, every element is written by the kernel
+  crops.resize_({num_boxes, depth, crop_height, crop_width});
+
+  if (feature_maps[0].scalar_type() == at::kHalf) {
+    assert(crops.scalar_type() == at::kHalf);
+    PyramidLevelsHalf levels;
+    levels.num_levels = num_levels;
+    for (int l = 0; l < num_levels; ++l) {
+      levels.data[l] = reinterpret_cast<const unsigned short*>(
+          feature_maps[l].data<at::Half>());
+      levels.height[l] = feature_maps[l].size(2);
+      levels.width[l] = feature_maps[l].size(3);
+    }
+    PyramidCropAndResizeHalfLaucher(
+        levels, boxes.data<float>(), box_index.data<int>(), num_boxes,
+        batch_size, image_area, crop_height, crop_width, depth,
+        extrapolation_value,
+        reinterpret_cast<unsigned short*>(crops.data<at::Half>()),
+        channels_last);
+    return;
+  }
+
+  PyramidLevels levels;
+  levels.num_levels = num_levels;
+  for (int l = 0; l < num_levels; ++l) {
+    levels.data[l] = feature_maps[l].data<float>();
+    levels.height[l] = feature_maps[l].size(2);
+    levels.width[l] = feature_maps[l].size(3);
+  }
+
+  PyramidCropAndResizeLaucher(levels, boxes.data<float>(),
+                              box_index.data<int>(), num_boxes, batch_size,
+                              image_area, crop_height, crop_width, depth,
+                              extrapolation_value, crops.data<float>(),
+                              channels_last);
+}
+
 void crop_and_resize_gpu_backward(
     at::Tensor grads,
     at::Tensor boxes,       // [y1, x1, y2, x2]
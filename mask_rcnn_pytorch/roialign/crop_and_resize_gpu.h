@@ -1,4 +1,5 @@
 #include <torch/torch.h>
+#include <vector>
 
 void crop_and_resize_gpu_forward(
     at::Tensor image,
@@ -9,6 +10,17 @@ void crop_and_resize_gpu_forward(
     const int crop_width,
     at::Tensor crops);
 
+// Feature maps and crops are both float or both half
+void pyramid_crop_and_resize_gpu_forward(
+    std::vector<at::Tensor> feature_maps,  // [P2, P3, ...]
+    at::Tensor boxes,                      // [y1, x1, y2, x2] normalized
+    at::Tensor box_index,                  // range in [0, batch_size)
+    const float image_area,
+    const float extrapolation_value,
+    const int crop_height,
+    const int crop_width,
+    at::Tensor crops);
+
 void crop_and_resize_gpu_backward(
     at::Tensor grads,
     at::Tensor boxes,       // [y1, x1, y2, x2]
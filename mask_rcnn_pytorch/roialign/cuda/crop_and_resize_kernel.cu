@@ -1,3 +1,4 @@
+#include <cuda_fp16.h>
 #include <math.h>
 #include <stdio.h>
 #include "crop_and_resize_kernel.h"
@@ -85,6 +86,140 @@ __global__ void CropAndResizeKernel(const int nthreads,
   }
 }
 
+// Feature values are always interpolated in float
+__device__ inline float LoadValue(const float* ptr) {
+  return *ptr;
+}
+
+__device__ inline float LoadValue(const unsigned short* ptr) {
+  return __half2float(__ushort_as_half(*ptr));
+}
+
+__device__ inline void StoreValue(float* ptr, float value) {
+  *ptr = value;
+}
+
+__device__ inline void StoreValue(unsigned short* ptr, float value) {
+  *ptr = __half_as_ushort(__float2half(value));
+}
+
+// With channels_last the feature maps are [batch, height, width, depth] and
+// the neighbouring threads take the neighbouring channels of a crop location,
+// so the taps are read coalesced, crops are NCHW in both layouts.
+// Non zero kCropSize and kDepth replace the runtime sizes, so the index
+// divisions become multiplications and the crop_height > 1 checks go away.
+template <bool channels_last,
+          int kCropSize,
+          int kDepth,
+          typename Levels,
+          typename scalar_t>
+__global__ void PyramidCropAndResizeKernel(const int nthreads,
+                                           Levels levels,
+                                           const float* boxes_ptr,
+                                           const int* box_ind_ptr,
+                                           int num_boxes,
+                                           int batch,
+                                           float image_area,
+                                           int crop_height,
+                                           int crop_width,
+                                           int depth,
+                                           float extrapolation_value,
+                                           scalar_t* crops_ptr) {
+  if (kCropSize > 0) {
+    crop_height = kCropSize;
+    crop_width = kCropSize;
+  }
+  if (kDepth > 0)
+    depth = kDepth;
+  CUDA_1D_KERNEL_LOOP(thread_idx, nthreads) {
+    // NCHW: idx = w + crop_width * (h + crop_height * (d + depth * b))
+    // NHWC: idx = d + depth * (w + crop_width * (h + crop_height * b))
+    int idx = thread_idx;
+    int x, y, d, b;
+    if (channels_last) {
+      d = idx % depth;
+      idx /= depth;
+      x = idx % crop_width;
+      idx /= crop_width;
+      y = idx % crop_height;
+      b = idx / crop_height;
+    } else {
+      x = idx % crop_width;
+      idx /= crop_width;
+      y = idx % crop_height;
+      idx /= crop_height;
+      d = idx % depth;
+      b = idx / depth;
+    }
+    const int out_idx = ((b * depth + d) * crop_height + y) * crop_width + x;
+
+    const float* box = boxes_ptr + b * 4;
+    const float y1 = box[0];
+    const float x1 = box[1];
+    const float y2 = box[2];
+    const float x2 = box[3];
+
+    const int b_in = box_ind_ptr[b];
+    if (b_in < 0 || b_in >= batch) {
+      continue;
+    }
+
+    // Every box picks its own level of the pyramid
+    const int level = PyramidLevelIndex(box, image_area, levels.num_levels);
+    const int image_height = levels.height[level];
+    const int image_width = levels.width[level];
+
+    const float height_scale =
+        (crop_height > 1) ? (y2 - y1) * (image_height - 1) / (crop_height - 1)
+                          : 0;
+    const float width_scale =
+        (crop_width > 1) ? (x2 - x1) * (image_width - 1) / (crop_width - 1) : 0;
+
+    const float in_y = (crop_height > 1)
+                           ? y1 * (image_height - 1) + y * height_scale
+                           : 0.5 * (y1 + y2) * (image_height - 1);
+    if (in_y < 0 || in_y > image_height - 1) {
+      StoreValue(crops_ptr + out_idx, extrapolation_value);
+      continue;
+    }
+
+    const float in_x = (crop_width > 1)
+                           ? x1 * (image_width - 1) + x * width_scale
+                           : 0.5 * (x1 + x2) * (image_width - 1);
+    if (in_x < 0 || in_x > image_width - 1) {
+      StoreValue(crops_ptr + out_idx, extrapolation_value);
+      continue;
+    }
+
+    const int top_y_index = floorf(in_y);
+    const int bottom_y_index = ceilf(in_y);
+    const float y_lerp = in_y - top_y_index;
+
+    const int left_x_index = floorf(in_x);
+    const int right_x_index = ceilf(in_x);
+    const float x_lerp = in_x - left_x_index;
+
+    // strides of the location and of the channel
+    const int pixel = channels_last ? depth : 1;
+    const int channel = channels_last ? 1 : image_height * image_width;
+    const auto* pimage = levels.data[level] +
+                         b_in * depth * image_height * image_width +
+                         d * channel;
+    const float top_left = LoadValue(
+        pimage + (top_y_index * image_width + left_x_index) * pixel);
+    const float top_right = LoadValue(
+        pimage + (top_y_index * image_width + right_x_index) * pixel);
+    const float bottom_left = LoadValue(
+        pimage + (bottom_y_index * image_width + left_x_index) * pixel);
+    const float bottom_right = LoadValue(
+        pimage + (bottom_y_index * image_width + right_x_index) * pixel);
+
+    const float top = top_left + (top_right - top_left) * x_lerp;
+    const float bottom = bottom_left + (bottom_right - bottom_left) * x_lerp;
+    StoreValue(crops_ptr + out_idx, top + (bottom - top) * y_lerp);
+  }
+}
+
 __global__ void CropAndResizeBackpropImageKernel(const int nthreads,
                                                  const float* grads_ptr,
                                                  const float* boxes_ptr,
@@ -195,6 +330,122 @@ void CropAndResizeLaucher(const float* image_ptr,
   }
 }
 
+// Picks the instantiation for the pool sizes of Config and the depth of the
+// pyramid, other sizes run the generic kernel
+template <bool channels_last, typename Levels, typename scalar_t>
+void LaunchPyramidCropAndResize(int block_count,
+                                int thread_per_block,
+                                int total_count,
+                                Levels levels,
+                                const float* boxes_ptr,
+                                const int* box_ind_ptr,
+                                int num_boxes,
+                                int batch,
+                                float image_area,
+                                int crop_height,
+                                int crop_width,
+                                int depth,
+                                float extrapolation_value,
+                                scalar_t* crops_ptr) {
+  const bool square = crop_height == crop_width;
+  if (square && crop_height == 7 && depth == 256)
+    PyramidCropAndResizeKernel<channels_last, 7, 256>
+        <<<block_count, thread_per_block, 0>>>(
+            total_count, levels, boxes_ptr, box_ind_ptr, num_boxes, batch,
+            image_area, crop_height, crop_width, depth, extrapolation_value,
+            crops_ptr);
+  else if (square && crop_height == 14 && depth == 256)
+    PyramidCropAndResizeKernel<channels_last, 14, 256>
+        <<<block_count, thread_per_block, 0>>>(
+            total_count, levels, boxes_ptr, box_ind_ptr, num_boxes, batch,
+            image_area, crop_height, crop_width, depth, extrapolation_value,
+            crops_ptr);
+  else
+    PyramidCropAndResizeKernel<channels_last, 0, 0>
+        <<<block_count, thread_per_block, 0>>>(
+            total_count, levels, boxes_ptr, box_ind_ptr, num_boxes, batch,
+            image_area, crop_height, crop_width, depth, extrapolation_value,
+            crops_ptr);
+}
+
+void PyramidCropAndResizeLaucher(PyramidLevels levels,
+                                 const float* boxes_ptr,
+                                 const int* box_ind_ptr,
+                                 int num_boxes,
+                                 int batch,
+                                 float image_area,
+                                 int crop_height,
+                                 int crop_width,
+                                 int depth,
+                                 float extrapolation_value,
+                                 float* crops_ptr,
+                                 int channels_last) {
+  const int total_count = num_boxes * crop_height * crop_width * depth;
+  const int thread_per_block = 512;
+  const int block_count =
+      (total_count + thread_per_block - 1) / thread_per_block;
+  cudaError_t err;
+
+  if (total_count > 0) {
+    if (channels_last)
+      LaunchPyramidCropAndResize<true>(
+          block_count, thread_per_block, total_count, levels, boxes_ptr,
+          box_ind_ptr, num_boxes, batch, image_area, crop_height, crop_width,
+          depth, extrapolation_value, crops_ptr);
+    else
+      LaunchPyramidCropAndResize<false>(
+          block_count, thread_per_block, total_count, levels, boxes_ptr,
+          box_ind_ptr, num_boxes, batch, image_area, crop_height, crop_width,
+          depth, extrapolation_value, crops_ptr);
+
+    err = cudaGetLastError();
+    if (cudaSuccess != err) {
+      fprintf(stderr, "cudaCheckError() failed : %s\n",
+              cudaGetErrorString(err));
+      exit(-1);
+    }
+  }
+}
+
+void PyramidCropAndResizeHalfLaucher(PyramidLevelsHalf levels,
+                                     const float* boxes_ptr,
+                                     const int* box_ind_ptr,
+                                     int num_boxes,
+                                     int batch,
+                                     float image_area,
+                                     int crop_height,
+                                     int crop_width,
+                                     int depth,
+                                     float extrapolation_value,
+                                     unsigned short* crops_ptr,
+                                     int channels_last) {
+  const int total_count = num_boxes * crop_height * crop_width * depth;
+  const int thread_per_block = 512;
+  const int block_count =
+      (total_count + thread_per_block - 1) / thread_per_block;
+  cudaError_t err;
+
+  if (total_count > 0) {
+    if (channels_last)
+      LaunchPyramidCropAndResize<true>(
+          block_count, thread_per_block, total_count, levels, boxes_ptr,
+          box_ind_ptr, num_boxes, batch, image_area, crop_height, crop_width,
+          depth, extrapolation_value, crops_ptr);
+    else
+      LaunchPyramidCropAndResize<false>(
+          block_count, thread_per_block, total_count, levels, boxes_ptr,
+          box_ind_ptr, num_boxes, batch, image_area, crop_height, crop_width,
+          depth, extrapolation_value, crops_ptr);
+
+    err = cudaGetLastError();
+    if (cudaSuccess != err) {
+      fprintf(stderr, "cudaCheckError() failed : %s\n",
+              cudaGetErrorString(err));
+      exit(-1);
+    }
+  }
+}
+
 void CropAndResizeBackpropImageLaucher(const float* grads_ptr,
                                        const float* boxes_ptr,
                                        const int* box_ind_ptr,
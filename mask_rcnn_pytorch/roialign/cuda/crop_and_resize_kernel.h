@@ -1,6 +1,8 @@
 #ifndef _CropAndResize_Kernel
 #define _CropAndResize_Kernel
 
+#include "../pyramid_levels.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +20,34 @@ void CropAndResizeLaucher(const float* image_ptr,
                           float extrapolation_value,
                           float* crops_ptr);
 
+void PyramidCropAndResizeLaucher(PyramidLevels levels,
+                                 const float* boxes_ptr,
+                                 const int* box_ind_ptr,
+                                 int num_boxes,
+                                 int batch,
+                                 float image_area,
+                                 int crop_height,
+                                 int crop_width,
+                                 int depth,
+                                 float extrapolation_value,
+                                 float* crops_ptr,
+                                 int channels_last);
+
+// Half precision feature maps and crops, interpolation is done in float.
+// With channels_last the feature maps are [batch, height, width, depth].
+void PyramidCropAndResizeHalfLaucher(PyramidLevelsHalf levels,
+                                     const float* boxes_ptr,
+                                     const int* box_ind_ptr,
+                                     int num_boxes,
+                                     int batch,
+                                     float image_area,
+                                     int crop_height,
+                                     int crop_width,
+                                     int depth,
+                                     float extrapolation_value,
+                                     unsigned short* crops_ptr,
+                                     int channels_last);
+
 void CropAndResizeBackpropImageLaucher(const float* grads_ptr,
                                        const float* boxes_ptr,
                                        const int* box_ind_ptr,
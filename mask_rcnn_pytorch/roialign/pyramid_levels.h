@@ -0,0 +1,53 @@
+#ifndef PYRAMID_LEVELS_H
+#define PYRAMID_LEVELS_H
+
+#include <math.h>
+
+#ifdef __CUDACC__
+#define PYRAMID_HOST_DEVICE __host__ __device__
+#else
+#define PYRAMID_HOST_DEVICE
+#endif
+
+// P2 - P5
+#define PYRAMID_MAX_LEVELS 4
+
+// Feature maps of the pyramid levels, each is [batch, depth, height, width],
+// the first one is P2. Passed to CUDA kernels by value.
+typedef struct {
+  const float* data[PYRAMID_MAX_LEVELS];
+  int height[PYRAMID_MAX_LEVELS];
+  int width[PYRAMID_MAX_LEVELS];
+  int num_levels;
+} PyramidLevels;
+
+// Same as PyramidLevels for half precision feature maps, data holds raw
+// IEEE 754 binary16 values.
+typedef struct {
+  const unsigned short* data[PYRAMID_MAX_LEVELS];
+  int height[PYRAMID_MAX_LEVELS];
+  int width[PYRAMID_MAX_LEVELS];
+  int num_levels;
+} PyramidLevelsHalf;
+
+// Assigns ROI to a level in the pyramid based on the ROI area.
+// Equation 1 in the Feature Pyramid Networks paper. Account for
+// the fact that box coordinates are normalized here.
+// e.g. a 224x224 ROI (in pixels) maps to P4
+// Returns index of the level, 0 is P2
+PYRAMID_HOST_DEVICE inline int PyramidLevelIndex(const float* box,
+                                                 const float image_area,
+                                                 const int num_levels) {
+  const float h = box[2] - box[0];
+  const float w = box[3] - box[1];
+  const float level =
+      nearbyintf(4 + log2f(sqrtf(h * w) / (224.0f / sqrtf(image_area))));
+  // NaN or -inf for empty boxes, they go to the first level
+  if (!(level > 2))
+    return 0;
+  if (level >= 2 + num_levels - 1)
+    return num_levels - 1;
+  return static_cast<int>(level) - 2;
+}
+
+#endif  // PYRAMID_LEVELS_H
@@ -0,0 +1,121 @@
+#include "rpntargets.h"
+#include "boxutils.h"
+
+std::tuple<at::Tensor, at::Tensor> BuildRpnTargets(at::Tensor anchors,
+                                                   at::Tensor gt_boxes,
+                                                   const Config& config) {
+  // RPN Match: 1 = positive anchor, -1 = negative anchor, 0 = neutral
+  auto rpn_match = torch::zeros({anchors.size(0)}, at::dtype(at::kInt));
+  // RPN bounding boxes: [max anchors per image, (dy, dx, log(dh), log(dw))]
+  auto rpn_bbox = torch::zeros({config.rpn_train_anchors_per_image, 4});
+
+  auto minus_one = torch::tensor(-1);
+  auto one = torch::tensor(1);
+  auto arange = torch::arange(anchors.size(0), at::dtype(at::kLong));
+  if (anchors.is_cuda()) {
+    rpn_match = rpn_match.cuda();
+    rpn_bbox = rpn_bbox.cuda();
+    minus_one = minus_one.cuda();
+    one = one.cuda();
+    arange = arange.cuda();
+  }
+
+  // Handle COCO crowds
+  // A crowd box in COCO is a bounding box around several instances.
+  // They are excluded on loading stage
+
+  // Best matches for anchors and GT boxes, from overlaps
+  // [num_anchors, num_gt_boxes] which is not built because anchors are too big
+  at::Tensor anchor_iou_max, anchor_iou_argmax, gt_iou_argmax;
+  std::tie(anchor_iou_max, anchor_iou_argmax, std::ignore, gt_iou_argmax) =
+      BBoxMaxOverlaps(anchors, gt_boxes);
+
+  //  // Debug block
+  //  {
+  //    std::cerr << std::get<0>(overlaps.sort(0, true)).narrow(0, 0,
+  //    10).squeeze(); auto max_overlaps =
+  //        std::get<1>(overlaps.sort(0, true)).narrow(0, 0, 10).squeeze();
+  //    auto max_anchors = anchors.index_select(0, max_overlaps);
+  //    VisualizeRPNTrargets(config.image_shape[0], config.image_shape[1],
+  //                         max_anchors, gt_boxes);
+  //    exit(0);
+  //  }
+
+  // Match anchors to GT Boxes
+  // If an anchor overlaps a GT box with IoU >= 0.7 then it's positive.
+  // If an anchor overlaps a GT box with IoU < 0.3 then it's negative.
+  // Neutral anchors are those that don't match the conditions above,
+  // and they don't influence the loss function.
+  // However, don't keep any GT box unmatched (rare, but happens). Instead,
+  // match it to the closest anchor (even if its max IoU is < 0.3).
+
+  // 1. Set negative anchors first. They get overwritten below if a GT box is
+  // matched to them. Skip boxes in crowd areas.
+  rpn_match = torch::where(anchor_iou_max < 0.5, minus_one, rpn_match);  // 0.3
+
+  // 2. Set an anchor for each GT box (regardless of IoU value).
+  // TODO: (Legacy)If multiple anchors have the same IoU match all of them
+  rpn_match.index_fill_(0, gt_iou_argmax, 1);
+  // 3. Set anchors with high overlap as positive.
+  rpn_match = torch::where(anchor_iou_max >= config.anchor_iou_max_threshold,
+                           one, rpn_match);
+
+  // Subsample to balance positive and negative anchors
+  // Don't let positives be more than half the anchors
+  auto ids = (rpn_match == 1).nonzero().narrow(1, 0, 1);  // take first column
+  auto extra = ids.size(0) - (config.rpn_train_anchors_per_image / 2);
+  if (extra > 0) {
+    // Reset the extra ones to neutral
+    auto idx = torch::randperm(ids.size(0), at::dtype(at::kLong));
+    idx = idx.narrow(0, 0, extra);
+    if (anchors.is_cuda())
+      idx = idx.cuda();
+    ids = ids.take(idx);  // random::choice(ids, extra, replace=False)
+    rpn_match.index_fill_(0, ids, 0);
+  }
+  // Same for negative proposals
+  auto positives_num = torch::sum(rpn_match == 1).item<int32_t>();
+  // or: auto positives_num = ids.size(0);
+  ids = (rpn_match == -1).nonzero().narrow(1, 0, 1);
+  extra = ids.size(0) - (config.rpn_train_anchors_per_image - positives_num);
+  if (extra > 0) {
+    // Rest the extra ones to neutral
+    auto idx = torch::randperm(ids.size(0), at::dtype(at::kLong));
+    idx = idx.narrow(0, 0, extra);
+    if (anchors.is_cuda())
+      idx = idx.cuda();
+    ids = ids.take(idx);  // random::choice(ids, extra, replace=False)
+    rpn_match.index_fill_(0, ids, 0);
+  }
+
+  // For positive anchors, compute shift and scale needed to transform them
+  // to match the corresponding GT boxes.
+  ids = (rpn_match == 1).nonzero().narrow(1, 0, 1).flatten();
+  auto gt = gt_boxes.index_select(0, anchor_iou_argmax.take(ids));
+  auto a = anchors.index_select(0, ids);
+  rpn_bbox.index_put_({arange.narrow(0, 0, ids.numel())},
+                      BoxRefinement(a, gt));
+
+  // Normalize
+  auto std_dev = torch::tensor(config.rpn_bbox_std_dev,
+                               at::dtype(at::kFloat).requires_grad(false));
+  if (anchors.is_cuda())
+    std_dev = std_dev.cuda();
+  rpn_bbox /= std_dev;
+
+  return {rpn_match, rpn_bbox};
+}
+
+std::tuple<at::Tensor, at::Tensor> BuildBatchRpnTargets(at::Tensor anchors,
+                                                        at::Tensor gt_boxes,
+                                                        const Config& config) {
+  std::vector<at::Tensor> rpn_match;
+  std::vector<at::Tensor> rpn_bbox;
+  for (int64_t b = 0; b < gt_boxes.size(0); ++b) {
+    at::Tensor match, bbox;
+    std::tie(match, bbox) = BuildRpnTargets(anchors, gt_boxes[b], config);
+    rpn_match.push_back(match.unsqueeze(1));
+    rpn_bbox.push_back(bbox);
+  }
+  return {torch::stack(rpn_match), torch::stack(rpn_bbox)};
+}
@@ -0,0 +1,34 @@
+#ifndef RPNTARGETS_H
+#define RPNTARGETS_H
+
+#include "config.h"
+
+#include <torch/torch.h>
+
+/* Given the anchors and GT boxes, compute overlaps and identify positive
+ * anchors and deltas to refine them to match their corresponding GT boxes.
+ * Works on the device of the anchors.
+ * anchors: [num_anchors, (y1, x1, y2, x2)]
+ * gt_boxes: [num_gt_boxes, (y1, x1, y2, x2)]
+ * Returns:
+ * rpn_match: [N] (int32) matches between anchors and GT boxes.
+ *            1 = positive anchor, -1 = negative anchor, 0 = neutral
+ * rpn_bbox: [N, (dy, dx, log(dh), log(dw))] Anchor bbox deltas.
+ */
+std::tuple<at::Tensor, at::Tensor> BuildRpnTargets(at::Tensor anchors,
+                                                   at::Tensor gt_boxes,
+                                                   const Config& config);
+
+/* Builds RPN targets for the batch of images, in the same format as
+ * CocoDataset samples have.
+ * anchors: [num_anchors, (y1, x1, y2, x2)]
+ * gt_boxes: [batch, num_gt_boxes, (y1, x1, y2, x2)]
+ * Returns:
+ * rpn_match: [batch, num_anchors, 1]
+ * rpn_bbox: [batch, rpn_train_anchors_per_image, 4]
+ */
+std::tuple<at::Tensor, at::Tensor> BuildBatchRpnTargets(at::Tensor anchors,
+                                                        at::Tensor gt_boxes,
+                                                        const Config& config);
+
+#endif  // RPNTARGETS_H
@@ -0,0 +1,215 @@
+#include "sampleprefetcher.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+SamplePrefetcher::SamplePrefetcher(CocoDataset dataset,
+                                   uint32_t workers_num,
+                                   uint32_t queue_size,
+                                   bool to_gpu,
+                                   int16_t device_index,
+                                   uint32_t shard_index,
+                                   uint32_t shards_num,
+                                   uint32_t group_size)
+    : dataset_(std::move(dataset)),
+      config_(dataset_->GetConfig()),
+      queue_size_(std::max({queue_size, group_size, 1u})),
+      to_gpu_(to_gpu),
+      gpu_decode_(to_gpu && config_->gpu_image_decode),
+      device_index_(device_index),
+      group_size_(std::max(group_size, 1u)) {
+#ifdef NDEBUG
+  random_engine_.seed(std::random_device()());
+#endif
+  shards_num = std::max(shards_num, 1u);
+  auto dataset_size = dataset_->size().value_or(0);
+  for (size_t i = shard_index; i < dataset_size; i += shards_num)
+    order_.push_back(i);
+  order_pos_ = order_.size();  // shuffle on the first request
+  if (order_.empty())
+    throw std::invalid_argument("Can't prefetch samples from empty dataset");
+  if (group_size_ > 1) {
+    auto groups = dataset_->ShapeGroups();
+    std::map<uint32_t, std::vector<size_t>> group_samples;
+    for (auto i : order_)
+      group_samples[groups.at(i)].push_back(i);
+    for (auto& group : group_samples)
+      group_samples_.push_back(std::move(group.second));
+  }
+
+  StartWorkers(workers_num);
+}
+
+SamplePrefetcher::SamplePrefetcher(std::shared_ptr<ShardStream> stream,
+                                   std::shared_ptr<const Config> config,
+                                   uint32_t workers_num,
+                                   uint32_t queue_size,
+                                   bool to_gpu,
+                                   int16_t device_index)
+    : stream_(std::move(stream)),
+      config_(std::move(config)),
+      queue_size_(std::max(queue_size, 1u)),
+      to_gpu_(to_gpu),
+      gpu_decode_(to_gpu && config_->gpu_image_decode),
+      device_index_(device_index) {
+  if (!stream_)
+    throw std::invalid_argument("Can't prefetch samples without a stream");
+  StartWorkers(workers_num);
+}
+
+void SamplePrefetcher::StartWorkers(uint32_t workers_num) {
+  if (gpu_decode_ && !JpegDecoder::IsAvailable())
+    throw std::invalid_argument("GPU image decoding needs nvJPEG");
+  workers_num = std::max(workers_num, 1u);
+  for (uint32_t i = 0; i < workers_num; ++i)
+    workers_.emplace_back([this]() { this->WorkerLoop(); });
+}
+
+SamplePrefetcher::~SamplePrefetcher() {
+  Stop();
+}
+
+void SamplePrefetcher::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    stop_ = true;
+  }
+  not_full_cv_.notify_all();
+  not_empty_cv_.notify_all();
+  for (auto& worker : workers_) {
+    if (worker.joinable())
+      worker.join();
+  }
+}
+
+Sample SamplePrefetcher::Next() {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  not_empty_cv_.wait(lock,
+                     [this]() { return !queue_.empty() || error_ || stop_; });
+  if (queue_.empty()) {
+    if (error_)
+      std::rethrow_exception(error_);
+    throw std::logic_error("Sample prefetcher is stopped");
+  }
+  auto sample = std::move(queue_.front());
+  queue_.pop_front();
+  lock.unlock();
+  not_full_cv_.notify_one();
+  return sample;
+}
+
+std::vector<Sample> SamplePrefetcher::LoadRun(JpegDecoder* decoder) {
+  // Images are left encoded for the decoder
+  const bool decode_image = decoder == nullptr;
+  std::vector<Sample> samples;
+  if (dataset_) {
+    for (auto index : NextRun())
+      samples.push_back(MakeSample(
+          dataset_->Loader().GetImage(index, decode_image), *config_,
+          decoder));
+  } else {
+    samples.push_back(MakeSample(
+        DecodeShardRecord(stream_->Next(), decode_image), *config_, decoder));
+  }
+  return samples;
+}
+
+std::vector<size_t> SamplePrefetcher::NextRun() {
+  std::lock_guard<std::mutex> lock(order_mutex_);
+  if (order_pos_ == order_.size()) {
+    Shuffle();
+    order_pos_ = 0;
+  }
+  // The order is made of whole runs
+  auto begin = order_.begin() + static_cast<ptrdiff_t>(order_pos_);
+  order_pos_ += group_size_;
+  return std::vector<size_t>(begin, begin + group_size_);
+}
+
+void SamplePrefetcher::Shuffle() {
+  if (group_samples_.empty()) {
+    std::shuffle(order_.begin(), order_.end(), random_engine_);
+    return;
+  }
+
+  // Shuffle samples of every group, cut the groups into runs and shuffle
+  // the runs. The last run of a group takes the missing samples from the
+  // start of the group, so the runs of the small groups repeat samples.
+  std::vector<std::vector<size_t>> runs;
+  for (auto& samples : group_samples_) {
+    std::shuffle(samples.begin(), samples.end(), random_engine_);
+    for (size_t i = 0; i < samples.size(); i += group_size_) {
+      std::vector<size_t> run;
+      for (size_t j = i; j < i + group_size_; ++j)
+        run.push_back(samples[j % samples.size()]);
+      runs.push_back(std::move(run));
+    }
+  }
+  std::shuffle(runs.begin(), runs.end(), random_engine_);
+
+  order_.clear();
+  for (const auto& run : runs)
+    order_.insert(order_.end(), run.begin(), run.end());
+}
+
+Sample SamplePrefetcher::ToGpu(Sample sample) const {
+  // Copies are queued to the default stream of the device, so they are
+  // ordered with the training kernels which use the sample
+  torch::Device device(torch::kCUDA, device_index_);
+  auto copy = [&device](at::Tensor& t) {
+    if (t.defined() && t.numel() > 0 && !t.is_cuda())
+      t = t.pin_memory().to(device, t.scalar_type(), /*non_blocking*/ true);
+  };
+  copy(sample.data.image);
+  copy(sample.target.rpn_match);
+  copy(sample.target.rpn_bbox);
+  copy(sample.target.gt_class_ids);
+  copy(sample.target.gt_boxes);
+  copy(sample.target.gt_masks);
+  return sample;
+}
+
+void SamplePrefetcher::WorkerLoop() {
+  std::unique_ptr<JpegDecoder> decoder;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      not_full_cv_.wait(lock, [this]() {
+        return queue_.size() + pending_ + group_size_ <= queue_size_ || stop_;
+      });
+      if (stop_ || error_)
+        return;
+      pending_ += group_size_;
+    }
+
+    try {
+      if (gpu_decode_ && !decoder)
+        decoder = std::make_unique<JpegDecoder>(device_index_);
+      auto samples = LoadRun(decoder.get());
+      if (to_gpu_) {
+        for (auto& sample : samples)
+          sample = ToGpu(std::move(sample));
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        pending_ -= group_size_;
+        if (stop_)
+          return;
+        for (auto& sample : samples)
+          queue_.push_back(std::move(sample));
+      }
+      not_empty_cv_.notify_all();
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        pending_ -= group_size_;
+        if (!error_)
+          error_ = std::current_exception();
+      }
+      not_empty_cv_.notify_all();
+      return;
+    }
+  }
+}
@@ -0,0 +1,103 @@
+#ifndef SAMPLEPREFETCHER_H
+#define SAMPLEPREFETCHER_H
+
+#include "cocodataset.h"
+#include "shardstream.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+
+/* Loads samples of the dataset with several worker threads into the bounded
+ * queue, so decoding, resizing and target building run in parallel with the
+ * training. Samples are taken in a random order, the order is reshuffled
+ * after each pass over the dataset. Workers live until the prefetcher is
+ * destroyed, so the same prefetcher is used for all epochs.
+ * If to_gpu is set, sample tensors are copied to the GPU device_index by the
+ * workers from the pinned memory with asynchronous copies.
+ * For data parallel training the dataset is split into shards_num shards,
+ * every prefetcher takes samples only from the shard shard_index.
+ * If group_size > 1, the order is made of runs of group_size samples with
+ * the same input shape, see CocoDataset::ShapeGroups, so samples of one
+ * optimizer step share the shape when padding is off. The last run of a
+ * shape is filled up with other samples of the shape, and a worker loads a
+ * whole run and queues it at once, so every group_size samples taken with
+ * Next are one run.
+ * With a ShardStream the workers decode records of the stream instead, the
+ * stream does the shuffling and the sharding.
+ * With Config::gpu_image_decode and to_gpu, every worker decodes JPEG images
+ * with its own JpegDecoder on the GPU, the workers only read the files and
+ * process the annotations.
+ */
+class SamplePrefetcher {
+ public:
+  SamplePrefetcher(CocoDataset dataset,
+                   uint32_t workers_num,
+                   uint32_t queue_size,
+                   bool to_gpu,
+                   int16_t device_index = 0,
+                   uint32_t shard_index = 0,
+                   uint32_t shards_num = 1,
+                   uint32_t group_size = 1);
+  SamplePrefetcher(std::shared_ptr<ShardStream> stream,
+                   std::shared_ptr<const Config> config,
+                   uint32_t workers_num,
+                   uint32_t queue_size,
+                   bool to_gpu,
+                   int16_t device_index = 0);
+  SamplePrefetcher(const SamplePrefetcher&) = delete;
+  SamplePrefetcher& operator=(const SamplePrefetcher&) = delete;
+  ~SamplePrefetcher();
+
+  // Blocks until a sample is ready, rethrows exceptions of the workers
+  Sample Next();
+
+  void Stop();
+
+ private:
+  void StartWorkers(uint32_t workers_num);
+  void WorkerLoop();
+  // group_size samples of the dataset, one sample of the stream
+  std::vector<Sample> LoadRun(JpegDecoder* decoder);
+  std::vector<size_t> NextRun();
+  void Shuffle();
+  Sample ToGpu(Sample sample) const;
+
+ private:
+  // Samples are loaded either from the dataset or from the stream
+  std::optional<CocoDataset> dataset_;
+  std::shared_ptr<ShardStream> stream_;
+  std::shared_ptr<const Config> config_;
+  uint32_t queue_size_{0};
+  bool to_gpu_{false};
+  bool gpu_decode_{false};
+  int16_t device_index_{0};
+
+  // Sampling order, guarded with order_mutex_
+  std::mutex order_mutex_;
+  std::vector<size_t> order_;
+  // Samples of the shard for every shape group, empty if not grouped
+  std::vector<std::vector<size_t>> group_samples_;
+  uint32_t group_size_{1};
+  size_t order_pos_{0};
+  std::mt19937 random_engine_;
+
+  std::mutex queue_mutex_;
+  std::condition_variable not_empty_cv_;
+  std::condition_variable not_full_cv_;
+  std::deque<Sample> queue_;
+  // Samples which are being loaded, they have reserved places in the queue
+  uint32_t pending_{0};
+  std::exception_ptr error_;
+  bool stop_{false};
+
+  std::vector<std::thread> workers_;
+};
+
+#endif  // SAMPLEPREFETCHER_H
@@ -0,0 +1,156 @@
+#include "config.h"
+#include "debug.h"
+#include "detectionbackend.h"
+#include "inferenceserver.h"
+#include "maskrcnn.h"
+#include "stateloader.h"
+
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include <experimental/filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs = std::experimental::filesystem;
+
+class ServerConfig : public Config {
+ public:
+  ServerConfig(uint32_t batch_size,
+               bool profile,
+               float min_score,
+               int64_t mask_top_k,
+               bool boxes_only,
+               double slo_ms) {
+    if (!torch::cuda::is_available())
+      throw std::runtime_error("Cuda is not available");
+    gpu_count = 1;
+    images_per_gpu = batch_size;
+    num_classes = 81;  // 4 - for shapes, 81 - for coco dataset
+    profile_inference = profile;
+    inference_min_score = min_score;
+    inference_mask_top_k = mask_top_k;
+    inference_boxes_only = boxes_only;
+    inference_latency_slo_ms = slo_ms;
+
+    UpdateSettings();
+  }
+};
+
+const cv::String keys =
+    "{help h usage ? |      | print this message   }"
+    "{@params        |<none>| path to trained parameters }"
+    "{port p         |8080  | TCP port to listen on }"
+    "{batch b        |4     | max number of images in batch }"
+    "{delay d        |10    | max time in ms request waits for batch }"
+    "{profile        |      | directory to write stage latencies to }"
+    "{script s       |      | params is a TorchScript module of the model }"
+    "{min_score      |0     | detections with lower scores are dropped }"
+    "{mask_top_k     |0     | max detections with masks per image, 0 - all }"
+    "{boxes_only     |      | don't compute masks }"
+    "{slo            |0     | latency objective in ms, 0 - fixed proposals }"
+    "{heads          |      | extra heads as file:num_classes,... }";
+
+int main(int argc, char** argv) {
+#ifndef NDEBUG
+  // initialize debug print function
+  auto x__ = torch::tensor({1, 2, 3, 4});
+  auto p = PrintTensor(x__);
+#endif
+  try {
+    cv::CommandLineParser parser(argc, argv, keys);
+    parser.about("MaskRCNN inference server");
+
+    if (parser.has("help") || argc == 1) {
+      parser.printMessage();
+      return 0;
+    }
+
+    std::string params_path = parser.get<cv::String>(0);
+    auto port = parser.get<int>("port");
+    auto batch_size = parser.get<int>("batch");
+    auto delay = parser.get<int>("delay");
+    std::string profile_dir = parser.get<cv::String>("profile");
+    bool script = parser.has("script");
+    auto min_score = parser.get<float>("min_score");
+    auto mask_top_k = parser.get<int>("mask_top_k");
+    bool boxes_only = parser.has("boxes_only");
+    std::string heads = parser.get<cv::String>("heads");
+    auto slo_ms = parser.get<double>("slo");
+
+    // Chech parsing errors
+    if (!parser.check()) {
+      parser.printErrors();
+      parser.printMessage();
+      return 1;
+    }
+
+    if (port <= 0 || port > 65535 || batch_size <= 0 || delay < 0 ||
+        min_score < 0 || mask_top_k < 0 || slo_ms < 0)
+      throw std::invalid_argument("Wrong server parameters");
+
+    params_path = fs::canonical(params_path);
+    if (!fs::exists(params_path))
+      throw std::invalid_argument("Wrong file path for parameters");
+
+    if (!profile_dir.empty() && !fs::is_directory(profile_dir))
+      throw std::invalid_argument("Wrong directory for profile");
+
+    auto head_params = ParseHeadFiles(heads);
+    if (script && !head_params.empty())
+      throw std::invalid_argument("Heads require the libtorch model");
+
+    auto config = std::make_shared<ServerConfig>(
+        static_cast<uint32_t>(batch_size), !profile_dir.empty(), min_score,
+        mask_top_k, boxes_only, slo_ms);
+
+    std::shared_ptr<DetectionBackend> backend;
+    if (script) {
+      backend = std::make_shared<ScriptBackend>(params_path, torch::kCUDA);
+    } else {
+      // Directory to save logs and trained model
+      auto model_dir = fs::current_path() / "logs";
+
+      // Create model object.
+      MaskRCNN model(model_dir, config);
+
+      // load state before moving to GPU
+      if (params_path.find(".json") != std::string::npos) {
+        LoadStateDictJson(*model, params_path);
+      } else {
+        LoadStateDict(*model, params_path, "");
+      }
+
+      // Only the heads are read from the checkpoints of the other variants,
+      // they run on the backbone of the model
+      for (const auto& [file_name, num_classes] : head_params) {
+        auto head_config = std::make_shared<ServerConfig>(*config);
+        head_config->num_classes = num_classes;
+        HeadSet head_set(head_config);
+        LoadStateDict(*head_set, file_name, "");
+        model->AddHeads(head_set);
+      }
+
+      if (config->gpu_count > 0)
+        model->to(torch::DeviceType::CUDA);
+      backend = std::make_shared<EagerBackend>(model);
+    }
+
+    // Don't make first requests wait for cuDNN benchmarking
+    backend->WarmUp();
+
+    double mask_threshold = 0.5;
+    InferenceServer server(backend, config, static_cast<uint16_t>(port),
+                           std::chrono::milliseconds(delay), mask_threshold,
+                           profile_dir);
+    std::cout << "Listening on port " << port << std::endl;
+    server.Run();
+  } catch (const std::exception& err) {
+    std::cout << err.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
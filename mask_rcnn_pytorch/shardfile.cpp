@@ -0,0 +1,239 @@
+#include "shardfile.h"
+
+#include <experimental/filesystem>
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <type_traits>
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+const char kShardMagic[8] = {'M', 'R', 'C', 'N', 'N', 'S', 'H', 'D'};
+const uint32_t kShardVersion = 1;
+const char kShardExtension[] = ".shard";
+// Protects readers from allocating memory for garbage sizes
+const uint64_t kMaxImageBytes = 256 * 1024 * 1024;
+const uint32_t kMaxInstances = 65536;
+
+struct ShardHeader {
+  char magic[8];
+  uint32_t version{0};
+  uint32_t records_num{0};
+};
+
+struct ShardRecordHeader {
+  uint32_t image_id{0};
+  uint32_t width{0};
+  uint32_t height{0};
+  uint32_t instances_num{0};
+  uint64_t image_size{0};
+};
+
+struct ShardInstance {
+  CocoBBox bbox;
+  int32_t class_id{0};
+  uint32_t counts_num{0};
+};
+
+template <typename T>
+void WriteData(std::ofstream& file, const T* data, size_t count) {
+  static_assert(std::is_trivially_copyable<T>::value, "Plain data only");
+  file.write(reinterpret_cast<const char*>(data),
+             static_cast<std::streamsize>(count * sizeof(T)));
+}
+
+template <typename T>
+bool ReadData(std::ifstream& file, T* data, size_t count) {
+  static_assert(std::is_trivially_copyable<T>::value, "Plain data only");
+  file.read(reinterpret_cast<char*>(data),
+            static_cast<std::streamsize>(count * sizeof(T)));
+  return static_cast<bool>(file);
+}
+}  // namespace
+
+ShardWriter::ShardWriter(const std::string& file_name)
+    : file_name_(file_name),
+      file_(file_name, std::ios::binary | std::ios::trunc) {
+  if (!file_)
+    throw std::runtime_error(file_name + " file can't be created");
+  ShardHeader header;
+  std::memcpy(header.magic, kShardMagic, sizeof(kShardMagic));
+  header.version = kShardVersion;
+  WriteData(file_, &header, 1);
+}
+
+ShardWriter::~ShardWriter() {
+  try {
+    Close();
+  } catch (const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+  }
+}
+
+void ShardWriter::Write(const ShardRecord& record) {
+  if (record.boxes.size() != record.classes.size() ||
+      record.boxes.size() != record.masks.size())
+    throw std::invalid_argument("Shard record instances don't match");
+  ShardRecordHeader header;
+  header.image_id = record.image_id;
+  header.width = record.width;
+  header.height = record.height;
+  header.instances_num = static_cast<uint32_t>(record.boxes.size());
+  header.image_size = record.image.size();
+  WriteData(file_, &header, 1);
+  WriteData(file_, record.image.data(), record.image.size());
+  for (size_t i = 0; i < record.boxes.size(); ++i) {
+    ShardInstance instance;
+    instance.bbox = record.boxes[i];
+    instance.class_id = record.classes[i];
+    instance.counts_num = static_cast<uint32_t>(record.masks[i].size());
+    WriteData(file_, &instance, 1);
+  }
+  for (const auto& counts : record.masks)
+    WriteData(file_, counts.data(), counts.size());
+  if (!file_)
+    throw std::runtime_error(file_name_ + " file write failed");
+  ++records_num_;
+}
+
+void ShardWriter::Close() {
+  if (!file_.is_open())
+    return;
+  file_.seekp(offsetof(ShardHeader, records_num));
+  WriteData(file_, &records_num_, 1);
+  file_.close();
+  if (!file_)
+    throw std::runtime_error(file_name_ + " file write failed");
+}
+
+ShardReader::ShardReader(const std::string& file_name)
+    : file_name_(file_name), file_(file_name, std::ios::binary) {
+  ShardHeader header;
+  if (!ReadData(file_, &header, 1) ||
+      std::memcmp(header.magic, kShardMagic, sizeof(kShardMagic)) != 0 ||
+      header.version != kShardVersion)
+    throw std::runtime_error(file_name + " is not a shard file");
+  records_num_ = header.records_num;
+}
+
+bool ShardReader::Next(ShardRecord& record) {
+  if (record_index_ == records_num_)
+    return false;
+  ShardRecordHeader header;
+  if (!ReadData(file_, &header, 1) || header.image_size > kMaxImageBytes ||
+      header.instances_num > kMaxInstances)
+    throw std::runtime_error(file_name_ + " shard file is corrupted");
+  record.image_id = header.image_id;
+  record.width = header.width;
+  record.height = header.height;
+  record.image.resize(header.image_size);
+  std::vector<ShardInstance> instances(header.instances_num);
+  bool ok = ReadData(file_, record.image.data(), record.image.size()) &&
+            ReadData(file_, instances.data(), instances.size());
+  record.boxes.resize(instances.size());
+  record.classes.resize(instances.size());
+  record.masks.resize(instances.size());
+  // Runs can't be more than the pixels
+  const uint64_t max_counts =
+      static_cast<uint64_t>(header.width) * header.height + 1;
+  for (size_t i = 0; i < instances.size() && ok; ++i) {
+    if (instances[i].counts_num > max_counts)
+      throw std::runtime_error(file_name_ + " shard file is corrupted");
+    record.boxes[i] = instances[i].bbox;
+    record.classes[i] = instances[i].class_id;
+    record.masks[i].resize(instances[i].counts_num);
+    ok = ReadData(file_, record.masks[i].data(), record.masks[i].size());
+  }
+  if (!ok)
+    throw std::runtime_error(file_name_ + " shard file is truncated");
+  ++record_index_;
+  return true;
+}
+
+ImageDesc DecodeShardRecord(ShardRecord record, bool decode_image) {
+  ImageDesc desc;
+  desc.id = record.image_id;
+  auto height = static_cast<int>(record.height);
+  auto width = static_cast<int>(record.width);
+  if (decode_image) {
+    desc.image = cv::imdecode(record.image, cv::IMREAD_COLOR);
+    if (desc.image.empty())
+      throw std::runtime_error("Failed to decode image " +
+                               std::to_string(record.image_id) + " of shard");
+    height = desc.image.rows;
+    width = desc.image.cols;
+  } else {
+    desc.image_data = std::move(record.image);
+  }
+  desc.boxes = std::move(record.boxes);
+  desc.classes = std::move(record.classes);
+  desc.masks.resize(record.masks.size());
+  for (size_t i = 0; i < record.masks.size(); ++i) {
+    desc.masks[i].counts = std::move(record.masks[i]);
+    desc.masks[i].height = height;
+    desc.masks[i].width = width;
+  }
+  return desc;
+}
+
+std::vector<std::string> WriteCocoShards(const CocoLoader& loader,
+                                         const std::string& dir,
+                                         uint32_t images_per_shard) {
+  images_per_shard = std::max(images_per_shard, 1u);
+  std::vector<std::string> shard_files;
+  std::unique_ptr<ShardWriter> writer;
+  ShardRecord record;
+  for (uint32_t i = 0; i < loader.GetImagesCount(); ++i) {
+    if (!writer || writer->RecordsCount() == images_per_shard) {
+      std::ostringstream name;
+      name << std::setw(5) << std::setfill('0') << shard_files.size()
+           << kShardExtension;
+      shard_files.push_back((fs::path(dir) / name.str()).string());
+      writer = std::make_unique<ShardWriter>(shard_files.back());
+    }
+
+    auto image_path = loader.GetImagePath(i);
+    std::ifstream image_file(image_path, std::ios::binary);
+    record.image.assign(std::istreambuf_iterator<char>(image_file),
+                        std::istreambuf_iterator<char>());
+    if (!image_file && !image_file.eof())
+      throw std::runtime_error(image_path + " file can't be read");
+    const auto& image_info = loader.GetImageInfo(i);
+    record.image_id = image_info.id;
+    record.width = image_info.width;
+    record.height = image_info.height;
+    record.boxes.clear();
+    record.classes.clear();
+    record.masks.clear();
+    for (auto& instance : loader.GetGroundTruth(i)) {
+      if (instance.iscrowd)
+        continue;
+      CocoBBox bbox;
+      bbox.x = static_cast<int32_t>(instance.box[0]);
+      bbox.y = static_cast<int32_t>(instance.box[1]);
+      bbox.width = static_cast<int32_t>(instance.box[2]);
+      bbox.height = static_cast<int32_t>(instance.box[3]);
+      record.boxes.push_back(bbox);
+      record.classes.push_back(instance.class_id);
+      record.masks.push_back(std::move(instance.mask.counts));
+    }
+    writer->Write(record);
+  }
+  if (writer)
+    writer->Close();
+  return shard_files;
+}
+
+std::vector<std::string> ListShards(const std::string& dir) {
+  std::vector<std::string> shard_files;
+  for (const auto& entry : fs::directory_iterator(dir)) {
+    if (entry.path().extension() == kShardExtension)
+      shard_files.push_back(entry.path().string());
+  }
+  std::sort(shard_files.begin(), shard_files.end());
+  return shard_files;
+}
@@ -0,0 +1,75 @@
+#ifndef SHARDFILE_H
+#define SHARDFILE_H
+
+#include "cocoloader.h"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/* Shards store training images with their annotations as sequential records,
+ * so a dataset is read in large sequential reads and only the current records
+ * are kept in memory:
+ * [header][record]...[record]
+ * A record is the image file as it was encoded on the disk, with boxes, class
+ * ids and RLE masks of its instances. Crowd annotations aren't stored, they
+ * are excluded from training.
+ */
+struct ShardRecord {
+  uint32_t image_id{0};
+  uint32_t width{0};
+  uint32_t height{0};
+  std::vector<uint8_t> image;
+  std::vector<CocoBBox> boxes;
+  std::vector<int32_t> classes;
+  std::vector<std::vector<uint32_t>> masks;  // RLE counts
+};
+
+class ShardWriter {
+ public:
+  explicit ShardWriter(const std::string& file_name);
+  ShardWriter(const ShardWriter&) = delete;
+  ShardWriter& operator=(const ShardWriter&) = delete;
+  ~ShardWriter();
+
+  void Write(const ShardRecord& record);
+  uint32_t RecordsCount() const { return records_num_; }
+  // Writes the number of records to the header
+  void Close();
+
+ private:
+  std::string file_name_;
+  std::ofstream file_;
+  uint32_t records_num_{0};
+};
+
+class ShardReader {
+ public:
+  explicit ShardReader(const std::string& file_name);
+
+  // Returns false after the last record
+  bool Next(ShardRecord& record);
+
+ private:
+  std::string file_name_;
+  std::ifstream file_;
+  uint32_t records_num_{0};
+  uint32_t record_index_{0};
+};
+
+// Decodes the image of the record, masks are of the image size. Without
+// decode_image the encoded image is moved to image_data.
+ImageDesc DecodeShardRecord(ShardRecord record, bool decode_image = true);
+
+/* Writes images of the loader with annotations to dir/NNNNN.shard files of
+ * images_per_shard images, returns names of the files.
+ */
+std::vector<std::string> WriteCocoShards(const CocoLoader& loader,
+                                         const std::string& dir,
+                                         uint32_t images_per_shard);
+
+// Shard files of the directory, sorted by name
+std::vector<std::string> ListShards(const std::string& dir);
+
+#endif  // SHARDFILE_H
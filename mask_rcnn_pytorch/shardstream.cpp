@@ -0,0 +1,95 @@
+#include "shardstream.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+ShardStream::ShardStream(std::vector<std::string> files,
+                         uint32_t shuffle_size,
+                         uint32_t readahead,
+                         uint32_t shard_index,
+                         uint32_t shards_num)
+    : shuffle_size_(std::max(shuffle_size, 1u)),
+      buffer_size_(shuffle_size_ + std::max(readahead, 1u)) {
+#ifdef NDEBUG
+  random_engine_.seed(std::random_device()());
+#endif
+  shards_num = std::max(shards_num, 1u);
+  for (size_t i = shard_index; i < files.size(); i += shards_num)
+    files_.push_back(std::move(files[i]));
+  if (files_.empty())
+    throw std::invalid_argument("No shard files for the stream");
+  buffer_.reserve(buffer_size_);
+  reader_ = std::thread([this]() { this->ReadLoop(); });
+}
+
+ShardStream::~ShardStream() {
+  Stop();
+}
+
+void ShardStream::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  not_full_cv_.notify_all();
+  ready_cv_.notify_all();
+  if (reader_.joinable())
+    reader_.join();
+}
+
+ShardRecord ShardStream::Next() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ready_cv_.wait(lock, [this]() {
+    return buffer_.size() >= shuffle_size_ || error_ || stop_;
+  });
+  if (buffer_.size() < shuffle_size_) {
+    if (error_)
+      std::rethrow_exception(error_);
+    throw std::logic_error("Shard stream is stopped");
+  }
+  std::uniform_int_distribution<size_t> position(0, buffer_.size() - 1);
+  auto i = position(random_engine_);
+  std::swap(buffer_[i], buffer_.back());
+  auto record = std::move(buffer_.back());
+  buffer_.pop_back();
+  lock.unlock();
+  not_full_cv_.notify_one();
+  return record;
+}
+
+void ShardStream::ReadLoop() {
+  try {
+    std::vector<std::string> files = files_;
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shuffle(files.begin(), files.end(), random_engine_);
+      }
+      size_t records_num = 0;
+      for (const auto& file : files) {
+        ShardReader reader(file);
+        ShardRecord record;
+        while (reader.Next(record)) {
+          ++records_num;
+          std::unique_lock<std::mutex> lock(mutex_);
+          not_full_cv_.wait(lock, [this]() {
+            return buffer_.size() < buffer_size_ || stop_;
+          });
+          if (stop_)
+            return;
+          buffer_.push_back(std::move(record));
+          lock.unlock();
+          ready_cv_.notify_one();
+        }
+      }
+      if (records_num == 0)
+        throw std::runtime_error("Shard files of the stream are empty");
+    }
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
+    ready_cv_.notify_all();
+  }
+}
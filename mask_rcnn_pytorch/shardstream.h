@@ -0,0 +1,59 @@
+#ifndef SHARDSTREAM_H
+#define SHARDSTREAM_H
+
+#include "shardfile.h"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Endless stream of training records from shard files, memory is bounded by
+ * the buffer size instead of the dataset size. A reader thread reads shards
+ * one after another with sequential reads, the order of shards is reshuffled
+ * after each pass. Records are taken from the buffer of shuffle_size +
+ * readahead records at random positions once shuffle_size records are
+ * buffered, the reader refills it while the records are decoded.
+ * For data parallel training shard files are split into shards_num parts,
+ * the stream reads only the files i with i % shards_num == shard_index.
+ * Next is thread safe, it is called by the workers of SamplePrefetcher.
+ */
+class ShardStream {
+ public:
+  ShardStream(std::vector<std::string> files,
+              uint32_t shuffle_size,
+              uint32_t readahead,
+              uint32_t shard_index = 0,
+              uint32_t shards_num = 1);
+  ShardStream(const ShardStream&) = delete;
+  ShardStream& operator=(const ShardStream&) = delete;
+  ~ShardStream();
+
+  // Blocks until a record is ready, rethrows exceptions of the reader
+  ShardRecord Next();
+
+  void Stop();
+
+ private:
+  void ReadLoop();
+
+ private:
+  std::vector<std::string> files_;
+  uint32_t shuffle_size_{1};
+  uint32_t buffer_size_{1};
+  std::mt19937 random_engine_;  // guarded with mutex_
+
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+  std::condition_variable not_full_cv_;
+  std::vector<ShardRecord> buffer_;
+  std::exception_ptr error_;
+  bool stop_{false};
+
+  std::thread reader_;
+};
+
+#endif  // SHARDSTREAM_H
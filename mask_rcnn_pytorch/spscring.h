@@ -0,0 +1,54 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* Fixed capacity queue for exactly one producer and one consumer thread.
+ * Push and Pop don't take locks or wait, Push fails when the ring is full.
+ */
+template <typename T>
+class SpscRing {
+ public:
+  // One slot stays unused to tell the full ring from the empty one
+  explicit SpscRing(size_t capacity) : items_(capacity + 1) {}
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Called only by the producer
+  bool Push(const T& item) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto next = Next(head);
+    if (next == tail_.load(std::memory_order_acquire))
+      return false;
+    items_[head] = item;
+    head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Called only by the consumer
+  bool Pop(T& item) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+      return false;
+    item = items_[tail];
+    tail_.store(Next(tail), std::memory_order_release);
+    return true;
+  }
+
+  size_t Capacity() const { return items_.size() - 1; }
+
+ private:
+  size_t Next(size_t index) const {
+    return index + 1 == items_.size() ? 0 : index + 1;
+  }
+
+ private:
+  std::vector<T> items_;
+  // Indices are on their own cache lines, so the threads don't contend
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+#endif  // SPSCRING_H
@@ -0,0 +1,274 @@
+#include "stageprofiler.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <cuda_runtime_api.h>
+#include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+// Bounds the memory of a long running profiler, older records are dropped
+const size_t kMaxRecords = 100000;
+const size_t kMaxSamples = 100000;
+
+double Percentile(std::vector<double>& values, double p) {
+  auto n = static_cast<size_t>(p * static_cast<double>(values.size() - 1));
+  std::nth_element(values.begin(), values.begin() + static_cast<long>(n),
+                   values.end());
+  return values[n];
+}
+
+double Milliseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+cudaEvent_t ToEvent(void* event) {
+  return static_cast<cudaEvent_t>(event);
+}
+
+void CheckCuda(cudaError_t status) {
+  if (status != cudaSuccess)
+    throw std::runtime_error(std::string("Profiler CUDA error : ") +
+                             cudaGetErrorString(status));
+}
+}  // namespace
+
+StageProfiler::Scope::Scope(StageProfiler* profiler,
+                            const char* stage,
+                            bool on_gpu)
+    : profiler_(profiler) {
+  if (profiler_)
+    record_ = profiler_->Start(stage, on_gpu);
+}
+
+StageProfiler::Scope::~Scope() {
+  if (profiler_)
+    profiler_->End(record_);
+}
+
+StageProfiler::StageProfiler(bool use_cuda) : use_cuda_(use_cuda) {}
+
+StageProfiler::~StageProfiler() {
+  for (auto& record : records_)
+    ReleaseEvents(record);
+  if (origin_event_)
+    cudaEventDestroy(ToEvent(origin_event_));
+  for (auto event : free_events_)
+    cudaEventDestroy(ToEvent(event));
+}
+
+void* StageProfiler::NewEvent() {
+  if (!free_events_.empty()) {
+    auto event = free_events_.back();
+    free_events_.pop_back();
+    return event;
+  }
+  cudaEvent_t event;
+  CheckCuda(cudaEventCreate(&event));
+  return event;
+}
+
+void StageProfiler::ReleaseEvents(Record& record) {
+  for (auto event : {record.start_event, record.end_event}) {
+    if (event)
+      free_events_.push_back(event);
+  }
+  record.start_event = nullptr;
+  record.end_event = nullptr;
+}
+
+size_t StageProfiler::Start(const char* stage, bool on_gpu) {
+  Record record;
+  record.stage = stage;
+  record.on_gpu = on_gpu && use_cuda_;
+  cudaStream_t stream = nullptr;
+  if (use_cuda_)
+    stream = at::cuda::getCurrentCUDAStream().stream();
+  if (!has_origin_) {
+    origin_ = std::chrono::steady_clock::now();
+    if (use_cuda_) {
+      origin_event_ = origin_event_ ? origin_event_ : NewEvent();
+      CheckCuda(cudaEventRecord(ToEvent(origin_event_), stream));
+    }
+    has_origin_ = true;
+  }
+  if (record.on_gpu) {
+    record.start_event = NewEvent();
+    CheckCuda(cudaEventRecord(ToEvent(record.start_event), stream));
+  }
+  record.start = std::chrono::steady_clock::now();
+  records_.push_back(record);
+  return first_record_ + records_.size() - 1;
+}
+
+void StageProfiler::End(size_t record_id) {
+  if (record_id < first_record_)
+    return;
+  auto& record = records_.at(record_id - first_record_);
+  record.end = std::chrono::steady_clock::now();
+  if (record.on_gpu) {
+    record.end_event = NewEvent();
+    CheckCuda(cudaEventRecord(ToEvent(record.end_event),
+                              at::cuda::getCurrentCUDAStream().stream()));
+  }
+  record.ended = true;
+}
+
+void StageProfiler::Collect(bool wait) {
+  // Records are done in the order of their starts, an open or unfinished
+  // stage stops the collection
+  while (collected_ < records_.size()) {
+    auto& record = records_[collected_];
+    if (!record.ended)
+      break;
+    if (record.on_gpu) {
+      auto end_event = ToEvent(record.end_event);
+      if (wait) {
+        CheckCuda(cudaEventSynchronize(end_event));
+      } else {
+        auto status = cudaEventQuery(end_event);
+        if (status == cudaErrorNotReady)
+          break;
+        CheckCuda(status);
+      }
+      float start_ms = 0;
+      float duration_ms = 0;
+      CheckCuda(cudaEventElapsedTime(&start_ms, ToEvent(origin_event_),
+                                     ToEvent(record.start_event)));
+      CheckCuda(cudaEventElapsedTime(
+          &duration_ms, ToEvent(record.start_event), end_event));
+      record.start_ms = start_ms;
+      record.duration_ms = duration_ms;
+      ReleaseEvents(record);
+    } else {
+      record.start_ms = Milliseconds(record.start - origin_);
+      record.duration_ms = Milliseconds(record.end - record.start);
+    }
+
+    auto& durations = durations_[record.stage];
+    if (durations.size() >= kMaxSamples)
+      durations.erase(durations.begin(),
+                      durations.begin() + kMaxSamples / 2);
+    durations.push_back(record.duration_ms);
+    ++collected_;
+  }
+
+  if (records_.size() > kMaxRecords && collected_ > kMaxRecords / 2) {
+    auto dropped = kMaxRecords / 2;
+    records_.erase(records_.begin(),
+                   records_.begin() + static_cast<long>(dropped));
+    collected_ -= dropped;
+    first_record_ += dropped;
+  }
+}
+
+void StageProfiler::Reset() {
+  Collect(/*wait*/ true);
+  for (auto& record : records_)
+    ReleaseEvents(record);
+  first_record_ += records_.size();
+  records_.clear();
+  collected_ = 0;
+  durations_.clear();
+  has_origin_ = false;
+}
+
+std::vector<StageProfiler::StageStat> StageProfiler::Stats() {
+  Collect(/*wait*/ true);
+  std::vector<StageStat> stats;
+  for (auto& [name, durations] : durations_) {
+    if (durations.empty())
+      continue;
+    auto values = durations;
+    StageStat stat;
+    stat.name = name;
+    stat.count = values.size();
+    for (auto value : values)
+      stat.mean_ms += value / static_cast<double>(values.size());
+    stat.p50_ms = Percentile(values, 0.50);
+    stat.p95_ms = Percentile(values, 0.95);
+    stat.p99_ms = Percentile(values, 0.99);
+    stats.push_back(stat);
+  }
+  return stats;
+}
+
+void StageProfiler::WriteJson(const std::string& file_name) {
+  std::ofstream file(file_name);
+  if (!file)
+    throw std::runtime_error("Failed to open file " + file_name);
+  rapidjson::OStreamWrapper stream(file);
+  rapidjson::Writer<rapidjson::OStreamWrapper> writer(stream);
+  writer.StartObject();
+  for (auto& stat : Stats()) {
+    writer.Key(stat.name.c_str());
+    writer.StartObject();
+    writer.Key("count");
+    writer.Uint64(stat.count);
+    writer.Key("mean_ms");
+    writer.Double(stat.mean_ms);
+    writer.Key("p50_ms");
+    writer.Double(stat.p50_ms);
+    writer.Key("p95_ms");
+    writer.Double(stat.p95_ms);
+    writer.Key("p99_ms");
+    writer.Double(stat.p99_ms);
+    writer.EndObject();
+  }
+  writer.EndObject();
+}
+
+void StageProfiler::WriteChromeTrace(const std::string& file_name) {
+  Collect(/*wait*/ true);
+  std::ofstream file(file_name);
+  if (!file)
+    throw std::runtime_error("Failed to open file " + file_name);
+  rapidjson::OStreamWrapper stream(file);
+  rapidjson::Writer<rapidjson::OStreamWrapper> writer(stream);
+  writer.StartObject();
+  writer.Key("traceEvents");
+  writer.StartArray();
+  // GPU and CPU stages are shown as separate threads, their times are
+  // measured with different clocks
+  for (auto tid : {0, 1}) {
+    writer.StartObject();
+    writer.Key("name");
+    writer.String("thread_name");
+    writer.Key("ph");
+    writer.String("M");
+    writer.Key("pid");
+    writer.Int(0);
+    writer.Key("tid");
+    writer.Int(tid);
+    writer.Key("args");
+    writer.StartObject();
+    writer.Key("name");
+    writer.String(tid == 0 ? "CPU" : "GPU");
+    writer.EndObject();
+    writer.EndObject();
+  }
+  for (size_t i = 0; i < collected_; ++i) {
+    const auto& record = records_[i];
+    writer.StartObject();
+    writer.Key("name");
+    writer.String(record.stage);
+    writer.Key("ph");
+    writer.String("X");
+    writer.Key("ts");
+    writer.Double(record.start_ms * 1000);
+    writer.Key("dur");
+    writer.Double(record.duration_ms * 1000);
+    writer.Key("pid");
+    writer.Int(0);
+    writer.Key("tid");
+    writer.Int(record.on_gpu ? 1 : 0);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.Key("displayTimeUnit");
+  writer.String("ms");
+  writer.EndObject();
+}
@@ -0,0 +1,92 @@
+#ifndef STAGEPROFILER_H
+#define STAGEPROFILER_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Latency profiler for the stages of the inference pipeline.
+ * Stages on the GPU are timed with CUDA events recorded on the current
+ * stream, so timing doesn't synchronize the host with the GPU. Durations of
+ * the events are read when the GPU passed them, by Collect. Stages on the
+ * CPU are timed with steady_clock.
+ * The profiler isn't thread safe, all stages have to be timed by one thread.
+ */
+class StageProfiler {
+ public:
+  struct StageStat {
+    std::string name;
+    size_t count{0};
+    double mean_ms{0};
+    double p50_ms{0};
+    double p95_ms{0};
+    double p99_ms{0};
+  };
+
+  // Times the stage from the construction till the destruction, does
+  // nothing without the profiler. The stage name has to be a literal.
+  class Scope {
+   public:
+    Scope(StageProfiler* profiler, const char* stage, bool on_gpu = true);
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope();
+
+   private:
+    StageProfiler* profiler_{nullptr};
+    size_t record_{0};
+  };
+
+  explicit StageProfiler(bool use_cuda);
+  StageProfiler(const StageProfiler&) = delete;
+  StageProfiler& operator=(const StageProfiler&) = delete;
+  ~StageProfiler();
+
+  // Reads durations of the finished GPU stages, with wait it waits for all
+  void Collect(bool wait);
+  void Reset();
+
+  // Percentiles of the stage durations, calls Collect(true)
+  std::vector<StageStat> Stats();
+  void WriteJson(const std::string& file_name);
+  // Trace of the recorded stages for chrome://tracing
+  void WriteChromeTrace(const std::string& file_name);
+
+ private:
+  struct Record {
+    const char* stage{nullptr};
+    bool on_gpu{false};
+    // Events or host times of the stage, milliseconds are valid when done
+    void* start_event{nullptr};
+    void* end_event{nullptr};
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    double start_ms{0};
+    double duration_ms{0};
+    bool ended{false};
+  };
+
+  size_t Start(const char* stage, bool on_gpu);
+  void End(size_t record);
+  void* NewEvent();
+  void ReleaseEvents(Record& record);
+
+ private:
+  bool use_cuda_{false};
+  // Trace time is counted from the first stage after Reset
+  void* origin_event_{nullptr};
+  std::chrono::steady_clock::time_point origin_;
+  bool has_origin_{false};
+
+  std::vector<Record> records_;
+  // Id of records_[0], ids returned by Start stay valid when old records
+  // are dropped
+  size_t first_record_{0};
+  // Records before this index have their durations
+  size_t collected_{0};
+  std::vector<void*> free_events_;
+  std::map<std::string, std::vector<double>> durations_;
+};
+
+#endif  // STAGEPROFILER_H
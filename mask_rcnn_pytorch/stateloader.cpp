@@ -1,17 +1,203 @@
 #include "stateloader.h"
 #include "debug.h"
+#include "mappedfile.h"
 #include "nnutils.h"
+#include "quantization.h"
 
 #include <rapidjson/error/en.h>
 #include <rapidjson/filereadstream.h>
 #include <rapidjson/reader.h>
 
+#include <cstddef>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
 #include <iostream>
 #include <regex>
+#include <sstream>
 #include <stack>
+#include <unordered_map>
 
 namespace {
 
+const char kStateMagic[8] = {'M', 'R', 'C', 'N', 'N', 'S', 'T', 'D'};
+// Version 2 added flags to the header, version 1 files are still read
+const uint32_t kStateVersion = 2;
+const uint64_t kStateAlignment = 64;
+const uint32_t kStateMaxDims = 8;
+
+struct StateHeader {
+  char magic[8];
+  uint32_t version{0};
+  uint32_t tensors_num{0};
+  uint64_t index_offset{0};
+  uint64_t names_offset{0};
+  uint64_t data_offset{0};
+  uint32_t flags{0};
+  uint32_t reserved{0};
+};
+
+// Size of the version 1 header, without flags
+const uint64_t kStateHeaderV1Size = offsetof(StateHeader, flags);
+
+// The file doesn't have all tensors of the module
+const uint32_t kStatePartial = 1;
+
+struct StateEntry {
+  uint64_t name_offset{0};
+  uint32_t name_size{0};
+  uint32_t dtype{0};
+  uint32_t is_buffer{0};
+  uint32_t dims_num{0};
+  int64_t sizes[kStateMaxDims] = {0};
+  uint64_t data_offset{0};
+  uint64_t data_size{0};
+};
+
+// Stored dtype tags, they don't depend on the torch enum values
+enum class StateDType : uint32_t {
+  Float = 0,
+  Half,
+  Double,
+  Long,
+  Int,
+  Byte,
+  Char
+};
+
+// Quantized weights are stored as int8 values with the float scales entry
+const char kScaleSuffix[] = ".scale";
+
+StateDType ToStateDType(at::ScalarType type) {
+  switch (type) {
+    case at::kFloat:
+      return StateDType::Float;
+    case at::kHalf:
+      return StateDType::Half;
+    case at::kDouble:
+      return StateDType::Double;
+    case at::kLong:
+      return StateDType::Long;
+    case at::kInt:
+      return StateDType::Int;
+    case at::kByte:
+      return StateDType::Byte;
+    case at::kChar:
+      return StateDType::Char;
+    default:
+      throw std::invalid_argument("Unsupported state tensor type");
+  }
+}
+
+at::ScalarType FromStateDType(uint32_t type) {
+  switch (static_cast<StateDType>(type)) {
+    case StateDType::Float:
+      return at::kFloat;
+    case StateDType::Half:
+      return at::kHalf;
+    case StateDType::Double:
+      return at::kDouble;
+    case StateDType::Long:
+      return at::kLong;
+    case StateDType::Int:
+      return at::kInt;
+    case StateDType::Byte:
+      return at::kByte;
+    case StateDType::Char:
+      return at::kChar;
+  }
+  throw std::runtime_error("Unknown state tensor type");
+}
+
+uint64_t AlignOffset(uint64_t offset) {
+  return (offset + kStateAlignment - 1) / kStateAlignment * kStateAlignment;
+}
+
+bool IsBinaryStateFile(const std::string& file_name) {
+  std::ifstream file(file_name, std::ios::binary);
+  char magic[sizeof(kStateMagic)] = {0};
+  file.read(magic, sizeof(magic));
+  return file && std::memcmp(magic, kStateMagic, sizeof(kStateMagic)) == 0;
+}
+
+void LoadStateDictBinary(torch::nn::Module& module,
+                         const std::string& file_name,
+                         const std::string& ignore_name_regex) {
+  MappedFile file(file_name);
+  const auto* version = file.at<uint32_t>(offsetof(StateHeader, version));
+  if (!version || (*version != 1 && *version != kStateVersion))
+    throw std::runtime_error(file_name + " unsupported state file version");
+  StateHeader header;
+  auto header_size = *version == 1 ? kStateHeaderV1Size : sizeof(StateHeader);
+  const auto* header_data = file.at<uint8_t>(0, header_size);
+  if (!header_data)
+    throw std::runtime_error(file_name + " state file is corrupted");
+  std::memcpy(&header, header_data, header_size);
+  const auto* entries =
+      file.at<StateEntry>(header.index_offset, header.tensors_num);
+  if (!entries)
+    throw std::runtime_error(file_name + " state file is corrupted");
+
+  std::unordered_map<std::string, const StateEntry*> index;
+  for (uint32_t i = 0; i < header.tensors_num; ++i) {
+    const auto* name = file.at<char>(entries[i].name_offset,
+                                     entries[i].name_size);
+    if (!name || entries[i].dims_num > kStateMaxDims)
+      throw std::runtime_error(file_name + " state file is corrupted");
+    index.emplace(std::string(name, entries[i].name_size), &entries[i]);
+  }
+
+  torch::NoGradGuard no_grad;
+  std::regex re(ignore_name_regex);
+  std::smatch m;
+  auto mapped = [&](const StateEntry& entry) {
+    const auto* data = file.at<uint8_t>(entry.data_offset, entry.data_size);
+    if (!data)
+      throw std::runtime_error(file_name + " state file is corrupted");
+    std::vector<int64_t> sizes(entry.sizes, entry.sizes + entry.dims_num);
+    // Tensor shares the mapped memory, copy_ is the only copy of the data
+    auto stored = torch::from_blob(const_cast<uint8_t*>(data), sizes,
+                                   at::dtype(FromStateDType(entry.dtype)));
+    if (static_cast<uint64_t>(stored.numel() * stored.element_size()) !=
+        entry.data_size)
+      throw std::runtime_error(file_name + " state file is corrupted");
+    return stored;
+  };
+  auto load = [&](const std::string& name, torch::Tensor& value) {
+    if (std::regex_match(name, m, re))
+      return;
+    auto i = index.find(name);
+    if (i == index.end() && (header.flags & kStatePartial))
+      return;
+    if (i == index.end())
+      throw std::runtime_error(name + " parameter not found in " + file_name);
+    const auto& entry = *i->second;
+    auto stored = mapped(entry);
+    if (stored.numel() != value.numel())
+      throw std::runtime_error(name + " parameter has wrong size");
+    if (entry.dtype == static_cast<uint32_t>(StateDType::Char) &&
+        value.is_floating_point()) {
+      auto scale = index.find(name + kScaleSuffix);
+      if (scale == index.end())
+        throw std::runtime_error(name + " quantization scales not found");
+      auto scales = mapped(*scale->second);
+      if (stored.dim() == 0 || scales.numel() != stored.size(0))
+        throw std::runtime_error(name + " quantization scales wrong size");
+      stored = DequantizeWeight(stored, scales);
+    }
+    value.copy_(stored.view(value.sizes()));
+  };
+
+  auto params = module.named_parameters(true /*recurse*/);
+  auto buffers = module.named_buffers(true /*recurse*/);
+  for (auto& val : params) {
+    load(val.key(), val.value());
+  }
+  for (auto& val : buffers) {
+    load(val.key(), val.value());
+  }
+}
+
 enum class ReadState {
   None,
   DictObject,
@@ -221,27 +407,124 @@ void LoadStateDictJson(torch::nn::Module& module,
   std::cout.flush();
 }
 
-void SaveStateDict(const torch::nn::Module& module,
-                   const std::string& file_name) {
-  torch::serialize::OutputArchive archive;
+StateTensors GetStateTensors(const torch::nn::Module& module,
+                             bool trainable_only) {
+  StateTensors state;
+  state.partial = trainable_only;
   auto params = module.named_parameters(true /*recurse*/);
   auto buffers = module.named_buffers(true /*recurse*/);
   for (const auto& val : params) {
-    if (!is_empty(val.value())) {
-      archive.write(val.key(), val.value());
+    if (!is_empty(val.value()) &&
+        (!trainable_only || val.value().requires_grad())) {
+      state.names.push_back(val.key());
+      state.tensors.push_back(val.value().detach());
+      state.is_buffer.push_back(false);
     }
   }
   for (const auto& val : buffers) {
     if (!is_empty(val.value())) {
-      archive.write(val.key(), val.value(), /*is_buffer*/ true);
+      state.names.push_back(val.key());
+      state.tensors.push_back(val.value().detach());
+      state.is_buffer.push_back(true);
     }
   }
-  archive.save_to(file_name);
+  return state;
+}
+
+void SaveStateDict(const torch::nn::Module& module,
+                   const std::string& file_name,
+                   bool quantize_weights) {
+  SaveStateTensors(GetStateTensors(module), file_name, quantize_weights);
+}
+
+void SaveStateTensors(const StateTensors& state,
+                      const std::string& file_name,
+                      bool quantize_weights) {
+  std::vector<std::string> names;
+  std::vector<torch::Tensor> tensors;
+  std::vector<uint32_t> is_buffer;
+  for (size_t i = 0; i < state.tensors.size(); ++i) {
+    auto value = state.tensors[i].cpu().contiguous();
+    const auto& name = state.names[i];
+    if (quantize_weights && !state.is_buffer[i] &&
+        IsQuantizableWeight(name, value)) {
+      auto quantized = QuantizeWeight(value);
+      names.push_back(name);
+      tensors.push_back(quantized.values);
+      is_buffer.push_back(0);
+      names.push_back(name + kScaleSuffix);
+      tensors.push_back(quantized.scales);
+      is_buffer.push_back(1);
+    } else {
+      names.push_back(name);
+      tensors.push_back(value);
+      is_buffer.push_back(state.is_buffer[i] ? 1 : 0);
+    }
+  }
+
+  StateHeader header;
+  std::memcpy(header.magic, kStateMagic, sizeof(kStateMagic));
+  header.version = kStateVersion;
+  header.tensors_num = static_cast<uint32_t>(tensors.size());
+  header.index_offset = sizeof(StateHeader);
+  header.names_offset =
+      header.index_offset + tensors.size() * sizeof(StateEntry);
+
+  std::vector<StateEntry> entries(tensors.size());
+  uint64_t names_size = 0;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    entries[i].name_offset = header.names_offset + names_size;
+    entries[i].name_size = static_cast<uint32_t>(names[i].size());
+    names_size += names[i].size();
+  }
+  header.data_offset = AlignOffset(header.names_offset + names_size);
+  header.flags = state.partial ? kStatePartial : 0;
+  uint64_t data_offset = header.data_offset;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    auto& entry = entries[i];
+    const auto& tensor = tensors[i];
+    if (tensor.dim() > static_cast<int64_t>(kStateMaxDims))
+      throw std::invalid_argument(names[i] + " has too many dimensions");
+    entry.dtype = static_cast<uint32_t>(ToStateDType(tensor.scalar_type()));
+    entry.is_buffer = is_buffer[i];
+    entry.dims_num = static_cast<uint32_t>(tensor.dim());
+    for (int64_t d = 0; d < tensor.dim(); ++d)
+      entry.sizes[d] = tensor.size(d);
+    entry.data_offset = data_offset;
+    entry.data_size =
+        static_cast<uint64_t>(tensor.numel() * tensor.element_size());
+    data_offset = AlignOffset(data_offset + entry.data_size);
+  }
+
+  std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+  if (!file)
+    throw std::runtime_error(file_name + " file can't be created");
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(entries.data()),
+             static_cast<std::streamsize>(entries.size() * sizeof(StateEntry)));
+  for (const auto& name : names)
+    file.write(name.data(), static_cast<std::streamsize>(name.size()));
+  const char padding[kStateAlignment] = {0};
+  uint64_t pos = header.names_offset + names_size;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    file.write(padding,
+               static_cast<std::streamsize>(entries[i].data_offset - pos));
+    file.write(static_cast<const char*>(tensors[i].data_ptr()),
+               static_cast<std::streamsize>(entries[i].data_size));
+    pos = entries[i].data_offset + entries[i].data_size;
+  }
+  if (!file)
+    throw std::runtime_error(file_name + " file write failed");
 }
 
 void LoadStateDict(torch::nn::Module& module,
                    const std::string& file_name,
                    const std::string& ignore_name_regex) {
+  if (IsBinaryStateFile(file_name)) {
+    LoadStateDictBinary(module, file_name, ignore_name_regex);
+    return;
+  }
+
   torch::serialize::InputArchive archive;
   archive.load_from(file_name);
   torch::NoGradGuard no_grad;
@@ -260,3 +543,23 @@ void LoadStateDict(torch::nn::Module& module,
     }
   }
 }
+
+std::vector<std::pair<std::string, uint32_t>> ParseHeadFiles(
+    const std::string& heads) {
+  std::vector<std::pair<std::string, uint32_t>> result;
+  std::stringstream stream(heads);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    auto pos = item.rfind(':');
+    if (pos == std::string::npos || pos == 0 || pos + 1 == item.size() ||
+        item.find_first_not_of("0123456789", pos + 1) != std::string::npos)
+      throw std::invalid_argument("Wrong heads parameter " + item);
+    auto num_classes = std::stoul(item.substr(pos + 1));
+    if (num_classes < 2 || num_classes > UINT32_MAX)
+      throw std::invalid_argument("Wrong number of classes " + item);
+    result.emplace_back(
+        std::experimental::filesystem::canonical(item.substr(0, pos)),
+        static_cast<uint32_t>(num_classes));
+  }
+  return result;
+}
@@ -2,6 +2,9 @@
 #define STATELOADER_H
 
 #include <torch/torch.h>
+#include <cstdint>
+#include <string>
+#include <utility>
 #include <vector>
 
 /* Correspondig Python export code
@@ -23,10 +26,50 @@ torch::OrderedDict<std::string, torch::Tensor> LoadStateDictJson(
 
 void LoadStateDictJson(torch::nn::Module& module, const std::string& file_name);
 
+/* State is saved to the flat binary file:
+ * [header][index][names][tensors data]
+ * The index has name, dtype, shape and offset of each tensor, tensors data is
+ * aligned to 64 bytes. Loading memory maps the file and copies each tensor
+ * directly from the mapping into the module, without any parsing.
+ * LoadStateDict also reads files saved as torch archives.
+ *
+ * With quantize_weights convolution and linear weights are saved as int8
+ * with per output channel scales in the "<name>.scale" entries, see
+ * quantization.h. Such files are about 4 times smaller, LoadStateDict
+ * restores float weights from them.
+ */
 void SaveStateDict(const torch::nn::Module& module,
-                   const std::string& file_name);
+                   const std::string& file_name,
+                   bool quantize_weights = false);
+
+/* Parameters and buffers of the module, in the order they are saved. The
+ * partial state misses some tensors of the module, LoadStateDict leaves them
+ * unchanged, so it should be loaded over the full state.
+ */
+struct StateTensors {
+  std::vector<std::string> names;
+  std::vector<at::Tensor> tensors;
+  std::vector<bool> is_buffer;
+  bool partial{false};
+};
+
+// With trainable_only the state is partial, it has only the parameters which
+// require gradients and all buffers. Tensors share the module memory.
+StateTensors GetStateTensors(const torch::nn::Module& module,
+                             bool trainable_only = false);
+
+// Tensors can be on any device
+void SaveStateTensors(const StateTensors& state,
+                      const std::string& file_name,
+                      bool quantize_weights = false);
 void LoadStateDict(torch::nn::Module& module,
                    const std::string& file_name,
                    const std::string& ignore_name_regex = "");
 
+// Checkpoints of the head sets of other variants with their numbers of
+// classes, from "file:num_classes,file:num_classes,...", see HeadSetImpl.
+// The files have to exist, their names are made canonical.
+std::vector<std::pair<std::string, uint32_t>> ParseHeadFiles(
+    const std::string& heads);
+
 #endif  // STATELOADER_H
@@ -1,13 +1,26 @@
 #include "statreporter.h"
+#include "metricsexporter.h"
+
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 
+namespace {
+// Reports made between the terminal updates
+const size_t kEventsCapacity = 4096;
+const auto kPrintInterval = std::chrono::milliseconds(200);
+}  // namespace
+
 StatReporter::StatReporter(uint32_t epochs_num,
                            uint32_t train_steps_num,
-                           uint32_t val_steps_num)
+                           uint32_t val_steps_num,
+                           const std::string& metrics_dir)
     : epochs_num_(epochs_num),
       train_steps_num_(train_steps_num),
-      val_steps_num_(val_steps_num) {
+      val_steps_num_(val_steps_num),
+      events_(kEventsCapacity) {
+  if (!metrics_dir.empty())
+    exporter_ = std::make_unique<MetricsExporter>(metrics_dir);
   print_thread = std::thread([this]() { this->PrintLoop(); });
 }
 
@@ -15,97 +28,173 @@ StatReporter::~StatReporter() {
   Stop();
 }
 
-void StatReporter::ReportTrainStep(uint32_t i, const LossStat& stat) {
-  {
-    std::lock_guard<std::mutex> lock(state_mutex_);
-    train_step_ = i;
-    train_stat_ = stat;
-    print_state_ = PrintState::ReportTrainStep;
+void StatReporter::Push(const Event& event, bool can_drop) {
+  while (!events_.Push(event)) {
+    if (can_drop) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    std::this_thread::yield();
   }
-  state_cv_.notify_one();
+}
+
+void StatReporter::ReportTrainStep(uint32_t i,
+                                   const LossStat& stat,
+                                   const StepTiming& timing) {
+  Event event;
+  event.state = PrintState::ReportTrainStep;
+  event.index = i;
+  event.stat = stat;
+  event.timing = timing;
+  Push(event, /*can_drop*/ true);
 }
 
 void StatReporter::ReportValidationStep(uint32_t i, const LossStat& stat) {
-  {
-    std::lock_guard<std::mutex> lock(state_mutex_);
-    train_step_ = i;
-    valid_stat_ = stat;
-    print_state_ = PrintState::ReportValidationStep;
-  }
-  state_cv_.notify_one();
+  Event event;
+  event.state = PrintState::ReportValidationStep;
+  event.index = i;
+  event.valid_stat = stat;
+  Push(event, /*can_drop*/ true);
 }
 
 void StatReporter::StartEpoch(uint32_t i, double learning_rate) {
-  {
-    std::lock_guard<std::mutex> lock(state_mutex_);
-    epoch_ = i;
-    learning_rate_ = learning_rate;
-    print_state_ = PrintState::StartEpoch;
-  }
-  state_cv_.notify_one();
+  Event event;
+  event.state = PrintState::StartEpoch;
+  event.index = i;
+  event.learning_rate = learning_rate;
+  Push(event, /*can_drop*/ false);
 }
 
 void StatReporter::ReportEpoch(const LossStat& train_stat,
                                const LossStat& valid_stat) {
-  {
-    std::lock_guard<std::mutex> lock(state_mutex_);
-    train_stat_ = train_stat;
-    valid_stat_ = valid_stat;
-    print_state_ = PrintState::ReportEpoch;
-  }
-  state_cv_.notify_one();
+  Event event;
+  event.state = PrintState::ReportEpoch;
+  event.stat = train_stat;
+  event.valid_stat = valid_stat;
+  Push(event, /*can_drop*/ false);
+}
+
+void StatReporter::ReportMemory(const MemoryStat& stat) {
+  Event event;
+  event.state = PrintState::ReportMemory;
+  event.memory = stat;
+  Push(event, /*can_drop*/ false);
+}
+
+void StatReporter::ReportEvaluation(const CocoEvalStats& bbox_stat,
+                                    const CocoEvalStats& segm_stat) {
+  Event event;
+  event.state = PrintState::ReportEvaluation;
+  event.bbox_stat = bbox_stat;
+  event.segm_stat = segm_stat;
+  Push(event, /*can_drop*/ false);
 }
 
 void StatReporter::Stop() {
-  {
-    std::lock_guard<std::mutex> lock(state_mutex_);
-    print_state_ = PrintState::Stop;
-  }
-  state_cv_.notify_one();
+  if (!print_thread.joinable())
+    return;
+  stop_.store(true, std::memory_order_release);
   print_thread.join();
 }
 
 void StatReporter::PrintLoop() {
-  bool done = false;
-  while (!done) {
-    std::unique_lock<std::mutex> lock(state_mutex_);
-    state_cv_.wait(lock, [this] { return print_state_ != PrintState::Idle; });
-    switch (print_state_) {
-      case PrintState::StartEpoch:
-        std::cerr << "\nEpoch " << epoch_ << "/" << epochs_num_ << "\n";
-        std::cerr << "\tlearning rate " << learning_rate_ << "\n";
-        print_state_ = PrintState::Idle;
-        break;
-      case PrintState::ReportEpoch:
-        std::cerr << "\tTraining losses :\n";
-        PrintLoss(std::cerr, train_stat_);
-        std::cerr << "\tValidation losses :\n";
-        PrintLoss(std::cerr, valid_stat_);
-        print_state_ = PrintState::Idle;
-        break;
-      case PrintState::ReportTrainStep:
-        ClearStepScreen();
-        std::cerr << "\tTrain step " << train_step_ << "/" << train_steps_num_;
-        PrintLossSmall(std::cerr, train_stat_);
-        std::cerr << "\r";
-        print_state_ = PrintState::Idle;
-        break;
-      case PrintState::ReportValidationStep:
-        ClearStepScreen();
-        std::cerr << "\tValidation step " << train_step_ << "/"
-                  << val_steps_num_;
-        PrintLossSmall(std::cerr, valid_stat_);
-        std::cerr << "\r";
-        print_state_ = PrintState::Idle;
-        break;
-      case PrintState::Idle:
-        // ignore
-        break;
-      case PrintState::Stop:
-        done = true;
-        break;
-    }
+  while (true) {
+    // Reports pushed before Stop are visible after the flag is seen
+    bool done = stop_.load(std::memory_order_acquire);
+    Event event;
+    while (events_.Pop(event))
+      HandleEvent(event);
+    // Only the latest step is shown
+    PrintStep();
+    if (exporter_)
+      exporter_->Flush();
+    if (done)
+      break;
+    std::this_thread::sleep_for(kPrintInterval);
+  }
+}
+
+void StatReporter::HandleEvent(const Event& event) {
+  switch (event.state) {
+    case PrintState::StartEpoch:
+      PrintStep();
+      epoch_ = event.index;
+      learning_rate_ = event.learning_rate;
+      std::cerr << "\nEpoch " << epoch_ << "/" << epochs_num_ << "\n";
+      std::cerr << "\tlearning rate " << learning_rate_ << "\n";
+      break;
+    case PrintState::ReportEpoch:
+      PrintStep();
+      train_stat_ = event.stat;
+      valid_stat_ = event.valid_stat;
+      std::cerr << "\tTraining losses :\n";
+      PrintLoss(std::cerr, train_stat_);
+      std::cerr << "\tValidation losses :\n";
+      PrintLoss(std::cerr, valid_stat_);
+      if (has_memory_stat_) {
+        std::cerr << "\tGPU memory :\n";
+        PrintMemory(std::cerr, memory_stat_);
+      }
+      {
+        auto dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped > dropped_printed_) {
+          std::cerr << "\t" << dropped - dropped_printed_
+                    << " step reports were dropped\n";
+          dropped_printed_ = dropped;
+        }
+      }
+      break;
+    case PrintState::ReportTrainStep:
+      train_step_ = event.index;
+      train_stat_ = event.stat;
+      pending_step_ = event.state;
+      if (exporter_) {
+        exporter_->WriteStep(epoch_, event.index, event.stat, event.timing,
+                             memory_stat_);
+      }
+      break;
+    case PrintState::ReportValidationStep:
+      val_step_ = event.index;
+      valid_stat_ = event.valid_stat;
+      pending_step_ = event.state;
+      break;
+    case PrintState::ReportMemory:
+      memory_stat_ = event.memory;
+      has_memory_stat_ = true;
+      break;
+    case PrintState::ReportEvaluation:
+      PrintStep();
+      std::cerr << "\tBox metrics :\n";
+      PrintEvaluation(std::cerr, event.bbox_stat);
+      std::cerr << "\tMask metrics :\n";
+      PrintEvaluation(std::cerr, event.segm_stat);
+      if (exporter_)
+        exporter_->WriteEvaluation(epoch_, event.bbox_stat, event.segm_stat);
+      break;
+    case PrintState::Idle:
+      // ignore
+      break;
+  }
+}
+
+void StatReporter::PrintStep() {
+  switch (pending_step_) {
+    case PrintState::ReportTrainStep:
+      ClearStepScreen();
+      std::cerr << "\tTrain step " << train_step_ << "/" << train_steps_num_;
+      PrintLossSmall(std::cerr, train_stat_);
+      std::cerr << "\r";
+      break;
+    case PrintState::ReportValidationStep:
+      ClearStepScreen();
+      std::cerr << "\tValidation step " << val_step_ << "/" << val_steps_num_;
+      PrintLossSmall(std::cerr, valid_stat_);
+      std::cerr << "\r";
+      break;
+    default:
+      break;
   }
+  pending_step_ = PrintState::Idle;
 }
 
 void StatReporter::ClearStepScreen() {}
@@ -134,3 +223,35 @@ void StatReporter::PrintLossSmall(std::ostream& out, const LossStat& stat) {
   out << " mrcnn_mask : " << stat.loss_mrcnn_mask;
   out << "              ";
 }
+
+void StatReporter::PrintMemory(std::ostream& out, const MemoryStat& stat) {
+  const double mb = 1024 * 1024;
+  auto flags = out.flags();
+  auto precision = out.precision();
+  out << std::fixed << std::setprecision(1);
+  out << "\t\t" << std::setw(20) << "allocated MB : " << stat.allocated / mb
+      << " peak " << stat.peak_allocated / mb << "\n";
+  out << "\t\t" << std::setw(20) << "cached MB : " << stat.cached / mb
+      << " peak " << stat.peak_cached / mb << "\n";
+  out << "\t\t" << std::setw(20) << "step arena MB : "
+      << stat.arena_reserved / mb << " grows " << stat.arena_grows << "\n";
+  out.flags(flags);
+  out.precision(precision);
+}
+
+void StatReporter::PrintEvaluation(std::ostream& out,
+                                   const CocoEvalStats& stat) {
+  auto flags = out.flags();
+  auto precision = out.precision();
+  out << std::fixed << std::setprecision(3);
+  out << "\t\t" << std::setw(20) << "AP : " << stat.ap << " AP50 "
+      << stat.ap50 << " AP75 " << stat.ap75 << "\n";
+  out << "\t\t" << std::setw(20) << "AP by area : " << stat.ap_small << " "
+      << stat.ap_medium << " " << stat.ap_large << "\n";
+  out << "\t\t" << std::setw(20) << "AR : " << stat.ar1 << " " << stat.ar10
+      << " " << stat.ar100 << "\n";
+  out << "\t\t" << std::setw(20) << "AR by area : " << stat.ar_small << " "
+      << stat.ar_medium << " " << stat.ar_large << "\n";
+  out.flags(flags);
+  out.precision(precision);
+}
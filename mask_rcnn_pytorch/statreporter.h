@@ -1,20 +1,25 @@
 #ifndef STATREPORTER_H
 #define STATREPORTER_H
 
+#include "cocoeval.h"
+#include "spscring.h"
+
 #include <atomic>
-#include <condition_variable>
 #include <iosfwd>
-#include <mutex>
+#include <memory>
 #include <string>
 #include <thread>
 
+class MetricsExporter;
+
 enum class PrintState {
   StartEpoch,
   ReportEpoch,
   ReportTrainStep,
   ReportValidationStep,
-  Idle,
-  Stop
+  ReportMemory,
+  ReportEvaluation,
+  Idle
 };
 
 struct LossStat {
@@ -26,25 +31,77 @@ struct LossStat {
   float loss_mrcnn_mask{0};
 };
 
+// Memory usage in bytes, peaks are high watermarks since the start
+struct MemoryStat {
+  int64_t allocated{0};
+  int64_t peak_allocated{0};
+  int64_t cached{0};
+  int64_t peak_cached{0};
+  int64_t arena_reserved{0};
+  // Number of times a step needed a larger arena buffer than reserved
+  uint32_t arena_grows{0};
+};
+
+// Host side timing of one optimizer step
+struct StepTiming {
+  double step_seconds{0};
+  // Time the step waited for the data loaders
+  double data_wait_seconds{0};
+  uint32_t images{0};
+};
+
+/* Progress is printed by a separate thread. Reports are passed to it through
+ * a lock free ring, so the training loop never waits for the terminal, and
+ * the terminal is updated a few times per second with the latest step.
+ * With the metrics_dir every train step is also exported by MetricsExporter.
+ */
 class StatReporter {
  public:
   StatReporter(uint32_t epochs_num,
                uint32_t train_steps_num,
-               uint32_t val_steps_num);
+               uint32_t val_steps_num,
+               const std::string& metrics_dir = "");
   StatReporter(const StatReporter&) = delete;
   StatReporter& operator=(const StatReporter&) = delete;
   ~StatReporter();
 
   void StartEpoch(uint32_t i, double learning_rate);
-  void ReportTrainStep(uint32_t i, const LossStat& stat);
+  void ReportTrainStep(uint32_t i,
+                       const LossStat& stat,
+                       const StepTiming& timing = {});
   void ReportValidationStep(uint32_t i, const LossStat& stat);
   void ReportEpoch(const LossStat& train_stat, const LossStat& valid_stat);
+  // Printed with the next epoch report and exported with the train steps
+  void ReportMemory(const MemoryStat& stat);
+  // COCO metrics of the epoch, see CocoEvaluator
+  void ReportEvaluation(const CocoEvalStats& bbox_stat,
+                        const CocoEvalStats& segm_stat);
 
+  // Prints all reports made before and stops the print thread
   void Stop();
 
  private:
+  struct Event {
+    PrintState state{PrintState::Idle};
+    // Step or epoch number
+    uint32_t index{0};
+    double learning_rate{0};
+    LossStat stat;
+    LossStat valid_stat;
+    StepTiming timing;
+    MemoryStat memory;
+    CocoEvalStats bbox_stat;
+    CocoEvalStats segm_stat;
+  };
+
+  // Step reports are dropped if the ring is full, other reports wait
+  void Push(const Event& event, bool can_drop);
+  void HandleEvent(const Event& event);
+  void PrintStep();
   void PrintLoss(std::ostream& out, const LossStat& stat);
   void PrintLossSmall(std::ostream& out, const LossStat& stat);
+  void PrintMemory(std::ostream& out, const MemoryStat& stat);
+  void PrintEvaluation(std::ostream& out, const CocoEvalStats& stat);
   void PrintLoop();
   void ClearStepScreen();
 
@@ -54,16 +111,24 @@ class StatReporter {
   double learning_rate_{0.0};
   LossStat train_stat_;
   LossStat valid_stat_;
+  MemoryStat memory_stat_;
+  bool has_memory_stat_{false};
 
   uint32_t train_steps_num_{0};
   uint32_t train_step_{0};
   uint32_t val_steps_num_{0};
   uint32_t val_step_{0};
 
+  // Step which is not printed yet, ReportTrainStep or ReportValidationStep
+  PrintState pending_step_{PrintState::Idle};
+  uint64_t dropped_printed_{0};
+
+  std::unique_ptr<MetricsExporter> exporter_;
+
+  SpscRing<Event> events_;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<bool> stop_{false};
   std::thread print_thread;
-  PrintState print_state_{PrintState::Idle};
-  std::mutex state_mutex_;
-  std::condition_variable state_cv_;
 };
 
 #endif  // STATREPORTER_H
@@ -0,0 +1,38 @@
+#include "steparena.h"
+
+#include <functional>
+#include <numeric>
+
+namespace {
+int64_t Numel(at::IntList sizes) {
+  return std::accumulate(sizes.begin(), sizes.end(), int64_t{1},
+                         std::multiplies<int64_t>());
+}
+}  // namespace
+
+StepArena::StepArena(at::Device device) : device_(device) {}
+
+void StepArena::Reserve(const std::string& name,
+                        at::IntList sizes,
+                        at::ScalarType type) {
+  auto& buffer = buffers_[name];
+  if (buffer.defined())
+    reserved_bytes_ -= buffer.numel() * buffer.element_size();
+  buffer = torch::empty({Numel(sizes)},
+                        at::dtype(type).device(device_).requires_grad(false));
+  reserved_bytes_ += buffer.numel() * buffer.element_size();
+}
+
+at::Tensor StepArena::Get(const std::string& name,
+                          at::IntList sizes,
+                          at::ScalarType type) {
+  auto& buffer = buffers_[name];
+  auto numel = Numel(sizes);
+  if (!buffer.defined() || buffer.scalar_type() != type ||
+      buffer.numel() < numel) {
+    if (buffer.defined())
+      ++grow_count_;
+    Reserve(name, sizes, type);
+  }
+  return buffer.narrow(0, 0, numel).view(sizes);
+}
@@ -0,0 +1,42 @@
+#ifndef STEPARENA_H
+#define STEPARENA_H
+
+#include <torch/torch.h>
+
+#include <map>
+#include <string>
+
+/* Named buffers for the temporary tensors of a training step. Buffers are
+ * reserved once with the maximal sizes from the config and every step takes
+ * its tensors from them, so the allocator sees the same blocks all the time
+ * instead of tensors of sizes changing with the number of proposals.
+ * A tensor returned by Get is valid until the next Get of the same name:
+ * an arena belongs to one model and its tensors must not outlive the step.
+ */
+class StepArena {
+ public:
+  explicit StepArena(at::Device device);
+  StepArena(const StepArena&) = delete;
+  StepArena& operator=(const StepArena&) = delete;
+
+  void Reserve(const std::string& name,
+               at::IntList sizes,
+               at::ScalarType type);
+
+  // Returns uninitialized contiguous tensor sharing memory with the buffer.
+  // The buffer is reallocated if it is too small, counted in GrowCount.
+  at::Tensor Get(const std::string& name,
+                 at::IntList sizes,
+                 at::ScalarType type);
+
+  int64_t ReservedBytes() const { return reserved_bytes_; }
+  uint32_t GrowCount() const { return grow_count_; }
+
+ private:
+  at::Device device_;
+  std::map<std::string, at::Tensor> buffers_;
+  int64_t reserved_bytes_{0};
+  uint32_t grow_count_{0};
+};
+
+#endif  // STEPARENA_H
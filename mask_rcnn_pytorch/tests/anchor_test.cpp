@@ -3,6 +3,9 @@
 #include "../anchors.h"
 #include "../config.h"
 
+#include <algorithm>
+#include <numeric>
+
 TEST_CASE("Generate anchors no throw", "[anchors]") {
   Config config;
   torch::Tensor boxes;
@@ -59,3 +62,51 @@ TEST_CASE("Generate anchors", "[anchors]") {
     REQUIRE(y2 < static_cast<float>(image_shape[0]) + half_w);
   }
 }
+
+TEST_CASE("Anchors are cached by geometry", "[anchors]") {
+  Config config;
+  auto anchors = CachedPyramidAnchors(config, at::kCPU);
+  REQUIRE(CachedPyramidAnchors(config, at::kCPU).data<float>() ==
+          anchors.data<float>());
+  auto expected = GeneratePyramidAnchors(
+      config.rpn_anchor_scales, config.rpn_anchor_ratios,
+      config.backbone_shapes, config.backbone_strides,
+      static_cast<float>(config.rpn_anchor_stride));
+  REQUIRE(anchors.equal(expected));
+
+  // Other input size means other feature shapes
+  config.image_max_dim = 512;
+  config.UpdateSettings();
+  auto other = CachedPyramidAnchors(config, at::kCPU);
+  REQUIRE(other.data<float>() != anchors.data<float>());
+  REQUIRE(other.size(0) != anchors.size(0));
+}
+
+TEST_CASE("Anchors follow non square inputs", "[anchors]") {
+  Config config;
+  config.image_padding = false;
+  auto anchors = CachedPyramidAnchors(config, 768, 1024, at::kCPU);
+  int64_t expected = 0;
+  for (const auto& shape : config.BackboneShapes(768, 1024))
+    expected += static_cast<int64_t>(shape.first * shape.second) *
+                static_cast<int64_t>(config.rpn_anchor_ratios.size());
+  REQUIRE(anchors.size(0) == expected);
+  REQUIRE(CachedPyramidAnchors(config, 1024, 768, at::kCPU).size(0) ==
+          expected);
+  REQUIRE(CachedPyramidAnchors(config, at::kCPU).size(0) > expected);
+}
+
+TEST_CASE("Anchor counts per level", "[anchors]") {
+  Config config;
+  config.image_padding = false;
+  for (uint32_t anchor_stride : {1, 2}) {
+    config.rpn_anchor_stride = anchor_stride;
+    auto counts = PyramidAnchorCounts(config, 768, 1024);
+    REQUIRE(counts.size() == config.backbone_strides.size());
+    auto anchors = CachedPyramidAnchors(config, 768, 1024, at::kCPU);
+    REQUIRE(std::accumulate(counts.begin(), counts.end(), int64_t{0}) ==
+            anchors.size(0));
+    // Finer levels have more anchors
+    REQUIRE(std::is_sorted(counts.rbegin(), counts.rend()));
+  }
+}
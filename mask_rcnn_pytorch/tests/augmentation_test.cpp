@@ -0,0 +1,46 @@
+#include "catch.hpp"
+
+#include "../augmentation.h"
+
+TEST_CASE("Flip augmentation", "[augmentation]") {
+  torch::manual_seed(7411);
+  Config config;
+  config.augment_flip_prob = 1;
+  auto images = torch::rand({2, 3, 8, 10}) * 255;
+  std::vector<Window> windows(2, Window{0, 0, 8, 10});
+  std::vector<at::Tensor> class_ids, boxes, masks;
+  for (int64_t i = 0; i < 2; ++i) {
+    class_ids.push_back(
+        torch::tensor({3, 5}, at::dtype(at::kInt)).view({1, 2}));
+    boxes.push_back(torch::tensor({1.f, 2.f, 5.f, 6.f, 0.f, 0.f, 8.f, 3.f})
+                        .view({1, 2, 4}));
+    masks.push_back((torch::rand({1, 2, 4, 4}) > 0.5).to(at::kFloat));
+  }
+  auto expected_images = images.flip({3});
+  auto expected_masks = masks[0].flip({3});
+
+  AugmentBatch(images, windows, class_ids, boxes, masks, config);
+  REQUIRE(images.allclose(expected_images, 0, 1e-3));
+  auto expected_boxes =
+      torch::tensor({1.f, 4.f, 5.f, 8.f, 0.f, 7.f, 8.f, 10.f}).view({1, 2, 4});
+  REQUIRE(boxes[0].allclose(expected_boxes));
+  REQUIRE(masks[0].equal(expected_masks));
+  REQUIRE(class_ids[0].equal(
+      torch::tensor({3, 5}, at::dtype(at::kInt)).view({1, 2})));
+}
+
+TEST_CASE("Color augmentation keeps padding", "[augmentation]") {
+  torch::manual_seed(7412);
+  Config config;
+  config.augment_color_jitter = 0.4f;
+  auto images = torch::rand({1, 3, 8, 10}) * 100;
+  // Padding of molded images is the negative mean pixel
+  for (int64_t c = 0; c < 3; ++c)
+    images[0][c].narrow(1, 6, 4).fill_(-config.mean_pixel[c]);
+  auto padding = images.narrow(3, 6, 4).clone();
+  std::vector<Window> windows{Window{0, 0, 8, 6}};
+  std::vector<at::Tensor> class_ids, boxes, masks;
+
+  AugmentBatch(images, windows, class_ids, boxes, masks, config);
+  REQUIRE(images.narrow(3, 6, 4).allclose(padding, 0, 1e-3));
+}
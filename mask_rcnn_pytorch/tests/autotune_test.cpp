@@ -0,0 +1,130 @@
+#include "catch.hpp"
+
+#include "../../autotune.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+TEST_CASE("Tuner searches the knobs one by one", "[autotune]") {
+  utils::AutoTuner tuner({{"workers", {1, 2, 4, 8}}, {"prefetch", {2, 4, 8}}});
+  // the best is 4 workers and the prefetch of 8
+  auto measure = [](const utils::TuneSettings& settings) {
+    auto workers = static_cast<double>(settings.at("workers"));
+    auto prefetch = static_cast<double>(settings.at("prefetch"));
+    utils::TuneTrial trial;
+    trial.rate = 100 - (workers - 4) * (workers - 4) + prefetch;
+    return trial;
+  };
+  auto best = tuner.Tune({{"workers", 1}, {"prefetch", 2}}, measure);
+  REQUIRE(best.at("workers") == 4);
+  REQUIRE(best.at("prefetch") == 8);
+  // the start and the candidates which differ from it
+  REQUIRE(tuner.TrialsNum() == 1 + 3 + 2);
+  REQUIRE(tuner.BestRate() == Approx(108));
+}
+
+TEST_CASE("Tuner rejects failed trials and trials over the limit",
+          "[autotune]") {
+  utils::AutoTuner tuner({{"batch", {1, 2, 4, 8}}}, 3000);
+  auto measure = [](const utils::TuneSettings& settings) {
+    auto batch = settings.at("batch");
+    if (batch == 8)
+      throw std::runtime_error("out of memory");
+    utils::TuneTrial trial;
+    trial.rate = batch;
+    trial.memory = batch * 1000;
+    return trial;
+  };
+  auto best = tuner.Tune({{"batch", 1}}, measure);
+  REQUIRE(best.at("batch") == 2);
+  REQUIRE(tuner.BestRate() == Approx(2));
+
+  // nothing is accepted, the start is kept
+  utils::AutoTuner failing({{"batch", {2}}});
+  best = failing.Tune({{"batch", 1}}, [](const utils::TuneSettings&) {
+    throw std::runtime_error("broken");
+    return utils::TuneTrial();
+  });
+  REQUIRE(best.at("batch") == 1);
+}
+
+TEST_CASE("Tuner checks the trials which raised the memory watermark",
+          "[autotune]") {
+  utils::AutoTuner tuner({{"batch", {1, 2, 4, 8}}, {"workers", {1, 2, 4}}},
+                         5000);
+  // the watermark only grows, the batch of 8 raises it over the limit
+  int64_t watermark = 0;
+  auto measure = [&watermark](const utils::TuneSettings& settings) {
+    auto batch = settings.at("batch");
+    auto workers = settings.at("workers");
+    utils::TuneTrial trial;
+    trial.memory_before = watermark;
+    watermark = std::max<int64_t>(watermark, batch * 1000 + workers * 10);
+    trial.rate = batch + workers;
+    trial.memory = watermark;
+    return trial;
+  };
+  auto best = tuner.Tune({{"batch", 1}, {"workers", 1}}, measure);
+  // the workers are still tuned after the rejected batch
+  REQUIRE(best.at("batch") == 4);
+  REQUIRE(best.at("workers") == 4);
+  REQUIRE(tuner.BestRate() == Approx(8));
+}
+
+TEST_CASE("Tuned settings are saved per signature", "[autotune]") {
+  const std::string file_name = "autotune_test.txt";
+  std::remove(file_name.c_str());
+  utils::TuneSettings settings;
+  REQUIRE_FALSE(utils::LoadTuneSettings(file_name, "gpus=1", settings));
+
+  utils::SaveTuneSettings(file_name, "gpus=1", {{"workers", 4}});
+  utils::SaveTuneSettings(file_name, "gpus=2", {{"workers", 8}});
+  utils::SaveTuneSettings(file_name, "gpus=1", {{"workers", 2}, {"x", 3}});
+
+  REQUIRE(utils::LoadTuneSettings(file_name, "gpus=1", settings));
+  REQUIRE(settings == utils::TuneSettings{{"workers", 2}, {"x", 3}});
+  REQUIRE(utils::LoadTuneSettings(file_name, "gpus=2", settings));
+  REQUIRE(settings == utils::TuneSettings{{"workers", 8}});
+  REQUIRE(utils::ReadTuneLines(file_name).size() == 2);
+  std::remove(file_name.c_str());
+
+  REQUIRE(utils::TuneSettingsString({{"a", 1}, {"b", 20}}) == "a=1 b=20");
+  REQUIRE(utils::ParseTuneSettings("a=1 b=20") ==
+          utils::TuneSettings{{"a", 1}, {"b", 20}});
+  REQUIRE_THROWS(utils::ParseTuneSettings("a"));
+  REQUIRE(utils::TuneFile("/tmp").find("/autotune-") != std::string::npos);
+}
+
+TEST_CASE("Tuned settings are loaded or tuned and saved", "[autotune]") {
+  REQUIRE(utils::TuneCandidates({8, 0, 2, 16, 2, 1}, 8) ==
+          std::vector<uint32_t>{1, 2, 8});
+
+  const std::string file_name = "autotune_load_test.txt";
+  std::remove(file_name.c_str());
+  utils::AutoTuner tuner({{"workers", {1, 2, 4}}});
+  size_t measured = 0;
+  auto measure = [&measured](const utils::TuneSettings& settings) {
+    ++measured;
+    utils::TuneTrial trial;
+    trial.rate = settings.at("workers");
+    return trial;
+  };
+  auto settings = utils::LoadOrTune(file_name, "gpus=1", false, tuner,
+                                    {{"workers", 1}}, measure);
+  REQUIRE(settings == utils::TuneSettings{{"workers", 4}});
+  REQUIRE(measured == 3);
+
+  // the next run takes the saved settings, retune measures again
+  settings = utils::LoadOrTune(file_name, "gpus=1", false, tuner,
+                               {{"workers", 1}}, measure);
+  REQUIRE(settings == utils::TuneSettings{{"workers", 4}});
+  REQUIRE(measured == 3);
+  settings = utils::LoadOrTune(file_name, "gpus=1", true, tuner,
+                               {{"workers", 1}}, measure);
+  REQUIRE(measured == 6);
+  std::remove(file_name.c_str());
+}
@@ -0,0 +1,48 @@
+#include "catch.hpp"
+
+#include "../blockingqueue.h"
+
+#include <thread>
+
+TEST_CASE("Blocking queue passes items between threads", "[blockingqueue]") {
+  const int count = 10000;
+  BlockingQueue<int> first(2);
+  BlockingQueue<int> second(3);
+  std::thread producer([&first]() {
+    for (int i = 0; i < count; ++i)
+      first.Push(i);
+    first.Close();
+  });
+  std::thread stage([&first, &second]() {
+    int value = 0;
+    while (first.Pop(value))
+      second.Push(value * 2);
+    second.Close();
+  });
+
+  bool ordered = true;
+  int expected = 0;
+  int value = 0;
+  while (second.Pop(value)) {
+    ordered = ordered && value == expected * 2;
+    ++expected;
+  }
+  producer.join();
+  stage.join();
+  REQUIRE(ordered);
+  REQUIRE(expected == count);
+}
+
+TEST_CASE("Closed blocking queue returns the rest", "[blockingqueue]") {
+  BlockingQueue<int> queue(2);
+  REQUIRE(queue.Push(1));
+  REQUIRE(queue.Push(2));
+  queue.Close();
+  REQUIRE(!queue.Push(3));
+  int value = 0;
+  REQUIRE(queue.Pop(value));
+  REQUIRE(value == 1);
+  REQUIRE(queue.Pop(value));
+  REQUIRE(value == 2);
+  REQUIRE(!queue.Pop(value));
+}
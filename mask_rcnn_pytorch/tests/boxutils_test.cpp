@@ -0,0 +1,62 @@
+#include "catch.hpp"
+
+#include "../boxutils.h"
+
+namespace {
+at::Tensor RandomBoxes(int64_t n) {
+  auto y1x1 = torch::rand({n, 2}) * 800;
+  auto hw = torch::rand({n, 2}) * 150 + 1;
+  return torch::cat({y1x1, y1x1 + hw}, 1);
+}
+}  // namespace
+
+TEST_CASE("BBoxOverlaps matches BBoxOverlapsLoops", "[boxutils]") {
+  torch::manual_seed(8731);
+  for (int64_t n : {1, 7, 513, 5000}) {
+    for (int64_t m : {1, 3, 100}) {
+      auto boxes1 = RandomBoxes(n);
+      auto boxes2 = RandomBoxes(m);
+      auto overlaps = BBoxOverlaps(boxes1, boxes2);
+      auto expected = BBoxOverlapsLoops(boxes1, boxes2);
+      REQUIRE(overlaps.sizes() == expected.sizes());
+      REQUIRE(overlaps.equal(expected));
+    }
+  }
+}
+
+TEST_CASE("BBoxMaxOverlaps matches reductions of overlaps", "[boxutils]") {
+  torch::manual_seed(2239);
+  auto boxes1 = RandomBoxes(3000);
+  auto boxes2 = RandomBoxes(50);
+  // Duplicates make ties, the first index has to be taken
+  boxes1[10] = boxes2[4];
+  boxes1[20] = boxes2[4];
+  auto overlaps = BBoxOverlapsLoops(boxes1, boxes2);
+
+  at::Tensor max1, argmax1, max2, argmax2;
+  std::tie(max1, argmax1, max2, argmax2) = BBoxMaxOverlaps(boxes1, boxes2);
+  REQUIRE(max1.equal(std::get<0>(overlaps.max(1))));
+  REQUIRE(max2.equal(std::get<0>(overlaps.max(0))));
+  // Argmax values have to point to the max values
+  REQUIRE(overlaps.gather(1, argmax1.unsqueeze(1)).squeeze(1).equal(max1));
+  REQUIRE(overlaps.gather(0, argmax2.unsqueeze(0)).squeeze(0).equal(max2));
+  REQUIRE(argmax2[4].item<int64_t>() == 10);
+}
+
+TEST_CASE("DecodeBoxes matches ApplyBoxDeltas and ClipBoxes", "[boxutils]") {
+  torch::manual_seed(5127);
+  std::vector<float> std_dev = {0.1f, 0.1f, 0.2f, 0.2f};
+  auto std_dev_tensor = torch::tensor(std_dev);
+  for (int64_t n : {1, 17, 6000}) {
+    auto boxes = RandomBoxes(n) / 1024;
+    auto deltas = torch::randn({n, 4}) * 2;
+    Window window{10, 20, 700, 900};
+    auto decoded = DecodeBoxes(boxes, deltas, std_dev, 768, 1024, window);
+
+    auto expected = ApplyBoxDeltas(boxes, deltas * std_dev_tensor) *
+                    torch::tensor({768.f, 1024.f, 768.f, 1024.f});
+    expected = ClipBoxes(expected, window);
+    REQUIRE(decoded.sizes() == expected.sizes());
+    REQUIRE(decoded.allclose(expected, /*rtol*/ 1e-5, /*atol*/ 1e-3));
+  }
+}
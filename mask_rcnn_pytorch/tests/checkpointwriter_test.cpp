@@ -0,0 +1,53 @@
+#include "catch.hpp"
+
+#include "../checkpointwriter.h"
+#include "../stateloader.h"
+
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+TEST_CASE("Partial checkpoints", "[checkpointwriter]") {
+  torch::manual_seed(3301);
+  auto make_model = [] {
+    return torch::nn::Sequential(
+        torch::nn::Conv2d(torch::nn::Conv2dOptions(3, 8, 3)),
+        torch::nn::BatchNorm(8), torch::nn::Linear(16, 4));
+  };
+  auto model = make_model();
+  // Frozen first layer isn't saved
+  for (auto& param : model->ptr(0)->parameters())
+    param.set_requires_grad(false);
+
+  auto dir = fs::temp_directory_path();
+  auto first_file = (dir / "checkpoint_test_0.dat").string();
+  auto second_file = (dir / "checkpoint_test_1.dat").string();
+  {
+    CheckpointWriter writer;
+    writer.Save(GetStateTensors(*model, /*trainable_only*/ true), first_file);
+    // The snapshot is taken by Save, later changes aren't written
+    writer.Save(GetStateTensors(*model, /*trainable_only*/ true), second_file,
+                first_file);
+    {
+      torch::NoGradGuard no_grad;
+      for (auto& param : model->parameters())
+        param.add_(1);
+    }
+    writer.Wait();
+  }
+  REQUIRE_FALSE(fs::exists(first_file));
+  REQUIRE_FALSE(fs::exists(second_file + ".tmp"));
+
+  auto loaded = make_model();
+  auto initial = loaded->named_parameters().find("0.weight")->clone();
+  LoadStateDict(*loaded, second_file);
+  fs::remove(second_file);
+
+  // Frozen parameters are kept, the rest is loaded
+  auto params = model->named_parameters();
+  REQUIRE(loaded->named_parameters().find("0.weight")->equal(initial));
+  for (auto& param : loaded->named_parameters()) {
+    if (param.key().find("0.") != 0)
+      REQUIRE(param.value().equal(*params.find(param.key()) - 1));
+  }
+}
@@ -0,0 +1,88 @@
+#include "catch.hpp"
+
+#include "../cocoeval.h"
+
+namespace {
+CocoInstance MakeInstance(uint32_t image_id,
+                          int32_t class_id,
+                          int x,
+                          int y,
+                          int width,
+                          int height,
+                          float score = 0,
+                          bool iscrowd = false) {
+  CocoInstance instance;
+  instance.image_id = image_id;
+  instance.class_id = class_id;
+  instance.box[0] = static_cast<float>(x);
+  instance.box[1] = static_cast<float>(y);
+  instance.box[2] = static_cast<float>(width);
+  instance.box[3] = static_cast<float>(height);
+  instance.score = score;
+  instance.iscrowd = iscrowd;
+  cv::Mat mask = cv::Mat::zeros(100, 100, CV_8UC1);
+  mask(cv::Rect(x, y, width, height)) = 255;
+  instance.mask.counts = EncodeRle(mask);
+  instance.mask.height = mask.rows;
+  instance.mask.width = mask.cols;
+  return instance;
+}
+}  // namespace
+
+TEST_CASE("RLE intersection", "[cocoeval]") {
+  auto a = MakeInstance(1, 1, 10, 10, 40, 40).mask;
+  auto b = MakeInstance(1, 1, 30, 20, 40, 40).mask;
+  REQUIRE(RleArea(a) == 1600);
+  REQUIRE(RleIntersection(a, b) == 20 * 30);
+  REQUIRE(RleIntersection(b, a) == 20 * 30);
+  REQUIRE(RleIntersection(a, a) == 1600);
+}
+
+TEST_CASE("COCO metrics", "[cocoeval]") {
+  CocoEvaluator evaluator;
+  evaluator.AddGroundTruth(MakeInstance(1, 1, 10, 10, 40, 40));
+  evaluator.AddGroundTruth(MakeInstance(2, 1, 10, 10, 40, 40));
+  evaluator.AddDetection(MakeInstance(1, 1, 10, 10, 40, 40, 0.9f));
+  // The false positive with the highest score
+  evaluator.AddDetection(MakeInstance(2, 1, 60, 60, 20, 20, 0.95f));
+  evaluator.AddDetection(MakeInstance(2, 1, 10, 10, 40, 40, 0.5f));
+
+  for (auto type : {CocoIouType::BBox, CocoIouType::Segm}) {
+    auto stats = evaluator.Evaluate(type);
+    // Precision 2/3 at all recall levels
+    REQUIRE(stats.ap == Approx(2. / 3));
+    REQUIRE(stats.ap50 == Approx(2. / 3));
+    REQUIRE(stats.ap75 == Approx(2. / 3));
+    // No small and large ground truth, the small false positive is ignored
+    // for the medium range
+    REQUIRE(stats.ap_small == -1);
+    REQUIRE(stats.ap_medium == Approx(1));
+    REQUIRE(stats.ap_large == -1);
+    REQUIRE(stats.ar1 == Approx(0.5));
+    REQUIRE(stats.ar100 == Approx(1));
+  }
+}
+
+TEST_CASE("COCO metrics ignore crowd regions", "[cocoeval]") {
+  CocoEvaluator evaluator;
+  evaluator.AddGroundTruth(MakeInstance(1, 1, 10, 10, 30, 30));
+  evaluator.AddGroundTruth(MakeInstance(1, 1, 50, 50, 50, 50, 0, true));
+  evaluator.AddDetection(MakeInstance(1, 1, 10, 10, 30, 30, 0.9f));
+  // Detections inside the crowd region aren't false positives
+  evaluator.AddDetection(MakeInstance(1, 1, 55, 55, 20, 20, 0.95f));
+  evaluator.AddDetection(MakeInstance(1, 1, 75, 75, 20, 20, 0.8f));
+
+  auto stats = evaluator.Evaluate(CocoIouType::Segm);
+  REQUIRE(stats.ap == Approx(1));
+  REQUIRE(stats.ar100 == Approx(1));
+
+  // Imperfect boxes are matched only at low thresholds
+  evaluator.Clear();
+  evaluator.AddGroundTruth(MakeInstance(1, 1, 10, 10, 40, 40));
+  evaluator.AddDetection(MakeInstance(1, 1, 10, 10, 40, 30, 0.9f));
+  stats = evaluator.Evaluate(CocoIouType::BBox);
+  REQUIRE(stats.ap50 == Approx(1));
+  REQUIRE(stats.ap75 == Approx(1));
+  // IoU 0.75 passes thresholds 0.50:0.75
+  REQUIRE(stats.ap == Approx(0.6));
+}
@@ -0,0 +1,41 @@
+#include "catch.hpp"
+
+#include "../cocorle.h"
+
+TEST_CASE("RLE encoding is column-major", "[rle]") {
+  cv::Mat mask = cv::Mat::zeros(2, 3, CV_8UC1);
+  mask.at<uint8_t>(1, 0) = 255;
+  mask.at<uint8_t>(0, 1) = 255;
+  mask.at<uint8_t>(1, 2) = 1;
+  // Columns: [0, 1], [1, 0], [0, 1]
+  auto counts = EncodeRle(mask);
+  std::vector<uint32_t> expected = {1, 2, 2, 1};
+  REQUIRE(counts == expected);
+}
+
+TEST_CASE("RLE decoding restores the mask", "[rle]") {
+  cv::Mat mask = cv::Mat::zeros(37, 53, CV_8UC1);
+  cv::circle(mask, cv::Point(20, 15), 10, cv::Scalar(255), cv::FILLED);
+  cv::rectangle(mask, cv::Point(40, 0), cv::Point(52, 36), cv::Scalar(255),
+                cv::FILLED);
+  auto counts = EncodeRle(mask);
+  auto decoded = DecodeRle(counts.data(), counts.size(), mask.rows, mask.cols);
+  REQUIRE(decoded.size() == mask.size());
+  REQUIRE(cv::countNonZero(decoded != mask) == 0);
+
+  cv::Mat full(4, 4, CV_8UC1, cv::Scalar(255));
+  counts = EncodeRle(full);
+  REQUIRE(counts.front() == 0);
+  decoded = DecodeRle(counts.data(), counts.size(), 4, 4);
+  REQUIRE(cv::countNonZero(decoded != full) == 0);
+}
+
+TEST_CASE("RLE string decoding", "[rle]") {
+  std::string str = "122O";
+  std::vector<uint32_t> expected = {1, 2, 2, 1};
+  REQUIRE(DecodeRleString(str.data(), str.size()) == expected);
+
+  str = "T3";
+  expected = {100};
+  REQUIRE(DecodeRleString(str.data(), str.size()) == expected);
+}
@@ -0,0 +1,36 @@
+#include "catch.hpp"
+
+#include "../config.h"
+#include "../detectionlayer.h"
+
+TEST_CASE("Detections are clipped to their image", "[detectionlayer]") {
+  Config config;
+  config.gpu_count = 0;
+  config.num_classes = 2;
+  config.image_min_dim = 64;
+  config.image_max_dim = 64;
+  config.detection_min_confidence = 0.5f;
+  config.UpdateSettings();
+  auto constants = BuildLayerConstants(config, 64, 64);
+
+  // One proposal and one padding row per image
+  auto rois = torch::tensor({0.1f, 0.1f, 0.9f, 0.9f, 0.f, 0.f, 0.f, 0.f,
+                             0.1f, 0.1f, 0.9f, 0.9f, 0.f, 0.f, 0.f, 0.f})
+                  .view({2, 2, 4});
+  auto probs = torch::tensor({0.1f, 0.9f, 0.5f, 0.5f, 0.2f, 0.8f, 0.5f, 0.5f})
+                   .view({4, 2});
+  auto deltas = torch::zeros({4, 2, 4});
+  std::vector<ImageMeta> image_meta(2);
+  image_meta[0].window = Window{0, 0, 64, 64};
+  image_meta[1].window = Window{0, 0, 32, 64};
+
+  auto detections =
+      DetectionLayer(config, constants, rois, probs, deltas, image_meta);
+  REQUIRE(detections.sizes() == at::IntList({2, 2, 6}));
+  auto expected =
+      torch::tensor({6.f, 6.f, 58.f, 58.f, 1.f, 0.9f, 0.f, 0.f, 0.f, 0.f, 0.f,
+                     0.f, 6.f, 6.f, 32.f, 58.f, 1.f, 0.8f, 0.f, 0.f, 0.f, 0.f,
+                     0.f, 0.f})
+          .view({2, 2, 6});
+  REQUIRE(detections.allclose(expected));
+}
@@ -0,0 +1,97 @@
+#include "catch.hpp"
+
+#include "../config.h"
+#include "../detectiontargetlayer.h"
+
+namespace {
+// Boxes in normalized coordinates slightly inside of the given box
+at::Tensor JitteredBoxes(at::Tensor box, int64_t n) {
+  auto shrink = torch::rand({n, 4}) * 0.01f *
+                torch::tensor({1.f, 1.f, -1.f, -1.f});
+  return box.unsqueeze(0).repeat({n, 1}) + shrink;
+}
+}  // namespace
+
+TEST_CASE("Detection targets have fixed size", "[detectiontargetlayer]") {
+  torch::manual_seed(3412);
+  Config config;
+  config.gpu_count = 0;
+  config.use_mini_mask = true;
+  auto rois_count = static_cast<int64_t>(config.train_rois_per_image);
+
+  auto gt_boxes = torch::tensor({0.1f, 0.1f, 0.3f, 0.4f, 0.5f, 0.5f, 0.9f,
+                                 0.8f, 0.f, 0.f, 0.f, 0.f})
+                      .view({3, 4});
+  auto gt_class_ids = torch::tensor({3, 7, 0}, at::dtype(at::kInt));
+  auto gt_masks = torch::ones({3, 56, 56});
+
+  for (int64_t positives : {0, 10, 300}) {
+    auto far_boxes = torch::tensor({0.6f, 0.f, 0.7f, 0.1f}).view({1, 4});
+    auto proposals =
+        torch::cat({JitteredBoxes(gt_boxes[0], positives / 2),
+                    JitteredBoxes(gt_boxes[1], positives - positives / 2),
+                    far_boxes.repeat({500, 1}), torch::zeros({100, 4})});
+    auto [batch_rois, batch_class_ids, batch_deltas, batch_masks] =
+        DetectionTargetLayer(config, proposals.unsqueeze(0),
+                             gt_class_ids.unsqueeze(0), gt_boxes.unsqueeze(0),
+                             gt_masks.unsqueeze(0));
+    REQUIRE(batch_rois.sizes() == at::IntList({1, rois_count, 4}));
+    REQUIRE(batch_class_ids.sizes() == at::IntList({1, rois_count}));
+    REQUIRE(batch_deltas.sizes() == at::IntList({1, rois_count, 4}));
+    REQUIRE(batch_masks.size(1) == rois_count);
+    auto rois = batch_rois[0];
+    auto class_ids = batch_class_ids[0];
+    auto deltas = batch_deltas[0];
+    auto masks = batch_masks[0];
+
+    auto positive_max = static_cast<int64_t>(config.train_rois_per_image *
+                                             config.roi_positive_ratio);
+    auto expected_positive = std::min(positives, positive_max);
+    auto positive = class_ids > 0;
+    REQUIRE(positive.sum().item<int64_t>() == expected_positive);
+    REQUIRE(((class_ids == 3) | (class_ids == 7)).eq(positive).all()
+                .item<uint8_t>());
+    auto r = 1.0f / config.roi_positive_ratio;
+    auto expected_negative = static_cast<int64_t>(
+        r * static_cast<float>(expected_positive) - expected_positive);
+    REQUIRE((class_ids == 0).sum().item<int64_t>() == expected_negative);
+
+    // Padding rows are zeros and never taken from zero proposals
+    auto padding = (class_ids < 0).unsqueeze(1);
+    REQUIRE(rois.masked_select(padding).eq(0).all().item<uint8_t>());
+    REQUIRE(deltas.masked_select(padding).eq(0).all().item<uint8_t>());
+    auto valid_rois = rois.masked_select(padding == 0).view({-1, 4});
+    REQUIRE((valid_rois.narrow(1, 2, 1) > valid_rois.narrow(1, 0, 1))
+                .all()
+                .item<uint8_t>());
+    REQUIRE(masks.sum().item<float>() ==
+            Approx(static_cast<float>(expected_positive * masks.size(1) *
+                                      masks.size(2))));
+  }
+}
+
+TEST_CASE("Byte GT masks give the same targets", "[detectiontargetlayer]") {
+  Config config;
+  config.gpu_count = 0;
+  config.use_mini_mask = true;
+
+  auto gt_boxes =
+      torch::tensor({0.1f, 0.1f, 0.3f, 0.4f, 0.5f, 0.5f, 0.9f, 0.8f})
+          .view({1, 2, 4});
+  auto gt_class_ids = torch::tensor({3, 7}, at::dtype(at::kInt)).view({1, 2});
+  auto gt_masks = torch::rand({1, 2, 56, 56}) > 0.5f;
+  torch::manual_seed(7);
+  auto proposals = torch::cat({JitteredBoxes(gt_boxes[0][0], 20),
+                               JitteredBoxes(gt_boxes[0][1], 20)})
+                       .unsqueeze(0);
+
+  torch::manual_seed(11);
+  auto byte_targets = DetectionTargetLayer(config, proposals, gt_class_ids,
+                                           gt_boxes, gt_masks);
+  torch::manual_seed(11);
+  auto float_targets = DetectionTargetLayer(
+      config, proposals, gt_class_ids, gt_boxes, gt_masks.to(at::kFloat));
+  REQUIRE(std::get<1>(byte_targets).equal(std::get<1>(float_targets)));
+  REQUIRE(std::get<3>(byte_targets).scalar_type() == at::kFloat);
+  REQUIRE(std::get<3>(byte_targets).equal(std::get<3>(float_targets)));
+}
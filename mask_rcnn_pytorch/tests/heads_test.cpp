@@ -0,0 +1,73 @@
+#include "catch.hpp"
+
+#include "../maskrcnn.h"
+#include "../stateloader.h"
+
+#include <experimental/filesystem>
+#include <fstream>
+
+namespace fs = std::experimental::filesystem;
+
+TEST_CASE("Head files parameter", "[heads]") {
+  auto dir = fs::temp_directory_path() / "heads_test";
+  fs::create_directories(dir);
+  auto cars = (dir / "cars.pt").string();
+  auto animals = (dir / "animals.pt").string();
+  std::ofstream(cars) << "cars";
+  std::ofstream(animals) << "animals";
+
+  auto heads = ParseHeadFiles(cars + ":5," + animals + ":12");
+  REQUIRE(heads.size() == 2);
+  REQUIRE(heads[0].first == fs::canonical(cars).string());
+  REQUIRE(heads[0].second == 5);
+  REQUIRE(heads[1].first == fs::canonical(animals).string());
+  REQUIRE(heads[1].second == 12);
+  REQUIRE(ParseHeadFiles("").empty());
+
+  REQUIRE_THROWS(ParseHeadFiles(cars));
+  REQUIRE_THROWS(ParseHeadFiles(cars + ":"));
+  REQUIRE_THROWS(ParseHeadFiles(":5"));
+  REQUIRE_THROWS(ParseHeadFiles(cars + ":1"));
+  REQUIRE_THROWS(ParseHeadFiles(cars + ":-3"));
+  REQUIRE_THROWS(ParseHeadFiles(cars + ":5x"));
+  REQUIRE_THROWS(ParseHeadFiles(cars + ":5,," + animals + ":12"));
+  REQUIRE_THROWS(ParseHeadFiles((dir / "missing.pt").string() + ":5"));
+  fs::remove_all(dir);
+}
+
+TEST_CASE("Head sets with the own heads", "[heads]") {
+  torch::manual_seed(7109);
+  auto config = std::make_shared<Config>();
+  config->gpu_count = 0;
+  config->images_per_gpu = 1;
+  config->num_classes = 3;
+  config->image_min_dim = 128;
+  config->image_max_dim = 128;
+  config->UpdateSettings();
+  MaskRCNN model("", config);
+
+  // The extra set is read from the checkpoint of the model itself, like
+  // the sets of the server
+  auto file_name = (fs::temp_directory_path() / "heads_model.dat").string();
+  SaveStateDict(*model, file_name);
+  HeadSet head_set(std::make_shared<Config>(*config));
+  LoadStateDict(*head_set, file_name, "");
+  fs::remove(file_name);
+  REQUIRE(model->AddHeads(head_set) == 1);
+  REQUIRE(model->HeadsNum() == 2);
+
+  std::vector<ImageMeta> image_metas(1);
+  image_metas[0].image_width = 128;
+  image_metas[0].image_height = 128;
+  image_metas[0].window = Window{0, 0, 128, 128};
+  auto images = torch::randn({1, 3, 128, 128});
+  auto [detections, masks] = model->Detect(images, image_metas);
+  auto results = model->DetectHeads(images, image_metas);
+  REQUIRE(results.size() == 2);
+  for (const auto& [set_detections, set_masks] : results) {
+    REQUIRE(set_detections.sizes() == detections.sizes());
+    REQUIRE(set_detections.allclose(detections));
+    REQUIRE(set_masks.sizes() == masks.sizes());
+    REQUIRE(set_masks.allclose(masks));
+  }
+}
@@ -0,0 +1,81 @@
+#include "catch.hpp"
+
+#include "../imageutils.h"
+
+TEST_CASE("Mini masks from RLE", "[imageutils]") {
+  cv::Mat mask = cv::Mat::zeros(61, 83, CV_8UC1);
+  cv::circle(mask, cv::Point(30, 25), 17, cv::Scalar(255), cv::FILLED);
+  cv::rectangle(mask, cv::Point(50, 5), cv::Point(70, 55), cv::Scalar(255),
+                cv::FILLED);
+  RleMask rle;
+  rle.counts = EncodeRle(mask);
+  rle.height = mask.rows;
+  rle.width = mask.cols;
+
+  std::vector<RleMask> masks{rle, rle, rle};
+  std::vector<cv::Rect> boxes{cv::Rect(13, 8, 35, 35), cv::Rect(50, 5, 21, 51),
+                              cv::Rect(0, 0, 83, 61)};
+  // Without scaling the result is the same as of the dense masks
+  std::vector<float> float_boxes;
+  for (const auto& box : boxes) {
+    float_boxes.push_back(box.y);
+    float_boxes.push_back(box.x);
+    float_boxes.push_back(box.y + box.height);
+    float_boxes.push_back(box.x + box.width);
+  }
+  auto dense = MinimizeMasks(float_boxes, ResizeMasks(masks, 1, Padding{}),
+                             28, 28);
+  auto mini = MiniMasksFromRle(masks, boxes, 28, 28);
+  REQUIRE(mini.size() == dense.size());
+  for (size_t i = 0; i < mini.size(); ++i) {
+    REQUIRE(mini[i].type() == CV_32FC1);
+    REQUIRE(mini[i].size() == cv::Size(28, 28));
+    REQUIRE(cv::countNonZero(mini[i] != dense[i]) == 0);
+  }
+}
+
+TEST_CASE("Mold image tensor", "[imageutils]") {
+  Config config;
+  cv::Mat image(21, 34, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+  Padding padding{1, 3, 2, 4, 0, 0};
+  cv::Mat padded;
+  cv::copyMakeBorder(image, padded, padding.top_pad, padding.bottom_pad,
+                     padding.left_pad, padding.right_pad, cv::BORDER_CONSTANT,
+                     cv::Scalar(0, 0, 0));
+  auto expected = CvImageToTensor(MoldImage(padded, config));
+
+  // Decoder output is the RGB planes
+  cv::Mat rgb;
+  cv::cvtColor(image, rgb, cv::COLOR_BGR2RGB);
+  auto rgb_tensor =
+      torch::from_blob(rgb.data, {image.rows, image.cols, 3}, at::kByte)
+          .permute({2, 0, 1})
+          .contiguous();
+  // Without resizing the result matches the CPU path
+  auto molded = MoldImageTensor(rgb_tensor, image.size(), padding, config);
+  REQUIRE(molded.sizes() == expected.sizes());
+  REQUIRE(molded.allclose(expected, 0, 1e-4));
+
+  auto resized =
+      MoldImageTensor(rgb_tensor, cv::Size(68, 42), padding, config);
+  REQUIRE(resized.size(0) == 3);
+  REQUIRE(resized.size(1) == 42 + 4);
+  REQUIRE(resized.size(2) == 68 + 6);
+}
+
+TEST_CASE("Unmold box only detections", "[imageutils]") {
+  auto detections = torch::tensor({10.f, 20.f, 30.f, 50.f, 3.f, 0.9f,  //
+                                   5.f, 5.f, 40.f, 15.f, 1.f, 0.8f,    //
+                                   0.f, 0.f, 0.f, 0.f, 0.f, 0.f})
+                        .view({3, 6});
+  auto mrcnn_mask = torch::zeros({0, 28, 28, 5});
+  auto [boxes, class_ids, scores, masks] = UnmoldDetectionsPacked(
+      detections, mrcnn_mask, cv::Size(60, 40), Window{0, 0, 40, 60}, 0.5);
+  REQUIRE(masks.empty());
+  REQUIRE(boxes.size(0) == 2);
+  REQUIRE(boxes[0].equal(torch::tensor({10, 20, 30, 50}, at::dtype(at::kInt))));
+  REQUIRE(class_ids.view({-1}).equal(
+      torch::tensor({3, 1}, at::dtype(at::kLong))));
+  REQUIRE(scores.view({-1}).allclose(torch::tensor({0.9f, 0.8f})));
+}
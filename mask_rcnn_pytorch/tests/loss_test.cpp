@@ -0,0 +1,84 @@
+#include "catch.hpp"
+
+#include "../loss.h"
+
+#include <vector>
+
+namespace {
+// rpn_match [batch, anchors, 1] of -1, 0, 1 values
+at::Tensor RandomMatch(int64_t batch, int64_t anchors) {
+  return torch::randint(-1, 2, {batch, anchors, 1}, at::dtype(at::kInt));
+}
+}  // namespace
+
+TEST_CASE("RPN losses match row selection", "[loss]") {
+  torch::manual_seed(6251);
+  int64_t batch = 2;
+  int64_t anchors = 500;
+  int64_t rows = 256;
+  auto rpn_match = RandomMatch(batch, anchors);
+  auto logits = torch::randn({batch, anchors, 2});
+  auto pred_bbox = torch::randn({batch, anchors, 4});
+  auto target_bbox = torch::randn({batch, rows, 4});
+
+  // Reference gathers contributing anchors of each image
+  auto match = rpn_match.squeeze(2);
+  auto valid = torch::nonzero(match != 0);
+  auto expected_class = torch::nll_loss(
+      logits.index({valid.select(1, 0), valid.select(1, 1)}).log_softmax(1),
+      (match == 1)
+          .index({valid.select(1, 0), valid.select(1, 1)})
+          .to(at::kLong));
+  REQUIRE(ComputeRpnClassLoss(rpn_match, logits)
+              .allclose(expected_class, 1e-5, 1e-6));
+
+  std::vector<at::Tensor> preds, targets;
+  for (int64_t b = 0; b < batch; ++b) {
+    auto positive = torch::nonzero(match[b] == 1).select(1, 0);
+    auto count = std::min(positive.size(0), rows);
+    preds.push_back(pred_bbox[b].index_select(0, positive.narrow(0, 0, count)));
+    targets.push_back(target_bbox[b].narrow(0, 0, count));
+  }
+  auto expected_bbox =
+      torch::smooth_l1_loss(torch::cat(preds), torch::cat(targets));
+  REQUIRE(ComputeRpnBBoxLoss(target_bbox, rpn_match, pred_bbox)
+              .allclose(expected_bbox, 1e-5, 1e-6));
+}
+
+TEST_CASE("Mask RCNN losses ignore padding rows", "[loss]") {
+  torch::manual_seed(1380);
+  int64_t rois = 20;
+  int64_t classes = 5;
+  auto class_ids = torch::randint(-1, classes, {rois}, at::dtype(at::kInt));
+  auto logits = torch::randn({rois, classes});
+  auto target_deltas = torch::randn({rois, 4});
+  auto pred_bbox = torch::randn({rois, classes, 4});
+  auto target_masks = torch::randint(0, 2, {rois, 7, 7});
+  auto pred_masks = torch::rand({rois, classes, 7, 7}) * 0.98 + 0.01;
+
+  auto valid = torch::nonzero(class_ids >= 0).select(1, 0);
+  auto expected_class = torch::nll_loss(
+      logits.index_select(0, valid).log_softmax(1),
+      class_ids.index_select(0, valid).to(at::kLong));
+  REQUIRE(ComputeMrcnnClassLoss(class_ids, logits)
+              .allclose(expected_class, 1e-5, 1e-6));
+
+  auto positive = torch::nonzero(class_ids > 0).select(1, 0);
+  auto positive_ids = class_ids.index_select(0, positive).to(at::kLong);
+  auto expected_bbox = torch::smooth_l1_loss(
+      pred_bbox.index({positive, positive_ids}),
+      target_deltas.index_select(0, positive));
+  REQUIRE(ComputeMrcnnBBoxLoss(target_deltas, class_ids, pred_bbox)
+              .allclose(expected_bbox, 1e-5, 1e-6));
+
+  auto expected_mask = torch::binary_cross_entropy(
+      pred_masks.index({positive, positive_ids}),
+      target_masks.index_select(0, positive));
+  REQUIRE(ComputeMrcnnMaskLoss(target_masks, class_ids, pred_masks)
+              .allclose(expected_mask, 1e-5, 1e-6));
+
+  // Without positive ROIs the losses are zeros
+  auto negative_ids = class_ids.clamp_max(0);
+  REQUIRE(ComputeMrcnnBBoxLoss(target_deltas, negative_ids, pred_bbox)
+              .item<float>() == 0);
+}
@@ -0,0 +1,76 @@
+#include "catch.hpp"
+
+#include "../nms.h"
+
+#include <math.h>
+#include <vector>
+
+namespace {
+// Straightforward implementation used as reference
+std::vector<int64_t> ReferenceNms(at::Tensor dets, float thresh) {
+  at::Tensor order;
+  std::tie(std::ignore, order) =
+      dets.narrow(1, 4, 1).sort(0, /*descending*/ true);
+  order = order.flatten();
+  auto n = dets.size(0);
+  auto d = dets.accessor<float, 2>();
+  auto o = order.accessor<int64_t, 1>();
+  std::vector<bool> suppressed(static_cast<size_t>(n), false);
+  std::vector<int64_t> keep;
+  for (int64_t k = 0; k < n; ++k) {
+    auto i = o[k];
+    if (suppressed[i])
+      continue;
+    keep.push_back(i);
+    float iarea = (d[i][3] - d[i][1] + 1) * (d[i][2] - d[i][0] + 1);
+    for (int64_t m = k + 1; m < n; ++m) {
+      auto j = o[m];
+      float jarea = (d[j][3] - d[j][1] + 1) * (d[j][2] - d[j][0] + 1);
+      float xx1 = fmaxf(d[i][0], d[j][0]);
+      float yy1 = fmaxf(d[i][1], d[j][1]);
+      float xx2 = fminf(d[i][2], d[j][2]);
+      float yy2 = fminf(d[i][3], d[j][3]);
+      float w = fmaxf(0.0f, xx2 - xx1 + 1);
+      float h = fmaxf(0.0f, yy2 - yy1 + 1);
+      float inter = w * h;
+      if (inter / (iarea + jarea - inter) >= thresh)
+        suppressed[j] = true;
+    }
+  }
+  return keep;
+}
+}  // namespace
+
+TEST_CASE("CPU Nms matches reference", "[nms]") {
+  torch::manual_seed(3465);
+  for (int64_t n : {1, 7, 8, 9, 17, 100, 1000, 6000}) {
+    auto y1x1 = torch::rand({n, 2}) * 800;
+    auto hw = torch::rand({n, 2}) * 150 + 1;
+    auto scores = torch::rand({n, 1});
+    auto dets = torch::cat({y1x1, y1x1 + hw, scores}, 1);
+    for (float thresh : {0.3f, 0.5f, 0.7f}) {
+      auto keep = Nms(dets, thresh);
+      auto expected = ReferenceNms(dets, thresh);
+      REQUIRE(keep.size(0) == static_cast<int64_t>(expected.size()));
+      auto keep_data = keep.accessor<int64_t, 1>();
+      for (size_t i = 0; i < expected.size(); ++i)
+        REQUIRE(keep_data[static_cast<int64_t>(i)] == expected[i]);
+    }
+  }
+}
+
+TEST_CASE("GroupNms keeps overlapped boxes of different groups", "[nms]") {
+  // Two identical boxes in group 1, one copy in group 2 and a separate box
+  auto dets = torch::tensor({10.f, 10.f, 50.f, 50.f, 1.f, 0.9f,    //
+                             10.f, 10.f, 50.f, 50.f, 1.f, 0.8f,    //
+                             10.f, 10.f, 50.f, 50.f, 2.f, 0.7f,    //
+                             100.f, 100.f, 150.f, 150.f, 1.f, 0.6f})
+                  .view({4, 6});
+  auto keep = GroupNms(dets, 0.5f);
+  auto keep_data = keep.accessor<uint8_t, 1>();
+  REQUIRE(keep.size(0) == 4);
+  REQUIRE(keep_data[0] == 1);
+  REQUIRE(keep_data[1] == 0);
+  REQUIRE(keep_data[2] == 1);
+  REQUIRE(keep_data[3] == 1);
+}
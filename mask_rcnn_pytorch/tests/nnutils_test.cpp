@@ -58,3 +58,50 @@ TEST_CASE("upsample result check", "[nnutils]") {
   REQUIRE(y_data[0][1][0] == Approx(0));
   REQUIRE(y_data[0][2][5] == Approx(2));
 }
+
+TEST_CASE("Batch norm folding", "[nnutils]") {
+  torch::manual_seed(3301);
+  torch::nn::Conv2d conv(torch::nn::Conv2dOptions(3, 8, 3));
+  torch::nn::BatchNorm bn(torch::nn::BatchNormOptions(8).eps(0.001));
+  {
+    torch::NoGradGuard no_grad;
+    bn->weight.uniform_(0.5, 1.5);
+    bn->bias.uniform_(-1, 1);
+    bn->running_mean.uniform_(-1, 1);
+    bn->running_variance.uniform_(0.5, 2);
+  }
+  bn->eval();
+
+  auto x = torch::randn({2, 3, 9, 9});
+  auto expected = bn->forward(conv->forward(x));
+  FoldBatchNorm(*conv, *bn);
+  REQUIRE(conv->forward(x).allclose(expected, 1e-4, 1e-5));
+  // The batch norm is left as the identity
+  REQUIRE(bn->forward(conv->forward(x)).allclose(expected, 1e-4, 1e-5));
+}
+
+TEST_CASE("Checkpoint forward gradients", "[nnutils]") {
+  torch::manual_seed(9017);
+  torch::nn::Sequential layers(
+      torch::nn::Conv2d(torch::nn::Conv2dOptions(2, 4, 3)),
+      torch::nn::Functional(torch::relu),
+      torch::nn::Conv2d(torch::nn::Conv2dOptions(4, 3, 1)));
+  auto input = torch::randn({2, 2, 7, 7}, at::requires_grad());
+
+  layers->forward(input).pow(2).sum().backward();
+  auto expected_input_grad = input.grad().clone();
+  std::vector<at::Tensor> expected_grads;
+  for (auto& param : layers->parameters()) {
+    expected_grads.push_back(param.grad().clone());
+    param.grad().zero_();
+  }
+  input.grad().zero_();
+
+  auto output = CheckpointForward(
+      [layers](at::Tensor x) { return layers->forward(x); }, input);
+  output.pow(2).sum().backward();
+  REQUIRE(input.grad().allclose(expected_input_grad));
+  auto params = layers->parameters();
+  for (size_t i = 0; i < params.size(); ++i)
+    REQUIRE(params[i].grad().allclose(expected_grads[i]));
+}
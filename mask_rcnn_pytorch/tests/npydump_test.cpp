@@ -0,0 +1,65 @@
+#include "catch.hpp"
+
+#include "../../npydump.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <string>
+#include <vector>
+
+namespace {
+std::string ReadFile(const std::string& file_name) {
+  std::ifstream file(file_name, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  std::remove(file_name.c_str());
+  return data;
+}
+}  // namespace
+
+TEST_CASE("Npy header is aligned and has the shape", "[npydump]") {
+  auto header = utils::NpyHeader("<f4", {2, 3});
+  REQUIRE(header.size() % 64 == 0);
+  REQUIRE(header.compare(0, 8, std::string("\x93NUMPY\x01\x00", 8)) == 0);
+  REQUIRE(static_cast<size_t>(static_cast<unsigned char>(header[8])) ==
+          header.size() - 10);
+  REQUIRE(header.back() == '\n');
+  REQUIRE(header.find("'descr': '<f4'") != std::string::npos);
+  REQUIRE(header.find("'shape': (2, 3)") != std::string::npos);
+  REQUIRE(utils::NpyHeader("<i8", {5}).find("'shape': (5,)") !=
+          std::string::npos);
+  REQUIRE(utils::NpyHeader("<f8", {}).find("'shape': ()") != std::string::npos);
+}
+
+TEST_CASE("Npy dumps have the row major values", "[npydump]") {
+  std::vector<float> values(6);
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = static_cast<float>(i);
+  // transposed, so the dump is [[0, 3], [1, 4], [2, 5]]
+  auto view = utils::MakeView(values.data(), {2, 3}).Permute({1, 0});
+  utils::DumpNpy("npydump_view.npy", view);
+  std::list<int32_t> list{7, 8, 9};
+  utils::DumpNpy("npydump_list.npy", list);
+  values.assign(values.size(), -1.f);  // the dumps have own copies
+  utils::FlushDumps();
+
+  auto view_file = ReadFile("npydump_view.npy");
+  auto header = utils::NpyHeader("<f4", {3, 2});
+  REQUIRE(view_file.size() == header.size() + 6 * sizeof(float));
+  REQUIRE(view_file.compare(0, header.size(), header) == 0);
+  std::vector<float> dumped(6);
+  std::memcpy(dumped.data(), view_file.data() + header.size(),
+              6 * sizeof(float));
+  REQUIRE(dumped == std::vector<float>{0, 3, 1, 4, 2, 5});
+
+  auto list_file = ReadFile("npydump_list.npy");
+  header = utils::NpyHeader("<i4", {3});
+  REQUIRE(list_file.size() == header.size() + 3 * sizeof(int32_t));
+  std::vector<int32_t> dumped_list(3);
+  std::memcpy(dumped_list.data(), list_file.data() + header.size(),
+              3 * sizeof(int32_t));
+  REQUIRE(dumped_list == std::vector<int32_t>{7, 8, 9});
+}
@@ -0,0 +1,88 @@
+#include "catch.hpp"
+
+#include "../imageutils.h"
+#include "../pastemasks.h"
+
+#include <opencv2/opencv.hpp>
+
+namespace {
+// The way masks were unmolded with OpenCV
+cv::Mat ReferencePaste(at::Tensor mask,
+                       int y1,
+                       int x1,
+                       int y2,
+                       int x2,
+                       const cv::Size& image_shape,
+                       double threshold) {
+  mask = mask.contiguous();
+  cv::Mat cv_mask(static_cast<int>(mask.size(0)),
+                  static_cast<int>(mask.size(1)), CV_32FC1, mask.data<float>());
+  cv::Mat resized;
+  cv::resize(cv_mask, resized, cv::Size(x2 - x1, y2 - y1), 0, 0,
+             cv::INTER_LINEAR);
+  cv::threshold(resized, resized, threshold, 255, cv::THRESH_BINARY);
+  cv::Mat full_mask = cv::Mat::zeros(image_shape, CV_32FC1);
+  resized.copyTo(full_mask(cv::Rect(x1, y1, x2 - x1, y2 - y1)));
+  full_mask.convertTo(full_mask, CV_8UC1);
+  return full_mask;
+}
+}  // namespace
+
+TEST_CASE("PasteMasks matches OpenCV resize", "[pastemasks]") {
+  torch::manual_seed(7345);
+  cv::Size image_shape(300, 200);
+  auto masks = torch::rand({3, 28, 28});
+  auto boxes = torch::tensor({10, 20, 110, 220,  //
+                              0, 0, 200, 300,    //
+                              50, 70, 53, 140})
+                   .view({3, 4})
+                   .to(at::kInt);
+  auto packed = PasteMasks(masks, boxes, image_shape.height, image_shape.width,
+                           0.5f);
+  REQUIRE(packed.size() == 3);
+  auto b = boxes.accessor<int32_t, 2>();
+  for (int64_t i = 0; i < 3; ++i) {
+    auto expected = ReferencePaste(masks[i], b[i][0], b[i][1], b[i][2],
+                                   b[i][3], image_shape, 0.5);
+    auto unpacked = UnpackMask(packed[static_cast<size_t>(i)], image_shape);
+    // OpenCV may use vectorized arithmetic, values right at the threshold
+    // can differ
+    auto area = (b[i][2] - b[i][0]) * (b[i][3] - b[i][1]);
+    REQUIRE(cv::countNonZero(unpacked != expected) <= area / 1000 + 1);
+  }
+}
+
+TEST_CASE("PasteMasks clips boxes and packs bits", "[pastemasks]") {
+  auto masks = torch::ones({1, 28, 28});
+  auto boxes = torch::tensor({-5, 30, 10, 120}).view({1, 4}).to(at::kInt);
+  auto packed = PasteMasks(masks, boxes, 50, 100, 0.5f);
+  REQUIRE(packed.size() == 1);
+  const auto& mask = packed[0];
+  REQUIRE(mask.y1 == 0);
+  REQUIRE(mask.x1 == 30);
+  REQUIRE(mask.height == 10);
+  REQUIRE(mask.width == 70);
+  REQUIRE(mask.words_per_row == 3);
+  REQUIRE(mask.Test(0, 30));
+  REQUIRE(mask.Test(9, 99));
+  REQUIRE(!mask.Test(10, 50));
+  REQUIRE(!mask.Test(5, 29));
+  REQUIRE(cv::countNonZero(UnpackMask(mask, cv::Size(100, 50))) == 700);
+}
+
+TEST_CASE("PackedMaskToRle matches EncodeRle", "[pastemasks]") {
+  torch::manual_seed(2934);
+  auto masks = torch::rand({3, 28, 28});
+  auto boxes = torch::tensor({3, 5, 40, 90,  //
+                              0, 0, 50, 100,  //
+                              20, 60, 21, 61})
+                   .view({3, 4})
+                   .to(at::kInt);
+  auto packed = PasteMasks(masks, boxes, 50, 100, 0.5f);
+  for (const auto& mask : packed) {
+    auto rle = PackedMaskToRle(mask, 50, 100);
+    REQUIRE(rle.height == 50);
+    REQUIRE(rle.width == 100);
+    REQUIRE(rle.counts == EncodeRle(UnpackMask(mask, cv::Size(100, 50))));
+  }
+}
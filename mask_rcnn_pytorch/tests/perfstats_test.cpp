@@ -0,0 +1,34 @@
+#include "catch.hpp"
+
+#include "../../perfstats.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+TEST_CASE("Perf report lines have the case and its metrics", "[perfstats]") {
+  const std::string file_name = "perfstats_test.jsonl";
+  std::remove(file_name.c_str());
+  {
+    utils::PerfReport report("suite", file_name);
+    report.Write("detect", {{"ms", 2.5}, {"allocations", 3}});
+    report.Write("train", {});
+  }
+  std::ifstream file(file_name);
+  std::string line;
+  REQUIRE(std::getline(file, line));
+  const std::string detect =
+      "{\"suite\":\"suite\",\"case\":\"detect\",\"ms\":2.5,\"allocations\":3,"
+      "\"peak_rss_mb\":";
+  REQUIRE(line.compare(0, detect.size(), detect) == 0);
+  REQUIRE(line.back() == '}');
+  REQUIRE(std::getline(file, line));
+  REQUIRE(line.find("\"case\":\"train\",\"peak_rss_mb\":") !=
+          std::string::npos);
+  REQUIRE_FALSE(std::getline(file, line));
+  std::remove(file_name.c_str());
+
+  REQUIRE(utils::PeakMemoryMb() > 0);
+  // operator new isn't replaced in the tests
+  REQUIRE(utils::AllocationCount() == 0);
+}
@@ -0,0 +1,48 @@
+#include "catch.hpp"
+
+#include "../proposalbudget.h"
+
+TEST_CASE("Proposal counts of the latency objective", "[proposalbudget]") {
+  Config config;
+  config.post_nms_rois_inference = 1000;
+  config.min_post_nms_rois_inference = 300;
+  REQUIRE(ProposalCounts(config) == std::vector<int64_t>{1000, 500, 300});
+  config.min_post_nms_rois_inference = 250;
+  REQUIRE(ProposalCounts(config) == std::vector<int64_t>{1000, 500, 250});
+  config.min_post_nms_rois_inference = 2000;
+  REQUIRE(ProposalCounts(config) == std::vector<int64_t>{1000});
+}
+
+TEST_CASE("Proposal budget follows the load", "[proposalbudget]") {
+  Config config;
+  config.post_nms_rois_inference = 1000;
+  config.min_post_nms_rois_inference = 250;
+  config.inference_latency_slo_ms = 100;
+  ProposalBudget budget(config);
+  REQUIRE(budget.Count() == 1000);
+
+  // Within the objective nothing changes
+  for (int i = 0; i < 100; ++i)
+    REQUIRE(budget.Update(80, 40, 0, 4) == 1000);
+
+  // Queued requests exceed the objective, the count goes down step by step
+  // and stops at the minimum
+  int64_t count = 1000;
+  for (int i = 0; i < 100; ++i) {
+    auto next = budget.Update(50, 40, 8, 4);
+    REQUIRE((next == count || next == count / 2));
+    count = next;
+  }
+  REQUIRE(count == 250);
+  // the first slow batch lowered the count at once
+  REQUIRE(budget.Batches()[0] == 101);
+
+  // Light load raises it again
+  for (int i = 0; i < 200; ++i)
+    count = budget.Update(20, 10, 0, 4);
+  REQUIRE(count == 1000);
+  size_t batches = 0;
+  for (auto n : budget.Batches())
+    batches += n;
+  REQUIRE(batches == 400);
+}
@@ -0,0 +1,56 @@
+#include "catch.hpp"
+
+#include "../quantization.h"
+#include "../stateloader.h"
+
+#include <experimental/filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+TEST_CASE("Weight quantization round trip", "[quantization]") {
+  torch::manual_seed(3301);
+  auto weight = torch::randn({8, 3, 3, 3});
+  weight[2].zero_();
+  auto quantized = QuantizeWeight(weight);
+  REQUIRE(quantized.values.scalar_type() == at::kChar);
+  REQUIRE(quantized.values.sizes() == weight.sizes());
+  REQUIRE(quantized.scales.sizes() == at::IntList({8}));
+  REQUIRE(quantized.scales[2].item<float>() == Approx(1));
+
+  auto restored = DequantizeWeight(quantized.values, quantized.scales);
+  auto error = (restored - weight).abs().view({8, -1});
+  auto bound = quantized.scales.unsqueeze(1) / 2 + 1e-6;
+  REQUIRE((error <= bound).all().item<uint8_t>() == 1);
+  REQUIRE(restored[2].abs().sum().item<float>() == 0);
+
+  REQUIRE(IsQuantizableWeight("fpn.C1.0.weight", weight));
+  REQUIRE_FALSE(IsQuantizableWeight("fpn.C1.1.weight", torch::ones({8})));
+  REQUIRE_FALSE(IsQuantizableWeight("fpn.C1.0.bias", weight));
+}
+
+TEST_CASE("Quantized state dict", "[quantization]") {
+  torch::manual_seed(3301);
+  torch::nn::Sequential model(
+      torch::nn::Conv2d(torch::nn::Conv2dOptions(3, 16, 3)),
+      torch::nn::BatchNorm(16), torch::nn::Linear(32, 4));
+  auto file_name = (fs::temp_directory_path() / "quantized_state.dat").string();
+  SaveStateDict(*model, file_name, /*quantize_weights*/ true);
+
+  torch::nn::Sequential loaded(
+      torch::nn::Conv2d(torch::nn::Conv2dOptions(3, 16, 3)),
+      torch::nn::BatchNorm(16), torch::nn::Linear(32, 4));
+  LoadStateDict(*loaded, file_name);
+  fs::remove(file_name);
+
+  auto params = model->named_parameters();
+  for (auto& param : loaded->named_parameters()) {
+    const auto& expected = *params.find(param.key());
+    if (IsQuantizableWeight(param.key(), expected)) {
+      auto quantized = QuantizeWeight(expected);
+      REQUIRE(param.value().equal(
+          DequantizeWeight(quantized.values, quantized.scales)));
+    } else {
+      REQUIRE(param.value().equal(expected));
+    }
+  }
+}
@@ -0,0 +1,77 @@
+#include "catch.hpp"
+
+#include "../roialign.h"
+
+#include <math.h>
+
+namespace {
+// Straightforward crop_and_resize of a single level used as reference
+at::Tensor ReferenceCrops(at::Tensor feature_map,
+                          at::Tensor boxes,
+                          int pool_size) {
+  const auto depth = feature_map.size(1);
+  const auto height = feature_map.size(2);
+  const auto width = feature_map.size(3);
+  auto crops = torch::zeros({boxes.size(0), depth, pool_size, pool_size});
+  auto f = feature_map.accessor<float, 4>();
+  auto b = boxes.accessor<float, 2>();
+  auto c = crops.accessor<float, 4>();
+  for (int64_t i = 0; i < boxes.size(0); ++i) {
+    for (int y = 0; y < pool_size; ++y) {
+      const float in_y =
+          b[i][0] * (height - 1) +
+          y * ((b[i][2] - b[i][0]) * (height - 1) / (pool_size - 1));
+      for (int x = 0; x < pool_size; ++x) {
+        const float in_x =
+            b[i][1] * (width - 1) +
+            x * ((b[i][3] - b[i][1]) * (width - 1) / (pool_size - 1));
+        if (in_y < 0 || in_y > height - 1 || in_x < 0 || in_x > width - 1)
+          continue;
+        const int top = floorf(in_y);
+        const int bottom = ceilf(in_y);
+        const int left = floorf(in_x);
+        const int right = ceilf(in_x);
+        const float y_lerp = in_y - top;
+        const float x_lerp = in_x - left;
+        for (int64_t d = 0; d < depth; ++d) {
+          const float t = f[0][d][top][left] +
+                          (f[0][d][top][right] - f[0][d][top][left]) * x_lerp;
+          const float s =
+              f[0][d][bottom][left] +
+              (f[0][d][bottom][right] - f[0][d][bottom][left]) * x_lerp;
+          c[i][d][y][x] = t + (s - t) * y_lerp;
+        }
+      }
+    }
+  }
+  return crops;
+}
+}  // namespace
+
+TEST_CASE("RoIAlign of the pool sizes", "[roialign]") {
+  torch::manual_seed(5);
+  std::vector<int32_t> image_shape{256, 256};
+  // the last boxes are partly outside of the image
+  auto boxes = torch::rand({40, 4}) * 0.7f;
+  boxes.narrow(1, 2, 2) += boxes.narrow(1, 0, 2) * 0.5f + 0.2f;
+  boxes.narrow(0, 30, 10) += 0.3f;
+  for (int depth : {256, 8}) {
+    // one level, so all boxes are cropped from it
+    auto feature_map = torch::rand({1, depth, 19, 23});
+    for (int pool_size : {7, 14, 5}) {
+      auto expected = ReferenceCrops(feature_map, boxes, pool_size);
+      auto pooled = PyramidRoiAlign({boxes, feature_map}, pool_size,
+                                    image_shape);
+      REQUIRE(pooled.sizes() == expected.sizes());
+      REQUIRE(pooled.allclose(expected, 1e-5, 1e-6));
+
+      auto channels_last = ToChannelsLast(feature_map);
+      REQUIRE(IsChannelsLast(channels_last));
+      REQUIRE(channels_last.sizes() == feature_map.sizes());
+      auto pooled_nhwc = PyramidRoiAlign({boxes, channels_last}, pool_size,
+                                         image_shape);
+      REQUIRE(pooled_nhwc.allclose(expected, 1e-5, 1e-6));
+    }
+  }
+  REQUIRE_FALSE(IsChannelsLast(torch::rand({1, 8, 4, 5})));
+}
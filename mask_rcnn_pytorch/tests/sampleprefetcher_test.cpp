@@ -0,0 +1,79 @@
+#include "catch.hpp"
+
+#include "../sampleprefetcher.h"
+
+#include <experimental/filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace fs = std::experimental::filesystem;
+
+TEST_CASE("Steps take samples of one shape", "[sampleprefetcher]") {
+  auto dir = fs::temp_directory_path() / "sampleprefetcher_test";
+  fs::create_directories(dir);
+  // Three images of one shape and two of the other one, so the last run of
+  // the first shape is filled up and the runs of both shapes are mixed
+  std::vector<std::pair<int, int>> sizes{
+      {64, 64}, {128, 64}, {64, 64}, {128, 64}, {64, 64}};
+  std::string images;
+  std::string annotations;
+  cv::RNG rng(1025);
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    auto id = std::to_string(i + 1);
+    auto name = id + ".jpg";
+    cv::Mat image(sizes[i].second, sizes[i].first, CV_8UC3);
+    rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+    cv::imwrite((dir / name).string(), image);
+    if (i > 0) {
+      images += ",";
+      annotations += ",";
+    }
+    images += "{\"id\":" + id + ",\"width\":" +
+              std::to_string(sizes[i].first) + ",\"height\":" +
+              std::to_string(sizes[i].second) + ",\"file_name\":\"" + name +
+              "\"}";
+    annotations += "{\"id\":" + id + ",\"image_id\":" + id +
+                   ",\"category_id\":1,\"iscrowd\":0,"
+                   "\"bbox\":[8,8,16,16],"
+                   "\"segmentation\":[[8,8,24,8,24,24,8,24]]}";
+  }
+  auto ann_file = (dir / "annotations.json").string();
+  std::ofstream(ann_file) << "{\"images\":[" << images
+                          << "],\"annotations\":[" << annotations
+                          << "],\"categories\":[{\"id\":1,\"name\":\"box\"}]}";
+
+  auto config = std::make_shared<Config>();
+  config->gpu_count = 0;
+  config->images_per_gpu = 2;
+  config->num_classes = 2;
+  config->image_min_dim = 64;
+  config->image_max_dim = 128;
+  config->image_padding = false;
+  config->UpdateSettings();
+  auto loader = std::make_shared<CocoLoader>(dir.string(), ann_file);
+  loader->LoadData({"BG", "box"});
+  CocoDataset dataset(loader, config);
+  auto groups = dataset.ShapeGroups();
+  REQUIRE(std::set<uint32_t>(groups.begin(), groups.end()).size() == 2);
+
+  {
+    // More workers than runs in the queue, so they finish out of order
+    SamplePrefetcher prefetcher(dataset, /*workers_num*/ 4,
+                                /*queue_size*/ 1, /*to_gpu*/ false,
+                                /*device_index*/ 0, /*shard_index*/ 0,
+                                /*shards_num*/ 1, config->images_per_gpu);
+    std::set<int64_t> widths;
+    for (int step = 0; step < 20; ++step) {
+      std::vector<at::Tensor> step_images;
+      for (uint32_t i = 0; i < config->images_per_gpu; ++i)
+        step_images.push_back(prefetcher.Next().data.image);
+      REQUIRE(step_images[0].sizes() == step_images[1].sizes());
+      REQUIRE_NOTHROW(torch::cat(step_images, /*dim*/ 0));
+      widths.insert(step_images[0].size(-1));
+    }
+    REQUIRE(widths == std::set<int64_t>{64, 128});
+  }
+  fs::remove_all(dir);
+}
@@ -0,0 +1,98 @@
+#include "catch.hpp"
+
+#include "../shardfile.h"
+#include "../shardstream.h"
+
+#include <experimental/filesystem>
+#include <map>
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+ShardRecord MakeRecord(uint32_t id) {
+  ShardRecord record;
+  record.image_id = id;
+  record.width = 4;
+  record.height = 3;
+  record.image.assign(id + 1, static_cast<uint8_t>(id));
+  for (uint32_t i = 0; i < id % 3; ++i) {
+    CocoBBox bbox;
+    bbox.x = static_cast<int32_t>(i);
+    bbox.width = 2;
+    bbox.height = 1;
+    record.boxes.push_back(bbox);
+    record.classes.push_back(static_cast<int32_t>(id + i));
+    record.masks.push_back({i, 2, 12 - 2 - i});
+  }
+  return record;
+}
+}  // namespace
+
+TEST_CASE("Shard records", "[shardfile]") {
+  auto file_name =
+      (fs::temp_directory_path() / "shardfile_test.shard").string();
+  {
+    ShardWriter writer(file_name);
+    for (uint32_t id = 0; id < 5; ++id)
+      writer.Write(MakeRecord(id));
+    REQUIRE(writer.RecordsCount() == 5);
+  }
+
+  ShardReader reader(file_name);
+  ShardRecord record;
+  for (uint32_t id = 0; id < 5; ++id) {
+    REQUIRE(reader.Next(record));
+    auto expected = MakeRecord(id);
+    REQUIRE(record.image_id == id);
+    REQUIRE(record.width == expected.width);
+    REQUIRE(record.height == expected.height);
+    REQUIRE(record.image == expected.image);
+    REQUIRE(record.boxes.size() == expected.boxes.size());
+    for (size_t i = 0; i < record.boxes.size(); ++i) {
+      REQUIRE(record.boxes[i].x == expected.boxes[i].x);
+      REQUIRE(record.boxes[i].width == expected.boxes[i].width);
+    }
+    REQUIRE(record.classes == expected.classes);
+    REQUIRE(record.masks == expected.masks);
+  }
+  REQUIRE_FALSE(reader.Next(record));
+  fs::remove(file_name);
+}
+
+TEST_CASE("Shard stream", "[shardfile]") {
+  auto dir = fs::temp_directory_path();
+  std::vector<std::string> files;
+  for (uint32_t shard = 0; shard < 4; ++shard) {
+    files.push_back(
+        (dir / ("shardstream_test_" + std::to_string(shard) + ".shard"))
+            .string());
+    ShardWriter writer(files.back());
+    for (uint32_t i = 0; i < 3; ++i)
+      writer.Write(MakeRecord(shard * 3 + i));
+  }
+
+  SECTION("Every record of a pass") {
+    // Records are read in passes over the shards, the buffer of two records
+    // can't hold all copies of a record of three passes
+    ShardStream stream(files, 1, 1);
+    std::map<uint32_t, uint32_t> counts;
+    for (uint32_t i = 0; i < 36; ++i)
+      ++counts[stream.Next().image_id];
+    REQUIRE(counts.size() == 12);
+    for (const auto& count : counts)
+      REQUIRE(count.second <= 4);
+  }
+
+  SECTION("Split of shards") {
+    // Second of two parts reads the shards 1 and 3
+    ShardStream stream(files, 2, 1, 1, 2);
+    for (uint32_t i = 0; i < 20; ++i) {
+      auto shard = stream.Next().image_id / 3;
+      REQUIRE((shard == 1 || shard == 3));
+    }
+  }
+
+  REQUIRE_THROWS(ShardStream(files, 2, 1, 4, 5));
+  for (const auto& file : files)
+    fs::remove(file);
+}
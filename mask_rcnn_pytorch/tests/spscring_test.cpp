@@ -0,0 +1,52 @@
+#include "catch.hpp"
+
+#include "../spscring.h"
+
+#include <thread>
+
+TEST_CASE("SPSC ring keeps order and capacity", "[spscring]") {
+  SpscRing<int> ring(3);
+  REQUIRE(ring.Capacity() == 3);
+  int value = 0;
+  REQUIRE(!ring.Pop(value));
+
+  REQUIRE(ring.Push(1));
+  REQUIRE(ring.Push(2));
+  REQUIRE(ring.Push(3));
+  REQUIRE(!ring.Push(4));
+
+  REQUIRE(ring.Pop(value));
+  REQUIRE(value == 1);
+  // Freed slot is reused after the wrap around
+  REQUIRE(ring.Push(4));
+  for (int expected = 2; expected <= 4; ++expected) {
+    REQUIRE(ring.Pop(value));
+    REQUIRE(value == expected);
+  }
+  REQUIRE(!ring.Pop(value));
+}
+
+TEST_CASE("SPSC ring passes values between threads", "[spscring]") {
+  const int count = 100000;
+  SpscRing<int> ring(64);
+  std::thread producer([&ring]() {
+    for (int i = 0; i < count; ++i) {
+      while (!ring.Push(i))
+        std::this_thread::yield();
+    }
+  });
+
+  bool ordered = true;
+  int expected = 0;
+  while (expected < count) {
+    int value = 0;
+    if (ring.Pop(value)) {
+      ordered = ordered && value == expected;
+      ++expected;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  REQUIRE(ordered);
+}
@@ -0,0 +1,28 @@
+#include "catch.hpp"
+
+#include "../stageprofiler.h"
+
+#include <thread>
+
+TEST_CASE("Stage profiler percentiles", "[stageprofiler]") {
+  StageProfiler profiler(/*use_cuda*/ false);
+  for (int i = 1; i <= 20; ++i) {
+    StageProfiler::Scope scope(&profiler, "outer", /*on_gpu*/ false);
+    StageProfiler::Scope inner(&profiler, "inner", /*on_gpu*/ false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(i % 2 ? 1 : 5));
+  }
+  { StageProfiler::Scope scope(nullptr, "ignored"); }
+
+  auto stats = profiler.Stats();
+  REQUIRE(stats.size() == 2);
+  for (auto& stat : stats) {
+    REQUIRE(stat.count == 20);
+    REQUIRE(stat.p50_ms >= 1);
+    REQUIRE(stat.p50_ms <= stat.p95_ms);
+    REQUIRE(stat.p95_ms <= stat.p99_ms);
+    REQUIRE(stat.p99_ms >= 5);
+  }
+
+  profiler.Reset();
+  REQUIRE(profiler.Stats().empty());
+}
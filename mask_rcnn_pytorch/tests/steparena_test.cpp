@@ -0,0 +1,28 @@
+#include "catch.hpp"
+
+#include "../steparena.h"
+
+TEST_CASE("Step arena reuses buffers", "[steparena]") {
+  StepArena arena(at::kCPU);
+  arena.Reserve("boxes", {100, 4}, at::kFloat);
+  REQUIRE(arena.ReservedBytes() == 100 * 4 * 4);
+
+  auto first = arena.Get("boxes", {50, 4}, at::kFloat);
+  REQUIRE(first.sizes() == at::IntList({50, 4}));
+  REQUIRE(first.is_contiguous());
+  auto second = arena.Get("boxes", {100, 4}, at::kFloat);
+  REQUIRE(second.data<float>() == first.data<float>());
+  REQUIRE(arena.GrowCount() == 0);
+
+  // Larger tensors and other types reallocate the buffer
+  auto larger = arena.Get("boxes", {200, 4}, at::kFloat);
+  REQUIRE(larger.numel() == 800);
+  REQUIRE(arena.GrowCount() == 1);
+  REQUIRE(arena.ReservedBytes() == 200 * 4 * 4);
+  arena.Get("boxes", {10}, at::kInt);
+  REQUIRE(arena.GrowCount() == 2);
+
+  // Buffers which were not reserved are allocated on the first use
+  arena.Get("ids", {10}, at::kLong);
+  REQUIRE(arena.GrowCount() == 2);
+}
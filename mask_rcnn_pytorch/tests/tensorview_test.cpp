@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include "../../tensorview.h"
+
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+TEST_CASE("Interleaved BGR is copied to RGB planes", "[tensorview]") {
+  const int rows = 3;
+  const int cols = 5;
+  std::vector<uint8_t> image(rows * cols * 3);
+  std::iota(image.begin(), image.end(), 0);
+  // [rows, cols, channels] -> [channels, rows, cols] with reversed channels
+  auto src = utils::MakeView(image.data(), {rows, cols, 3})
+                 .Reverse(2)
+                 .Permute({2, 0, 1});
+  std::vector<float> planes(image.size());
+  utils::CopyView(src, utils::MakeView(planes.data(), {3, rows, cols}));
+  bool same = true;
+  for (int c = 0; c < 3; ++c) {
+    for (int y = 0; y < rows; ++y) {
+      for (int x = 0; x < cols; ++x) {
+        same = same && planes[(c * rows + y) * cols + x] ==
+                           image[(y * cols + x) * 3 + (2 - c)];
+      }
+    }
+  }
+  REQUIRE(same);
+}
+
+TEST_CASE("Dense views are used in place", "[tensorview]") {
+  std::vector<float> data(24);
+  std::iota(data.begin(), data.end(), 0.f);
+  std::vector<float> buffer;
+  auto view = utils::MakeView(data.data(), {2, 3, 4});
+  REQUIRE(view.dense());
+  REQUIRE(utils::DenseData(view, buffer) == data.data());
+  REQUIRE(buffer.empty());
+
+  // the middle rows of every matrix
+  auto slice = view.Slice(1, 1, 3);
+  REQUIRE(!slice.dense());
+  auto dense = utils::DenseData(slice, buffer);
+  REQUIRE(buffer.size() == 16);
+  REQUIRE(dense[0] == 4.f);
+  REQUIRE(dense[7] == 11.f);
+  REQUIRE(dense[8] == 16.f);
+  REQUIRE(dense[15] == 23.f);
+}
+
+TEST_CASE("Transposed copy matches the elements", "[tensorview]") {
+  std::vector<double> data(6 * 7);
+  std::iota(data.begin(), data.end(), 0.);
+  std::vector<double> transposed(data.size());
+  utils::CopyView(utils::MakeView(data.data(), {6, 7}).Permute({1, 0}),
+                  utils::MakeView(transposed.data(), {7, 6}));
+  REQUIRE(transposed[1] == 7.);
+  REQUIRE(transposed[6] == 1.);
+  REQUIRE(transposed[41] == 41.);
+  REQUIRE_THROWS_AS(utils::CopyView(utils::MakeView(data.data(), {6, 7}),
+                                    utils::MakeView(transposed.data(), {7, 6})),
+                    std::invalid_argument);
+}
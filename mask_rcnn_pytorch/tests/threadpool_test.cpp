@@ -0,0 +1,61 @@
+#include "catch.hpp"
+
+#include "../../threadpool.h"
+
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+TEST_CASE("Thread pool runs every index once", "[threadpool]") {
+  utils::ThreadPool pool(3);
+  std::vector<std::atomic<int>> calls(1000);
+  for (auto& call : calls)
+    call = 0;
+  pool.ParallelFor(0, calls.size(), [&](size_t i) { ++calls[i]; }, 7);
+  bool once = true;
+  for (auto& call : calls)
+    once = once && call == 1;
+  REQUIRE(once);
+}
+
+TEST_CASE("Thread pool nested loops don't block", "[threadpool]") {
+  utils::ThreadPool pool(2);
+  std::atomic<size_t> sum{0};
+  pool.ParallelFor(0, 8, [&](size_t i) {
+    pool.ParallelFor(0, 100, [&](size_t j) { sum += i * 100 + j; });
+  });
+  REQUIRE(sum == 799 * 800 / 2);
+}
+
+TEST_CASE("Thread pool futures pass values and errors", "[threadpool]") {
+  utils::ThreadPool pool(0);  // the waiting thread runs the tasks
+  auto value = pool.Submit([]() { return 42; });
+  auto error = pool.Submit([]() -> int { throw std::runtime_error("task"); });
+  REQUIRE(pool.Wait(value) == 42);
+  REQUIRE_THROWS_AS(pool.Wait(error), std::runtime_error);
+  REQUIRE_THROWS_AS(pool.ParallelFor(0, 10,
+                                     [](size_t i) {
+                                       if (i == 5)
+                                         throw std::runtime_error("index");
+                                     }),
+                    std::runtime_error);
+}
+
+TEST_CASE("Scratch arena reuses the memory of a scope", "[threadpool]") {
+  utils::ScratchArena arena;
+  float* first = nullptr;
+  {
+    utils::ScratchArena::Scope scope(arena);
+    first = arena.Allocate<float>(1000);
+    std::iota(first, first + 1000, 0.f);
+    auto* second = arena.Allocate<double>(1 << 20);  // a new block
+    REQUIRE(reinterpret_cast<size_t>(second) % alignof(double) == 0);
+    REQUIRE(first[999] == 999.f);
+  }
+  auto reserved = arena.reserved();
+  utils::ScratchArena::Scope scope(arena);
+  REQUIRE(arena.Allocate<float>(1000) == first);
+  arena.Allocate<double>(1 << 20);
+  REQUIRE(arena.reserved() == reserved);
+}
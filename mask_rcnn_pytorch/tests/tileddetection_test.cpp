@@ -0,0 +1,78 @@
+#include "catch.hpp"
+
+#include "../tileddetection.h"
+
+namespace {
+// Detects the box of bright pixels in every image
+class BrightBoxBackend : public DetectionBackend {
+ public:
+  explicit BrightBoxBackend(const Config& config) : config_(config) {}
+
+  std::tuple<at::Tensor, at::Tensor> Detect(
+      at::Tensor images,
+      const std::vector<ImageMeta>& /*image_metas*/) override {
+    const auto batch = images.size(0);
+    auto detections = torch::zeros({batch, 1, 6});
+    for (int64_t i = 0; i < batch; ++i) {
+      auto pixels = (images[i][0] > 0).nonzero();
+      if (pixels.size(0) == 0)
+        continue;
+      auto min = std::get<0>(pixels.min(/*dim*/ 0)).to(at::kFloat);
+      auto max = std::get<0>(pixels.max(/*dim*/ 0)).to(at::kFloat) + 1;
+      detections[i][0].narrow(0, 0, 2).copy_(min);
+      detections[i][0].narrow(0, 2, 2).copy_(max);
+      detections[i][0][4] = 1;
+      detections[i][0][5] = 0.9f;
+    }
+    auto masks = torch::ones({batch, 1, config_.mask_shape[0],
+                              config_.mask_shape[1],
+                              static_cast<int64_t>(config_.num_classes)});
+    return {detections, masks};
+  }
+
+ private:
+  const Config& config_;
+};
+}  // namespace
+
+TEST_CASE("Image tiles", "[tileddetection]") {
+  auto tiles = ImageTiles(cv::Size(250, 100), cv::Size(100, 100), 20);
+  std::vector<cv::Rect> expected{cv::Rect(0, 0, 100, 100),
+                                 cv::Rect(80, 0, 100, 100),
+                                 cv::Rect(150, 0, 100, 100)};
+  REQUIRE(tiles == expected);
+
+  // Images smaller than the tile are one tile
+  tiles = ImageTiles(cv::Size(60, 40), cv::Size(100, 100), 20);
+  REQUIRE(tiles == std::vector<cv::Rect>{cv::Rect(0, 0, 60, 40)});
+
+  REQUIRE_THROWS(ImageTiles(cv::Size(250, 100), cv::Size(100, 100), 100));
+}
+
+TEST_CASE("Tiled detection merges tiles", "[tileddetection]") {
+  Config config;
+  config.gpu_count = 0;
+  config.images_per_gpu = 3;
+  config.num_classes = 2;
+  config.image_min_dim = 64;
+  config.image_max_dim = 64;
+  config.UpdateSettings();
+
+  // The object is in the overlap of all four tiles
+  cv::Mat image = cv::Mat::zeros(100, 100, CV_8UC3);
+  cv::rectangle(image, cv::Rect(40, 40, 20, 20), cv::Scalar::all(255),
+                cv::FILLED);
+  BrightBoxBackend backend(config);
+  auto [boxes, class_ids, scores, masks] =
+      DetectTiled(backend, image, config, /*overlap*/ 28,
+                  /*mask_threshold*/ 0.5);
+  REQUIRE(boxes.size(0) == 1);
+  REQUIRE(boxes[0].equal(torch::tensor({40, 40, 60, 60})));
+  REQUIRE(class_ids.view({-1}).equal(
+      torch::tensor({1}, at::dtype(at::kLong))));
+  REQUIRE(masks.size() == 1);
+  REQUIRE(masks[0].y1 == 40);
+  REQUIRE(masks[0].x1 == 40);
+  REQUIRE(masks[0].height == 20);
+  REQUIRE(masks[0].width == 20);
+}
@@ -0,0 +1,65 @@
+#include "catch.hpp"
+
+#ifndef WITH_TRACE
+#define WITH_TRACE
+#endif
+#include "../../trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace {
+std::string WriteAndRead() {
+  const std::string file_name = "trace_test.json";
+  REQUIRE(utils::trace::WriteTrace(file_name));
+  std::ifstream file(file_name);
+  std::stringstream text;
+  text << file.rdbuf();
+  std::remove(file_name.c_str());
+  return text.str();
+}
+
+size_t Count(const std::string& text, const std::string& pattern) {
+  size_t count = 0;
+  for (auto pos = text.find(pattern); pos != std::string::npos;
+       pos = text.find(pattern, pos + pattern.size()))
+    ++count;
+  return count;
+}
+}  // namespace
+
+TEST_CASE("Trace records the zones of the threads", "[trace]") {
+  utils::trace::Enable(true);
+  WriteAndRead();  // drops the events of the other tests
+  {
+    MLCPP_TRACE_ZONE("test_outer");
+    MLCPP_TRACE_ZONE("test_inner");
+    MLCPP_TRACE_COUNTER("test_queue", 3);
+  }
+  std::thread worker([]() {
+    MLCPP_TRACE_THREAD("test_worker");
+    for (int i = 0; i < 10000; ++i) {  // a few chunks
+      MLCPP_TRACE_ZONE("test_worker_zone");
+    }
+  });
+  worker.join();
+  utils::trace::Enable(false);
+  { MLCPP_TRACE_ZONE("test_disabled"); }
+
+  auto trace = WriteAndRead();
+  REQUIRE(trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+  REQUIRE(Count(trace, "\"name\":\"test_outer\",\"ph\":\"X\"") == 1);
+  REQUIRE(Count(trace, "\"name\":\"test_inner\",\"ph\":\"X\"") == 1);
+  REQUIRE(Count(trace, "\"name\":\"test_queue\",\"ph\":\"C\"") == 1);
+  REQUIRE(Count(trace, "\"args\":{\"value\":3}") == 1);
+  REQUIRE(Count(trace, "\"name\":\"test_worker_zone\"") == 10000);
+  REQUIRE(Count(trace, "\"args\":{\"name\":\"test_worker\"}") == 1);
+  REQUIRE(Count(trace, "test_disabled") == 0);
+
+  // the events are written once and the finished thread is forgotten
+  auto next = WriteAndRead();
+  REQUIRE(Count(next, "test_") == 0);
+}
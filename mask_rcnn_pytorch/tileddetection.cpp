@@ -0,0 +1,176 @@
+#include "tileddetection.h"
+#include "imageutils.h"
+#include "nms.h"
+#include "nnutils.h"
+
+#include <ATen/cuda/CUDAContext.h>
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+
+namespace {
+// Start coordinates of the tiles along the axis
+std::vector<int32_t> AxisTiles(int32_t size, int32_t tile, int32_t overlap) {
+  if (size <= tile)
+    return {0};
+  std::vector<int32_t> starts;
+  for (int32_t start = 0; start + tile < size; start += tile - overlap)
+    starts.push_back(start);
+  starts.push_back(size - tile);
+  return starts;
+}
+
+// Network outputs of a tile batch which aren't unmolded yet
+struct TileBatch {
+  std::vector<cv::Rect> tiles;
+  std::vector<Window> windows;
+  at::Tensor detections;
+  at::Tensor mrcnn_mask;
+  size_t stream{0};
+};
+
+struct ImageDetections {
+  std::vector<at::Tensor> boxes;
+  std::vector<at::Tensor> class_ids;
+  std::vector<at::Tensor> scores;
+  std::vector<PackedMask> masks;
+};
+
+// Unmolds detections of the tiles and moves them to the image coordinates
+void UnmoldTiles(const TileBatch& batch,
+                 double mask_threshold,
+                 ImageDetections& result) {
+  if (is_empty(batch.detections))
+    return;
+  for (size_t i = 0; i < batch.tiles.size(); ++i) {
+    const auto& tile = batch.tiles[i];
+    auto n = static_cast<int64_t>(i);
+    auto [boxes, class_ids, scores, masks] = UnmoldDetectionsPacked(
+        batch.detections[n], batch.mrcnn_mask[n], tile.size(),
+        batch.windows[i], mask_threshold);
+    if (is_empty(boxes))
+      continue;
+    auto shift = torch::tensor({tile.y, tile.x, tile.y, tile.x});
+    result.boxes.push_back(boxes + shift);
+    result.class_ids.push_back(class_ids);
+    result.scores.push_back(scores);
+    for (auto& mask : masks) {
+      mask.y1 += tile.y;
+      mask.x1 += tile.x;
+      result.masks.push_back(std::move(mask));
+    }
+  }
+}
+
+// Per class NMS of the detections of all tiles, kept ones are sorted by
+// score
+std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<PackedMask>>
+MergeTiles(ImageDetections detections, float nms_threshold) {
+  if (detections.boxes.empty()) {
+    return {torch::empty({}, at::dtype(at::kInt)),
+            torch::empty({}, at::dtype(at::kLong)),
+            torch::empty({}, at::dtype(at::kFloat)),
+            {}};
+  }
+  auto boxes = torch::cat(detections.boxes);
+  auto class_ids = torch::cat(detections.class_ids);
+  auto scores = torch::cat(detections.scores);
+  auto dets = torch::cat(
+      {boxes.to(at::kFloat), class_ids.to(at::kFloat), scores}, /*dim*/ 1);
+  auto keep = GroupNms(dets, nms_threshold).nonzero().view({-1});
+  auto order = std::get<1>(scores.index_select(0, keep)
+                               .view({-1})
+                               .sort(/*dim*/ 0, /*descending*/ true));
+  keep = keep.index_select(0, order);
+
+  std::vector<PackedMask> masks;
+  if (!detections.masks.empty()) {
+    const auto* keep_data = keep.data<int64_t>();
+    for (int64_t i = 0; i < keep.size(0); ++i)
+      masks.push_back(
+          std::move(detections.masks[static_cast<size_t>(keep_data[i])]));
+  }
+  return {boxes.index_select(0, keep), class_ids.index_select(0, keep),
+          scores.index_select(0, keep), std::move(masks)};
+}
+}  // namespace
+
+std::vector<cv::Rect> ImageTiles(const cv::Size& image_size,
+                                 const cv::Size& tile_size,
+                                 int32_t overlap) {
+  if (overlap < 0 || overlap >= std::min(tile_size.width, tile_size.height))
+    throw std::invalid_argument("Tile overlap has to be less than the tile");
+  auto rows = AxisTiles(image_size.height, tile_size.height, overlap);
+  auto cols = AxisTiles(image_size.width, tile_size.width, overlap);
+  std::vector<cv::Rect> tiles;
+  for (auto y : rows) {
+    for (auto x : cols) {
+      tiles.emplace_back(x, y, std::min(tile_size.width, image_size.width),
+                         std::min(tile_size.height, image_size.height));
+    }
+  }
+  return tiles;
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<PackedMask>>
+DetectTiled(DetectionBackend& backend,
+            const cv::Mat& image,
+            const Config& config,
+            int32_t overlap,
+            double mask_threshold,
+            uint32_t streams_num) {
+  auto tiles = ImageTiles(
+      image.size(), cv::Size(config.image_shape[1], config.image_shape[0]),
+      overlap);
+
+  std::vector<at::cuda::CUDAStream> streams;
+  if (config.gpu_count > 0) {
+    for (uint32_t i = 0; i < streams_num; ++i)
+      streams.push_back(at::cuda::getStreamFromPool());
+  }
+  std::optional<StreamGuard> stream_guard;
+
+  ImageDetections detections;
+  std::optional<TileBatch> pending;
+  const auto batch_size = static_cast<size_t>(config.images_per_gpu);
+  for (size_t first = 0; first < tiles.size(); first += batch_size) {
+    TileBatch batch;
+    std::vector<cv::Mat> images;
+    for (size_t i = first; i < std::min(first + batch_size, tiles.size());
+         ++i) {
+      batch.tiles.push_back(tiles[i]);
+      images.push_back(image(tiles[i]));
+    }
+    // Partial batches are filled with copies of the last tile, so the model
+    // always runs with the warmed up shapes
+    while (images.size() < batch_size)
+      images.push_back(images.back());
+
+    // The batch is queued on its stream while the previous one may still
+    // run on the other
+    if (!streams.empty()) {
+      batch.stream = (first / batch_size) % streams.size();
+      stream_guard.emplace(streams[batch.stream]);
+    }
+    auto [molded_images, image_metas, windows] = MoldInputs(images, config);
+    batch.windows = std::move(windows);
+    std::tie(batch.detections, batch.mrcnn_mask) =
+        backend.Detect(molded_images, image_metas);
+
+    if (pending) {
+      if (!streams.empty())
+        stream_guard.emplace(streams[pending->stream]);
+      UnmoldTiles(*pending, mask_threshold, detections);
+    }
+    pending = std::move(batch);
+  }
+  if (pending) {
+    if (!streams.empty())
+      stream_guard.emplace(streams[pending->stream]);
+    UnmoldTiles(*pending, mask_threshold, detections);
+  }
+  stream_guard.reset();
+
+  return MergeTiles(std::move(detections), config.detection_nms_threshold);
+}
@@ -0,0 +1,42 @@
+#ifndef TILEDDETECTION_H
+#define TILEDDETECTION_H
+
+#include "config.h"
+#include "detectionbackend.h"
+#include "pastemasks.h"
+
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include <tuple>
+#include <vector>
+
+/* Tiles of tile_size covering the image, neighbour tiles overlap by at least
+ * overlap pixels. Last tiles of a row and a column are moved back to the
+ * image edge, so all tiles have the same size; an axis shorter than the
+ * tile is one tile of the axis length.
+ */
+std::vector<cv::Rect> ImageTiles(const cv::Size& image_size,
+                                 const cv::Size& tile_size,
+                                 int32_t overlap);
+
+/* Detects objects in an image larger than the network input without
+ * downscaling it. The image is split to overlapping tiles of the input size
+ * Config::image_shape, the tiles are detected in batches of
+ * Config::images_per_gpu, and detections are shifted back to the image and
+ * merged with per class NMS of Config::detection_nms_threshold, so objects
+ * in the overlaps are kept once. On the GPU tile batches alternate between
+ * streams_num CUDA streams: the next batch is molded and queued before the
+ * previous one is unmolded.
+ * Returns the same as UnmoldDetectionsPacked for the whole image, sorted by
+ * score.
+ */
+std::tuple<at::Tensor, at::Tensor, at::Tensor, std::vector<PackedMask>>
+DetectTiled(DetectionBackend& backend,
+            const cv::Mat& image,
+            const Config& config,
+            int32_t overlap,
+            double mask_threshold,
+            uint32_t streams_num = 2);
+
+#endif  // TILEDDETECTION_H
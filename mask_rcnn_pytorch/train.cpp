@@ -1,17 +1,25 @@
+#include "../autotune.h"
 #include "cocodataset.h"
 #include "cocoloader.h"
 #include "config.h"
 #include "debug.h"
 #include "imageutils.h"
 #include "maskrcnn.h"
+#include "shardfile.h"
 #include "stateloader.h"
 
+#include <ATen/Parallel.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <THC/THCCachingAllocator.h>
 #include <torch/torch.h>
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
 #include <experimental/filesystem>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <thread>
 
 namespace fs = std::experimental::filesystem;
 
@@ -28,10 +36,100 @@ class TrainConfig : public Config {
   }
 };
 
+// Images per second and the memory of the training with the settings of the
+// config, see MaskRCNNImpl::MeasureTraining
+using TrainMeasure = std::function<std::tuple<double, MemoryStat>()>;
+
+// High watermark of the caching allocator on the GPUs of the config, it
+// can't be reset, see utils::TuneTrial
+int64_t PeakAllocated(const Config& config) {
+  int64_t peak = 0;
+  for (uint32_t d = 0; d < config.gpu_count; ++d)
+    peak += static_cast<int64_t>(
+        THCCachingAllocator_maxMemoryAllocated(static_cast<int>(d)));
+  return peak;
+}
+
+void ApplyTuneSettings(const utils::TuneSettings& settings,
+                       TrainConfig& config) {
+  for (const auto& setting : settings) {
+    if (setting.first == "data_workers_num")
+      config.data_workers_num = setting.second;
+    else if (setting.first == "data_prefetch_size")
+      config.data_prefetch_size = setting.second;
+    else if (setting.first == "images_per_gpu")
+      config.images_per_gpu = setting.second;
+    else if (setting.first == "torch_threads")
+      at::set_num_threads(static_cast<int>(setting.second));
+  }
+  config.UpdateSettings();
+}
+
+// The loader workers, the prefetch depth, the split of the cores between the
+// loaders and the torch threads and, with tune_batch, the images per GPU are
+// tuned with short training runs. The best settings of the host are saved to
+// the host file in model_dir and are taken from it by the next runs, unless
+// retune is set.
+void TuneTraining(TrainConfig& config,
+                  const TrainMeasure& measure,
+                  const std::string& model_dir,
+                  bool tune_batch,
+                  bool retune) {
+  std::string signature = "mask_rcnn_pytorch_train gpus=" +
+                          std::to_string(config.gpu_count) +
+                          " shape=" + std::to_string(config.image_shape[0]) +
+                          "x" + std::to_string(config.image_shape[1]) +
+                          " mixed=" + std::to_string(config.mixed_precision);
+  if (!tune_batch)
+    signature += " images_per_gpu=" + std::to_string(config.images_per_gpu);
+  const auto cores = std::max(std::thread::hardware_concurrency(), 1u);
+  // the batch is tuned first, the loaders have to keep up with it
+  std::vector<utils::TuneKnob> knobs;
+  if (tune_batch)
+    knobs.push_back({"images_per_gpu", utils::TuneCandidates({1, 2, 4, 8}, 8)});
+  knobs.push_back(
+      {"data_workers_num", utils::TuneCandidates({1, 2, 4, 8, 16}, cores)});
+  knobs.push_back(
+      {"data_prefetch_size", utils::TuneCandidates({2, 4, 8, 16, 32}, 32)});
+  knobs.push_back(
+      {"torch_threads",
+       utils::TuneCandidates({1, cores / 4, cores / 2, cores}, cores)});
+  // Peaks of the caching allocator don't go down, so a trial is only over the
+  // limit when it raised the peak over it
+  const auto memory_limit = static_cast<int64_t>(
+      config.autotune_memory_fraction * config.gpu_count *
+      static_cast<double>(at::cuda::getDeviceProperties(0)->totalGlobalMem));
+  utils::AutoTuner tuner(knobs, memory_limit);
+
+  utils::TuneSettings start{
+      {"data_workers_num", config.data_workers_num},
+      {"data_prefetch_size", config.data_prefetch_size},
+      {"torch_threads", static_cast<uint32_t>(at::get_num_threads())}};
+  if (tune_batch)
+    start["images_per_gpu"] = config.images_per_gpu;
+  auto settings = utils::LoadOrTune(
+      utils::TuneFile(model_dir), signature, retune, tuner, start,
+      [&](const utils::TuneSettings& trial_settings) {
+        ApplyTuneSettings(trial_settings, config);
+        utils::TuneTrial trial;
+        trial.memory_before = PeakAllocated(config);
+        auto [rate, memory] = measure();
+        trial.rate = rate;
+        trial.memory = memory.peak_allocated;
+        return trial;
+      });
+  ApplyTuneSettings(settings, config);
+}
+
 const cv::String keys =
     "{help h usage ? |      | print this message   }"
     "{@data_dir      |<none>| path to coco dataset root folder}"
-    "{@params        |<none>| path to trained parameters }";
+    "{@params        |<none>| path to trained parameters }"
+    "{resume r       |      | checkpoint to load over the parameters }"
+    "{shards         |      | directory of train set shards, made if empty }"
+    "{autotune       |      | tune the loader and thread settings first }"
+    "{autotune-batch |      | tune the images per GPU too }"
+    "{retune         |      | tune again instead of the saved settings }";
 
 int main(int argc, char** argv) {
 #ifndef NDEBUG
@@ -53,6 +151,11 @@ int main(int argc, char** argv) {
 
     std::string data_path = parser.get<cv::String>(0);
     std::string params_path = parser.get<cv::String>(1);
+    std::string resume_path = parser.get<cv::String>("resume");
+    std::string shards_path = parser.get<cv::String>("shards");
+    const bool tune_batch = parser.has("autotune-batch");
+    const bool retune = parser.has("retune");
+    const bool autotune = parser.has("autotune") || tune_batch || retune;
 
     // Chech parsing errors
     if (!parser.check()) {
@@ -89,39 +192,82 @@ int main(int argc, char** argv) {
       std::string ignore_layers{""};
       LoadStateDict(*model, params_path, ignore_layers);
     }
+    // Checkpoints with only trainable parameters are partial, the rest is
+    // taken from the parameters
+    if (!resume_path.empty())
+      LoadStateDict(*model, resume_path);
 
     if (config->gpu_count > 0)
       model->to(torch::DeviceType::CUDA);
 
     // Make data sets
-    auto train_loader = std::make_unique<CocoLoader>(
-        fs::path(data_path) / "train2017",
-        fs::path(data_path) / "annotations/instances_train2017.json");
-    auto train_set =
-        std::make_unique<CocoDataset>(std::move(train_loader), config);
+    std::unique_ptr<CocoDataset> train_set;
+    std::vector<std::string> train_shards;
+    if (shards_path.empty()) {
+      auto train_loader = std::make_unique<CocoLoader>(
+          fs::path(data_path) / "train2017",
+          fs::path(data_path) / "annotations/instances_train2017.json",
+          fs::path(data_path) / "annotations/instances_train2017.cache");
+      train_set =
+          std::make_unique<CocoDataset>(std::move(train_loader), config);
+    } else {
+      // Annotations are loaded only once to write the shards, the training
+      // streams samples from them
+      if (!fs::exists(shards_path))
+        fs::create_directories(shards_path);
+      train_shards = ListShards(shards_path);
+      if (train_shards.empty()) {
+        std::cout << "Writing train set shards to " << shards_path
+                  << std::endl;
+        CocoDataset shards_set(
+            std::make_shared<CocoLoader>(
+                fs::path(data_path) / "train2017",
+                fs::path(data_path) / "annotations/instances_train2017.json",
+                fs::path(data_path) / "annotations/instances_train2017.cache"),
+            config);
+        train_shards =
+            WriteCocoShards(shards_set.Loader(), shards_path, 1000);
+      }
+    }
 
     auto val_loader = std::make_unique<CocoLoader>(
         fs::path(data_path) / "val2017",
-        fs::path(data_path) / "annotations/instances_val2017.json");
+        fs::path(data_path) / "annotations/instances_val2017.json",
+        fs::path(data_path) / "annotations/instances_val2017.cache");
     auto val_set = std::make_unique<CocoDataset>(std::move(val_loader), config);
 
+    // Tuned with the layers of the first stage
+    if (autotune) {
+      auto measure = [&]() {
+        if (train_set)
+          return model->MeasureTraining(*train_set, config->autotune_images,
+                                        "heads");
+        return model->MeasureTraining(train_shards, config->autotune_images,
+                                      "heads");
+      };
+      TuneTraining(*config, measure, model_dir, tune_batch, retune);
+    }
+
+    auto train = [&](double learning_rate, uint32_t epochs,
+                     const std::string& layers) {
+      if (train_set)
+        model->Train(*train_set, *val_set, learning_rate, epochs, layers);
+      else
+        model->Train(train_shards, *val_set, learning_rate, epochs, layers);
+    };
+
     //    // Training - Stage 1
     std::cout << "Training network heads" << std::endl;
-    model->Train(*train_set, *val_set, config->learning_rate, /*epochs*/
-                 40,
-                 "heads");  // 40
+    train(config->learning_rate, /*epochs*/ 40, "heads");  // 40
 
     //    // Training - Stage 2
     std::cout << "Fine tune Resnet stage 4 and up" << std::endl;
-    model->Train(*train_set, *val_set, config->learning_rate, /*epochs*/
-                 120,
-                 "4+");  // 120
+    train(config->learning_rate, /*epochs*/ 120, "4+");  // 120
 
     // Training - Stage 3
     // Fine tune all layers
     std::cout << "Fine tune all layers" << std::endl;
-    model->Train(*train_set, *val_set, config->learning_rate / 10,
-                 /*epochs*/ 160, "all");  // 160
+    train(config->learning_rate / 10, /*epochs*/ 160, "all");  // 160
 
   } catch (const std::exception& err) {
     std::cout << err.what() << std::endl;
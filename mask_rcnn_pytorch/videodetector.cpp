@@ -0,0 +1,268 @@
+#include "videodetector.h"
+#include "nnutils.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <cuda_runtime_api.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+const float kMinTrackIou = 0.5f;
+
+void CheckCuda(cudaError_t status) {
+  if (status != cudaSuccess)
+    throw std::runtime_error(std::string("Video detector CUDA error : ") +
+                             cudaGetErrorString(status));
+}
+
+float BoxIou(const int32_t* a, const int32_t* b) {
+  auto y1 = std::max(a[0], b[0]);
+  auto x1 = std::max(a[1], b[1]);
+  auto y2 = std::min(a[2], b[2]);
+  auto x2 = std::min(a[3], b[3]);
+  if (y2 <= y1 || x2 <= x1)
+    return 0;
+  auto intersection = static_cast<float>((y2 - y1) * (x2 - x1));
+  auto area_a = static_cast<float>((a[2] - a[0]) * (a[3] - a[1]));
+  auto area_b = static_cast<float>((b[2] - b[0]) * (b[3] - b[1]));
+  return intersection / (area_a + area_b - intersection);
+}
+
+// Detections of a frame, 0 if there are none
+int64_t Count(const at::Tensor& boxes) {
+  return is_empty(boxes) ? 0 : boxes.size(0);
+}
+}  // namespace
+
+VideoDetector::VideoDetector(MaskRCNN model,
+                             std::shared_ptr<const Config> config,
+                             double mask_threshold,
+                             uint32_t mask_interval,
+                             uint32_t queue_size)
+    : model_(model),
+      config_(config),
+      mold_config_(*config),
+      mask_threshold_(mask_threshold),
+      mask_interval_(std::max(mask_interval, 1u)),
+      on_gpu_(config->gpu_count > 0),
+      inputs_(queue_size),
+      molded_(queue_size),
+      detected_(queue_size),
+      outputs_(queue_size) {
+  mold_config_.gpu_count = 0;
+  prepare_thread_ = std::thread([this] { PrepareLoop(); });
+  detect_thread_ = std::thread([this] { DetectLoop(); });
+  unmold_thread_ = std::thread([this] { UnmoldLoop(); });
+}
+
+VideoDetector::~VideoDetector() {
+  Stop();
+}
+
+bool VideoDetector::Push(cv::Mat frame) {
+  Input input;
+  input.index = frames_num_;
+  input.image = frame;
+  if (!inputs_.Push(std::move(input)))
+    return false;
+  ++frames_num_;
+  return true;
+}
+
+bool VideoDetector::PushEncoded(std::vector<uint8_t> data) {
+  Input input;
+  input.index = frames_num_;
+  input.data = std::move(data);
+  if (!inputs_.Push(std::move(input)))
+    return false;
+  ++frames_num_;
+  return true;
+}
+
+void VideoDetector::Close() {
+  inputs_.Close();
+}
+
+bool VideoDetector::Next(Frame& frame) {
+  bool has_frame = outputs_.Pop(frame);
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  if (error_)
+    std::rethrow_exception(error_);
+  return has_frame;
+}
+
+void VideoDetector::Fail(std::exception_ptr error) {
+  {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (!error_)
+      error_ = error;
+  }
+  inputs_.Close();
+  molded_.Close();
+  detected_.Close();
+  outputs_.Close();
+}
+
+void VideoDetector::Stop() {
+  inputs_.Close();
+  molded_.Close();
+  detected_.Close();
+  outputs_.Close();
+  for (auto* thread : {&prepare_thread_, &detect_thread_, &unmold_thread_}) {
+    if (thread->joinable())
+      thread->join();
+  }
+  // Frames left between the stages
+  Detected detected;
+  while (detected_.Pop(detected)) {
+    if (detected.event)
+      cudaEventDestroy(static_cast<cudaEvent_t>(detected.event));
+  }
+}
+
+void VideoDetector::PrepareLoop() {
+  try {
+    Input input;
+    while (inputs_.Pop(input)) {
+      if (!input.data.empty()) {
+        input.image = cv::imdecode(input.data, cv::IMREAD_COLOR);
+        if (input.image.empty())
+          throw std::runtime_error("Failed to decode frame " +
+                                   std::to_string(input.index));
+      }
+      Molded molded;
+      molded.index = input.index;
+      molded.image_size = input.image.size();
+      std::vector<Window> windows;
+      std::tie(molded.images, molded.image_metas, windows) =
+          MoldInputs({input.image}, mold_config_);
+      molded.window = windows.front();
+      if (on_gpu_)
+        molded.images = molded.images.pin_memory();
+      if (!molded_.Push(std::move(molded)))
+        break;
+    }
+    molded_.Close();
+  } catch (...) {
+    Fail(std::current_exception());
+  }
+}
+
+void VideoDetector::DetectLoop() {
+  try {
+    if (on_gpu_)
+      at::cuda::setCurrentCUDAStream(at::cuda::getStreamFromPool());
+    Molded molded;
+    while (molded_.Pop(molded)) {
+      Detected detected;
+      auto images = molded.images;
+      if (on_gpu_)
+        images = images.to(torch::Device(torch::kCUDA), images.scalar_type(),
+                           /*non_blocking*/ true);
+      const bool key_frame = molded.index % mask_interval_ == 0;
+      std::tie(detected.detections, detected.mrcnn_mask) = model_->Detect(
+          images, molded.image_metas, /*boxes_only*/ !key_frame);
+      if (on_gpu_) {
+        cudaEvent_t event;
+        CheckCuda(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+        detected.event = event;
+        CheckCuda(cudaEventRecord(event,
+                                  at::cuda::getCurrentCUDAStream().stream()));
+      }
+      detected.molded = std::move(molded);
+      auto* event = detected.event;
+      if (!detected_.Push(std::move(detected))) {
+        if (event)
+          cudaEventDestroy(static_cast<cudaEvent_t>(event));
+        break;
+      }
+    }
+    detected_.Close();
+  } catch (...) {
+    Fail(std::current_exception());
+  }
+}
+
+void VideoDetector::UnmoldLoop() {
+  try {
+    if (on_gpu_)
+      at::cuda::setCurrentCUDAStream(at::cuda::getStreamFromPool());
+    Detected detected;
+    while (detected_.Pop(detected)) {
+      // The unmold stream waits for the frame on the GPU, not the host
+      if (detected.event) {
+        auto event = static_cast<cudaEvent_t>(detected.event);
+        CheckCuda(cudaStreamWaitEvent(
+            at::cuda::getCurrentCUDAStream().stream(), event, 0));
+        CheckCuda(cudaEventDestroy(event));
+        detected.event = nullptr;
+      }
+      Frame frame;
+      frame.index = detected.molded.index;
+      frame.image_size = detected.molded.image_size;
+      frame.key_frame = frame.index % mask_interval_ == 0;
+      if (!is_empty(detected.detections)) {
+        std::tie(frame.boxes, frame.class_ids, frame.scores, frame.masks) =
+            UnmoldDetectionsPacked(detected.detections[0],
+                                   detected.mrcnn_mask[0], frame.image_size,
+                                   detected.molded.window, mask_threshold_);
+      }
+      // Results are on the host, so the tensors of the frame can be released
+      detected = Detected();
+
+      if (frame.key_frame) {
+        key_boxes_ = frame.boxes;
+        key_class_ids_ = frame.class_ids;
+        key_masks_ = frame.masks;
+      } else {
+        TrackMasks(frame);
+      }
+      if (!outputs_.Push(std::move(frame)))
+        break;
+    }
+    outputs_.Close();
+  } catch (...) {
+    Fail(std::current_exception());
+  }
+}
+
+void VideoDetector::TrackMasks(Frame& frame) const {
+  const auto count = Count(frame.boxes);
+  frame.masks.assign(static_cast<size_t>(count), PackedMask());
+  const auto key_count =
+      std::min(Count(key_boxes_), static_cast<int64_t>(key_masks_.size()));
+  if (count == 0 || key_count == 0)
+    return;
+  auto boxes = frame.boxes.contiguous();
+  auto class_ids = frame.class_ids.contiguous();
+  auto key_boxes = key_boxes_.contiguous();
+  auto key_class_ids = key_class_ids_.contiguous();
+  const auto* box = boxes.data<int32_t>();
+  const auto* class_id = class_ids.data<int64_t>();
+  const auto* key_box = key_boxes.data<int32_t>();
+  const auto* key_class_id = key_class_ids.data<int64_t>();
+  for (int64_t i = 0; i < count; ++i) {
+    float best_iou = kMinTrackIou;
+    int64_t best = -1;
+    for (int64_t k = 0; k < key_count; ++k) {
+      if (key_class_id[k] != class_id[i])
+        continue;
+      auto iou = BoxIou(box + 4 * i, key_box + 4 * k);
+      if (iou > best_iou) {
+        best_iou = iou;
+        best = k;
+      }
+    }
+    if (best < 0)
+      continue;
+    // The mask moves with the top left corner of its box and stays in the
+    // image
+    auto mask = key_masks_[static_cast<size_t>(best)];
+    mask.y1 = std::clamp(mask.y1 + box[4 * i] - key_box[4 * best], 0,
+                         std::max(frame.image_size.height - mask.height, 0));
+    mask.x1 = std::clamp(mask.x1 + box[4 * i + 1] - key_box[4 * best + 1], 0,
+                         std::max(frame.image_size.width - mask.width, 0));
+    frame.masks[static_cast<size_t>(i)] = std::move(mask);
+  }
+}
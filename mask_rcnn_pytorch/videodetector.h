@@ -0,0 +1,125 @@
+#ifndef VIDEODETECTOR_H
+#define VIDEODETECTOR_H
+
+#include "blockingqueue.h"
+#include "config.h"
+#include "imageutils.h"
+#include "maskrcnn.h"
+#include "pastemasks.h"
+
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Detects a sequence of frames, e.g. of a camera stream. Frames go through
+ * three pipeline stages running on their own threads, so stages of
+ * consecutive frames overlap:
+ * - prepare: decodes encoded frames and molds them on the CPU to the pinned
+ *   memory,
+ * - detect: copies the frame to the GPU and runs the model on its own CUDA
+ *   stream,
+ * - unmold: pastes the masks on another CUDA stream, which waits only for
+ *   the frame on the detect stream, and copies the results to the host.
+ * Every frame is detected alone and the results come in the frame order.
+ * With mask_interval N > 1 the mask head runs only for every N-th key
+ * frame. Frames between get only boxes, and the masks of the key frame
+ * instances they match (the same class and the best IoU above 0.5), moved
+ * with the boxes. The model has to be warmed up before, see WarmUp.
+ */
+class VideoDetector {
+ public:
+  struct Frame {
+    uint64_t index{0};
+    cv::Size image_size;
+    bool key_frame{true};
+    // The same as UnmoldDetectionsPacked returns, between key frames the
+    // masks of unmatched detections are empty
+    at::Tensor boxes;
+    at::Tensor class_ids;
+    at::Tensor scores;
+    std::vector<PackedMask> masks;
+  };
+
+  VideoDetector(MaskRCNN model,
+                std::shared_ptr<const Config> config,
+                double mask_threshold,
+                uint32_t mask_interval = 1,
+                uint32_t queue_size = 2);
+  VideoDetector(const VideoDetector&) = delete;
+  VideoDetector& operator=(const VideoDetector&) = delete;
+  ~VideoDetector();
+
+  // Block while the pipeline is full, return false after Close or an error
+  bool Push(cv::Mat frame);
+  bool PushEncoded(std::vector<uint8_t> data);
+
+  // No more frames, Next returns the frames in the pipeline
+  void Close();
+
+  // Blocks until the next frame is detected, returns false after the last
+  // frame. Rethrows exceptions of the stages.
+  bool Next(Frame& frame);
+
+ private:
+  struct Input {
+    uint64_t index{0};
+    cv::Mat image;
+    std::vector<uint8_t> data;
+  };
+  struct Molded {
+    uint64_t index{0};
+    cv::Size image_size;
+    at::Tensor images;
+    std::vector<ImageMeta> image_metas;
+    Window window;
+  };
+  struct Detected {
+    Molded molded;
+    at::Tensor detections;
+    at::Tensor mrcnn_mask;
+    // CUDA event after the frame on the detect stream
+    void* event{nullptr};
+  };
+
+  void PrepareLoop();
+  void DetectLoop();
+  void UnmoldLoop();
+  void TrackMasks(Frame& frame) const;
+  void Fail(std::exception_ptr error);
+  void Stop();
+
+ private:
+  MaskRCNN model_;
+  std::shared_ptr<const Config> config_;
+  // Frames are molded on the CPU, the copy runs on the detect stream
+  Config mold_config_;
+  double mask_threshold_{0};
+  uint32_t mask_interval_{1};
+  bool on_gpu_{false};
+  uint64_t frames_num_{0};
+
+  BlockingQueue<Input> inputs_;
+  BlockingQueue<Molded> molded_;
+  BlockingQueue<Detected> detected_;
+  BlockingQueue<Frame> outputs_;
+
+  // Detections of the last key frame, used only by the unmold stage
+  at::Tensor key_boxes_;
+  at::Tensor key_class_ids_;
+  std::vector<PackedMask> key_masks_;
+
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+
+  std::thread prepare_thread_;
+  std::thread detect_thread_;
+  std::thread unmold_thread_;
+};
+
+#endif  // VIDEODETECTOR_H
@@ -0,0 +1,268 @@
+#ifndef NPYDUMP_H
+#define NPYDUMP_H
+
+#include "tensorview.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Binary dumps of the intermediate values as .npy files, which numpy.load
+ * reads as is, for the comparison with the Python references. Writing
+ * formatted text takes minutes for feature maps, so the values are copied
+ * to a buffer of the dump and written by one background thread, the caller
+ * doesn't wait for the disk. The device values are copied to the host
+ * asynchronously, the writer waits for the copy with the wait function of
+ * the dump. FlushDumps waits until the queued dumps are written.
+ */
+namespace utils {
+
+template <typename T>
+const char* NpyDescr();
+template <>
+inline const char* NpyDescr<float>() {
+  return "<f4";
+}
+template <>
+inline const char* NpyDescr<double>() {
+  return "<f8";
+}
+template <>
+inline const char* NpyDescr<int8_t>() {
+  return "|i1";
+}
+template <>
+inline const char* NpyDescr<uint8_t>() {
+  return "|u1";
+}
+template <>
+inline const char* NpyDescr<int16_t>() {
+  return "<i2";
+}
+template <>
+inline const char* NpyDescr<uint16_t>() {
+  return "<u2";
+}
+template <>
+inline const char* NpyDescr<int32_t>() {
+  return "<i4";
+}
+template <>
+inline const char* NpyDescr<uint32_t>() {
+  return "<u4";
+}
+template <>
+inline const char* NpyDescr<int64_t>() {
+  return "<i8";
+}
+template <>
+inline const char* NpyDescr<uint64_t>() {
+  return "<u8";
+}
+template <>
+inline const char* NpyDescr<bool>() {
+  return "|b1";
+}
+
+// Header of the version 1.0 format, the data after it is aligned to 64 bytes
+inline std::string NpyHeader(const std::string& descr,
+                             const std::vector<size_t>& shape) {
+  std::string dict =
+      "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (";
+  for (auto size : shape)
+    dict += std::to_string(size) + (shape.size() == 1 ? "," : ", ");
+  if (shape.size() > 1)
+    dict.resize(dict.size() - 2);
+  dict += "), }";
+  const size_t prefix = 10;  // magic, version and the dict length
+  dict.append((64 - (prefix + dict.size() + 1) % 64) % 64, ' ');
+  dict += '\n';
+  if (dict.size() > 0xffff)
+    throw std::invalid_argument("too many npy dimensions");
+  std::string header("\x93NUMPY\x01\x00", 8);
+  header += static_cast<char>(dict.size() & 0xff);
+  header += static_cast<char>(dict.size() >> 8);
+  return header + dict;
+}
+
+// Row major data of the shape, little endian
+inline void WriteNpy(const std::string& file_name,
+                     const std::string& descr,
+                     const std::vector<size_t>& shape,
+                     const void* data,
+                     size_t bytes) {
+  std::ofstream file(file_name, std::ios::binary);
+  auto header = NpyHeader(descr, shape);
+  file.write(header.data(), static_cast<std::streamsize>(header.size()));
+  file.write(static_cast<const char*>(data),
+             static_cast<std::streamsize>(bytes));
+  if (!file)
+    throw std::runtime_error("Failed to write " + file_name);
+}
+
+class NpyWriter {
+ public:
+  struct Dump {
+    std::string file_name;
+    std::string descr;
+    std::vector<size_t> shape;
+    const void* data{nullptr};
+    size_t bytes{0};
+    // keeps the data alive till it's written
+    std::shared_ptr<const void> owner;
+    // waits for the asynchronous copy of the data, if not empty
+    std::function<void()> wait;
+  };
+
+  NpyWriter() : thread_([this]() { WriterLoop(); }) {}
+  NpyWriter(const NpyWriter&) = delete;
+  NpyWriter& operator=(const NpyWriter&) = delete;
+  // Writes the queued dumps
+  ~NpyWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  void Push(Dump dump) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      dumps_.push_back(std::move(dump));
+    }
+    cv_.notify_all();
+  }
+
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return dumps_.empty() && !writing_; });
+  }
+
+ private:
+  void WriterLoop() {
+    while (true) {
+      Dump dump;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stop_ || !dumps_.empty(); });
+        if (dumps_.empty())
+          break;
+        dump = std::move(dumps_.front());
+        dumps_.pop_front();
+        writing_ = true;
+      }
+      // a failed dump doesn't stop the run
+      try {
+        if (dump.wait)
+          dump.wait();
+        WriteNpy(dump.file_name, dump.descr, dump.shape, dump.data,
+                 dump.bytes);
+      } catch (const std::exception& err) {
+        std::cerr << "Dump " << dump.file_name << " failed : " << err.what()
+                  << std::endl;
+      }
+      dump = Dump();  // releases the data
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writing_ = false;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Dump> dumps_;
+  bool writing_{false};
+  bool stop_{false};
+  std::thread thread_;
+};
+
+inline NpyWriter& DefaultNpyWriter() {
+  static NpyWriter writer;
+  return writer;
+}
+
+inline void FlushDumps() {
+  DefaultNpyWriter().Flush();
+}
+
+namespace detail {
+// Queues the dump of a new buffer of size elements filled by fill
+template <typename T, typename F>
+void PushDump(const std::string& file_name,
+              std::vector<size_t> shape,
+              size_t size,
+              F&& fill) {
+  std::shared_ptr<T> buffer(new T[size], std::default_delete<T[]>());
+  fill(buffer.get());
+  NpyWriter::Dump dump;
+  dump.file_name = file_name;
+  dump.descr = NpyDescr<T>();
+  dump.shape = std::move(shape);
+  dump.data = buffer.get();
+  dump.bytes = size * sizeof(T);
+  dump.owner = std::move(buffer);
+  DefaultNpyWriter().Push(std::move(dump));
+}
+}  // namespace detail
+
+// Copies the view and writes it in the background
+template <typename T>
+void DumpNpy(const std::string& file_name, const TensorView<T>& view) {
+  using Value = std::remove_const_t<T>;
+  detail::PushDump<Value>(
+      file_name,
+      std::vector<size_t>(view.shape.begin(), view.shape.begin() + view.dims),
+      view.size(),
+      [&view](Value* data) { CopyView(view, MakeDenseView(data, view)); });
+}
+
+// Row major data of the shape
+template <typename T>
+void DumpNpy(const std::string& file_name,
+             const T* data,
+             const std::vector<size_t>& shape) {
+  size_t size = 1;
+  for (auto dim : shape)
+    size *= dim;
+  detail::PushDump<T>(file_name, shape, size, [data, size](T* buffer) {
+    std::copy(data, data + size, buffer);
+  });
+}
+
+// One dimensional dump of a container of numbers, the binary counterpart of
+// the operator<< of ioutils.h
+template <typename Container,
+          typename Value = typename Container::value_type,
+          typename = std::enable_if_t<std::is_arithmetic<Value>::value>>
+void DumpNpy(const std::string& file_name, const Container& container) {
+  const auto size =
+      static_cast<size_t>(std::distance(std::begin(container),
+                                        std::end(container)));
+  detail::PushDump<Value>(file_name, {size}, size,
+                          [&container](Value* buffer) {
+                            std::copy(std::begin(container),
+                                      std::end(container), buffer);
+                          });
+}
+
+}  // namespace utils
+
+#endif  // NPYDUMP_H
@@ -0,0 +1,128 @@
+#include "perfstats.h"
+
+#include <cstdlib>
+#include <new>
+
+/*
+ * Counting replacements of the global operator new and delete, a binary
+ * counts its heap allocations when this file is one of its sources. They
+ * are defined in their own translation unit, so the callers don't see the
+ * malloc and free calls behind them. All replaceable forms are replaced,
+ * the memory of all of them is taken from malloc, so any delete matches any
+ * new. The aligned forms are the ones of C++17.
+ */
+namespace {
+
+void* CountedAlloc(std::size_t size) {
+  utils::AllocationCounter().fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+#ifdef __cpp_aligned_new
+void* CountedAlignedAlloc(std::size_t size, std::align_val_t alignment) {
+  utils::AllocationCounter().fetch_add(1, std::memory_order_relaxed);
+  auto align = static_cast<std::size_t>(alignment);
+  if (align < sizeof(void*))
+    align = sizeof(void*);
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, align, size == 0 ? 1 : size) != 0)
+    return nullptr;
+  return ptr;
+}
+#endif
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  if (void* ptr = CountedAlloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  if (void* ptr = CountedAlignedAlloc(size, alignment))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void* operator new(std::size_t size,
+                   std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return CountedAlignedAlloc(size, alignment);
+}
+
+void* operator new[](std::size_t size,
+                     std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return CountedAlignedAlloc(size, alignment);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr,
+                     std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr,
+                       std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+#endif
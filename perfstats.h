@@ -0,0 +1,74 @@
+#ifndef PERFSTATS_H
+#define PERFSTATS_H
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Shared measurements of the performance regression suite, see bench_all.sh.
+ * Every measured case of a subsystem is one JSON line of its metrics, the
+ * lines of a run are checked against a stored baseline by bench_compare.sh.
+ * Heap allocations are counted when perfstats.cpp, which replaces the
+ * global operator new and delete, is one of the sources of the binary,
+ * otherwise the count stays 0.
+ */
+namespace utils {
+
+inline std::atomic<uint64_t>& AllocationCounter() {
+  static std::atomic<uint64_t> counter{0};
+  return counter;
+}
+
+// Calls of operator new since the start, by all threads
+inline uint64_t AllocationCount() {
+  return AllocationCounter().load(std::memory_order_relaxed);
+}
+
+// Peak resident memory of the process in megabytes
+inline double PeakMemoryMb() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss) / 1024;  // kilobytes on Linux
+}
+
+// Metric names with values, in the order of the line
+using PerfMetrics = std::vector<std::pair<std::string, double>>;
+
+class PerfReport {
+ public:
+  // An empty file name writes the lines to stdout
+  PerfReport(std::string suite, const std::string& file_name)
+      : suite_(std::move(suite)) {
+    if (!file_name.empty()) {
+      file_.open(file_name, std::ios::app);
+      if (!file_)
+        throw std::runtime_error(file_name + " file can't be opened");
+    }
+  }
+
+  // The peak resident memory is added to the metrics
+  void Write(const std::string& name, const PerfMetrics& metrics) {
+    std::ostream& out = file_.is_open() ? file_ : std::cout;
+    out << "{\"suite\":\"" << suite_ << "\",\"case\":\"" << name << "\"";
+    for (const auto& metric : metrics)
+      out << ",\"" << metric.first << "\":" << metric.second;
+    out << ",\"peak_rss_mb\":" << PeakMemoryMb() << "}" << std::endl;
+  }
+
+ private:
+  std::string suite_;
+  std::ofstream file_;
+};
+
+}  // namespace utils
+
+#endif  // PERFSTATS_H
@@ -0,0 +1,144 @@
+#ifndef POLYMODEL_H
+#define POLYMODEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Fitted polynomial regression shared by the samples. The coefficients are
+ * the ones of the powers of the scaled x, z = (x - x_mean) * x_scale, and the
+ * prediction is restored with y = p(z) * y_scale + y_mean, so every backend
+ * maps its own standardization and scaling into these four numbers. The
+ * prediction doesn't build the design matrix, the polynomial is evaluated with
+ * the Horner's scheme on several points at once, which the compiler
+ * vectorizes, and the chunks of the points are spread over the OpenMP threads.
+ */
+namespace utils {
+
+class PolynomialModel {
+ public:
+  PolynomialModel() = default;
+  PolynomialModel(std::vector<double> coefficients,
+                  double x_mean,
+                  double x_scale,
+                  double y_mean,
+                  double y_scale)
+      : coefficients_(std::move(coefficients)),
+        x_mean_(x_mean),
+        x_scale_(x_scale),
+        y_mean_(y_mean),
+        y_scale_(y_scale) {}
+
+  size_t degree() const { return coefficients_.size(); }
+  const std::vector<double>& coefficients() const { return coefficients_; }
+
+  double Predict(double x) const {
+    double z = (x - x_mean_) * x_scale_;
+    double v = 0;
+    for (auto c = coefficients_.rbegin(); c != coefficients_.rend(); ++c)
+      v = v * z + *c;
+    return v * y_scale_ + y_mean_;
+  }
+
+  // y[i] = Predict(x[i]) for n points
+  template <typename T>
+  void Predict(const T* x, size_t n, T* y) const {
+    const auto chunks = static_cast<int64_t>((n + kChunk - 1) / kChunk);
+#pragma omp parallel for schedule(static)
+    for (int64_t chunk = 0; chunk < chunks; ++chunk) {
+      auto begin = static_cast<size_t>(chunk) * kChunk;
+      PredictRange(x, y, begin, std::min(begin + kChunk, n));
+    }
+  }
+
+  template <typename T>
+  std::vector<T> Predict(const std::vector<T>& x) const {
+    std::vector<T> y(x.size());
+    Predict(x.data(), x.size(), y.data());
+    return y;
+  }
+
+  // Text file with the scaling and the coefficients in the full precision
+  void Save(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file)
+      throw std::runtime_error(path + " file can't be opened");
+    file << kHeader << "\n"
+         << std::setprecision(std::numeric_limits<double>::max_digits10)
+         << x_mean_ << " " << x_scale_ << " " << y_mean_ << " " << y_scale_
+         << "\n"
+         << coefficients_.size() << "\n";
+    for (auto c : coefficients_)
+      file << c << "\n";
+    if (!file)
+      throw std::runtime_error(path + " file can't be written");
+  }
+
+  static PolynomialModel Load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+      throw std::runtime_error(path + " file can't be opened");
+    std::string header;
+    std::getline(file, header);
+    if (header != kHeader)
+      throw std::runtime_error(path + " isn't a polynomial model file");
+    PolynomialModel model;
+    size_t degree = 0;
+    file >> model.x_mean_ >> model.x_scale_ >> model.y_mean_ >>
+        model.y_scale_ >> degree;
+    model.coefficients_.resize(degree);
+    for (auto& c : model.coefficients_)
+      file >> c;
+    if (!file)
+      throw std::runtime_error(path + " polynomial model file is broken");
+    return model;
+  }
+
+ private:
+  // Points of one OpenMP task and of one vectorized evaluation
+  static const size_t kChunk = 4096;
+  static const size_t kLanes = 8;
+  static constexpr const char* kHeader = "polynomial-model 1";
+
+  template <typename T>
+  void PredictRange(const T* x, T* y, size_t begin, size_t end) const {
+    const double* c = coefficients_.data();
+    const auto degree = coefficients_.size();
+    size_t i = begin;
+    for (; i + kLanes <= end; i += kLanes) {
+      double z[kLanes];
+      double v[kLanes];
+      for (size_t l = 0; l < kLanes; ++l) {
+        z[l] = (static_cast<double>(x[i + l]) - x_mean_) * x_scale_;
+        v[l] = 0;
+      }
+      for (auto k = degree; k-- > 0;) {
+        const double ck = c[k];
+#pragma omp simd
+        for (size_t l = 0; l < kLanes; ++l)
+          v[l] = v[l] * z[l] + ck;
+      }
+      for (size_t l = 0; l < kLanes; ++l)
+        y[i + l] = static_cast<T>(v[l] * y_scale_ + y_mean_);
+    }
+    for (; i < end; ++i)
+      y[i] = static_cast<T>(Predict(static_cast<double>(x[i])));
+  }
+
+  std::vector<double> coefficients_;
+  double x_mean_{0};
+  double x_scale_{1};
+  double y_mean_{0};
+  double y_scale_{1};
+};
+
+}  // namespace utils
+
+#endif  // POLYMODEL_H
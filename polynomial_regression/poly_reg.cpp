@@ -3,7 +3,6 @@
  */
 
 // third party includes
-#include <csv.h>
 #include <plot.h>
 #include <xtensor-blas/xlinalg.hpp>
 #include <xtensor/xadapt.hpp>
@@ -14,28 +13,77 @@
 
 // stl includes
 #include <algorithm>
+#include <cmath>
 #include <experimental/filesystem>
 #include <iostream>
 #include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 // application includes
+#include "../crossval.h"
 #include "../ioutils.h"
+#include "../polymodel.h"
+#include "../regbench.h"
+#include "../streamfit.h"
+#include "../tsvloader.h"
 #include "../utils.h"
 
 // Namespace and type aliases
 namespace fs = std::experimental::filesystem;
+// The float32 build (-DWITH_FLOAT32=ON) halves the memory traffic of the
+// design matrix and doubles the SIMD width. The long sums over the rows are
+// compensated and X^T*X is accumulated and solved in double, so the fit of
+// the degree 64 keeps its accuracy.
+#ifdef POLY_REG_FLOAT32
+typedef float DType;
+#else
 typedef double DType;
+#endif
+typedef double AccType;
 
 // linalg package doesn't support dynamic layouts
 using Matrix = xt::xarray<DType, xt::layout_type::row_major>;
+using AccMatrix = xt::xarray<AccType, xt::layout_type::row_major>;
+
+// Kahan's summation, the rounding error of the sum doesn't grow with the
+// number of the terms (needs the strict floating point, no -ffast-math)
+struct CompensatedSum {
+  DType sum{0};
+  DType compensation{0};
+
+  void Add(DType v) {
+    auto y = v - compensation;
+    auto t = sum + y;
+    compensation = (t - sum) - y;
+    sum = t;
+  }
+  DType Value() const { return sum; }
+};
+
+// Dot product of the row and b, the lanes are summed in parallel
+inline DType dot(const DType* xr, const DType* bd, size_t cols) {
+  DType v = 0;
+#pragma omp simd reduction(+ : v)
+  for (size_t j = 0; j < cols; ++j)
+    v += xr[j] * bd[j];
+  return v;
+}
 
 auto standardize(const Matrix& v) {
   assert(v.shape().size() == 1);
-  auto m = xt::eval(xt::mean(v))[0];
   auto n = v.shape()[0];
-  auto sd = xt::eval(
-      xt::sqrt(xt::sum(xt::pow(v - m, 2)) / static_cast<DType>(n - 1)))[0];
+  CompensatedSum sum;
+  for (auto e : v)
+    sum.Add(e);
+  auto m = sum.Value() / static_cast<DType>(n);
+  CompensatedSum sq_sum;
+  for (auto e : v)
+    sq_sum.Add((e - m) * (e - m));
+  auto sd = std::sqrt(sq_sum.Value() / static_cast<DType>(n - 1));
   auto sv = (v - m) / sd;
   return std::make_tuple(xt::eval(sv), m, sd);
 }
@@ -47,33 +95,99 @@ auto minmax_scale(const Matrix& v, DType rmin, DType rmax) {
   return xt::eval(vs * (rmax - rmin) - rmin);
 }
 
+// Moments of the design matrix columns, the column 0 is the constant term
+// and the column 1 is the standardized x, so their moments are 0 and 1
+struct PolynomialMoments {
+  AccType x_mean{0};
+  AccType x_sd{1};
+  std::vector<AccType> mean;
+  std::vector<AccType> sd;
+};
+
+// Powers of the standardized x are built by repeated multiplication row by
+// row, the moments of the columns are accumulated with Welford's method in
+// the same pass, the second pass standardizes the columns in place. The
+// moments are accumulated in double, the float updates of the mean drift
+// over millions of rows.
 auto generate_polynomial(const Matrix& x, size_t degree) {
   assert(x.shape().size() == 1);
   auto rows = x.shape()[0];
+  PolynomialMoments moments;
+  Matrix z;
+  std::tie(z, moments.x_mean, moments.x_sd) = standardize(x);
+  moments.mean.assign(degree, 0);
+  moments.sd.assign(degree, 1);
+  std::vector<AccType> m2(degree, 0);
+
   auto poly_shape = std::vector<size_t>{rows, degree};
-  Matrix poly_x = xt::zeros<DType>(poly_shape);
-  // fill additional column for simpler vectorization
-  {
-    auto xv = xt::view(poly_x, xt::all(), 0);
-    xv = xt::ones<DType>({rows});
+  Matrix poly_x = xt::empty<DType>(poly_shape);
+  DType* pd = poly_x.data();
+  AccType* mean = moments.mean.data();
+  for (size_t r = 0; r < rows; ++r) {
+    DType* row = pd + r * degree;
+    const DType zr = z(r);
+    const AccType inv_n = AccType(1) / static_cast<AccType>(r + 1);
+    // the column 0 is an additional column for simpler vectorization
+    DType p = 1;
+    for (size_t i = 0; i < degree; ++i) {
+      row[i] = p;
+      p *= zr;
+    }
+    for (size_t i = 2; i < degree; ++i) {
+      AccType delta = row[i] - mean[i];
+      mean[i] += delta * inv_n;
+      m2[i] += delta * (row[i] - mean[i]);
+    }
   }
-  // copy initial data
-  {
-    auto xv = xt::view(poly_x, xt::all(), 1);
-    xv = std::get<0>(standardize(x));
+  for (size_t i = 2; i < degree; ++i)
+    moments.sd[i] = std::sqrt(m2[i] / static_cast<AccType>(rows - 1));
+
+  const AccType* sd = moments.sd.data();
+  for (size_t r = 0; r < rows; ++r) {
+    DType* row = pd + r * degree;
+    for (size_t i = 2; i < degree; ++i)
+      row[i] = static_cast<DType>((row[i] - mean[i]) / sd[i]);
   }
-  // generate additional terms
-  auto x_col = xt::view(poly_x, xt::all(), 1);
-  for (size_t i = 2; i < degree; ++i) {
-    auto xv = xt::view(poly_x, xt::all(), i);
-    xv = xt::pow(x_col, static_cast<DType>(i));
-    xv = std::get<0>(standardize(xv));
+  return std::make_tuple(poly_x, moments);
+}
+
+// Coefficients of the powers of the standardized x, with the moments of the
+// columns folded in, for the evaluation with the Horner's scheme
+auto power_coefficients(const AccMatrix& b,
+                        const PolynomialMoments& moments) {
+  auto degree = b.shape()[0];
+  std::vector<double> c(degree, 0);
+  if (degree > 0)
+    c[0] = b(0);
+  for (size_t i = 1; i < degree; ++i) {
+    c[i] = b(i) / moments.sd[i];
+    c[0] -= c[i] * moments.mean[i];
   }
-  return poly_x;
+  return c;
 }
 
-auto bgd(const Matrix& x, const Matrix& y, size_t batch_size) {
-  size_t n_epochs = 50000;
+// Mean squared error of x*b over all rows without temporaries
+DType mse(const Matrix& x, const Matrix& y, const Matrix& b) {
+  auto rows = x.shape()[0];
+  auto cols = x.shape()[1];
+  const DType* xd = x.data();
+  const DType* bd = b.data();
+  CompensatedSum sum;
+  for (size_t r = 0; r < rows; ++r) {
+    auto e = y(r) - dot(xd + r * cols, bd, cols);
+    sum.Add(e * e);
+  }
+  return sum.Value() / static_cast<DType>(rows);
+}
+
+// Mini-batches are read in place from the rows of x, the error and the
+// gradient live in buffers allocated once. The cost over all rows is
+// evaluated every cost_interval epochs for the early stopping.
+auto bgd(const Matrix& x,
+         const Matrix& y,
+         size_t batch_size,
+         size_t cost_interval = 10,
+         size_t n_epochs = 50000) {
   DType lr = 0.0055;
 
   auto rows = x.shape()[0];
@@ -81,26 +195,41 @@ auto bgd(const Matrix& x, const Matrix& y, size_t batch_size) {
 
   size_t batches = rows / batch_size;  // some samples will be skipped
   Matrix b = xt::zeros<DType>({cols});
+  Matrix error = xt::zeros<DType>({batch_size});
+  Matrix grad = xt::zeros<DType>({cols});
+
+  const DType* xd = x.data();
+  DType* bd = b.data();
+  DType* ed = error.data();
+  DType* gd = grad.data();
+  const DType step = lr / static_cast<DType>(batch_size);
 
   DType prev_cost = std::numeric_limits<DType>::max();
   for (size_t i = 0; i < n_epochs; ++i) {
     for (size_t bi = 0; bi < batches; ++bi) {
       auto s = bi * batch_size;
-      auto e = s + batch_size;
-      Matrix batch_x = xt::view(x, xt::range(s, e), xt::all());
-      Matrix batch_y = xt::view(y, xt::range(s, e), xt::all());
-
-      auto yhat = xt::linalg::dot(batch_x, b);
-      Matrix error = yhat - batch_y;
-
-      auto grad = xt::linalg::dot(xt::transpose(batch_x), error) /
-                  static_cast<DType>(batch_size);
+      const DType* batch_x = xd + s * cols;
+
+      // error = batch_x * b - batch_y
+      for (size_t k = 0; k < batch_size; ++k)
+        ed[k] = dot(batch_x + k * cols, bd, cols) - y(s + k);
+
+      // grad = batch_x^T * error
+      std::fill(gd, gd + cols, DType(0));
+      for (size_t k = 0; k < batch_size; ++k) {
+        const DType* xr = batch_x + k * cols;
+        const DType ek = ed[k];
+        for (size_t j = 0; j < cols; ++j)
+          gd[j] += xr[j] * ek;
+      }
 
-      b = b - lr * grad;
+      for (size_t j = 0; j < cols; ++j)
+        bd[j] -= step * gd[j];
     }
 
-    auto cost = (xt::sum(xt::pow(y - xt::linalg::dot(x, b), 2.f)) /
-                 static_cast<DType>(rows))(0);  // evaluate value immediatly
+    if ((i + 1) % cost_interval != 0 && i + 1 != n_epochs)
+      continue;
+    auto cost = mse(x, y, b);
 
     std::cout << "Iteration : " << i << " Cost = " << cost << std::endl;
     if (cost <= prev_cost)
@@ -111,6 +240,90 @@ auto bgd(const Matrix& x, const Matrix& y, size_t batch_size) {
   return b;
 }
 
+// Lower triangle of X^T*X and X^T*y accumulated in one pass over the rows,
+// the triangle is mirrored at the end. The condition number of X^T*X at the
+// degree 64 is out of the float range, so it's always in double.
+auto normal_equation_terms(const Matrix& x, const Matrix& y) {
+  auto rows = x.shape()[0];
+  auto cols = x.shape()[1];
+  AccMatrix xtx = xt::zeros<AccType>({cols, cols});
+  AccMatrix xty = xt::zeros<AccType>({cols});
+  const DType* xd = x.data();
+  AccType* xtx_d = xtx.data();
+  AccType* xty_d = xty.data();
+  for (size_t r = 0; r < rows; ++r) {
+    const DType* xr = xd + r * cols;
+    const AccType yr = y(r);
+    for (size_t i = 0; i < cols; ++i) {
+      const AccType xi = xr[i];
+      xty_d[i] += xi * yr;
+      AccType* xtx_row = xtx_d + i * cols;
+      for (size_t j = 0; j <= i; ++j)
+        xtx_row[j] += xi * xr[j];
+    }
+  }
+  for (size_t i = 0; i < cols; ++i)
+    for (size_t j = i + 1; j < cols; ++j)
+      xtx_d[i * cols + j] = xtx_d[j * cols + i];
+  return std::make_tuple(xtx, xty);
+}
+
+// Solves X^T*X*b = X^T*y with the Cholesky factorization instead of the
+// explicit inverse, returns false when X^T*X is numerically singular
+bool solve_cholesky(const AccMatrix& xtx,
+                    const AccMatrix& xty,
+                    AccMatrix& b) {
+  auto cols = xty.shape()[0];
+  try {
+    AccMatrix l = xt::linalg::cholesky(xtx);
+    // L*z = X^T*y, then L^T*b = z
+    b = xty;
+    for (size_t i = 0; i < cols; ++i) {
+      for (size_t j = 0; j < i; ++j)
+        b(i) -= l(i, j) * b(j);
+      b(i) /= l(i, i);
+    }
+    for (size_t i = cols; i-- > 0;) {
+      for (size_t j = i + 1; j < cols; ++j)
+        b(i) -= l(j, i) * b(j);
+      b(i) /= l(i, i);
+    }
+    return xt::all(xt::isfinite(b));
+  } catch (const std::runtime_error& err) {
+    std::cout << err.what() << std::endl;
+  }
+  return false;
+}
+
+// At high degrees X^T*X can be numerically singular, then the least squares
+// solution of X*b = y is taken, it doesn't square the condition number of X.
+auto solve_normal_equation(const Matrix& x, const Matrix& y) {
+  auto [xtx, xty] = normal_equation_terms(x, y);
+  AccMatrix b;
+  if (!solve_cholesky(xtx, xty, b)) {
+    std::cout << "X^T*X is singular, using least squares" << std::endl;
+    b = std::get<0>(
+        xt::linalg::lstsq(xt::cast<AccType>(x), xt::cast<AccType>(y)));
+  }
+  return b;
+}
+
+// Predictions are scaled with the moments of the training data and don't
+// build the design matrix
+utils::PolynomialModel make_model(const AccMatrix& b,
+                                  const PolynomialMoments& moments,
+                                  AccType ym,
+                                  AccType ysd) {
+  return utils::PolynomialModel(power_coefficients(b, moments),
+                                moments.x_mean, 1 / moments.x_sd, ym, ysd);
+}
+
+Matrix predict(const utils::PolynomialModel& model, const Matrix& x) {
+  Matrix y = xt::empty<DType>(x.shape());
+  model.Predict(x.data(), x.size(), y.data());
+  return y;
+}
+
 auto make_regression_model(const Matrix& data_x,
                            const Matrix& data_y,
                            size_t p_degree,
@@ -119,35 +332,189 @@ auto make_regression_model(const Matrix& data_x,
   auto [y, ym, ysd] = standardize(data_y);
 
   // X standardization & polynomization
-  Matrix x = xt::eval(generate_polynomial(data_x, p_degree));
+  Matrix x;
+  PolynomialMoments moments;
+  std::tie(x, moments) = generate_polynomial(data_x, p_degree);
 
-  Matrix b;
+  AccMatrix b;
   if (equation) {
     // calculate parameters witn normal equation
-    auto xt = xt::transpose(x);
-    b = xt::linalg::dot(
-        xt::linalg::dot(xt::linalg::inv(xt::linalg::dot(xt, x)), xt), y);
-    auto cost = (xt::sum(xt::pow(y - xt::linalg::dot(x, b), 2.f)) /
-                 static_cast<DType>(x.shape()[0]))[0];
-    std::cout << "calculated cost : " << cost << std::endl;
+    b = solve_normal_equation(x, y);
+    std::cout << "calculated cost : " << mse(x, y, xt::cast<DType>(b))
+              << std::endl;
   } else {
     // learn parameters with Gradient Descent
     b = bgd(x, y, 15);
   }
 
   // create model
-  auto model = [b, ym, ysd, p_degree](const auto& data_x) {
-    auto x = xt::eval(generate_polynomial(data_x, p_degree));
-    Matrix yhat = xt::linalg::dot(x, b);
-    // restore scaling for predicted line values
+  return make_model(b, moments, ym, ysd);
+}
+
+// Fits a file which doesn't fit in memory from the sums of the powers of the
+// standardized x, see streamfit.h. Columns of the design matrix are
+// X_i = (P_i - mean_i) / sd_i, with the moments of the columns taken from the
+// sums, so X^T*X and X^T*y are derived from P^T*P and P^T*y. Returns the model
+// and the range of x.
+auto make_streaming_regression_model(const std::string& path,
+                                     size_t p_degree,
+                                     size_t threads) {
+  auto stats = utils::StreamPolynomialStats(path, p_degree, threads);
+  const auto& sums = stats.sums;
+  const auto n = static_cast<AccType>(sums.count);
+  const auto d = p_degree;
+  std::cout << "Streamed rows : " << sums.count << std::endl;
+
+  PolynomialMoments moments;
+  moments.x_mean = stats.x.mean;
+  moments.x_sd = stats.x.Sd();
+  moments.mean.assign(d, 0);
+  moments.sd.assign(d, 1);
+  for (size_t i = 2; i < d; ++i) {
+    // P_0 is 1, so the row 0 of P^T*P are the sums of the powers
+    auto mean = sums.ptp[i] / n;
+    moments.mean[i] = mean;
+    moments.sd[i] =
+        std::sqrt((sums.ptp[i * d + i] - n * mean * mean) / (n - 1));
+  }
 
-    yhat = (yhat * ysd) + ym;
-    return yhat;
-  };
-  return model;
+  AccMatrix xtx = xt::empty<AccType>({d, d});
+  AccMatrix xty = xt::empty<AccType>({d});
+  const auto& m = moments.mean;
+  const auto& sd = moments.sd;
+  for (size_t i = 0; i < d; ++i) {
+    for (size_t j = 0; j < d; ++j) {
+      auto v = sums.ptp[i * d + j] - m[i] * sums.ptp[j] - m[j] * sums.ptp[i] +
+               n * m[i] * m[j];
+      xtx(i, j) = v / (sd[i] * sd[j]);
+    }
+    xty(i) = (sums.pty[i] - m[i] * sums.pty[0]) / sd[i];
+  }
+
+  AccMatrix b;
+  if (!solve_cholesky(xtx, xty, b)) {
+    std::cout << "X^T*X is singular, using least squares" << std::endl;
+    b = std::get<0>(xt::linalg::lstsq(xtx, xty));
+  }
+  std::cout << "calculated cost : "
+            << utils::NormalEquationCost({xtx.begin(), xtx.end()},
+                                         {xty.begin(), xty.end()}, sums.yty,
+                                         sums.count, {b.begin(), b.end()})
+            << std::endl;
+
+  auto model = make_model(b, moments, stats.y.mean, stats.y.Sd());
+  return std::make_tuple(model, stats.x.min, stats.x.max);
 }
 
-int main() {
+// Streaming mode for the files of any size, only the approximation is plotted
+int stream_main(const std::string& path, size_t threads) {
+  auto [model, x_min, x_max] =
+      make_streaming_regression_model(path, 64, threads);
+  const Matrix new_x = xt::linspace<DType>(x_min, x_max, 2000);
+  Matrix values = predict(model, new_x);
+
+  auto x_coord = xt::view(new_x, xt::all());
+  auto polyline = xt::view(values, xt::all());
+  plotcpp::Plot plt(true);
+  plt.SetTerminal("qt");
+  plt.SetTitle("Web traffic");
+  plt.SetXLabel("Time");
+  plt.SetYLabel("Hits/hour");
+  plt.SetAutoscale();
+  plt.GnuplotCommand("set grid");
+  plt.Draw2D(plotcpp::Lines(x_coord.begin(), x_coord.end(), polyline.begin(),
+                            "poly line approx d = 64", "lc rgb 'green' lw 2"));
+  plt.Flush();
+  return 0;
+}
+
+// Times the steps of the fit on synthetic data, see regbench.h
+int bench_main(size_t rows, size_t p_degree, const std::string& json_file) {
+  std::cout << "Rows : " << rows << " degree : " << p_degree << std::endl;
+  auto data = utils::SyntheticRegressionData<DType>(rows);
+#if defined(POLY_REG_FLOAT32)
+  utils::BenchReport report("xtensor-float32", rows, p_degree, json_file);
+#elif defined(POLY_REG_NATIVE)
+  utils::BenchReport report("xtensor-native", rows, p_degree, json_file);
+#else
+  utils::BenchReport report("xtensor", rows, p_degree, json_file);
+#endif
+  auto shape = std::vector<size_t>{rows};
+  const auto data_x = xt::adapt(data.first, shape);
+  const auto data_y = xt::adapt(data.second, shape);
+
+  Matrix y;
+  DType ym{0}, ysd{0};
+  report.Measure("standardize",
+                 [&]() { std::tie(y, ym, ysd) = standardize(data_y); });
+  // the standardization of x is fused with the generation
+  Matrix x;
+  PolynomialMoments moments;
+  report.Measure("generate_polynomial", [&]() {
+    std::tie(x, moments) = generate_polynomial(data_x, p_degree);
+  });
+  AccMatrix b;
+  report.Measure("normal_equation",
+                 [&]() { b = solve_normal_equation(x, y); });
+  report.Measure("bgd_epoch", [&]() { bgd(x, y, 15, 1, 1); });
+  auto model = make_model(b, moments, ym, ysd);
+  std::vector<DType> new_y(rows);
+  report.Measure("predict", [&]() {
+    model.Predict(data.first.data(), rows, new_y.data());
+  });
+  return 0;
+}
+
+// Cross validation of the degrees up to max_degree, see crossval.h
+int select_main(const std::vector<DType>& x,
+                const std::vector<DType>& y,
+                size_t max_degree,
+                size_t folds) {
+  auto scores = utils::CrossValidateDegrees(
+      x, y, max_degree, folds, std::thread::hardware_concurrency());
+  utils::PrintDegreeScores(scores);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // poly_reg --stream <file.tsv> [threads]
+  if (argc > 2 && std::string(argv[1]) == "--stream") {
+    size_t threads =
+        argc > 3 ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+    try {
+      return stream_main(argv[2], std::max<size_t>(threads, 1));
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // poly_reg [--save-model <file>] saves the model of the degree 64
+  std::string model_path;
+  if (argc > 2 && std::string(argv[1]) == "--save-model")
+    model_path = argv[2];
+
+  // poly_reg --bench <rows> [degree] [json file]
+  if (argc > 2 && std::string(argv[1]) == "--bench") {
+    try {
+      return bench_main(std::stoul(argv[2]),
+                        argc > 3 ? std::stoul(argv[3]) : 64,
+                        argc > 4 ? argv[4] : "");
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // poly_reg --select-degree <max degree> [folds]
+  size_t select_degree = 0;
+  size_t folds = 5;
+  if (argc > 2 && std::string(argv[1]) == "--select-degree") {
+    select_degree = std::stoul(argv[2]);
+    if (argc > 3)
+      folds = std::stoul(argv[3]);
+  }
+
   // Download the data
   const std::string data_path{"web_traffic.tsv"};
   if (!fs::exists(data_path)) {
@@ -160,33 +527,18 @@ int main() {
   }
 
   // Read the data
-  io::CSVReader<2, io::trim_chars<' '>, io::no_quote_escape<'\t'>> data_tsv(
-      data_path);
-
-  std::vector<DType> raw_data_x;
-  std::vector<DType> raw_data_y;
-
-  bool done = false;
-  do {
-    try {
-      DType x = 0, y = 0;
-      done = !data_tsv.read_row(x, y);
-      if (!done) {
-        raw_data_x.push_back(x);
-        raw_data_y.push_back(y);
-      }
-    } catch (const io::error::no_digit& err) {
-      // ignore bad formated samples
-      std::cout << err.what() << std::endl;
-    }
-  } while (!done);
+  auto data = utils::LoadTsv<DType>(data_path, 2);
+  if (data.invalid_rows > 0)
+    std::cout << "Skipped bad formated rows : " << data.invalid_rows
+              << std::endl;
 
-  // shuffle data
+  // shuffle data, all columns with the same permutation
   size_t seed = 3465467546;
-  std::shuffle(raw_data_x.begin(), raw_data_x.end(),
-               std::default_random_engine(seed));
-  std::shuffle(raw_data_y.begin(), raw_data_y.end(),
-               std::default_random_engine(seed));
+  data.Shuffle(seed);
+  std::vector<DType>& raw_data_x = data.columns[0];
+  std::vector<DType>& raw_data_y = data.columns[1];
+  if (select_degree > 0)
+    return select_main(raw_data_x, raw_data_y, select_degree, folds);
 
   // map data to the tensor
   size_t rows = raw_data_x.size();
@@ -204,15 +556,23 @@ int main() {
 
   // poly line
   auto poly_model_eq = make_regression_model(data_x, data_y, 64, true);
-  Matrix poly_line_values_eq = poly_model_eq(new_x);
+  Matrix poly_line_values_eq = predict(poly_model_eq, new_x);
+  if (!model_path.empty()) {
+    try {
+      poly_model_eq.Save(model_path);
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
 
   // poly line
   auto poly_model = make_regression_model(data_x, data_y, 10, false);
-  Matrix poly_line_values = poly_model(new_x);
+  Matrix poly_line_values = predict(poly_model, new_x);
 
   // straight line
   auto line_model = make_regression_model(data_x, data_y, 2, false);
-  Matrix line_values = line_model(new_x);
+  Matrix line_values = predict(line_model, new_x);
 
   // create adaptors with STL like interfaces
   auto x_coord = xt::view(new_x, xt::all());
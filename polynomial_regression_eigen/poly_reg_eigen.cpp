@@ -3,9 +3,11 @@
  */
 
 // third party includes
-#include <csv.h>
 #include <plot.h>
 #include <Eigen/Dense>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // stl includes
 #include <algorithm>
@@ -13,9 +15,15 @@
 #include <iostream>
 #include <random>
 #include <string>
+#include <thread>
 
 // application includes
+#include "../crossval.h"
 #include "../ioutils.h"
+#include "../polymodel.h"
+#include "../regbench.h"
+#include "../streamfit.h"
+#include "../tsvloader.h"
 #include "../utils.h"
 
 // Namespace and type aliases
@@ -33,32 +41,26 @@ auto standardize(const Matrix& v) {
   return std::make_tuple(sv, m(0, 0), sd);
 }
 
+// Powers are built by repeated multiplication of the previous column
 auto generate_polynomial(const Matrix& x, size_t degree) {
   assert(x.cols() == 1);
   auto rows = x.rows();
 
-  Matrix poly_x = Matrix::Zero(rows, degree);
+  Matrix poly_x(rows, degree);
   // fill additional column for simpler vectorization
-  {
-    auto xv = poly_x.block(0, 0, rows, 1);
-    xv.setOnes();
-  }
-  // copy initial data
-  {
-    auto xv = poly_x.block(0, 1, rows, 1);
-    xv = x;
-  }
-  // generate additional terms
-  for (size_t i = 2; i < degree; ++i) {
-    auto xv = poly_x.block(0, i, rows, 1);
-    xv = x.array().pow(static_cast<DType>(i));
+  if (degree > 0)
+    poly_x.col(0).setOnes();
+  // generate the terms, the first one is the initial data
+  for (size_t i = 1; i < degree; ++i) {
+    poly_x.col(i) = poly_x.col(i - 1).cwiseProduct(x);
   }
   return poly_x;
 }
 
-auto bgd(const Matrix& x, const Matrix& y) {
+// The error, the gradient and the residuals live in buffers allocated once,
+// products are evaluated into them without temporaries
+auto bgd(const Matrix& x, const Matrix& y, size_t n_epochs = 1000) {
   size_t batch_size = 8;
-  size_t n_epochs = 1000;
   DType lr = 0.0015;
 
   auto rows = x.rows();
@@ -66,6 +68,10 @@ auto bgd(const Matrix& x, const Matrix& y) {
 
   size_t batches = rows / batch_size;  // some samples will be skipped
   Matrix b = Matrix::Zero(cols, 1);
+  Matrix error(batch_size, 1);
+  Matrix grad(cols, 1);
+  Matrix residual(rows, 1);
+  const DType step = lr / static_cast<DType>(batch_size);
 
   DType prev_cost = std::numeric_limits<DType>::max();
   for (size_t i = 0; i < n_epochs; ++i) {
@@ -74,16 +80,17 @@ auto bgd(const Matrix& x, const Matrix& y) {
       auto batch_x = x.block(s, 0, batch_size, cols);
       auto batch_y = y.block(s, 0, batch_size, 1);
 
-      auto yhat = batch_x * b;
-      auto error = yhat - batch_y;
+      error.noalias() = batch_x * b;
+      error -= batch_y;
 
-      auto grad =
-          (batch_x.transpose() * error) / static_cast<DType>(batch_size);
+      grad.noalias() = batch_x.transpose() * error;
 
-      b = b - lr * grad;
+      b.noalias() -= step * grad;
     }
 
-    DType cost = (y - x * b).array().pow(2.f).sum() / static_cast<DType>(rows);
+    residual.noalias() = x * b;
+    residual -= y;
+    DType cost = residual.squaredNorm() / static_cast<DType>(rows);
 
     std::cout << "BGD iteration : " << i << " Cost = " << cost << std::endl;
     if (cost <= prev_cost)
@@ -94,7 +101,195 @@ auto bgd(const Matrix& x, const Matrix& y) {
   return b;
 }
 
-int main() {
+// X^T*X by rank updates of the lower triangle with blocks of rows, every
+// OpenMP thread updates its own matrix and they are summed. Only the lower
+// triangle is set.
+Matrix gram_matrix(const Matrix& x) {
+  const auto rows = x.rows();
+  const auto cols = x.cols();
+  const Eigen::Index block_rows = 4096;
+  Matrix xtx = Matrix::Zero(cols, cols);
+#pragma omp parallel
+  {
+    Matrix part = Matrix::Zero(cols, cols);
+#pragma omp for schedule(static) nowait
+    for (Eigen::Index s = 0; s < rows; s += block_rows) {
+      auto n = std::min(block_rows, rows - s);
+      part.selfadjointView<Eigen::Lower>().rankUpdate(
+          x.middleRows(s, n).transpose());
+    }
+#pragma omp critical
+    xtx += part;
+  }
+  return xtx;
+}
+
+Matrix solve_normal_equation(const Matrix& x, const Matrix& y) {
+  Matrix xtx = gram_matrix(x);
+  Matrix xty = x.transpose() * y;
+  return xtx.selfadjointView<Eigen::Lower>().ldlt().solve(xty);
+}
+
+// The model of the coefficients b of the powers of
+// z = (x - x_mean) / x_sd * scale fitted to y' = (y - y_mean) / y_sd * scale
+utils::PolynomialModel make_model(const Matrix& b,
+                                  DType x_mean,
+                                  DType x_sd,
+                                  DType y_mean,
+                                  DType y_sd,
+                                  DType scale) {
+  return utils::PolynomialModel({b.data(), b.data() + b.rows()}, x_mean,
+                                scale / x_sd, y_mean, y_sd / scale);
+}
+
+// Times the steps of the fit on synthetic data, see regbench.h, the plain
+// normal equation is compared with the rank update one
+int bench_main(size_t rows, size_t p_degree, const std::string& json_file) {
+  std::cout << "Rows : " << rows << " degree : " << p_degree
+            << " threads : " << Eigen::nbThreads() << std::endl;
+  auto data = utils::SyntheticRegressionData<DType>(rows);
+  utils::BenchReport report("eigen", rows, p_degree, json_file);
+  const auto n = static_cast<Eigen::Index>(rows);
+  const auto data_x = Eigen::Map<Matrix>(data.first.data(), n, 1);
+  const auto data_y = Eigen::Map<Matrix>(data.second.data(), n, 1);
+
+  const DType scale = 0.6;
+  Matrix x, y;
+  DType xm{0}, xsd{0}, ym{0}, ysd{0};
+  report.Measure("standardize", [&]() {
+    std::tie(x, xm, xsd) = standardize(data_x);
+    std::tie(y, ym, ysd) = standardize(data_y);
+    x *= scale;
+    y *= scale;
+  });
+  Matrix poly_x;
+  report.Measure("generate_polynomial",
+                 [&]() { poly_x = generate_polynomial(x, p_degree); });
+  Matrix b_plain;
+  report.Measure("normal_equation_plain", [&]() {
+    b_plain =
+        (poly_x.transpose() * poly_x).ldlt().solve(poly_x.transpose() * y);
+  });
+  Matrix b_fast;
+  report.Measure("normal_equation",
+                 [&]() { b_fast = solve_normal_equation(poly_x, y); });
+  report.Measure("bgd_epoch", [&]() { bgd(poly_x, y, 1); });
+  auto model = make_model(b_fast, xm, xsd, ym, ysd, scale);
+  std::vector<DType> new_y(rows);
+  report.Measure("predict", [&]() {
+    model.Predict(data.first.data(), rows, new_y.data());
+  });
+  std::cout << "solutions difference : " << (b_plain - b_fast).norm()
+            << std::endl;
+  return 0;
+}
+
+// Streaming mode for the files of any size: the normal equation is built
+// from the sums of the powers, see streamfit.h, only the approximation is
+// plotted
+int stream_main(const std::string& path, size_t threads) {
+  size_t p_degree = 64;
+  const DType scale = 0.6;
+  auto stats = utils::StreamPolynomialStats(path, p_degree, threads, scale);
+  const auto& sums = stats.sums;
+  std::cout << "Streamed rows : " << sums.count << std::endl;
+
+  const auto d = static_cast<Eigen::Index>(p_degree);
+  Eigen::Map<const Matrix> xtx(sums.ptp.data(), d, d);
+  Eigen::Map<const Matrix> xty(sums.pty.data(), d, 1);
+  Matrix b_eq = xtx.ldlt().solve(xty);
+  std::vector<DType> b_values(b_eq.data(), b_eq.data() + d);
+  std::cout << "cost for normal equation solution : "
+            << utils::NormalEquationCost(sums.ptp, sums.pty, sums.yty,
+                                         sums.count, b_values)
+            << std::endl;
+
+  // make predictions with the scaling of the training data
+  auto model = make_model(b_eq, stats.x.mean, stats.x.Sd(), stats.y.mean,
+                          stats.y.Sd(), scale);
+  const size_t new_x_size = 500;
+  std::vector<DType> x_coord(new_x_size);
+  auto new_x = Eigen::Map<Matrix>(x_coord.data(), new_x_size, 1);
+  new_x = Eigen::Matrix<DType, Eigen::Dynamic, 1>::LinSpaced(
+      new_x_size, stats.x.min, stats.x.max);
+  auto polyline_eq = model.Predict(x_coord);
+
+  plotcpp::Plot plt(true);
+  plt.SetTerminal("qt");
+  plt.SetTitle("Web traffic");
+  plt.SetXLabel("Time");
+  plt.SetYLabel("Hits/hour");
+  plt.SetAutoscale();
+  plt.GnuplotCommand("set grid");
+  plt.Draw2D(plotcpp::Lines(x_coord.begin(), x_coord.end(), polyline_eq.begin(),
+                            "neq approx", "lc rgb 'red' lw 2"));
+  plt.Flush();
+  return 0;
+}
+
+// Cross validation of the degrees up to max_degree, see crossval.h
+int select_main(const std::vector<DType>& x,
+                const std::vector<DType>& y,
+                size_t max_degree,
+                size_t folds) {
+  auto scores = utils::CrossValidateDegrees(
+      x, y, max_degree, folds, std::thread::hardware_concurrency());
+  utils::PrintDegreeScores(scores);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // --threads <n> is taken by Eigen and the OpenMP loops, the default is the
+  // number of OpenMP threads
+  std::vector<std::string> args(argv, argv + argc);
+  auto threads_arg = std::find(args.begin(), args.end(), "--threads");
+  if (threads_arg != args.end() && threads_arg + 1 != args.end()) {
+    auto threads = std::stoi(*(threads_arg + 1));
+    Eigen::setNbThreads(threads);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    args.erase(threads_arg, threads_arg + 2);
+  }
+
+  // poly_reg_eigen --bench <rows> [degree] [json file]
+  if (args.size() > 2 && args[1] == "--bench") {
+    try {
+      return bench_main(std::stoul(args[2]),
+                        args.size() > 3 ? std::stoul(args[3]) : 64,
+                        args.size() > 4 ? args[4] : "");
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // poly_reg_eigen --stream <file.tsv> [threads]
+  if (args.size() > 2 && args[1] == "--stream") {
+    size_t threads = args.size() > 3 ? std::stoul(args[3])
+                                     : std::thread::hardware_concurrency();
+    try {
+      return stream_main(args[2], std::max<size_t>(threads, 1));
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // poly_reg_eigen [--save-model <file>] saves the normal equation model
+  std::string model_path;
+  if (args.size() > 2 && args[1] == "--save-model")
+    model_path = args[2];
+
+  // poly_reg_eigen --select-degree <max degree> [folds]
+  size_t select_degree = 0;
+  size_t folds = 5;
+  if (args.size() > 2 && args[1] == "--select-degree") {
+    select_degree = std::stoul(args[2]);
+    if (args.size() > 3)
+      folds = std::stoul(args[3]);
+  }
+
   // Download the data
   const std::string data_path{"web_traffic.tsv"};
   if (!fs::exists(data_path)) {
@@ -107,40 +302,27 @@ int main() {
   }
 
   // Read the data
-  io::CSVReader<2, io::trim_chars<' '>, io::no_quote_escape<'\t'>> data_tsv(
-      data_path);
+  auto data = utils::LoadTsv<DType>(data_path, 2);
+  if (data.invalid_rows > 0)
+    std::cout << "Skipped bad formated rows : " << data.invalid_rows
+              << std::endl;
 
-  std::vector<DType> raw_data_x;
-  std::vector<DType> raw_data_y;
-
-  bool done = false;
-  do {
-    try {
-      DType x = 0, y = 0;
-      done = !data_tsv.read_row(x, y);
-      if (!done) {
-        raw_data_x.push_back(x);
-        raw_data_y.push_back(y);
-      }
-    } catch (const io::error::no_digit& err) {
-      // ignore bad formated samples
-      std::cout << err.what() << std::endl;
-    }
-  } while (!done);
-
-  // shuffle data
+  // shuffle data, all columns with the same permutation
   size_t seed = 3465467546;
-  std::shuffle(raw_data_x.begin(), raw_data_x.end(),
-               std::default_random_engine(seed));
-  std::shuffle(raw_data_y.begin(), raw_data_y.end(),
-               std::default_random_engine(seed));
+  data.Shuffle(seed);
+  std::vector<DType>& raw_data_x = data.columns[0];
+  std::vector<DType>& raw_data_y = data.columns[1];
+  if (select_degree > 0)
+    return select_main(raw_data_x, raw_data_y, select_degree, folds);
 
   // map data to the tensor
   size_t rows = raw_data_x.size();
   const auto data_x = Eigen::Map<Matrix>(raw_data_x.data(), rows, 1);
   std::cout << "X shape " << data_x.rows() << ":" << data_x.cols() << std::endl;
   Matrix x;
-  std::tie(x, std::ignore, std::ignore) = standardize(data_x);
+  DType xm{0};
+  DType xsd{0};
+  std::tie(x, xm, xsd) = standardize(data_x);
 
   const auto data_y = Eigen::Map<Matrix>(raw_data_y.data(), rows, 1);
   std::cout << "Y shape " << data_y.rows() << ":" << data_y.cols() << std::endl;
@@ -158,8 +340,7 @@ int main() {
 
   // solve normal equation
   Matrix poly_x = generate_polynomial(x, p_degree);
-  Matrix b_eq =
-      (poly_x.transpose() * poly_x).ldlt().solve(poly_x.transpose() * y);
+  Matrix b_eq = solve_normal_equation(poly_x, y);
   auto cost =
       (y - poly_x * b_eq).array().pow(2.f).sum() / static_cast<DType>(rows);
   std::cout << "cost for normal equation solution : " << cost << std::endl;
@@ -173,26 +354,19 @@ int main() {
   auto new_x = Eigen::Map<Matrix>(x_coord.data(), new_x_size, 1);
   new_x = Eigen::Matrix<DType, Eigen::Dynamic, 1>::LinSpaced(
       new_x_size, data_x.minCoeff(), data_x.maxCoeff());
-  Matrix new_x_std;
-  std::tie(new_x_std, std::ignore, std::ignore) = standardize(new_x);
-  new_x_std *= scale;
-  Matrix new_poly_x = generate_polynomial(new_x_std, p_degree);
-
-  // make predictions
-  std::vector<DType> polyline_eq(new_x_size);
-  auto new_y_eq = Eigen::Map<Matrix>(polyline_eq.data(), new_x_size, 1);
-  new_y_eq = new_poly_x * b_eq;
-
-  std::vector<DType> polyline(new_x_size);
-  auto new_y = Eigen::Map<Matrix>(polyline.data(), new_x_size, 1);
-  new_y = new_poly_x * b;
-
-  // restore scalenew_y
-  new_y_eq /= scale;
-  new_y_eq = (new_y_eq * ysd).array() + ym;
-
-  new_y /= scale;
-  new_y = (new_y * ysd).array() + ym;
+
+  // make predictions with the scaling of the training data
+  auto model_eq = make_model(b_eq, xm, xsd, ym, ysd, scale);
+  auto polyline_eq = model_eq.Predict(x_coord);
+  auto polyline = make_model(b, xm, xsd, ym, ysd, scale).Predict(x_coord);
+  if (!model_path.empty()) {
+    try {
+      model_eq.Save(model_path);
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
 
   // plot the data we read and approximate
   plotcpp::Plot plt(true);
@@ -2,7 +2,13 @@
 #define COMMON_H
 
 #include <mshadow/tensor.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <vector>
+
+#include "../npydump.h"
 
 template <typename Device>
 struct ScopedTensorEngine {
@@ -12,15 +18,126 @@ struct ScopedTensorEngine {
   ScopedTensorEngine& operator=(const ScopedTensorEngine&) = delete;
 };
 
-template <typename DType, typename Tensor>
-void print_tensor(Tensor const& tensor, char const* label) {
-  std::vector<DType> values(tensor.shape_.Size());
-  mshadow::Tensor<mshadow::cpu, Tensor::kSubdim + 1, DType> cpu_tensor(
-      values.data(), tensor.shape_);
+// Host memory for the copies from and to the Device. It is page-locked for
+// the GPU, only such copies are asynchronous and overlap with the kernels.
+template <typename Device, typename DType>
+class HostBuffer {
+ public:
+  explicit HostBuffer(size_t size) : data_(size) {}
+
+  DType* data() { return data_.data(); }
+  size_t size() const { return data_.size(); }
+
+  mshadow::Tensor<mshadow::cpu, 2, DType> column() {
+    return mshadow::Tensor<mshadow::cpu, 2, DType>(data(),
+                                                   mshadow::Shape2(size(), 1));
+  }
+
+ private:
+  std::vector<DType> data_;
+};
+
+// Marks a point of the stream, the host or other streams can wait for it.
+// Host streams are synchronous, so there is nothing to wait for.
+template <typename Device>
+class StreamEvent {
+ public:
+  void Record(mshadow::Stream<Device>*) {}
+  void Block(mshadow::Stream<Device>*) {}
+  void Wait() {}
+};
+
+#ifdef __CUDACC__
+template <typename DType>
+class HostBuffer<mshadow::gpu, DType> {
+ public:
+  explicit HostBuffer(size_t size) : size_(size) {
+    auto bytes = std::max<size_t>(size, 1) * sizeof(DType);
+    MSHADOW_CUDA_CALL(
+        cudaMallocHost(reinterpret_cast<void**>(&data_), bytes));
+  }
+  ~HostBuffer() { cudaFreeHost(data_); }
+  HostBuffer(const HostBuffer&) = delete;
+  HostBuffer& operator=(const HostBuffer&) = delete;
+
+  DType* data() { return data_; }
+  size_t size() const { return size_; }
+
+  mshadow::Tensor<mshadow::cpu, 2, DType> column() {
+    return mshadow::Tensor<mshadow::cpu, 2, DType>(data(),
+                                                   mshadow::Shape2(size(), 1));
+  }
+
+ private:
+  DType* data_{nullptr};
+  size_t size_{0};
+};
+
+template <>
+class StreamEvent<mshadow::gpu> {
+ public:
+  StreamEvent() {
+    MSHADOW_CUDA_CALL(
+        cudaEventCreateWithFlags(&event_, cudaEventDisableTiming));
+  }
+  ~StreamEvent() { cudaEventDestroy(event_); }
+  StreamEvent(const StreamEvent&) = delete;
+  StreamEvent& operator=(const StreamEvent&) = delete;
+
+  void Record(mshadow::Stream<mshadow::gpu>* stream) {
+    MSHADOW_CUDA_CALL(cudaEventRecord(
+        event_, mshadow::Stream<mshadow::gpu>::GetStream(stream)));
+  }
+  // The later work of the stream waits for the event, the host doesn't
+  void Block(mshadow::Stream<mshadow::gpu>* stream) {
+    MSHADOW_CUDA_CALL(cudaStreamWaitEvent(
+        mshadow::Stream<mshadow::gpu>::GetStream(stream), event_, 0));
+  }
+  void Wait() { MSHADOW_CUDA_CALL(cudaEventSynchronize(event_)); }
+
+ private:
+  cudaEvent_t event_;
+};
+#endif
+
+template <typename DType, typename Device, int dim>
+void print_tensor(mshadow::Tensor<Device, dim, DType> const& tensor,
+                  char const* label) {
+  HostBuffer<Device, DType> buffer(tensor.shape_.Size());
+  mshadow::Tensor<mshadow::cpu, dim, DType> cpu_tensor(
+      buffer.data(), tensor.shape_);
   mshadow::Copy(cpu_tensor, tensor, tensor.stream_);
+  if (tensor.stream_ != nullptr)
+    tensor.stream_->Wait();
+  std::vector<DType> values(buffer.data(), buffer.data() + buffer.size());
   std::cout << label << " :\n" << values << std::endl;
 }
 
+// Writes the tensor to the .npy file in the background, unlike print_tensor
+// the host doesn't wait for the copy, the writer thread does
+template <typename DType, typename Device, int dim>
+void dump_tensor(mshadow::Tensor<Device, dim, DType> const& tensor,
+                 char const* file_name) {
+  auto buffer =
+      std::make_shared<HostBuffer<Device, DType>>(tensor.shape_.Size());
+  mshadow::Tensor<mshadow::cpu, dim, DType> cpu_tensor(buffer->data(),
+                                                       tensor.shape_);
+  mshadow::Copy(cpu_tensor, tensor, tensor.stream_);
+  auto copied = std::make_shared<StreamEvent<Device>>();
+  copied->Record(tensor.stream_);
+
+  utils::NpyWriter::Dump dump;
+  dump.file_name = file_name;
+  dump.descr = utils::NpyDescr<DType>();
+  for (int i = 0; i < dim; ++i)
+    dump.shape.push_back(tensor.shape_[i]);
+  dump.data = buffer->data();
+  dump.bytes = buffer->size() * sizeof(DType);
+  dump.owner = buffer;
+  dump.wait = [copied]() { copied->Wait(); };
+  utils::DefaultNpyWriter().Push(std::move(dump));
+}
+
 struct Pow {
   template <typename DType>
   MSHADOW_XINLINE static float Map(DType x, DType y) {
@@ -35,13 +152,14 @@ struct Sqrt {
   }
 };
 
+// Both values are reduced into one tensor and read back with one copy
 template <typename Device, typename DType>
 auto get_min_max(mshadow::Tensor<Device, 2, DType> const& tensor) {
   using Tensor = mshadow::Tensor<Device, 2, DType>;
-  mshadow::TensorContainer<Device, 1, DType> min(mshadow::Shape1(1));
-  min.set_stream(tensor.stream_);
-  mshadow::TensorContainer<Device, 1, DType> max(mshadow::Shape1(1));
-  max.set_stream(tensor.stream_);
+  mshadow::TensorContainer<Device, 1, DType> min_max(mshadow::Shape1(2));
+  min_max.set_stream(tensor.stream_);
+  auto min = min_max.Slice(0, 1);
+  auto max = min_max.Slice(1, 2);
 
   min = mshadow::expr::ReduceTo1DExp<Tensor, DType, mshadow::red::minimum,
                                      mshadow::expr::ExpInfo<Tensor>::kDim - 1>(
@@ -50,12 +168,32 @@ auto get_min_max(mshadow::Tensor<Device, 2, DType> const& tensor) {
                                      mshadow::expr::ExpInfo<Tensor>::kDim - 1>(
       tensor, DType(1));
 
-  mshadow::TensorContainer<mshadow::cpu, 1, DType> value(mshadow::Shape1(1));
-  mshadow::Copy(value, min, tensor.stream_);
-  DType v_min = value[0];
-  mshadow::Copy(value, max, tensor.stream_);
-  DType v_max = value[0];
-  return std::make_pair(v_min, v_max);
+  HostBuffer<Device, DType> value(2);
+  mshadow::Tensor<mshadow::cpu, 1, DType> host_value(value.data(),
+                                                     mshadow::Shape1(2));
+  mshadow::Copy(host_value, min_max, tensor.stream_);
+  if (tensor.stream_ != nullptr)
+    tensor.stream_->Wait();
+  return std::make_pair(value.data()[0], value.data()[1]);
+}
+
+// Uploads the values on the copy stream through the staging buffer and
+// records the event after the copy. The copy is asynchronous, so the staging
+// buffer must live until the event passes, the compute stream should Block
+// on the event before using dst.
+template <typename Device, typename DType>
+void load_data(std::vector<DType> const& raw_data,
+               mshadow::TensorContainer<Device, 2, DType>& dst,
+               HostBuffer<Device, DType>& staging,
+               mshadow::Stream<Device>* copy_stream,
+               StreamEvent<Device>& done) {
+  assert(staging.size() == raw_data.size());
+  std::memcpy(staging.data(), raw_data.data(),
+              raw_data.size() * sizeof(DType));
+  auto host_data = staging.column();
+  dst.Resize(host_data.shape_);
+  mshadow::Copy(dst, host_data, copy_stream);
+  done.Record(copy_stream);
 }
 
 template <typename Device, typename DType>
@@ -4,18 +4,111 @@
 #include <mshadow/tensor.h>
 #include "common.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __CUDACC__
+// One epoch of the mini-batch AdaDelta in one launch. A single block walks
+// the batches in order because every batch depends on the weights of the
+// previous one. Thread j keeps the weight j and its AdaDelta state in the
+// registers, the weights and the errors of the batch are shared.
+template <typename DType>
+__global__ void AdaDeltaEpochKernel(const DType* x,
+                                    int x_stride,
+                                    const DType* y,
+                                    int y_stride,
+                                    int n_batches,
+                                    int batch_size,
+                                    int cols,
+                                    DType lr,
+                                    DType e,
+                                    DType* weights,
+                                    int weights_stride,
+                                    DType* eg_sum,
+                                    int eg_stride,
+                                    DType* ex_sum,
+                                    int ex_stride) {
+  extern __shared__ unsigned char shared[];
+  DType* w = reinterpret_cast<DType*>(shared);
+  DType* error = w + cols;
+  const int j = threadIdx.x;
+  DType wj = 0, eg = 0, ex = 0;
+  if (j < cols) {
+    wj = weights[j * weights_stride];
+    eg = eg_sum[j * eg_stride];
+    ex = ex_sum[j * ex_stride];
+    w[j] = wj;
+  }
+  __syncthreads();
+  for (int b = 0; b < n_batches; ++b) {
+    const DType* batch_x = x + b * batch_size * x_stride;
+    const DType* batch_y = y + b * batch_size * y_stride;
+    // error = batch_x * w - batch_y
+    for (int k = j; k < batch_size; k += blockDim.x) {
+      DType yhat = 0;
+      for (int c = 0; c < cols; ++c)
+        yhat += batch_x[k * x_stride + c] * w[c];
+      error[k] = yhat - batch_y[k * y_stride];
+    }
+    __syncthreads();
+    if (j < cols) {
+      DType grad = 0;
+      for (int k = 0; k < batch_size; ++k)
+        grad += batch_x[k * x_stride + j] * error[k];
+      grad /= batch_size;
+      eg = lr * eg + (1 - lr) * grad * grad;
+      DType delta = -(sqrt(ex + e) / sqrt(eg + e)) * grad;
+      ex = lr * ex + (1 - lr) * delta * delta;
+      wj += delta;
+    }
+    __syncthreads();
+    if (j < cols)
+      w[j] = wj;
+    __syncthreads();
+  }
+  if (j < cols) {
+    weights[j * weights_stride] = wj;
+    eg_sum[j * eg_stride] = eg;
+    ex_sum[j * ex_stride] = ex;
+  }
+}
+#endif
 
 template <typename Device, typename DType>
 class Optimizer {
  public:
   Optimizer() {}
 
+  void set_epochs(size_t epochs) { n_epochs = std::max<size_t>(epochs, 1); }
+
+  void set_batch_size(size_t size) { batch_size = std::max<size_t>(size, 1); }
+
+  // Data parallel training: every mini-batch is split into equal shards, one
+  // per stream, the partial gradients are computed on the streams
+  // concurrently and summed before the update. The streams need BLAS handles,
+  // the rows of the batch which don't fill a shard are skipped.
+  void set_shard_streams(std::vector<mshadow::Stream<Device>*> const& streams) {
+    shard_streams = streams;
+  }
+
   void predict(mshadow::Tensor<Device, 2, DType> const& x,
                mshadow::Tensor<Device, 2, DType>& y) {
     y = mshadow::expr::dot(x, weights);
   }
 
+  std::vector<DType> get_weights() {
+    std::vector<DType> values(weights.shape_[0]);
+    mshadow::Tensor<mshadow::cpu, 2, DType> host_weights(
+        values.data(), mshadow::Shape2(values.size(), 1));
+    mshadow::Copy(host_weights, weights, weights.stream_);
+    if (weights.stream_ != nullptr)
+      weights.stream_->Wait();
+    return values;
+  }
+
   void fit(mshadow::Tensor<Device, 2, DType> const& x,
            mshadow::Tensor<Device, 2, DType> const& y) {
     assert(y.shape_.kDimension == 2);
@@ -44,7 +137,8 @@ class Optimizer {
     error_total.Resize(mshadow::Shape2(rows, 1));
     error_total.set_stream(x.stream_);
 
-    error_total_cpu.Resize(mshadow::Shape2(rows, 1));
+    cost_sum.Resize(mshadow::Shape1(1));
+    cost_sum.set_stream(x.stream_);
 
     eg_sum.Resize(mshadow::Shape2(cols, 1));
     eg_sum.set_stream(x.stream_);
@@ -57,55 +151,143 @@ class Optimizer {
     ex_sum.set_stream(x.stream_);
     ex_sum = 0.f;
 
-    // gradient descent
+    shard_rows = batch_size / std::max<size_t>(shard_streams.size(), 1);
+    if (!shard_streams.empty() && shard_rows == 0)
+      throw std::invalid_argument("Batch size is less than the streams number");
+    shard_yhat.resize(shard_streams.size());
+    shard_grad.resize(shard_streams.size());
+    for (size_t s = 0; s < shard_streams.size(); ++s) {
+      shard_yhat[s].set_stream(shard_streams[s]);
+      shard_yhat[s].Resize(mshadow::Shape2(shard_rows, 1));
+      shard_grad[s].set_stream(shard_streams[s]);
+      shard_grad[s].Resize(mshadow::Shape2(cols, 1));
+    }
+
+    // gradient descent, the cost is checked every cost_interval epochs
+    DType prev_cost = std::numeric_limits<DType>::max();
     for (size_t epoch = 0; epoch < n_epochs; ++epoch) {
-      for (size_t bi = 0; bi < n_batches; ++bi) {
-        auto bs = bi * batch_size;
-        auto be = bs + batch_size;
-        auto batch_x = x.Slice(bs, be);
-        auto batch_y = y.Slice(bs, be);
-
-        // Print weights
-        // print_tensor<DType>(weights, "weights");
-
-        predict(batch_x, yhat);
-
-        error = yhat - batch_y;
-        grad = mshadow::expr::dot(batch_x.T(), error);
-        grad /= batch_size;
-
-        // print_tensor<DType>(grad, "grad");
-        // print_tensor<DType>(error, "error");
-
-        // AdaDelta
-        eg_sum = lr * eg_sum + (1.f - lr) * mshadow::expr::F<Pow>(grad, 2);
-        weights_delta = -1.f *
-                        (mshadow::expr::F<Sqrt>(ex_sum + e) /
-                         mshadow::expr::F<Sqrt>(eg_sum + e)) *
-                        grad;
-        ex_sum =
-            lr * ex_sum + (1.f - lr) * mshadow::expr::F<Pow>(weights_delta, 2);
-        weights = weights + weights_delta;
-
-        // BGD
-        // weights = weights - (lr * grad);
-      }
-      // compute cost
-      error_total = mshadow::expr::dot(x, weights);
-      error_total = mshadow::expr::F<Pow>(error_total - y, 2);
-
-      mshadow::Copy(error_total_cpu, error_total, error_total.stream_);
-      long double cost = 0;
-      for (size_t r = 0; r < rows; ++r)
-        cost += error_total_cpu[r][0];
-      cost /= rows;
-      std::cout << "Epoch " << epoch << " cost = " << cost << std::endl;
+      if (shard_streams.empty())
+        train_epoch(x, y, n_batches);
+      else
+        train_epoch_sharded(x, y, n_batches);
+      if ((epoch + 1) % cost_interval != 0 && epoch + 1 != n_epochs)
+        continue;
+      auto cost = compute_cost(x, y);
+      // not flushed, the output doesn't wait for the terminal
+      std::cout << "Epoch " << epoch << " cost = " << cost << "\n";
+      if (cost <= prev_cost)
+        prev_cost = cost;
+      else
+        break;  // early stopping
     }
+    std::cout.flush();
   }
 
  private:
+  // Mean squared error reduced on the device, only the scalar is read back
+  DType compute_cost(mshadow::Tensor<Device, 2, DType> const& x,
+                     mshadow::Tensor<Device, 2, DType> const& y) {
+    using Tensor = mshadow::Tensor<Device, 2, DType>;
+    error_total = mshadow::expr::dot(x, weights);
+    error_total = mshadow::expr::F<Pow>(error_total - y, 2);
+    cost_sum =
+        mshadow::expr::ReduceTo1DExp<Tensor, DType, mshadow::red::sum,
+                                     mshadow::expr::ExpInfo<Tensor>::kDim - 1>(
+            error_total, DType(1) / x.shape_[0]);
+    mshadow::Copy(cost_cpu, cost_sum, x.stream_);
+    if (x.stream_ != nullptr)
+      x.stream_->Wait();
+    return cost_cpu[0];
+  }
+
+  // AdaDelta over the mini-batches of one epoch with tensor expressions
+  void train_epoch(mshadow::Tensor<mshadow::cpu, 2, DType> const& x,
+                   mshadow::Tensor<mshadow::cpu, 2, DType> const& y,
+                   size_t n_batches) {
+    for (size_t bi = 0; bi < n_batches; ++bi) {
+      auto bs = bi * batch_size;
+      auto be = bs + batch_size;
+      auto batch_x = x.Slice(bs, be);
+      auto batch_y = y.Slice(bs, be);
+
+      predict(batch_x, yhat);
+
+      error = yhat - batch_y;
+      grad = mshadow::expr::dot(batch_x.T(), error);
+      grad /= batch_size;
+
+      adadelta_update();
+
+      // BGD
+      // weights = weights - (lr * grad);
+    }
+  }
+
+  void train_epoch_sharded(mshadow::Tensor<Device, 2, DType> const& x,
+                           mshadow::Tensor<Device, 2, DType> const& y,
+                           size_t n_batches) {
+    const auto shards = shard_streams.size();
+    for (size_t bi = 0; bi < n_batches; ++bi) {
+      // the shards read the weights of the previous update
+      if (x.stream_ != nullptr)
+        x.stream_->Wait();
+      for (size_t s = 0; s < shards; ++s) {
+        auto bs = bi * batch_size + s * shard_rows;
+        auto shard_x = x.Slice(bs, bs + shard_rows);
+        auto shard_y = y.Slice(bs, bs + shard_rows);
+        shard_x.set_stream(shard_streams[s]);
+        shard_y.set_stream(shard_streams[s]);
+        shard_yhat[s] = mshadow::expr::dot(shard_x, weights);
+        shard_yhat[s] -= shard_y;
+        shard_grad[s] = mshadow::expr::dot(shard_x.T(), shard_yhat[s]);
+      }
+      for (auto stream : shard_streams)
+        stream->Wait();
+
+      mshadow::Copy(grad, shard_grad[0], grad.stream_);
+      for (size_t s = 1; s < shards; ++s)
+        grad += shard_grad[s];
+      grad /= static_cast<DType>(shards * shard_rows);
+
+      adadelta_update();
+    }
+  }
+
+  void adadelta_update() {
+    eg_sum = lr * eg_sum + (1.f - lr) * mshadow::expr::F<Pow>(grad, 2);
+    weights_delta = -1.f *
+                    (mshadow::expr::F<Sqrt>(ex_sum + e) /
+                     mshadow::expr::F<Sqrt>(eg_sum + e)) *
+                    grad;
+    ex_sum =
+        lr * ex_sum + (1.f - lr) * mshadow::expr::F<Pow>(weights_delta, 2);
+    weights = weights + weights_delta;
+  }
+
+#ifdef __CUDACC__
+  // The whole epoch is one launch of the fused kernel, separate expressions
+  // would be several launches per tiny mini-batch
+  void train_epoch(mshadow::Tensor<mshadow::gpu, 2, DType> const& x,
+                   mshadow::Tensor<mshadow::gpu, 2, DType> const& y,
+                   size_t n_batches) {
+    auto cols = static_cast<int>(x.shape_[1]);
+    auto threads = std::max(cols, static_cast<int>(batch_size));
+    threads = (threads + 31) / 32 * 32;
+    auto shared_size = (cols + batch_size) * sizeof(DType);
+    AdaDeltaEpochKernel<DType>
+        <<<1, threads, shared_size,
+           mshadow::Stream<mshadow::gpu>::GetStream(x.stream_)>>>(
+            x.dptr_, x.stride_, y.dptr_, y.stride_,
+            static_cast<int>(n_batches), static_cast<int>(batch_size), cols,
+            lr, e, weights.dptr_, weights.stride_, eg_sum.dptr_,
+            eg_sum.stride_, ex_sum.dptr_, ex_sum.stride_);
+    MSHADOW_CUDA_POST_KERNEL_CHECK(AdaDeltaEpochKernel);
+  }
+#endif
+
   size_t n_epochs = 5000;
   size_t batch_size = 8;
+  size_t cost_interval = 10;
   // DType lr = 0.01;  // BGD
 
   mshadow::TensorContainer<Device, 2, DType> weights;
@@ -113,7 +295,9 @@ class Optimizer {
   mshadow::TensorContainer<Device, 2, DType> yhat;
   mshadow::TensorContainer<Device, 2, DType> error;
   mshadow::TensorContainer<Device, 2, DType> error_total;
-  mshadow::TensorContainer<mshadow::cpu, 2, DType> error_total_cpu;
+  mshadow::TensorContainer<Device, 1, DType> cost_sum;
+  mshadow::TensorContainer<mshadow::cpu, 1, DType> cost_cpu{
+      mshadow::Shape1(1)};
 
   // AdaDelta
   DType lr = 0.99;
@@ -121,6 +305,12 @@ class Optimizer {
   mshadow::TensorContainer<Device, 2, DType> eg_sum;
   mshadow::TensorContainer<Device, 2, DType> weights_delta;
   mshadow::TensorContainer<Device, 2, DType> ex_sum;
+
+  // data parallel mode
+  std::vector<mshadow::Stream<Device>*> shard_streams;
+  size_t shard_rows = 0;
+  std::vector<mshadow::TensorContainer<Device, 2, DType>> shard_yhat;
+  std::vector<mshadow::TensorContainer<Device, 2, DType>> shard_grad;
 };
 
 #endif  // OPTIMIZER_H
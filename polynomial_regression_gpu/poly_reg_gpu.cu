@@ -3,100 +3,106 @@
  */
 
 // third party includes
-#include <csv.h>
+#include <cuda_runtime.h>
 #include <mshadow/tensor.h>
 #include <plot.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // stl includes
 #include <experimental/filesystem>
 #include <iostream>
 #include <random>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 // application includes
+#include "../crossval.h"
 #include "../ioutils.h"
+#include "../polymodel.h"
+#include "../regbench.h"
+#include "../streamfit.h"
+#include "../tsvloader.h"
 #include "../utils.h"
 #include "common.h"
 #include "optimizer.h"
 #include "polynomial.h"
 #include "standardizer.h"
 
-#define USE_GPU
-
 // Namespace and type aliases
 namespace fs = std::experimental::filesystem;
-#ifdef USE_GPU  // use macros because lack of "if constexpr"
-using xpu = mshadow::gpu;
-#else
-using xpu = mshadow::cpu;
-#endif
 using DType = float;
-using GpuStream = mshadow::Stream<xpu>;
-using GpuStreamPtr = std::unique_ptr<GpuStream, void (*)(GpuStream*)>;
+template <typename Device>
+using StreamPtr = std::unique_ptr<mshadow::Stream<Device>,
+                                  void (*)(mshadow::Stream<Device>*)>;
 
-int main() {
-  // Download the data
-  const std::string data_path{"web_traffic.tsv"};
-  if (!fs::exists(data_path)) {
-    const std::string data_url{
-        R"(https://raw.githubusercontent.com/luispedro/BuildingMachineLearningSystemsWithPython/master/ch01/data/web_traffic.tsv)"};
-    if (!utils::DownloadFile(data_url, data_path)) {
-      std::cerr << "Unable to download the file " << data_url << std::endl;
-      return 1;
-    }
-  }
+// The auto mode uses the GPU for the design matrices of this many elements,
+// smaller problems are faster on the host than the launches and copies
+const size_t kGpuMinElements = 1 << 20;
 
-  // Read the data
-  io::CSVReader<2, io::trim_chars<' '>, io::no_quote_escape<'\t'>> data_tsv(
-      data_path);
+struct TrainOptions {
+  size_t p_degree = 64;
+  size_t shards = 0;
+  size_t batch_size = 0;
+  std::string model_path;
+};
 
-  std::vector<DType> raw_data_x;
-  std::vector<DType> raw_data_y;
+template <typename Device>
+StreamPtr<Device> make_stream() {
+  return StreamPtr<Device>(
+      mshadow::NewStream<Device>(true, false, -1),
+      [](mshadow::Stream<Device>* s) { mshadow::DeleteStream(s); });
+}
 
-  bool done = false;
-  do {
-    try {
-      DType x = 0, y = 0;
-      done = !data_tsv.read_row(x, y);
-      if (!done) {
-        raw_data_x.push_back(x);
-        raw_data_y.push_back(y);
-      }
-    } catch (const io::error::no_digit& err) {
-      // ignore bad formated samples
-      std::cout << err.what() << std::endl;
-    }
-  } while (!done);
+bool gpu_available() {
+  int count = 0;
+  if (cudaGetDeviceCount(&count) != cudaSuccess) {
+    cudaGetLastError();  // clear the error of the missing driver
+    return false;
+  }
+  return count > 0;
+}
 
-  // shuffle data
-  size_t seed = 25345;
-  std::shuffle(raw_data_x.begin(), raw_data_x.end(),
-               std::default_random_engine(seed));
-  std::shuffle(raw_data_y.begin(), raw_data_y.end(),
-               std::default_random_engine(seed));
+// Fits the model on the Device and returns its predictions for new_data_x
+template <typename Device>
+std::vector<DType> fit_predict(std::vector<DType> const& raw_data_x,
+                               std::vector<DType> const& raw_data_y,
+                               std::vector<DType> const& new_data_x,
+                               TrainOptions const& options) {
+  auto computeStream = make_stream<Device>();
+  auto copyStream = make_stream<Device>();
 
-  // define comupte engines
-  ScopedTensorEngine<mshadow::cpu> tensorEngineCpu;
-#ifdef USE_GPU  // use macros because lack of "if constexpr"
-  ScopedTensorEngine<mshadow::gpu> tensorEngineGpu;
-#endif
-  GpuStreamPtr computeStream(mshadow::NewStream<xpu>(true, false, -1),
-                             [](GpuStream* s) { mshadow::DeleteStream(s); });
+  // map data to the tensors, all the uploads are started at once on the copy
+  // stream and overlap with the computations
+  auto n = new_data_x.size();
+  HostBuffer<Device, DType> x_staging(raw_data_x.size());
+  HostBuffer<Device, DType> y_staging(raw_data_y.size());
+  HostBuffer<Device, DType> new_x_staging(n);
+  StreamEvent<Device> x_loaded, y_loaded, new_x_loaded;
 
-  // map data to the tensors
-  mshadow::TensorContainer<xpu, 2, DType> x;
+  mshadow::TensorContainer<Device, 2, DType> x;
   x.set_stream(computeStream.get());
-  load_data<xpu>(raw_data_x, x);
+  load_data(raw_data_x, x, x_staging, copyStream.get(), x_loaded);
 
-  mshadow::TensorContainer<xpu, 2, DType> y;
+  mshadow::TensorContainer<Device, 2, DType> y;
   y.set_stream(computeStream.get());
-  load_data<xpu>(raw_data_y, y);
+  load_data(raw_data_y, y, y_staging, copyStream.get(), y_loaded);
+
+  mshadow::TensorContainer<Device, 2, DType> new_x;
+  new_x.set_stream(computeStream.get());
+  load_data(new_data_x, new_x, new_x_staging, copyStream.get(),
+            new_x_loaded);
 
   // standardize data
   auto rows = raw_data_x.size();
-  Standardizer<xpu, DType> standardizer;
+  Standardizer<Device, DType> standardizer;
+  x_loaded.Block(computeStream.get());
   standardizer.transform(x);
+  auto x_moments = standardizer.get_moments();
+  y_loaded.Block(computeStream.get());
   standardizer.transform(y);
   auto y_moments = standardizer.get_moments();
 
@@ -107,40 +113,43 @@ int main() {
   y *= scale;
 
   // generate polynom
-  size_t p_degree = 64;
-  mshadow::TensorContainer<xpu, 2, DType> poly_x(
+  auto p_degree = options.p_degree;
+  mshadow::TensorContainer<Device, 2, DType> poly_x(
       mshadow::Shape2(rows, p_degree));
   poly_x.set_stream(computeStream.get());
   generate_polynomial(x, poly_x, p_degree);
 
   // learn polynomial regression with Batch Gradient Descent
-  Optimizer<xpu, DType> optimizer;
+  Optimizer<Device, DType> optimizer;
+  if (options.batch_size > 0)
+    optimizer.set_batch_size(options.batch_size);
+  std::vector<StreamPtr<Device>> shard_streams;
+  std::vector<mshadow::Stream<Device>*> shard_stream_ptrs;
+  for (size_t i = 0; i < options.shards; ++i) {
+    shard_streams.push_back(make_stream<Device>());
+    shard_stream_ptrs.push_back(shard_streams.back().get());
+  }
+  optimizer.set_shard_streams(shard_stream_ptrs);
   optimizer.fit(poly_x, y);
-
-  // generate new data
-  size_t n = 2000;
-  auto minmax_x = std::minmax_element(raw_data_x.begin(), raw_data_x.end());
-  auto time_range = *minmax_x.second - *minmax_x.first;
-  auto inc_step = time_range / n;
-  auto x_val = inc_step;
-  std::vector<DType> new_data_x(n);
-  for (auto& x : new_data_x) {
-    x = x_val;
-    x_val += inc_step;
+  if (!options.model_path.empty()) {
+    auto weights = optimizer.get_weights();
+    utils::PolynomialModel model({weights.begin(), weights.end()},
+                                 x_moments[0], scale / x_moments[1],
+                                 y_moments[0], y_moments[1] / scale);
+    model.Save(options.model_path);
   }
-  mshadow::TensorContainer<xpu, 2, DType> new_x(mshadow::Shape2(n, 1));
-  new_x.set_stream(computeStream.get());
-  load_data<xpu>(new_data_x, new_x);
+
+  new_x_loaded.Block(computeStream.get());
   standardizer.transform(new_x);
   new_x *= scale;
 
-  mshadow::TensorContainer<xpu, 2, DType> new_poly_x(
+  mshadow::TensorContainer<Device, 2, DType> new_poly_x(
       mshadow::Shape2(n, p_degree));
   new_poly_x.set_stream(computeStream.get());
   generate_polynomial(new_x, new_poly_x, p_degree);
 
   // make predictions
-  mshadow::TensorContainer<xpu, 2, DType> new_y(mshadow::Shape2(n, 1));
+  mshadow::TensorContainer<Device, 2, DType> new_y(mshadow::Shape2(n, 1));
   new_y.set_stream(computeStream.get());
   optimizer.predict(new_poly_x, new_y);
 
@@ -148,11 +157,295 @@ int main() {
   new_y /= scale;
   new_y = (new_y * y_moments[1]) + y_moments[0];
 
-  // get results from gpu
-  std::vector<DType> raw_pred_y(n);
-  mshadow::Tensor<mshadow::cpu, 2, DType> pred_y(raw_pred_y.data(),
-                                                 mshadow::Shape2(n, 1));
-  mshadow::Copy(pred_y, new_y, computeStream.get());
+  // get results from the device
+  HostBuffer<Device, DType> pred_staging(n);
+  StreamEvent<Device> pred_loaded;
+  mshadow::Copy(pred_staging.column(), new_y, computeStream.get());
+  pred_loaded.Record(computeStream.get());
+  pred_loaded.Wait();
+  return std::vector<DType>(pred_staging.data(), pred_staging.data() + n);
+}
+
+// Streaming mode for the files of any size: the data doesn't fit the device,
+// so the sums of the powers are reduced on the host threads, see
+// streamfit.h, and the normal equation is solved once on the host. Only the
+// approximation is plotted.
+int stream_main(const std::string& path, size_t threads) {
+  size_t p_degree = 64;
+  const double scale = 0.6;
+  auto stats = utils::StreamPolynomialStats(path, p_degree, threads, scale);
+  const auto& sums = stats.sums;
+  std::cout << "Streamed rows : " << sums.count << std::endl;
+
+  auto b = sums.pty;
+  if (!utils::SolveCholesky(sums.ptp, b)) {
+    std::cerr << "X^T*X is singular" << std::endl;
+    return 1;
+  }
+  std::cout << "cost for normal equation solution : "
+            << utils::NormalEquationCost(sums.ptp, sums.pty, sums.yty,
+                                         sums.count, b)
+            << std::endl;
+
+  // make predictions with the scaling of the training data
+  utils::PolynomialModel model(b, stats.x.mean, scale / stats.x.Sd(),
+                               stats.y.mean, stats.y.Sd() / scale);
+  size_t n = 2000;
+  std::vector<DType> new_data_x(n);
+  auto inc_step = (stats.x.max - stats.x.min) / static_cast<double>(n - 1);
+  for (size_t i = 0; i < n; ++i)
+    new_data_x[i] = static_cast<DType>(stats.x.min + inc_step * i);
+  auto raw_pred_y = model.Predict(new_data_x);
+
+  plotcpp::Plot plt(true);
+  plt.SetTerminal("qt");
+  plt.SetTitle("Web traffic");
+  plt.SetXLabel("Time");
+  plt.SetYLabel("Hits/hour");
+  plt.SetAutoscale();
+  plt.GnuplotCommand("set grid");
+  plt.Draw2D(
+      plotcpp::Lines(new_data_x.begin(), new_data_x.end(), raw_pred_y.begin(),
+                     "poly line approx", "lc rgb 'green' lw 2"));
+  plt.Flush();
+  return 0;
+}
+
+// Times the steps of the fit on synthetic data, see regbench.h. The device
+// is synchronized at the end of every step. The normal equation is solved
+// only in the streaming mode on the host, so it isn't timed here.
+template <typename Device>
+int bench_main(size_t rows,
+               TrainOptions const& options,
+               const std::string& backend,
+               const std::string& json_file) {
+  std::cout << "Rows : " << rows << " degree : " << options.p_degree
+            << std::endl;
+  auto data = utils::SyntheticRegressionData<DType>(rows);
+  utils::BenchReport report(backend, rows, options.p_degree, json_file);
+  auto stream = make_stream<Device>();
+
+  mshadow::TensorContainer<Device, 2, DType> x;
+  x.set_stream(stream.get());
+  mshadow::TensorContainer<Device, 2, DType> y;
+  y.set_stream(stream.get());
+  report.Measure("upload", [&]() {
+    load_data<Device>(data.first, x);
+    load_data<Device>(data.second, y);
+    stream->Wait();
+  });
+
+  Standardizer<Device, DType> standardizer;
+  const DType scale = 0.6;
+  report.Measure("standardize", [&]() {
+    standardizer.transform(x);
+    standardizer.transform(y);
+    x *= scale;
+    y *= scale;
+    stream->Wait();
+  });
+
+  mshadow::TensorContainer<Device, 2, DType> poly_x(
+      mshadow::Shape2(rows, options.p_degree));
+  poly_x.set_stream(stream.get());
+  report.Measure("generate_polynomial", [&]() {
+    generate_polynomial(x, poly_x, options.p_degree);
+    stream->Wait();
+  });
+
+  Optimizer<Device, DType> optimizer;
+  optimizer.set_epochs(1);
+  if (options.batch_size > 0)
+    optimizer.set_batch_size(options.batch_size);
+  std::vector<StreamPtr<Device>> shard_streams;
+  std::vector<mshadow::Stream<Device>*> shard_stream_ptrs;
+  for (size_t i = 0; i < options.shards; ++i) {
+    shard_streams.push_back(make_stream<Device>());
+    shard_stream_ptrs.push_back(shard_streams.back().get());
+  }
+  optimizer.set_shard_streams(shard_stream_ptrs);
+  report.Measure("bgd_epoch", [&]() {
+    optimizer.fit(poly_x, y);
+    stream->Wait();
+  });
+
+  mshadow::TensorContainer<Device, 2, DType> new_y(mshadow::Shape2(rows, 1));
+  new_y.set_stream(stream.get());
+  report.Measure("predict", [&]() {
+    optimizer.predict(poly_x, new_y);
+    stream->Wait();
+  });
+  return 0;
+}
+
+// Cross validation of the degrees up to max_degree, see crossval.h
+int select_main(const std::vector<DType>& x,
+                const std::vector<DType>& y,
+                size_t max_degree,
+                size_t folds) {
+  auto scores = utils::CrossValidateDegrees(
+      x, y, max_degree, folds, std::thread::hardware_concurrency());
+  utils::PrintDegreeScores(scores);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // polynomial-regression-gpu --stream <file.tsv> [threads]
+  if (argc > 2 && std::string(argv[1]) == "--stream") {
+    size_t threads =
+        argc > 3 ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+    try {
+      return stream_main(argv[2], std::max<size_t>(threads, 1));
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // polynomial-regression-gpu [--device cpu|gpu|auto] [--threads <n>]
+  //                           [--streams <n>] [--batch-size <n>]
+  //                           [--save-model <file>]
+  //                           [--select-degree <max degree>] [--folds <n>]
+  // polynomial-regression-gpu [--device cpu|gpu|auto] [--threads <n>]
+  //                           --bench <rows> [degree] [json file]
+  // the bench arguments are the same as of the other backends
+  int options_end = 1;
+  while (options_end < argc && std::string(argv[options_end]) != "--bench")
+    ++options_end;
+  TrainOptions options;
+  std::string device = "auto";
+  size_t select_degree = 0;
+  size_t folds = 5;
+  size_t bench_rows = 0;
+  std::string bench_json;
+  if (options_end + 1 < argc) {
+    try {
+      bench_rows = std::stoul(argv[options_end + 1]);
+      if (options_end + 2 < argc)
+        options.p_degree = std::stoul(argv[options_end + 2]);
+    } catch (const std::exception& err) {
+      std::cerr << "Wrong bench arguments: " << err.what() << std::endl;
+      return 1;
+    }
+    if (options_end + 3 < argc)
+      bench_json = argv[options_end + 3];
+  }
+  for (int i = 1; i + 1 < options_end; i += 2) {
+    std::string arg(argv[i]);
+    if (arg == "--device") {
+      device = argv[i + 1];
+    } else if (arg == "--threads") {
+#ifdef _OPENMP
+      omp_set_num_threads(std::max(std::stoi(argv[i + 1]), 1));
+#endif
+    } else if (arg == "--streams") {
+      options.shards = std::stoul(argv[i + 1]);
+    } else if (arg == "--batch-size") {
+      options.batch_size = std::stoul(argv[i + 1]);
+    } else if (arg == "--save-model") {
+      options.model_path = argv[i + 1];
+    } else if (arg == "--select-degree") {
+      select_degree = std::stoul(argv[i + 1]);
+    } else if (arg == "--folds") {
+      folds = std::stoul(argv[i + 1]);
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
+  if (device != "cpu" && device != "gpu" && device != "auto") {
+    std::cerr << "Unknown device " << device << std::endl;
+    return 1;
+  }
+  if (device == "gpu" && !gpu_available()) {
+    // the CPU lines of the bench would repeat the ones of --device cpu
+    if (bench_rows > 0) {
+      std::cerr << "There is no GPU, the bench is skipped" << std::endl;
+      return 0;
+    }
+    std::cerr << "There is no GPU, the CPU is used" << std::endl;
+    device = "cpu";
+  }
+
+  if (bench_rows > 0) {
+    // with the auto device both backends are timed, the GPU one when there is
+    // a GPU
+    ScopedTensorEngine<mshadow::cpu> tensorEngineCpu;
+    try {
+      if (device != "gpu")
+        bench_main<mshadow::cpu>(bench_rows, options, "mshadow-cpu",
+                                 bench_json);
+      if (device == "gpu" || (device == "auto" && gpu_available())) {
+        ScopedTensorEngine<mshadow::gpu> tensorEngineGpu;
+        bench_main<mshadow::gpu>(bench_rows, options, "mshadow-gpu",
+                                 bench_json);
+      }
+      return 0;
+    } catch (const std::exception& err) {
+      std::cerr << err.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // Download the data
+  const std::string data_path{"web_traffic.tsv"};
+  if (!fs::exists(data_path)) {
+    const std::string data_url{
+        R"(https://raw.githubusercontent.com/luispedro/BuildingMachineLearningSystemsWithPython/master/ch01/data/web_traffic.tsv)"};
+    if (!utils::DownloadFile(data_url, data_path)) {
+      std::cerr << "Unable to download the file " << data_url << std::endl;
+      return 1;
+    }
+  }
+
+  // Read the data
+  auto data = utils::LoadTsv<DType>(data_path, 2);
+  if (data.invalid_rows > 0)
+    std::cout << "Skipped bad formated rows : " << data.invalid_rows
+              << std::endl;
+
+  // shuffle data, all columns with the same permutation
+  size_t seed = 25345;
+  data.Shuffle(seed);
+  std::vector<DType>& raw_data_x = data.columns[0];
+  std::vector<DType>& raw_data_y = data.columns[1];
+  if (select_degree > 0)
+    return select_main(raw_data_x, raw_data_y, select_degree, folds);
+
+  bool use_gpu = device == "gpu";
+  if (device == "auto") {
+    use_gpu = gpu_available() &&
+              raw_data_x.size() * options.p_degree >= kGpuMinElements;
+  }
+  std::cout << "Device : " << (use_gpu ? "gpu" : "cpu") << std::endl;
+
+  // generate new data
+  size_t n = 2000;
+  auto minmax_x = std::minmax_element(raw_data_x.begin(), raw_data_x.end());
+  auto time_range = *minmax_x.second - *minmax_x.first;
+  auto inc_step = time_range / n;
+  auto x_val = inc_step;
+  std::vector<DType> new_data_x(n);
+  for (auto& x : new_data_x) {
+    x = x_val;
+    x_val += inc_step;
+  }
+
+  // define comupte engines, the host one is used by the copies too
+  ScopedTensorEngine<mshadow::cpu> tensorEngineCpu;
+  std::unique_ptr<ScopedTensorEngine<mshadow::gpu>> tensorEngineGpu;
+  if (use_gpu)
+    tensorEngineGpu.reset(new ScopedTensorEngine<mshadow::gpu>());
+  std::vector<DType> raw_pred_y;
+  try {
+    raw_pred_y = use_gpu ? fit_predict<mshadow::gpu>(raw_data_x, raw_data_y,
+                                                     new_data_x, options)
+                         : fit_predict<mshadow::cpu>(raw_data_x, raw_data_y,
+                                                     new_data_x, options);
+  } catch (const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
 
   // plot the data we read and approximate
   plotcpp::Plot plt(true);
@@ -13,6 +13,79 @@ std::pair<DType, DType> get_range_for_degree(DType degree) {
   return std::make_pair(-max_v, max_v);
 }
 
+// Powers [1, x, ..., x^(p_degree - 1)] of every row by the repeated
+// multiplication
+template <typename DType>
+void fill_powers(mshadow::Tensor<mshadow::cpu, 2, DType> const& tensor,
+                 mshadow::Tensor<mshadow::cpu, 2, DType> const& poly,
+                 size_t p_degree) {
+#pragma omp parallel for
+  for (mshadow::index_t r = 0; r < tensor.shape_[0]; ++r) {
+    DType x = tensor[r][0];
+    DType v = 1;
+    DType* row = poly[r].dptr_;
+    for (size_t c = 0; c < p_degree; ++c) {
+      row[c] = v;
+      v *= x;
+    }
+  }
+}
+
+#ifdef __CUDACC__
+const int kPowersRows = 32;
+const int kPowersThreads = 128;
+
+// Every block fills kPowersRows rows. A thread per row computes the powers
+// into the shared tile, the tile rows are padded against bank conflicts, then
+// the block writes the tile to poly in the row-major order, so the stores are
+// coalesced.
+template <typename DType>
+__global__ void PowersKernel(const DType* x,
+                             int x_stride,
+                             int rows,
+                             DType* poly,
+                             int poly_stride,
+                             int p_degree) {
+  extern __shared__ unsigned char shared[];
+  DType* tile = reinterpret_cast<DType*>(shared);
+  const int tile_stride = p_degree + 1;
+  const int row0 = blockIdx.x * kPowersRows;
+  const int block_rows = min(kPowersRows, rows - row0);
+  if (threadIdx.x < block_rows) {
+    DType v = 1;
+    DType xr = x[(row0 + threadIdx.x) * x_stride];
+    DType* tile_row = tile + threadIdx.x * tile_stride;
+    for (int c = 0; c < p_degree; ++c) {
+      tile_row[c] = v;
+      v *= xr;
+    }
+  }
+  __syncthreads();
+  for (int i = threadIdx.x; i < block_rows * p_degree; i += blockDim.x) {
+    int r = i / p_degree;
+    int c = i - r * p_degree;
+    poly[(row0 + r) * poly_stride + c] = tile[r * tile_stride + c];
+  }
+}
+
+template <typename DType>
+void fill_powers(mshadow::Tensor<mshadow::gpu, 2, DType> const& tensor,
+                 mshadow::Tensor<mshadow::gpu, 2, DType> const& poly,
+                 size_t p_degree) {
+  auto rows = static_cast<int>(tensor.shape_[0]);
+  if (rows == 0)
+    return;
+  auto blocks = (rows + kPowersRows - 1) / kPowersRows;
+  auto shared_size = kPowersRows * (p_degree + 1) * sizeof(DType);
+  PowersKernel<DType>
+      <<<blocks, kPowersThreads, shared_size,
+         mshadow::Stream<mshadow::gpu>::GetStream(tensor.stream_)>>>(
+          tensor.dptr_, tensor.stride_, rows, poly.dptr_, poly.stride_,
+          static_cast<int>(p_degree));
+  MSHADOW_CUDA_POST_KERNEL_CHECK(PowersKernel);
+}
+#endif
+
 // takes tensor N x 1 and returns tensor N x p_degree
 template <typename Device, typename DType>
 void generate_polynomial(mshadow::Tensor<Device, 2, DType> const& tensor,
@@ -20,18 +93,10 @@ void generate_polynomial(mshadow::Tensor<Device, 2, DType> const& tensor,
                          size_t p_degree) {
   assert(tensor.shape_.kDimension == 2);
   assert(tensor.shape_[1] == 1);
+  assert(poly.shape_[0] == tensor.shape_[0]);
+  assert(poly.shape_[1] == p_degree);
 
-  auto rows = tensor.shape_[0];
-  mshadow::TensorContainer<Device, 2, DType> col_temp(mshadow::Shape2(rows, 1));
-  col_temp.set_stream(tensor.stream_);
-
-  for (size_t c = 0; c < p_degree; ++c) {
-    auto col = mshadow::expr::slice(poly, mshadow::Shape2(0, c),
-                                    mshadow::Shape2(rows, c + 1));
-    col_temp = mshadow::expr::F<Pow>(tensor, static_cast<DType>(c));
-    // print_tensor<DType>(col_temp, "pow");
-    col = col_temp;
-  }
+  fill_powers(tensor, poly, p_degree);
 }
 
 #endif  // POLYNOM_H
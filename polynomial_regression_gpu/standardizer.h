@@ -4,14 +4,93 @@
 #include <mshadow/tensor.h>
 #include "common.h"
 
-// Standardize 2D tensor of shape [rows]x[1]
+#include <cmath>
+#include <vector>
+
+#ifdef __CUDACC__
+// Count, mean and squared deviation of the values, partial results are
+// merged with Chan's formula
+template <typename DType>
+struct WelfordState {
+  DType count;
+  DType mean;
+  DType m2;
+};
+
+template <typename DType>
+MSHADOW_XINLINE WelfordState<DType> merge_welford(WelfordState<DType> a,
+                                                 WelfordState<DType> b) {
+  DType n = a.count + b.count;
+  if (n == 0)
+    return a;
+  DType delta = b.mean - a.mean;
+  WelfordState<DType> r;
+  r.count = n;
+  r.mean = a.mean + delta * b.count / n;
+  r.m2 = a.m2 + b.m2 + delta * delta * a.count * b.count / n;
+  return r;
+}
+
+const int kWelfordThreads = 256;
+const int kWelfordBlocks = 64;
+
+// Every block reduces its grid-stride part of the column into the partials
+template <typename DType>
+__global__ void WelfordPartialKernel(const DType* x,
+                                     int stride,
+                                     int rows,
+                                     DType* partials) {
+  __shared__ WelfordState<DType> states[kWelfordThreads];
+  WelfordState<DType> s{0, 0, 0};
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < rows;
+       i += blockDim.x * gridDim.x) {
+    DType v = x[i * stride];
+    s.count += 1;
+    DType delta = v - s.mean;
+    s.mean += delta / s.count;
+    s.m2 += delta * (v - s.mean);
+  }
+  states[threadIdx.x] = s;
+  __syncthreads();
+  for (int half = blockDim.x / 2; half > 0; half /= 2) {
+    if (threadIdx.x < half)
+      states[threadIdx.x] =
+          merge_welford(states[threadIdx.x], states[threadIdx.x + half]);
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    partials[blockIdx.x * 3] = states[0].count;
+    partials[blockIdx.x * 3 + 1] = states[0].mean;
+    partials[blockIdx.x * 3 + 2] = states[0].m2;
+  }
+}
+
+// Merges the partials into the mean and the sample standard deviation
+template <typename DType>
+__global__ void WelfordFinishKernel(const DType* partials,
+                                    int blocks,
+                                    DType* moments) {
+  WelfordState<DType> s{0, 0, 0};
+  for (int b = 0; b < blocks; ++b) {
+    WelfordState<DType> p{partials[b * 3], partials[b * 3 + 1],
+                          partials[b * 3 + 2]};
+    s = merge_welford(s, p);
+  }
+  moments[0] = s.mean;
+  moments[1] = sqrt(s.m2 / (s.count - 1));
+}
+#endif
+
+// Standardize 2D tensor of shape [rows]x[1]. The mean and the standard
+// deviation are reduced in one pass with Welford's method, then the tensor is
+// normalized in place.
 template <typename Device, typename DType>
 class Standardizer {
  public:
   using Tensor = mshadow::TensorContainer<Device, 2, DType>;
   using Stream = mshadow::Stream<Device>;
 
-  Standardizer() {}
+  Standardizer() : moments(mshadow::Shape1(2)), moments_cpu(moments.shape_) {}
   ~Standardizer() {}
   Standardizer(const Standardizer&) = delete;
   Standardizer& operator=(const Standardizer&) = delete;
@@ -20,44 +99,55 @@ class Standardizer {
     assert(vec.shape_.kDimension == 2);
     assert(vec.shape_[1] == 1);
 
-    auto rows = vec.shape_[0];
-
-    // alloc dst/temp tensors
-    mean.Resize(mshadow::Shape1(1));
-    mean.set_stream(vec.stream_);
-    temp.Resize(mshadow::Shape2(rows, 1));
-    temp.set_stream(vec.stream_);
-    sd.Resize(mshadow::Shape1(1));
-    sd.set_stream(vec.stream_);
+    moments.set_stream(vec.stream_);
+    reduce_moments(vec);
 
-    // calculate
-    mean = mshadow::expr::sumall_except_dim<1>(vec);
-    mean /= static_cast<DType>(rows);
-    temp = mshadow::expr::F<Pow>(
-        vec - mshadow::expr::broadcast<1>(mean, temp.shape_), 2);
-
-    sd = mshadow::expr::sumall_except_dim<1>(temp);
-    sd = mshadow::expr::F<Sqrt>(sd / static_cast<DType>(rows - 1));
+    auto shape = vec.shape_;
+    vec = (vec - mshadow::expr::broadcast<1>(moments.Slice(0, 1), shape)) /
+          mshadow::expr::broadcast<1>(moments.Slice(1, 2), shape);
+  }
 
-    temp = (vec - mshadow::expr::broadcast<1>(mean, temp.shape_)) /
-           mshadow::expr::broadcast<1>(sd, temp.shape_);
+  // Mean and standard deviation of the last transformed tensor
+  auto get_moments() {
+    mshadow::Copy(moments_cpu, moments, moments.stream_);
+    if (moments.stream_ != nullptr)
+      moments.stream_->Wait();
+    return std::vector<DType>{moments_cpu[0], moments_cpu[1]};
+  }
 
-    mshadow::Copy(vec, temp, vec.stream_);
+ private:
+  void reduce_moments(mshadow::Tensor<mshadow::cpu, 2, DType> const& vec) {
+    double count = 0, mean = 0, m2 = 0;
+    for (mshadow::index_t r = 0; r < vec.shape_[0]; ++r) {
+      double v = vec[r][0];
+      count += 1;
+      double delta = v - mean;
+      mean += delta / count;
+      m2 += delta * (v - mean);
+    }
+    moments[0] = static_cast<DType>(mean);
+    moments[1] = static_cast<DType>(std::sqrt(m2 / (count - 1)));
   }
 
-  auto get_moments() {
-    mshadow::TensorContainer<mshadow::cpu, 1, DType> value(mshadow::Shape1(1));
-    mshadow::Copy(value, mean, mean.stream_);
-    DType v_mean = value[0];
-    mshadow::Copy(value, sd, sd.stream_);
-    DType v_sd = value[0];
-    return std::vector<DType>{v_mean, v_sd};
+#ifdef __CUDACC__
+  void reduce_moments(mshadow::Tensor<mshadow::gpu, 2, DType> const& vec) {
+    partials.set_stream(vec.stream_);
+    partials.Resize(mshadow::Shape1(kWelfordBlocks * 3));
+    auto stream = mshadow::Stream<mshadow::gpu>::GetStream(vec.stream_);
+    WelfordPartialKernel<DType><<<kWelfordBlocks, kWelfordThreads, 0, stream>>>(
+        vec.dptr_, vec.stride_, vec.shape_[0], partials.dptr_);
+    MSHADOW_CUDA_POST_KERNEL_CHECK(WelfordPartialKernel);
+    WelfordFinishKernel<DType><<<1, 1, 0, stream>>>(
+        partials.dptr_, kWelfordBlocks, moments.dptr_);
+    MSHADOW_CUDA_POST_KERNEL_CHECK(WelfordFinishKernel);
   }
+#endif
 
  private:
-  mshadow::TensorContainer<Device, 1, DType> mean;
-  mshadow::TensorContainer<Device, 1, DType> sd;
-  mshadow::TensorContainer<Device, 2, DType> temp;
+  // [mean, sd]
+  mshadow::TensorContainer<Device, 1, DType> moments;
+  mshadow::TensorContainer<mshadow::cpu, 1, DType> moments_cpu;
+  mshadow::TensorContainer<Device, 1, DType> partials;
 };
 
 #endif  // STANDARDIZER_H
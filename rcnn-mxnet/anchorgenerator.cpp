@@ -27,21 +27,6 @@ Eigen::MatrixX4f whcxcy_to_anchors(const Eigen::ArrayXf& w,
   return result;
 }
 
-std::tuple<Eigen::MatrixXf, Eigen::MatrixXf> meshgrid(const Eigen::ArrayXf& x,
-                                                      const Eigen::ArrayXf& y) {
-  auto nx = x.size();
-  auto ny = y.size();
-  Eigen::MatrixXf X(ny, nx);
-  Eigen::MatrixXf Y(ny, nx);
-  for (Eigen::Index i = 0; i < ny; ++i) {
-    X.row(i) = x.transpose();
-  }
-  for (Eigen::Index j = 0; j < nx; ++j) {
-    Y.col(j) = y;
-  }
-  return std::make_tuple(X, Y);
-}
-
 }  // namespace
 
 AnchorGenerator::AnchorGenerator(const Params& params)
@@ -88,22 +73,31 @@ Eigen::MatrixXf AnchorGenerator::Generate(uint32_t width,
       Eigen::ArrayXi::LinSpaced(height, 0, static_cast<int>(height))
           .cast<float>();
   shift_y *= stride_;
-  Eigen::MatrixXf shift_X, shift_Y;
-  std::tie(shift_X, shift_Y) = meshgrid(shift_x, shift_y);
-  shift_X.transposeInPlace();
-  shift_X.resize(1, shift_X.size());
-  shift_Y.transposeInPlace();
-  shift_Y.resize(1, shift_Y.size());
-  Eigen::MatrixXf shifts(4, shift_X.size());
-  shifts << shift_X, shift_Y, shift_X, shift_Y;
-  shifts.transposeInPlace();
-  auto ncells = shifts.rows();
-  Eigen::MatrixXf all_anchors(ncells * num_anchors_, 4);
 
-  for (Eigen::Index i = 0, j = 0; i < ncells; ++i) {
-    for (Eigen::Index k = 0; k < num_anchors_; ++k) {
-      all_anchors.row(j++) = shifts.row(i) + base_anchors_.row(k);
+  // every coordinate column is written in one pass without temporary grids
+  Eigen::MatrixXf all_anchors(shift_x.size() * shift_y.size() * num_anchors_,
+                              4);
+  for (Eigen::Index c = 0; c < 4; ++c) {
+    const auto& shifts = c % 2 == 0 ? shift_x : shift_y;
+    float* col = all_anchors.col(c).data();
+    Eigen::Index j = 0;
+    for (Eigen::Index y = 0; y < shift_y.size(); ++y) {
+      for (Eigen::Index x = 0; x < shift_x.size(); ++x) {
+        auto shift = shifts(c % 2 == 0 ? x : y);
+        for (Eigen::Index k = 0; k < num_anchors_; ++k)
+          col[j++] = shift + base_anchors_(k, c);
+      }
     }
   }
   return all_anchors;
 }
+
+std::shared_ptr<const Eigen::MatrixXf> AnchorGenerator::Get(
+    uint32_t width,
+    uint32_t height) const {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  auto& anchors = cache_[std::make_pair(width, height)];
+  if (!anchors)
+    anchors = std::make_shared<const Eigen::MatrixXf>(Generate(width, height));
+  return anchors;
+}
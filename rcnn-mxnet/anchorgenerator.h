@@ -4,19 +4,37 @@
 #include "params.h"
 
 #include <Eigen/Dense>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+/* Anchors of a feature map are [cells * anchors, 4] x1, y1, x2, y2 rows,
+ * cells go in the row major order. The matrix is column major, so every
+ * coordinate is a contiguous aligned array, AnchorSampler reads them so.
+ */
 class AnchorGenerator {
  public:
   AnchorGenerator(const Params& params);
   Eigen::MatrixXf Generate(uint32_t width, uint32_t height) const;
 
+  // Anchors of the feature map size are generated once and shared
+  std::shared_ptr<const Eigen::MatrixXf> Get(uint32_t width,
+                                             uint32_t height) const;
+
  private:
   float stride_;
   Eigen::Array3f scales_;
   Eigen::Array3f ratios_;
   Eigen::Index num_anchors_;
   Eigen::MatrixXf base_anchors_;
+
+  mutable std::mutex cache_mutex_;
+  mutable std::map<std::pair<uint32_t, uint32_t>,
+                   std::shared_ptr<const Eigen::MatrixXf>>
+      cache_;
 };
 
 #endif  // ANCHORGENERATOR_H
@@ -1,8 +1,104 @@
 #include "anchorsampler.h"
 #include "bbox.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <random>
+#include <tuple>
+#include <vector>
+
+namespace {
+struct Box {
+  float x1 = 0;
+  float y1 = 0;
+  float x2 = 0;
+  float y2 = 0;
+};
+
+struct Overlap {
+  uint32_t anchor = 0;
+  uint32_t gt = 0;
+  float value = 0;
+};
+
+// The same overlap as bbox_overlaps
+float BoxOverlap(const Box& a, const Box& b) {
+  auto iw = std::min(a.x2, b.x2) - std::max(a.x1, b.x1) + 1;
+  if (iw <= 0)
+    return 0;
+  auto ih = std::min(a.y2, b.y2) - std::max(a.y1, b.y1) + 1;
+  if (ih <= 0)
+    return 0;
+  auto a_area = (a.x2 - a.x1 + 1) * (a.y2 - a.y1 + 1);
+  auto b_area = (b.x2 - b.x1 + 1) * (b.y2 - b.y1 + 1);
+  return iw * ih / (a_area + b_area - iw * ih);
+}
+
+/* Uniform grid over the image, every cell has the gt boxes which cover it.
+ * Visit calls the function once for every gt box in the cells of a box.
+ */
+class GtGrid {
+ public:
+  GtGrid(const std::vector<Box>& gt_boxes, float width, float height)
+      : cols_(CellsCount(width)),
+        rows_(CellsCount(height)),
+        cells_(static_cast<size_t>(cols_ * rows_)),
+        visited_(gt_boxes.size(), 0) {
+    for (size_t g = 0; g < gt_boxes.size(); ++g) {
+      int x1, y1, x2, y2;
+      std::tie(x1, y1, x2, y2) = CellRange(gt_boxes[g]);
+      for (int y = y1; y <= y2; ++y) {
+        for (int x = x1; x <= x2; ++x) {
+          cells_[static_cast<size_t>(y * cols_ + x)].push_back(
+              static_cast<uint32_t>(g));
+        }
+      }
+    }
+  }
+
+  template <typename F>
+  void Visit(const Box& box, F&& func) {
+    ++stamp_;
+    int x1, y1, x2, y2;
+    std::tie(x1, y1, x2, y2) = CellRange(box);
+    for (int y = y1; y <= y2; ++y) {
+      for (int x = x1; x <= x2; ++x) {
+        for (auto g : cells_[static_cast<size_t>(y * cols_ + x)]) {
+          if (visited_[g] != stamp_) {
+            visited_[g] = stamp_;
+            func(g);
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  static constexpr float kCellSize = 64.f;
+
+  static int CellsCount(float size) {
+    return std::max(1, static_cast<int>(std::ceil(size / kCellSize)));
+  }
+
+  int Cell(float v, int count) const {
+    return std::min(count - 1, std::max(0, static_cast<int>(v / kCellSize)));
+  }
+
+  // Boxes include their x2, y2 pixels
+  std::tuple<int, int, int, int> CellRange(const Box& box) const {
+    return std::make_tuple(Cell(box.x1, cols_), Cell(box.y1, rows_),
+                           Cell(box.x2 + 1, cols_), Cell(box.y2 + 1, rows_));
+  }
+
+  int cols_ = 1;
+  int rows_ = 1;
+  std::vector<std::vector<uint32_t>> cells_;
+  std::vector<uint32_t> visited_;
+  uint32_t stamp_ = 0;
+};
+}  // namespace
 
 AnchorSampler::AnchorSampler(const Params& params)
     : allowed_border_(params.rpn_allowed_border),
@@ -13,102 +109,103 @@ AnchorSampler::AnchorSampler(const Params& params)
   num_fg_ = static_cast<Eigen::Index>(num_batch_ * fg_fraction_);
 }
 
-std::tuple<Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf>
-AnchorSampler::Assign(const Eigen::MatrixXf& anchors,
-                      const Eigen::MatrixXf& all_gt_boxes,
-                      float im_width,
-                      float im_height) {
-  // filter out padded gt_boxes
-  auto num_valid_boxes = (all_gt_boxes.rightCols(1).array() > 0).count();
+void AnchorSampler::Assign(const Eigen::MatrixXf& anchors,
+                           const Eigen::MatrixXf& all_gt_boxes,
+                           float im_width,
+                           float im_height,
+                           float* labels,
+                           float* bbox_targets,
+                           float* bbox_weights) const {
+  auto n_anchors = anchors.rows();
+  // label: 1 is positive, 0 is negative, -1 is dont care
+  std::fill(labels, labels + n_anchors, -1.f);
+  std::fill(bbox_targets, bbox_targets + n_anchors * 4, 0.f);
+  std::fill(bbox_weights, bbox_weights + n_anchors * 4, 0.f);
+
+  // filter out padded gt_boxes, padding is at the end
+  std::vector<Box> gt_boxes;
   auto boxes_cols = all_gt_boxes.cols();
-  Eigen::MatrixXf gt_boxes(num_valid_boxes, all_gt_boxes.cols());
-  for (Eigen::Index i = 0, j = 0; i < num_valid_boxes; ++i) {
+  for (Eigen::Index i = 0; i < all_gt_boxes.rows(); ++i) {
     if (all_gt_boxes(i, boxes_cols - 1) > 0.f) {
-      gt_boxes.row(j++) = all_gt_boxes.row(i);
+      gt_boxes.push_back(Box{all_gt_boxes(i, 0), all_gt_boxes(i, 1),
+                             all_gt_boxes(i, 2), all_gt_boxes(i, 3)});
     }
   }
 
-  auto n_anchors = anchors.rows();
-  // filter out anchors outside the image region
-  Eigen::ArrayXf indices_base = Eigen::ArrayXf::Constant(n_anchors, 1.f);
-
-  Eigen::ArrayXf inds_inside =
-      (anchors.block(0, 0, n_anchors, 1).array() >= -allowed_border_)
-          .select(indices_base, -indices_base);
-  inds_inside = (anchors.block(0, 1, n_anchors, 1).array() >= -allowed_border_)
-                    .select(inds_inside, -indices_base);
-  inds_inside =
-      (anchors.block(0, 2, n_anchors, 1).array() < im_width + allowed_border_)
-          .select(inds_inside, -indices_base);
-  inds_inside =
-      (anchors.block(0, 3, n_anchors, 1).array() < im_height + allowed_border_)
-          .select(inds_inside, -indices_base);
-
-  auto num_valid = (inds_inside > 0).count();
-
-  Eigen::MatrixXf valid_anchors(num_valid, anchors.cols());
-  for (Eigen::Index i = 0, j = 0; i < n_anchors; ++i) {
-    if (inds_inside[i] >= 1.f) {
-      valid_anchors.row(j++) = anchors.row(i);
+  // filter out anchors outside the image region in a single pass
+  std::vector<Eigen::Index> inside;
+  inside.reserve(static_cast<size_t>(n_anchors));
+  const auto* x1 = anchors.col(0).data();
+  const auto* y1 = anchors.col(1).data();
+  const auto* x2 = anchors.col(2).data();
+  const auto* y2 = anchors.col(3).data();
+  for (Eigen::Index i = 0; i < n_anchors; ++i) {
+    if (x1[i] >= -allowed_border_ && y1[i] >= -allowed_border_ &&
+        x2[i] < im_width + allowed_border_ &&
+        y2[i] < im_height + allowed_border_) {
+      inside.push_back(i);
     }
   }
 
-  // label: 1 is positive, 0 is negative, -1 is dont care
-  Eigen::MatrixXf labels = Eigen::MatrixXf::Constant(num_valid, 1, -1.f);
-  Eigen::MatrixXf bbox_targets = Eigen::MatrixXf::Zero(num_valid, 4);
-  Eigen::MatrixXf bbox_weights = Eigen::MatrixXf::Zero(num_valid, 4);
-
   // std::random_device rd;
   std::mt19937 mt(5675317);  // rd());
 
-  // sample for positive labels
-  if (gt_boxes.rows() > 0) {
-    // overlap between the anchors and the gt boxes
-    // result is 2d matrix with ratio of overlap (anchors, gt_boxes)
-    auto overlaps = bbox_overlaps(valid_anchors, gt_boxes);
-
-    // fg anchors: anchor with highest overlap for each gt
-    Eigen::Matrix<bool, Eigen::Dynamic, Eigen::Dynamic> gt_max_overlaps =
-        (overlaps.array() ==
-         overlaps.colwise().maxCoeff().array().replicate(overlaps.rows(), 1))
-            .matrix()
-            .rowwise()
-            .any();
-    labels = (gt_max_overlaps.array() > 0).select(1.f, labels);
-
-    // fg anchors: anchor with overlap > iou thresh
-    Eigen::MatrixXf max_overlaps = overlaps.rowwise().maxCoeff();
-    auto fg_indices_expr = max_overlaps.array() >= fg_overlap_;
-    auto fg_indices = expr_row_indices(fg_indices_expr);
-    for (auto index : fg_indices) {
-      labels(index) = 1;
+  std::vector<Eigen::Index> fg_indices;
+  std::vector<Eigen::Index> bg_indices;
+  if (!gt_boxes.empty()) {
+    // overlaps between the inside anchors and the gt boxes they can overlap,
+    // gt boxes are registered in the grid cells they cover
+    GtGrid grid(gt_boxes, im_width, im_height);
+    std::vector<float> max_overlaps(inside.size(), 0.f);
+    std::vector<uint32_t> argmax_overlaps(inside.size(), 0);
+    std::vector<float> gt_max_overlaps(gt_boxes.size(), 0.f);
+    std::vector<Overlap> overlaps;
+    for (size_t j = 0; j < inside.size(); ++j) {
+      auto i = inside[j];
+      Box anchor{x1[i], y1[i], x2[i], y2[i]};
+      grid.Visit(anchor, [&](uint32_t g) {
+        auto overlap = BoxOverlap(anchor, gt_boxes[g]);
+        if (overlap <= 0)
+          return;
+        overlaps.push_back(Overlap{static_cast<uint32_t>(j), g, overlap});
+        if (overlap > max_overlaps[j]) {
+          max_overlaps[j] = overlap;
+          argmax_overlaps[j] = g;
+        }
+        gt_max_overlaps[g] = std::max(gt_max_overlaps[g], overlap);
+      });
     }
 
     // bg anchors: anchor with overlap < iou thresh
-    auto bg_indices_expr = max_overlaps.array() < bg_overlap_;
-    auto bg_indices = expr_row_indices(bg_indices_expr);
-    for (auto index : bg_indices) {
-      if (labels(index) < 0)  // don't reset previously selected rois
-        labels(index) = 0;
+    for (size_t j = 0; j < inside.size(); ++j) {
+      if (max_overlaps[j] < bg_overlap_)
+        labels[inside[j]] = 0;
+    }
+    // fg anchors: anchor with highest overlap for each gt
+    for (const auto& overlap : overlaps) {
+      if (overlap.value == gt_max_overlaps[overlap.gt])
+        labels[inside[overlap.anchor]] = 1;
+    }
+    // fg anchors: anchor with overlap > iou thresh
+    for (size_t j = 0; j < inside.size(); ++j) {
+      if (max_overlaps[j] >= fg_overlap_)
+        labels[inside[j]] = 1;
     }
 
-    fg_indices.clear();
-    bg_indices.clear();
-    for (Eigen::Index i = 0; i < labels.rows(); ++i) {
-      if (labels(i, 0) > 0)
+    for (auto i : inside) {
+      if (labels[i] > 0)
         fg_indices.push_back(i);
-      else if (labels(i, 0) >= 0 && labels(i, 0) < 1)
+      else if (labels[i] == 0)
         bg_indices.push_back(i);
     }
 
     // subsample positive anchors
     Eigen::Index fg_labels_count = static_cast<Eigen::Index>(fg_indices.size());
-    assert(fg_labels_count >= 1);
     if (fg_labels_count > num_fg_) {
       auto disable_inds = random_choice(
           fg_indices, static_cast<size_t>(fg_labels_count - num_fg_), mt);
       for (auto index : disable_inds) {
-        labels(index) = -1;
+        labels[index] = -1;
       }
     }
 
@@ -119,52 +216,37 @@ AnchorSampler::Assign(const Eigen::MatrixXf& anchors,
       auto disable_inds = random_choice(
           bg_indices, static_cast<size_t>(bg_labels_count - max_neg), mt);
       for (auto index : disable_inds) {
-        labels(index) = -1;
+        labels[index] = -1;
       }
     }
 
-    assert(fg_labels_count >= (labels.array() > 0).count());
-    assert(max_neg >= (labels.array() == 0).count());
-
-    // make gt_box correspondence for each positive anchor
-    Eigen::MatrixXf anchors_gt_boxes(valid_anchors.rows(), gt_boxes.cols());
-    auto anchor_box_inds = argmax(overlaps).second;
-    assert(labels.rows() == anchor_box_inds.rows());
-    for (Eigen::Index i = 0; i < num_valid; ++i) {
-      anchors_gt_boxes.row(i) = gt_boxes.row(anchor_box_inds(i));
+    // calculate anchor vs bbox offsets of fg anchors, only fg anchors has
+    // bbox_targets
+    for (size_t j = 0; j < inside.size(); ++j) {
+      auto i = inside[j];
+      if (labels[i] < 1.f)
+        continue;
+      const auto& gt = gt_boxes[argmax_overlaps[j]];
+      auto ex_width = x2[i] - x1[i] + 1.f;
+      auto ex_height = y2[i] - y1[i] + 1.f;
+      auto ex_ctr_x = x1[i] + 0.5f * (ex_width - 1);
+      auto ex_ctr_y = y1[i] + 0.5f * (ex_height - 1);
+      auto gt_width = gt.x2 - gt.x1 + 1.f;
+      auto gt_height = gt.y2 - gt.y1 + 1.f;
+      auto gt_ctr_x = gt.x1 + 0.5f * (gt_width - 1);
+      auto gt_ctr_y = gt.y1 + 0.5f * (gt_height - 1);
+      auto* target = bbox_targets + i * 4;
+      target[0] = (gt_ctr_x - ex_ctr_x) / (ex_width + 1e-14f);
+      target[1] = (gt_ctr_y - ex_ctr_y) / (ex_height + 1e-14f);
+      target[2] = std::log(gt_width / ex_width);
+      target[3] = std::log(gt_height / ex_height);
+      std::fill(bbox_weights + i * 4, bbox_weights + i * 4 + 4, 1.f);
     }
-
-    // calculate anchor vs bbox offsets
-    auto raw_bbox_targets =
-        bbox_transform(valid_anchors, anchors_gt_boxes, {1, 1, 1, 1});
-    bbox_targets = (labels.replicate(1, bbox_targets.cols()).array() >= 1.f)
-                       .select(raw_bbox_targets, bbox_targets);
-
-    // only fg anchors has bbox_targets
-    bbox_weights = (labels.replicate(1, bbox_weights.cols()).array() >= 1.f)
-                       .select(1.f, bbox_weights);
   } else {
     // randomly draw bg anchors
-    std::vector<Eigen::Index> bg_inds(static_cast<size_t>(labels.rows()));
-    std::iota(bg_inds.begin(), bg_inds.end(), 0);
-    bg_inds = random_choice(bg_inds, static_cast<size_t>(num_batch_), mt);
-    for (auto index : bg_inds) {
-      labels(index) = 0;
+    auto bg_count = std::min(static_cast<size_t>(num_batch_), inside.size());
+    for (auto index : random_choice(inside, bg_count, mt)) {
+      labels[index] = 0;
     }
   }
-
-  // make final result
-  Eigen::MatrixXf all_labels = Eigen::MatrixXf::Constant(n_anchors, 1, -1.f);
-  Eigen::MatrixXf all_bbox_targets = Eigen::MatrixXf::Zero(n_anchors, 4);
-  Eigen::MatrixXf all_bbox_weights = Eigen::MatrixXf::Zero(n_anchors, 4);
-  for (Eigen::Index i = 0, j = 0; i < n_anchors; ++i) {
-    if (inds_inside[i] >= 1.f) {
-      all_labels(i, 0) = labels(j, 0);
-      all_bbox_targets.row(i) = bbox_targets.row(j);
-      all_bbox_weights.row(i) = bbox_weights.row(j);
-      ++j;
-    }
-  }
-
-  return {all_labels, all_bbox_targets, all_bbox_weights};
 }
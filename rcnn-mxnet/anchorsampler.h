@@ -4,16 +4,20 @@
 #include "params.h"
 
 #include <Eigen/Dense>
-#include <tuple>
 
 class AnchorSampler {
  public:
   AnchorSampler(const Params& params);
-  std::tuple<Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf> Assign(
-      const Eigen::MatrixXf& anchors,
-      const Eigen::MatrixXf& gt_boxes,
-      float im_width,
-      float im_height);
+  // Labels, bbox targets and bbox weights of the anchors are written to the
+  // row major [anchors], [anchors, 4] and [anchors, 4] buffers. Overlaps are
+  // computed only for the gt boxes in the grid cells an anchor covers.
+  void Assign(const Eigen::MatrixXf& anchors,
+              const Eigen::MatrixXf& gt_boxes,
+              float im_width,
+              float im_height,
+              float* labels,
+              float* bbox_targets,
+              float* bbox_weights) const;
 
  private:
   float allowed_border_ = 0;
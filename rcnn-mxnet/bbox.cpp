@@ -1,68 +1,67 @@
 ﻿#include "bbox.h"
+#include "../tensorview.h"
+#include "../trace.h"
 
+#include <cmath>
+#include <limits>
 #include <random>
 #include <type_traits>
 
-namespace {
-struct ArgmaxVisitor {
-  ArgmaxVisitor(Eigen::Index rows, Eigen::Index cols)
-      : max_rows(cols, 1), max_cols(rows, 1) {}
-  void init(const bool& value, Eigen::Index i, Eigen::Index j) {
-    operator()(value, i, j);
-  }
-  void operator()(const bool& value, Eigen::Index i, Eigen::Index j) {
-    if (value) {
-      max_cols(i, 0) = j;
-      max_rows(j, 0) = i;
+void rowwise_max_argmax(const Eigen::MatrixXf& m,
+                        Eigen::ArrayXf& max,
+                        Indices& max_cols) {
+  const auto rows = m.rows();
+  max.setConstant(rows, -std::numeric_limits<float>::infinity());
+  max_cols.setZero(rows);
+  // column by column, so the reads are contiguous
+  for (Eigen::Index j = 0; j < m.cols(); ++j) {
+    const auto* col = m.col(j).data();
+    for (Eigen::Index i = 0; i < rows; ++i) {
+      const bool greater = col[i] >= max(i);
+      max(i) = greater ? col[i] : max(i);
+      max_cols(i) = greater ? j : max_cols(i);
     }
   }
-  Indices max_rows;
-  Indices max_cols;
-};
-}  // namespace
+}
 
 std::pair<Indices, Indices> argmax(const Eigen::MatrixXf& m) {
-  auto max_pos =
-      (m.array() == m.rowwise().maxCoeff().array().replicate(1, m.cols()))
-          .matrix();
-  ArgmaxVisitor visitor(m.rows(), m.cols());
-  max_pos.visit(visitor);
-  return {visitor.max_rows, visitor.max_cols};
+  Eigen::ArrayXf max;
+  Indices max_cols;
+  rowwise_max_argmax(m, max, max_cols);
+  Indices max_rows = Indices::Constant(m.cols(), -1);
+  for (Eigen::Index i = 0; i < m.rows(); ++i)
+    max_rows(max_cols(i)) = i;
+  return {max_rows, max_cols};
 }
 
 Eigen::MatrixXf bbox_overlaps(const Eigen::MatrixXf& boxes,
                               const Eigen::MatrixXf& query_boxes) {
   auto ns = boxes.rows();
   auto ks = query_boxes.rows();
-  Eigen::MatrixXf overlaps = Eigen::MatrixXf::Zero(ns, ks);
-
-  // take care - element wise multiplication
-  Eigen::ArrayXf query_box_area =
-      ((query_boxes.block(0, 2, ks, 1) - query_boxes.block(0, 0, ks, 1))
-           .array() +
-       1) *
-      ((query_boxes.block(0, 3, ks, 1) - query_boxes.block(0, 1, ks, 1))
-           .array() +
-       1);
-
-  Eigen::ArrayXf box_area =
-      ((boxes.block(0, 2, ns, 1) - boxes.block(0, 0, ns, 1)).array() + 1) *
-      ((boxes.block(0, 3, ns, 1) - boxes.block(0, 1, ns, 1)).array() + 1);
-
-  // Eigen defaults to storing the entry in column-major
+  Eigen::MatrixXf overlaps(ns, ks);
+
+  // Columns of the column major boxes are contiguous coordinate arrays, so
+  // the overlaps with a query box are computed for all boxes at once with
+  // vector instructions and without branches
+  auto x1 = boxes.col(0).array();
+  auto y1 = boxes.col(1).array();
+  auto x2 = boxes.col(2).array();
+  auto y2 = boxes.col(3).array();
+  Eigen::ArrayXf box_area = (x2 - x1 + 1) * (y2 - y1 + 1);
+  Eigen::ArrayXf iw(ns);
+  Eigen::ArrayXf intersection(ns);
   for (Eigen::Index k = 0; k < ks; ++k) {
-    for (Eigen::Index n = 0; n < ns; ++n) {
-      auto iw = std::min(boxes(n, 2), query_boxes(k, 2)) -
-                std::max(boxes(n, 0), query_boxes(k, 0)) + 1;
-      if (iw > 0) {
-        auto ih = std::min(boxes(n, 3), query_boxes(k, 3)) -
-                  std::max(boxes(n, 1), query_boxes(k, 1)) + 1;
-        if (ih > 0) {
-          auto all_area = box_area(n) + query_box_area(k) - iw * ih;
-          overlaps(n, k) = iw * ih / all_area;
-        }
-      }
-    }
+    auto qx1 = query_boxes(k, 0);
+    auto qy1 = query_boxes(k, 1);
+    auto qx2 = query_boxes(k, 2);
+    auto qy2 = query_boxes(k, 3);
+    auto query_box_area = (qx2 - qx1 + 1) * (qy2 - qy1 + 1);
+    iw = (x2.min(qx2) - x1.max(qx1) + 1).max(0.f);
+    intersection = iw * (y2.min(qy2) - y1.max(qy1) + 1).max(0.f);
+    overlaps.col(k).array() =
+        (intersection > 0)
+            .select(intersection / (box_area + query_box_area - intersection),
+                    0.f);
   }
   return overlaps;
 }
@@ -144,7 +143,79 @@ std::vector<Detection> DecodePredictions(const Eigen::MatrixXf& rois,
   return result;
 }
 
+std::vector<Detection> DecodePredictions(const ConstRowMatrixMap& rois,
+                                         const ConstRowMatrixMap& scores,
+                                         const ConstRowMatrixMap& bbox_deltas,
+                                         const float* im_info,
+                                         const Params& params) {
+  assert(rois.rows() == scores.rows() && rois.rows() == bbox_deltas.rows());
+  assert(bbox_deltas.cols() == 4 * scores.cols());
+  auto height = im_info[0];
+  auto width = im_info[1];
+  auto scale = im_info[2];
+  const auto& stds = params.rcnn_bbox_stds;
+
+  std::vector<Detection> result;
+  std::vector<Detection> one_class_result;
+  one_class_result.reserve(static_cast<size_t>(scores.rows()));
+  for (Eigen::Index c = 1; c < scores.cols(); ++c) {
+    one_class_result.clear();
+    for (Eigen::Index i = 0; i < scores.rows(); ++i) {
+      auto score = scores(i, c);
+      if (score <= params.rcnn_conf_thresh)
+        continue;
+      // the same transform as bbox_pred and clip_boxes do for all boxes
+      auto w = rois(i, 3) - rois(i, 1) + 1.0f;
+      auto h = rois(i, 4) - rois(i, 2) + 1.0f;
+      auto ctr_x = rois(i, 1) + 0.5f * (w - 1.0f);
+      auto ctr_y = rois(i, 2) + 0.5f * (h - 1.0f);
+      const float* delta = bbox_deltas.row(i).data() + 4 * c;
+      auto pred_ctr_x = delta[0] * stds[0] * w + ctr_x;
+      auto pred_ctr_y = delta[1] * stds[1] * h + ctr_y;
+      auto pred_w = std::exp(delta[2] * stds[2]) * w;
+      auto pred_h = std::exp(delta[3] * stds[3]) * h;
+      auto clip = [](float v, float size) {
+        return std::max(std::min(v, size - 1), 0.f);
+      };
+
+      one_class_result.emplace_back();
+      auto& det = one_class_result.back();
+      det.class_id = c;
+      det.score = score;
+      // we used scaled image & roi to train, so it is necessary to transform
+      // them back
+      det.x1 = clip(pred_ctr_x - 0.5f * (pred_w - 1.0f), width) / scale;
+      det.y1 = clip(pred_ctr_y - 0.5f * (pred_h - 1.0f), height) / scale;
+      det.x2 = clip(pred_ctr_x + 0.5f * (pred_w - 1.0f), width) / scale;
+      det.y2 = clip(pred_ctr_y + 0.5f * (pred_h - 1.0f), height) / scale;
+    }
+    nms(one_class_result, params.rpn_nms_thresh);
+    result.insert(result.end(), one_class_result.begin(),
+                  one_class_result.end());
+  }
+  return result;
+}
+
+std::vector<Detection> DecodeDetections(const ConstRowMatrixMap& detections) {
+  assert(detections.cols() == 6);
+  std::vector<Detection> result;
+  for (Eigen::Index i = 0; i < detections.rows(); ++i) {
+    if (detections(i, 0) < 0)
+      continue;
+    result.emplace_back();
+    auto& det = result.back();
+    det.class_id = static_cast<long>(detections(i, 0));
+    det.score = detections(i, 1);
+    det.x1 = detections(i, 2);
+    det.y1 = detections(i, 3);
+    det.x2 = detections(i, 4);
+    det.y2 = detections(i, 5);
+  }
+  return result;
+}
+
 void nms(std::vector<Detection>& predictions, float nms_thresh) {
+  MLCPP_TRACE_ZONE("nms");
   using I = std::vector<Detection>::iterator;
   std::vector<I> inds(predictions.size());
   std::iota(inds.begin(), inds.end(), predictions.begin());
@@ -267,17 +338,11 @@ Eigen::MatrixXf clip_boxes(const Eigen::MatrixXf& boxes,
 
 Eigen::MatrixXf NDArray2ToEigen(const mxnet::cpp::NDArray& value) {
   assert(value.GetShape().size() == 2);
-  //  auto result =
-  //      Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
-  //                                     Eigen::RowMajor>>(
-  //          value.GetData(), value.GetShape()[0], value.GetShape()[1]);
-
-  Eigen::MatrixXf result(value.GetShape()[0], value.GetShape()[1]);
-  for (Eigen::Index x = 0; x < result.cols(); ++x) {
-    for (Eigen::Index y = 0; y < result.rows(); ++y) {
-      result(y, x) = value.At(y, x);
-    }
-  }
+  // the row major host data goes to the column major matrix with one pass
+  const auto& shape = value.GetShape();
+  Eigen::MatrixXf result(shape[0], shape[1]);
+  utils::CopyView(utils::MakeView(value.GetData(), {shape[0], shape[1]}),
+                  utils::EigenView(result));
   return result;
 }
 
@@ -290,39 +355,95 @@ Eigen::MatrixXf NDArray3ToEigen(const mxnet::cpp::NDArray& value) {
   return result;
 }
 
-std::tuple<Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf>
-SampleRois(const Eigen::MatrixXf& rois,
-           const Eigen::MatrixXf& gt_boxes,
-           int num_classes,
-           int rois_per_image,
-           int fg_rois_per_image,
-           float fg_overlap,
-           const std::vector<float>& box_stds) {
-  auto overlaps = bbox_overlaps(rois, gt_boxes);
-  auto gt_assignment = argmax(overlaps).second;
+namespace {
+// Reuses the host array if the shape is the same
+void CopyToHost(const mxnet::cpp::NDArray& src, mxnet::cpp::NDArray& dst) {
+  auto shape = src.GetShape();
+  if (dst.GetShape() != shape) {
+    dst = mxnet::cpp::NDArray(
+        shape, mxnet::cpp::Context(mxnet::cpp::DeviceType::kCPUPinned, 0),
+        false);
+  }
+  src.CopyTo(&dst);
+}
+
+// The last two dimensions, the first one of 3d outputs is the batch
+ConstRowMatrixMap HostView(const mxnet::cpp::NDArray& value) {
+  auto shape = value.GetShape();
+  assert(shape.size() >= 2);
+  return ConstRowMatrixMap(value.GetData(),
+                           static_cast<Eigen::Index>(shape[shape.size() - 2]),
+                           static_cast<Eigen::Index>(shape.back()));
+}
+}  // namespace
 
-  Eigen::MatrixXf labels(gt_assignment.rows(), 1);
-  for (Eigen::Index i = 0; i < gt_assignment.size(); ++i) {
-    Eigen::Index j = gt_assignment(i);
-    labels(i, 0) = gt_boxes(j, 4);
+void PredictionBuffer::CopyFrom(const mxnet::cpp::NDArray& rois,
+                                const mxnet::cpp::NDArray& scores,
+                                const mxnet::cpp::NDArray& bbox_deltas) {
+  CopyToHost(rois, rois_);
+  CopyToHost(scores, scores_);
+  CopyToHost(bbox_deltas, bbox_deltas_);
+  decoded_ = false;
+}
+
+void PredictionBuffer::CopyFrom(const mxnet::cpp::NDArray& detections) {
+  CopyToHost(detections, detections_);
+  decoded_ = true;
+}
+
+void PredictionBuffer::WaitToRead() const {
+  if (decoded_) {
+    detections_.WaitToRead();
+  } else {
+    rois_.WaitToRead();
+    scores_.WaitToRead();
+    bbox_deltas_.WaitToRead();
   }
-  Eigen::MatrixXf max_overlaps = overlaps.rowwise().maxCoeff();
+}
+
+ConstRowMatrixMap PredictionBuffer::Rois() const {
+  return HostView(rois_);
+}
+
+ConstRowMatrixMap PredictionBuffer::Scores() const {
+  return HostView(scores_);
+}
+
+ConstRowMatrixMap PredictionBuffer::BboxDeltas() const {
+  return HostView(bbox_deltas_);
+}
+
+ConstRowMatrixMap PredictionBuffer::Detections() const {
+  return HostView(detections_);
+}
+
+void SampleRois(const Eigen::MatrixXf& rois,
+                const Eigen::MatrixXf& gt_boxes,
+                int num_classes,
+                int rois_per_image,
+                int fg_rois_per_image,
+                float fg_overlap,
+                const std::vector<float>& box_stds,
+                std::mt19937& mt,
+                RowMatrixRef out_rois,
+                RowMatrixRef out_labels,
+                RowMatrixRef out_bbox_targets,
+                RowMatrixRef out_bbox_weights) {
+  assert(out_rois.rows() == rois_per_image);
+  assert(out_bbox_targets.cols() == 4 * num_classes);
+  auto overlaps = bbox_overlaps(rois, gt_boxes);
+  Eigen::ArrayXf max_overlaps;
+  Indices gt_assignment;
+  rowwise_max_argmax(overlaps, max_overlaps, gt_assignment);
 
   std::vector<Eigen::Index> fg_indexes;
   std::vector<Eigen::Index> bg_indexes;
-  WhereVisitor indexes_visitor;
-
-  // std::random_device rd;
-  size_t seed_ = 5675317;
-  std::mt19937 mt(seed_);  // rd());
 
   // select foreground RoI with FG_THRESH overlap
-  auto fg_indexes_expr = (max_overlaps.array() >= fg_overlap);
-  indexes_visitor.data = &fg_indexes;
-  fg_indexes_expr.visit(indexes_visitor);
+  expr_row_indices(max_overlaps >= fg_overlap, fg_indexes);
   // guard against the case when an image has fewer than fg_rois_per_image
   // foreground RoIs
-  auto fg_indexes_count = fg_indexes_expr.count();
+  auto fg_indexes_count = static_cast<Eigen::Index>(fg_indexes.size());
   assert(fg_indexes_count > 0);
   auto fg_rois_this_image =
       std::min(static_cast<Eigen::Index>(fg_rois_per_image), fg_indexes_count);
@@ -333,13 +454,11 @@ SampleRois(const Eigen::MatrixXf& rois,
   }
 
   // select background RoIs as those within [0, FG_THRESH)
-  auto bg_indexes_expr = (max_overlaps.array() < fg_overlap);
-  indexes_visitor.data = &bg_indexes;
-  bg_indexes_expr.visit(indexes_visitor);
+  expr_row_indices(max_overlaps < fg_overlap, bg_indexes);
   // compute number of background RoIs to take from this image (guarding
   // against there being fewer than desired)
   auto bg_rois_this_image = rois_per_image - fg_rois_this_image;
-  auto bg_indexes_count = bg_indexes_expr.count();
+  auto bg_indexes_count = static_cast<Eigen::Index>(bg_indexes.size());
   bg_rois_this_image = std::min(bg_rois_this_image, bg_indexes_count);
   // sample bg rois without replacement
   if (bg_indexes_count > bg_rois_this_image) {
@@ -349,6 +468,7 @@ SampleRois(const Eigen::MatrixXf& rois,
 
   // indexes selected
   std::vector<Eigen::Index> keep_indexes;
+  keep_indexes.reserve(static_cast<size_t>(rois_per_image));
   keep_indexes.insert(keep_indexes.end(), fg_indexes.begin(), fg_indexes.end());
   keep_indexes.insert(keep_indexes.end(), bg_indexes.begin(), bg_indexes.end());
 
@@ -361,45 +481,49 @@ SampleRois(const Eigen::MatrixXf& rois,
                         gap_indexes.end());
   }
 
-  // sample rois and labels
+  // sample rois, labels and the boxes of the targets, labels of bg rois are 0
   assert(static_cast<size_t>(rois_per_image) == keep_indexes.size());
   Eigen::MatrixXf b_rois(rois_per_image, rois.cols());
-  Eigen::MatrixXf b_labels(rois_per_image, 1);
-  int j = 0;
-  for (auto i : keep_indexes) {
-    b_rois.row(j) = rois.row(i);
-    // set labels of bg rois to be 0
-    if (j >= fg_rois_this_image)
-      b_labels(j, 0) = 0;
-    else
-      b_labels(j, 0) = labels(i, 0);
-    ++j;
-  }
-
-  // load or compute bbox_target
   Eigen::MatrixXf boxes(rois_per_image, 4);
-  int b = 0;
-  for (auto i : keep_indexes) {
-    Eigen::Index j = gt_assignment(i);
-    boxes.row(b) = gt_boxes.row(j).leftCols(4);
-    ++b;
+  for (Eigen::Index j = 0; j < rois_per_image; ++j) {
+    auto i = keep_indexes[static_cast<size_t>(j)];
+    auto g = gt_assignment(i);
+    b_rois.row(j) = rois.row(i);
+    boxes.row(j) = gt_boxes.row(g).leftCols(4);
+    out_labels(j, 0) = j < fg_rois_this_image ? gt_boxes(g, 4) : 0;
   }
+  out_rois = b_rois;
 
   auto targets = bbox_transform(b_rois, boxes, box_stds);
   assert(targets.rows() >= fg_rois_this_image);
   assert(!(targets.array() > 1000).any());
 
-  Eigen::MatrixXf bbox_targets =
-      Eigen::MatrixXf::Zero(rois_per_image, 4 * num_classes);
-  Eigen::MatrixXf bbox_weights =
-      Eigen::MatrixXf::Zero(rois_per_image, 4 * num_classes);
+  out_bbox_targets.setZero();
+  out_bbox_weights.setZero();
   for (Eigen::Index i = 0; i < fg_rois_this_image; ++i) {
-    auto cls_ind = static_cast<int>(b_labels(i));
-    bbox_targets.row(i).block(0, cls_ind * 4, 1, 4).array() = targets.row(i);
-    bbox_weights.row(i).block(0, cls_ind * 4, 1, 4).array() = 1;
+    auto cls_ind = static_cast<int>(out_labels(i, 0));
+    out_bbox_targets.block(i, cls_ind * 4, 1, 4) = targets.row(i);
+    out_bbox_weights.block(i, cls_ind * 4, 1, 4).setOnes();
   }
+}
 
-  // assert(!b_rois.array().isNaN().any());
-
-  return std::make_tuple(b_rois, b_labels, bbox_targets, bbox_weights);
+std::tuple<Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf>
+SampleRois(const Eigen::MatrixXf& rois,
+           const Eigen::MatrixXf& gt_boxes,
+           int num_classes,
+           int rois_per_image,
+           int fg_rois_per_image,
+           float fg_overlap,
+           const std::vector<float>& box_stds) {
+  std::mt19937 mt(kSampleRoisSeed);
+  RowMatrixXf b_rois(rois_per_image, rois.cols());
+  RowMatrixXf b_labels(rois_per_image, 1);
+  RowMatrixXf bbox_targets(rois_per_image, 4 * num_classes);
+  RowMatrixXf bbox_weights(rois_per_image, 4 * num_classes);
+  SampleRois(rois, gt_boxes, num_classes, rois_per_image, fg_rois_per_image,
+             fg_overlap, box_stds, mt, b_rois, b_labels, bbox_targets,
+             bbox_weights);
+  return std::make_tuple(Eigen::MatrixXf(b_rois), Eigen::MatrixXf(b_labels),
+                         Eigen::MatrixXf(bbox_targets),
+                         Eigen::MatrixXf(bbox_weights));
 }
@@ -6,56 +6,80 @@
 #include <mxnet-cpp/MxNetCpp.h>
 #include <Eigen/Dense>
 
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <tuple>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 using Indices = Eigen::Array<Eigen::Index, Eigen::Dynamic, 1>;
 
+// max_cols(i) is the column of the maximum of the row i, max_rows(j) is the
+// last row whose maximum is in the column j or -1. The last column wins on
+// ties.
 std::pair<Indices, Indices> argmax(const Eigen::MatrixXf& m);
 
-struct WhereVisitor {
-  WhereVisitor(bool row = true) : is_row_(row) {}
+// Maximums of the rows and their columns in one pass over the column major
+// matrix, ties as in argmax
+void rowwise_max_argmax(const Eigen::MatrixXf& m,
+                        Eigen::ArrayXf& max,
+                        Indices& max_cols);
 
-  void init(const bool& value, Eigen::Index i, Eigen::Index j) {
-    operator()(value, i, j);
-  }
-  void operator()(const bool& value, Eigen::Index i, Eigen::Index j) {
-    if (value && data) {
-      data->push_back(is_row_ ? i : j);
-    }
+// Indices of the true values of the vector expression, compacted without
+// branches into the result, which keeps its capacity
+template <typename T>
+void expr_row_indices(const T& expr, std::vector<Eigen::Index>& result) {
+  result.resize(static_cast<size_t>(expr.size()));
+  size_t count = 0;
+  for (Eigen::Index i = 0; i < expr.size(); ++i) {
+    result[count] = i;
+    count += expr(i) ? 1 : 0;
   }
-  bool is_row_{true};
-  std::vector<Eigen::Index>* data{nullptr};
-};
+  result.resize(count);
+}
 
 template <typename T>
 std::vector<Eigen::Index> expr_row_indices(const T& expr) {
-  WhereVisitor indexes_visitor;
   std::vector<Eigen::Index> result;
-  indexes_visitor.data = &result;
-  expr.visit(indexes_visitor);
+  expr_row_indices(expr, result);
   return result;
 }
 
+// num random items of m without replacement in a random order, partial
+// Fisher-Yates shuffle. Few samples of many items keep only the swapped
+// positions in a map, so they cost O(num) and not O(m.size()).
 template <class T, class Rnd>
 T random_choice(const T& m, size_t num, Rnd& rnd) {
+  const size_t size = m.size();
+  num = std::min(num, size);
   T result(num);
-  // result.reserve(num);
-  //  std::uniform_int_distribution<size_t> dist(0, m.size() - 1);
-  //  std::unordered_set<size_t> set;
-  //  while (set.size() < num) {
-  //    auto index = dist(rnd);
-  //    if (set.find(index) == set.end()) {
-  //      result.push_back(m[index]);
-  //      set.insert(index);
-  //    }
-  //  }
-  std::vector<size_t> idx(m.size());
-  std::iota(idx.begin(), idx.end(), 0);
-  std::shuffle(idx.begin(), idx.end(), rnd);
-  for (size_t i = 0; i < num; ++i) {
-    result[i] = m[idx[i]];
+  if (num * 4 > size) {
+    std::vector<size_t> idx(size);
+    std::iota(idx.begin(), idx.end(), 0);
+    for (size_t i = 0; i < num; ++i) {
+      std::uniform_int_distribution<size_t> dist(i, size - 1);
+      std::swap(idx[i], idx[dist(rnd)]);
+      result[i] = m[idx[i]];
+    }
+  } else {
+    // position -> item index of the positions moved by the swaps
+    std::unordered_map<size_t, size_t> moved;
+    moved.reserve(num * 2);
+    auto at = [&moved](size_t pos) {
+      auto i = moved.find(pos);
+      return i != moved.end() ? i->second : pos;
+    };
+    for (size_t i = 0; i < num; ++i) {
+      std::uniform_int_distribution<size_t> dist(i, size - 1);
+      auto j = dist(rnd);
+      auto item = at(j);
+      moved[j] = at(i);
+      result[i] = m[item];
+    }
   }
-
   return result;
 }
 
@@ -103,6 +127,44 @@ Eigen::MatrixXf NDArray2ToEigen(const mxnet::cpp::NDArray& value);
 Eigen::MatrixXf NDArray3ToEigen(
     const mxnet::cpp::NDArray& value);  // ignore first dimension
 
+// NDArray memory layout
+using RowMatrixXf =
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using ConstRowMatrixMap = Eigen::Map<const RowMatrixXf>;
+using RowMatrixMap = Eigen::Map<RowMatrixXf>;
+
+/* Host copies of the net outputs (rois, scores, bbox_deltas) of one image.
+ * Arrays are allocated in the pinned memory on the first copy and reused
+ * for next images of the same output shapes, matrices are views of them.
+ */
+class PredictionBuffer {
+ public:
+  // Queues the copies, doesn't wait
+  void CopyFrom(const mxnet::cpp::NDArray& rois,
+                const mxnet::cpp::NDArray& scores,
+                const mxnet::cpp::NDArray& bbox_deltas);
+  // Only the detections decoded by the net, see rcnn_gpu_decode
+  void CopyFrom(const mxnet::cpp::NDArray& detections);
+  void WaitToRead() const;
+
+  // Valid after WaitToRead, until the next copy
+  // rois: [N, 5] batch index, x1, y1, x2, y2
+  // scores: [N, num_classes]
+  // bbox_deltas: [N, 4 * num_classes]
+  ConstRowMatrixMap Rois() const;
+  ConstRowMatrixMap Scores() const;
+  ConstRowMatrixMap BboxDeltas() const;
+  // detections: [rcnn_max_detections, 6] class id, score, x1, y1, x2, y2
+  ConstRowMatrixMap Detections() const;
+
+ private:
+  mxnet::cpp::NDArray rois_;
+  mxnet::cpp::NDArray scores_;
+  mxnet::cpp::NDArray bbox_deltas_;
+  mxnet::cpp::NDArray detections_;
+  bool decoded_{false};
+};
+
 struct Detection {
   long class_id = -1;
   float x1 = 0;
@@ -119,12 +181,31 @@ std::vector<Detection> DecodePredictions(const Eigen::MatrixXf& rois,
                                          const Eigen::MatrixXf& im_info,
                                          const Params& params);
 
+/*
+ * The same on views of the net outputs without intermediate matrices, only
+ * boxes of the scores above the threshold are decoded
+ * im_info: height, width, scale
+ */
+std::vector<Detection> DecodePredictions(const ConstRowMatrixMap& rois,
+                                         const ConstRowMatrixMap& scores,
+                                         const ConstRowMatrixMap& bbox_deltas,
+                                         const float* im_info,
+                                         const Params& params);
+
+// Detections of the net decode, rows with negative class ids are skipped
+std::vector<Detection> DecodeDetections(const ConstRowMatrixMap& detections);
+
 /*
  * greedily select boxes with high confidence and overlap with current maximum
  * <= thresh rule out overlap >= thresh
  */
 void nms(std::vector<Detection>& predictions, float nms_thresh);
 
+// Seed of the samples of the SampleRois without a random engine
+const uint32_t kSampleRoisSeed = 5675317;
+
+using RowMatrixRef = Eigen::Ref<RowMatrixXf, 0, Eigen::OuterStride<>>;
+
 /*
  * Generate random sample of ROIs comprising foreground and background examples
  * rois: [n, 4] (x1, y1, x2, y2)
@@ -135,6 +216,7 @@ void nms(std::vector<Detection>& predictions, float nms_thresh);
  * fg_overlap: overlap threshold for fg rois
  * box_stds: std var of bbox reg
  * return: (labels, rois, bbox_targets, bbox_weights)
+ * The samples are the same every call, see the overload below.
  */
 std::tuple<Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf, Eigen::MatrixXf>
 SampleRois(const Eigen::MatrixXf& rois,
@@ -145,4 +227,23 @@ SampleRois(const Eigen::MatrixXf& rois,
            float fg_overlap,
            const std::vector<float>& box_stds);
 
+/*
+ * SampleRois with the random engine of the caller, the results are written
+ * into the rows of the outputs: out_rois [rois_per_image, 4], out_labels
+ * [rois_per_image, 1], out_bbox_targets and out_bbox_weights [rois_per_image,
+ * 4 * num_classes]. The outputs can be blocks of one batch matrix.
+ */
+void SampleRois(const Eigen::MatrixXf& rois,
+                const Eigen::MatrixXf& gt_boxes,
+                int num_classes,
+                int rois_per_image,
+                int fg_rois_per_image,
+                float fg_overlap,
+                const std::vector<float>& box_stds,
+                std::mt19937& mt,
+                RowMatrixRef out_rois,
+                RowMatrixRef out_labels,
+                RowMatrixRef out_bbox_targets,
+                RowMatrixRef out_bbox_weights);
+
 #endif  // BBOX_H
@@ -0,0 +1,319 @@
+#include "../anchorgenerator.h"
+#include "../anchorsampler.h"
+#include "../bbox.h"
+#include "../imagedb.h"
+#include "../imageutils.h"
+#include "../params.h"
+#include "../trainiter.h"
+
+#include <benchmark/benchmark.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <random>
+#include <vector>
+
+namespace {
+const float kImageWidth = 640;
+const float kImageHeight = 480;
+
+// [n, 4] x1, y1, x2, y2 boxes in the image
+Eigen::MatrixXf RandomBoxes(Eigen::Index n, uint32_t seed) {
+  std::mt19937 mt(seed);
+  std::uniform_real_distribution<float> x(0, kImageWidth * 0.8f);
+  std::uniform_real_distribution<float> y(0, kImageHeight * 0.8f);
+  std::uniform_real_distribution<float> side(8, kImageHeight * 0.2f);
+  Eigen::MatrixXf boxes(n, 4);
+  for (Eigen::Index i = 0; i < n; ++i) {
+    boxes(i, 0) = x(mt);
+    boxes(i, 1) = y(mt);
+    boxes(i, 2) = boxes(i, 0) + side(mt);
+    boxes(i, 3) = boxes(i, 1) + side(mt);
+  }
+  return boxes;
+}
+
+// [n, 5] boxes with classes in [1, num_classes)
+Eigen::MatrixXf RandomGtBoxes(Eigen::Index n, int num_classes) {
+  Eigen::MatrixXf gt_boxes(n, 5);
+  gt_boxes.leftCols(4) = RandomBoxes(n, 7);
+  for (Eigen::Index i = 0; i < n; ++i)
+    gt_boxes(i, 4) = static_cast<float>(1 + i % (num_classes - 1));
+  return gt_boxes;
+}
+
+std::vector<Detection> RandomDetections(Eigen::Index n) {
+  auto boxes = RandomBoxes(n, 3);
+  std::mt19937 mt(5);
+  std::uniform_real_distribution<float> score(0, 1);
+  std::vector<Detection> detections(static_cast<size_t>(n));
+  for (Eigen::Index i = 0; i < n; ++i) {
+    auto& det = detections[static_cast<size_t>(i)];
+    det.class_id = 1;
+    det.x1 = boxes(i, 0);
+    det.y1 = boxes(i, 1);
+    det.x2 = boxes(i, 2);
+    det.y2 = boxes(i, 3);
+    det.score = score(mt);
+  }
+  return detections;
+}
+
+/* Images of the training shape with random boxes, generated in memory so
+ * the iterator is measured without the disk and jpeg decoding
+ */
+class BenchImageDb : public ImageDb {
+ public:
+  BenchImageDb(uint32_t images_num, Eigen::Index boxes_num)
+      : images_num_(images_num),
+        image_(static_cast<int>(kImageHeight), static_cast<int>(kImageWidth),
+               CV_8UC3) {
+    cv::randu(image_, cv::Scalar::all(0), cv::Scalar::all(255));
+    auto boxes = RandomBoxes(boxes_num, 11);
+    for (Eigen::Index i = 0; i < boxes_num; ++i) {
+      boxes_.push_back(LabelBBox{boxes(i, 0), boxes(i, 1),
+                                 boxes(i, 2) - boxes(i, 0),
+                                 boxes(i, 3) - boxes(i, 1)});
+      classes_.push_back(static_cast<float>(1 + i % 80));
+    }
+  }
+
+  uint32_t GetImagesCount() const override { return images_num_; }
+  cv::Size GetImageSize(uint32_t /*index*/) const override {
+    return image_.size();
+  }
+  ImageDesc GetImage(uint32_t /*index*/,
+                     uint32_t height,
+                     uint32_t width) const override {
+    ImageDesc result;
+    std::tie(result.image, result.scale) =
+        FitImageSize(image_.clone(), height, width);
+    result.height = result.image.rows;
+    result.width = result.image.cols;
+    result.boxes = boxes_;
+    result.classes = classes_;
+    return result;
+  }
+
+ private:
+  uint32_t images_num_{0};
+  cv::Mat image_;
+  std::vector<LabelBBox> boxes_;
+  std::vector<float> classes_;
+};
+
+void BM_BboxOverlaps(benchmark::State& state) {
+  auto boxes = RandomBoxes(state.range(0), 1);
+  auto query_boxes = RandomBoxes(state.range(1), 2);
+  for (auto _ : state) {
+    auto overlaps = bbox_overlaps(boxes, query_boxes);
+    benchmark::DoNotOptimize(overlaps.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) *
+                          state.range(1));
+}
+BENCHMARK(BM_BboxOverlaps)
+    ->Args({2000, 100})
+    ->Args({12000, 100})
+    ->Args({20000, 20})
+    ->ArgNames({"boxes", "gt"})
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_BboxTransform(benchmark::State& state) {
+  auto ex_rois = RandomBoxes(state.range(0), 1);
+  auto gt_rois = RandomBoxes(state.range(0), 2);
+  for (auto _ : state) {
+    auto targets = bbox_transform(ex_rois, gt_rois, {0.1f, 0.1f, 0.2f, 0.2f});
+    benchmark::DoNotOptimize(targets.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BboxTransform)
+    ->Arg(512)
+    ->Arg(12000)
+    ->ArgName("rois")
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_BboxPred(benchmark::State& state) {
+  auto n = state.range(0);
+  auto classes = state.range(1);
+  auto boxes = RandomBoxes(n, 1);
+  Eigen::MatrixXf deltas = Eigen::MatrixXf::Random(n, 4 * classes) * 0.1f;
+  Eigen::MatrixXf stds(1, 4);
+  stds << 0.1f, 0.1f, 0.2f, 0.2f;
+  for (auto _ : state) {
+    auto pred = bbox_pred(boxes, deltas, stds);
+    benchmark::DoNotOptimize(pred.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n * classes);
+}
+BENCHMARK(BM_BboxPred)
+    ->Args({300, 81})
+    ->Args({12000, 1})
+    ->ArgNames({"rois", "classes"})
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_ClipBoxes(benchmark::State& state) {
+  auto n = state.range(0);
+  auto classes = state.range(1);
+  Eigen::MatrixXf boxes =
+      (Eigen::MatrixXf::Random(n, 4 * classes).array() + 0.5f) * kImageWidth;
+  for (auto _ : state) {
+    auto clipped = clip_boxes(boxes, kImageWidth, kImageHeight);
+    benchmark::DoNotOptimize(clipped.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n * classes);
+}
+BENCHMARK(BM_ClipBoxes)
+    ->Args({300, 81})
+    ->Args({12000, 1})
+    ->ArgNames({"rois", "classes"})
+    ->Unit(benchmark::kMicrosecond);
+
+// The copy of the detections is a part of the time, nms changes them
+void BM_Nms(benchmark::State& state) {
+  auto detections = RandomDetections(state.range(0));
+  for (auto _ : state) {
+    auto kept = detections;
+    nms(kept, 0.3f);
+    benchmark::DoNotOptimize(kept.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Nms)
+    ->Arg(300)
+    ->Arg(2000)
+    ->Arg(12000)
+    ->ArgName("boxes")
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_SampleRois(benchmark::State& state) {
+  const int num_classes = static_cast<int>(state.range(2));
+  auto rois = RandomBoxes(state.range(0), 1);
+  auto gt_boxes = RandomGtBoxes(state.range(1), num_classes);
+  Params params;
+  for (auto _ : state) {
+    auto samples = SampleRois(
+        rois, gt_boxes, num_classes, params.rcnn_batch_rois,
+        static_cast<int>(params.rcnn_fg_fraction * params.rcnn_batch_rois),
+        params.rcnn_fg_overlap, params.rcnn_bbox_stds);
+    benchmark::DoNotOptimize(std::get<0>(samples).data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SampleRois)
+    ->Args({2000, 100, 81})
+    ->Args({12000, 100, 81})
+    ->ArgNames({"rois", "gt", "classes"})
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_AnchorGenerate(benchmark::State& state) {
+  Params params;
+  AnchorGenerator generator(params);
+  auto width = static_cast<uint32_t>(state.range(0));
+  auto height = static_cast<uint32_t>(state.range(1));
+  for (auto _ : state) {
+    auto anchors = generator.Generate(width, height);
+    benchmark::DoNotOptimize(anchors.data());
+  }
+  state.SetItemsProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_AnchorGenerate)
+    ->Args({40, 30})
+    ->Args({64, 64})
+    ->ArgNames({"width", "height"})
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_AnchorAssign(benchmark::State& state) {
+  Params params;
+  AnchorGenerator generator(params);
+  AnchorSampler sampler(params);
+  auto anchors = generator.Generate(static_cast<uint32_t>(state.range(0)),
+                                    static_cast<uint32_t>(state.range(1)));
+  auto gt_boxes = RandomGtBoxes(state.range(2), params.rcnn_num_classes);
+  const auto count = static_cast<size_t>(anchors.rows());
+  std::vector<float> labels(count);
+  std::vector<float> bbox_targets(count * 4);
+  std::vector<float> bbox_weights(count * 4);
+  for (auto _ : state) {
+    sampler.Assign(anchors, gt_boxes, kImageWidth, kImageHeight, labels.data(),
+                   bbox_targets.data(), bbox_weights.data());
+    benchmark::DoNotOptimize(labels.data());
+  }
+  state.SetItemsProcessed(state.iterations() * anchors.rows());
+}
+BENCHMARK(BM_AnchorAssign)
+    ->Args({40, 30, 20})
+    ->Args({40, 30, 100})
+    ->ArgNames({"width", "height", "gt"})
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_CVToMxnetFormat(benchmark::State& state) {
+  cv::Mat image(static_cast<int>(state.range(1)),
+                static_cast<int>(state.range(0)), CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+  std::vector<float> data(image.total() * 3);
+  for (auto _ : state) {
+    CVToMxnetFormat(image, data.data());
+    benchmark::DoNotOptimize(data.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size() * sizeof(float));
+}
+BENCHMARK(BM_CVToMxnetFormat)
+    ->Args({640, 480})
+    ->Args({1024, 1024})
+    ->ArgNames({"width", "height"})
+    ->Unit(benchmark::kMicrosecond);
+
+// Batches of the iterator with the decode pool and the label assignment,
+// arrays are on the CPU
+void BM_TrainIterNext(benchmark::State& state) {
+  Params params;
+  params.rcnn_batch_size = static_cast<uint32_t>(state.range(0));
+  BenchImageDb image_db(64, state.range(1));
+  std::vector<TrainBucket> buckets;
+  for (const auto& shape : params.train_buckets) {
+    TrainBucket bucket;
+    bucket.height = shape.first;
+    bucket.width = shape.second;
+    auto stride = static_cast<uint32_t>(params.rpn_feat_stride);
+    bucket.feat_height = (bucket.height + stride - 1) / stride;
+    bucket.feat_width = (bucket.width + stride - 1) / stride;
+    buckets.push_back(bucket);
+  }
+  TrainIter train_iter(&image_db, params, buckets);
+  std::vector<std::map<std::string, mxnet::cpp::NDArray>> arrays(
+      train_iter.GetBucketsCount());
+  mxnet::cpp::Context ctx(mxnet::cpp::kCPU, 0);
+  for (size_t b = 0; b < arrays.size(); ++b) {
+    const auto& shapes = train_iter.GetShapes(b);
+    arrays[b]["data"] = mxnet::cpp::NDArray(shapes.im, ctx, false);
+    arrays[b]["im_info"] = mxnet::cpp::NDArray(shapes.im_info, ctx, false);
+    arrays[b]["gt_boxes"] = mxnet::cpp::NDArray(shapes.gt_boxes, ctx, false);
+    arrays[b]["label"] = mxnet::cpp::NDArray(shapes.label, ctx, false);
+    arrays[b]["bbox_target"] =
+        mxnet::cpp::NDArray(shapes.bbox_target, ctx, false);
+    arrays[b]["bbox_weight"] =
+        mxnet::cpp::NDArray(shapes.bbox_weight, ctx, false);
+  }
+  train_iter.Reset();
+  for (auto _ : state) {
+    if (!train_iter.Next()) {
+      train_iter.Reset();
+      train_iter.Next();
+    }
+    auto& batch = arrays[train_iter.GetBucket()];
+    train_iter.GetData(batch["data"], batch["im_info"], batch["gt_boxes"],
+                       batch["label"], batch["bbox_target"],
+                       batch["bbox_weight"]);
+    mxnet::cpp::NDArray::WaitAll();
+  }
+  state.SetItemsProcessed(state.iterations() * params.rcnn_batch_size);
+}
+BENCHMARK(BM_TrainIterNext)
+    ->Args({4, 20})
+    ->Args({4, 100})
+    ->ArgNames({"batch", "gt"})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+}  // namespace
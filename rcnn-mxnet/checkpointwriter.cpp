@@ -0,0 +1,108 @@
+#include "checkpointwriter.h"
+#include "params.h"
+
+#include <cstdio>
+#include <experimental/filesystem>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::experimental::filesystem;
+
+CheckpointWriter::CheckpointWriter(const std::string& file_name,
+                                   uint32_t keep_last)
+    : file_name_(file_name), keep_last_(keep_last) {
+  writer_thread_ = std::thread([this]() { WriterLoop(); });
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !pending_; });
+    stop_ = true;
+  }
+  cv_.notify_all();
+  writer_thread_.join();
+}
+
+void CheckpointWriter::Save(mxnet::cpp::Executor* exe, uint32_t epoch) {
+  using mxnet::cpp::NDArray;
+  Wait();
+  for (const auto& param : GetNetParams(exe)) {
+    auto& host = snapshot_[param.first];
+    if (host.GetShape() != param.second.GetShape())
+      host = NDArray(param.second.GetShape(), mxnet::cpp::Context::cpu(),
+                     false);
+    param.second.CopyTo(&host);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = true;
+    pending_epoch_ = epoch;
+  }
+  cv_.notify_all();
+}
+
+void CheckpointWriter::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return !pending_; });
+  if (error_) {
+    auto error = error_;
+    error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void CheckpointWriter::WriterLoop() {
+  while (true) {
+    uint32_t epoch{0};
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || pending_; });
+      if (!pending_)
+        break;
+      epoch = pending_epoch_;
+    }
+    std::exception_ptr error;
+    try {
+      Write(epoch);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ = false;
+      if (error)
+        error_ = error;
+    }
+    cv_.notify_all();
+  }
+}
+
+void CheckpointWriter::Write(uint32_t epoch) {
+  // waits only for the snapshot copies
+  for (const auto& array : snapshot_)
+    array.second.WaitToRead();
+
+  auto tmp_file_name = file_name_ + ".tmp";
+  mxnet::cpp::NDArray::Save(tmp_file_name, snapshot_);
+  if (std::rename(tmp_file_name.c_str(), file_name_.c_str()) != 0)
+    throw std::runtime_error("Failed to write check point " + file_name_);
+
+  if (keep_last_ > 0) {
+    fs::copy_file(file_name_, EpochFileName(epoch),
+                  fs::copy_options::overwrite_existing);
+    if (epoch >= keep_last_) {
+      std::error_code ec;
+      fs::remove(EpochFileName(epoch - keep_last_), ec);
+    }
+  }
+}
+
+std::string CheckpointWriter::EpochFileName(uint32_t epoch) const {
+  fs::path path(file_name_);
+  std::stringstream name;
+  name << path.stem().string() << "-" << std::setw(4) << std::setfill('0')
+       << epoch << path.extension().string();
+  return (path.parent_path() / name.str()).string();
+}
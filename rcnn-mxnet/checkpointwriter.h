@@ -0,0 +1,55 @@
+#ifndef CHECKPOINTWRITER_H
+#define CHECKPOINTWRITER_H
+
+#include <mxnet-cpp/MxNetCpp.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/* Saves parameters of an executor without stopping the training. Save only
+ * queues copies of the parameters to host arrays, the engine runs them
+ * before the next updates of the weights. A writer thread waits for the
+ * copies, writes a temporary file and renames it to the check point file,
+ * so the file is always complete. With keep_last > 0 the check points of
+ * the last keep_last epochs are also kept as <name>-<epoch><ext>.
+ */
+class CheckpointWriter {
+ public:
+  explicit CheckpointWriter(const std::string& file_name,
+                            uint32_t keep_last = 0);
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+  ~CheckpointWriter();
+
+  // Waits only while the previous check point is written, rethrows its
+  // errors
+  void Save(mxnet::cpp::Executor* exe, uint32_t epoch);
+  // Waits until the last check point is written
+  void Wait();
+
+ private:
+  void WriterLoop();
+  void Write(uint32_t epoch);
+  std::string EpochFileName(uint32_t epoch) const;
+
+ private:
+  std::string file_name_;
+  uint32_t keep_last_{0};
+  // host arrays are allocated by the first save and reused
+  std::map<std::string, mxnet::cpp::NDArray> snapshot_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool pending_{false};
+  uint32_t pending_epoch_{0};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::thread writer_thread_;
+};
+
+#endif  // CHECKPOINTWRITER_H
@@ -6,6 +6,7 @@
 #include <rapidjson/filereadstream.h>
 #include <rapidjson/reader.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <experimental/filesystem>
 #include <iostream>
@@ -144,6 +145,8 @@ struct CocoHandler
         annotation_.image_id = u;
       } else if (key_ == "category_id") {
         annotation_.category_id = u;
+      } else if (key_ == "iscrowd") {
+        annotation_.iscrowd = u != 0;
       }
     }
     return true;
@@ -184,6 +187,7 @@ struct CocoHandler
       category_object_ = false;
     } else if (annotation_array_ && annotation_object_) {
       coco_->AddAnnotation(annotation_);
+      annotation_ = CocoAnnotation();
       annotation_object_ = false;
     }
     key_.clear();
@@ -237,7 +241,20 @@ struct CocoHandler
 
 void Coco::LoadTrainData(const std::vector<uint32_t>& keep_classes,
                          float keep_aspect) {
-  auto* file = std::fopen(train_annotations_file_.c_str(), "r");
+  images_folder_ = train_images_folder_;
+  LoadData(train_annotations_file_, keep_classes, keep_aspect, false);
+}
+
+void Coco::LoadValData(const std::vector<uint32_t>& keep_classes) {
+  images_folder_ = test_images_folder_;
+  LoadData(test_annotations_file_, keep_classes, -1, true);
+}
+
+void Coco::LoadData(const std::string& annotations_file,
+                    const std::vector<uint32_t>& keep_classes,
+                    float keep_aspect,
+                    bool keep_empty) {
+  auto* file = std::fopen(annotations_file.c_str(), "r");
   if (file) {
     char readBuffer[65536];
     rapidjson::FileReadStream is(file, readBuffer, sizeof(readBuffer));
@@ -260,7 +277,10 @@ void Coco::LoadTrainData(const std::vector<uint32_t>& keep_classes,
       auto image_id = img.first;
       auto i = image_to_ant_index_.find(image_id);
       if (i == image_to_ant_index_.end()) {
-        images_to_remove.push_back(image_id);
+        if (keep_empty)
+          image_to_ant_index_[image_id];
+        else
+          images_to_remove.push_back(image_id);
       }
     }
     for (auto image_id : images_to_remove) {
@@ -311,7 +331,7 @@ void Coco::LoadTrainData(const std::vector<uint32_t>& keep_classes,
           }
         }
 
-        if (skip) {
+        if (skip && !keep_empty) {
           images_to_remove.push_back(image_id);
         } else {
           for (auto ant_id : ant_to_remove) {
@@ -324,8 +344,43 @@ void Coco::LoadTrainData(const std::vector<uint32_t>& keep_classes,
         images_.erase(image_id);
       }
     }
+    BuildImageTable();
   } else {
-    throw std::runtime_error(train_annotations_file_ + " file can't be opened");
+    throw std::runtime_error(annotations_file + " file can't be opened");
+  }
+}
+
+void Coco::BuildImageTable() {
+  image_table_.clear();
+  image_table_.reserve(images_.size());
+  for (auto& img : images_) {
+    image_table_.push_back(img.second);
+  }
+  std::sort(image_table_.begin(), image_table_.end(),
+            [](const CocoImage& a, const CocoImage& b) { return a.id < b.id; });
+
+  image_offsets_.assign(1, 0);
+  image_offsets_.reserve(image_table_.size() + 1);
+  image_boxes_.clear();
+  image_classes_.clear();
+  image_crowd_.clear();
+  std::vector<uint32_t> ant_ids;
+  for (auto& image : image_table_) {
+    const auto& ants = image_to_ant_index_.at(image.id);
+    ant_ids.assign(ants.begin(), ants.end());
+    std::sort(ant_ids.begin(), ant_ids.end());
+    for (const auto ant_id : ant_ids) {
+      const auto& ant = annotations_.at(ant_id);
+      image_boxes_.push_back(LabelBBox{static_cast<float>(ant.bbox.x),
+                                       static_cast<float>(ant.bbox.y),
+                                       static_cast<float>(ant.bbox.width),
+                                       static_cast<float>(ant.bbox.height)});
+      const auto& cat = categories_.at(ant.category_id);
+      uint32_t class_ind = cat_ind_to_class_ind_.at(cat.id);
+      image_classes_.push_back(static_cast<float>(class_ind));
+      image_crowd_.push_back(ant.iscrowd);
+    }
+    image_offsets_.push_back(image_boxes_.size());
   }
 }
 
@@ -346,17 +401,36 @@ void Coco::AddCategory(CocoCategory category) {
 }
 
 uint32_t Coco::GetImagesCount() const {
-  return static_cast<uint32_t>(images_.size());
+  return static_cast<uint32_t>(image_table_.size());
+}
+
+cv::Size Coco::GetImageSize(uint32_t index) const {
+  const auto& image = image_table_.at(index);
+  return cv::Size(static_cast<int>(image.width),
+                  static_cast<int>(image.height));
+}
+
+std::string Coco::GetImagePath(uint32_t index) const {
+  return (fs::path(images_folder_) / image_table_.at(index).name).string();
+}
+
+CocoGroundTruth Coco::GetGroundTruth(uint32_t index) const {
+  CocoGroundTruth result;
+  for (auto i = image_offsets_.at(index); i < image_offsets_.at(index + 1);
+       ++i) {
+    result.boxes.push_back(image_boxes_[i]);
+    result.classes.push_back(static_cast<uint32_t>(image_classes_[i]));
+    result.crowd.push_back(image_crowd_[i]);
+  }
+  return result;
 }
 
 ImageDesc Coco::GetImage(uint32_t index,
                          uint32_t height,
                          uint32_t width) const {
-  if (index < images_.size()) {
-    auto i = images_.begin();
-    std::advance(i, index);
-    fs::path file_path(train_images_folder_);
-    file_path /= i->second.name;
+  if (index < image_table_.size()) {
+    fs::path file_path(images_folder_);
+    file_path /= image_table_[index].name;
     // std::cout << file_path << std::endl;
     cv::Mat img;
     float scale{0};
@@ -367,19 +441,12 @@ ImageDesc Coco::GetImage(uint32_t index,
       result.scale = scale;
       result.height = img.rows;
       result.width = img.cols;
-      auto& ants = image_to_ant_index_.at(i->second.id);
-      result.boxes.reserve(ants.size());
-      result.classes.reserve(ants.size());
-      for (const auto ant_id : ants) {
-        const auto& ant = annotations_.at(ant_id);
-        result.boxes.push_back(LabelBBox{static_cast<float>(ant.bbox.x),
-                                         static_cast<float>(ant.bbox.y),
-                                         static_cast<float>(ant.bbox.width),
-                                         static_cast<float>(ant.bbox.height)});
-        const auto& cat = categories_.at(ant.category_id);
-        uint32_t class_ind = cat_ind_to_class_ind_.at(cat.id);
-        result.classes.push_back(static_cast<float>(class_ind));
-      }
+      auto begin = static_cast<std::ptrdiff_t>(image_offsets_[index]);
+      auto end = static_cast<std::ptrdiff_t>(image_offsets_[index + 1]);
+      result.boxes.assign(image_boxes_.begin() + begin,
+                          image_boxes_.begin() + end);
+      result.classes.assign(image_classes_.begin() + begin,
+                            image_classes_.begin() + end);
       return result;
     } else {
       throw std::runtime_error(file_path.string() + " file can't be opened");
@@ -9,6 +9,7 @@
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 struct CocoCategory {
   uint32_t id = 0;
@@ -27,6 +28,7 @@ struct CocoAnnotation {
   uint32_t image_id = 0;
   uint32_t category_id = 0;
   CocoBBox bbox;  // x,y,w,h
+  bool iscrowd = false;
   void push_bbox(double v) {
     switch (bbox_index) {
       case 0:
@@ -50,6 +52,13 @@ struct CocoAnnotation {
   uint32_t bbox_index = 0;
 };
 
+// Boxes of an image for the evaluation, crowd boxes are ignored
+struct CocoGroundTruth {
+  std::vector<LabelBBox> boxes;
+  std::vector<uint32_t> classes;
+  std::vector<bool> crowd;
+};
+
 struct CocoImage {
   uint32_t id = 0;
   uint32_t width = 0;
@@ -62,6 +71,8 @@ class Coco : public ImageDb {
   explicit Coco(const std::string& path);
   void LoadTrainData(const std::vector<uint32_t>& keep_classes = {},
                      float keep_aspect = -1);
+  // Validation images, the ones without annotations are kept
+  void LoadValData(const std::vector<uint32_t>& keep_classes = {});
   void AddImage(CocoImage image);
   void AddAnnotation(CocoAnnotation annotation);
   void AddCategory(CocoCategory category);
@@ -69,17 +80,30 @@ class Coco : public ImageDb {
 
   static const std::vector<std::string>& GetClasses();
 
+  std::string GetImagePath(uint32_t index) const;
+  CocoGroundTruth GetGroundTruth(uint32_t index) const;
+
   // ImageDb interface
   uint32_t GetImagesCount() const override;
+  cv::Size GetImageSize(uint32_t index) const override;
   ImageDesc GetImage(uint32_t index,
                      uint32_t height,
                      uint32_t width) const override;
 
+ private:
+  void LoadData(const std::string& annotations_file,
+                const std::vector<uint32_t>& keep_classes,
+                float keep_aspect,
+                bool keep_empty);
+  void BuildImageTable();
+
  private:
   std::string train_images_folder_;
   std::string test_images_folder_;
   std::string train_annotations_file_;
   std::string test_annotations_file_;
+  // folder of the loaded images
+  std::string images_folder_;
 
   std::unordered_map<uint32_t, CocoImage> images_;
   std::unordered_map<uint32_t, CocoAnnotation> annotations_;
@@ -88,6 +112,14 @@ class Coco : public ImageDb {
   std::unordered_map<uint32_t, std::unordered_set<uint32_t>>
       image_to_ant_index_;
   std::unordered_map<uint32_t, uint32_t> cat_ind_to_class_ind_;
+
+  // Loaded images ordered by id, GetImage takes them by index. Boxes and
+  // classes of the image i are in [image_offsets_[i], image_offsets_[i + 1])
+  std::vector<CocoImage> image_table_;
+  std::vector<size_t> image_offsets_;
+  std::vector<LabelBBox> image_boxes_;
+  std::vector<float> image_classes_;
+  std::vector<bool> image_crowd_;
 };
 
 #endif  // COCO_H
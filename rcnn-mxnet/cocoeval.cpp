@@ -0,0 +1,237 @@
+#include "cocoeval.h"
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+
+namespace {
+const float kAreaRanges[CocoEvaluator::kAreas][2] = {{0.f, 1e10f},
+                                                     {0.f, 32.f * 32.f},
+                                                     {32.f * 32.f, 96.f * 96.f},
+                                                     {96.f * 96.f, 1e10f}};
+const size_t kMaxDets[] = {1, 10, 100};
+const size_t kRecallPoints = 101;
+
+float Threshold(size_t t) {
+  return 0.5f + 0.05f * static_cast<float>(t);
+}
+
+bool OutOfRange(float area, size_t range) {
+  return area < kAreaRanges[range][0] || area > kAreaRanges[range][1];
+}
+
+// Boxes are x, y, width, height; the union of a crowd box is the detection
+float Iou(const LabelBBox& det, const LabelBBox& gt, bool crowd) {
+  auto w = std::min(det.x + det.width, gt.x + gt.width) - std::max(det.x, gt.x);
+  auto h =
+      std::min(det.y + det.height, gt.y + gt.height) - std::max(det.y, gt.y);
+  if (w <= 0 || h <= 0)
+    return 0;
+  auto intersection = w * h;
+  auto det_area = det.width * det.height;
+  auto union_area =
+      crowd ? det_area : det_area + gt.width * gt.height - intersection;
+  return union_area > 0 ? intersection / union_area : 0;
+}
+}  // namespace
+
+void CocoEvaluator::AddImage(const CocoGroundTruth& ground_truth,
+                             const std::vector<Detection>& detections) {
+  std::map<uint32_t, std::vector<size_t>> class_gts;
+  std::map<uint32_t, std::vector<const Detection*>> class_dets;
+  for (size_t g = 0; g < ground_truth.boxes.size(); ++g)
+    class_gts[ground_truth.classes[g]].push_back(g);
+  for (const auto& det : detections)
+    class_dets[static_cast<uint32_t>(det.class_id)].push_back(&det);
+  for (const auto& gts : class_gts)
+    class_dets[gts.first];
+
+  std::vector<ImageClassEval> evals;
+  std::vector<LabelBBox> det_boxes;
+  std::vector<float> ious;
+  std::vector<size_t> gt_order;
+  std::vector<uint8_t> gt_ignored;
+  std::vector<int> gt_match;
+  for (auto& dets : class_dets) {
+    auto& class_det = dets.second;
+    std::stable_sort(class_det.begin(), class_det.end(),
+                     [](const Detection* a, const Detection* b) {
+                       return a->score > b->score;
+                     });
+    if (class_det.size() > kMaxDets[2])
+      class_det.resize(kMaxDets[2]);
+    static const std::vector<size_t> no_gts;
+    auto gts_iter = class_gts.find(dets.first);
+    const auto& gts = gts_iter != class_gts.end() ? gts_iter->second : no_gts;
+    const auto dets_num = class_det.size();
+    const auto gts_num = gts.size();
+
+    ImageClassEval eval;
+    eval.class_id = dets.first;
+    det_boxes.clear();
+    // detections are inclusive pixel boxes
+    for (const auto* det : class_det) {
+      eval.scores.push_back(det->score);
+      det_boxes.push_back(LabelBBox{det->x1, det->y1, det->x2 - det->x1 + 1,
+                                    det->y2 - det->y1 + 1});
+    }
+    ious.resize(dets_num * gts_num);
+    for (size_t d = 0; d < dets_num; ++d) {
+      for (size_t g = 0; g < gts_num; ++g)
+        ious[d * gts_num + g] = Iou(det_boxes[d], ground_truth.boxes[gts[g]],
+                                    ground_truth.crowd[gts[g]]);
+    }
+
+    for (size_t a = 0; a < kAreas; ++a) {
+      gt_ignored.resize(gts_num);
+      for (size_t g = 0; g < gts_num; ++g) {
+        const auto& box = ground_truth.boxes[gts[g]];
+        gt_ignored[g] = ground_truth.crowd[gts[g]] ||
+                        OutOfRange(box.width * box.height, a);
+      }
+      eval.gt_count[a] = static_cast<uint32_t>(
+          std::count(gt_ignored.begin(), gt_ignored.end(), 0));
+      // ground truth which isn't ignored is matched first
+      gt_order.resize(gts_num);
+      std::iota(gt_order.begin(), gt_order.end(), 0);
+      std::stable_sort(gt_order.begin(), gt_order.end(),
+                       [&gt_ignored](size_t l, size_t r) {
+                         return gt_ignored[l] < gt_ignored[r];
+                       });
+
+      auto& matched = eval.matched[a];
+      auto& ignored = eval.ignored[a];
+      matched.assign(kThresholds * dets_num, 0);
+      ignored.assign(kThresholds * dets_num, 0);
+      for (size_t t = 0; t < kThresholds; ++t) {
+        gt_match.assign(gts_num, -1);
+        for (size_t d = 0; d < dets_num; ++d) {
+          auto best_iou = std::min(Threshold(t), 1 - 1e-10f);
+          int best = -1;
+          for (auto g : gt_order) {
+            // crowd boxes match any number of detections
+            if (gt_match[g] >= 0 && !ground_truth.crowd[gts[g]])
+              continue;
+            // the rest are ignored boxes
+            if (best >= 0 && !gt_ignored[static_cast<size_t>(best)] &&
+                gt_ignored[g])
+              break;
+            if (ious[d * gts_num + g] < best_iou)
+              continue;
+            best_iou = ious[d * gts_num + g];
+            best = static_cast<int>(g);
+          }
+          auto i = t * dets_num + d;
+          if (best >= 0) {
+            gt_match[static_cast<size_t>(best)] = static_cast<int>(d);
+            matched[i] = 1;
+            ignored[i] = gt_ignored[static_cast<size_t>(best)];
+          } else {
+            const auto& box = det_boxes[d];
+            ignored[i] = OutOfRange(box.width * box.height, a);
+          }
+        }
+      }
+    }
+    evals.push_back(std::move(eval));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& eval : evals)
+    evals_.push_back(std::move(eval));
+  ++images_count_;
+}
+
+uint32_t CocoEvaluator::GetImagesCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return images_count_;
+}
+
+std::pair<float, float> CocoEvaluator::Accumulate(
+    const std::vector<size_t>& evals,
+    size_t area,
+    size_t threshold,
+    size_t max_dets) const {
+  struct Match {
+    float score;
+    bool matched;
+  };
+  std::vector<Match> matches;
+  uint32_t gt_count = 0;
+  for (auto e : evals) {
+    const auto& eval = evals_[e];
+    gt_count += eval.gt_count[area];
+    const auto dets_num = eval.scores.size();
+    for (size_t d = 0; d < std::min(dets_num, max_dets); ++d) {
+      auto i = threshold * dets_num + d;
+      if (!eval.ignored[area][i])
+        matches.push_back(Match{eval.scores[d], eval.matched[area][i] != 0});
+    }
+  }
+  if (gt_count == 0)
+    return {-1.f, -1.f};
+  std::stable_sort(
+      matches.begin(), matches.end(),
+      [](const Match& a, const Match& b) { return a.score > b.score; });
+
+  std::vector<float> precision(matches.size());
+  std::vector<float> recall(matches.size());
+  float tp = 0;
+  for (size_t i = 0; i < matches.size(); ++i) {
+    tp += matches[i].matched ? 1 : 0;
+    precision[i] = tp / static_cast<float>(i + 1);
+    recall[i] = tp / static_cast<float>(gt_count);
+  }
+  // the envelope of the precision
+  for (size_t i = matches.size(); i-- > 1;)
+    precision[i - 1] = std::max(precision[i - 1], precision[i]);
+  float precision_sum = 0;
+  for (size_t r = 0; r < kRecallPoints; ++r) {
+    auto recall_point = static_cast<float>(r) / (kRecallPoints - 1);
+    auto i = std::lower_bound(recall.begin(), recall.end(), recall_point) -
+             recall.begin();
+    if (static_cast<size_t>(i) < precision.size())
+      precision_sum += precision[static_cast<size_t>(i)];
+  }
+  return {precision_sum / kRecallPoints, recall.empty() ? 0 : recall.back()};
+}
+
+CocoEvaluator::Summary CocoEvaluator::Summarize() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<uint32_t, std::vector<size_t>> class_evals;
+  for (size_t e = 0; e < evals_.size(); ++e)
+    class_evals[evals_[e].class_id].push_back(e);
+
+  // means over the classes with ground truth and the selected thresholds
+  auto mean = [&](size_t area, size_t max_dets, size_t first_threshold,
+                  size_t last_threshold, bool recall) {
+    float sum = 0;
+    size_t count = 0;
+    for (const auto& evals : class_evals) {
+      for (auto t = first_threshold; t <= last_threshold; ++t) {
+        auto result = Accumulate(evals.second, area, t, max_dets);
+        auto value = recall ? result.second : result.first;
+        if (value >= 0) {
+          sum += value;
+          ++count;
+        }
+      }
+    }
+    return count > 0 ? sum / count : -1.f;
+  };
+  const auto last = kThresholds - 1;
+  Summary summary;
+  summary.ap = mean(0, kMaxDets[2], 0, last, false);
+  summary.ap50 = mean(0, kMaxDets[2], 0, 0, false);
+  summary.ap75 = mean(0, kMaxDets[2], 5, 5, false);
+  summary.ap_small = mean(1, kMaxDets[2], 0, last, false);
+  summary.ap_medium = mean(2, kMaxDets[2], 0, last, false);
+  summary.ap_large = mean(3, kMaxDets[2], 0, last, false);
+  summary.ar1 = mean(0, kMaxDets[0], 0, last, true);
+  summary.ar10 = mean(0, kMaxDets[1], 0, last, true);
+  summary.ar100 = mean(0, kMaxDets[2], 0, last, true);
+  summary.ar_small = mean(1, kMaxDets[2], 0, last, true);
+  summary.ar_medium = mean(2, kMaxDets[2], 0, last, true);
+  summary.ar_large = mean(3, kMaxDets[2], 0, last, true);
+  return summary;
+}
@@ -0,0 +1,73 @@
+#ifndef COCOEVAL_H
+#define COCOEVAL_H
+
+#include "bbox.h"
+#include "coco.h"
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/* COCO box evaluation with the matching of the cocoapi COCOeval. Detections
+ * of every image and class are matched greedily in the score order to the
+ * ground truth at the IoU thresholds 0.5:0.05:0.95. Crowd boxes and boxes out
+ * of the area range are ignored, detections matched to them don't count.
+ * Precision is interpolated at 101 recall points. Images are added from any
+ * thread, only the matches are kept, so memory doesn't grow with the
+ * detections.
+ */
+class CocoEvaluator {
+ public:
+  struct Summary {
+    // AP averaged over the IoU thresholds, at IoU 0.5 and 0.75 and for the
+    // area ranges, with 100 detections per image
+    float ap{0};
+    float ap50{0};
+    float ap75{0};
+    float ap_small{0};
+    float ap_medium{0};
+    float ap_large{0};
+    // AR with 1, 10 and 100 detections per image and for the area ranges
+    float ar1{0};
+    float ar10{0};
+    float ar100{0};
+    float ar_small{0};
+    float ar_medium{0};
+    float ar_large{0};
+  };
+
+  void AddImage(const CocoGroundTruth& ground_truth,
+                const std::vector<Detection>& detections);
+  uint32_t GetImagesCount() const;
+  Summary Summarize() const;
+
+  static const size_t kThresholds = 10;
+  static const size_t kAreas = 4;  // all, small, medium, large
+
+ private:
+  // Matches of the detections of a class in an image, sorted by score
+  struct ImageClassEval {
+    uint32_t class_id{0};
+    std::vector<float> scores;
+    // ground truth boxes which aren't ignored, per area range
+    std::array<uint32_t, kAreas> gt_count{};
+    // [threshold * detections + detection] per area range
+    std::array<std::vector<uint8_t>, kAreas> matched;
+    std::array<std::vector<uint8_t>, kAreas> ignored;
+  };
+
+  // Precision averaged over the recall points and the final recall of a
+  // class, -1 if it has no ground truth in the area range
+  std::pair<float, float> Accumulate(const std::vector<size_t>& evals,
+                                     size_t area,
+                                     size_t threshold,
+                                     size_t max_dets) const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<ImageClassEval> evals_;
+  uint32_t images_count_{0};
+};
+
+#endif  // COCOEVAL_H
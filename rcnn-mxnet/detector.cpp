@@ -0,0 +1,255 @@
+#include "detector.h"
+#include "../trace.h"
+#include "imageutils.h"
+#include "mxutils.h"
+#include "rcnn.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <stdexcept>
+
+Detector::Detector(const std::string& params_path,
+                   const mxnet::cpp::Context& ctx,
+                   const Params& params,
+                   uint32_t workers_num,
+                   uint32_t queue_size)
+    : ctx_(ctx), params_(params), queue_size_(std::max(queue_size, 1u)) {
+  using mxnet::cpp::NDArray;
+  using mxnet::cpp::Shape;
+  auto net = GetRCNNSymbol(params_, false);
+
+  // parameters are saved by the net with the batch norms
+  Params saved_params = params_;
+  saved_params.rcnn_fold_batch_norm = false;
+  auto saved_net = GetRCNNSymbol(saved_params, false);
+  std::map<std::string, NDArray> aux_map;
+  std::tie(args_map_, aux_map) = LoadNetParams(ctx_, params_path, &saved_net);
+  if (params_.rcnn_fold_batch_norm)
+    FoldRCNNBatchNorms(args_map_, aux_map);
+  Shape data_shape(1, 3, params_.img_short_side, params_.img_long_side);
+  args_map_["data"] = NDArray(data_shape, ctx_, false);
+  args_map_["im_info"] = NDArray(Shape(1, 3), ctx_, false);
+  // parameters are saved in float32
+  if (params_.mixed_precision)
+    CastToArgTypes(InferArgTypes(net, {"data", "im_info"}), args_map_);
+  for (size_t i = 0; i < 2; ++i) {
+    InputSlot slot;
+    slot.data = NDArray(data_shape, ctx_, false);
+    slot.im_info = NDArray(Shape(1, 3), ctx_, false);
+    slots_.push_back(slot);
+  }
+
+  executor_.reset(net.SimpleBind(ctx_, args_map_,
+                                 std::map<std::string, NDArray>(),
+                                 std::map<std::string, mxnet::cpp::OpReqType>(),
+                                 aux_map));
+  NDArray::WaitAll();
+  CheckMXnetError("bind detector");
+
+  for (uint32_t i = 0; i < queue_size_ + std::max(workers_num, 1u); ++i)
+    buffers_.emplace_back(new PredictionBuffer());
+
+  pipeline_thread_ = std::thread([this]() { PipelineLoop(); });
+  for (uint32_t i = 0; i < std::max(workers_num, 1u); ++i)
+    decode_threads_.emplace_back([this]() { DecodeLoop(); });
+}
+
+Detector::~Detector() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (pipeline_thread_.joinable())
+    pipeline_thread_.join();
+  for (auto& thread : decode_threads_) {
+    if (thread.joinable())
+      thread.join();
+  }
+  mxnet::cpp::NDArray::WaitAll();
+}
+
+void Detector::Push(const std::string& file_name) {
+  Request request;
+  request.name = file_name;
+  PushRequest(std::move(request));
+}
+
+void Detector::PushEncoded(const std::string& name, std::vector<uint8_t> data) {
+  Request request;
+  request.name = name;
+  request.data = std::move(data);
+  PushRequest(std::move(request));
+}
+
+void Detector::PushRequest(Request request) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() {
+    return stop_ || closed_ || requests_.size() < queue_size_;
+  });
+  if (stop_ || closed_)
+    throw std::logic_error("Detector is closed");
+  request.index = pushed_num_++;
+  requests_.push_back(std::move(request));
+  cv_.notify_all();
+}
+
+void Detector::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  cv_.notify_all();
+}
+
+bool Detector::Next(Result& result) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() {
+    return error_ || results_.count(next_result_) > 0 ||
+           (closed_ && next_result_ == pushed_num_);
+  });
+  if (error_)
+    std::rethrow_exception(error_);
+  auto i = results_.find(next_result_);
+  if (i == results_.end())
+    return false;
+  result = std::move(i->second);
+  results_.erase(i);
+  ++next_result_;
+  return true;
+}
+
+void Detector::Fail(std::exception_ptr error) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!error_)
+    error_ = error;
+  stop_ = true;
+  cv_.notify_all();
+}
+
+void Detector::PipelineLoop() {
+  MLCPP_TRACE_THREAD("detector pipeline");
+  try {
+    std::vector<float> host_image;
+    while (true) {
+      Request request;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock,
+                 [this]() { return stop_ || closed_ || !requests_.empty(); });
+        if (stop_ || requests_.empty())
+          break;
+        request = std::move(requests_.front());
+        requests_.pop_front();
+        cv_.notify_all();
+      }
+
+      cv::Mat img;
+      float scale{1};
+      {
+        MLCPP_TRACE_ZONE("load");
+        if (request.data.empty()) {
+          std::tie(img, scale) = LoadImageFitSize(
+              request.name, params_.img_short_side, params_.img_long_side);
+        } else {
+          std::tie(img, scale) =
+              FitImageSize(cv::imdecode(request.data, cv::IMREAD_COLOR),
+                           params_.img_short_side, params_.img_long_side);
+        }
+      }
+      if (img.empty())
+        throw std::runtime_error("Failed to load image " + request.name);
+
+      Prediction prediction;
+      prediction.index = request.index;
+      prediction.name = std::move(request.name);
+      prediction.im_info = {static_cast<float>(img.rows),
+                            static_cast<float>(img.cols), scale};
+
+      // The synchronous upload waits only for the copy from the slot two
+      // images before, the forward pass of the previous image keeps running
+      // the forward pass is queued, the zone times the upload and the queuing
+      {
+        MLCPP_TRACE_ZONE("forward");
+        auto& slot = slots_[request.index % slots_.size()];
+        host_image.resize(img.total() * 3);
+        CVToMxnetFormat(img, host_image.data());
+        slot.data.SyncCopyFromCPU(host_image.data(), host_image.size());
+        slot.im_info.SyncCopyFromCPU(prediction.im_info.data(),
+                                     prediction.im_info.size());
+        slot.data.CopyTo(&args_map_["data"]);
+        slot.im_info.CopyTo(&args_map_["im_info"]);
+        executor_->Forward(false);
+      }
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stop_ || !buffers_.empty(); });
+        if (stop_)
+          break;
+        prediction.buffer = std::move(buffers_.back());
+        buffers_.pop_back();
+      }
+      if (params_.rcnn_gpu_decode)
+        prediction.buffer->CopyFrom(executor_->outputs[3]);
+      else
+        prediction.buffer->CopyFrom(executor_->outputs[0],
+                                    executor_->outputs[1],
+                                    executor_->outputs[2]);
+      CheckMXnetError("detector forward");
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      predictions_.push_back(std::move(prediction));
+      cv_.notify_all();
+    }
+  } catch (...) {
+    Fail(std::current_exception());
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  pipeline_done_ = true;
+  cv_.notify_all();
+}
+
+void Detector::DecodeLoop() {
+  MLCPP_TRACE_THREAD("detector decode");
+  try {
+    while (true) {
+      Prediction prediction;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() {
+          return stop_ || pipeline_done_ || !predictions_.empty();
+        });
+        if (stop_ || predictions_.empty())
+          break;
+        prediction = std::move(predictions_.front());
+        predictions_.pop_front();
+        cv_.notify_all();
+      }
+
+      // waits only for the forward pass of this image
+      Result result;
+      result.index = prediction.index;
+      result.name = std::move(prediction.name);
+      auto& buffer = *prediction.buffer;
+      {
+        MLCPP_TRACE_ZONE("wait_forward");
+        buffer.WaitToRead();
+      }
+      {
+        MLCPP_TRACE_ZONE("decode");
+        if (params_.rcnn_gpu_decode)
+          result.detections = DecodeDetections(buffer.Detections());
+        else
+          result.detections = DecodePredictions(
+              buffer.Rois(), buffer.Scores(), buffer.BboxDeltas(),
+              prediction.im_info.data(), params_);
+      }
+      CheckMXnetError("detector decode");
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.push_back(std::move(prediction.buffer));
+      results_.emplace(result.index, std::move(result));
+      cv_.notify_all();
+    }
+  } catch (...) {
+    Fail(std::current_exception());
+  }
+}
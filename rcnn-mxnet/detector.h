@@ -0,0 +1,104 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include "bbox.h"
+#include "params.h"
+
+#include <mxnet-cpp/MxNetCpp.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Detects a stream of images with the executor bound once and the
+ * parameters kept on the device. A pipeline thread decodes and uploads every
+ * image to one of two device input slots and queues the forward pass, so the
+ * upload of an image overlaps with the forward pass of the previous one.
+ * Predictions are copied to reused pinned host buffers and decoded by a pool
+ * of CPU workers while the next images run. Results come in the push order.
+ */
+class Detector {
+ public:
+  struct Result {
+    uint64_t index{0};
+    std::string name;
+    std::vector<Detection> detections;
+  };
+
+  Detector(const std::string& params_path,
+           const mxnet::cpp::Context& ctx,
+           const Params& params,
+           uint32_t workers_num = 2,
+           uint32_t queue_size = 4);
+  Detector(const Detector&) = delete;
+  Detector& operator=(const Detector&) = delete;
+  ~Detector();
+
+  // Block while queue_size images wait for the pipeline
+  void Push(const std::string& file_name);
+  void PushEncoded(const std::string& name, std::vector<uint8_t> data);
+
+  // No more images, Next returns the results of the images pushed before
+  void Close();
+
+  // Blocks until the next result is decoded, returns false after the last
+  // one. Rethrows the errors of the pipeline.
+  bool Next(Result& result);
+
+ private:
+  struct Request {
+    uint64_t index{0};
+    std::string name;
+    std::vector<uint8_t> data;  // empty for files
+  };
+  struct InputSlot {
+    mxnet::cpp::NDArray data;
+    mxnet::cpp::NDArray im_info;
+  };
+  struct Prediction {
+    uint64_t index{0};
+    std::string name;
+    std::vector<float> im_info;
+    // host copies of the executor outputs, from buffers_
+    std::unique_ptr<PredictionBuffer> buffer;
+  };
+
+  void PushRequest(Request request);
+  void PipelineLoop();
+  void DecodeLoop();
+  void Fail(std::exception_ptr error);
+
+ private:
+  mxnet::cpp::Context ctx_;
+  Params params_;
+  size_t queue_size_{4};
+  std::unique_ptr<mxnet::cpp::Executor> executor_;
+  std::map<std::string, mxnet::cpp::NDArray> args_map_;
+  std::vector<InputSlot> slots_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Request> requests_;
+  std::deque<Prediction> predictions_;
+  // free host buffers, one per prediction in flight
+  std::vector<std::unique_ptr<PredictionBuffer>> buffers_;
+  std::map<uint64_t, Result> results_;
+  uint64_t pushed_num_{0};
+  uint64_t next_result_{0};
+  bool closed_{false};
+  bool pipeline_done_{false};
+  bool stop_{false};
+  std::exception_ptr error_;
+
+  std::thread pipeline_thread_;
+  std::vector<std::thread> decode_threads_;
+};
+
+#endif  // DETECTOR_H
@@ -0,0 +1,165 @@
+#include "flatoptimizer.h"
+#include "mxutils.h"
+
+#include <cmath>
+
+namespace {
+void CastTo(const mxnet::cpp::NDArray& src, mxnet::cpp::NDArray& dst) {
+  mxnet::cpp::Operator("Cast")(src)
+      .SetParam("dtype", dst.GetDType() == kFloat16Type ? "float16" : "float32")
+      .Invoke(dst);
+}
+}  // namespace
+
+FlatOptimizer::FlatOptimizer(
+    const mxnet::cpp::Context& ctx,
+    const Settings& settings,
+    std::unique_ptr<mxnet::cpp::LRScheduler> lr_scheduler)
+    : ctx_(ctx), settings_(settings), lr_scheduler_(std::move(lr_scheduler)) {
+  if (lr_scheduler_)
+    lr_scheduler_->SetLR(settings_.lr);
+}
+
+void FlatOptimizer::Pack(const std::vector<std::string>& trainable_args,
+                         std::map<std::string, mxnet::cpp::NDArray>& args_map,
+                         std::map<std::string, mxnet::cpp::NDArray>& grad_map,
+                         const std::map<std::string, int>& arg_types) {
+  using mxnet::cpp::NDArray;
+  using mxnet::cpp::Shape;
+  auto arg_type = [&arg_types](const std::string& name) {
+    auto type = arg_types.find(name);
+    return type != arg_types.end() ? type->second : kFloat32Type;
+  };
+  // Parameters of every bucket, a parameter larger than bucket_size is alone,
+  // a bucket has parameters of one type
+  std::vector<std::vector<std::string>> bucket_args;
+  std::vector<mx_uint> bucket_sizes;
+  std::vector<int> bucket_types;
+  for (const auto& name : trainable_args) {
+    auto size = static_cast<mx_uint>(args_map.at(name).Size());
+    auto dtype = arg_type(name);
+    if (bucket_args.empty() || bucket_types.back() != dtype ||
+        (settings_.bucket_size > 0 &&
+         bucket_sizes.back() + size > settings_.bucket_size)) {
+      bucket_args.emplace_back();
+      bucket_sizes.push_back(0);
+      bucket_types.push_back(dtype);
+    }
+    bucket_args.back().push_back(name);
+    bucket_sizes.back() += size;
+  }
+
+  buckets_.clear();
+  for (size_t b = 0; b < bucket_args.size(); ++b) {
+    Bucket bucket;
+    bucket.dtype = bucket_types[b];
+    auto total_size = bucket_sizes[b];
+    bucket.weights = NDArray(Shape(total_size), ctx_, false);
+    bucket.grads = NDArray(Shape(total_size), ctx_, false);
+    mx_uint offset = 0;
+    for (const auto& name : bucket_args[b]) {
+      auto& arg = args_map.at(name);
+      auto size = static_cast<mx_uint>(arg.Size());
+      auto weight = bucket.weights.Slice(offset, offset + size)
+                        .Reshape(Shape(arg.GetShape()));
+      arg.CopyTo(&weight);
+      offset += size;
+    }
+    bucket.grads = 0;
+    auto* bound_weights = &bucket.weights;
+    if (bucket.dtype != kFloat32Type) {
+      bucket.low_weights = CastArray(bucket.weights, bucket.dtype);
+      bound_weights = &bucket.low_weights;
+      if (settings_.method == Method::Adam)
+        bucket.grads32 = bucket.grads.Copy(ctx_);
+      bucket.grads = CastArray(bucket.grads, bucket.dtype);
+    }
+    offset = 0;
+    for (const auto& name : bucket_args[b]) {
+      auto& arg = args_map.at(name);
+      auto size = static_cast<mx_uint>(arg.Size());
+      Shape shape(arg.GetShape());
+      arg = bound_weights->Slice(offset, offset + size).Reshape(shape);
+      grad_map[name] = bucket.grads.Slice(offset, offset + size).Reshape(shape);
+      offset += size;
+    }
+
+    bucket.state0 = NDArray(Shape(total_size), ctx_, false);
+    bucket.state0 = 0;
+    if (settings_.method == Method::Adam) {
+      bucket.state1 = NDArray(Shape(total_size), ctx_, false);
+      bucket.state1 = 0;
+    }
+    buckets_.push_back(std::move(bucket));
+  }
+  NDArray::WaitAll();
+}
+
+mxnet::cpp::NDArray& FlatOptimizer::GetWeights(size_t bucket) {
+  auto& b = buckets_.at(bucket);
+  return b.dtype != kFloat32Type ? b.low_weights : b.weights;
+}
+
+mxnet::cpp::NDArray& FlatOptimizer::GetGradients(size_t bucket) {
+  return buckets_.at(bucket).grads;
+}
+
+void FlatOptimizer::LoadMasterWeights() {
+  for (auto& bucket : buckets_) {
+    if (bucket.dtype != kFloat32Type)
+      CastTo(bucket.low_weights, bucket.weights);
+  }
+}
+
+void FlatOptimizer::Update() {
+  ++num_update_;
+  auto lr = lr_scheduler_ ? lr_scheduler_->GetLR(num_update_) : settings_.lr;
+  if (settings_.method == Method::Adam) {
+    // bias correction as in mxnet::cpp::AdamOptimizer
+    auto t = static_cast<float>(num_update_);
+    lr *= std::sqrt(1 - std::pow(settings_.beta2, t)) /
+          (1 - std::pow(settings_.beta1, t));
+  }
+  for (auto& bucket : buckets_) {
+    const bool low_precision = bucket.dtype != kFloat32Type;
+    if (settings_.method == Method::SgdMomentum && low_precision) {
+      // updates the master weights and the momentum in place
+      mxnet::cpp::Operator("mp_sgd_mom_update")(bucket.low_weights,
+                                                bucket.grads, bucket.state0,
+                                                bucket.weights)
+          .SetParam("lr", lr)
+          .SetParam("wd", settings_.wd)
+          .SetParam("momentum", settings_.momentum)
+          .SetParam("rescale_grad", settings_.rescale_grad)
+          .SetParam("clip_gradient", settings_.clip_gradient)
+          .Invoke(bucket.low_weights);
+    } else if (settings_.method == Method::SgdMomentum) {
+      mxnet::cpp::Operator("sgd_mom_update")(bucket.weights, bucket.grads,
+                                             bucket.state0)
+          .SetParam("lr", lr)
+          .SetParam("wd", settings_.wd)
+          .SetParam("momentum", settings_.momentum)
+          .SetParam("rescale_grad", settings_.rescale_grad)
+          .SetParam("clip_gradient", settings_.clip_gradient)
+          .Invoke(bucket.weights);
+    } else {
+      auto* grads = &bucket.grads;
+      if (low_precision) {
+        CastTo(bucket.grads, bucket.grads32);
+        grads = &bucket.grads32;
+      }
+      mxnet::cpp::Operator("adam_update")(bucket.weights, *grads,
+                                          bucket.state0, bucket.state1)
+          .SetParam("lr", lr)
+          .SetParam("beta1", settings_.beta1)
+          .SetParam("beta2", settings_.beta2)
+          .SetParam("epsilon", settings_.epsilon)
+          .SetParam("wd", settings_.wd)
+          .SetParam("rescale_grad", settings_.rescale_grad)
+          .SetParam("clip_gradient", settings_.clip_gradient)
+          .Invoke(bucket.weights);
+      if (low_precision)
+        CastTo(bucket.weights, bucket.low_weights);
+    }
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef FLATOPTIMIZER_H
+#define FLATOPTIMIZER_H
+
+#include <mxnet-cpp/MxNetCpp.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Optimizer of the trainable parameters packed into flat arrays. The
+ * executor is bound to views of the flat parameters and gradients, so every
+ * step is a single sgd_mom_update or adam_update launch per bucket instead
+ * of a launch per parameter. Views share the engine variable of their array,
+ * so gradients of a bucket are ready only after the backward pass wrote all
+ * of them. Parameters are split to buckets of bucket_size elements to sync
+ * gradients of the last layers while the backward pass still runs, 0 packs
+ * all parameters into one bucket. Parameters of float16 types get float16
+ * buckets which the executor is bound to, the optimizer updates their
+ * float32 master weights and casts them back, mp_sgd_mom_update does it in
+ * one launch.
+ */
+class FlatOptimizer {
+ public:
+  enum class Method { SgdMomentum, Adam };
+
+  struct Settings {
+    Method method = Method::SgdMomentum;
+    float lr = 0.01f;
+    float wd = 0;
+    float momentum = 0.9f;  // sgd
+    float beta1 = 0.9f;     // adam
+    float beta2 = 0.999f;   // adam
+    float epsilon = 1e-8f;  // adam
+    float rescale_grad = 1;
+    float clip_gradient = -1;
+    size_t bucket_size = 0;
+  };
+
+  FlatOptimizer(const mxnet::cpp::Context& ctx,
+                const Settings& settings,
+                std::unique_ptr<mxnet::cpp::LRScheduler> lr_scheduler);
+  FlatOptimizer(const FlatOptimizer&) = delete;
+  FlatOptimizer& operator=(const FlatOptimizer&) = delete;
+
+  // Copies the trainable arguments to the flat arrays and replaces them in
+  // args_map with their views, grad_map gets the views of their gradients.
+  // Arguments are float32 unless arg_types has other types for them. Has to
+  // be called before the executor is bound with the maps.
+  void Pack(const std::vector<std::string>& trainable_args,
+            std::map<std::string, mxnet::cpp::NDArray>& args_map,
+            std::map<std::string, mxnet::cpp::NDArray>& grad_map,
+            const std::map<std::string, int>& arg_types = {});
+
+  // Buckets are in the order of the trainable arguments, the weights are
+  // the ones the executor is bound to, of the type of the gradients
+  size_t GetBucketsCount() const { return buckets_.size(); }
+  mxnet::cpp::NDArray& GetWeights(size_t bucket);
+  mxnet::cpp::NDArray& GetGradients(size_t bucket);
+  // Copies the bound float16 weights to the master weights after they are
+  // changed outside of Update, e.g. pulled from the kvstore
+  void LoadMasterWeights();
+
+  // Updates all trainable parameters with their gradients
+  void Update();
+
+ private:
+  struct Bucket {
+    int dtype{0};
+    mxnet::cpp::NDArray weights;
+    mxnet::cpp::NDArray grads;
+    // momentum for sgd, mean and variance for adam
+    mxnet::cpp::NDArray state0;
+    mxnet::cpp::NDArray state1;
+    // float16 weights bound to the executor and float32 gradients for adam
+    mxnet::cpp::NDArray low_weights;
+    mxnet::cpp::NDArray grads32;
+  };
+
+ private:
+  mxnet::cpp::Context ctx_;
+  Settings settings_;
+  std::unique_ptr<mxnet::cpp::LRScheduler> lr_scheduler_;
+  unsigned num_update_{0};
+  std::vector<Bucket> buckets_;
+};
+
+#endif  // FLATOPTIMIZER_H
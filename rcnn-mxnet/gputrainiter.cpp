@@ -1,10 +1,34 @@
 #include "gputrainiter.h"
 
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+namespace {
+mx_uint ShapeSize(const std::vector<mx_uint>& shape) {
+  mx_uint size = 1;
+  for (auto dim : shape)
+    size *= dim;
+  return size;
+}
+
+mxnet::cpp::NDArray View(const mxnet::cpp::NDArray& storage,
+                         const std::vector<mx_uint>& shape) {
+  return storage.Slice(0, ShapeSize(shape)).Reshape(mxnet::cpp::Shape(shape));
+}
+}  // namespace
+
 GpuTrainIter::GpuTrainIter(ImageDb* image_db,
                            const Params& params,
-                           uint32_t feat_height,
-                           uint32_t feat_width)
-    : train_iter_(image_db, params, feat_height, feat_width) {}
+                           const std::vector<TrainBucket>& buckets,
+                           uint32_t shard,
+                           uint32_t shards_num)
+    : train_iter_(image_db, params, buckets, shard, shards_num),
+      slots_num_(std::max(params.rcnn_prefetch_batches, 1u)) {}
+
+GpuTrainIter::~GpuTrainIter() {
+  StopLoader();
+}
 
 uint32_t GpuTrainIter::GetSize() const {
   return train_iter_.GetSize();
@@ -14,29 +38,109 @@ uint32_t GpuTrainIter::GetBatchCount() const {
   return train_iter_.GetBatchCount();
 }
 
+size_t GpuTrainIter::GetBucketsCount() const {
+  return train_iter_.GetBucketsCount();
+}
+
+const BatchShapes& GpuTrainIter::GetShapes(size_t bucket) const {
+  return train_iter_.GetShapes(bucket);
+}
+
+size_t GpuTrainIter::GetBucket() const {
+  assert(current_slot_ >= 0);
+  return slots_[static_cast<size_t>(current_slot_)].bucket;
+}
+
 void GpuTrainIter::Reset() {
+  if (slots_.empty())
+    throw std::runtime_error("GpuTrainIter GPU cache is not allocated");
+  StopLoader();
   train_iter_.Reset();
-  ScheduleLoadDataToGpu();
+  free_slots_.clear();
+  for (size_t i = 0; i < slots_.size(); ++i)
+    free_slots_.push_back(i);
+  ready_slots_.clear();
+  current_slot_ = -1;
+  loader_done_ = false;
+  stop_ = false;
+  error_ = nullptr;
+  loader_thread_ = std::thread([this]() { LoaderLoop(); });
 }
 
 bool GpuTrainIter::Next() {
-  auto data_available = load_result_.get();
-  return data_available;
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Copies from the previous slot are ordered by the engine before the
+  // loader writes to it again
+  if (current_slot_ >= 0) {
+    free_slots_.push_back(static_cast<size_t>(current_slot_));
+    current_slot_ = -1;
+    cv_.notify_all();
+  }
+  cv_.wait(lock, [this]() { return !ready_slots_.empty() || loader_done_; });
+  if (ready_slots_.empty()) {
+    if (error_)
+      std::rethrow_exception(error_);
+    return false;
+  }
+  current_slot_ = static_cast<int64_t>(ready_slots_.front());
+  ready_slots_.pop_front();
+  return true;
 }
 
-void GpuTrainIter::ScheduleLoadDataToGpu() {
-  auto load_result = std::async(std::launch::async, [&]() {
-    if (train_iter_.Next()) {
+void GpuTrainIter::LoaderLoop() {
+  try {
+    while (true) {
+      size_t slot_index = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stop_ || !free_slots_.empty(); });
+        if (stop_)
+          break;
+        slot_index = free_slots_.front();
+        free_slots_.pop_front();
+      }
+      if (!train_iter_.Next())
+        break;
       // load data to GPU cache
-      train_iter_.GetData(gpu_im_arr, gpu_im_info_arr, gpu_gt_boxes_arr,
-                          gpu_label_arr, gpu_bbox_target_arr,
-                          gpu_bbox_weight_arr);
-      return true;
-    } else {
-      return false;
+      auto& slot = slots_[slot_index];
+      slot.bucket = train_iter_.GetBucket();
+      const auto& shapes = train_iter_.GetShapes(slot.bucket);
+      auto& storage = slot.storage;
+      auto& batch = slot.batch;
+      batch.im_arr = View(storage.im_arr, shapes.im);
+      batch.im_info_arr = View(storage.im_info_arr, shapes.im_info);
+      batch.gt_boxes_arr = View(storage.gt_boxes_arr, shapes.gt_boxes);
+      batch.label_arr = View(storage.label_arr, shapes.label);
+      batch.bbox_target_arr = View(storage.bbox_target_arr, shapes.bbox_target);
+      batch.bbox_weight_arr = View(storage.bbox_weight_arr, shapes.bbox_weight);
+      train_iter_.GetData(batch.im_arr, batch.im_info_arr, batch.gt_boxes_arr,
+                          batch.label_arr, batch.bbox_target_arr,
+                          batch.bbox_weight_arr);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_slots_.push_back(slot_index);
+      }
+      cv_.notify_all();
     }
-  });
-  load_result_ = std::move(load_result);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = std::current_exception();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loader_done_ = true;
+  }
+  cv_.notify_all();
+}
+
+void GpuTrainIter::StopLoader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (loader_thread_.joinable())
+    loader_thread_.join();
 }
 
 void GpuTrainIter::GetData(mxnet::cpp::NDArray& im_arr,
@@ -45,14 +149,16 @@ void GpuTrainIter::GetData(mxnet::cpp::NDArray& im_arr,
                            mxnet::cpp::NDArray& label_arr,
                            mxnet::cpp::NDArray& bbox_target_arr,
                            mxnet::cpp::NDArray& bbox_weight_arr) {
-  // Copy data from GPU to GPU
-  gpu_im_arr.CopyTo(&im_arr);
-  gpu_im_info_arr.CopyTo(&im_info_arr);
-  gpu_gt_boxes_arr.CopyTo(&gt_boxes_arr);
-  gpu_label_arr.CopyTo(&label_arr);
-  gpu_bbox_target_arr.CopyTo(&bbox_target_arr);
-  gpu_bbox_weight_arr.CopyTo(&bbox_weight_arr);
-  mxnet::cpp::NDArray::WaitAll();
+  assert(current_slot_ >= 0);
+  // Copy data from GPU to GPU, the copies are queued to the engine and the
+  // executor reading the arrays waits for them, so there is no global wait
+  auto& batch = slots_[static_cast<size_t>(current_slot_)].batch;
+  batch.im_arr.CopyTo(&im_arr);
+  batch.im_info_arr.CopyTo(&im_info_arr);
+  batch.gt_boxes_arr.CopyTo(&gt_boxes_arr);
+  batch.label_arr.CopyTo(&label_arr);
+  batch.bbox_target_arr.CopyTo(&bbox_target_arr);
+  batch.bbox_weight_arr.CopyTo(&bbox_weight_arr);
 
   auto* err = MXGetLastError();
   if (err && err[0] != 0) {
@@ -60,22 +166,32 @@ void GpuTrainIter::GetData(mxnet::cpp::NDArray& im_arr,
               << std::endl;
     exit(-1);
   }
-
-  ScheduleLoadDataToGpu();
 }
 
-void GpuTrainIter::AllocateGpuCache(
-    const mxnet::cpp::Context& ctx,
-    const std::vector<mx_uint>& im_shape,
-    const std::vector<mx_uint>& im_info_shape,
-    const std::vector<mx_uint>& gt_boxes_shape,
-    const std::vector<mx_uint>& label_shape,
-    const std::vector<mx_uint>& bbox_target_shape,
-    const std::vector<mx_uint>& bbox_weight_shape) {
-  gpu_im_arr = mxnet::cpp::NDArray(im_shape, ctx, false);
-  gpu_im_info_arr = mxnet::cpp::NDArray(im_info_shape, ctx, false);
-  gpu_gt_boxes_arr = mxnet::cpp::NDArray(gt_boxes_shape, ctx, false);
-  gpu_label_arr = mxnet::cpp::NDArray(label_shape, ctx, false);
-  gpu_bbox_target_arr = mxnet::cpp::NDArray(bbox_target_shape, ctx, false);
-  gpu_bbox_weight_arr = mxnet::cpp::NDArray(bbox_weight_shape, ctx, false);
+void GpuTrainIter::AllocateGpuCache(const mxnet::cpp::Context& ctx) {
+  StopLoader();
+  // sizes of the largest arrays of all buckets
+  std::array<mx_uint, 6> capacity{};
+  for (size_t b = 0; b < train_iter_.GetBucketsCount(); ++b) {
+    const auto& shapes = train_iter_.GetShapes(b);
+    std::array<const std::vector<mx_uint>*, 6> bucket_shapes{
+        &shapes.im,    &shapes.im_info,     &shapes.gt_boxes,
+        &shapes.label, &shapes.bbox_target, &shapes.bbox_weight};
+    for (size_t i = 0; i < capacity.size(); ++i)
+      capacity[i] = std::max(capacity[i], ShapeSize(*bucket_shapes[i]));
+  }
+  auto storage = [&](size_t i) {
+    return mxnet::cpp::NDArray(mxnet::cpp::Shape(capacity[i]), ctx, false);
+  };
+  slots_.clear();
+  for (uint32_t i = 0; i < slots_num_; ++i) {
+    BatchSlot slot;
+    slot.storage.im_arr = storage(0);
+    slot.storage.im_info_arr = storage(1);
+    slot.storage.gt_boxes_arr = storage(2);
+    slot.storage.label_arr = storage(3);
+    slot.storage.bbox_target_arr = storage(4);
+    slot.storage.bbox_weight_arr = storage(5);
+    slots_.push_back(slot);
+  }
 }
@@ -3,25 +3,39 @@
 
 #include <mxnet-cpp/MxNetCpp.h>
 
-#include <atomic>
 #include <condition_variable>
-#include <future>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <thread>
 
 #include "trainiter.h"
 
+/* Loads training batches to a ring of GPU slots on a loader thread, up to
+ * rcnn_prefetch_batches batches are ready ahead of the training loop. A slot
+ * taken by Next is reused after the following Next call. Slots have arrays of
+ * the largest batch of all buckets, a batch is loaded to their views of the
+ * shapes of its bucket.
+ */
 class GpuTrainIter {
  public:
   GpuTrainIter(ImageDb* image_db,
                const Params& params,
-               uint32_t feat_height,
-               uint32_t feat_width);
+               const std::vector<TrainBucket>& buckets,
+               uint32_t shard = 0,
+               uint32_t shards_num = 1);
   GpuTrainIter(const GpuTrainIter&) = delete;
   GpuTrainIter& operator=(const GpuTrainIter&) = delete;
+  ~GpuTrainIter();
 
   uint32_t GetSize() const;
   uint32_t GetBatchCount() const;
 
+  size_t GetBucketsCount() const;
+  const BatchShapes& GetShapes(size_t bucket) const;
+  // Bucket of the batch taken by Next
+  size_t GetBucket() const;
+
   void Reset();
   bool Next();
 
@@ -32,26 +46,40 @@ class GpuTrainIter {
                mxnet::cpp::NDArray& bbox_target_arr,
                mxnet::cpp::NDArray& bbox_weight_arr);
 
-  void AllocateGpuCache(const mxnet::cpp::Context& ctx,
-                        const std::vector<mx_uint>& im_shape,
-                        const std::vector<mx_uint>& im_info_shape,
-                        const std::vector<mx_uint>& gt_boxes_shape,
-                        const std::vector<mx_uint>& label_shape,
-                        const std::vector<mx_uint>& bbox_target_shape,
-                        const std::vector<mx_uint>& bbox_weight_shape);
+  void AllocateGpuCache(const mxnet::cpp::Context& ctx);
+
+ private:
+  struct BatchArrays {
+    mxnet::cpp::NDArray im_arr;
+    mxnet::cpp::NDArray im_info_arr;
+    mxnet::cpp::NDArray gt_boxes_arr;
+    mxnet::cpp::NDArray label_arr;
+    mxnet::cpp::NDArray bbox_target_arr;
+    mxnet::cpp::NDArray bbox_weight_arr;
+  };
+  struct BatchSlot {
+    BatchArrays storage;
+    BatchArrays batch;  // views of the storage
+    size_t bucket{0};
+  };
 
-  void ScheduleLoadDataToGpu();
+  void LoaderLoop();
+  void StopLoader();
 
  private:
   TrainIter train_iter_;
-  std::future<bool> load_result_;
-
-  mxnet::cpp::NDArray gpu_im_arr;
-  mxnet::cpp::NDArray gpu_im_info_arr;
-  mxnet::cpp::NDArray gpu_gt_boxes_arr;
-  mxnet::cpp::NDArray gpu_label_arr;
-  mxnet::cpp::NDArray gpu_bbox_target_arr;
-  mxnet::cpp::NDArray gpu_bbox_weight_arr;
+  uint32_t slots_num_{1};
+  std::vector<BatchSlot> slots_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<size_t> free_slots_;
+  std::deque<size_t> ready_slots_;
+  int64_t current_slot_{-1};
+  bool loader_done_{false};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::thread loader_thread_;
 };
 
 #endif  // GPUTRAINITER_H
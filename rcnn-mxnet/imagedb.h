@@ -23,6 +23,8 @@ class ImageDb {
  public:
   virtual ~ImageDb();
   virtual uint32_t GetImagesCount() const = 0;
+  // Original size of the image, without loading it
+  virtual cv::Size GetImageSize(uint32_t index) const = 0;
   virtual ImageDesc GetImage(uint32_t index,
                              uint32_t height,
                              uint32_t width) const = 0;
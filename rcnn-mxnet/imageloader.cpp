@@ -0,0 +1,112 @@
+#include "imageloader.h"
+#include "../threadpool.h"
+#include "../trace.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <memory>
+
+ImageLoader::ImageLoader(const ImageDb* image_db, uint32_t decoders_num)
+    : image_db_(image_db), decoders_num_(std::max(decoders_num, 1u)) {
+  assert(image_db_ != nullptr);
+}
+
+ImageLoader::~ImageLoader() {
+  std::vector<std::future<void>> decoders;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    decoders.swap(decoder_results_);
+  }
+  // the started tasks use the loader, the waiting thread runs the ones which
+  // didn't start yet
+  for (auto& decoder : decoders)
+    utils::DefaultPool().Wait(decoder);
+}
+
+std::vector<ImageDesc> ImageLoader::Load(const std::vector<uint32_t>& indices,
+                                         uint32_t height,
+                                         uint32_t width) {
+  std::vector<std::future<ImageDesc>> images;
+  images.reserve(indices.size());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto index : indices) {
+      auto i = readahead_.find(Key(index, height, width));
+      if (i != readahead_.end()) {
+        images.push_back(std::move(i->second));
+        readahead_.erase(i);
+      } else {
+        images.push_back(Queue(index, height, width));
+      }
+    }
+    StartDecoders();
+  }
+
+  std::vector<ImageDesc> result;
+  result.reserve(images.size());
+  for (auto& image : images)
+    result.push_back(utils::DefaultPool().Wait(image));
+  return result;
+}
+
+void ImageLoader::Prefetch(const std::vector<uint32_t>& indices,
+                           uint32_t height,
+                           uint32_t width) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto index : indices) {
+    Key key(index, height, width);
+    if (readahead_.find(key) == readahead_.end())
+      readahead_.emplace(key, Queue(index, height, width));
+  }
+  StartDecoders();
+}
+
+void ImageLoader::ClearPrefetch() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  readahead_.clear();
+}
+
+std::future<ImageDesc> ImageLoader::Queue(uint32_t index,
+                                          uint32_t height,
+                                          uint32_t width) {
+  auto task = std::make_shared<std::packaged_task<ImageDesc()>>(
+      [this, index, height, width]() {
+        MLCPP_TRACE_ZONE("load");
+        return image_db_->GetImage(index, height, width);
+      });
+  tasks_.push_back([task]() { (*task)(); });
+  return task->get_future();
+}
+
+void ImageLoader::StartDecoders() {
+  decoder_results_.erase(
+      std::remove_if(decoder_results_.begin(), decoder_results_.end(),
+                     [](const std::future<void>& decoder) {
+                       return decoder.wait_for(std::chrono::seconds(0)) ==
+                              std::future_status::ready;
+                     }),
+      decoder_results_.end());
+  while (decoders_ < decoders_num_ && decoders_ < tasks_.size()) {
+    ++decoders_;
+    decoder_results_.push_back(
+        utils::DefaultPool().Submit([this]() { Decode(); }));
+  }
+}
+
+void ImageLoader::Decode() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_ || tasks_.empty()) {
+        --decoders_;
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
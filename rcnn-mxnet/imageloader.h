@@ -0,0 +1,59 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include "imagedb.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+/* Loads images of an ImageDb on the tasks of the shared pool, so loading a
+ * batch keeps the disk and the cores busy. Up to decoders_num tasks take the
+ * queued images at once. Images of the next batches can be requested ahead
+ * with Prefetch, Load takes them from the readahead or queues the missing
+ * ones.
+ */
+class ImageLoader {
+ public:
+  ImageLoader(const ImageDb* image_db, uint32_t decoders_num);
+  ImageLoader(const ImageLoader&) = delete;
+  ImageLoader& operator=(const ImageLoader&) = delete;
+  ~ImageLoader();
+
+  // Blocks until all images are loaded, rethrows the errors of GetImage
+  std::vector<ImageDesc> Load(const std::vector<uint32_t>& indices,
+                              uint32_t height,
+                              uint32_t width);
+  // Queues the images, doesn't wait
+  void Prefetch(const std::vector<uint32_t>& indices,
+                uint32_t height,
+                uint32_t width);
+  // Drops the readahead, e.g. when the order of images changes
+  void ClearPrefetch();
+
+ private:
+  using Key = std::tuple<uint32_t, uint32_t, uint32_t>;
+
+  // Both are called with the mutex locked
+  std::future<ImageDesc> Queue(uint32_t index, uint32_t height, uint32_t width);
+  void StartDecoders();
+  // Body of the pool tasks, takes the queued images until none is left
+  void Decode();
+
+ private:
+  const ImageDb* image_db_{nullptr};
+  uint32_t decoders_num_{1};
+  std::mutex mutex_;
+  std::deque<std::function<void()>> tasks_;
+  std::map<Key, std::future<ImageDesc>> readahead_;
+  uint32_t decoders_{0};  // running decode tasks
+  std::vector<std::future<void>> decoder_results_;
+  bool stop_{false};
+};
+
+#endif  // IMAGELOADER_H
@@ -1,4 +1,5 @@
 #include "imageutils.h"
+#include "../tensorview.h"
 
 std::pair<cv::Mat, float> LoadImage(const std::string& file_name,
                                     uint32_t short_side,
@@ -28,9 +29,13 @@ std::pair<cv::Mat, float> LoadImage(const std::string& file_name,
 std::tuple<cv::Mat, float> LoadImageFitSize(const std::string& file_name,
                                             uint32_t height,
                                             uint32_t width) {
-  auto img = cv::imread(file_name);
+  return FitImageSize(cv::imread(file_name), height, width);
+}
+
+std::tuple<cv::Mat, float> FitImageSize(cv::Mat img,
+                                        uint32_t height,
+                                        uint32_t width) {
   if (!img.empty()) {
-    img.convertTo(img, CV_32FC3);
     float scale = 1.f;
     // assume that an image width in most cases is bigger than height
     float ratio = static_cast<float>(img.cols) / static_cast<float>(img.rows);
@@ -61,21 +66,30 @@ std::tuple<cv::Mat, float> LoadImageFitSize(const std::string& file_name,
   return {cv::Mat(), 0};
 }
 
+namespace {
+// The planes are written by rows, so the pixels of a row stay in the cache
+// while the channels are taken from them
+template <typename T>
+void CopyToPlanes(const cv::Mat& img, float* dst) {
+  auto pixels = utils::CvMatView<const T>(img).Reverse(2).Permute({2, 0, 1});
+  auto planes = utils::MakeView(dst, {3, img.rows, img.cols});
+  for (int y = 0; y < img.rows; ++y)
+    utils::CopyView(pixels.Slice(1, y, y + 1), planes.Slice(1, y, y + 1));
+}
+}  // namespace
+
+void CVToMxnetFormat(const cv::Mat& img, float* dst) {
+  assert(img.type() == CV_32FC3 || img.type() == CV_8UC3);
+  // BGR to the RGB planes
+  if (img.depth() == CV_32F)
+    CopyToPlanes<float>(img, dst);
+  else
+    CopyToPlanes<uint8_t>(img, dst);
+}
+
 std::vector<float> CVToMxnetFormat(const cv::Mat& img) {
-  assert(img.type() == CV_32FC3);
-  auto size = img.channels() * img.rows * img.cols;
-  std::vector<float> array(static_cast<size_t>(size));
-  size_t k = 0;
-  // Convert to from BGR
-  for (int c = 2; c >= 0; --c) {
-    for (int y = 0; y < img.rows; ++y) {
-      for (int x = 0; x < img.cols; ++x) {
-        auto t = (y * img.cols + x) * 3 + c;
-        array[k] = img.ptr<float>()[t];
-        ++k;
-      }
-    }
-  }
+  std::vector<float> array(static_cast<size_t>(3 * img.rows * img.cols));
+  CVToMxnetFormat(img, array.data());
   return array;
 }
 
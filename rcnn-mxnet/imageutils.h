@@ -13,11 +13,20 @@ std::pair<cv::Mat, float> LoadImage(const std::string& file_name,
                                     uint32_t short_side,
                                     uint32_t long_side);
 
-// resize image with constraint proportions and pad with zero
+// resize image with constraint proportions and pad with zero, the image
+// stays 8 bit, CVToMxnetFormat converts it to float
 std::tuple<cv::Mat, float> LoadImageFitSize(const std::string& file_name,
                                             uint32_t height,
                                             uint32_t width);
 
+// the same for a decoded 8 bit BGR image
+std::tuple<cv::Mat, float> FitImageSize(cv::Mat img,
+                                        uint32_t height,
+                                        uint32_t width);
+
+// Writes 3 * rows * cols floats of the RGB planes of a CV_8UC3 or CV_32FC3
+// BGR image to dst, 8 bit values are converted on the way
+void CVToMxnetFormat(const cv::Mat& img, float* dst);
 std::vector<float> CVToMxnetFormat(const cv::Mat& img);
 
 void ShowResult(const std::vector<Detection>& detection,
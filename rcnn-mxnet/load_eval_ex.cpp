@@ -3,19 +3,303 @@
 
 #include "imageutils.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <vector>
 
 /*The global context, change them if necessary*/
 static mxnet::cpp::Context global_ctx(mxnet::cpp::kGPU, 0);
 // static Context global_ctx(mxnet::cpp::kCPU,0);
 
+static const mxnet::cpp::index_t image_size = 224;
+
+const cv::String keys =
+    "{help h usage ? |      | print this message   }"
+    "{@image         |      | path to image }"
+    "{l list         |      | file with image paths to score in batches }"
+    "{b batch        |32    | images in a batch }"
+    "{w workers      |4     | threads decoding the images }"
+    "{k top          |5     | labels printed for every image }";
+
+static std::vector<std::string> LoadLabels() {
+  std::vector<std::string> labels;
+  std::ifstream labels_file("../model/synset.txt");
+  if (labels_file) {
+    std::string label;
+    while (std::getline(labels_file, label)) {
+      labels.push_back(label);
+    }
+  }
+  return labels;
+}
+
+/* Scores the images of the list in batches with the executor bound once.
+ * Decode workers fill the host batches ahead of the net, every batch is
+ * uploaded to one of two device slots, so the upload of a batch overlaps with
+ * the forward pass of the previous one. Probabilities are copied to reused
+ * pinned buffers and a readout thread prints the top labels while the next
+ * batches run.
+ */
+class BatchScorer {
+ public:
+  BatchScorer(mxnet::cpp::Symbol net,
+              std::map<std::string, mxnet::cpp::NDArray> args_map,
+              const std::map<std::string, mxnet::cpp::NDArray>& aux_map,
+              std::vector<std::string> files,
+              uint32_t batch_size,
+              uint32_t workers_num,
+              uint32_t top_k)
+      : files_(std::move(files)),
+        batch_size_(std::max(batch_size, 1u)),
+        top_k_(top_k),
+        labels_(LoadLabels()) {
+    using namespace mxnet::cpp;
+    batches_num_ = (files_.size() + batch_size_ - 1) / batch_size_;
+    Shape data_shape(batch_size_, 3, image_size, image_size);
+    args_map["data"] = NDArray(data_shape, global_ctx, false);
+    for (auto& slot : slots_)
+      slot = NDArray(data_shape, global_ctx, false);
+    executor_.reset(net.SimpleBind(global_ctx, args_map,
+                                   std::map<std::string, NDArray>(),
+                                   std::map<std::string, OpReqType>(),
+                                   aux_map));
+    data_ = args_map["data"];
+    auto output_shape = executor_->outputs[0].GetShape();
+    for (size_t i = 0; i < kBuffers; ++i)
+      free_buffers_.emplace_back(
+          Shape(output_shape), Context(DeviceType::kCPUPinned, 0), false);
+    for (uint32_t i = 0; i < std::max(workers_num, 1u); ++i)
+      workers_.emplace_back([this]() { DecodeLoop(); });
+  }
+
+  ~BatchScorer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      cv_.notify_all();
+    }
+    for (auto& worker : workers_)
+      worker.join();
+    mxnet::cpp::NDArray::WaitAll();
+  }
+
+  // Returns the number of scored images
+  size_t Run() {
+    std::thread readout([this]() { ReadoutLoop(); });
+    try {
+      for (size_t b = 0; b < batches_num_; ++b) {
+        HostBatch batch;
+        Output output;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this, b]() {
+            return error_ || (decoded_.count(b) > 0 && !free_buffers_.empty());
+          });
+          if (error_)
+            break;
+          batch = std::move(decoded_[b]);
+          decoded_.erase(b);
+          next_batch_ = b + 1;
+          output.probs = free_buffers_.back();
+          free_buffers_.pop_back();
+          cv_.notify_all();
+        }
+        // the synchronous upload waits only for the copy from the slot two
+        // batches before
+        auto& slot = slots_[b % slots_.size()];
+        slot.SyncCopyFromCPU(batch.data.data(), batch.data.size());
+        slot.CopyTo(&data_);
+        executor_->Forward(false);
+        executor_->outputs[0].CopyTo(&output.probs);
+        output.names = std::move(batch.names);
+        std::lock_guard<std::mutex> lock(mutex_);
+        outputs_.push_back(std::move(output));
+        cv_.notify_all();
+      }
+    } catch (...) {
+      Fail(std::current_exception());
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      inputs_done_ = true;
+      cv_.notify_all();
+    }
+    readout.join();
+    if (error_)
+      std::rethrow_exception(error_);
+    return scored_num_;
+  }
+
+ private:
+  static const size_t kBuffers = 3;
+  // batches decoded ahead of the net
+  static const size_t kReadahead = 4;
+
+  struct HostBatch {
+    std::vector<std::string> names;
+    std::vector<float> data;
+  };
+  struct Output {
+    std::vector<std::string> names;
+    mxnet::cpp::NDArray probs;
+  };
+
+  void Fail(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_)
+      error_ = error;
+    cv_.notify_all();
+  }
+
+  void DecodeLoop() {
+    try {
+      const size_t image_len = 3 * image_size * image_size;
+      while (true) {
+        size_t b = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this]() {
+            return stop_ || error_ || decode_batch_ >= batches_num_ ||
+                   decode_batch_ < next_batch_ + kReadahead;
+          });
+          if (stop_ || error_ || decode_batch_ >= batches_num_)
+            break;
+          b = decode_batch_++;
+        }
+        HostBatch batch;
+        // the last batch is padded with zeros
+        batch.data.assign(batch_size_ * image_len, 0.f);
+        auto end = std::min(files_.size(), (b + 1) * batch_size_);
+        for (auto i = b * batch_size_; i < end; ++i) {
+          auto img = std::get<0>(
+              LoadImageFitSize(files_[i], image_size, image_size));
+          if (img.empty())
+            throw std::runtime_error("Failed to load image " + files_[i]);
+          CVToMxnetFormat(img, batch.data.data() + batch.names.size() *
+                                                       image_len);
+          batch.names.push_back(files_[i]);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        decoded_[b] = std::move(batch);
+        cv_.notify_all();
+      }
+    } catch (...) {
+      Fail(std::current_exception());
+    }
+  }
+
+  void ReadoutLoop() {
+    try {
+      auto start = std::chrono::steady_clock::now();
+      std::vector<size_t> order;
+      while (true) {
+        Output output;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this]() {
+            return error_ || inputs_done_ || !outputs_.empty();
+          });
+          if (error_ || outputs_.empty())
+            break;
+          output = std::move(outputs_.front());
+          outputs_.pop_front();
+        }
+        output.probs.WaitToRead();
+        const auto* probs = output.probs.GetData();
+        const size_t classes = output.probs.Size() / batch_size_;
+        order.resize(classes);
+        const auto top_k = std::min(static_cast<size_t>(top_k_), classes);
+        for (size_t i = 0; i < output.names.size(); ++i) {
+          const auto* row = probs + i * classes;
+          std::iota(order.begin(), order.end(), 0);
+          std::partial_sort(
+              order.begin(), order.begin() + static_cast<long>(top_k),
+              order.end(),
+              [row](size_t a, size_t b) { return row[a] > row[b]; });
+          std::cout << output.names[i];
+          for (size_t k = 0; k < top_k; ++k) {
+            auto label = order[k] < labels_.size() ? labels_[order[k]]
+                                                   : std::to_string(order[k]);
+            std::cout << "\t" << label << " " << row[order[k]];
+          }
+          std::cout << "\n";
+        }
+        scored_num_ += output.names.size();
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          free_buffers_.push_back(output.probs);
+          cv_.notify_all();
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cerr << "Images: " << scored_num_
+                  << " images/s: " << scored_num_ / elapsed.count() << "\r";
+      }
+      std::cerr << std::endl;
+    } catch (...) {
+      Fail(std::current_exception());
+    }
+  }
+
+ private:
+  std::vector<std::string> files_;
+  size_t batch_size_{1};
+  size_t batches_num_{0};
+  uint32_t top_k_{5};
+  std::vector<std::string> labels_;
+  std::unique_ptr<mxnet::cpp::Executor> executor_;
+  mxnet::cpp::NDArray data_;
+  mxnet::cpp::NDArray slots_[2];
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<size_t, HostBatch> decoded_;
+  std::deque<Output> outputs_;
+  std::vector<mxnet::cpp::NDArray> free_buffers_;
+  size_t decode_batch_{0};
+  size_t next_batch_{0};
+  bool inputs_done_{false};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::atomic<size_t> scored_num_{0};
+  std::vector<std::thread> workers_;
+};
+
 int main(int argc, char** argv) {
   using namespace mxnet::cpp;
-  if (argc > 1) {
+  cv::CommandLineParser parser(argc, argv, keys);
+  parser.about("Resnet classification");
+  if (parser.has("help") || argc == 1) {
+    parser.printMessage();
+    return 0;
+  }
+  std::string image_path = parser.get<cv::String>(0);
+  std::string list_path;
+  if (parser.has("list"))
+    list_path = parser.get<cv::String>("list");
+  auto batch_size = parser.get<uint32_t>("batch");
+  auto workers_num = parser.get<uint32_t>("workers");
+  auto top_k = parser.get<uint32_t>("top");
+  if (!parser.check() || (image_path.empty() && list_path.empty())) {
+    parser.printErrors();
+    parser.printMessage();
+    return 1;
+  }
+
+  {
     //---------- Load symbols
     std::string symbol_file = "../model/model_symbol.json";
     Symbol net = Symbol::Load(symbol_file).GetInternals();
@@ -43,6 +327,29 @@ int main(int argc, char** argv) {
     /*WaitAll is need when we copy data between GPU and the main memory*/
     NDArray::WaitAll();
 
+    if (!list_path.empty()) {
+      std::vector<std::string> files;
+      std::ifstream list_file(list_path);
+      std::string line;
+      while (std::getline(list_file, line)) {
+        if (!line.empty())
+          files.push_back(line);
+      }
+      auto start = std::chrono::steady_clock::now();
+      size_t scored_num = 0;
+      {
+        BatchScorer scorer(net, args_map, aux_map, std::move(files),
+                           batch_size, workers_num, top_k);
+        scored_num = scorer.Run();
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      std::cerr << "Scored " << scored_num << " images, "
+                << scored_num / elapsed.count() << " images/s" << std::endl;
+      MXNotifyShutdown();
+      return 0;
+    }
+
     //----------- Load mean
     NDArray mean_img(Shape(1, 3, 224, 224), global_ctx, false);
     mean_img.SyncCopyFromCPU(
@@ -51,7 +358,7 @@ int main(int argc, char** argv) {
     NDArray::WaitAll();
 
     //----------- Load data
-    auto img = LoadImageFitSize(argv[1], 224, 224);
+    auto img = LoadImageFitSize(image_path, image_size, image_size);
     auto array = CVToMxnetFormat(std::get<0>(img));
     NDArray data(Shape(1, 3, static_cast<index_t>(std::get<0>(img).rows),
                        static_cast<index_t>(std::get<0>(img).cols)),
@@ -84,16 +391,7 @@ int main(int argc, char** argv) {
         max_index = i;
       }
     }
-    std::vector<std::string> labels;
-    {
-      std::ifstream labels_file("../model/synset.txt");
-      if (labels_file) {
-        std::string label;
-        while (std::getline(labels_file, label)) {
-          labels.push_back(label);
-        }
-      }
-    }
+    auto labels = LoadLabels();
     std::cout << "Probalility " << max_pred << " Class " << labels[max_index]
               << std::endl;
   }
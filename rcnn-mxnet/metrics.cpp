@@ -1,180 +1,128 @@
 #include "metrics.h"
 #include "mxutils.h"
 
-#include <mshadow/tensor.h>
-#include <Eigen/Dense>
-
-void RCNNAccMetric::Update(mxnet::cpp::NDArray labels,
-                           mxnet::cpp::NDArray preds) {
-  auto preds_shape = preds.GetShape();
-  auto labels_shape = labels.GetShape();
-  mx_uint batches = labels_shape.front();
-  mx_uint len = labels_shape.back() * batches;
-  mx_uint classes_num = preds_shape.back();
-  std::vector<mx_float> pred_data(len);
-  std::vector<mx_float> label_data(len);
-  preds.Reshape(mxnet::cpp::Shape(static_cast<mx_uint>(-1), classes_num))
-      .ArgmaxChannel()
-      .SyncCopyToCPU(&pred_data, pred_data.size());
-  labels.Reshape(mxnet::cpp::Shape(static_cast<mx_uint>(-1)))
-      .SyncCopyToCPU(&label_data, label_data.size());
-  CheckMXnetError("RCNNAccMetric");
-  for (mx_uint i = 0; i < len; ++i) {
-    sum_metric +=
-        (static_cast<int>(pred_data[i]) == static_cast<int>(label_data[i])) ? 1
-                                                                            : 0;
-    num_inst += 1;
-  }
-}
-
-void RCNNLogLossMetric::Update(mxnet::cpp::NDArray labels,
-                               mxnet::cpp::NDArray preds) {
-  auto preds_shape = preds.GetShape();
-  auto labels_shape = labels.GetShape();
-  mx_uint batches = labels_shape.front();
-  mx_uint len = labels_shape.back() * batches;
-  mx_uint classes_num = preds_shape.back();
-  std::vector<mx_float> pred_data(preds.Size());
-  std::vector<mx_float> label_data(labels.Size());
-  preds.SyncCopyToCPU(&pred_data, pred_data.size());
-  labels.SyncCopyToCPU(&label_data, label_data.size());
-  CheckMXnetError("RCNNLogLossMetric");
-
-  auto pred = Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic,
-                                             Eigen::Dynamic, Eigen::RowMajor>>(
-      pred_data.data(), len, classes_num);
-
-  auto label = Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic,
-                                              Eigen::Dynamic, Eigen::RowMajor>>(
-      label_data.data(), len, 1);
-
-  Eigen::MatrixXf cls(len, 1);
-  for (Eigen::Index r = 0; r < len; ++r) {
-    cls(r, 0) = pred(r, static_cast<Eigen::Index>(label(r, 0)));
-  }
-
-  cls.array() += 1e-14f;
-  auto cls_loss = -1 * cls.array().log();
-  auto value = cls_loss.sum();
-  assert(!std::isnan(value));
-  sum_metric += value;
-  num_inst += label.rows();
-}
-
-void RCNNL1LossMetric::Update(mxnet::cpp::NDArray labels,
-                              mxnet::cpp::NDArray preds) {
-  std::vector<mx_float> pred_data(preds.Size());
-  std::vector<mx_float> label_data(labels.Size());
-  preds.SyncCopyToCPU(&pred_data, pred_data.size());
-  labels.SyncCopyToCPU(&label_data, label_data.size());
-  CheckMXnetError("RCNNL1LossMetric");
-
-  auto bbox_loss =
-      Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
-                                     Eigen::RowMajor>>(
-          pred_data.data(), static_cast<Eigen::Index>(pred_data.size()), 1);
-
-  auto label = Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic,
-                                              Eigen::Dynamic, Eigen::RowMajor>>(
-      label_data.data(), static_cast<Eigen::Index>(label_data.size()), 1);
-
-  sum_metric += bbox_loss.array().sum();
-  num_inst += (label.array() != 0).count();
-}
-
-void RPNL1LossMetric::Update(mxnet::cpp::NDArray labels,
-                             mxnet::cpp::NDArray preds) {
-  auto preds_shape = preds.GetShape();
-  auto labels_shape = labels.GetShape();
-  std::vector<mx_float> pred_data(preds.Size());
-  std::vector<mx_float> label_data(labels.Size());
-  preds.SyncCopyToCPU(&pred_data, pred_data.size());
-  labels.SyncCopyToCPU(&label_data, label_data.size());
-  CheckMXnetError("RPNL1LossMetric");
-
-  auto bbox_loss =
-      Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
-                                     Eigen::RowMajor>>(
-          pred_data.data(), static_cast<Eigen::Index>(pred_data.size()), 1);
-
-  auto bbox_weight =
-      Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
-                                     Eigen::RowMajor>>(
-          label_data.data(), static_cast<Eigen::Index>(label_data.size()), 1);
+namespace {
+using mxnet::cpp::NDArray;
+using mxnet::cpp::Operator;
+using mxnet::cpp::Shape;
 
+NDArray Sum(const NDArray& x) {
+  return Operator("sum")(x).Invoke().front();
+}
+
+NDArray Argmax(const NDArray& x, int axis) {
+  return Operator("argmax")(x).SetParam("axis", axis).Invoke().front();
+}
+
+NDArray Pick(const NDArray& x, const NDArray& index, int axis) {
+  return Operator("pick")(x, index).SetParam("axis", axis).Invoke().front();
+}
+
+NDArray Equal(const NDArray& a, const NDArray& b) {
+  return Operator("broadcast_equal")(a, b).Invoke().front();
+}
+
+NDArray ScalarOp(const char* name, const NDArray& x, float scalar) {
+  return Operator(name)(x).SetParam("scalar", scalar).Invoke().front();
+}
+
+NDArray Log(const NDArray& x) {
+  return Operator("log")(x).Invoke().front();
+}
+
+// Labels of RPN anchors (B, 1, A*H, W) as (B, A*H, W) like the argmax over
+// the class axis of the predictions
+NDArray RPNLabels(const NDArray& labels) {
+  auto shape = labels.GetShape();
+  return labels.Reshape(Shape(shape[0], shape[2], shape[3]));
+}
+}  // namespace
+
+void DeviceMetric::Allocate(const mxnet::cpp::Context& ctx) {
+  totals_ = NDArray(Shape(2), ctx, false);
+  totals_ = 0;
+  host_totals_ = NDArray(Shape(2), mxnet::cpp::Context::cpu(), false);
+  host_totals_ = 0;
+  allocated_ = true;
+}
+
+void DeviceMetric::Reset() {
+  if (allocated_)
+    totals_ = 0;
+  host_count_ = 0;
+}
+
+void DeviceMetric::Accumulate(NDArray sum, NDArray count) {
+  if (!allocated_)
+    Allocate(sum.GetContext());
+  totals_ += Operator("Concat")(sum, count)
+                 .SetParam("num_args", 2)
+                 .SetParam("dim", 0)
+                 .Invoke()
+                 .front();
+}
+
+void DeviceMetric::Accumulate(NDArray sum, float count) {
+  if (!allocated_)
+    Allocate(sum.GetContext());
+  totals_.Slice(0, 1) += sum;
+  host_count_ += count;
+}
+
+void DeviceMetric::Fetch() {
+  if (!allocated_)
+    return;
+  totals_.CopyTo(&host_totals_);
+  fetched_host_count_ = host_count_;
+}
+
+float DeviceMetric::Get() {
+  if (!allocated_)
+    return 0;
+  host_totals_.WaitToRead();
+  CheckMXnetError(name_.c_str());
+  const auto* totals = host_totals_.GetData();
+  return totals[0] / (totals[1] + fetched_host_count_);
+}
+
+void RCNNAccMetric::Update(NDArray labels, NDArray preds) {
+  auto classes_num = preds.GetShape().back();
+  auto pred_label = Argmax(
+      preds.Reshape(Shape(static_cast<mx_uint>(-1), classes_num)), 1);
+  auto label = labels.Reshape(Shape(static_cast<mx_uint>(-1)));
+  Accumulate(Sum(Equal(pred_label, label)), static_cast<float>(labels.Size()));
+}
+
+void RCNNLogLossMetric::Update(NDArray labels, NDArray preds) {
+  auto classes_num = preds.GetShape().back();
+  auto cls = Pick(preds.Reshape(Shape(static_cast<mx_uint>(-1), classes_num)),
+                  labels.Reshape(Shape(static_cast<mx_uint>(-1))), 1);
+  auto cls_loss = Log(cls + 1e-14f) * -1.f;
+  Accumulate(Sum(cls_loss), static_cast<float>(labels.Size()));
+}
+
+void RCNNL1LossMetric::Update(NDArray labels, NDArray preds) {
+  Accumulate(Sum(preds), Sum(ScalarOp("_not_equal_scalar", labels, 0)));
+}
+
+void RPNL1LossMetric::Update(NDArray labels, NDArray preds) {
   // calculate num_inst(average on those fg anchors)
-  auto num = (bbox_weight.array() > 0).count() / 4;
-  auto val = bbox_loss.array().sum();
-  sum_metric += val;
-  num_inst += num;
-}
-
-void RPNAccMetric::Update(mxnet::cpp::NDArray labels,
-                          mxnet::cpp::NDArray preds) {
-  auto preds_shape = preds.GetShape();
-  auto labels_shape = labels.GetShape();
-  std::vector<mx_float> pred_data(labels.Size());
-  std::vector<mx_float> label_data(labels.Size());
-  preds.ArgmaxChannel().SyncCopyToCPU(&pred_data, pred_data.size());
-  labels.SyncCopyToCPU(&label_data, label_data.size());
-  CheckMXnetError("RPNAccMetric");
-  for (mx_uint i = 0; i < labels.Size(); ++i) {
-    if (static_cast<long>(label_data[i]) != -1) {
-      sum_metric +=
-          (static_cast<int>(pred_data[i]) == static_cast<int>(label_data[i]))
-              ? 1
-              : 0;
-      num_inst += 1;
-    }
-  }
-}
-
-void RPNLogLossMetric::Update(mxnet::cpp::NDArray labels,
-                              mxnet::cpp::NDArray preds) {
-  using namespace mxnet::cpp;
-  using namespace mshadow;
-  std::vector<mx_float> label_data(labels.Size());
-  labels.SyncCopyToCPU(&label_data, label_data.size());
-
-  std::vector<mx_float> pred_data(preds.Size());
-  preds.SyncCopyToCPU(&pred_data, pred_data.size());
-  CheckMXnetError("RPNLogLossMetric");
-
-  index_t labels_len = static_cast<index_t>(label_data.size());
-  index_t len = static_cast<index_t>(pred_data.size());
-  index_t dim3 = len / (preds.GetShape()[0] * preds.GetShape()[1]);
-  auto out_shape = Shape2(labels_len, len / labels_len);
-  Tensor<cpu, 2, float> pred(pred_data.data(), out_shape);
-  {
-    TensorContainer<cpu, 2, float> x3(out_shape);
-    {
-      Tensor<cpu, 4, float> pred_map(
-          pred_data.data(), Shape4(preds.GetShape()[0], preds.GetShape()[1],
-                                   preds.GetShape()[2], preds.GetShape()[3]));
-      auto x1 = expr::reshape(
-          pred_map, Shape3(preds.GetShape()[0], preds.GetShape()[1], dim3));
-      auto x2 = expr::transpose(x1, Shape3(0, 2, 1));
-      x3 = expr::reshape(x2, out_shape);
-    }
-    Copy(pred, x3);
-  }
-
-  // filter with labels
-  std::vector<float> cls_data;
-  cls_data.reserve(labels_len);
-  for (index_t i = 0; i < labels_len; ++i) {
-    if (static_cast<long>(label_data[i]) != -1) {
-      cls_data.push_back(pred[i][static_cast<index_t>(label_data[i])]);
-    }
-  }
-
-  Eigen::MatrixXf cls =
-      Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
-                                     Eigen::RowMajor>>(
-          cls_data.data(), static_cast<Eigen::Index>(cls_data.size()), 1);
-
-  cls.array() += 1e-14f;
-  auto cls_loss = -1 * cls.array().log();
-  sum_metric += cls_loss.sum();
-  num_inst += cls_data.size();
+  auto num = Sum(ScalarOp("_greater_scalar", labels, 0)) / 4.f;
+  Accumulate(Sum(preds), num);
+}
+
+void RPNAccMetric::Update(NDArray labels, NDArray preds) {
+  auto label = RPNLabels(labels);
+  auto valid = ScalarOp("_not_equal_scalar", label, -1);
+  auto correct = Equal(Argmax(preds, 1), label) * valid;
+  Accumulate(Sum(correct), Sum(valid));
+}
+
+void RPNLogLossMetric::Update(NDArray labels, NDArray preds) {
+  auto label = RPNLabels(labels);
+  auto valid = ScalarOp("_not_equal_scalar", label, -1);
+  // ignored anchors pick the class 0 and are masked out
+  auto cls = Pick(preds, label, 1);
+  auto cls_loss = Log(cls + 1e-14f) * -1.f * valid;
+  Accumulate(Sum(cls_loss), Sum(valid));
 }
@@ -3,44 +3,82 @@
 
 #include <mxnet-cpp/MxNetCpp.h>
 
-class RCNNAccMetric : public mxnet::cpp::EvalMetric {
+/* Training metric computed on the device of the predictions. Updates are
+ * reductions queued to the engine, which add to the sum and the number of
+ * instances kept on the device, so they don't wait for the network. Fetch
+ * queues the copy of the two totals to the host and Get waits only for it.
+ */
+class DeviceMetric {
  public:
-  RCNNAccMetric() : EvalMetric("RCNNAccMetric") {}
+  explicit DeviceMetric(const std::string& name) : name_(name) {}
+  DeviceMetric(const DeviceMetric&) = delete;
+  DeviceMetric& operator=(const DeviceMetric&) = delete;
+  virtual ~DeviceMetric() = default;
+
+  virtual void Update(mxnet::cpp::NDArray labels,
+                      mxnet::cpp::NDArray preds) = 0;
+  void Reset();
+  void Fetch();
+  float Get();
+
+  const std::string& GetName() const { return name_; }
+
+ protected:
+  // sum and count are device arrays of shape (1)
+  void Accumulate(mxnet::cpp::NDArray sum, mxnet::cpp::NDArray count);
+  // count known on the host from the shapes
+  void Accumulate(mxnet::cpp::NDArray sum, float count);
+
+ private:
+  void Allocate(const mxnet::cpp::Context& ctx);
+
+ private:
+  std::string name_;
+  bool allocated_{false};
+  mxnet::cpp::NDArray totals_;
+  mxnet::cpp::NDArray host_totals_;
+  float host_count_{0};
+  float fetched_host_count_{0};
+};
+
+class RCNNAccMetric : public DeviceMetric {
+ public:
+  RCNNAccMetric() : DeviceMetric("RCNNAccMetric") {}
 
   void Update(mxnet::cpp::NDArray labels, mxnet::cpp::NDArray preds) override;
 };
 
-class RCNNLogLossMetric : public mxnet::cpp::EvalMetric {
+class RCNNLogLossMetric : public DeviceMetric {
  public:
-  RCNNLogLossMetric() : EvalMetric("RCNNLogLossMetric") {}
+  RCNNLogLossMetric() : DeviceMetric("RCNNLogLossMetric") {}
 
   void Update(mxnet::cpp::NDArray labels, mxnet::cpp::NDArray preds) override;
 };
 
-class RCNNL1LossMetric : public mxnet::cpp::EvalMetric {
+class RCNNL1LossMetric : public DeviceMetric {
  public:
-  RCNNL1LossMetric() : EvalMetric("RCNNL1LossMetric") {}
+  RCNNL1LossMetric() : DeviceMetric("RCNNL1LossMetric") {}
 
   void Update(mxnet::cpp::NDArray labels, mxnet::cpp::NDArray preds) override;
 };
 
-class RPNL1LossMetric : public mxnet::cpp::EvalMetric {
+class RPNL1LossMetric : public DeviceMetric {
  public:
-  RPNL1LossMetric() : EvalMetric("RPNL1LossMetric") {}
+  RPNL1LossMetric() : DeviceMetric("RPNL1LossMetric") {}
 
   void Update(mxnet::cpp::NDArray labels, mxnet::cpp::NDArray preds) override;
 };
 
-class RPNAccMetric : public mxnet::cpp::EvalMetric {
+class RPNAccMetric : public DeviceMetric {
  public:
-  RPNAccMetric() : EvalMetric("RPNAccMetric") {}
+  RPNAccMetric() : DeviceMetric("RPNAccMetric") {}
 
   void Update(mxnet::cpp::NDArray labels, mxnet::cpp::NDArray preds) override;
 };
 
-class RPNLogLossMetric : public mxnet::cpp::EvalMetric {
+class RPNLogLossMetric : public DeviceMetric {
  public:
-  RPNLogLossMetric() : EvalMetric("RPNLogLossMetric") {}
+  RPNLogLossMetric() : DeviceMetric("RPNLogLossMetric") {}
 
   void Update(mxnet::cpp::NDArray labels, mxnet::cpp::NDArray preds) override;
 };
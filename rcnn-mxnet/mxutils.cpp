@@ -1,5 +1,6 @@
 #include "mxutils.h"
 #include <iostream>
+#include <stdexcept>
 
 void CheckMXnetError(const char* state) {
   auto* err = MXGetLastError();
@@ -9,3 +10,49 @@ void CheckMXnetError(const char* state) {
     exit(-1);
   }
 }
+
+std::map<std::string, int> InferArgTypes(
+    const mxnet::cpp::Symbol& net,
+    const std::vector<std::string>& float32_inputs) {
+  std::vector<const char*> keys;
+  std::vector<int> types;
+  for (const auto& name : float32_inputs) {
+    keys.push_back(name.c_str());
+    types.push_back(kFloat32Type);
+  }
+  mx_uint in_size = 0;
+  mx_uint out_size = 0;
+  mx_uint aux_size = 0;
+  const int* in_types = nullptr;
+  const int* out_types = nullptr;
+  const int* aux_types = nullptr;
+  int complete = 0;
+  if (MXSymbolInferType(net.GetHandle(), static_cast<mx_uint>(keys.size()),
+                        keys.data(), types.data(), &in_size, &in_types,
+                        &out_size, &out_types, &aux_size, &aux_types,
+                        &complete) != 0 ||
+      !complete)
+    throw std::runtime_error("Failed to infer types of the net arguments");
+
+  auto args = net.ListArguments();
+  std::map<std::string, int> arg_types;
+  for (mx_uint i = 0; i < in_size && i < args.size(); ++i)
+    arg_types[args[i]] = in_types[i];
+  return arg_types;
+}
+
+mxnet::cpp::NDArray CastArray(const mxnet::cpp::NDArray& array, int dtype) {
+  return mxnet::cpp::Operator("Cast")(array)
+      .SetParam("dtype", dtype == kFloat16Type ? "float16" : "float32")
+      .Invoke()
+      .front();
+}
+
+void CastToArgTypes(const std::map<std::string, int>& arg_types,
+                    std::map<std::string, mxnet::cpp::NDArray>& args_map) {
+  for (auto& arg : args_map) {
+    auto type = arg_types.find(arg.first);
+    if (type != arg_types.end() && arg.second.GetDType() != type->second)
+      arg.second = CastArray(arg.second, type->second);
+  }
+}
@@ -3,6 +3,27 @@
 
 #include <mxnet-cpp/MxNetCpp.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
 void CheckMXnetError(const char* state);
 
+// mshadow type flags
+const int kFloat32Type = 0;
+const int kFloat16Type = 2;
+
+// Types of the net arguments inferred from the float32 inputs
+std::map<std::string, int> InferArgTypes(
+    const mxnet::cpp::Symbol& net,
+    const std::vector<std::string>& float32_inputs);
+
+// A copy of the array of the type, on the same device
+mxnet::cpp::NDArray CastArray(const mxnet::cpp::NDArray& array, int dtype);
+
+// Arrays of other types than the net arguments are replaced with copies of
+// the argument types
+void CastToArgTypes(const std::map<std::string, int>& arg_types,
+                    std::map<std::string, mxnet::cpp::NDArray>& args_map);
+
 #endif  // MXUTILS_H
@@ -1,31 +1,61 @@
 #include "params.h"
+#include "mxutils.h"
+
+#include <iostream>
+#include <set>
 
 std::pair<std::map<std::string, mxnet::cpp::NDArray>,
           std::map<std::string, mxnet::cpp::NDArray>>
-LoadNetParams(const mxnet::cpp::Context& ctx, const std::string& param_file) {
+LoadNetParams(const mxnet::cpp::Context& ctx,
+              const std::string& param_file,
+              const mxnet::cpp::Symbol* net) {
   using namespace mxnet::cpp;
   //---------- Load parameters
   std::map<std::string, NDArray> paramters;
   NDArray::Load(param_file, nullptr, &paramters);
+
+  std::set<std::string> arg_names;
+  std::set<std::string> aux_names;
+  if (net) {
+    for (const auto& name : net->ListArguments())
+      arg_names.insert(name);
+    for (const auto& name : net->ListAuxiliaryStates())
+      aux_names.insert(name);
+  }
+  auto keep = [net](const std::set<std::string>& names,
+                    const std::string& name) {
+    return !net || names.count(name) > 0;
+  };
+
+  // Copies are only queued, so the engine overlaps them, and the whole set
+  // is waited for once
   std::map<std::string, NDArray> args_map;
   std::map<std::string, NDArray> aux_map;
   for (const auto& k : paramters) {
-    if (k.first.substr(0, 4) == "aux:") {
-      auto name = k.first.substr(4, k.first.size() - 4);
-      aux_map[name] = k.second.Copy(ctx);
-      aux_map[name].WaitAll();
-    }
-    if (k.first.substr(0, 4) == "arg:") {
-      auto name = k.first.substr(4, k.first.size() - 4);
-      args_map[name] = k.second.Copy(ctx);
-      args_map[name].WaitAll();
+    if (k.first.compare(0, 4, "aux:") == 0) {
+      auto name = k.first.substr(4);
+      if (keep(aux_names, name))
+        aux_map[name] = k.second.Copy(ctx);
+    } else if (k.first.compare(0, 4, "arg:") == 0) {
+      auto name = k.first.substr(4);
+      if (keep(arg_names, name))
+        args_map[name] = k.second.Copy(ctx);
+    } else {
+      std::cout << "Skipping parameter without arg: or aux: prefix : "
+                << k.first << std::endl;
     }
   }
+  NDArray::WaitAll();
   return std::make_pair(args_map, aux_map);
 }
 
-void SaveNetParams(const std::string& param_file, mxnet::cpp::Executor* exe) {
-  mxnet::cpp::NDArray::WaitAll();
+std::map<std::string, mxnet::cpp::NDArray> GetNetParams(
+    mxnet::cpp::Executor* exe) {
+  // parameters of mixed precision nets are saved in float32
+  auto to_float32 = [](const mxnet::cpp::NDArray& array) {
+    return array.GetDType() == kFloat32Type ? array
+                                            : CastArray(array, kFloat32Type);
+  };
   std::map<std::string, mxnet::cpp::NDArray> params;
   for (auto& iter : exe->arg_dict()) {
     if (iter.first.rfind("data", 0) != 0 &&
@@ -34,10 +64,15 @@ void SaveNetParams(const std::string& param_file, mxnet::cpp::Executor* exe) {
         iter.first.rfind("label", 0) != 0 &&
         iter.first.rfind("bbox_target", 0) != 0 &&
         iter.first.rfind("bbox_weight", 0) != 0)
-      params.insert({"arg:" + iter.first, iter.second});
+      params.insert({"arg:" + iter.first, to_float32(iter.second)});
   }
   for (auto iter : exe->aux_dict()) {
     params.insert({"aux:" + iter.first, iter.second});
   }
-  mxnet::cpp::NDArray::Save(param_file, params);
+  return params;
+}
+
+void SaveNetParams(const std::string& param_file, mxnet::cpp::Executor* exe) {
+  mxnet::cpp::NDArray::WaitAll();
+  mxnet::cpp::NDArray::Save(param_file, GetNetParams(exe));
 }
@@ -11,6 +11,13 @@ class Params {
  public:
   uint32_t img_short_side = 480;
   uint32_t img_long_side = 640;
+  // Training image shapes (height, width), the first one is the largest.
+  // Images are trained in the shape they fill best, so portrait images are
+  // not padded to the landscape shape.
+  std::vector<std::pair<uint32_t, uint32_t>> train_buckets{
+      {img_short_side, img_long_side},
+      {img_long_side, img_short_side},
+      {img_short_side, img_short_side}};
   float rpn_feat_stride = 16;
   std::vector<float> rpn_anchor_scales{8.f, 16.f, 32.f};
   std::vector<float> rpn_anchor_ratios{0.5f, 1.f, 2.f};
@@ -28,11 +35,35 @@ class Params {
   std::vector<float> rcnn_pooled_size{14, 14};
   uint32_t rcnn_batch_size = 4;
   uint32_t rcnn_batch_gt_boxes = 100;
+  uint32_t rcnn_prefetch_batches = 3;  // batches loaded ahead to the GPU
+  uint32_t rcnn_decode_threads = 4;    // train images decoded at once
+  uint32_t rcnn_grad_bucket_size = 1 << 22;  // gradient elements synced at once
+  // Warm-up tuning of the decode tasks and the prefetch depth by
+  // rcnn_train --autotune, see autotune.h. Every trial times the given
+  // batches, trials with more GPU memory than the fraction are rejected.
+  uint32_t rcnn_autotune_batches = 30;
+  float rcnn_autotune_memory_fraction = 0.9f;
   int rcnn_batch_rois = 128;
   float rcnn_fg_fraction = 0.25f;
   float rcnn_fg_overlap = 0.5f;
   std::vector<float> rcnn_bbox_stds{0.1f, 0.1f, 0.2f, 0.2f};
   float rcnn_conf_thresh = 1e-3f;
+  // Convolutions and fully connected layers run in float16, the optimizer
+  // keeps float32 master weights. Loss gradients are scaled by the loss scale
+  // and the optimizer scales them back.
+  bool mixed_precision = false;
+  float mixed_precision_loss_scale = 128.f;
+  // Boxes are decoded and suppressed by the inference net on the device, only
+  // the top rcnn_max_detections are copied to the host
+  bool rcnn_gpu_decode = true;
+  uint32_t rcnn_max_detections = 100;
+  // Batch norms right after convolutions are folded into the convolution
+  // biases of the inference net, see FoldRCNNBatchNorms
+  bool rcnn_fold_batch_norm = true;
+  // Arguments with one of these parts in the name are frozen in training,
+  // they are bound without gradients like the net inputs
+  std::vector<std::string> rcnn_frozen_args{"conv0", "stage1", "gamma",
+                                            "beta"};
 
   Params(bool is_eval = false) {
     if (is_eval) {
@@ -44,9 +75,17 @@ class Params {
   }
 };
 
+// Parameters of the file copied to the context, with a net only the
+// arguments and auxiliary states it has
 std::pair<std::map<std::string, mxnet::cpp::NDArray>,
           std::map<std::string, mxnet::cpp::NDArray>>
-LoadNetParams(const mxnet::cpp::Context& ctx, const std::string& param_file);
+LoadNetParams(const mxnet::cpp::Context& ctx,
+              const std::string& param_file,
+              const mxnet::cpp::Symbol* net = nullptr);
+
+// Parameters of the executor without the net inputs, named as in the files
+std::map<std::string, mxnet::cpp::NDArray> GetNetParams(
+    mxnet::cpp::Executor* exe);
 
 void SaveNetParams(const std::string& param_file, mxnet::cpp::Executor* exe);
 
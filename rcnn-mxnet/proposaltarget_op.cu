@@ -1,8 +1,324 @@
 #include "proposaltarget_op.h"
 #include "proposaltarget_op.hpp"
 
+#include <cuda_runtime.h>
+
+#include <algorithm>
+
+// GPU version of the ProposalTarget forward: candidates are matched to the
+// gt boxes, sampled and converted to targets on the device, so the operator
+// doesn't copy rois to the host and doesn't synchronize with the GPU.
+// Sampling is done with random keys instead of shuffles, every candidate gets
+// a key and the candidates with the lowest keys are taken.
+
 namespace mxnet {
 namespace op {
+namespace {
+const int kThreadsPerBlock = 256;
+const int kMaxBlocks = 4096;
+const uint32_t kSamplingSeed = 5675317;
+
+struct BoxStds {
+  float values[4];
+};
+
+int BlocksFor(int count) {
+  auto blocks = (count + kThreadsPerBlock - 1) / kThreadsPerBlock;
+  return std::max(1, std::min(kMaxBlocks, blocks));
+}
+
+void CheckLaunch(const char* name) {
+  cudaError_t err = cudaPeekAtLastError();
+  CHECK_EQ(err, cudaSuccess) << name << " : " << cudaGetErrorString(err);
+}
+
+// Uniform random key of the candidate for the forward call
+__device__ uint32_t RandomKey(uint32_t call, uint32_t index) {
+  uint32_t h = kSamplingSeed ^ (call * 0x9E3779B9u) ^ (index * 0x85EBCA6Bu);
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// Candidates are the rois [rois_count, 5] (batch_index, x1, y1, x2, y2)
+// followed by the gt boxes [batch_images * gt_count, 5] (x1, y1, x2, y2, cls)
+// of all images. Returns the (x1, y1, x2, y2) box, image is -1 for padded gt
+// boxes.
+__device__ const float* CandidateBox(const float* rois,
+                                     const float* gt_boxes,
+                                     int rois_count,
+                                     int gt_count,
+                                     int c,
+                                     int* image) {
+  if (c < rois_count) {
+    *image = static_cast<int>(rois[c * 5]);
+    return rois + c * 5 + 1;
+  }
+  auto g = c - rois_count;
+  *image = gt_boxes[g * 5 + 4] > 0 ? g / gt_count : -1;
+  return gt_boxes + g * 5;
+}
+
+__device__ float BoxOverlap(const float* a, const float* b) {
+  auto iw = fminf(a[2], b[2]) - fmaxf(a[0], b[0]) + 1;
+  if (iw <= 0)
+    return 0;
+  auto ih = fminf(a[3], b[3]) - fmaxf(a[1], b[1]) + 1;
+  if (ih <= 0)
+    return 0;
+  auto a_area = (a[2] - a[0] + 1) * (a[3] - a[1] + 1);
+  auto b_area = (b[2] - b[0] + 1) * (b[3] - b[1] + 1);
+  return iw * ih / (a_area + b_area - iw * ih);
+}
+
+// Finds the gt box with the highest overlap for every candidate
+__global__ void MatchCandidatesKernel(const float* rois,
+                                      const float* gt_boxes,
+                                      int rois_count,
+                                      int batch_images,
+                                      int gt_count,
+                                      uint32_t call,
+                                      float* max_overlaps,
+                                      int* assignment,
+                                      int* images,
+                                      uint32_t* keys) {
+  const int candidates_count = rois_count + batch_images * gt_count;
+  for (int c = blockIdx.x * blockDim.x + threadIdx.x; c < candidates_count;
+       c += blockDim.x * gridDim.x) {
+    int image = -1;
+    auto box = CandidateBox(rois, gt_boxes, rois_count, gt_count, c, &image);
+    if (image < 0 || image >= batch_images) {
+      images[c] = -1;
+      continue;
+    }
+    float best_overlap = -1;
+    int best = -1;
+    for (int j = 0; j < gt_count; ++j) {
+      auto gt_box = gt_boxes + (image * gt_count + j) * 5;
+      if (gt_box[4] <= 0)
+        continue;
+      auto overlap = BoxOverlap(box, gt_box);
+      if (overlap > best_overlap) {
+        best_overlap = overlap;
+        best = j;
+      }
+    }
+    images[c] = image;
+    max_overlaps[c] = fmaxf(best_overlap, 0.f);
+    assignment[c] = best;
+    keys[c] = RandomKey(call, static_cast<uint32_t>(c));
+  }
+}
+
+// One block per image: takes up to fg_rois_per_image foreground candidates
+// and fills the rest with background ones, repeated if there are not enough.
+// keep gets the candidate of every output row, -1 for empty rows.
+__global__ void SelectRoisKernel(const int* images,
+                                 const float* max_overlaps,
+                                 const uint32_t* keys,
+                                 int candidates_count,
+                                 float fg_overlap,
+                                 int rois_per_image,
+                                 int fg_rois_per_image,
+                                 int* keep,
+                                 int* fg_counts) {
+  const int image = blockIdx.x;
+  auto image_keep = keep + image * rois_per_image;
+  __shared__ int fg_count;
+  __shared__ int bg_count;
+  if (threadIdx.x == 0) {
+    fg_count = 0;
+    bg_count = 0;
+  }
+  for (int i = threadIdx.x; i < rois_per_image; i += blockDim.x)
+    image_keep[i] = -1;
+  __syncthreads();
+  for (int c = threadIdx.x; c < candidates_count; c += blockDim.x) {
+    if (images[c] == image)
+      atomicAdd(max_overlaps[c] >= fg_overlap ? &fg_count : &bg_count, 1);
+  }
+  __syncthreads();
+
+  const int fg_this = min(fg_rois_per_image, fg_count);
+  const int bg_this = min(rois_per_image - fg_this, bg_count);
+  if (threadIdx.x == 0)
+    fg_counts[image] = fg_this;
+
+  for (int c = threadIdx.x; c < candidates_count; c += blockDim.x) {
+    if (images[c] != image)
+      continue;
+    const bool fg = max_overlaps[c] >= fg_overlap;
+    // Rank of the candidate among the candidates of the same kind
+    int rank = 0;
+    for (int other = 0; other < candidates_count; ++other) {
+      if (images[other] != image || (max_overlaps[other] >= fg_overlap) != fg)
+        continue;
+      if (keys[other] < keys[c] || (keys[other] == keys[c] && other < c))
+        ++rank;
+    }
+    // Padding rows repeat background rois, or foreground ones if there are
+    // no background rois
+    if (fg && rank < fg_this) {
+      image_keep[rank] = c;
+      if (bg_this == 0) {
+        for (int i = fg_this + rank; i < rois_per_image; i += fg_this)
+          image_keep[i] = c;
+      }
+    } else if (!fg && rank < bg_this) {
+      image_keep[fg_this + rank] = c;
+      for (int i = fg_this + bg_this + rank; i < rois_per_image; i += bg_this)
+        image_keep[i] = c;
+    }
+  }
+}
+
+// Writes rois, labels and the class specific bbox targets and weights of
+// the output rows
+__global__ void WriteTargetsKernel(const float* rois,
+                                   const float* gt_boxes,
+                                   int rois_count,
+                                   int gt_count,
+                                   const int* keep,
+                                   const int* assignment,
+                                   const int* fg_counts,
+                                   int batch_rois,
+                                   int rois_per_image,
+                                   int num_classes,
+                                   BoxStds box_stds,
+                                   float* out_rois,
+                                   float* labels,
+                                   float* bbox_targets,
+                                   float* bbox_weights) {
+  for (int r = blockIdx.x * blockDim.x + threadIdx.x; r < batch_rois;
+       r += blockDim.x * gridDim.x) {
+    const int image = r / rois_per_image;
+    const int slot = r % rois_per_image;
+    auto targets = bbox_targets + r * num_classes * 4;
+    auto weights = bbox_weights + r * num_classes * 4;
+    for (int i = 0; i < num_classes * 4; ++i) {
+      targets[i] = 0;
+      weights[i] = 0;
+    }
+    out_rois[r * 5] = image;
+    labels[r] = 0;
+    const int c = keep[r];
+    if (c < 0) {
+      for (int i = 1; i < 5; ++i)
+        out_rois[r * 5 + i] = 0;
+      continue;
+    }
+    int candidate_image = 0;
+    auto box = CandidateBox(rois, gt_boxes, rois_count, gt_count, c,
+                            &candidate_image);
+    for (int i = 0; i < 4; ++i)
+      out_rois[r * 5 + 1 + i] = box[i];
+    if (slot >= fg_counts[image])
+      continue;
+
+    // set labels and targets of fg rois
+    auto gt_box = gt_boxes + (image * gt_count + assignment[c]) * 5;
+    auto cls = static_cast<int>(gt_box[4]);
+    labels[r] = gt_box[4];
+    auto ex_width = box[2] - box[0] + 1;
+    auto ex_height = box[3] - box[1] + 1;
+    auto ex_ctr_x = box[0] + 0.5f * (ex_width - 1);
+    auto ex_ctr_y = box[1] + 0.5f * (ex_height - 1);
+    auto gt_width = gt_box[2] - gt_box[0] + 1;
+    auto gt_height = gt_box[3] - gt_box[1] + 1;
+    auto gt_ctr_x = gt_box[0] + 0.5f * (gt_width - 1);
+    auto gt_ctr_y = gt_box[1] + 0.5f * (gt_height - 1);
+    auto cls_targets = targets + cls * 4;
+    cls_targets[0] =
+        (gt_ctr_x - ex_ctr_x) / (ex_width + 1e-14f) / box_stds.values[0];
+    cls_targets[1] =
+        (gt_ctr_y - ex_ctr_y) / (ex_height + 1e-14f) / box_stds.values[1];
+    cls_targets[2] = logf(gt_width / ex_width) / box_stds.values[2];
+    cls_targets[3] = logf(gt_height / ex_height) / box_stds.values[3];
+    for (int i = 0; i < 4; ++i)
+      weights[cls * 4 + i] = 1;
+  }
+}
+}  // namespace
+
+template <>
+void ProposalTargetOp<gpu>::Forward(const OpContext& ctx,
+                                    const std::vector<TBlob>& in_data,
+                                    const std::vector<OpReqType>& req,
+                                    const std::vector<TBlob>& out_data,
+                                    const std::vector<TBlob>& /*aux_states*/) {
+  using namespace mshadow;
+  CHECK_EQ(param_.batch_images, in_data[1].shape_[0]);
+  CHECK_EQ(param_.box_stds.ndim(), 4U);
+  for (auto r : req) {
+    CHECK_EQ(kWriteTo, r);
+  }
+  Stream<gpu>* s = ctx.get_stream<gpu>();
+  cudaStream_t stream = Stream<gpu>::GetStream(s);
+
+  // rois [n, 5] (batch_index, x1, y1, x2, y2)
+  Tensor<gpu, 2> all_rois = in_data[0].get<gpu, 2, real_t>(s);
+  // gt_boxes [b, n, 5] (x1, y1, x2, y2, cls)
+  Tensor<gpu, 3> all_gt_boxes = in_data[1].get<gpu, 3, real_t>(s);
+
+  auto rois_shape = Shape2(static_cast<index_t>(param_.batch_rois), 5);
+  auto label_shape = Shape1(static_cast<index_t>(param_.batch_rois));
+  auto bbox_target_shape =
+      Shape2(static_cast<index_t>(param_.batch_rois),
+             static_cast<index_t>(param_.num_classes * 4));
+  Tensor<gpu, 2> out_rois =
+      out_data[0].get_with_shape<gpu, 2, real_t>(rois_shape, s);
+  Tensor<gpu, 1> labels =
+      out_data[1].get_with_shape<gpu, 1, real_t>(label_shape, s);
+  Tensor<gpu, 2> bbox_targets =
+      out_data[2].get_with_shape<gpu, 2, real_t>(bbox_target_shape, s);
+  Tensor<gpu, 2> bbox_weights =
+      out_data[3].get_with_shape<gpu, 2, real_t>(bbox_target_shape, s);
+
+  const int rois_count = static_cast<int>(all_rois.shape_[0]);
+  const int gt_count = static_cast<int>(all_gt_boxes.shape_[1]);
+  const int candidates_count = rois_count + param_.batch_images * gt_count;
+  auto rois_per_image = param_.batch_rois / param_.batch_images;
+  auto fg_rois_per_image =
+      static_cast<int>(std::round(param_.fg_fraction * rois_per_image));
+  BoxStds box_stds;
+  std::copy(param_.box_stds.begin(), param_.box_stds.end(), box_stds.values);
+
+  // Workspace of 4 byte values: max overlaps, assignment, images and keys of
+  // the candidates, kept candidates of the rows and fg counts of the images
+  auto workspace_size = static_cast<index_t>(
+      4 * candidates_count + param_.batch_rois + param_.batch_images);
+  Tensor<gpu, 1, real_t> workspace =
+      ctx.requested[0].get_space_typed<gpu, 1, real_t>(Shape1(workspace_size),
+                                                       s);
+  float* max_overlaps = workspace.dptr_;
+  int* assignment = reinterpret_cast<int*>(max_overlaps + candidates_count);
+  int* images = assignment + candidates_count;
+  uint32_t* keys = reinterpret_cast<uint32_t*>(images + candidates_count);
+  int* keep = reinterpret_cast<int*>(keys + candidates_count);
+  int* fg_counts = keep + param_.batch_rois;
+
+  MatchCandidatesKernel<<<BlocksFor(candidates_count), kThreadsPerBlock, 0,
+                          stream>>>(
+      all_rois.dptr_, all_gt_boxes.dptr_, rois_count, param_.batch_images,
+      gt_count, forward_calls_++, max_overlaps, assignment, images, keys);
+  CheckLaunch("MatchCandidatesKernel");
+
+  SelectRoisKernel<<<param_.batch_images, kThreadsPerBlock, 0, stream>>>(
+      images, max_overlaps, keys, candidates_count, param_.fg_overlap,
+      rois_per_image, fg_rois_per_image, keep, fg_counts);
+  CheckLaunch("SelectRoisKernel");
+
+  WriteTargetsKernel<<<BlocksFor(param_.batch_rois), kThreadsPerBlock, 0,
+                       stream>>>(
+      all_rois.dptr_, all_gt_boxes.dptr_, rois_count, gt_count, keep,
+      assignment, fg_counts, param_.batch_rois, rois_per_image,
+      param_.num_classes, box_stds, out_rois.dptr_, labels.dptr_,
+      bbox_targets.dptr_, bbox_weights.dptr_);
+  CheckLaunch("WriteTargetsKernel");
+}
 
 template <>
 Operator* CreateOp<gpu>(ProposalTargetParam param) {
@@ -2,10 +2,12 @@
 #define PROPOSALTARGET_OP_HPP
 
 #include "bbox.h"
+#include "../threadpool.h"
 #include "proposaltarget_op.h"
 
 #include <Eigen/Dense>
-#include <tuple>
+#include <algorithm>
+#include <random>
 
 namespace mxnet {
 namespace op {
@@ -43,114 +45,89 @@ class ProposalTargetOp : public Operator {
                static_cast<index_t>(param_.num_classes * 4));
 
     // ---------------- Main logic - cpu version ----------------------------
+    // (the gpu version is in proposaltarget_op.cu)
     auto rois_per_image = param_.batch_rois / param_.batch_images;
     auto fg_rois_per_image =
         static_cast<int>(std::round(param_.fg_fraction * rois_per_image));
     std::vector<float> box_stds;
     box_stds.assign(param_.box_stds.begin(), param_.box_stds.end());
 
-    using EigenMatrix =
-        Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
-    EigenMatrix rois(rois_shape[0], rois_shape[1]);
-    EigenMatrix labels(label_shape[0], 1);
-    EigenMatrix bbox_targets(bbox_target_shape[0], bbox_target_shape[1]);
-    EigenMatrix bbox_weights(bbox_weight_shape[0], bbox_weight_shape[1]);
-
-    EigenMatrix all_rois(all_rois_x.shape_[0], all_rois_x.shape_[1]);
-    Tensor<cpu, 2, real_t> all_rois_t(all_rois.data(), all_rois_x.shape_);
-    Copy(all_rois_t, all_rois_x, s);
+    for (auto r : req) {
+      CHECK_EQ(kWriteTo, r);
+    }
 
-    EigenMatrix batch_gt_boxes(all_gt_boxes_x.shape_[1],
-                               all_gt_boxes_x.shape_[2]);
-    for (int batch_idx = 0; batch_idx < param_.batch_images; ++batch_idx) {
+    // cpu tensors, the samples of the images are written into the outputs
+    ConstRowMatrixMap all_rois(all_rois_x.dptr_, all_rois_x.shape_[0],
+                               all_rois_x.shape_[1]);
+    const auto gt_rows = static_cast<Eigen::Index>(all_gt_boxes_x.shape_[1]);
+    const auto gt_cols = static_cast<Eigen::Index>(all_gt_boxes_x.shape_[2]);
+    RowMatrixMap rois(
+        out_data[0].get_with_shape<xpu, 2, real_t>(rois_shape, s).dptr_,
+        rois_shape[0], rois_shape[1]);
+    RowMatrixMap labels(
+        out_data[1].get_with_shape<xpu, 1, real_t>(label_shape, s).dptr_,
+        label_shape[0], 1);
+    RowMatrixMap bbox_targets(
+        out_data[2].get_with_shape<xpu, 2, real_t>(bbox_target_shape, s).dptr_,
+        bbox_target_shape[0], bbox_target_shape[1]);
+    RowMatrixMap bbox_weights(
+        out_data[3].get_with_shape<xpu, 2, real_t>(bbox_weight_shape, s).dptr_,
+        bbox_weight_shape[0], bbox_weight_shape[1]);
+
+    const auto call = forward_calls_++;
+    auto sample_image = [&](size_t image) {
+      const auto batch_idx = static_cast<int>(image);
       //----------------------------------------------
-      // select gt boxes related to the current batch element
-      Tensor<cpu, 2, real_t> all_gt_boxes_t(
-          batch_gt_boxes.data(),
-          Shape2(all_gt_boxes_x.shape_[1], all_gt_boxes_x.shape_[2]));
-      Copy(all_gt_boxes_t, all_gt_boxes_x[static_cast<index_t>(batch_idx)], s);
-
-      // select gt boxes with foreground class
+      // select gt boxes with foreground class of the current batch element
+      ConstRowMatrixMap batch_gt_boxes(
+          all_gt_boxes_x.dptr_ + image * static_cast<size_t>(gt_rows * gt_cols),
+          gt_rows, gt_cols);
       auto gt_boxes_count = (batch_gt_boxes.col(4).array() > 0).count();
-      Eigen::MatrixXf gt_boxes(gt_boxes_count, all_gt_boxes_x.shape_[2]);
-      for (Eigen::Index i = 0, j = 0; i < batch_gt_boxes.rows();
-           ++i) {  // col major
+      Eigen::MatrixXf gt_boxes(gt_boxes_count, gt_cols);
+      for (Eigen::Index i = 0, j = 0; i < batch_gt_boxes.rows(); ++i) {
         if (batch_gt_boxes(i, 4) > 0)
           gt_boxes.row(j++) = batch_gt_boxes.row(i);
       }
       //----------------------------------------------
       // select rois related to the current batch element, images have different
-      // size so rois count can also be different
+      // size so rois count can also be different, and include ground-truth
+      // boxes in the set of candidate rois
       auto batch_rois_count =
           (all_rois.col(0).array() == static_cast<float>(batch_idx)).count();
-
-      Eigen::MatrixXf batch_rois(
-          batch_rois_count,
-          all_rois.cols() - 1);  // exclude batch index col
-      for (Eigen::Index i = 0, j = 0; i < all_rois.rows(); ++i) {  // col major
+      Eigen::MatrixXf batch_rois(batch_rois_count + gt_boxes_count,
+                                 all_rois.cols() - 1);
+      Eigen::Index j = 0;
+      for (Eigen::Index i = 0; i < all_rois.rows(); ++i) {
         if (static_cast<int>(all_rois(i, 0)) == batch_idx)
           batch_rois.row(j++) = all_rois.row(i).rightCols(4);
       }
-
-      //----------------------------------------------
-      // Include ground-truth boxes in the set of candidate rois
-      {
-        Eigen::MatrixXf rois_and_gt(batch_rois.rows() + gt_boxes.rows(),
-                                    rois.cols() - 1);
-        rois_and_gt << batch_rois,
-            gt_boxes.block(0, 0, gt_boxes.rows(), gt_boxes.cols() - 1);
-        batch_rois = rois_and_gt;
-      }
+      batch_rois.bottomRows(gt_boxes_count) = gt_boxes.leftCols(4);
 
       //----------------------------------------------
       // mark rois for this batch
-      rois.block(batch_idx * rois_per_image, 0, rois_per_image, 1).array() =
-          batch_idx;
+      auto first = batch_idx * rois_per_image;
+      rois.block(first, 0, rois_per_image, 1).setConstant(
+          static_cast<float>(batch_idx));
 
       //----------------------------------------------
       // generate random sample of ROIs comprising foreground and background
-      // examples
-      auto b_rois = rois.block(batch_idx * rois_per_image, 1, rois_per_image,
-                               rois.cols() - 1);
-      auto b_labels = labels.block(batch_idx * rois_per_image, 0,
-                                   rois_per_image, labels.cols());
-      auto b_bbox_targets = bbox_targets.block(
-          batch_idx * rois_per_image, 0, rois_per_image, bbox_targets.cols());
-      auto b_bbox_weights = bbox_weights.block(
-          batch_idx * rois_per_image, 0, rois_per_image, bbox_weights.cols());
-      std::tie(b_rois, b_labels, b_bbox_targets, b_bbox_weights) =
-          SampleRois(batch_rois, gt_boxes, param_.num_classes, rois_per_image,
-                     fg_rois_per_image, param_.fg_overlap, box_stds);
-    }
-
-    Tensor<cpu, 2, real_t> rois_t(rois.data(), rois_shape);
-    Tensor<cpu, 1, real_t> labels_t(labels.data(), label_shape);
-    Tensor<cpu, 2, real_t> bbox_targets_t(bbox_targets.data(),
-                                          bbox_target_shape);
-    Tensor<cpu, 2, real_t> bbox_weights_t(bbox_weights.data(),
-                                          bbox_weight_shape);
-
+      // examples, the stream of an image doesn't depend on the threads
+      std::seed_seq seed{kSampleRoisSeed, call, static_cast<uint32_t>(image)};
+      std::mt19937 mt(seed);
+      SampleRois(batch_rois, gt_boxes, param_.num_classes, rois_per_image,
+                 fg_rois_per_image, param_.fg_overlap, box_stds, mt,
+                 rois.block(first, 1, rois_per_image, rois.cols() - 1),
+                 labels.block(first, 0, rois_per_image, 1),
+                 bbox_targets.block(first, 0, rois_per_image,
+                                    bbox_targets.cols()),
+                 bbox_weights.block(first, 0, rois_per_image,
+                                    bbox_weights.cols()));
+    };
+
+    // images are sampled in parallel, the engine thread takes one of them
+    utils::ParallelFor(0, static_cast<size_t>(param_.batch_images),
+                       sample_image);
     // ---------------- Main logic end --------------------------
-
-    // get destination tensors
-    Tensor<xpu, 2> out0 =
-        out_data[0].get_with_shape<xpu, 2, real_t>(rois_shape, s);
-    Tensor<xpu, 1> out1 =
-        out_data[1].get_with_shape<xpu, 1, real_t>(label_shape, s);
-    Tensor<xpu, 2> out2 =
-        out_data[2].get_with_shape<xpu, 2, real_t>(bbox_target_shape, s);
-    Tensor<xpu, 2> out3 =
-        out_data[3].get_with_shape<xpu, 2, real_t>(bbox_weight_shape, s);
-
-    // copy results
-    for (auto r : req) {
-      CHECK_EQ(kWriteTo, r);
-    }
-
-    Copy(out0, rois_t, s);
-    Copy(out1, labels_t, s);
-    Copy(out2, bbox_targets_t, s);
-    Copy(out3, bbox_weights_t, s);
   }
 
   void Backward(const OpContext& ctx,
@@ -175,6 +152,8 @@ class ProposalTargetOp : public Operator {
 
  private:
   ProposalTargetParam param_;
+  // Forward calls, both versions take new random samples every call
+  uint32_t forward_calls_{0};
 };  // class ProposalOp
 
 }  // namespace op
@@ -13,6 +13,126 @@
 static const mxnet::cpp::index_t undefined =
     static_cast<mxnet::cpp::index_t>(-1);
 
+namespace {
+using mxnet::cpp::Operator;
+using mxnet::cpp::Symbol;
+
+// resnet 101
+const std::vector<uint32_t> kResnetUnits{3, 4, 23, 3};
+const std::vector<uint32_t> kResnetFilters{256, 512, 1024, 2048};
+
+Symbol SliceAxis(Symbol data, int axis, int begin, int end) {
+  return Operator("slice_axis")
+      .SetParam("axis", axis)
+      .SetParam("begin", begin)
+      .SetParam("end", end)
+      .SetInput("data", data)
+      .CreateSymbol();
+}
+
+Symbol Broadcast(const std::string& op, Symbol lhs, Symbol rhs) {
+  return Operator("broadcast_" + op)(lhs, rhs).CreateSymbol();
+}
+
+Symbol CastTo(Symbol data, const char* dtype) {
+  return Operator("Cast")
+      .SetParam("dtype", dtype)
+      .SetInput("data", data)
+      .CreateSymbol();
+}
+
+Symbol Scalar(const std::string& op, Symbol data, float scalar) {
+  return Operator("_" + op + "_scalar")
+      .SetParam("scalar", scalar)
+      .SetInput("data", data)
+      .CreateSymbol();
+}
+
+/*
+ * Decodes the boxes of all classes but the background on the device, the
+ * same as bbox_pred, clip_boxes and DecodePredictions do on the host, and
+ * suppresses them with one class aware box_nms.
+ * return: [batch, rcnn_max_detections, 6] class id, score, x1, y1, x2, y2
+ * sorted by score, rows after the last detection are -1
+ */
+Symbol GetDetectionSymbol(Symbol rois,
+                          Symbol cls_prob,
+                          Symbol bbox_pred,
+                          Symbol im_info,
+                          const Params& params) {
+  using mxnet::cpp::Shape;
+  using mxnet::cpp::index_t;
+  auto batch = static_cast<index_t>(params.rcnn_batch_size);
+  auto classes = params.rcnn_num_classes;
+  const auto& stds = params.rcnn_bbox_stds;
+
+  // [batch, rois, 1, 1] for every coordinate
+  auto boxes = Reshape(SliceAxis(rois, 1, 1, 5), Shape(batch, undefined, 1, 4));
+  auto x1 = SliceAxis(boxes, 3, 0, 1);
+  auto y1 = SliceAxis(boxes, 3, 1, 2);
+  auto widths = Scalar("plus", SliceAxis(boxes, 3, 2, 3) - x1, 1);
+  auto heights = Scalar("plus", SliceAxis(boxes, 3, 3, 4) - y1, 1);
+  auto ctr_x = x1 + Scalar("mul", Scalar("minus", widths, 1), 0.5f);
+  auto ctr_y = y1 + Scalar("mul", Scalar("minus", heights, 1), 0.5f);
+
+  // [batch, rois, classes - 1, 1] without the background
+  auto deltas = SliceAxis(
+      Reshape(bbox_pred, Shape(batch, undefined, static_cast<index_t>(classes),
+                               4)),
+      2, 1, classes);
+  auto delta = [&](int i) {
+    return Scalar("mul", SliceAxis(deltas, 3, i, i + 1), stds[i]);
+  };
+  auto pred_ctr_x = Broadcast("add", Broadcast("mul", delta(0), widths), ctr_x);
+  auto pred_ctr_y =
+      Broadcast("add", Broadcast("mul", delta(1), heights), ctr_y);
+  auto pred_w = Broadcast("mul", exp(delta(2)), widths);
+  auto pred_h = Broadcast("mul", exp(delta(3)), heights);
+
+  // clipped to the image and scaled back to the original image size
+  auto info = Reshape(im_info, Shape(batch, 1, 1, 3));
+  auto max_y = Scalar("minus", SliceAxis(info, 3, 0, 1), 1);
+  auto max_x = Scalar("minus", SliceAxis(info, 3, 1, 2), 1);
+  auto scale = SliceAxis(info, 3, 2, 3);
+  auto coord = [&](Symbol ctr, Symbol size, Symbol max, float sign) {
+    auto v = ctr + Scalar("mul", Scalar("minus", size, 1), 0.5f * sign);
+    v = Scalar("maximum", Broadcast("minimum", v, max), 0);
+    return Broadcast("div", v, scale);
+  };
+
+  auto scores = SliceAxis(
+      Reshape(cls_prob,
+              Shape(batch, undefined, static_cast<index_t>(classes), 1)),
+      2, 1, classes);
+  auto ids = Reshape(Operator("_arange")
+                         .SetParam("start", 1)
+                         .SetParam("stop", classes)
+                         .CreateSymbol(),
+                     Shape(1, 1, static_cast<index_t>(classes - 1), 1));
+  ids = Broadcast("add", zeros_like(scores), ids);
+
+  auto records = Concat({ids, scores, coord(pred_ctr_x, pred_w, max_x, -1),
+                         coord(pred_ctr_y, pred_h, max_y, -1),
+                         coord(pred_ctr_x, pred_w, max_x, 1),
+                         coord(pred_ctr_y, pred_h, max_y, 1)},
+                        6, 3);
+  records = Reshape(records, Shape(batch, undefined, 6));
+
+  auto nms = Operator("_contrib_box_nms")
+                 .SetParam("overlap_thresh", params.rpn_nms_thresh)
+                 .SetParam("valid_thresh", params.rcnn_conf_thresh)
+                 .SetParam("topk", -1)
+                 .SetParam("coord_start", 2)
+                 .SetParam("score_index", 1)
+                 .SetParam("id_index", 0)
+                 .SetParam("force_suppress", false)
+                 .SetInput("data", records)
+                 .CreateSymbol();
+  // box_nms moves the detections left to the head
+  return SliceAxis(nms, 1, 0, static_cast<int>(params.rcnn_max_detections));
+}
+}  // namespace
+
 mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
   using namespace mxnet::cpp;
   float num_anchors =
@@ -27,12 +147,23 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
 
   std::vector<Symbol> out_group;
 
-  // resnet 101
-  std::vector<uint32_t> units{3, 4, 23, 3};
-  std::vector<uint32_t> filter_list{256, 512, 1024, 2048};
+  // With mixed precision the convolutions and fully connected layers run in
+  // float16, proposals, roi pooling and losses take float32 inputs. Loss
+  // gradients are scaled up, so small float16 gradients don't underflow.
+  const bool fp16 = params.mixed_precision;
+  auto to_fp32 = [fp16](Symbol sym) {
+    return fp16 ? CastTo(sym, "float32") : sym;
+  };
+  auto to_fp16 = [fp16](Symbol sym) {
+    return fp16 ? CastTo(sym, "float16") : sym;
+  };
+  const float loss_scale = fp16 ? params.mixed_precision_loss_scale : 1.f;
+
+  const bool fold_batch_norm = !train && params.rcnn_fold_batch_norm;
 
   // shared convolutional layers
-  Symbol conv_feat = GetResnetHeadSymbol(data, units, filter_list);
+  Symbol conv_feat = GetResnetHeadSymbol(to_fp16(data), kResnetUnits,
+                                         kResnetFilters, fold_batch_norm);
 
   // rpn feature
   auto rpn_conv = Operator("Convolution")
@@ -59,6 +190,7 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
           .SetInput("bias", Symbol("rpn_cls_score_bias"))
           .SetInput("data", rpn_relu)
           .CreateSymbol("rpn_cls_score");
+  rpn_cls_score = to_fp32(rpn_cls_score);
 
   auto rpn_cls_score_reshape = Operator("Reshape")
                                    .SetParam("shape", Shape(0, 2, undefined, 0))
@@ -70,6 +202,7 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
                             .SetParam("multi_output", true)
                             .SetParam("use_ignore", true)
                             .SetParam("normalization", "valid")
+                            .SetParam("grad_scale", loss_scale)
                             .SetInput("data", rpn_cls_score_reshape)
                             .SetInput("label", rpn_label)
                             .CreateSymbol("rpn_cls_prob");
@@ -98,6 +231,7 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
           .SetInput("weight", Symbol("rpn_bbox_pred_weight"))
           .SetInput("bias", Symbol("rpn_bbox_pred_bias"))
           .CreateSymbol("rpn_bbox_pred");
+  rpn_bbox_pred = to_fp32(rpn_bbox_pred);
 
   if (train) {
     Symbol rpn_bbox_diff = rpn_bbox_pred - rpn_bbox_target;
@@ -105,7 +239,8 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
         rpn_bbox_weight * smooth_l1("rpn_bbox_loss_", rpn_bbox_diff, 3.f);
 
     auto rpn_bbox_loss =
-        MakeLoss("rpn_bbox_loss", rpn_bbox_loss_, 1.f / params.rpn_batch_rois);
+        MakeLoss("rpn_bbox_loss", rpn_bbox_loss_,
+                 loss_scale / params.rpn_batch_rois);
     out_group.push_back((rpn_bbox_loss));
   }
 
@@ -158,12 +293,13 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
                           static_cast<index_t>(params.rcnn_pooled_size[1])))
           .SetParam("spatial_scale", 1.0f / params.rcnn_feat_stride)
           .SetInput("rois", rois)
-          .SetInput("data", conv_feat)
+          .SetInput("data", to_fp32(conv_feat))
           .CreateSymbol("roi_pool");
 
   // rcnn top feature
   mxnet::cpp::Symbol top_feat =
-      GetResnetTopSymbol(roi_pool, units, filter_list);
+      GetResnetTopSymbol(to_fp16(roi_pool), kResnetUnits, kResnetFilters,
+                         fold_batch_norm);
 
   // rcnn classification
   auto cls_score = Operator("FullyConnected")
@@ -174,11 +310,13 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
                        .SetInput("bias", Symbol("cls_score_bias"))
                        .SetInput("data", Flatten(top_feat))
                        .CreateSymbol("cls_score");
+  cls_score = to_fp32(cls_score);
 
   Symbol cls_prob;
   if (train) {
     cls_prob = Operator("SoftmaxOutput")
                    .SetParam("normalization", "batch")
+                   .SetParam("grad_scale", loss_scale)
                    .SetInput("label", label)
                    .SetInput("data", cls_score)
                    .CreateSymbol("cls_prob");
@@ -195,6 +333,7 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
                        .SetInput("bias", Symbol("bbox_pred_bias"))
                        .SetInput("data", top_feat)
                        .CreateSymbol("bbox_pred");
+  bbox_pred = to_fp32(bbox_pred);
 
   Symbol bbox_loss;
   if (train) {
@@ -204,7 +343,7 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
                           .SetInput("data", (bbox_pred - bbox_target))
                           .CreateSymbol("bbox_loss_");
     bbox_loss =
-        MakeLoss("bbox_loss", bbox_loss_, 1.0f / params.rcnn_batch_rois);
+        MakeLoss("bbox_loss", bbox_loss_, loss_scale / params.rcnn_batch_rois);
 
     bbox_loss =
         Reshape("bbox_loss_reshape", bbox_loss,
@@ -237,6 +376,9 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
                       static_cast<index_t>(4 * params.rcnn_num_classes)));
 
     out_group.push_back(bbox_pred);
+    if (params.rcnn_gpu_decode)
+      out_group.push_back(BlockGrad(GetDetectionSymbol(
+          rois, cls_prob, bbox_pred, im_info, params)));
   }
 
   // group output
@@ -244,6 +386,11 @@ mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train) {
   return res_group;
 }
 
+void FoldRCNNBatchNorms(std::map<std::string, mxnet::cpp::NDArray>& args_map,
+                        std::map<std::string, mxnet::cpp::NDArray>& aux_map) {
+  FoldResnetBatchNorms(kResnetUnits, args_map, aux_map);
+}
+
 void InitiaizeRCNN(std::map<std::string, mxnet::cpp::NDArray>& args_map) {
   mxnet::cpp::Normal normal(0, 0.01f);
   mxnet::cpp::Zero zero;
@@ -7,6 +7,11 @@
 
 mxnet::cpp::Symbol GetRCNNSymbol(const Params& params, bool train);
 
+// Converts the parameters of the training net to the inference net with
+// Params::rcnn_fold_batch_norm
+void FoldRCNNBatchNorms(std::map<std::string, mxnet::cpp::NDArray>& args_map,
+                        std::map<std::string, mxnet::cpp::NDArray>& aux_map);
+
 void InitiaizeRCNN(std::map<std::string, mxnet::cpp::NDArray>& args_map);
 
 #endif  // RCNN_H
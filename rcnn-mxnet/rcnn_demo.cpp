@@ -3,14 +3,21 @@
 
 #include "bbox.h"
 #include "coco.h"
+#include "detector.h"
 #include "imageutils.h"
 #include "mxutils.h"
 #include "params.h"
 #include "rcnn.h"
+#include "../perfstats.h"
 
+#include <chrono>
+#include <cstdint>
+#include <exception>
 #include <experimental/filesystem>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 namespace fs = std::experimental::filesystem;
 
@@ -19,7 +26,100 @@ static mxnet::cpp::Context global_ctx = mxnet::cpp::Context::gpu();
 const cv::String keys =
     "{help h usage ? |      | print this message   }"
     "{@params        |<none>| path to trained parameters }"
-    "{@image         |<none>| path to image }";
+    "{@image         |      | path to image }"
+    "{s serve        |      | detect images with paths read from stdin }"
+    "{bench          |      | JSON lines file, times the detection of the "
+    "image }";
+
+static void PrintDetections(const std::vector<Detection>& det) {
+  auto& classes = Coco::GetClasses();
+  for (auto& d : det) {
+    std::cout << classes[static_cast<size_t>(d.class_id)] << " - "
+              << std::to_string(d.score) << " " << d.x1 << " " << d.y1 << " "
+              << d.x2 << " " << d.y2 << std::endl;
+  }
+}
+
+// The executor is bound once, images are detected while next paths are read
+static void Serve(const std::string& params_path) {
+  Params params(true);
+  Detector detector(params_path, global_ctx, params);
+  std::exception_ptr error;
+  std::thread printer([&detector, &error]() {
+    try {
+      Detector::Result result;
+      while (detector.Next(result)) {
+        std::cout << result.name << " : " << result.detections.size()
+                  << std::endl;
+        PrintDetections(result.detections);
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+  try {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      if (!line.empty())
+        detector.Push(line);
+    }
+  } catch (...) {
+    // the printer rethrows the error of the pipeline
+  }
+  detector.Close();
+  printer.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// Images per second of the detections of the image pushed again and again,
+// the first images bind the memory of the pipeline and aren't timed
+static void Bench(const std::string& params_path,
+                  const std::string& image_path,
+                  const std::string& bench_file) {
+  const uint32_t warmup_images = 4;
+  const uint32_t bench_images = 64;
+  Params params(true);
+  Detector detector(params_path, global_ctx, params);
+  std::thread pusher([&detector, &image_path]() {
+    try {
+      for (uint32_t i = 0; i < warmup_images + bench_images; ++i)
+        detector.Push(image_path);
+    } catch (...) {
+      // Next rethrows the error of the pipeline
+    }
+    detector.Close();
+  });
+  std::exception_ptr error;
+  uint32_t images = 0;
+  uint64_t allocations = 0;
+  auto start = std::chrono::steady_clock::now();
+  try {
+    Detector::Result result;
+    while (detector.Next(result)) {
+      if (++images == warmup_images) {
+        allocations = utils::AllocationCount();
+        start = std::chrono::steady_clock::now();
+      }
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  allocations = utils::AllocationCount() - allocations;
+  pusher.join();
+  if (error)
+    std::rethrow_exception(error);
+  if (images <= warmup_images)
+    throw std::runtime_error("No timed detections");
+
+  const auto timed = static_cast<double>(images - warmup_images);
+  utils::PerfReport("rcnn-mxnet", bench_file)
+      .Write("detect", {{"ms", elapsed.count() / timed},
+                        {"images_per_s", timed / elapsed.count() * 1000},
+                        {"allocations", allocations / timed}});
+}
 
 int main(int argc, char** argv) {
   using namespace mxnet::cpp;
@@ -35,7 +135,7 @@ int main(int argc, char** argv) {
   std::string image_path = parser.get<cv::String>(1);
 
   // Chech parsing errors
-  if (!parser.check()) {
+  if (!parser.check() || (image_path.empty() && !parser.has("serve"))) {
     parser.printErrors();
     parser.printMessage();
     return 1;
@@ -43,110 +143,36 @@ int main(int argc, char** argv) {
 
   try {
     params_path = fs::canonical(fs::absolute(params_path));
+    if (parser.has("bench")) {
+      image_path = fs::canonical(fs::absolute(image_path));
+      Bench(params_path, image_path, parser.get<cv::String>("bench"));
+      MXNotifyShutdown();
+      return 0;
+    }
+    if (parser.has("serve")) {
+      std::cout << "Path to the net parameters : " << params_path << std::endl;
+      Serve(params_path);
+      MXNotifyShutdown();
+      return 0;
+    }
     image_path = fs::canonical(fs::absolute(image_path));
     if (fs::exists(image_path)) {
       std::cout << "Path to the net parameters : " << params_path << std::endl;
       std::cout << "Path to the image : " << image_path << std::endl;
 
-      //----------- Make net
       Params params(true);
-      auto net = GetRCNNSymbol(params, false);
-
-      //----------- Load data
-      cv::Mat img;
-      float scale{1};
-      std::tie(img, scale) = LoadImageFitSize(image_path, params.img_short_side,
-                                              params.img_long_side);
-
-      if (img.empty()) {
-        std::cout << "Failed to load image" << std::endl;
-        return 1;
-      }
-      mxnet::cpp::NDArray data(
-          mxnet::cpp::Shape(1, 3, static_cast<mxnet::cpp::index_t>(img.rows),
-                            static_cast<mxnet::cpp::index_t>(img.cols)),
-          global_ctx, false);
-      auto array = CVToMxnetFormat(img);
-      data.SyncCopyFromCPU(array.data(), array.size());
-
-      mxnet::cpp::NDArray im_info(mxnet::cpp::Shape(1, 3), global_ctx, false);
-      std::vector<float> raw_im_info = {static_cast<float>(img.rows),
-                                        static_cast<float>(img.cols), scale};
-      im_info.SyncCopyFromCPU(raw_im_info.data(), raw_im_info.size());
-      NDArray::WaitAll();
-      CheckMXnetError("Load data");
-
-      //----------- Load params
-      std::map<std::string, mxnet::cpp::NDArray> args_map;
-      std::map<std::string, mxnet::cpp::NDArray> aux_map;
-      std::tie(args_map, aux_map) = LoadNetParams(global_ctx, params_path);
-      args_map["data"] = data;
-      args_map["im_info"] = im_info;
-
-      NDArray::WaitAll();
-      CheckMXnetError("Load parameters from file");
-
-      //----------- Check Shapes - shouldn't fail
-      std::vector<std::string> args = net.ListArguments();
-      std::vector<std::string> outs = net.ListOutputs();
-      std::vector<std::string> auxs = net.ListAuxiliaryStates();
-      std::map<std::string, std::vector<mx_uint>> arg_shapes;
-      for (const auto& arg_name : args) {
-        auto iter = args_map.find(arg_name);
-        if (iter != args_map.end()) {
-          arg_shapes[arg_name] = iter->second.GetShape();
-        } else {
-          std::cout << "Configurable or missed argument : " << arg_name
-                    << std::endl;
-        }
-      }
-
-      for (const auto& arg_name : auxs) {
-        auto iter = aux_map.find(arg_name);
-        if (iter == aux_map.end()) {
-          std::cout << "Missed auxiliary state : " << arg_name << std::endl;
-        }
-      }
-
-      std::vector<std::vector<mx_uint>> in_shape;
-      std::vector<std::vector<mx_uint>> aux_shape;
-      std::vector<std::vector<mx_uint>> out_shape;
-      net.InferShape(arg_shapes, &in_shape, &aux_shape, &out_shape);
-
-      //----------- Predict
-      mxnet::cpp::Executor* executor = net.SimpleBind(
-          global_ctx, args_map, std::map<std::string, mxnet::cpp::NDArray>(),
-          std::map<std::string, mxnet::cpp::OpReqType>(), aux_map);
-      CheckMXnetError("bind");
-
-      executor->Forward(false);
-      NDArray::WaitAll();
-      CheckMXnetError("forward");
-
-      auto rois = executor->outputs[0].Copy(Context::cpu());
-      auto scores = executor->outputs[1].Copy(Context::cpu());
-      auto bbox_deltas = executor->outputs[2].Copy(Context::cpu());
-      NDArray::WaitAll();
-      delete executor;
-
-      //--------- Decode result
-      auto det =
-          DecodePredictions(NDArray2ToEigen(rois), NDArray3ToEigen(scores),
-                            NDArray3ToEigen(bbox_deltas),
-                            Eigen::Map<Eigen::MatrixXf>(
-                                raw_im_info.data(), 1,
-                                static_cast<Eigen::Index>(raw_im_info.size())),
-                            params);
+      Detector detector(params_path, global_ctx, params);
+      detector.Push(image_path);
+      detector.Close();
+      Detector::Result result;
+      if (!detector.Next(result))
+        throw std::runtime_error("No detection result");
+      auto& det = result.detections;
 
       //-------- Show result
       std::cout << "Predictions num: " << det.size() << std::endl;
-      auto& classes = Coco::GetClasses();
-      for (auto& d : det) {
-        std::cout << classes[static_cast<size_t>(d.class_id)] << " - "
-                  << std::to_string(d.score) << " " << d.x1 << " " << d.y1
-                  << " " << d.x2 << " " << d.y2 << std::endl;
-      }
-      ShowResult(det, image_path, "det.png", classes);
+      PrintDetections(det);
+      ShowResult(det, image_path, "det.png", Coco::GetClasses());
     }
     MXNotifyShutdown();
   } catch (const dmlc::Error& err) {
@@ -0,0 +1,146 @@
+#include <mxnet-cpp/MxNetCpp.h>
+#include <opencv2/opencv.hpp>
+
+#include "coco.h"
+#include "cocoeval.h"
+#include "detector.h"
+#include "params.h"
+
+#include <chrono>
+#include <exception>
+#include <experimental/filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace fs = std::experimental::filesystem;
+
+static mxnet::cpp::Context global_ctx = mxnet::cpp::Context::gpu();
+
+const cv::String keys =
+    "{help h usage ? |      | print this message   }"
+    "{@coco_path     |<none>| path to coco dataset }"
+    "{@params        |<none>| path to trained parameters }"
+    "{n images       |0     | validation images to evaluate, 0 - all }"
+    "{w workers      |4     | threads decoding the predictions }"
+    "{c classes      |      | comma separated class indices, all by default }";
+
+static std::vector<uint32_t> ParseClasses(const std::string& classes) {
+  std::vector<uint32_t> result;
+  std::stringstream stream(classes);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    result.push_back(static_cast<uint32_t>(std::stoul(item)));
+  return result;
+}
+
+static void PrintMetric(const std::string& name, float value) {
+  std::cout << std::left << std::setw(40) << name << " = " << std::fixed
+            << std::setprecision(3) << value << std::endl;
+}
+
+int main(int argc, char** argv) {
+  cv::CommandLineParser parser(argc, argv, keys);
+  parser.about("Faster R-CNN COCO evaluation");
+
+  if (parser.has("help") || argc == 1) {
+    parser.printMessage();
+    return 0;
+  }
+
+  std::string coco_path = parser.get<cv::String>(0);
+  std::string params_path = parser.get<cv::String>(1);
+  auto images_num = parser.get<uint32_t>("images");
+  auto workers_num = parser.get<uint32_t>("workers");
+  std::string classes;
+  if (parser.has("classes"))
+    classes = parser.get<cv::String>("classes");
+
+  // Chech parsing errors
+  if (!parser.check()) {
+    parser.printErrors();
+    parser.printMessage();
+    return 1;
+  }
+
+  try {
+    coco_path = fs::canonical(fs::absolute(coco_path));
+    params_path = fs::canonical(fs::absolute(params_path));
+    std::cout << "Path to the data set : " << coco_path << std::endl;
+    std::cout << "Path to the net parameters : " << params_path << std::endl;
+
+    Coco coco(coco_path);
+    coco.LoadValData(ParseClasses(classes));
+    if (images_num == 0 || images_num > coco.GetImagesCount())
+      images_num = coco.GetImagesCount();
+    std::cout << "Images count: " << images_num << std::endl;
+
+    Params params(true);
+    Detector detector(params_path, global_ctx, params, workers_num);
+
+    // Results are matched to the ground truth while the next images run
+    CocoEvaluator evaluator;
+    std::exception_ptr error;
+    std::thread collector([&]() {
+      try {
+        Detector::Result result;
+        while (detector.Next(result)) {
+          auto index = static_cast<uint32_t>(result.index);
+          evaluator.AddImage(coco.GetGroundTruth(index), result.detections);
+          if ((index + 1) % 500 == 0)
+            std::cout << "Detected " << index + 1 << " images" << std::endl;
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    try {
+      for (uint32_t i = 0; i < images_num; ++i)
+        detector.Push(coco.GetImagePath(i));
+    } catch (...) {
+      // the collector rethrows the error of the pipeline
+    }
+    detector.Close();
+    collector.join();
+    if (error)
+      std::rethrow_exception(error);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    auto summary = evaluator.Summarize();
+    const std::string ap = "Average Precision  (AP) @[ IoU=";
+    const std::string ar = "Average Recall     (AR) @[ IoU=";
+    PrintMetric(ap + "0.50:0.95 | area=   all ]", summary.ap);
+    PrintMetric(ap + "0.50      | area=   all ]", summary.ap50);
+    PrintMetric(ap + "0.75      | area=   all ]", summary.ap75);
+    PrintMetric(ap + "0.50:0.95 | area= small ]", summary.ap_small);
+    PrintMetric(ap + "0.50:0.95 | area=medium ]", summary.ap_medium);
+    PrintMetric(ap + "0.50:0.95 | area= large ]", summary.ap_large);
+    PrintMetric(ar + "0.50:0.95 | maxDets=  1 ]", summary.ar1);
+    PrintMetric(ar + "0.50:0.95 | maxDets= 10 ]", summary.ar10);
+    PrintMetric(ar + "0.50:0.95 | maxDets=100 ]", summary.ar100);
+    PrintMetric(ar + "0.50:0.95 | area= small ]", summary.ar_small);
+    PrintMetric(ar + "0.50:0.95 | area=medium ]", summary.ar_medium);
+    PrintMetric(ar + "0.50:0.95 | area= large ]", summary.ar_large);
+    std::cout << "Images/s: " << evaluator.GetImagesCount() / elapsed.count()
+              << std::endl;
+    MXNotifyShutdown();
+  } catch (const dmlc::Error& err) {
+    std::cout << "MXNet error occured : \n";
+    auto mx_err_msg = MXGetLastError();
+    if (mx_err_msg)
+      std::cout << mx_err_msg << "\n";
+    else {
+      std::cout << err.what() << std::endl;
+    }
+    return 1;
+  } catch (const std::exception& err) {
+    std::cout << err.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,4 +1,9 @@
+#include "checkpointwriter.h"
+#include "../autotune.h"
+#include "../perfstats.h"
+#include "../trace.h"
 #include "coco.h"
+#include "flatoptimizer.h"
 #include "gputrainiter.h"
 #include "imageutils.h"
 #include "metrics.h"
@@ -7,23 +12,157 @@
 #include "rcnn.h"
 #include "reporter.h"
 
+#include <cuda_runtime_api.h>
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <experimental/filesystem>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
 #include <string>
+#include <thread>
 
 namespace fs = std::experimental::filesystem;
 
 static mxnet::cpp::Context global_ctx(mxnet::cpp::kGPU, 0);
 // static mxnet::cpp::Context global_ctx(mxnet::cpp::kCPU, 0);
 
+namespace {
+// Data parallel replica of the net with its shard of the training data
+struct DeviceTrainer {
+  explicit DeviceTrainer(const mxnet::cpp::Context& ctx) : ctx(ctx) {}
+
+  mxnet::cpp::Context ctx;
+  std::map<std::string, mxnet::cpp::NDArray> args_map;
+  std::map<std::string, mxnet::cpp::NDArray> aux_map;
+  std::map<std::string, mxnet::cpp::NDArray> grad_map;
+  std::unique_ptr<GpuTrainIter> train_iter;
+  std::unique_ptr<FlatOptimizer> optimizer;
+  // inputs and executors of the training buckets, executors share the
+  // parameters, the gradients and the memory of the first one
+  std::vector<std::map<std::string, mxnet::cpp::NDArray>> inputs;
+  std::vector<std::unique_ptr<mxnet::cpp::Executor>> executors;
+  size_t bucket{0};  // of the current batch
+};
+
+std::map<std::string, mxnet::cpp::NDArray> CopyToDevice(
+    const std::map<std::string, mxnet::cpp::NDArray>& arrays,
+    const mxnet::cpp::Context& ctx) {
+  std::map<std::string, mxnet::cpp::NDArray> copies;
+  for (const auto& array : arrays) {
+    mxnet::cpp::NDArray copy(array.second.GetShape(), ctx, false);
+    array.second.CopyTo(&copy);
+    copies.emplace(array.first, copy);
+  }
+  return copies;
+}
+
+mxnet::cpp::Executor* BindBucket(mxnet::cpp::Symbol& net,
+                                 DeviceTrainer& device,
+                                 size_t bucket,
+                                 mxnet::cpp::Executor* shared_exec) {
+  using mxnet::cpp::NDArray;
+  const auto& shapes = device.train_iter->GetShapes(bucket);
+  auto& inputs = device.inputs[bucket];
+  auto add_input = [&](const char* name, const std::vector<mx_uint>& shape) {
+    inputs[name] = NDArray(mxnet::cpp::Shape(shape), device.ctx, false);
+  };
+  add_input("data", shapes.im);
+  add_input("im_info", shapes.im_info);
+  add_input("gt_boxes", shapes.gt_boxes);
+  add_input("label", shapes.label);
+  add_input("bbox_target", shapes.bbox_target);
+  add_input("bbox_weight", shapes.bbox_weight);
+
+  std::vector<NDArray> arg_arrays;
+  std::vector<NDArray> grad_arrays;
+  std::vector<mxnet::cpp::OpReqType> grad_reqs;
+  for (const auto& name : net.ListArguments()) {
+    auto input = inputs.find(name);
+    arg_arrays.push_back(input != inputs.end() ? input->second
+                                               : device.args_map.at(name));
+    auto grad = device.grad_map.find(name);
+    if (grad != device.grad_map.end()) {
+      grad_arrays.push_back(grad->second);
+      grad_reqs.push_back(mxnet::cpp::kWriteTo);
+    } else {
+      grad_arrays.push_back(NDArray());
+      grad_reqs.push_back(mxnet::cpp::kNullOp);
+    }
+  }
+  std::vector<NDArray> aux_arrays;
+  for (const auto& name : net.ListAuxiliaryStates())
+    aux_arrays.push_back(device.aux_map.at(name));
+  return net.Bind(device.ctx, arg_arrays, grad_arrays, grad_reqs, aux_arrays,
+                  {}, shared_exec);
+}
+
+void ApplyTuneSettings(const utils::TuneSettings& settings, Params& params) {
+  for (const auto& setting : settings) {
+    if (setting.first == "rcnn_decode_threads")
+      params.rcnn_decode_threads = setting.second;
+    else if (setting.first == "rcnn_prefetch_batches")
+      params.rcnn_prefetch_batches = setting.second;
+  }
+}
+
+// The decode tasks and the prefetch depth of the loaders are tuned with
+// short training runs of measure, which returns the images per second and
+// the used GPU memory. The best settings of the host are saved to the host
+// file in dir and are taken from it by the next runs, unless retune is set.
+// The batch size isn't tuned, the executors are bound to it.
+void TuneLoaders(Params& params,
+                 const std::string& signature,
+                 const std::function<utils::TuneTrial()>& measure,
+                 const std::string& dir,
+                 bool retune) {
+  const auto cores = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t free_memory = 0;
+  size_t total_memory = 0;
+  if (cudaMemGetInfo(&free_memory, &total_memory) != cudaSuccess)
+    total_memory = 0;
+  utils::AutoTuner tuner(
+      {{"rcnn_decode_threads", utils::TuneCandidates({1, 2, 4, 8, 16}, cores)},
+       {"rcnn_prefetch_batches",
+        utils::TuneCandidates({1, 2, 3, 4, 6, 8}, 8)}},
+      static_cast<int64_t>(params.rcnn_autotune_memory_fraction *
+                           static_cast<double>(total_memory)));
+  utils::TuneSettings start{
+      {"rcnn_decode_threads", params.rcnn_decode_threads},
+      {"rcnn_prefetch_batches", params.rcnn_prefetch_batches}};
+  auto settings =
+      utils::LoadOrTune(utils::TuneFile(dir), signature, retune, tuner, start,
+                        [&](const utils::TuneSettings& trial) {
+                          ApplyTuneSettings(trial, params);
+                          return measure();
+                        });
+  ApplyTuneSettings(settings, params);
+}
+}  // namespace
+
 const cv::String keys =
     "{help h usage ? |                  | print this message   }"
     "{@coco_path     |<none>            | path to coco dataset }"
     "{p params       |                  | path to trained resnet parameters }"
     "{s start-train  |                  | flag to start initial training }"
-    "{c check-point  |check-point.params| check point file name }";
+    "{c check-point  |check-point.params| check point file name }"
+    "{e keep-epochs  |0                 | epoch check points to keep }"
+    "{o optimizer    |sgd               | sgd or adam }"
+    "{m mixed        |                  | train in mixed precision }"
+    "{g gpus         |1                 | number of GPUs to train on }"
+    "{k kvstore      |device            | local, device, nccl or dist_sync }"
+    "{metrics-json   |                  | JSON lines file of the metrics }"
+    "{metrics-prom   |                  | Prometheus text file of metrics }"
+    "{autotune       |                  | tune the loader settings first }"
+    "{retune         |                  | tune again, not the saved ones }"
+    "{bench          |                  | JSON lines file, times the training "
+    "steps instead of the training }"
+    "{f freeze       |                  | comma separated parts of the frozen "
+    "argument names, conv0,stage1,gamma,beta by default }";
 
 int main(int argc, char** argv) {
   MXRandomSeed(5675317);
@@ -43,10 +182,47 @@ int main(int argc, char** argv) {
     params_path = parser.get<cv::String>("params");
 
   std::string check_point_file = parser.get<cv::String>("check-point");
+  auto keep_epochs = parser.get<uint32_t>("keep-epochs");
+
+  std::string optimizer_name = parser.get<cv::String>("optimizer");
+  if (optimizer_name != "sgd" && optimizer_name != "adam") {
+    std::cout << "Unknown optimizer : " << optimizer_name << std::endl;
+    return 1;
+  }
+
+  auto gpus_num = parser.get<uint32_t>("gpus");
+  if (gpus_num == 0) {
+    std::cout << "At least one GPU is required" << std::endl;
+    return 1;
+  }
+  std::string kvstore_type = parser.get<cv::String>("kvstore");
+  const bool distributed = kvstore_type.compare(0, 4, "dist") == 0;
 
   bool start_train{false};
   if (parser.has("start-train"))
     start_train = true;
+  const bool mixed_precision = parser.has("mixed");
+  const bool retune = parser.has("retune");
+  const bool autotune = parser.has("autotune") || retune;
+  std::string bench_file;
+  if (parser.has("bench"))
+    bench_file = parser.get<cv::String>("bench");
+  std::string metrics_json_file;
+  if (parser.has("metrics-json"))
+    metrics_json_file = parser.get<cv::String>("metrics-json");
+  std::string metrics_prom_file;
+  if (parser.has("metrics-prom"))
+    metrics_prom_file = parser.get<cv::String>("metrics-prom");
+  std::vector<std::string> frozen_args;
+  bool custom_frozen_args{false};
+  if (parser.has("freeze")) {
+    custom_frozen_args = true;
+    std::stringstream parts(parser.get<cv::String>("freeze"));
+    std::string part;
+    while (std::getline(parts, part, ','))
+      if (!part.empty())
+        frozen_args.push_back(part);
+  }
 
   // Chech parsing errors
   if (!parser.check()) {
@@ -57,6 +233,23 @@ int main(int argc, char** argv) {
   }
 
   try {
+    // Gradients of the GPUs and nodes are summed by the kvstore, every
+    // replica updates its parameters with the same sum
+    const bool use_kvstore = gpus_num > 1 || distributed;
+    int rank = 0;
+    int workers_num = 1;
+    if (use_kvstore) {
+      mxnet::cpp::KVStore::SetType(kvstore_type);
+      if (distributed && mxnet::cpp::KVStore::GetRole() != "worker") {
+        mxnet::cpp::KVStore::RunServer();
+        MXNotifyShutdown();
+        return 0;
+      }
+      rank = mxnet::cpp::KVStore::GetRank();
+      workers_num = mxnet::cpp::KVStore::GetNumWorkers();
+      CheckMXnetError("create kvstore");
+    }
+
     check_point_file = fs::absolute(check_point_file);
     coco_path = fs::canonical(fs::absolute(coco_path));
     if (!params_path.empty())
@@ -68,28 +261,48 @@ int main(int argc, char** argv) {
                 << std::endl;
 
       Params params;
+      params.mixed_precision = mixed_precision;
+      if (custom_frozen_args)
+        params.rcnn_frozen_args = frozen_args;
       auto net = GetRCNNSymbol(params, true);
 
       std::map<std::string, mxnet::cpp::NDArray> args_map;
       std::map<std::string, mxnet::cpp::NDArray> aux_map;
       std::cout << "Loading parameters ... " << std::endl;
       if (!params_path.empty())
-        std::tie(args_map, aux_map) = LoadNetParams(global_ctx, params_path);
+        std::tie(args_map, aux_map) =
+            LoadNetParams(global_ctx, params_path, &net);
 
       // ---------- Test parametes & Check Shapes - shouldn't fail
       std::cout << "Test shapes ..." << std::endl;
-      std::map<std::string, std::vector<mx_uint>> arg_shapes;
-      arg_shapes["data"] = {params.rcnn_batch_size, 3, params.img_short_side,
-                            params.img_long_side};
-
       auto feat_sym = net.GetInternals()["rpn_cls_score_output"];
 
       std::vector<std::vector<mx_uint>> in_shape;
       std::vector<std::vector<mx_uint>> aux_shape;
       std::vector<std::vector<mx_uint>> out_shape;
-      feat_sym.InferShape(arg_shapes, &in_shape, &aux_shape, &out_shape);
-      mx_uint feat_height = out_shape.at(0).at(2);
-      mx_uint feat_width = out_shape.at(0).at(3);
+      std::vector<TrainBucket> buckets;
+      for (const auto& bucket_shape : params.train_buckets) {
+        TrainBucket bucket;
+        bucket.height = bucket_shape.first;
+        bucket.width = bucket_shape.second;
+        in_shape.clear();
+        aux_shape.clear();
+        out_shape.clear();
+        feat_sym.InferShape({{"data",
+                              {params.rcnn_batch_size, 3, bucket.height,
+                               bucket.width}}},
+                            &in_shape, &aux_shape, &out_shape);
+        bucket.feat_height = out_shape.at(0).at(2);
+        bucket.feat_width = out_shape.at(0).at(3);
+        buckets.push_back(bucket);
+      }
+
+      // shapes are checked with the first bucket
+      std::map<std::string, std::vector<mx_uint>> arg_shapes;
+      arg_shapes["data"] = {params.rcnn_batch_size, 3, buckets.front().height,
+                            buckets.front().width};
+      mx_uint feat_height = buckets.front().feat_height;
+      mx_uint feat_width = buckets.front().feat_width;
       mx_uint rpn_num_anchors = static_cast<mx_uint>(
           params.rpn_anchor_scales.size() * params.rpn_anchor_ratios.size());
 
@@ -153,21 +366,45 @@ int main(int argc, char** argv) {
         net.InferArgsMap(global_ctx, &args_map, args_map);
       }
 
-      //----------- Train
-      uint32_t max_epoch = 100;
-
-      mxnet::cpp::Executor* executor{nullptr};
-      // without aux_map - training fails with nans
-      executor = net.SimpleBind(
-          global_ctx, args_map, std::map<std::string, mxnet::cpp::NDArray>(),
-          std::map<std::string, mxnet::cpp::OpReqType>(), aux_map);
-      args = net.ListArguments();
-
-      //      mxnet::cpp::Monitor monitor(1, std::regex("stage3.*"));
-      //      //.*|bbox_pred.*|prop_target.*|bbox_loss.*|rpn.*"));
-      //      //
-      //      std::regex("data|im_info|gt_boxes|label|bbox_target|bbox_weight"));
-      //      monitor.install(executor);
+      // The inputs and the frozen arguments, by default the backbone stem
+      // and the batch norms, get no gradient arrays, so they are bound with
+      // kNullOp and the backward pass skips them
+      std::unordered_set<std::string> not_update_args{
+          "data", "im_info", "gt_boxes", "label", "bbox_target", "bbox_weight"};
+      auto is_frozen = [&](const std::string& arg_name) {
+        return std::any_of(params.rcnn_frozen_args.begin(),
+                           params.rcnn_frozen_args.end(),
+                           [&](const std::string& part) {
+                             return arg_name.find(part) != std::string::npos;
+                           });
+      };
+      std::vector<std::string> trainable_args;
+      for (size_t i = 0; i < args.size(); ++i) {
+        const auto& arg_name = args[i];
+        if (not_update_args.count(arg_name) == 0 && !is_frozen(arg_name)) {
+          trainable_args.push_back(arg_name);
+          // the same as SimpleBind does for missed arguments
+          if (args_map.find(arg_name) == args_map.end()) {
+            args_map[arg_name] = mxnet::cpp::NDArray(
+                mxnet::cpp::Shape(in_shape[i]), global_ctx, false);
+            mxnet::cpp::NDArray::SampleGaussian(0, 1, &args_map[arg_name]);
+          }
+        }
+      }
+      // inputs are allocated for every bucket
+      for (const auto& arg_name : not_update_args)
+        args_map.erase(arg_name);
+      // missed auxiliary states are initialized as for a new batch norm
+      auto auxs = net.ListAuxiliaryStates();
+      for (size_t i = 0; i < auxs.size(); ++i) {
+        if (aux_map.find(auxs[i]) == aux_map.end()) {
+          mxnet::cpp::NDArray aux(mxnet::cpp::Shape(aux_shape[i]), global_ctx,
+                                  false);
+          const bool is_var = auxs[i].find("moving_var") != std::string::npos;
+          aux = is_var ? 1.f : 0.f;
+          aux_map[auxs[i]] = aux;
+        }
+      }
 
       if (start_train) {
         InitiaizeRCNN(args_map);
@@ -176,61 +413,255 @@ int main(int argc, char** argv) {
 
       std::cout << "Indexing trainig data set ..." << std::endl;
       Coco coco(coco_path);
-      coco.LoadTrainData(
-          {2, 3, 4, 6, 7},  // train only on vehicles with fixed aspect ratio
-          static_cast<float>(params.img_long_side) /
-              static_cast<float>(params.img_short_side));
-      GpuTrainIter train_iter(&coco, params, feat_height, feat_width);
-      train_iter.AllocateGpuCache(
-          global_ctx, arg_shapes["data"], arg_shapes["im_info"],
-          arg_shapes["gt_boxes"], arg_shapes["label"],
-          arg_shapes["bbox_target"], arg_shapes["bbox_weight"]);
-
-      auto batch_count = train_iter.GetBatchCount();
-      std::cout << "Total images count: " << train_iter.GetSize() << std::endl;
+      // train only on vehicles, images of all aspect ratios go to buckets
+      coco.LoadTrainData({2, 3, 4, 6, 7});
+
+      // Every GPU of every worker trains on its shard of the images
+      std::vector<DeviceTrainer> devices;
+      devices.reserve(gpus_num);
+      const uint32_t shards_num = static_cast<uint32_t>(workers_num) * gpus_num;
+      // Loaders are made again with the tuned settings, the size of the
+      // shards doesn't depend on them
+      auto make_train_iters = [&]() {
+        for (uint32_t d = 0; d < gpus_num; ++d) {
+          auto& device = devices[d];
+          device.train_iter.reset();  // frees the GPU slots first
+          device.train_iter = std::make_unique<GpuTrainIter>(
+              &coco, params, buckets,
+              static_cast<uint32_t>(rank) * gpus_num + d, shards_num);
+          device.train_iter->AllocateGpuCache(device.ctx);
+        }
+      };
+      for (uint32_t d = 0; d < gpus_num; ++d) {
+        devices.emplace_back(mxnet::cpp::Context(global_ctx.GetDeviceType(),
+                                                 static_cast<int>(d)));
+        auto& device = devices.back();
+        if (d == 0) {
+          device.args_map = args_map;
+          device.aux_map = aux_map;
+        } else {
+          device.args_map = CopyToDevice(args_map, device.ctx);
+          device.aux_map = CopyToDevice(aux_map, device.ctx);
+        }
+      }
+      make_train_iters();
+
+      const auto batch_count = devices.front().train_iter->GetBatchCount();
+      const auto device_images = devices.front().train_iter->GetSize();
+      std::cout << "Devices: " << gpus_num << " workers: " << workers_num
+                << std::endl;
+      std::cout << "Total images count: " << coco.GetImagesCount()
+                << std::endl;
+      std::cout << "Device images count: " << device_images << std::endl;
       std::cout << "Batch count: " << batch_count << std::endl;
 
+      //----------- Train
+      uint32_t max_epoch = 100;
+
       float lr = 0.001f;
       float lr_factor = 0.1f;
       int lr_epoch = 10;  // epoch to decay lr
-      int lr_step = (lr_epoch * static_cast<int>(train_iter.GetSize())) /
+      int lr_step = (lr_epoch * static_cast<int>(device_images)) /
                     static_cast<int>(params.rcnn_batch_size);
 
-      mxnet::cpp::Optimizer* opt = mxnet::cpp::OptimizerRegistry::Find("sgd");
-      opt->SetLRScheduler(
-             std::make_unique<mxnet::cpp::FactorScheduler>(lr_step, lr_factor))
-          ->SetParam("lr", lr)
-          ->SetParam("wd", 0.0005)
-          ->SetParam("momentum", 0.9f)
-          ->SetParam("rescale_grad", 1.0f / params.rcnn_batch_size)
-          ->SetParam("clip_gradient", 5);
-      CheckMXnetError("create optimizer");
+      FlatOptimizer::Settings optimizer_settings;
+      optimizer_settings.method = optimizer_name == "adam"
+                                      ? FlatOptimizer::Method::Adam
+                                      : FlatOptimizer::Method::SgdMomentum;
+      optimizer_settings.lr = lr;
+      optimizer_settings.wd = 0.0005f;
+      optimizer_settings.momentum = 0.9f;
+      // gradients are summed over all shards, mixed precision losses are
+      // scaled
+      optimizer_settings.rescale_grad =
+          1.0f / (params.rcnn_batch_size * shards_num);
+      if (params.mixed_precision)
+        optimizer_settings.rescale_grad /= params.mixed_precision_loss_scale;
+      optimizer_settings.clip_gradient = 5;
+      // buckets let the gradients of the last layers be synced while the
+      // backward pass still runs
+      optimizer_settings.bucket_size =
+          use_kvstore ? params.rcnn_grad_bucket_size : 0;
+
+      // float16 parameters of the mixed precision net, the others are float32
+      std::map<std::string, int> arg_types;
+      if (params.mixed_precision)
+        arg_types = InferArgTypes(net, {"data", "im_info", "gt_boxes", "label",
+                                        "bbox_target", "bbox_weight"});
+      for (auto& device : devices) {
+        device.optimizer = std::make_unique<FlatOptimizer>(
+            device.ctx, optimizer_settings,
+            std::make_unique<mxnet::cpp::FactorScheduler>(lr_step, lr_factor));
+        // Trainable parameters and their gradients are views of flat
+        // arrays, the executors are bound to them
+        device.optimizer->Pack(trainable_args, device.args_map,
+                               device.grad_map, arg_types);
+        CastToArgTypes(arg_types, device.args_map);
+        CheckMXnetError("pack parameters");
+
+        // Executors of the smaller buckets take the memory of the first one.
+        // Auxiliary states are bound too, without them training fails with
+        // nans.
+        device.inputs.resize(buckets.size());
+        for (size_t b = 0; b < buckets.size(); ++b) {
+          auto* shared_exec = b == 0 ? nullptr : device.executors.front().get();
+          device.executors.emplace_back(
+              BindBucket(net, device, b, shared_exec));
+          CheckMXnetError("bind executor");
+        }
+      }
 
-      std::unordered_set<std::string> not_update_args{
-          "data", "im_info", "gt_boxes", "label", "bbox_target", "bbox_weight"};
-      for (auto& arg_name : args) {
-        if (arg_name.find("conv0") != std::string::npos ||
-            arg_name.find("stage1") != std::string::npos ||
-            arg_name.find("gamma") != std::string::npos ||
-            arg_name.find("beta") != std::string::npos) {
-          not_update_args.insert(arg_name);
+      //      mxnet::cpp::Monitor monitor(1, std::regex("stage3.*"));
+      //      //.*|bbox_pred.*|prop_target.*|bbox_loss.*|rpn.*"));
+      //      //
+      //      std::regex("data|im_info|gt_boxes|label|bbox_target|bbox_weight"));
+      //      monitor.install(executor);
+
+      // A kvstore key per bucket, all replicas start from the parameters of
+      // the first GPU of the first worker
+      const auto buckets_num = devices.front().optimizer->GetBucketsCount();
+      if (use_kvstore) {
+        std::vector<int> keys(buckets_num);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::vector<mxnet::cpp::NDArray> weights;
+        for (size_t b = 0; b < buckets_num; ++b)
+          weights.push_back(devices.front().optimizer->GetWeights(b));
+        mxnet::cpp::KVStore::Init(keys, weights);
+        for (auto& device : devices) {
+          for (size_t b = 0; b < buckets_num; ++b)
+            mxnet::cpp::KVStore::Pull(static_cast<int>(b),
+                                      &device.optimizer->GetWeights(b));
+          device.optimizer->LoadMasterWeights();
         }
+        mxnet::cpp::NDArray::WaitAll();
+        CheckMXnetError("init kvstore");
       }
+
+      // Pushes are queued after the backward passes, the engine starts them
+      // as soon as the buckets are written. The last buckets are written
+      // first.
+      auto sync_gradients = [&]() {
+        for (size_t b = buckets_num; b-- > 0;) {
+          std::vector<int> keys(devices.size(), static_cast<int>(b));
+          std::vector<mxnet::cpp::NDArray> grads;
+          for (auto& device : devices)
+            grads.push_back(device.optimizer->GetGradients(b));
+          auto priority = -static_cast<int>(b);
+          mxnet::cpp::KVStore::Push(keys, grads, priority);
+          mxnet::cpp::KVStore::Pull(keys, &grads, priority);
+        }
+      };
+
+      // shards have the same size, so all devices end the epoch together
+      auto next_batch = [&]() {
+        MLCPP_TRACE_ZONE("load_batch");
+        for (auto& device : devices) {
+          if (!device.train_iter->Next())
+            return false;
+        }
+        return true;
+      };
+
+      // Trials run the forward and backward passes without the updates and
+      // the gradient sync, so the weights don't change and the workers of a
+      // distributed run don't wait for each other
+      auto run_batches = [&](uint32_t count) {
+        uint32_t batches = 0;
+        for (; batches < count && next_batch(); ++batches) {
+          for (auto& device : devices) {
+            device.bucket = device.train_iter->GetBucket();
+            auto& arrays = device.inputs[device.bucket];
+            device.train_iter->GetData(arrays["data"], arrays["im_info"],
+                                       arrays["gt_boxes"], arrays["label"],
+                                       arrays["bbox_target"],
+                                       arrays["bbox_weight"]);
+            device.executors[device.bucket]->Forward(true);
+          }
+          for (auto& device : devices)
+            device.executors[device.bucket]->Backward();
+        }
+        mxnet::cpp::NDArray::WaitAll();
+        CheckMXnetError("tuning steps");
+        return batches;
+      };
+      auto measure = [&]() {
+        make_train_iters();
+        for (auto& device : devices)
+          device.train_iter->Reset();
+        run_batches(2);  // the loaders fill the slots
+        auto start = std::chrono::steady_clock::now();
+        auto batches = run_batches(params.rcnn_autotune_batches);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        utils::TuneTrial trial;
+        trial.rate = batches * params.rcnn_batch_size * gpus_num /
+                     std::max(elapsed.count(), 1e-9);
+        size_t free_memory = 0;
+        size_t total_memory = 0;
+        if (cudaMemGetInfo(&free_memory, &total_memory) == cudaSuccess)
+          trial.memory = static_cast<int64_t>(total_memory - free_memory);
+        return trial;
+      };
+
+      if (autotune) {
+        auto signature =
+            "rcnn_train gpus=" + std::to_string(gpus_num) +
+            " batch=" + std::to_string(params.rcnn_batch_size) +
+            " shape=" + std::to_string(buckets.front().height) + "x" +
+            std::to_string(buckets.front().width) +
+            " mixed=" + std::to_string(params.mixed_precision);
+        TuneLoaders(params, signature, measure,
+                    fs::path(check_point_file).parent_path(), retune);
+        make_train_iters();
+      }
+      // The benchmark is a timed run like a tuning trial, with the tuned
+      // settings if they are asked for, the net isn't trained
+      if (!bench_file.empty()) {
+        auto allocations = utils::AllocationCount();
+        auto trial = measure();
+        allocations = utils::AllocationCount() - allocations;
+        if (rank == 0)
+          utils::PerfReport("rcnn-mxnet", bench_file)
+              .Write("train",
+                     {{"gpus", gpus_num},
+                      {"batch", params.rcnn_batch_size},
+                      {"images_per_s", trial.rate},
+                      {"allocations", static_cast<double>(allocations)},
+                      {"device_mb", static_cast<double>(trial.memory) /
+                                        (1 << 20)}});
+        devices.clear();
+        MXNotifyShutdown();
+        return 0;
+      }
+
 #ifdef NDEBUG
-      Reporter reporter(false, 8, std::chrono::milliseconds(5000));
+      Reporter reporter(false, 15, std::chrono::milliseconds(5000));
 #else
-      Reporter reporter(true, 8, std::chrono::milliseconds(5000));
+      Reporter reporter(true, 15, std::chrono::milliseconds(5000));
 #endif
-      reporter.SetLineDescription(0,
-                                  "Epoch(" + std::to_string(max_epoch) + ")");
-      reporter.SetLineDescription(1,
-                                  "Batch(" + std::to_string(batch_count) + ")");
-      reporter.SetLineDescription(2, "PRN accuracy");
-      reporter.SetLineDescription(3, "PRN log loss");
-      reporter.SetLineDescription(4, "PRN l1 loss");
-      reporter.SetLineDescription(5, "RCNN accurary");
+      reporter.SetLineDescription(
+          0, "Epoch(" + std::to_string(max_epoch) + ")", "epoch");
+      reporter.SetLineDescription(
+          1, "Batch(" + std::to_string(batch_count) + ")", "batch");
+      reporter.SetLineDescription(2, "PRN accuracy", "rpn_accuracy");
+      reporter.SetLineDescription(3, "PRN log loss", "rpn_log_loss");
+      reporter.SetLineDescription(4, "PRN l1 loss", "rpn_l1_loss");
+      reporter.SetLineDescription(5, "RCNN accurary", "rcnn_accuracy");
       reporter.SetLineDescription(6, "RCNN log loss");
       reporter.SetLineDescription(7, "RCNN l1 loss");
+      reporter.SetLineDescription(8, "Batch time ms");
+      reporter.SetLineDescription(9, "Images/s", "images_per_second");
+      // Host times of the steps, the passes are only queued to the engine,
+      // so the device time shows in the data wait and the batch time
+      reporter.SetLineDescription(10, "Data wait ms");
+      reporter.SetLineDescription(11, "Forward queue ms");
+      reporter.SetLineDescription(12, "Backward queue ms");
+      reporter.SetLineDescription(13, "Update queue ms");
+      reporter.SetLineDescription(14, "GPU memory used MB");
+      if (rank == 0) {
+        reporter.SetJsonLinesFile(metrics_json_file);
+        reporter.SetPrometheusFile(metrics_prom_file);
+      }
       reporter.Start();
 
       RPNAccMetric rpn_acc_metric;
@@ -241,83 +672,146 @@ int main(int argc, char** argv) {
       RCNNLogLossMetric rcnn_log_loss_metric;
       RCNNL1LossMetric rcnn_l1_loss_metric;
 
+      // in the order of the reporter lines from 2
+      std::vector<DeviceMetric*> metrics{
+          &rpn_acc_metric,  &rpn_log_loss_metric,  &rpn_l1_loss_metric,
+          &rcnn_acc_metric, &rcnn_log_loss_metric, &rcnn_l1_loss_metric};
+      // totals were fetched after the updates, so they are already on the
+      // host after the engine sync
+      auto report_metrics = [&]() {
+        size_t line = 2;
+        for (auto* metric : metrics)
+          reporter.SetLineValue(line++, metric->Get());
+      };
+
+      // Steps are queued to the engine without waiting, it orders the batch
+      // copies, passes and updates by their arrays. The host can't run far
+      // ahead because the loader waits for the free GPU slots. The engine is
+      // synchronized and errors are checked every sync_interval batches.
+      const uint32_t sync_interval = 100;
       uint32_t batch_num = 0;
+      uint64_t step = 0;
+      // check points are written on a background thread
+      std::unique_ptr<CheckpointWriter> checkpoint_writer;
+      if (rank == 0)
+        checkpoint_writer.reset(
+            new CheckpointWriter(check_point_file, keep_epochs));
       for (uint32_t epoch = 0; epoch < max_epoch; ++epoch) {
         batch_num = 0;
         reporter.SetLineValue(0, epoch);
-        train_iter.Reset();
-        while (train_iter.Next()) {
+        for (auto& device : devices)
+          device.train_iter->Reset();
+        auto sync_time = std::chrono::steady_clock::now();
+        uint32_t sync_batch_num = 0;
+        auto step_time = std::chrono::steady_clock::now();
+        // milliseconds since the last time point of the step
+        auto lap = [&step_time]() {
+          auto now = std::chrono::steady_clock::now();
+          std::chrono::duration<double, std::milli> elapsed = now - step_time;
+          step_time = now;
+          return elapsed.count();
+        };
+        while (next_batch()) {
+          reporter.SetStep(step++);
+          reporter.SetLineValue(10, lap());
           reporter.SetLineValue(1, batch_num);
-          CheckMXnetError("before copy batch");
-          train_iter.GetData(args_map["data"], args_map["im_info"],
-                             args_map["gt_boxes"], args_map["label"],
-                             args_map["bbox_target"], args_map["bbox_weight"]);
-          CheckMXnetError("copy batch");
-
-          // monitor.tic();
-          executor->Forward(true);
-          mxnet::cpp::NDArray::WaitAll();
-          CheckMXnetError("forward");
-
-          // evaluate training metrics - every 100 batches
-          if (batch_num % 100 == 0) {
-            rpn_acc_metric.Reset();
-            rpn_log_loss_metric.Reset();
-            rpn_l1_loss_metric.Reset();
-
-            rcnn_acc_metric.Reset();
-            rcnn_log_loss_metric.Reset();
-            rcnn_l1_loss_metric.Reset();
-
-            CheckMXnetError("forward metrics");
+          // calls are queued, so the devices run in parallel
+          {
+            MLCPP_TRACE_ZONE("forward");
+            for (auto& device : devices) {
+              device.bucket = device.train_iter->GetBucket();
+              auto& arrays = device.inputs[device.bucket];
+              device.train_iter->GetData(arrays["data"], arrays["im_info"],
+                                         arrays["gt_boxes"], arrays["label"],
+                                         arrays["bbox_target"],
+                                         arrays["bbox_weight"]);
+              device.executors[device.bucket]->Forward(true);
+            }
+          }
+          reporter.SetLineValue(11, lap());
+
+          // evaluate training metrics - every 100 batches, the reductions
+          // are queued on the device and reported after the next sync
+          if (batch_num % sync_interval == 0) {
+            for (auto* metric : metrics)
+              metric->Reset();
+
+            // metrics are evaluated on the first GPU
+            auto& first = devices.front();
+            auto* executor = first.executors[first.bucket].get();
+            auto& inputs = first.inputs[first.bucket];
+
             rcnn_acc_metric.Update(executor->outputs[4], executor->outputs[2]);
-            CheckMXnetError("metric 1");
             rcnn_log_loss_metric.Update(executor->outputs[4],
                                         executor->outputs[2]);
-            CheckMXnetError("metric 2");
             rcnn_l1_loss_metric.Update(executor->outputs[4],
                                        executor->outputs[3]);
-            CheckMXnetError("metric 3");
 
-            rpn_acc_metric.Update(args_map["label"], executor->outputs[0]);
-            CheckMXnetError("metric 4");
-            rpn_log_loss_metric.Update(args_map["label"], executor->outputs[0]);
-            CheckMXnetError("metric 5");
-            rpn_l1_loss_metric.Update(args_map["bbox_weight"],
+            rpn_acc_metric.Update(inputs["label"],
+                                  executor->outputs[0]);
+            rpn_log_loss_metric.Update(inputs["label"],
+                                       executor->outputs[0]);
+            rpn_l1_loss_metric.Update(inputs["bbox_weight"],
                                       executor->outputs[1]);
-            CheckMXnetError("metric 6");
-
-            reporter.SetLineValue(2, rpn_acc_metric.Get());
-            reporter.SetLineValue(3, rpn_log_loss_metric.Get());
-            reporter.SetLineValue(4, rpn_l1_loss_metric.Get());
-            reporter.SetLineValue(5, rcnn_acc_metric.Get());
-            reporter.SetLineValue(6, rcnn_log_loss_metric.Get());
-            reporter.SetLineValue(7, rcnn_l1_loss_metric.Get());
-          }
 
-          executor->Backward();
-          mxnet::cpp::NDArray::WaitAll();
-          CheckMXnetError("backward");
-          // monitor.toc_print();
+            for (auto* metric : metrics)
+              metric->Fetch();
+          }
 
-          for (size_t i = 0; i < args.size(); ++i) {
-            if (not_update_args.find(args[i]) == not_update_args.end()) {
-              opt->Update(static_cast<int>(i), executor->arg_arrays[i],
-                          executor->grad_arrays[i]);
-            }
+          lap();
+          {
+            MLCPP_TRACE_ZONE("backward");
+            for (auto& device : devices)
+              device.executors[device.bucket]->Backward();
           }
-          mxnet::cpp::NDArray::WaitAll();
-          CheckMXnetError("updates");
+
+          if (use_kvstore)
+            sync_gradients();
+          reporter.SetLineValue(12, lap());
+          for (auto& device : devices)
+            device.optimizer->Update();
+          reporter.SetLineValue(13, lap());
 
           ++batch_num;
+          if (batch_num % sync_interval == 0) {
+            mxnet::cpp::NDArray::WaitAll();
+            CheckMXnetError("train steps");
+            report_metrics();
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::milli> elapsed =
+                now - sync_time;
+            auto batches = batch_num - sync_batch_num;
+            reporter.SetLineValue(8, elapsed.count() / batches);
+            reporter.SetLineValue(9, 1000. * batches * params.rcnn_batch_size *
+                                         gpus_num / elapsed.count());
+            size_t free_memory = 0;
+            size_t total_memory = 0;
+            if (cudaMemGetInfo(&free_memory, &total_memory) == cudaSuccess)
+              reporter.SetLineValue(
+                  14, static_cast<double>(total_memory - free_memory) /
+                          (1 << 20));
+            sync_time = now;
+            sync_batch_num = batch_num;
+            // the engine sync is not a part of the next step
+            lap();
+          }
+        }
+        mxnet::cpp::NDArray::WaitAll();
+        CheckMXnetError("train epoch");
+        report_metrics();
+        if (checkpoint_writer) {
+          checkpoint_writer->Save(devices.front().executors.front().get(),
+                                  epoch);
+          std::cout << "Saving parameters to " << check_point_file
+                    << std::endl;
         }
-        SaveNetParams(check_point_file, executor);
-        std::cout << "Parameters saved to " << check_point_file << std::endl;
       }
       reporter.Stop();
+      if (checkpoint_writer)
+        checkpoint_writer->Wait();
 
       mxnet::cpp::NDArray::WaitAll();
-      delete executor;
+      devices.clear();
 
       MXNotifyShutdown();
     } else {
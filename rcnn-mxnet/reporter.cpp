@@ -2,11 +2,38 @@
 
 #include <ncurses.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iomanip>
+#include <stdexcept>
+
+namespace {
+// Records are taken from the ring at least this often
+const std::chrono::milliseconds kPollInterval(50);
+
+std::string MetricName(const std::string& desc) {
+  std::string name;
+  for (auto c : desc) {
+    if (std::isalnum(static_cast<unsigned char>(c)))
+      name += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    else if (!name.empty() && name.back() != '_')
+      name += '_';
+  }
+  while (!name.empty() && name.back() == '_')
+    name.pop_back();
+  return name;
+}
+}  // namespace
+
 Reporter::Reporter(bool stdout,
                    size_t lines_num,
-                   std::chrono::milliseconds interval)
-    : values_(lines_num),
+                   std::chrono::milliseconds interval,
+                   size_t queue_size)
+    : records_(queue_size),
+      values_(lines_num),
       descriptions_(lines_num),
+      names_(lines_num),
       interval_(interval),
       stdout_(stdout) {}
 
@@ -14,45 +41,119 @@ Reporter::~Reporter() {
   Stop();
 }
 
-void Reporter::SetLineDescription(size_t index, const std::string& desc) {
+void Reporter::SetLineDescription(size_t index,
+                                  const std::string& desc,
+                                  const std::string& name) {
   descriptions_.at(index) = desc;
+  names_.at(index) = name.empty() ? MetricName(desc) : name;
+}
+
+void Reporter::SetJsonLinesFile(const std::string& file_name) {
+  json_file_.close();
+  if (file_name.empty())
+    return;
+  json_file_.open(file_name, std::ios::app);
+  if (!json_file_)
+    throw std::runtime_error(file_name + " file can't be opened");
+}
+
+void Reporter::SetPrometheusFile(const std::string& file_name) {
+  prometheus_file_ = file_name;
 }
 
 void Reporter::Start() {
-  if (!stdout_) {
-    std::thread th([&]() {
-      WINDOW* win = nullptr;
-      win = initscr();
-      erase();
-      notimeout(win, true);
-      nodelay(win, true);
-
-      auto len = values_.size();
-      while (!stop_flag_) {
-        for (size_t i = 0; i < len; ++i) {
-          if (!stdout_) {
-            mvprintw(static_cast<int>(i), 0, "%s: %f\n",
-                     descriptions_[i].c_str(), static_cast<double>(values_[i]));
-          } else {
-            std::cout << descriptions_[i].c_str() << ": " << values_[i]
-                      << std::endl;
-          }
-        }
-        refresh();
-        std::this_thread::sleep_for(interval_);
-      }
-      endwin();
-    });
-    print_thread_ = std::move(th);
-  }
+  stop_flag_ = false;
+  print_thread_ = std::thread([this]() { SinkLoop(); });
 }
 
 void Reporter::Stop() {
+  if (!print_thread_.joinable())
+    return;
+  stop_flag_ = true;
+  print_thread_.join();
   if (!stdout_) {
-    stop_flag_ = true;
-    print_thread_.join();
     for (size_t i = 0; i < values_.size(); ++i) {
       std::cout << descriptions_[i].c_str() << ": " << values_[i] << std::endl;
     }
   }
+  if (dropped_num_ > 0)
+    std::cout << "Reporter dropped values: " << dropped_num_ << std::endl;
+}
+
+void Reporter::SinkLoop() {
+  if (!stdout_) {
+    WINDOW* win = initscr();
+    erase();
+    notimeout(win, true);
+    nodelay(win, true);
+  }
+  auto last_show = std::chrono::steady_clock::now();
+  bool stop = false;
+  while (!stop) {
+    // values pushed before the stop are still written
+    stop = stop_flag_;
+    Record record;
+    while (records_.Pop(record)) {
+      values_[record.index] = record.value;
+      WriteRecord(record);
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (stop || now - last_show >= interval_) {
+      last_show = now;
+      if (json_file_)
+        json_file_.flush();
+      WritePrometheus();
+      Show();
+    }
+    if (!stop)
+      std::this_thread::sleep_for(std::min(kPollInterval, interval_));
+  }
+  if (!stdout_)
+    endwin();
+}
+
+void Reporter::WriteRecord(const Record& record) {
+  if (stdout_) {
+    std::cout << descriptions_[record.index].c_str() << ": " << record.value
+              << std::endl;
+  }
+  if (json_file_) {
+    std::chrono::duration<double> time = record.time.time_since_epoch();
+    json_file_ << std::fixed << std::setprecision(3) << "{\"time\":"
+               << time.count() << ",\"step\":" << record.step
+               << ",\"name\":\"" << names_[record.index] << "\",\"value\":"
+               << std::defaultfloat << std::setprecision(7) << record.value
+               << "}\n";
+  }
+}
+
+// The file is replaced at once, so the node exporter textfile collector never
+// reads a partial file
+void Reporter::WritePrometheus() {
+  if (prometheus_file_.empty())
+    return;
+  auto tmp_file = prometheus_file_ + ".tmp";
+  {
+    std::ofstream file(tmp_file);
+    if (!file)
+      return;
+    for (size_t i = 0; i < values_.size(); ++i) {
+      if (names_[i].empty())
+        continue;
+      file << "# HELP rcnn_" << names_[i] << " " << descriptions_[i] << "\n";
+      file << "# TYPE rcnn_" << names_[i] << " gauge\n";
+      file << "rcnn_" << names_[i] << " " << values_[i] << "\n";
+    }
+  }
+  std::rename(tmp_file.c_str(), prometheus_file_.c_str());
+}
+
+void Reporter::Show() {
+  if (stdout_)
+    return;
+  for (size_t i = 0; i < values_.size(); ++i) {
+    mvprintw(static_cast<int>(i), 0, "%s: %f\n", descriptions_[i].c_str(),
+             static_cast<double>(values_[i]));
+  }
+  refresh();
 }
@@ -3,35 +3,117 @@
 
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <thread>
 #include <vector>
 
+/* Single producer single consumer ring of fixed size, Push and Pop don't
+ * lock or allocate. Push fails when the ring is full.
+ */
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity) : items_(capacity + 1) {}
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  bool Push(const T& item) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto next = (tail + 1) % items_.size();
+    if (next == head_.load(std::memory_order_acquire))
+      return false;
+    items_[tail] = item;
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool Pop(T& item) {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+    item = items_[head];
+    head_.store((head + 1) % items_.size(), std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T> items_;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+/* Training progress lines. Values are passed with the step and time through
+ * a lock-free ring to the sink thread, so the training loop never waits for
+ * the output. The sink shows the last values with ncurses, or prints them to
+ * stdout, appends every value to the JSON lines file and rewrites the
+ * Prometheus text file every interval. Values are dropped when the ring is
+ * full. Lines, the step and the values are set from one thread.
+ */
 class Reporter {
  public:
-  Reporter(bool stdout, size_t lines_num, std::chrono::milliseconds interval);
+  Reporter(bool stdout,
+           size_t lines_num,
+           std::chrono::milliseconds interval,
+           size_t queue_size = 4096);
   ~Reporter();
   Reporter(const Reporter&) = delete;
   Reporter& operator=(const Reporter&) = delete;
 
-  void SetLineDescription(size_t index, const std::string& desc);
+  // The name of the metric in the files, by default the description in the
+  // lower case with underscores
+  void SetLineDescription(size_t index,
+                          const std::string& desc,
+                          const std::string& name = {});
+
+  // Sinks are set before Start, an empty file name turns them off
+  void SetJsonLinesFile(const std::string& file_name);
+  void SetPrometheusFile(const std::string& file_name);
+
+  // The step of the next values
+  void SetStep(uint64_t step) { step_ = step; }
 
   template <typename T>
   void SetLineValue(size_t index, T value) {
-    values_[index] = static_cast<float>(value);
-    if (stdout_) {
-      std::cout << descriptions_[index].c_str() << ": " << values_[index]
-                << std::endl;
-    }
+    Record record;
+    record.index = index;
+    record.step = step_;
+    record.time = std::chrono::system_clock::now();
+    record.value = static_cast<float>(value);
+    if (!records_.Push(record))
+      ++dropped_num_;
   }
 
+  uint64_t GetDroppedCount() const { return dropped_num_; }
+
   void Start();
   void Stop();
 
  private:
-  std::vector<std::atomic<float>> values_;
+  struct Record {
+    size_t index{0};
+    uint64_t step{0};
+    std::chrono::system_clock::time_point time;
+    float value{0};
+  };
+
+  void SinkLoop();
+  void WriteRecord(const Record& record);
+  void WritePrometheus();
+  void Show();
+
+ private:
+  SpscRing<Record> records_;
+  std::atomic<uint64_t> dropped_num_{0};
+  uint64_t step_{0};
+  // sink thread state
+  std::vector<float> values_;
   std::vector<std::string> descriptions_;
+  std::vector<std::string> names_;
+  std::ofstream json_file_;
+  std::string prometheus_file_;
   std::atomic_bool stop_flag_{false};
   std::thread print_thread_;
   std::chrono::milliseconds interval_;
@@ -22,7 +22,8 @@ mxnet::cpp::Symbol ConvolutionUnit(mxnet::cpp::Symbol data,
                                    uint32_t num_filter,
                                    mxnet::cpp::Shape kernel,
                                    mxnet::cpp::Shape stride,
-                                   mxnet::cpp::Shape pad) {
+                                   mxnet::cpp::Shape pad,
+                                   bool with_bias = false) {
   using namespace mxnet::cpp;
   Symbol weight(name + "_weight");
   // Symbol bias(name + "_bias");
@@ -31,44 +32,75 @@ mxnet::cpp::Symbol ConvolutionUnit(mxnet::cpp::Symbol data,
   //  return Convolution(name, data, weight, bias, kernel, num_filter, stride,
   //                     Shape(1, 1), pad, 1, workspace, true);
 
-  return Operator("Convolution")
-      .SetParam("kernel", kernel)
+  Operator conv("Convolution");
+  conv.SetParam("kernel", kernel)
       .SetParam("num_filter", num_filter)
       .SetParam("stride", stride)
       .SetParam("dilate", Shape(1, 1))
       .SetParam("pad", pad)
       .SetParam("num_group", 1)
       .SetParam("workspace", workspace)
-      .SetParam("no_bias", true)
+      .SetParam("no_bias", !with_bias)
       .SetInput("data", data)
-      .SetInput("weight", weight)
-      .CreateSymbol(name);
+      .SetInput("weight", weight);
+  if (with_bias)
+    conv.SetInput("bias", Symbol(name + "_bias"));
+  return conv.CreateSymbol(name);
+}
+
+// Convolution followed by the batch norm, or the convolution with the folded
+// batch norm
+mxnet::cpp::Symbol ConvolutionBatchNormUnit(mxnet::cpp::Symbol data,
+                                            const std::string& conv_name,
+                                            const std::string& bn_name,
+                                            uint32_t num_filter,
+                                            mxnet::cpp::Shape kernel,
+                                            mxnet::cpp::Shape stride,
+                                            mxnet::cpp::Shape pad,
+                                            bool fold_batch_norm) {
+  auto conv = ConvolutionUnit(data, conv_name, num_filter, kernel, stride, pad,
+                              fold_batch_norm);
+  return fold_batch_norm ? conv : BatchNormUnit(conv, bn_name, false);
+}
+
+// Names of the convolutions and their folded batch norms
+std::vector<std::pair<std::string, std::string>> FoldedLayers(
+    const std::vector<uint32_t>& units) {
+  std::vector<std::pair<std::string, std::string>> layers{{"conv0", "bn0"}};
+  for (size_t s = 0; s < units.size(); ++s) {
+    for (uint32_t i = 1; i < units[s] + 1; ++i) {
+      std::stringstream name;
+      name << "stage" << s + 1 << "_unit" << i;
+      layers.emplace_back(name.str() + "_conv1", name.str() + "_bn2");
+      layers.emplace_back(name.str() + "_conv2", name.str() + "_bn3");
+    }
+  }
+  return layers;
 }
 
 mxnet::cpp::Symbol ResidualUnit(mxnet::cpp::Symbol data,
                                 uint32_t num_filter,
                                 uint32_t stride,
                                 bool dim_match,
-                                const std::string& name) {
+                                const std::string& name,
+                                bool fold_batch_norm) {
   using namespace mxnet::cpp;
 
   auto bn1 = BatchNormUnit(data, name + "_bn1", false);
 
   auto act1 = Activation(name + "_relu1", bn1, "relu");
 
-  auto conv1 = ConvolutionUnit(act1, name + "_conv1",
-                               static_cast<uint32_t>(num_filter * 0.25),
-                               Shape(1, 1), Shape(1, 1), Shape(0, 0));
-
-  auto bn2 = BatchNormUnit(conv1, name + "_bn2", false);
+  auto bn2 = ConvolutionBatchNormUnit(
+      act1, name + "_conv1", name + "_bn2",
+      static_cast<uint32_t>(num_filter * 0.25), Shape(1, 1), Shape(1, 1),
+      Shape(0, 0), fold_batch_norm);
 
   auto act2 = Activation(name + "_relu2", bn2, "relu");
 
-  auto conv2 = ConvolutionUnit(act2, name + "_conv2",
-                               static_cast<uint32_t>(num_filter * 0.25),
-                               Shape(3, 3), Shape(stride, stride), Shape(1, 1));
-
-  auto bn3 = BatchNormUnit(conv2, name + "_bn3", false);
+  auto bn3 = ConvolutionBatchNormUnit(
+      act2, name + "_conv2", name + "_bn3",
+      static_cast<uint32_t>(num_filter * 0.25), Shape(3, 3),
+      Shape(stride, stride), Shape(1, 1), fold_batch_norm);
 
   auto act3 = Activation(name + "_relu3", bn3, "relu");
 
@@ -96,15 +128,16 @@ mxnet::cpp::Symbol ResidualUnit(mxnet::cpp::Symbol data,
 mxnet::cpp::Symbol GetResnetHeadSymbol(
     mxnet::cpp::Symbol data,
     const std::vector<uint32_t>& units,
-    const std::vector<uint32_t>& filter_list) {
+    const std::vector<uint32_t>& filter_list,
+    bool fold_batch_norm) {
   using namespace mxnet::cpp;
   // res1
   auto data_bn = BatchNormUnit(data, "bn_data", true);
 
-  auto conv0 = ConvolutionUnit(data_bn, "conv0", 64, Shape(7, 7), Shape(2, 2),
-                               Shape(3, 3));
-
-  auto bn0 = BatchNormUnit(conv0, "bn0", false);
+  // bn_data is before the padded conv0, so it isn't folded
+  auto bn0 = ConvolutionBatchNormUnit(data_bn, "conv0", "bn0", 64, Shape(7, 7),
+                                      Shape(2, 2), Shape(3, 3),
+                                      fold_batch_norm);
 
   auto relu0 = Activation("relu0", bn0, "relu");
 
@@ -112,27 +145,33 @@ mxnet::cpp::Symbol GetResnetHeadSymbol(
       Pooling("pool0", relu0, Shape(3, 3), PoolingPoolType::kMax, false, false,
               PoolingPoolingConvention::kValid, Shape(2, 2), Shape(1, 1));
   // res2
-  auto unit = ResidualUnit(pool0, filter_list[0], 1, false, "stage1_unit1");
+  auto unit = ResidualUnit(pool0, filter_list[0], 1, false, "stage1_unit1",
+                           fold_batch_norm);
   for (uint32_t i = 2; i < units[0] + 1; ++i) {
     std::stringstream name;
     name << "stage1_unit" << i;
-    unit = ResidualUnit(unit, filter_list[0], 1, true, name.str());
+    unit = ResidualUnit(unit, filter_list[0], 1, true, name.str(),
+                        fold_batch_norm);
   }
 
   // res3
-  unit = ResidualUnit(unit, filter_list[1], 2, false, "stage2_unit1");
+  unit = ResidualUnit(unit, filter_list[1], 2, false, "stage2_unit1",
+                      fold_batch_norm);
   for (uint32_t i = 2; i < units[1] + 1; ++i) {
     std::stringstream name;
     name << "stage2_unit" << i;
-    unit = ResidualUnit(unit, filter_list[1], 1, true, name.str());
+    unit = ResidualUnit(unit, filter_list[1], 1, true, name.str(),
+                        fold_batch_norm);
   }
 
   // res4
-  unit = ResidualUnit(unit, filter_list[2], 2, false, "stage3_unit1");
+  unit = ResidualUnit(unit, filter_list[2], 2, false, "stage3_unit1",
+                      fold_batch_norm);
   for (uint32_t i = 2; i < units[2] + 1; ++i) {
     std::stringstream name;
     name << "stage3_unit" << i;
-    unit = ResidualUnit(unit, filter_list[2], 1, true, name.str());
+    unit = ResidualUnit(unit, filter_list[2], 1, true, name.str(),
+                        fold_batch_norm);
   }
 
   return unit;
@@ -141,13 +180,16 @@ mxnet::cpp::Symbol GetResnetHeadSymbol(
 mxnet::cpp::Symbol GetResnetTopSymbol(
     mxnet::cpp::Symbol data,
     const std::vector<uint32_t>& units,
-    const std::vector<uint32_t>& filter_list) {
+    const std::vector<uint32_t>& filter_list,
+    bool fold_batch_norm) {
   using namespace mxnet::cpp;
-  auto unit = ResidualUnit(data, filter_list[3], 2, false, "stage4_unit1");
+  auto unit = ResidualUnit(data, filter_list[3], 2, false, "stage4_unit1",
+                           fold_batch_norm);
   for (uint32_t i = 2; i < units[3] + 1; ++i) {
     std::stringstream name;
     name << "stage4_unit" << i;
-    unit = ResidualUnit(unit, filter_list[3], 1, true, name.str());
+    unit = ResidualUnit(unit, filter_list[3], 1, true, name.str(),
+                        fold_batch_norm);
   }
   auto bn1 = BatchNormUnit(unit, "bn1", false);
 
@@ -158,3 +200,37 @@ mxnet::cpp::Symbol GetResnetTopSymbol(
 
   return pool1;
 }
+
+void FoldResnetBatchNorms(
+    const std::vector<uint32_t>& units,
+    std::map<std::string, mxnet::cpp::NDArray>& args_map,
+    std::map<std::string, mxnet::cpp::NDArray>& aux_map) {
+  using namespace mxnet::cpp;
+  for (const auto& layer : FoldedLayers(units)) {
+    const auto& conv = layer.first;
+    const auto& bn = layer.second;
+    auto weight = args_map.at(conv + "_weight");
+    auto gamma = args_map.at(bn + "_gamma");
+    auto beta = args_map.at(bn + "_beta");
+    auto mean = aux_map.at(bn + "_moving_mean");
+    auto var = aux_map.at(bn + "_moving_var");
+
+    // y = gamma * (conv(x) - mean) / sqrt(var + eps) + beta
+    auto scale =
+        gamma *
+        Operator("rsqrt")(var + static_cast<mx_float>(eps)).Invoke().front();
+    auto channels = static_cast<index_t>(scale.Size());
+    args_map[conv + "_weight"] =
+        Operator("broadcast_mul")(weight,
+                                  scale.Reshape(Shape(channels, 1, 1, 1)))
+            .Invoke()
+            .front();
+    args_map[conv + "_bias"] = beta - mean * scale;
+
+    args_map.erase(bn + "_gamma");
+    args_map.erase(bn + "_beta");
+    aux_map.erase(bn + "_moving_mean");
+    aux_map.erase(bn + "_moving_var");
+  }
+  NDArray::WaitAll();
+}
@@ -5,12 +5,28 @@
 
 #include <mxnet-cpp/MxNetCpp.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
+// With fold_batch_norm the batch norms right after convolutions are replaced
+// with the convolution biases, the parameters have to be converted with
+// FoldResnetBatchNorms. Batch norms after the residual sums stay.
 mxnet::cpp::Symbol GetResnetHeadSymbol(
     mxnet::cpp::Symbol data,
     const std::vector<uint32_t>& units,
-    const std::vector<uint32_t>& filter_list);
+    const std::vector<uint32_t>& filter_list,
+    bool fold_batch_norm = false);
 mxnet::cpp::Symbol GetResnetTopSymbol(mxnet::cpp::Symbol data,
                                       const std::vector<uint32_t>& units,
-                                      const std::vector<uint32_t>& filter_list);
+                                      const std::vector<uint32_t>& filter_list,
+                                      bool fold_batch_norm = false);
+
+// Scales the convolution weights by the global statistics of the folded batch
+// norms and adds the biases, the batch norm parameters are removed
+void FoldResnetBatchNorms(
+    const std::vector<uint32_t>& units,
+    std::map<std::string, mxnet::cpp::NDArray>& args_map,
+    std::map<std::string, mxnet::cpp::NDArray>& aux_map);
 
 #endif  // RESNET_H
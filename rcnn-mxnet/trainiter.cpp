@@ -1,33 +1,110 @@
 #include "trainiter.h"
+#include "../threadpool.h"
 #include "imageutils.h"
 
-#include <mshadow/tensor.h>
 #include <Eigen/Dense>
 
 #include <algorithm>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
 
 // uncomment to save batch images with bboxes
 // #define IMG_DEBUG_TEST
 
+namespace {
+// Bucket whose shape the image fills best when it's resized to fit
+uint8_t BestBucket(const std::vector<TrainBucket>& buckets, cv::Size size) {
+  uint8_t best = 0;
+  float best_fill = 0;
+  for (size_t b = 0; b < buckets.size(); ++b) {
+    auto height = static_cast<float>(buckets[b].height);
+    auto width = static_cast<float>(buckets[b].width);
+    auto scale = std::min(height / static_cast<float>(size.height),
+                          width / static_cast<float>(size.width));
+    auto fill = scale * static_cast<float>(size.height) * scale *
+                static_cast<float>(size.width) / (height * width);
+    if (fill > best_fill + 1e-3f) {
+      best_fill = fill;
+      best = static_cast<uint8_t>(b);
+    }
+  }
+  return best;
+}
+}  // namespace
+
 TrainIter::TrainIter(ImageDb* image_db,
                      const Params& params,
-                     uint32_t feat_height,
-                     uint32_t feat_width)
+                     const std::vector<TrainBucket>& buckets,
+                     uint32_t shard,
+                     uint32_t shards_num)
     : image_db_(image_db),
+      image_loader_(image_db, params.rcnn_decode_threads),
       batch_size_(params.rcnn_batch_size),
-      short_side_len_(params.img_short_side),
-      long_side_len_(params.img_long_side),
-      one_image_size_(3 * short_side_len_ * long_side_len_),
+      shard_(shard),
+      shards_num_(shards_num),
+      buckets_(buckets),
       num_anchors_(static_cast<uint32_t>(params.rpn_anchor_scales.size() *
                                          params.rpn_anchor_ratios.size())),
       batch_gt_boxes_count_(params.rcnn_batch_gt_boxes),
-      feat_height_(feat_height),
-      feat_width_(feat_width),
       batch_indices_(batch_size_),
       anchor_generator_(params),
       anchor_sampler_(params) {
   assert(image_db_ != nullptr);
-  size_ = image_db->GetImagesCount();
+  if (shards_num_ == 0 || shard_ >= shards_num_)
+    throw std::invalid_argument("Invalid train data shard");
+  if (buckets_.empty() ||
+      buckets_.size() > std::numeric_limits<uint8_t>::max())
+    throw std::invalid_argument("Invalid number of train buckets");
+
+  for (const auto& bucket : buckets_) {
+    bucket_anchors_.push_back(
+        anchor_generator_.Get(bucket.feat_width, bucket.feat_height));
+    BatchShapes shapes;
+    shapes.im = {batch_size_, 3, bucket.height, bucket.width};
+    shapes.im_info = {batch_size_, 3};
+    shapes.gt_boxes = {batch_size_, batch_gt_boxes_count_, 5};
+    shapes.label = {batch_size_, 1, num_anchors_ * bucket.feat_height,
+                    bucket.feat_width};
+    shapes.bbox_target = {batch_size_, 4 * num_anchors_, bucket.feat_height,
+                          bucket.feat_width};
+    shapes.bbox_weight = shapes.bbox_target;
+    bucket_shapes_.push_back(shapes);
+  }
+
+  // Buffers get the capacity of the largest bucket, so batches of all
+  // buckets are filled without allocations
+  size_t max_image_size = 0;
+  size_t max_anchors = 0;
+  for (size_t b = 0; b < buckets_.size(); ++b) {
+    max_image_size = std::max(
+        max_image_size, static_cast<size_t>(3 * buckets_[b].height) *
+                            buckets_[b].width);
+    max_anchors = std::max(max_anchors,
+                           static_cast<size_t>(bucket_anchors_[b]->rows()));
+  }
+  raw_im_data_.reserve(max_image_size * batch_size_);
+  raw_im_info_data_.reserve(3 * batch_size_);
+  raw_gt_boxes_data_.reserve(
+      static_cast<size_t>(batch_gt_boxes_count_) * 5 * batch_size_);
+  raw_label_.reserve(max_anchors * batch_size_);
+  raw_bbox_target_.reserve(max_anchors * 4 * batch_size_);
+  raw_bbox_weight_.reserve(max_anchors * 4 * batch_size_);
+  transpose_buffer_.reserve(max_anchors * 4 * batch_size_);
+
+  images_count_ = image_db->GetImagesCount();
+  image_buckets_.resize(images_count_);
+  std::vector<uint32_t> bucket_sizes(buckets_.size(), 0);
+  for (uint32_t i = 0; i < images_count_; ++i) {
+    image_buckets_[i] = BestBucket(buckets_, image_db->GetImageSize(i));
+    ++bucket_sizes[image_buckets_[i]];
+  }
+  // the number of full batches doesn't depend on the order of images
+  uint32_t batches_count = 0;
+  for (auto bucket_size : bucket_sizes)
+    batches_count += bucket_size / batch_size_;
+  size_ = (batches_count / shards_num_) * batch_size_;
   Reset();
 }
 
@@ -39,11 +116,45 @@ uint32_t TrainIter::GetBatchCount() const {
   return size_ / batch_size_;
 }
 
+size_t TrainIter::GetBucketsCount() const {
+  return buckets_.size();
+}
+
+const BatchShapes& TrainIter::GetShapes(size_t bucket) const {
+  return bucket_shapes_.at(bucket);
+}
+
+size_t TrainIter::GetBucket() const {
+  return bucket_;
+}
+
 void TrainIter::Reset() {
   cur_ = 0;
-  data_indices_.resize(size_);
-  std::iota(data_indices_.begin(), data_indices_.end(), 0);
-  std::shuffle(data_indices_.begin(), data_indices_.end(), random_engine_);
+  image_loader_.ClearPrefetch();
+  all_indices_.resize(images_count_);
+  std::iota(all_indices_.begin(), all_indices_.end(), 0);
+  std::shuffle(all_indices_.begin(), all_indices_.end(), random_engine_);
+
+  // A batch is complete when its bucket gets batch_size images, so batches
+  // of different buckets are mixed in the shuffled order
+  std::vector<std::vector<uint32_t>> pending(buckets_.size());
+  data_indices_.clear();
+  batch_buckets_.clear();
+  uint32_t batch = 0;
+  for (auto index : all_indices_) {
+    auto bucket = image_buckets_[index];
+    auto& images = pending[bucket];
+    images.push_back(index);
+    if (images.size() < batch_size_)
+      continue;
+    if (batch % shards_num_ == shard_ && data_indices_.size() < size_) {
+      data_indices_.insert(data_indices_.end(), images.begin(), images.end());
+      batch_buckets_.push_back(bucket);
+    }
+    images.clear();
+    ++batch;
+  }
+  PrefetchNext();
 }
 
 bool TrainIter::Next() {
@@ -52,10 +163,19 @@ bool TrainIter::Next() {
     auto e = s + batch_size_;
     std::copy(s, e, batch_indices_.begin());
 
-    FillData();
-    FillLabels();
+    bucket_ = batch_buckets_[cur_ / batch_size_];
+    const auto& bucket = buckets_[bucket_];
+    im_height_ = bucket.height;
+    im_width_ = bucket.width;
+    one_image_size_ = 3 * im_height_ * im_width_;
+    feat_height_ = bucket.feat_height;
+    feat_width_ = bucket.feat_width;
 
+    FillData();
     cur_ += batch_size_;
+    // the next batch is decoded while the labels of this one are assigned
+    PrefetchNext();
+    FillLabels();
     return true;
   } else {
     return false;
@@ -68,45 +188,53 @@ void TrainIter::GetData(mxnet::cpp::NDArray& im_arr,
                         mxnet::cpp::NDArray& label_arr,
                         mxnet::cpp::NDArray& bbox_target_arr,
                         mxnet::cpp::NDArray& bbox_weight_arr) {
+  // Synchronous copies wait only for the arrays they write, not for the
+  // whole engine, so a batch can be loaded while the training runs
   im_arr.SyncCopyFromCPU(raw_im_data_.data(), raw_im_data_.size());
-  im_arr.WaitAll();
   im_info_arr.SyncCopyFromCPU(raw_im_info_data_.data(),
                               raw_im_info_data_.size());
-  im_info_arr.WaitAll();
   gt_boxes_arr.SyncCopyFromCPU(raw_gt_boxes_data_.data(),
                                raw_gt_boxes_data_.size());
-  gt_boxes_arr.WaitAll();
   label_arr.SyncCopyFromCPU(raw_label_.data(), raw_label_.size());
-  label_arr.WaitAll();
   bbox_target_arr.SyncCopyFromCPU(raw_bbox_target_.data(),
                                   raw_bbox_target_.size());
-  bbox_target_arr.WaitAll();
   bbox_weight_arr.SyncCopyFromCPU(raw_bbox_weight_.data(),
                                   raw_bbox_weight_.size());
-  bbox_weight_arr.WaitAll();
 }
 
-void TrainIter::FillData() {
-  raw_gt_boxes_data_.clear();
-  raw_im_data_.clear();
-  raw_im_info_data_.clear();
-
-  auto if_i = std::back_insert_iterator<std::vector<float>>(raw_im_info_data_);
-  auto b_i = std::back_insert_iterator<std::vector<float>>(raw_gt_boxes_data_);
-
-  // gt_boxes padding markers
-  std::vector<std::pair<size_t, size_t>> gt_boxes_pad_markers;
+void TrainIter::PrefetchNext() {
+  if (cur_ + batch_size_ > size_)
+    return;
+  const auto& bucket = buckets_[batch_buckets_[cur_ / batch_size_]];
+  std::vector<uint32_t> indices(data_indices_.begin() + cur_,
+                                data_indices_.begin() + cur_ + batch_size_);
+  image_loader_.Prefetch(indices, bucket.height, bucket.width);
+}
 
-  for (auto index : batch_indices_) {
-    // image is loaded with padding
-    auto image_desc =
-        image_db_->GetImage(index, short_side_len_, long_side_len_);
+void TrainIter::FillData() {
+  // Images are decoded by the loader tasks. Every image has fixed slices of
+  // the buffers, so images of the batch are written in parallel in place.
+  // gt_boxes slices are padded with -1 after the image boxes.
+  raw_im_data_.assign(static_cast<size_t>(one_image_size_) * batch_size_, 0.f);
+  raw_im_info_data_.assign(3 * batch_size_, 0.f);
+  raw_gt_boxes_data_.assign(
+      static_cast<size_t>(batch_gt_boxes_count_) * 5 * batch_size_, -1.f);
+
+  // images are loaded with padding
+  auto images = image_loader_.Load(batch_indices_, im_height_, im_width_);
+#ifdef IMG_DEBUG_TEST
+  std::mutex debug_mutex;  // the images are written to the same file
+#endif
+  // the first error of the images is rethrown
+  utils::ParallelFor(0, batch_size_, [&](size_t i) {
+    auto& image_desc = images[i];
     // Fill image
-    auto array = CVToMxnetFormat(image_desc.image);
-    assert(array.size() <= one_image_size_);
-    raw_im_data_.insert(raw_im_data_.end(), array.begin(), array.end());
+    assert(image_desc.image.total() * 3 <= one_image_size_);
+    CVToMxnetFormat(image_desc.image,
+                    raw_im_data_.data() + i * one_image_size_);
 
     // Fill info
+    auto if_i = raw_im_info_data_.begin() + i * 3;
     *if_i++ = image_desc.height;
     *if_i++ = image_desc.width;
     *if_i++ = image_desc.scale;
@@ -118,6 +246,8 @@ void TrainIter::FillData() {
 #ifdef IMG_DEBUG_TEST
     cv::Mat imgCopy = image_desc.image.clone();
 #endif
+    auto b_i = raw_gt_boxes_data_.begin() +
+               static_cast<std::ptrdiff_t>(i) * batch_gt_boxes_count_ * 5;
     auto ic = image_desc.classes.begin();
     for (const auto& b : image_desc.boxes) {
       // sanitize box
@@ -147,28 +277,15 @@ void TrainIter::FillData() {
 #endif
     }
 #ifdef IMG_DEBUG_TEST
+    std::lock_guard<std::mutex> lock(debug_mutex);
     cv::imwrite("det.png", imgCopy);
 #endif
-    gt_boxes_pad_markers.push_back(
-        {raw_gt_boxes_data_.size(), image_desc.boxes.size()});
-  }
-
-  // Add padding to gt_boxes
-  size_t pad_pos = 0;
-  for (auto& pad_marker : gt_boxes_pad_markers) {
-    auto pad_size = batch_gt_boxes_count_ - pad_marker.second;
-    if (pad_size != 0) {
-      auto pos = raw_gt_boxes_data_.begin();
-      std::advance(pos, pad_marker.first + pad_pos);
-      raw_gt_boxes_data_.insert(pos, pad_size * 5, -1.f);
-      pad_pos += pad_size * 5;
-    }
-  }
+  });
 }
 
 void TrainIter::FillLabels() {
   // all stacked image share same anchors
-  auto anchors = anchor_generator_.Generate(feat_width_, feat_height_);
+  const auto& anchors = *bucket_anchors_[bucket_];
 #ifdef IMG_DEBUG_TEST
   cv::Mat img = cv::imread("det.png");
   for (Eigen::Index i = 0; i < anchors.rows(); ++i) {
@@ -182,126 +299,50 @@ void TrainIter::FillLabels() {
 #endif
 
   // prepare data bindings
-  raw_label_.resize(static_cast<size_t>(anchors.rows()) * batch_size_);
-  Eigen::Map<
-      Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>
-      label_map(raw_label_.data(), anchors.rows() * batch_size_, 1);
-
-  raw_bbox_target_.resize(
-      static_cast<size_t>(anchors.rows() * 4 * batch_size_));
-  Eigen::Map<
-      Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>
-      bbox_target_map(raw_bbox_target_.data(), anchors.rows() * batch_size_, 4);
-
-  raw_bbox_weight_.resize(
-      static_cast<size_t>(anchors.rows() * 4 * batch_size_));
-  Eigen::Map<
-      Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>
-      bbox_weight_map(raw_bbox_weight_.data(), anchors.rows() * batch_size_, 4);
+  auto rows = static_cast<size_t>(anchors.rows());
+  raw_label_.resize(rows * batch_size_);
+  raw_bbox_target_.resize(rows * 4 * batch_size_);
+  raw_bbox_weight_.resize(rows * 4 * batch_size_);
 
   // assign anchor according to their real size encoded in im_info
   auto all_boxes = Eigen::Map<
       Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>(
       raw_gt_boxes_data_.data(),
       static_cast<mx_uint>(raw_gt_boxes_data_.size() / 5), 5);
-  for (uint32_t i = 0, box_index = 0; i < batch_size_; ++i) {
+  // Images are assigned in parallel, each one writes its own rows
+  utils::ParallelFor(0, batch_size_, [&](size_t i) {
     auto im_width = raw_im_info_data_[i * 3 + 1];
     auto im_height = raw_im_info_data_[i * 3];
-    auto boxes = all_boxes.block(box_index, 0, batch_gt_boxes_count_, 4);
-    box_index += batch_gt_boxes_count_;
-
-    Eigen::MatrixXf b_label, b_bbox_target, b_bbox_weight;
-    std::tie(b_label, b_bbox_target, b_bbox_weight) =
-        anchor_sampler_.Assign(anchors, boxes, im_width, im_height);
+    auto boxes =
+        all_boxes.block(i * batch_gt_boxes_count_, 0, batch_gt_boxes_count_, 4);
 
     // Because we use fixed image size padding is not required - number of valid
     // anchors will be the same
-
-    label_map.block(i * anchors.rows(), 0, anchors.rows(), 1) = b_label;
-
-    bbox_target_map.block(i * anchors.rows(), 0, anchors.rows(), 4) =
-        b_bbox_target;
-    bbox_weight_map.block(i * anchors.rows(), 0, anchors.rows(), 4) =
-        b_bbox_weight;
-  }
-
-  // fix sizes
-  ReshapeLabels(static_cast<unsigned int>(label_map.rows()),
-                static_cast<unsigned int>(label_map.cols()));
-  ReshapeTargets(static_cast<unsigned int>(bbox_target_map.rows()),
-                 static_cast<unsigned int>(bbox_target_map.cols()));
-  ReshapeWeights(static_cast<unsigned int>(bbox_weight_map.rows()),
-                 static_cast<unsigned int>(bbox_weight_map.cols()));
+    anchor_sampler_.Assign(anchors, boxes, im_width, im_height,
+                           raw_label_.data() + i * rows,
+                           raw_bbox_target_.data() + i * rows * 4,
+                           raw_bbox_weight_.data() + i * rows * 4);
+  });
+
+  // Labels are already in the (batch, 1, anchors * height, width) layout,
+  // targets and weights are transposed from (batch, height * width, 4 *
+  // anchors) to (batch, 4 * anchors, height, width)
+  TransposeTargets(raw_bbox_target_);
+  TransposeTargets(raw_bbox_weight_);
 }
 
-void TrainIter::ReshapeLabels(unsigned int rows, unsigned int cols) {
-  using namespace mshadow;
-  try {
-    auto out_shape =
-        Shape4(batch_size_, 1, num_anchors_ * feat_height_, feat_width_);
-    TensorContainer<cpu, 4, float> x2(out_shape);
-    {
-      Tensor<cpu, 2, float> lables(raw_label_.data(), Shape2(rows, cols));
-      auto x1 = expr::reshape(
-          lables,
-          Shape4(batch_size_, num_anchors_ * feat_height_, feat_width_, 1));
-      x2 = expr::transpose(x1, Shape4(0, 3, 1, 2));
+void TrainIter::TransposeTargets(std::vector<float>& values) {
+  const size_t cells = feat_height_ * feat_width_;
+  const size_t channels = 4 * num_anchors_;
+  transpose_buffer_.resize(values.size());
+  for (size_t b = 0; b < batch_size_; ++b) {
+    const float* src = values.data() + b * cells * channels;
+    float* dst = transpose_buffer_.data() + b * cells * channels;
+    for (size_t i = 0; i < cells; ++i) {
+      for (size_t c = 0; c < channels; ++c)
+        dst[c * cells + i] = src[i * channels + c];
     }
-
-    // self test
-    // std::fill(raw_label_.begin(), raw_label_.end(), 0);
-
-    Tensor<cpu, 4, float> out_lables(raw_label_.data(), out_shape);
-    Copy(out_lables, x2);
-  } catch (const std::exception& ex) {
-    std::cout << ex.what() << std::endl;
-  }
-}
-void TrainIter::ReshapeTargets(unsigned int rows, unsigned int cols) {
-  using namespace mshadow;
-  try {
-    auto out_shape =
-        Shape4(batch_size_, 4 * num_anchors_, feat_height_, feat_width_);
-    TensorContainer<cpu, 4, float> x2(out_shape);
-    {
-      Tensor<cpu, 2, float> bbox_targets(raw_bbox_target_.data(),
-                                         Shape2(rows, cols));
-      auto x1 = expr::reshape(
-          bbox_targets,
-          Shape4(batch_size_, feat_height_, feat_width_, 4 * num_anchors_));
-      x2 = expr::transpose(x1, Shape4(0, 3, 1, 2));
-    }
-
-    // self test
-    // std::fill(raw_bbox_target_.begin(), raw_bbox_target_.end(), 0);
-
-    Tensor<cpu, 4, float> bbox_targets(raw_bbox_target_.data(), out_shape);
-    Copy(bbox_targets, x2);
-  } catch (const std::exception& ex) {
-    std::cout << ex.what() << std::endl;
-  }
-}
-void TrainIter::ReshapeWeights(unsigned int rows, unsigned int cols) {
-  using namespace mshadow;
-  try {
-    auto out_shape =
-        Shape4(batch_size_, 4 * num_anchors_, feat_height_, feat_width_);
-    TensorContainer<cpu, 4, float> x2(out_shape);
-    {
-      Tensor<cpu, 2, float> bbox_weights(raw_bbox_weight_.data(),
-                                         Shape2(rows, cols));
-      auto x1 = expr::reshape(
-          bbox_weights,
-          Shape4(batch_size_, feat_height_, feat_width_, 4 * num_anchors_));
-      x2 = expr::transpose(x1, Shape4(0, 3, 1, 2));
-    }
-
-    // self test
-    // std::fill(raw_bbox_target_.begin(), raw_bbox_target_.end(), 0);
-
-    Tensor<cpu, 4, float> bbox_weights(raw_bbox_weight_.data(), out_shape);
-    Copy(bbox_weights, x2);
-  } catch (const std::exception& ex) {
-    std::cout << ex.what() << std::endl;
   }
+  // the buffers keep their capacities
+  values.swap(transpose_buffer_);
 }
@@ -4,6 +4,7 @@
 #include "anchorgenerator.h"
 #include "anchorsampler.h"
 #include "imagedb.h"
+#include "imageloader.h"
 #include "params.h"
 
 #include <mxnet-cpp/MxNetCpp.h>
@@ -11,18 +12,49 @@
 #include <array>
 #include <random>
 
+// Training image shape and the size of the RPN feature map for it
+struct TrainBucket {
+  uint32_t height{0};
+  uint32_t width{0};
+  uint32_t feat_height{0};
+  uint32_t feat_width{0};
+};
+
+// Shapes of the arrays of a batch
+struct BatchShapes {
+  std::vector<mx_uint> im;
+  std::vector<mx_uint> im_info;
+  std::vector<mx_uint> gt_boxes;
+  std::vector<mx_uint> label;
+  std::vector<mx_uint> bbox_target;
+  std::vector<mx_uint> bbox_weight;
+};
+
+/* Every image goes to the bucket whose shape it fills best when it's resized
+ * to fit. Batches are made of images of the same bucket in the shuffled
+ * order, the rest of the images of a bucket is dropped in the epoch.
+ * With shards_num > 1 the iterator goes only through its shard of the
+ * batches. All shards shuffle the images in the same order and take every
+ * shards_num-th batch, they have the same size and don't overlap.
+ */
 class TrainIter {
  public:
   TrainIter(ImageDb* image_db,
             const Params& params,
-            uint32_t feat_height,
-            uint32_t feat_width);
+            const std::vector<TrainBucket>& buckets,
+            uint32_t shard = 0,
+            uint32_t shards_num = 1);
   TrainIter(const TrainIter&) = delete;
   TrainIter& operator=(const TrainIter&) = delete;
 
   uint32_t GetSize() const;
   uint32_t GetBatchCount() const;
 
+  size_t GetBucketsCount() const;
+  const BatchShapes& GetShapes(size_t bucket) const;
+  // Bucket of the current batch
+  size_t GetBucket() const;
+
   void Reset();
   bool Next();
 
@@ -34,29 +66,43 @@ class TrainIter {
                mxnet::cpp::NDArray& bbox_weight_arr);
 
  private:
+  void PrefetchNext();
   void FillData();
   void FillLabels();
-  void ReshapeLabels(unsigned int rows, unsigned int cols);
-  void ReshapeTargets(unsigned int rows, unsigned int cols);
-  void ReshapeWeights(unsigned int rows, unsigned int cols);
+  void TransposeTargets(std::vector<float>& values);
 
  private:
   ImageDb* image_db_{nullptr};
+  ImageLoader image_loader_;
   uint32_t batch_size_{0};
   uint32_t size_{0};
   uint32_t cur_{0};
+  uint32_t shard_{0};
+  uint32_t shards_num_{1};
+  uint32_t images_count_{0};
+
+  std::vector<TrainBucket> buckets_;
+  std::vector<BatchShapes> bucket_shapes_;
+  // anchors are the same for all images of a bucket
+  std::vector<std::shared_ptr<const Eigen::MatrixXf>> bucket_anchors_;
+  std::vector<uint8_t> image_buckets_;
+  size_t bucket_{0};
 
-  uint32_t short_side_len_{0};
-  uint32_t long_side_len_{0};
+  // shape of the current bucket
+  uint32_t im_height_{0};
+  uint32_t im_width_{0};
   uint32_t one_image_size_{0};
   uint32_t num_anchors_{0};
   uint32_t batch_gt_boxes_count_{0};
-  uint32_t feat_height_;
-  uint32_t feat_width_;
+  uint32_t feat_height_{0};
+  uint32_t feat_width_{0};
 
   size_t seed_ = 5675317;
   std::mt19937 random_engine_{seed_};
+  std::vector<uint32_t> all_indices_;
+  // images of the batches of the shard and their buckets
   std::vector<uint32_t> data_indices_;
+  std::vector<size_t> batch_buckets_;
   std::vector<uint32_t> batch_indices_{batch_size_};
 
   AnchorGenerator anchor_generator_;
@@ -71,6 +117,7 @@ class TrainIter {
   std::vector<float> raw_label_;
   std::vector<float> raw_bbox_target_;
   std::vector<float> raw_bbox_weight_;
+  std::vector<float> transpose_buffer_;
 };
 
 #endif  // TRAINITER_H
@@ -0,0 +1,99 @@
+#ifndef REGBENCH_H
+#define REGBENCH_H
+
+#include "perfstats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Benchmark harness shared by the regression samples, so the backends are
+ * timed on the same synthetic data and report in the same format. Every
+ * stage is one JSON line with the time, the throughput in rows per second,
+ * the heap allocations of the stage and the peak resident memory of the
+ * process after it (see perfstats.h), the lines of all the backends can be
+ * appended to one file, see bench_regression.sh.
+ */
+namespace utils {
+
+// Rows like web_traffic.tsv: hours and a growing noisy number of hits
+template <typename T>
+std::pair<std::vector<T>, std::vector<T>> SyntheticRegressionData(
+    size_t rows,
+    unsigned seed = 25345) {
+  std::mt19937 generator(seed);
+  std::normal_distribution<double> noise(0, 200);
+  std::pair<std::vector<T>, std::vector<T>> data;
+  data.first.resize(rows);
+  data.second.resize(rows);
+  const double step = rows > 1 ? 743. / static_cast<double>(rows - 1) : 1;
+  for (size_t r = 0; r < rows; ++r) {
+    double x = static_cast<double>(r) * step;
+    data.first[r] = static_cast<T>(x);
+    data.second[r] = static_cast<T>(1500 + 0.000015 * x * x * x +
+                                    300 * std::sin(x / 24) + noise(generator));
+  }
+  // the samples train on the shuffled data, the same seed gives the same
+  // permutation
+  std::shuffle(data.first.begin(), data.first.end(), std::mt19937(seed));
+  std::shuffle(data.second.begin(), data.second.end(), std::mt19937(seed));
+  return data;
+}
+
+class BenchReport {
+ public:
+  // An empty file name writes the lines to stdout
+  BenchReport(std::string backend,
+              size_t rows,
+              size_t degree,
+              const std::string& file_name)
+      : backend_(std::move(backend)), rows_(rows), degree_(degree) {
+    if (!file_name.empty()) {
+      file_.open(file_name, std::ios::app);
+      if (!file_)
+        throw std::runtime_error(file_name + " file can't be opened");
+    }
+  }
+
+  // Times f, which must finish its work before it returns, the asynchronous
+  // devices have to be synchronized inside
+  template <typename F>
+  double Measure(const std::string& stage, F f) {
+    auto allocations = AllocationCount();
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    Write(stage, elapsed.count(), AllocationCount() - allocations);
+    return elapsed.count();
+  }
+
+ private:
+  void Write(const std::string& stage, double ms, uint64_t allocations) {
+    std::ostream& out = file_.is_open() ? file_ : std::cout;
+    out << "{\"backend\":\"" << backend_ << "\",\"rows\":" << rows_
+        << ",\"degree\":" << degree_ << ",\"stage\":\"" << stage
+        << "\",\"ms\":" << ms << ",\"rows_per_s\":"
+        << (ms > 0 ? static_cast<double>(rows_) / ms * 1000 : 0)
+        << ",\"allocations\":" << allocations
+        << ",\"peak_rss_mb\":" << PeakMemoryMb() << "}" << std::endl;
+  }
+
+  std::string backend_;
+  size_t rows_{0};
+  size_t degree_{0};
+  std::ofstream file_;
+};
+
+}  // namespace utils
+
+#endif  // REGBENCH_H
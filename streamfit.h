@@ -0,0 +1,251 @@
+#ifndef STREAMFIT_H
+#define STREAMFIT_H
+
+#include "threadpool.h"
+#include "tsvloader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Fit of the polynomial regression over TSV files which don't fit in memory.
+ * The file is mapped and split into ranges on the line bounds parsed in
+ * parallel, as in tsvloader.h, every range is reduced into sufficient
+ * statistics and the results are merged, so the memory doesn't depend on the
+ * file size. The first pass gets the moments of x and y for the
+ * standardization, the second one sums the powers of the standardized x, then
+ * the normal equation is solved once.
+ */
+namespace utils {
+
+// Reduces the (x, y) rows of a TSV file in parallel: every range gets its own
+// accumulator from make(), row(acc, x, y) adds the rows of the range to it
+// and the accumulators are merged with Acc::Merge. The rows which aren't two
+// finite numbers are skipped, the same as in LoadTsv.
+template <typename Acc, typename MakeAcc, typename RowFn>
+Acc ReduceTsv(const std::string& path,
+              size_t threads,
+              MakeAcc make,
+              RowFn row) {
+  detail::MappedFile file(path);
+  Acc result = make();
+  if (file.size() == 0)
+    return result;
+  auto bounds =
+      detail::SplitLines(file.data(), file.data() + file.size(), threads);
+  std::vector<std::future<Acc>> parts;
+  for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+    auto begin = bounds[i];
+    auto end = bounds[i + 1];
+    parts.push_back(utils::Async([begin, end, &make, &row]() {
+      Acc acc = make();
+      for (auto line = begin; line < end;) {
+        auto line_end = static_cast<const char*>(
+            std::memchr(line, '\n', static_cast<size_t>(end - line)));
+        if (line_end == nullptr)
+          line_end = end;
+        auto tab = std::find(line, line_end, '\t');
+        double x = 0, y = 0;
+        if (tab != line_end && std::find(tab + 1, line_end, '\t') == line_end &&
+            detail::ParseField(line, tab, x) &&
+            detail::ParseField(tab + 1, line_end, y))
+          row(acc, x, y);
+        line = line_end + 1;
+      }
+      return acc;
+    }));
+  }
+  for (auto& part : parts)
+    result.Merge(utils::DefaultPool().Wait(part));
+  return result;
+}
+
+// Count, mean, variance and range of values, Welford's method, partial
+// results are merged with Chan's formula
+struct RunningMoments {
+  void Add(double v) {
+    ++count;
+    auto delta = v - mean;
+    mean += delta / static_cast<double>(count);
+    m2 += delta * (v - mean);
+    min = std::min(min, v);
+    max = std::max(max, v);
+  }
+
+  void Merge(const RunningMoments& other) {
+    if (other.count == 0)
+      return;
+    auto n = static_cast<double>(count + other.count);
+    auto delta = other.mean - mean;
+    mean += delta * static_cast<double>(other.count) / n;
+    m2 += other.m2 +
+          delta * delta * static_cast<double>(count) *
+              static_cast<double>(other.count) / n;
+    count += other.count;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+
+  // Sample standard deviation as in the in memory standardization
+  double Sd() const {
+    return count > 1 ? std::sqrt(m2 / static_cast<double>(count - 1)) : 1;
+  }
+
+  size_t count{0};
+  double mean{0};
+  double m2{0};
+  double min{std::numeric_limits<double>::max()};
+  double max{std::numeric_limits<double>::lowest()};
+};
+
+// Sums of the powers p = [1, z, ..., z^(degree - 1)] over the rows: P^T*P,
+// P^T*y and y^T*y. Only the lower triangle of P^T*P is accumulated, Finish
+// mirrors it.
+struct PowerSums {
+  explicit PowerSums(size_t degree = 0)
+      : degree(degree), ptp(degree * degree, 0), pty(degree, 0), p(degree) {}
+
+  void Add(double z, double y) {
+    double v = 1;
+    for (size_t i = 0; i < degree; ++i) {
+      p[i] = v;
+      v *= z;
+    }
+    for (size_t i = 0; i < degree; ++i) {
+      pty[i] += p[i] * y;
+      double* row = ptp.data() + i * degree;
+      for (size_t j = 0; j <= i; ++j)
+        row[j] += p[i] * p[j];
+    }
+    yty += y * y;
+    ++count;
+  }
+
+  void Merge(const PowerSums& other) {
+    for (size_t i = 0; i < ptp.size(); ++i)
+      ptp[i] += other.ptp[i];
+    for (size_t i = 0; i < pty.size(); ++i)
+      pty[i] += other.pty[i];
+    yty += other.yty;
+    count += other.count;
+  }
+
+  void Finish() {
+    for (size_t i = 0; i < degree; ++i)
+      for (size_t j = i + 1; j < degree; ++j)
+        ptp[i * degree + j] = ptp[j * degree + i];
+  }
+
+  size_t degree{0};
+  size_t count{0};
+  std::vector<double> ptp;  // row major degree x degree
+  std::vector<double> pty;
+  double yty{0};
+
+ private:
+  std::vector<double> p;
+};
+
+struct StreamStats {
+  RunningMoments x;
+  RunningMoments y;
+  PowerSums sums;
+};
+
+// Moments of x and y, and sums of the powers of z = scale * (x - mx) / sdx
+// with y' = scale * (y - my) / sdy, two passes over the file
+inline StreamStats StreamPolynomialStats(const std::string& path,
+                                         size_t degree,
+                                         size_t threads,
+                                         double scale = 1) {
+  struct XYMoments {
+    void Merge(const XYMoments& other) {
+      x.Merge(other.x);
+      y.Merge(other.y);
+    }
+    RunningMoments x;
+    RunningMoments y;
+  };
+  auto moments = ReduceTsv<XYMoments>(
+      path, threads, []() { return XYMoments(); },
+      [](XYMoments& acc, double x, double y) {
+        acc.x.Add(x);
+        acc.y.Add(y);
+      });
+
+  StreamStats stats;
+  stats.x = moments.x;
+  stats.y = moments.y;
+  const double x_mean = stats.x.mean;
+  const double x_scale = scale / stats.x.Sd();
+  const double y_mean = stats.y.mean;
+  const double y_scale = scale / stats.y.Sd();
+  stats.sums = ReduceTsv<PowerSums>(
+      path, threads, [degree]() { return PowerSums(degree); },
+      [&](PowerSums& acc, double x, double y) {
+        acc.Add((x - x_mean) * x_scale, (y - y_mean) * y_scale);
+      });
+  stats.sums.Finish();
+  return stats;
+}
+
+// Mean squared error of the solution b of the normal equation from the sums
+// of its terms: (y^T*y - 2 * b^T*X^T*y + b^T*X^T*X*b) / n
+inline double NormalEquationCost(const std::vector<double>& xtx,
+                                 const std::vector<double>& xty,
+                                 double yty,
+                                 size_t count,
+                                 const std::vector<double>& b) {
+  const auto cols = b.size();
+  double cost = yty;
+  for (size_t i = 0; i < cols; ++i) {
+    double xtx_b = 0;
+    for (size_t j = 0; j < cols; ++j)
+      xtx_b += xtx[i * cols + j] * b[j];
+    cost += b[i] * (xtx_b - 2 * xty[i]);
+  }
+  return cost / static_cast<double>(std::max<size_t>(count, 1));
+}
+
+// Solves the normal equation a*b = rhs in place of rhs with the Cholesky
+// factorization of the row major matrix a, for the samples without a linear
+// algebra library on the host. Returns false when a isn't positive definite.
+inline bool SolveCholesky(std::vector<double> a, std::vector<double>& rhs) {
+  const auto n = rhs.size();
+  for (size_t j = 0; j < n; ++j) {
+    double d = a[j * n + j];
+    for (size_t k = 0; k < j; ++k)
+      d -= a[j * n + k] * a[j * n + k];
+    if (!(d > 0))
+      return false;
+    a[j * n + j] = std::sqrt(d);
+    for (size_t i = j + 1; i < n; ++i) {
+      double v = a[i * n + j];
+      for (size_t k = 0; k < j; ++k)
+        v -= a[i * n + k] * a[j * n + k];
+      a[i * n + j] = v / a[j * n + j];
+    }
+  }
+  // L*z = rhs, then L^T*b = z
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t k = 0; k < i; ++k)
+      rhs[i] -= a[i * n + k] * rhs[k];
+    rhs[i] /= a[i * n + i];
+  }
+  for (size_t i = n; i-- > 0;) {
+    for (size_t k = i + 1; k < n; ++k)
+      rhs[i] -= a[k * n + i] * rhs[k];
+    rhs[i] /= a[i * n + i];
+  }
+  return true;
+}
+
+}  // namespace utils
+
+#endif  // STREAMFIT_H
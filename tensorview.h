@@ -0,0 +1,271 @@
+#ifndef TENSORVIEW_H
+#define TENSORVIEW_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Strided views of the host memory of the libraries used by the samples, the
+ * pipelines pass the data between cv::Mat, torch tensors, mxnet NDArrays,
+ * Eigen and xtensor through them. A view is a pointer, a shape and strides in
+ * elements, the strides may be negative, so the permuted, sliced and
+ * reversed (BGR to RGB for example) layouts are views too. Data is copied
+ * only when the layouts differ: DenseData returns the pointer of a dense view
+ * as is, and CopyView moves the data of any view to any other one with one
+ * pass which writes the destination in its memory order and merges the
+ * dimensions dense in both views to one run, a memcpy when the types match.
+ *
+ * The adapters take the library objects as template parameters, so the
+ * header doesn't depend on the libraries and every sample includes it with
+ * the libraries it has.
+ */
+namespace utils {
+
+template <typename T>
+struct TensorView {
+  static const size_t kMaxDims = 4;
+
+  T* data{nullptr};
+  size_t dims{0};
+  std::array<ptrdiff_t, kMaxDims> shape{};
+  std::array<ptrdiff_t, kMaxDims> strides{};  // in elements
+
+  size_t size() const {
+    size_t size = dims > 0 ? 1 : 0;
+    for (size_t d = 0; d < dims; ++d)
+      size *= static_cast<size_t>(shape[d]);
+    return size;
+  }
+
+  // Row major without gaps
+  bool dense() const {
+    ptrdiff_t stride = 1;
+    for (size_t d = dims; d-- > 0;) {
+      if (shape[d] != 1 && strides[d] != stride)
+        return false;
+      stride *= shape[d];
+    }
+    return true;
+  }
+
+  // View of the dimensions in the order, order[i] is the dimension of this
+  // view which becomes the i-th one
+  TensorView Permute(std::initializer_list<size_t> order) const {
+    if (order.size() != dims)
+      throw std::invalid_argument("wrong number of the permuted dimensions");
+    TensorView result = *this;
+    size_t i = 0;
+    for (auto d : order) {
+      result.shape[i] = shape[d];
+      result.strides[i] = strides[d];
+      ++i;
+    }
+    return result;
+  }
+
+  // The indices of the dimension in the reverse order
+  TensorView Reverse(size_t dim) const {
+    TensorView result = *this;
+    if (shape[dim] > 0)
+      result.data += (shape[dim] - 1) * strides[dim];
+    result.strides[dim] = -strides[dim];
+    return result;
+  }
+
+  // [begin, end) of the dimension
+  TensorView Slice(size_t dim, ptrdiff_t begin, ptrdiff_t end) const {
+    if (begin < 0 || begin > end || end > shape[dim])
+      throw std::out_of_range("wrong view slice");
+    TensorView result = *this;
+    result.data += begin * strides[dim];
+    result.shape[dim] = end - begin;
+    return result;
+  }
+};
+
+template <typename T>
+TensorView<T> MakeView(T* data,
+                       std::initializer_list<ptrdiff_t> shape,
+                       std::initializer_list<ptrdiff_t> strides = {}) {
+  if (shape.size() > TensorView<T>::kMaxDims ||
+      (strides.size() != 0 && strides.size() != shape.size()))
+    throw std::invalid_argument("wrong view shape");
+  TensorView<T> view;
+  view.data = data;
+  view.dims = shape.size();
+  std::copy(shape.begin(), shape.end(), view.shape.begin());
+  if (strides.size() != 0) {
+    std::copy(strides.begin(), strides.end(), view.strides.begin());
+  } else {
+    ptrdiff_t stride = 1;
+    for (size_t d = view.dims; d-- > 0;) {
+      view.strides[d] = stride;
+      stride *= view.shape[d];
+    }
+  }
+  return view;
+}
+
+// Dense view of the data with the shape of the view
+template <typename T, typename Other>
+TensorView<T> MakeDenseView(T* data, const TensorView<Other>& other) {
+  TensorView<T> view;
+  view.data = data;
+  view.dims = other.dims;
+  view.shape = other.shape;
+  ptrdiff_t stride = 1;
+  for (size_t d = view.dims; d-- > 0;) {
+    view.strides[d] = stride;
+    stride *= view.shape[d];
+  }
+  return view;
+}
+
+// [rows, cols, channels] of a cv::Mat of T elements
+template <typename T, typename Mat>
+TensorView<T> CvMatView(Mat& mat) {
+  if (mat.elemSize1() != sizeof(T))
+    throw std::invalid_argument("cv::Mat elements aren't of the view type");
+  const auto element = static_cast<ptrdiff_t>(sizeof(T));
+  return MakeView(reinterpret_cast<T*>(mat.data),
+                  {mat.rows, mat.cols, mat.channels()},
+                  {static_cast<ptrdiff_t>(mat.step[0]) / element,
+                   static_cast<ptrdiff_t>(mat.step[1]) / element, 1});
+}
+
+// Any layout of a CPU torch tensor of T elements
+template <typename T, typename Tensor>
+TensorView<T> TorchView(Tensor& tensor) {
+  if (tensor.dim() > static_cast<int64_t>(TensorView<T>::kMaxDims))
+    throw std::invalid_argument("too many tensor dimensions for a view");
+  TensorView<T> view;
+  view.data = static_cast<T*>(tensor.data_ptr());
+  view.dims = static_cast<size_t>(tensor.dim());
+  for (size_t d = 0; d < view.dims; ++d) {
+    view.shape[d] = static_cast<ptrdiff_t>(tensor.size(d));
+    view.strides[d] = static_cast<ptrdiff_t>(tensor.stride(d));
+  }
+  return view;
+}
+
+// [rows, cols] of an Eigen matrix, map or block
+template <typename Matrix>
+auto EigenView(Matrix& matrix)
+    -> TensorView<std::remove_pointer_t<decltype(matrix.data())>> {
+  const auto inner = static_cast<ptrdiff_t>(matrix.innerStride());
+  const auto outer = static_cast<ptrdiff_t>(matrix.outerStride());
+  const bool row_major = Matrix::IsRowMajor;
+  return MakeView(matrix.data(),
+                  {static_cast<ptrdiff_t>(matrix.rows()),
+                   static_cast<ptrdiff_t>(matrix.cols())},
+                  {row_major ? outer : inner, row_major ? inner : outer});
+}
+
+namespace detail {
+template <typename Src, typename Dst>
+void CopyRun(const Src* src,
+             ptrdiff_t src_stride,
+             Dst* dst,
+             ptrdiff_t dst_stride,
+             ptrdiff_t size) {
+  if (src_stride == 1 && dst_stride == 1) {
+    if (std::is_same<std::remove_const_t<Src>, Dst>::value) {
+      std::memcpy(dst, src, static_cast<size_t>(size) * sizeof(Dst));
+    } else {
+      for (ptrdiff_t i = 0; i < size; ++i)
+        dst[i] = static_cast<Dst>(src[i]);
+    }
+  } else {
+    for (ptrdiff_t i = 0; i < size; ++i)
+      dst[i * dst_stride] = static_cast<Dst>(src[i * src_stride]);
+  }
+}
+
+template <typename Src, typename Dst>
+void CopyDims(const Src* src,
+              Dst* dst,
+              const ptrdiff_t* shape,
+              const ptrdiff_t* src_strides,
+              const ptrdiff_t* dst_strides,
+              size_t dims) {
+  if (dims == 1) {
+    CopyRun(src, src_strides[0], dst, dst_strides[0], shape[0]);
+    return;
+  }
+  for (ptrdiff_t i = 0; i < shape[0]; ++i) {
+    CopyDims(src + i * src_strides[0], dst + i * dst_strides[0], shape + 1,
+             src_strides + 1, dst_strides + 1, dims - 1);
+  }
+}
+}  // namespace detail
+
+// Copies the elements of src to dst of the same shape, converting them with
+// static_cast
+template <typename Src, typename Dst>
+void CopyView(const TensorView<Src>& src, const TensorView<Dst>& dst) {
+  if (src.dims != dst.dims ||
+      !std::equal(src.shape.begin(), src.shape.begin() + src.dims,
+                  dst.shape.begin()))
+    throw std::invalid_argument("copied views have different shapes");
+  if (src.size() == 0)
+    return;
+  // the dimensions from the largest destination stride, so the innermost
+  // loop writes the neighbouring elements
+  std::array<size_t, TensorView<Src>::kMaxDims> order{};
+  for (size_t d = 0; d < src.dims; ++d)
+    order[d] = d;
+  std::stable_sort(order.begin(), order.begin() + src.dims,
+                   [&dst](size_t a, size_t b) {
+                     return std::abs(dst.strides[a]) > std::abs(dst.strides[b]);
+                   });
+  std::array<ptrdiff_t, TensorView<Src>::kMaxDims> shape{};
+  std::array<ptrdiff_t, TensorView<Src>::kMaxDims> src_strides{};
+  std::array<ptrdiff_t, TensorView<Src>::kMaxDims> dst_strides{};
+  size_t dims = 0;
+  for (size_t i = 0; i < src.dims; ++i) {
+    auto d = order[i];
+    if (src.shape[d] == 1)
+      continue;
+    // the dimension continues the previous one in both views
+    if (dims > 0 &&
+        src_strides[dims - 1] == src.strides[d] * src.shape[d] &&
+        dst_strides[dims - 1] == dst.strides[d] * src.shape[d]) {
+      shape[dims - 1] *= src.shape[d];
+      src_strides[dims - 1] = src.strides[d];
+      dst_strides[dims - 1] = dst.strides[d];
+      continue;
+    }
+    shape[dims] = src.shape[d];
+    src_strides[dims] = src.strides[d];
+    dst_strides[dims] = dst.strides[d];
+    ++dims;
+  }
+  if (dims == 0) {  // a single element
+    *dst.data = static_cast<Dst>(*src.data);
+    return;
+  }
+  detail::CopyDims(src.data, dst.data, shape.data(), src_strides.data(),
+                   dst_strides.data(), dims);
+}
+
+// Pointer to the row major elements of the view, the data of a dense view of
+// the same type is used in place and the other views are copied to the buffer
+template <typename T, typename Src>
+const T* DenseData(const TensorView<Src>& view, std::vector<T>& buffer) {
+  if (std::is_same<std::remove_const_t<Src>, T>::value && view.dense())
+    return reinterpret_cast<const T*>(view.data);
+  buffer.resize(view.size());
+  CopyView(view, MakeDenseView(buffer.data(), view));
+  return buffer.data();
+}
+
+}  // namespace utils
+
+#endif  // TENSORVIEW_H
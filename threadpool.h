@@ -0,0 +1,322 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Task pool shared by the samples, so the loaders, the samplers and the
+ * evaluators don't start threads of their own and don't oversubscribe the
+ * cores. Every worker has a deque of tasks, a worker takes the newest task of
+ * its own deque and steals the oldest one of the others when it's empty.
+ * Tasks submitted from a worker go to its own deque, so the nested loops stay
+ * on the thread which started them. A thread waiting for a future of the pool
+ * with Wait runs the queued tasks meanwhile, so the nested waits don't block
+ * the workers. The long running loops, which sleep or wait for the other side
+ * of a queue, keep their own threads.
+ */
+namespace utils {
+
+// Bump allocator of one thread for the temporary buffers of the tasks. The
+// memory is reused after the Scope made before the allocation ends, so the
+// buffers of a task aren't allocated again by the next task of the thread.
+// The allocated objects aren't constructed and destructed, use it for the
+// trivial types.
+class ScratchArena {
+ public:
+  class Scope {
+   public:
+    explicit Scope(ScratchArena& arena)
+        : arena_(arena), block_(arena.block_), offset_(arena.offset_) {}
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope() {
+      arena_.block_ = block_;
+      arena_.offset_ = offset_;
+    }
+
+   private:
+    ScratchArena& arena_;
+    size_t block_{0};
+    size_t offset_{0};
+  };
+
+  template <typename T>
+  T* Allocate(size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "the arena doesn't call the destructors");
+    return static_cast<T*>(AllocateBytes(count * sizeof(T), alignof(T)));
+  }
+
+  size_t reserved() const {
+    size_t bytes = 0;
+    for (const auto& block : blocks_)
+      bytes += block.size;
+    return bytes;
+  }
+
+ private:
+  struct Block {
+    std::unique_ptr<unsigned char[]> data;
+    size_t size{0};
+  };
+
+  void* AllocateBytes(size_t bytes, size_t alignment) {
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    while (block_ < blocks_.size()) {
+      auto& block = blocks_[block_];
+      auto begin = reinterpret_cast<size_t>(block.data.get());
+      auto aligned = (begin + offset_ + alignment - 1) / alignment * alignment;
+      if (aligned + bytes <= begin + block.size) {
+        offset_ = aligned + bytes - begin;
+        return reinterpret_cast<void*>(aligned);
+      }
+      // the rest of the block stays unused until the scope ends
+      ++block_;
+      offset_ = 0;
+    }
+    Block block;
+    block.size = std::max(
+        {bytes + alignment, blocks_.empty() ? 0 : blocks_.back().size * 2,
+         kMinBlockSize});
+    block.data.reset(new unsigned char[block.size]);
+    blocks_.push_back(std::move(block));
+    block_ = blocks_.size() - 1;
+    return AllocateBytes(bytes, alignment);
+  }
+
+  static const size_t kMinBlockSize = 1 << 16;
+
+  std::vector<Block> blocks_;
+  size_t block_{0};   // block of the next allocation
+  size_t offset_{0};  // used bytes of the block
+};
+
+class ThreadPool {
+ public:
+  // With zero workers the tasks are run by the waiting threads
+  explicit ThreadPool(size_t workers_num) : queues_(workers_num + 1) {
+    for (auto& queue : queues_)
+      queue.reset(new Queue);
+    for (size_t i = 0; i < workers_num; ++i)
+      workers_.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_)
+      worker.join();
+  }
+
+  // Workers and the calling thread, the parallelism of ParallelFor
+  size_t size() const { return workers_.size() + 1; }
+
+  template <typename F>
+  auto Submit(F&& f) -> std::future<decltype(f())> {
+    using Result = decltype(f());
+    auto task =
+        std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+    auto result = task->get_future();
+    Push([task]() { (*task)(); });
+    return result;
+  }
+
+  // Runs the queued tasks until the future is ready and returns its value
+  template <typename R>
+  R Wait(std::future<R>& future) {
+    while (future.wait_for(std::chrono::seconds(0)) !=
+           std::future_status::ready) {
+      if (!RunOne())
+        future.wait_for(std::chrono::microseconds(100));
+    }
+    return future.get();
+  }
+
+  // Calls f(i) for i in [begin, end), the range is taken by the chunks of
+  // grain indices, blocks until all calls are done and rethrows the first
+  // error
+  template <typename F>
+  void ParallelFor(size_t begin, size_t end, F&& f, size_t grain = 1) {
+    if (begin >= end)
+      return;
+    grain = std::max<size_t>(grain, 1);
+    const auto chunks = (end - begin + grain - 1) / grain;
+    std::atomic<size_t> next{0};
+    auto run = [&]() {
+      try {
+        for (auto chunk = next.fetch_add(1); chunk < chunks;
+             chunk = next.fetch_add(1)) {
+          auto first = begin + chunk * grain;
+          auto last = std::min(first + grain, end);
+          for (auto i = first; i < last; ++i)
+            f(i);
+        }
+      } catch (...) {
+        next.store(chunks);  // the other threads skip the rest
+        throw;
+      }
+    };
+    // the helpers which start after the range is taken return at once
+    std::vector<std::future<void>> helpers;
+    for (size_t i = 1; i < std::min(chunks, size()); ++i)
+      helpers.push_back(Submit(run));
+    std::exception_ptr error;
+    try {
+      run();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    for (auto& helper : helpers) {
+      try {
+        Wait(helper);
+      } catch (...) {
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  // Arena of the calling thread
+  static ScratchArena& Scratch() {
+    static thread_local ScratchArena arena;
+    return arena;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  // Index of the queue of the calling worker, the last queue is shared by the
+  // other threads
+  size_t OwnQueue() const {
+    return Current().first == this ? Current().second : workers_.size();
+  }
+
+  static std::pair<const ThreadPool*, size_t>& Current() {
+    static thread_local std::pair<const ThreadPool*, size_t> current{nullptr,
+                                                                     0};
+    return current;
+  }
+
+  void Push(std::function<void()> task) {
+    auto& queue = *queues_[OwnQueue()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++queued_;
+    }
+    cv_.notify_one();
+  }
+
+  bool Pop(size_t index, bool newest, std::function<void()>& task) {
+    auto& queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      return false;
+    if (newest) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    return true;
+  }
+
+  // Runs one task of the own queue or a stolen one, false if all the queues
+  // are empty
+  bool RunOne() {
+    const auto own = OwnQueue();
+    std::function<void()> task;
+    bool found = Pop(own, true, task);
+    for (size_t i = 1; !found && i < queues_.size(); ++i)
+      found = Pop((own + i) % queues_.size(), false, task);
+    if (!found)
+      return false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --queued_;
+    }
+    task();  // packaged_task keeps the exceptions in the future
+    return true;
+  }
+
+  void WorkerLoop(size_t index) {
+    Current() = {this, index};
+    while (true) {
+      if (RunOne())
+        continue;
+      std::unique_lock<std::mutex> lock(mutex_);
+      // a task is counted after it's queued, so the count may be ahead of
+      // the queues for a moment, the wait ends and the loop tries again
+      cv_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0)
+        return;
+      if (queued_ > 0) {
+        lock.unlock();
+        if (!RunOne())
+          std::this_thread::yield();
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t queued_{0};
+  bool stop_{false};
+  std::vector<std::thread> workers_;
+};
+
+// Pool of the process, MLCPP_THREADS sets the parallelism, the hardware
+// concurrency by default
+inline ThreadPool& DefaultPool() {
+  static ThreadPool pool([]() -> size_t {
+    const char* env = std::getenv("MLCPP_THREADS");
+    long threads = env != nullptr ? std::atol(env) : 0;
+    if (threads <= 0)
+      threads = static_cast<long>(std::thread::hardware_concurrency());
+    return static_cast<size_t>(std::max(threads, 1L)) - 1;
+  }());
+  return pool;
+}
+
+template <typename F>
+auto Async(F&& f) {
+  return DefaultPool().Submit(std::forward<F>(f));
+}
+
+template <typename F>
+void ParallelFor(size_t begin, size_t end, F&& f, size_t grain = 1) {
+  DefaultPool().ParallelFor(begin, end, std::forward<F>(f), grain);
+}
+
+}  // namespace utils
+
+#endif  // THREADPOOL_H
@@ -0,0 +1,465 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef WITH_TRACE_CUDA
+#include <cuda_runtime_api.h>
+#endif
+
+/*
+ * Trace of the hot paths of the samples: scoped zones, counters and GPU
+ * zones timed with CUDA events, written as a Chrome trace JSON file for
+ * chrome://tracing and ui.perfetto.dev.
+ *
+ * The macros record nothing unless WITH_TRACE is defined, then the events
+ * are recorded when the MLCPP_TRACE environment variable names the trace
+ * file, which is written at the exit, or after Enable(true). Every thread
+ * appends its events to its own buffer of chunks without locks, WriteTrace
+ * takes the events recorded since the previous write from all the buffers.
+ * GPU zones need WITH_TRACE_CUDA too, their events are read by WriteTrace,
+ * so the zones don't synchronize the host with the GPU, without it they are
+ * host zones. The times are of steady_clock, which is shared by the
+ * processes of a host, so the traces of the samples run on the same machine
+ * are one timeline when their traceEvents arrays are concatenated.
+ * Zone and counter names have to be literals.
+ */
+namespace utils {
+namespace trace {
+
+enum class EventKind : uint8_t { kZone, kCounter, kGpuZone };
+
+struct Event {
+  const char* name{nullptr};
+  EventKind kind{EventKind::kZone};
+  int64_t start{0};  // steady_clock nanoseconds
+  int64_t duration{0};
+  double value{0};  // of the counters
+  // CUDA events of the GPU zones
+  void* gpu_start{nullptr};
+  void* gpu_end{nullptr};
+};
+
+inline bool WriteTrace(const std::string& file_name);
+
+namespace detail {
+
+inline int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+const size_t kChunkSize = 4096;
+// Events kept for a thread between the writes, the later ones are dropped
+const size_t kMaxChunks = 256;
+
+struct Chunk {
+  std::array<Event, kChunkSize> events;
+  std::atomic<size_t> size{0};
+  std::atomic<Chunk*> next{nullptr};
+};
+
+// Events of one thread, pushed only by the thread and taken only by the
+// writer. A chunk is published by its size, a full chunk by the next one, so
+// the writer frees the chunks the thread doesn't use anymore.
+class Buffer {
+ public:
+  explicit Buffer(int tid) : tid_(tid), head_(new Chunk), tail_(head_) {}
+  Buffer(const Buffer&) = delete;
+  Buffer& operator=(const Buffer&) = delete;
+  ~Buffer() {
+    while (head_ != nullptr) {
+      auto* next = head_->next.load();
+      delete head_;
+      head_ = next;
+    }
+  }
+
+  void Push(const Event& event) {
+    auto size = tail_->size.load(std::memory_order_relaxed);
+    if (size == kChunkSize) {
+      if (chunks_.load(std::memory_order_relaxed) >= kMaxChunks) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      auto* chunk = new Chunk;
+      chunks_.fetch_add(1, std::memory_order_relaxed);
+      tail_->next.store(chunk, std::memory_order_release);
+      tail_ = chunk;
+      size = 0;
+    }
+    tail_->events[size] = event;
+    tail_->size.store(size + 1, std::memory_order_release);
+  }
+
+  // Calls f for the events pushed since the previous call
+  template <typename F>
+  void Take(F&& f) {
+    while (true) {
+      // the size of a chunk with the next one doesn't change
+      auto* next = head_->next.load(std::memory_order_acquire);
+      auto size = head_->size.load(std::memory_order_acquire);
+      for (; taken_ < size; ++taken_)
+        f(head_->events[taken_]);
+      if (next == nullptr)
+        break;
+      delete head_;
+      head_ = next;
+      taken_ = 0;
+      chunks_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  int tid() const { return tid_; }
+  size_t TakeDropped() { return dropped_.exchange(0); }
+
+  std::atomic<const char*> name{nullptr};
+  std::atomic<bool> alive{true};
+
+ private:
+  const int tid_;
+  Chunk* head_{nullptr};  // of the writer
+  size_t taken_{0};
+  Chunk* tail_{nullptr};  // of the thread
+  std::atomic<size_t> chunks_{1};
+  std::atomic<size_t> dropped_{0};
+};
+
+struct Registry {
+  std::mutex mutex;  // of the registration and the writes, not the events
+  std::vector<std::shared_ptr<Buffer>> buffers;
+  int next_tid{1};
+};
+
+// Never destroyed, the threads may push events after the static destructors
+inline Registry& GetRegistry() {
+  static auto* registry = new Registry;
+  return *registry;
+}
+
+inline Buffer& ThreadBuffer() {
+  struct Holder {
+    Holder() {
+      auto& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      buffer = std::make_shared<Buffer>(registry.next_tid++);
+      registry.buffers.push_back(buffer);
+    }
+    ~Holder() { buffer->alive.store(false); }
+    std::shared_ptr<Buffer> buffer;
+  };
+  static thread_local Holder holder;
+  return *holder.buffer;
+}
+
+inline void WriteAtExit() {
+  static std::atomic<bool> written{false};
+  if (written.exchange(true))
+    return;
+  const char* file_name = std::getenv("MLCPP_TRACE");
+  if (file_name != nullptr && !WriteTrace(file_name))
+    std::cerr << "Failed to write the trace " << file_name << std::endl;
+}
+
+inline std::atomic<bool>& EnabledFlag() {
+  static std::atomic<bool> enabled([]() {
+    if (std::getenv("MLCPP_TRACE") == nullptr)
+      return false;
+    std::atexit(WriteAtExit);
+    return true;
+  }());
+  return enabled;
+}
+
+inline std::string Escape(const char* text) {
+  std::string result;
+  for (; text != nullptr && *text != '\0'; ++text) {
+    if (*text == '"' || *text == '\\')
+      result += '\\';
+    if (static_cast<unsigned char>(*text) >= 0x20)
+      result += *text;
+  }
+  return result;
+}
+
+inline std::string Microseconds(int64_t nanoseconds) {
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.3f",
+                static_cast<double>(nanoseconds) / 1000.0);
+  return text;
+}
+
+// GPU zones of a thread are on their own track
+const int kGpuTrack = 1 << 16;
+
+#ifdef WITH_TRACE_CUDA
+// Event recorded with the host time when the GPU passed it, the GPU zones are
+// placed on the host timeline by their time from it
+struct GpuOrigin {
+  cudaEvent_t event{nullptr};
+  int64_t host{0};
+};
+
+inline const GpuOrigin& GetGpuOrigin() {
+  static GpuOrigin origin = []() {
+    GpuOrigin origin;
+    if (cudaEventCreate(&origin.event) == cudaSuccess &&
+        cudaEventRecord(origin.event, nullptr) == cudaSuccess &&
+        cudaEventSynchronize(origin.event) == cudaSuccess) {
+      origin.host = Now();
+    } else {
+      origin.event = nullptr;
+    }
+    // registered after the CUDA runtime, so the trace is written before the
+    // runtime is torn down
+    if (std::getenv("MLCPP_TRACE") != nullptr)
+      std::atexit(WriteAtExit);
+    return origin;
+  }();
+  return origin;
+}
+
+// Replaces the host times of the GPU zone with the GPU ones, false if the
+// GPU times aren't available, on another device for example
+inline bool ReadGpuTimes(Event& event) {
+  auto start = static_cast<cudaEvent_t>(event.gpu_start);
+  auto end = static_cast<cudaEvent_t>(event.gpu_end);
+  const auto& origin = GetGpuOrigin();
+  float start_ms = 0;
+  float end_ms = 0;
+  bool done = origin.event != nullptr &&
+              cudaEventSynchronize(end) == cudaSuccess &&
+              cudaEventElapsedTime(&start_ms, origin.event, start) ==
+                  cudaSuccess &&
+              cudaEventElapsedTime(&end_ms, origin.event, end) == cudaSuccess;
+  cudaEventDestroy(start);
+  cudaEventDestroy(end);
+  if (!done) {
+    cudaGetLastError();  // the failed calls don't fail the next ones
+    return false;
+  }
+  event.start = origin.host + static_cast<int64_t>(start_ms * 1e6);
+  event.duration = static_cast<int64_t>((end_ms - start_ms) * 1e6);
+  return true;
+}
+#endif
+
+}  // namespace detail
+
+inline bool Enabled() {
+  return detail::EnabledFlag().load(std::memory_order_relaxed);
+}
+
+inline void Enable(bool enabled) {
+  detail::EnabledFlag().store(enabled);
+}
+
+// Name of the thread in the trace
+inline void SetThreadName(const char* name) {
+  detail::ThreadBuffer().name.store(name);
+}
+
+inline void Counter(const char* name, double value) {
+  if (!Enabled())
+    return;
+  Event event;
+  event.name = name;
+  event.kind = EventKind::kCounter;
+  event.start = detail::Now();
+  event.value = value;
+  detail::ThreadBuffer().Push(event);
+}
+
+// Times the zone from the construction till the destruction
+class Zone {
+ public:
+  explicit Zone(const char* name)
+      : name_(name), start_(Enabled() ? detail::Now() : 0) {}
+  Zone(const Zone&) = delete;
+  Zone& operator=(const Zone&) = delete;
+  ~Zone() {
+    if (start_ == 0)
+      return;
+    Event event;
+    event.name = name_;
+    event.start = start_;
+    event.duration = detail::Now() - start_;
+    detail::ThreadBuffer().Push(event);
+  }
+
+ private:
+  const char* name_{nullptr};
+  int64_t start_{0};
+};
+
+#ifdef WITH_TRACE_CUDA
+// Times the work queued on the stream by the zone, besides the host time of
+// the zone. Without on_gpu it's a host zone.
+class GpuZone {
+ public:
+  GpuZone(const char* name, bool on_gpu, cudaStream_t stream)
+      : name_(name), stream_(stream) {
+    if (!Enabled())
+      return;
+    start_ = detail::Now();
+    if (!on_gpu)
+      return;
+    detail::GetGpuOrigin();
+    if (cudaEventCreate(&start_event_) != cudaSuccess ||
+        cudaEventRecord(start_event_, stream_) != cudaSuccess) {
+      ReleaseEvents();
+      start_event_ = nullptr;
+    }
+  }
+  GpuZone(const GpuZone&) = delete;
+  GpuZone& operator=(const GpuZone&) = delete;
+  ~GpuZone() {
+    if (start_ == 0)
+      return;
+    Event event;
+    event.name = name_;
+    event.start = start_;
+    event.duration = detail::Now() - start_;
+    if (start_event_ != nullptr) {
+      if (cudaEventCreate(&end_event_) == cudaSuccess &&
+          cudaEventRecord(end_event_, stream_) == cudaSuccess) {
+        event.kind = EventKind::kGpuZone;
+        event.gpu_start = start_event_;
+        event.gpu_end = end_event_;
+      } else {
+        ReleaseEvents();
+      }
+    }
+    detail::ThreadBuffer().Push(event);
+  }
+
+ private:
+  void ReleaseEvents() {
+    for (auto cuda_event : {start_event_, end_event_}) {
+      if (cuda_event != nullptr)
+        cudaEventDestroy(cuda_event);
+    }
+    cudaGetLastError();
+  }
+
+  const char* name_{nullptr};
+  cudaStream_t stream_{nullptr};
+  int64_t start_{0};
+  cudaEvent_t start_event_{nullptr};
+  cudaEvent_t end_event_{nullptr};
+};
+#endif
+
+// Writes the events recorded since the previous write, false if the file
+// can't be written
+inline bool WriteTrace(const std::string& file_name) {
+  auto& registry = detail::GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  std::ofstream file(file_name);
+  if (!file)
+    return false;
+  const auto pid = std::to_string(getpid());
+  file.precision(10);
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+       << ",\"args\":{\"name\":\""
+       << detail::Escape(program_invocation_short_name) << "\"}}";
+  auto write_thread_name = [&](int tid, const std::string& name) {
+    file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+         << ",\"tid\":" << tid << ",\"args\":{\"name\":\"" << name << "\"}}";
+  };
+  auto write_zone = [&](const Event& event, int tid) {
+    file << ",\n{\"name\":\"" << detail::Escape(event.name)
+         << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << tid
+         << ",\"ts\":" << detail::Microseconds(event.start)
+         << ",\"dur\":" << detail::Microseconds(event.duration) << "}";
+  };
+  for (auto i = registry.buffers.begin(); i != registry.buffers.end();) {
+    auto& buffer = **i;
+    const auto tid = buffer.tid();
+    const char* name = buffer.name.load();
+    const auto thread_name = name != nullptr ? detail::Escape(name)
+                                             : "thread " + std::to_string(tid);
+    write_thread_name(tid, thread_name);
+#ifdef WITH_TRACE_CUDA
+    bool gpu_track = false;
+#endif
+    // a finished thread pushes nothing after its events are taken
+    const bool alive = buffer.alive.load();
+    buffer.Take([&](Event event) {
+      switch (event.kind) {
+        case EventKind::kZone:
+          write_zone(event, tid);
+          break;
+        case EventKind::kCounter:
+          file << ",\n{\"name\":\"" << detail::Escape(event.name)
+               << "\",\"ph\":\"C\",\"pid\":" << pid << ",\"tid\":" << tid
+               << ",\"ts\":" << detail::Microseconds(event.start)
+               << ",\"args\":{\"value\":" << event.value << "}}";
+          break;
+        case EventKind::kGpuZone:
+          write_zone(event, tid);
+#ifdef WITH_TRACE_CUDA
+          if (detail::ReadGpuTimes(event)) {
+            if (!gpu_track)
+              write_thread_name(tid + detail::kGpuTrack, thread_name + " gpu");
+            gpu_track = true;
+            write_zone(event, tid + detail::kGpuTrack);
+          }
+#endif
+          break;
+      }
+    });
+    if (auto dropped = buffer.TakeDropped())
+      std::cerr << "Trace dropped " << dropped << " events of " << thread_name
+                << std::endl;
+    i = alive ? i + 1 : registry.buffers.erase(i);
+  }
+  file << "\n]}\n";
+  return static_cast<bool>(file);
+}
+
+}  // namespace trace
+}  // namespace utils
+
+#define MLCPP_TRACE_CONCAT_(a, b) a##b
+#define MLCPP_TRACE_CONCAT(a, b) MLCPP_TRACE_CONCAT_(a, b)
+
+#ifdef WITH_TRACE
+#define MLCPP_TRACE_ZONE(name) \
+  ::utils::trace::Zone MLCPP_TRACE_CONCAT(trace_zone_, __COUNTER__)(name)
+#define MLCPP_TRACE_COUNTER(name, value) \
+  ::utils::trace::Counter(name, static_cast<double>(value))
+#define MLCPP_TRACE_THREAD(name) ::utils::trace::SetThreadName(name)
+#ifdef WITH_TRACE_CUDA
+// The stream is evaluated only with on_gpu, so it may be the current stream
+// of the device of a tensor which may be on the CPU
+#define MLCPP_TRACE_GPU_ZONE(name, on_gpu, stream)                     \
+  ::utils::trace::GpuZone MLCPP_TRACE_CONCAT(trace_zone_, __COUNTER__)( \
+      name, (on_gpu), (on_gpu) ? (stream) : cudaStream_t{})
+#else
+#define MLCPP_TRACE_GPU_ZONE(name, on_gpu, stream) MLCPP_TRACE_ZONE(name)
+#endif
+#else
+#define MLCPP_TRACE_ZONE(name) static_cast<void>(0)
+#define MLCPP_TRACE_COUNTER(name, value) static_cast<void>(0)
+#define MLCPP_TRACE_THREAD(name) static_cast<void>(0)
+#define MLCPP_TRACE_GPU_ZONE(name, on_gpu, stream) static_cast<void>(0)
+#endif
+
+#endif  // TRACE_H
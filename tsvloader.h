@@ -0,0 +1,213 @@
+#ifndef TSVLOADER_H
+#define TSVLOADER_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Loader of numeric TSV files shared by the samples. The file is mapped into
+ * the memory and split into ranges on line bounds, the ranges are parsed in
+ * parallel into columns. Rows with a wrong number of fields or with fields
+ * which aren't numbers are counted and skipped without exceptions, empty
+ * lines are ignored.
+ */
+namespace utils {
+
+template <typename DType>
+struct TsvColumns {
+  size_t rows() const { return columns.empty() ? 0 : columns[0].size(); }
+
+  // Shuffles all the columns with one permutation of the rows
+  void Shuffle(size_t seed) {
+    std::vector<size_t> permutation(rows());
+    std::iota(permutation.begin(), permutation.end(), 0);
+    std::shuffle(permutation.begin(), permutation.end(),
+                 std::default_random_engine(seed));
+    for (auto& column : columns) {
+      std::vector<DType> shuffled(column.size());
+      for (size_t i = 0; i < permutation.size(); ++i)
+        shuffled[i] = column[permutation[i]];
+      column.swap(shuffled);
+    }
+  }
+
+  std::vector<std::vector<DType>> columns;
+  size_t invalid_rows{0};
+};
+
+namespace detail {
+// Read only mapping of a whole file
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0)
+      throw std::runtime_error(path + " file can't be opened");
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      close(fd_);
+      throw std::runtime_error(path + " file can't be read");
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+      auto data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (data == MAP_FAILED) {
+        close(fd_);
+        throw std::runtime_error(path + " file can't be mapped");
+      }
+      data_ = static_cast<const char*>(data);
+      madvise(data, size_, MADV_SEQUENTIAL);
+    }
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() {
+    if (data_ != nullptr)
+      munmap(const_cast<char*>(data_), size_);
+    close(fd_);
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  int fd_{-1};
+  const char* data_{nullptr};
+  size_t size_{0};
+};
+
+// Parses the field [begin, end) without the spaces around it, false when it
+// isn't a finite number, so the "nan" values of the data are skipped
+inline bool ParseField(const char* begin, const char* end, double& value) {
+  while (begin != end && *begin == ' ')
+    ++begin;
+  while (end != begin && (end[-1] == ' ' || end[-1] == '\r'))
+    --end;
+  // strtod needs the terminating zero, numbers are short
+  char buffer[64];
+  auto length = static_cast<size_t>(end - begin);
+  if (length == 0 || length >= sizeof(buffer))
+    return false;
+  std::memcpy(buffer, begin, length);
+  buffer[length] = 0;
+  char* parsed = nullptr;
+  value = std::strtod(buffer, &parsed);
+  return parsed == buffer + length && std::isfinite(value);
+}
+
+// Bounds of up to parts ranges of [data, data_end), the ranges start after
+// the line ends
+inline std::vector<const char*> SplitLines(const char* data,
+                                           const char* data_end,
+                                           size_t parts) {
+  std::vector<const char*> bounds{data};
+  parts = std::max<size_t>(parts, 1);
+  const auto size = static_cast<size_t>(data_end - data);
+  for (size_t i = 1; i < parts; ++i) {
+    auto pos = std::max(bounds.back(), data + size / parts * i);
+    auto line_end = static_cast<const char*>(
+        std::memchr(pos, '\n', static_cast<size_t>(data_end - pos)));
+    bounds.push_back(line_end != nullptr ? line_end + 1 : data_end);
+  }
+  bounds.push_back(data_end);
+  return bounds;
+}
+
+template <typename DType>
+TsvColumns<DType> ParseRange(const char* begin,
+                             const char* end,
+                             size_t columns_num) {
+  TsvColumns<DType> result;
+  result.columns.resize(columns_num);
+  std::vector<double> row(columns_num);
+  while (begin < end) {
+    auto line_end = static_cast<const char*>(
+        std::memchr(begin, '\n', static_cast<size_t>(end - begin)));
+    if (line_end == nullptr)
+      line_end = end;
+    if (line_end != begin && !(line_end - begin == 1 && *begin == '\r')) {
+      size_t fields = 0;
+      bool valid = true;
+      for (auto field = begin; valid && field <= line_end; ++fields) {
+        auto field_end = std::find(field, line_end, '\t');
+        valid = fields < columns_num &&
+                ParseField(field, field_end, row[fields]);
+        field = field_end + 1;
+      }
+      if (valid && fields == columns_num) {
+        for (size_t c = 0; c < columns_num; ++c)
+          result.columns[c].push_back(static_cast<DType>(row[c]));
+      } else {
+        ++result.invalid_rows;
+      }
+    }
+    begin = line_end + 1;
+  }
+  return result;
+}
+}  // namespace detail
+
+// Loads columns_num columns of a TSV file with threads parsing threads
+template <typename DType>
+TsvColumns<DType> LoadTsv(
+    const std::string& path,
+    size_t columns_num,
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u)) {
+  detail::MappedFile file(path);
+  if (file.size() == 0) {
+    TsvColumns<DType> result;
+    result.columns.resize(columns_num);
+    return result;
+  }
+  auto bounds = detail::SplitLines(file.data(), file.data() + file.size(),
+                                   threads);
+
+  std::vector<std::future<TsvColumns<DType>>> parts;
+  for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+    auto begin = bounds[i];
+    auto end = bounds[i + 1];
+    parts.push_back(utils::Async([begin, end, columns_num]() {
+      return detail::ParseRange<DType>(begin, end, columns_num);
+    }));
+  }
+
+  // ranges are joined in the file order
+  std::vector<TsvColumns<DType>> results;
+  size_t rows = 0;
+  for (auto& part : parts) {
+    results.push_back(utils::DefaultPool().Wait(part));
+    rows += results.back().rows();
+  }
+  TsvColumns<DType> result;
+  result.columns.resize(columns_num);
+  for (auto& column : result.columns)
+    column.reserve(rows);
+  for (auto& part : results) {
+    for (size_t c = 0; c < columns_num; ++c) {
+      result.columns[c].insert(result.columns[c].end(),
+                               part.columns[c].begin(), part.columns[c].end());
+    }
+    result.invalid_rows += part.invalid_rows;
+  }
+  return result;
+}
+
+}  // namespace utils
+
+#endif  // TSVLOADER_H
@@ -1,38 +1,410 @@
 #include "utils.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <stdexcept>
+#include <vector>
 
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace utils {
 
-bool DownloadFile(const std::string& url, const std::string& path) {
-  CURLcode ret{CURLE_OK};
+namespace {
+// FIPS 180-4 SHA-256
+class Sha256 {
+ public:
+  void Update(const unsigned char* data, size_t size) {
+    length_ += size;
+    while (size > 0) {
+      auto n = std::min(size, sizeof(block_) - block_size_);
+      std::copy(data, data + n, block_ + block_size_);
+      block_size_ += n;
+      data += n;
+      size -= n;
+      if (block_size_ == sizeof(block_)) {
+        Transform();
+        block_size_ = 0;
+      }
+    }
+  }
+
+  std::string HexDigest() {
+    const uint64_t bits = length_ * 8;
+    const unsigned char pad = 0x80;
+    Update(&pad, 1);
+    const unsigned char zero = 0;
+    while (block_size_ != 56)
+      Update(&zero, 1);
+    unsigned char size[8];
+    for (int i = 0; i < 8; ++i)
+      size[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    Update(size, 8);
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (auto h : state_) {
+      for (int shift = 28; shift >= 0; shift -= 4)
+        hex += digits[(h >> shift) & 0xf];
+    }
+    return hex;
+  }
+
+ private:
+  static uint32_t Rotate(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  void Transform() {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = static_cast<uint32_t>(block_[4 * i]) << 24 |
+             static_cast<uint32_t>(block_[4 * i + 1]) << 16 |
+             static_cast<uint32_t>(block_[4 * i + 2]) << 8 |
+             static_cast<uint32_t>(block_[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+      auto s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      auto s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    std::copy(state_, state_ + 8, v);
+    for (int i = 0; i < 64; ++i) {
+      auto s1 = Rotate(v[4], 6) ^ Rotate(v[4], 11) ^ Rotate(v[4], 25);
+      auto ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+      auto t1 = v[7] + s1 + ch + k[i] + w[i];
+      auto s0 = Rotate(v[0], 2) ^ Rotate(v[0], 13) ^ Rotate(v[0], 22);
+      auto maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+      std::copy_backward(v, v + 7, v + 8);
+      v[4] += t1;
+      v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; ++i)
+      state_[i] += v[i];
+  }
+
+  uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  unsigned char block_[64];
+  size_t block_size_{0};
+  uint64_t length_{0};
+};
+
+std::string StringSha256(const std::string& text) {
+  Sha256 sha;
+  sha.Update(reinterpret_cast<const unsigned char*>(text.data()), text.size());
+  return sha.HexDigest();
+}
+
+bool FileExists(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+// Hard link when the cache is on the same file system, a copy otherwise
+bool LinkOrCopy(const std::string& from, const std::string& to) {
+  unlink(to.c_str());
+  if (link(from.c_str(), to.c_str()) == 0)
+    return true;
+  FILE* in = fopen(from.c_str(), "rb");
+  if (in == nullptr)
+    return false;
+  auto tmp = to + ".tmp";
+  FILE* out = fopen(tmp.c_str(), "wb");
+  bool ok = out != nullptr;
+  std::vector<char> buffer(1 << 20);
+  size_t n = 0;
+  while (ok && (n = fread(buffer.data(), 1, buffer.size(), in)) > 0)
+    ok = fwrite(buffer.data(), 1, n, out) == n;
+  fclose(in);
+  if (out != nullptr)
+    ok = fclose(out) == 0 && ok;
+  ok = ok && rename(tmp.c_str(), to.c_str()) == 0;
+  if (!ok)
+    unlink(tmp.c_str());
+  return ok;
+}
+
+CURL* NewHandle(const std::string& url) {
   CURL* hnd = curl_easy_init();
   if (hnd != nullptr) {
-    FILE* fp = fopen(path.c_str(), "wb");
-    if (fp != nullptr) {
-      curl_easy_setopt(hnd, CURLOPT_URL, url.c_str());
-      curl_easy_setopt(hnd, CURLOPT_TCP_KEEPALIVE, 1L);
-      curl_easy_setopt(hnd, CURLOPT_TCP_KEEPIDLE, 15L);
-      curl_easy_setopt(hnd, CURLOPT_TCP_KEEPINTVL, 30L);
-      curl_easy_setopt(hnd, CURLOPT_FOLLOWLOCATION, 1L);
-      curl_easy_setopt(
-          hnd, CURLOPT_NOSIGNAL,
-          1);  // Prevent "longjmp causes uninitialized stack frame" bug
-      curl_easy_setopt(hnd, CURLOPT_ACCEPT_ENCODING, "deflate");
-      curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, nullptr);
-      curl_easy_setopt(hnd, CURLOPT_WRITEDATA, fp);
-      // curl_easy_setopt(hnd, CURLOPT_VERBOSE, 1L);
-      ret = curl_easy_perform(hnd);
-    } else {
-      ret = CURLE_FAILED_INIT;
+    curl_easy_setopt(hnd, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(hnd, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(hnd, CURLOPT_TCP_KEEPIDLE, 15L);
+    curl_easy_setopt(hnd, CURLOPT_TCP_KEEPINTVL, 30L);
+    curl_easy_setopt(hnd, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(
+        hnd, CURLOPT_NOSIGNAL,
+        1);  // Prevent "longjmp causes uninitialized stack frame" bug
+    curl_easy_setopt(hnd, CURLOPT_FAILONERROR, 1L);
+    // curl_easy_setopt(hnd, CURLOPT_VERBOSE, 1L);
+  }
+  return hnd;
+}
+
+// Size of the content, -1 when it's unknown or the server doesn't take
+// range requests
+curl_off_t RangedLength(const std::string& url) {
+  CURL* hnd = NewHandle(url);
+  if (hnd == nullptr)
+    return -1;
+  curl_off_t length = -1;
+  curl_easy_setopt(hnd, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(hnd, CURLOPT_RANGE, "0-0");
+  if (curl_easy_perform(hnd) == CURLE_OK) {
+    long code = 0;
+    curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &code);
+    // ask for the full size, the ranged response has the one of the range
+    curl_easy_setopt(hnd, CURLOPT_RANGE, nullptr);
+    if ((code == 206 || code == 0) && curl_easy_perform(hnd) == CURLE_OK)
+      curl_easy_getinfo(hnd, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+  }
+  curl_easy_cleanup(hnd);
+  return length;
+}
+
+struct Range {
+  int fd{-1};
+  curl_off_t offset{0};  // next byte to write
+  curl_off_t end{0};     // last byte
+  size_t index{0};
+  int attempts{0};
+};
+
+size_t WriteRange(char* data, size_t size, size_t nmemb, void* user) {
+  auto* range = static_cast<Range*>(user);
+  auto bytes = size * nmemb;
+  if (range->offset + static_cast<curl_off_t>(bytes) > range->end + 1)
+    return 0;  // the server sent more than asked, fail the transfer
+  auto written = pwrite(range->fd, data, bytes, range->offset);
+  if (written > 0)
+    range->offset += written;
+  return written < 0 ? 0 : static_cast<size_t>(written);
+}
+
+// Chunks of the file are requested by several connections, every finished
+// chunk is appended to the done file, so a restart asks only for the rest
+bool DownloadRanges(const std::string& url,
+                    const std::string& part_path,
+                    curl_off_t length,
+                    const DownloadOptions& options) {
+  const auto done_path = part_path + ".done";
+  const auto chunk =
+      static_cast<curl_off_t>(std::max<size_t>(options.chunk_size, 1));
+  const auto chunks = static_cast<size_t>((length + chunk - 1) / chunk);
+  std::vector<bool> done(chunks, false);
+  // the first line is the layout of the chunks, a file of another layout
+  // isn't continued
+  bool resume = false;
+  if (FileExists(part_path)) {
+    FILE* done_file = fopen(done_path.c_str(), "r");
+    long long done_length = 0;
+    long long done_chunk = 0;
+    resume = done_file != nullptr &&
+             fscanf(done_file, "%lld %lld", &done_length, &done_chunk) == 2 &&
+             done_length == length && done_chunk == chunk;
+    size_t index = 0;
+    while (resume && fscanf(done_file, "%zu", &index) == 1) {
+      if (index < chunks)
+        done[index] = true;
     }
-  } else {
+    if (done_file != nullptr)
+      fclose(done_file);
+  }
+
+  int fd = open(part_path.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+  FILE* done_file = fopen(done_path.c_str(), resume ? "a" : "w");
+  if (done_file == nullptr || ftruncate(fd, length) != 0) {
+    close(fd);
+    if (done_file != nullptr)
+      fclose(done_file);
+    return false;
+  }
+  if (!resume) {
+    fprintf(done_file, "%lld %lld\n", static_cast<long long>(length),
+            static_cast<long long>(chunk));
+    fflush(done_file);
+  }
+
+  std::vector<Range> ranges;
+  for (size_t i = 0; i < chunks; ++i) {
+    if (!done[i]) {
+      Range range;
+      range.fd = fd;
+      range.offset = static_cast<curl_off_t>(i) * chunk;
+      range.end = std::min(range.offset + chunk, length) - 1;
+      range.index = i;
+      ranges.push_back(range);
+    }
+  }
+
+  CURLM* multi = curl_multi_init();
+  size_t next = 0;
+  int active = 0;
+  bool ok = multi != nullptr;
+  auto start = [&](Range& range) {
+    CURL* hnd = NewHandle(url);
+    if (hnd == nullptr)
+      return false;
+    auto bounds =
+        std::to_string(range.offset) + "-" + std::to_string(range.end);
+    curl_easy_setopt(hnd, CURLOPT_RANGE, bounds.c_str());  // copied by curl
+    curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, WriteRange);
+    curl_easy_setopt(hnd, CURLOPT_WRITEDATA, &range);
+    curl_easy_setopt(hnd, CURLOPT_PRIVATE, &range);
+    ++range.attempts;
+    ++active;
+    return curl_multi_add_handle(multi, hnd) == CURLM_OK;
+  };
+  const auto connections = std::max<size_t>(options.connections, 1);
+  while (ok && next < ranges.size() &&
+         static_cast<size_t>(active) < connections)
+    ok = start(ranges[next++]);
+  while (ok && active > 0) {
+    int running = 0;
+    ok = curl_multi_perform(multi, &running) == CURLM_OK;
+    int messages = 0;
+    while (ok) {
+      CURLMsg* message = curl_multi_info_read(multi, &messages);
+      if (message == nullptr)
+        break;
+      if (message->msg != CURLMSG_DONE)
+        continue;
+      CURL* hnd = message->easy_handle;
+      Range* range = nullptr;
+      curl_easy_getinfo(hnd, CURLINFO_PRIVATE, &range);
+      long code = 0;
+      curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &code);
+      const bool complete = message->data.result == CURLE_OK &&
+                            (code == 206 || code == 0) &&
+                            range->offset == range->end + 1;
+      curl_multi_remove_handle(multi, hnd);
+      curl_easy_cleanup(hnd);
+      --active;
+      if (complete) {
+        fprintf(done_file, "%zu\n", range->index);
+        fflush(done_file);
+        if (next < ranges.size())
+          ok = start(ranges[next++]);
+      } else if (range->attempts < 3) {
+        ok = start(*range);  // continues from the last written byte
+      } else {
+        ok = false;
+      }
+    }
+    if (ok && active > 0)
+      ok = curl_multi_wait(multi, nullptr, 0, 1000, nullptr) == CURLM_OK;
+  }
+  if (multi != nullptr)
+    curl_multi_cleanup(multi);  // the easy handles are left only on errors
+  fclose(done_file);
+  ok = close(fd) == 0 && ok;
+  if (ok)
+    unlink(done_path.c_str());
+  return ok;
+}
+
+// Single connection, a partial file is continued from its end
+bool DownloadStream(const std::string& url, const std::string& part_path) {
+  CURLcode ret{CURLE_OK};
+  CURL* hnd = NewHandle(url);
+  if (hnd == nullptr)
     return false;
+  struct stat info;
+  curl_off_t offset = stat(part_path.c_str(), &info) == 0 ? info.st_size : 0;
+  FILE* fp = fopen(part_path.c_str(), offset > 0 ? "ab" : "wb");
+  if (fp != nullptr) {
+    curl_easy_setopt(hnd, CURLOPT_RESUME_FROM_LARGE, offset);
+    curl_easy_setopt(hnd, CURLOPT_ACCEPT_ENCODING, "deflate");
+    curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, nullptr);
+    curl_easy_setopt(hnd, CURLOPT_WRITEDATA, fp);
+    ret = curl_easy_perform(hnd);
+    if (fclose(fp) != 0 && ret == CURLE_OK)
+      ret = CURLE_WRITE_ERROR;
+  } else {
+    ret = CURLE_FAILED_INIT;
   }
   curl_easy_cleanup(hnd);
+  if (ret != CURLE_OK &&
+      (ret == CURLE_RANGE_ERROR || stat(part_path.c_str(), &info) != 0 ||
+       info.st_size == 0)) {
+    // the server can't resume, the next call starts from scratch
+    unlink(part_path.c_str());
+  }
   return ret == CURLE_OK;
 }
+}  // namespace
+
+std::string FileSha256(const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr)
+    return {};
+  Sha256 sha;
+  std::vector<unsigned char> buffer(1 << 20);
+  size_t n = 0;
+  while ((n = fread(buffer.data(), 1, buffer.size(), fp)) > 0)
+    sha.Update(buffer.data(), n);
+  bool failed = ferror(fp) != 0;
+  fclose(fp);
+  return failed ? std::string() : sha.HexDigest();
+}
+
+bool DownloadFile(const std::string& url,
+                  const std::string& path,
+                  const DownloadOptions& options) {
+  // The cache is content addressed when the checksum is known, otherwise the
+  // files are addressed by the url
+  std::string cache_dir = options.cache_dir;
+  if (cache_dir.empty()) {
+    const char* env = std::getenv("MLCPP_CACHE_DIR");
+    cache_dir = env != nullptr ? env : "";
+  }
+  std::string cache_path;
+  if (!cache_dir.empty()) {
+    mkdir(cache_dir.c_str(), 0755);
+    cache_path = cache_dir + "/" +
+                 (options.sha256.empty() ? StringSha256(url) : options.sha256);
+    if (FileExists(cache_path) &&
+        (options.sha256.empty() || FileSha256(cache_path) == options.sha256))
+      return LinkOrCopy(cache_path, path);
+  }
+
+  const auto part_path = path + ".part";
+  auto length = RangedLength(url);
+  bool ok = length > 0 ? DownloadRanges(url, part_path, length, options)
+                       : DownloadStream(url, part_path);
+  if (!ok)
+    return false;
+  if (!options.sha256.empty() && FileSha256(part_path) != options.sha256) {
+    unlink(part_path.c_str());  // corrupted, the next call starts again
+    return false;
+  }
+  if (rename(part_path.c_str(), path.c_str()) != 0)
+    return false;
+  if (!cache_path.empty())
+    LinkOrCopy(path, cache_path);  // the cache is optional, errors are ignored
+  return true;
+}
+
+bool DownloadFile(const std::string& url, const std::string& path) {
+  return DownloadFile(url, path, DownloadOptions());
+}
 }  // namespace utils
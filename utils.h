@@ -1,11 +1,30 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <cstddef>
 #include <string>
 
 namespace utils {
+struct DownloadOptions {
+  size_t connections{4};        // concurrent range requests
+  size_t chunk_size{8 << 20};   // bytes of one range request
+  std::string sha256;           // expected hex checksum, empty to skip
+  // cache shared by the samples, empty takes the MLCPP_CACHE_DIR environment
+  // variable, no cache when both are empty
+  std::string cache_dir;
+};
+
+// The file is downloaded to path.part with parallel range requests when the
+// server supports them and is renamed to path only when it's complete and
+// verified, so an interrupted download is resumed by the next call
+bool DownloadFile(const std::string& url,
+                  const std::string& path,
+                  const DownloadOptions& options);
 bool DownloadFile(const std::string& url, const std::string& path);
 
+// Hex SHA-256 of the file content, empty if it can't be read
+std::string FileSha256(const std::string& path);
+
 template <typename I>
 struct iter {
   iter(I iterator) : base_iterator(iterator), index(0) {}